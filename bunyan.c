@@ -19,6 +19,13 @@
 #include <limits.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#endif
 
 #include "bunyan.h"
 #include "debug.h"
@@ -32,14 +39,13 @@ static const char *bunyan_name = NULL;
  * a multithreaded context and used thread-locals here for bunyan_buf etc.
  *
  * Unfortunately, pivy would like to be portable to platforms that don't support
- * thread-local annotations on variables (looking at you OpenBSD), so we've
- * removed those annotations here (and the mutexes) but left the remainder of
- * the code as-is.
+ * thread-local annotations on variables (looking at you OpenBSD), so instead of
+ * __thread we keep the per-thread state (the frame stack and the formatting
+ * buffer) in a struct bunyan_stack hung off a pthread key. The list of all
+ * stacks and the actual write to stderr are protected by bunyan_mtx.
  *
- * As a result this version of bunyan.c is completely unsafe to use in the
- * face of multi-threading. This is fine within the pivy repo where all we have
- * is a couple of single-threaded commandline tools, but if you re-use this
- * code elsewhere, beware!
+ * pivy-agent runs its card operations on a separate thread from the main
+ * event loop, so this does need to be safe to call from more than one thread.
  */
 
 /*
@@ -49,10 +55,7 @@ static const char *bunyan_name = NULL;
  * portable to lots of other operating systems.
  */
 
-static char *bunyan_buf = NULL;
-static size_t bunyan_buf_sz = 0;
-
-static enum bunyan_log_level bunyan_min_level = BNY_WARN;
+enum bunyan_log_level _bunyan_min_level = BNY_WARN;
 static boolean_t bunyan_omit_timestamp = B_FALSE;
 
 struct bunyan_var {
@@ -81,35 +84,84 @@ struct bunyan_frame {
 struct bunyan_stack {
 	struct bunyan_stack *bs_next;
 	struct bunyan_frame *bs_top;
+	char *bs_buf;
+	size_t bs_buf_sz;
 };
 
-static struct bunyan_stack *thstack;
+static pthread_mutex_t bunyan_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t bunyan_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t bunyan_key;
 static struct bunyan_stack *bunyan_stacks;
 
+static void
+bunyan_stack_free(void *arg)
+{
+	struct bunyan_stack *stk = arg, **pstk;
+
+	VERIFY0(pthread_mutex_lock(&bunyan_mtx));
+	for (pstk = &bunyan_stacks; *pstk != NULL; pstk = &(*pstk)->bs_next) {
+		if (*pstk == stk) {
+			*pstk = stk->bs_next;
+			break;
+		}
+	}
+	VERIFY0(pthread_mutex_unlock(&bunyan_mtx));
+	free(stk->bs_buf);
+	free(stk);
+}
+
+static void
+bunyan_key_init(void)
+{
+	VERIFY0(pthread_key_create(&bunyan_key, bunyan_stack_free));
+}
+
+/* Returns the calling thread's stack, creating it if necessary. */
+static struct bunyan_stack *
+bunyan_thstack(void)
+{
+	struct bunyan_stack *stk;
+
+	VERIFY0(pthread_once(&bunyan_key_once, bunyan_key_init));
+	stk = pthread_getspecific(bunyan_key);
+	if (stk == NULL) {
+		stk = calloc(1, sizeof (struct bunyan_stack));
+		VERIFY(stk != NULL);
+		VERIFY0(pthread_setspecific(bunyan_key, stk));
+
+		VERIFY0(pthread_mutex_lock(&bunyan_mtx));
+		stk->bs_next = bunyan_stacks;
+		bunyan_stacks = stk;
+		VERIFY0(pthread_mutex_unlock(&bunyan_mtx));
+	}
+	return (stk);
+}
+
 void
 bunyan_set_level(enum bunyan_log_level level)
 {
-	bunyan_min_level = level;
+	_bunyan_min_level = level;
 }
 
 enum bunyan_log_level
 bunyan_get_level(void)
 {
-	return (bunyan_min_level);
+	return (_bunyan_min_level);
 }
 
 static void
 printf_buf(const char *fmt, ...)
 {
+	struct bunyan_stack *stk = bunyan_thstack();
 	size_t orig, avail;
 	int wrote;
 	char *nbuf;
 	va_list ap, ap2;
 
-	if (bunyan_buf_sz == 0) {
-		bunyan_buf_sz = 1024;
-		bunyan_buf = calloc(bunyan_buf_sz, 1);
-		VERIFY(bunyan_buf != NULL);
+	if (stk->bs_buf_sz == 0) {
+		stk->bs_buf_sz = 1024;
+		stk->bs_buf = calloc(stk->bs_buf_sz, 1);
+		VERIFY(stk->bs_buf != NULL);
 	}
 
 	va_start(ap, fmt);
@@ -117,22 +169,22 @@ printf_buf(const char *fmt, ...)
 	/* Make a backup copy of the args so we can try again if we resize. */
 	va_copy(ap2, ap);
 
-	orig = strlen(bunyan_buf);
-	avail = bunyan_buf_sz - orig;
+	orig = strlen(stk->bs_buf);
+	avail = stk->bs_buf_sz - orig;
 again:
-	wrote = vsnprintf(bunyan_buf + orig, avail, fmt, ap);
+	wrote = vsnprintf(stk->bs_buf + orig, avail, fmt, ap);
 	VERIFY(wrote >= 0);
 	if (wrote >= avail) {
-		while (bunyan_buf_sz < orig + wrote)
-			bunyan_buf_sz *= 2;
-		nbuf = calloc(bunyan_buf_sz, 1);
+		while (stk->bs_buf_sz < orig + wrote)
+			stk->bs_buf_sz *= 2;
+		nbuf = calloc(stk->bs_buf_sz, 1);
 		VERIFY(nbuf != NULL);
-		bcopy(bunyan_buf, nbuf, orig);
+		bcopy(stk->bs_buf, nbuf, orig);
 		nbuf[orig] = 0;
-		free(bunyan_buf);
-		bunyan_buf = nbuf;
+		free(stk->bs_buf);
+		stk->bs_buf = nbuf;
 
-		avail = bunyan_buf_sz - orig;
+		avail = stk->bs_buf_sz - orig;
 		va_end(ap);
 		va_copy(ap, ap2);
 		goto again;
@@ -144,8 +196,9 @@ again:
 static void
 reset_buf(void)
 {
-	if (bunyan_buf_sz > 0)
-		bunyan_buf[0] = 0;
+	struct bunyan_stack *stk = bunyan_thstack();
+	if (stk->bs_buf_sz > 0)
+		stk->bs_buf[0] = 0;
 }
 
 #if defined(__linux__)
@@ -224,6 +277,315 @@ bunyan_timestamp(char *buffer, size_t len)
 	VERIFY(w < MAX_TS_LEN);
 }
 
+/*
+ * The async sink (see bunyan_set_async()): finished lines are copied into a
+ * ring of records under bunyan_mtx, and a writer thread takes them out and
+ * does the actual (possibly slow) write. Logging threads never wait on the
+ * writer: if there isn't space for a line we drop it and count it, and the
+ * writer reports the count once it catches up.
+ *
+ * Records are 8-byte aligned and never wrap around the end of the ring; if
+ * one won't fit at the end we put a wrap marker there and start again at the
+ * front.
+ */
+struct bunyan_rec {
+	uint32_t	br_len;
+	uint32_t	br_level;
+};
+
+#define	BR_WRAP		UINT32_MAX
+#define	BR_ALIGN(x)	(((x) + 7) & ~((size_t)7))
+#define	BR_DEFAULT_SIZE	(64 * 1024)
+#define	BR_FLUSH_SECS	2
+
+struct bunyan_ring {
+	pthread_t	 br_thread;
+	pthread_cond_t	 br_cv;		/* new records or drops */
+	pthread_cond_t	 br_drained;	/* ring emptied */
+	uint8_t		*br_buf;
+	size_t		 br_size;
+	size_t		 br_head;	/* where the next record goes */
+	size_t		 br_tail;	/* next record to write out */
+	size_t		 br_used;	/* including wrap padding */
+	boolean_t	 br_busy;	/* writer has a record out */
+	uint64_t	 br_drops;
+	int		 br_jfd;	/* native journald socket, or -1 */
+};
+
+/* Protected by bunyan_mtx. */
+static struct bunyan_ring *bunyan_ring = NULL;
+
+/* Must be called with bunyan_mtx held. */
+static boolean_t
+bunyan_ring_put(struct bunyan_ring *r, enum bunyan_log_level level,
+    const char *line, size_t len)
+{
+	const size_t need = BR_ALIGN(sizeof (struct bunyan_rec) + len);
+	struct bunyan_rec *rec;
+	size_t pad = 0;
+
+	if (r->br_used == 0)
+		r->br_head = r->br_tail = 0;
+	if (r->br_size - r->br_head < need)
+		pad = r->br_size - r->br_head;
+	if (need + pad > r->br_size - r->br_used)
+		return (B_FALSE);
+	if (pad > 0) {
+		rec = (struct bunyan_rec *)&r->br_buf[r->br_head];
+		rec->br_len = BR_WRAP;
+		r->br_used += pad;
+		r->br_head = 0;
+	}
+	rec = (struct bunyan_rec *)&r->br_buf[r->br_head];
+	rec->br_len = len;
+	rec->br_level = level;
+	bcopy(line, rec + 1, len);
+	r->br_head += need;
+	if (r->br_head == r->br_size)
+		r->br_head = 0;
+	r->br_used += need;
+	return (B_TRUE);
+}
+
+#if defined(__linux__)
+#define	JOURNALD_SOCKET		"/run/systemd/journal/socket"
+
+/*
+ * Sends one line to journald in its native protocol, so that it gets
+ * a proper PRIORITY and SYSLOG_IDENTIFIER. The MESSAGE uses the binary-safe
+ * form (name, newline, little-endian 64-bit length, data) since our lines
+ * often contain more newlines (for errf chains).
+ */
+static boolean_t
+bunyan_journald_send(int fd, enum bunyan_log_level level, const char *line,
+    size_t len)
+{
+	char hdr[256];
+	uint8_t mlen[8];
+	struct iovec iov[4];
+	int prio, w;
+	uint i;
+
+	if (level >= BNY_FATAL)
+		prio = 2;
+	else if (level >= BNY_ERROR)
+		prio = 3;
+	else if (level >= BNY_WARN)
+		prio = 4;
+	else if (level >= BNY_INFO)
+		prio = 6;
+	else
+		prio = 7;
+
+	if (len > 0 && line[len - 1] == '\n')
+		--len;
+
+	w = snprintf(hdr, sizeof (hdr), "PRIORITY=%d\nSYSLOG_IDENTIFIER=%s\n"
+	    "MESSAGE\n", prio, (bunyan_name == NULL) ? "pivy" : bunyan_name);
+	if (w < 0 || w >= sizeof (hdr))
+		return (B_FALSE);
+	for (i = 0; i < sizeof (mlen); ++i)
+		mlen[i] = ((uint64_t)len >> (8 * i)) & 0xff;
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = w;
+	iov[1].iov_base = mlen;
+	iov[1].iov_len = sizeof (mlen);
+	iov[2].iov_base = (void *)line;
+	iov[2].iov_len = len;
+	iov[3].iov_base = "\n";
+	iov[3].iov_len = 1;
+
+	return (writev(fd, iov, 4) >= 0);
+}
+
+static int
+bunyan_journald_open(void)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return (-1);
+	bzero(&sun, sizeof (sun));
+	sun.sun_family = AF_UNIX;
+	strlcpy(sun.sun_path, JOURNALD_SOCKET, sizeof (sun.sun_path));
+	if (connect(fd, (struct sockaddr *)&sun, sizeof (sun)) != 0) {
+		close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+#endif /* defined (__linux__) */
+
+static void
+bunyan_write_out(struct bunyan_ring *r, enum bunyan_log_level level,
+    const char *line, size_t len)
+{
+	ssize_t w;
+
+#if defined(__linux__)
+	if (r->br_jfd != -1 && bunyan_journald_send(r->br_jfd, level, line,
+	    len)) {
+		return;
+	}
+#endif
+	while (len > 0) {
+		w = write(STDERR_FILENO, line, len);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return;
+		line += w;
+		len -= w;
+	}
+}
+
+static void *
+bunyan_writer(void *arg)
+{
+	struct bunyan_ring *r = arg;
+	struct bunyan_rec *rec;
+	char time[MAX_TS_LEN];
+	char msg[MAX_TS_LEN + 128];
+	uint64_t drops;
+	size_t need;
+	int w;
+
+	VERIFY0(pthread_mutex_lock(&bunyan_mtx));
+	while (1) {
+		while (r->br_used == 0 && r->br_drops == 0)
+			VERIFY0(pthread_cond_wait(&r->br_cv, &bunyan_mtx));
+
+		if (r->br_used == 0) {
+			drops = r->br_drops;
+			r->br_drops = 0;
+			r->br_busy = B_TRUE;
+			VERIFY0(pthread_mutex_unlock(&bunyan_mtx));
+
+			time[0] = '\0';
+			if (!bunyan_omit_timestamp) {
+				bunyan_timestamp(time, sizeof (time) - 3);
+				strlcat(time, "] ", sizeof (time));
+			}
+			w = snprintf(msg, sizeof (msg), "%s%sWARN: dropped %llu "
+			    "log lines (output not keeping up)\n",
+			    bunyan_omit_timestamp ? "" : "[", time,
+			    (unsigned long long)drops);
+			if (w > 0 && w < sizeof (msg))
+				bunyan_write_out(r, BNY_WARN, msg, w);
+
+			VERIFY0(pthread_mutex_lock(&bunyan_mtx));
+			r->br_busy = B_FALSE;
+			continue;
+		}
+
+		rec = (struct bunyan_rec *)&r->br_buf[r->br_tail];
+		if (rec->br_len == BR_WRAP) {
+			r->br_used -= r->br_size - r->br_tail;
+			r->br_tail = 0;
+			continue;
+		}
+		need = BR_ALIGN(sizeof (struct bunyan_rec) + rec->br_len);
+
+		/* Producers leave this record alone until we release it. */
+		r->br_busy = B_TRUE;
+		VERIFY0(pthread_mutex_unlock(&bunyan_mtx));
+		bunyan_write_out(r, rec->br_level, (const char *)(rec + 1),
+		    rec->br_len);
+		VERIFY0(pthread_mutex_lock(&bunyan_mtx));
+		r->br_busy = B_FALSE;
+
+		r->br_tail += need;
+		if (r->br_tail == r->br_size)
+			r->br_tail = 0;
+		r->br_used -= need;
+		if (r->br_used == 0)
+			VERIFY0(pthread_cond_broadcast(&r->br_drained));
+	}
+	/* NOTREACHED */
+	return (NULL);
+}
+
+void
+bunyan_flush(void)
+{
+	struct bunyan_ring *r;
+	struct timespec deadline;
+
+	VERIFY0(pthread_mutex_lock(&bunyan_mtx));
+	r = bunyan_ring;
+	if (r == NULL) {
+		VERIFY0(pthread_mutex_unlock(&bunyan_mtx));
+		fflush(stderr);
+		return;
+	}
+	VERIFY0(clock_gettime(CLOCK_REALTIME, &deadline));
+	deadline.tv_sec += BR_FLUSH_SECS;
+	while (r->br_used > 0 || r->br_busy) {
+		if (pthread_cond_timedwait(&r->br_drained, &bunyan_mtx,
+		    &deadline) == ETIMEDOUT) {
+			break;
+		}
+	}
+	VERIFY0(pthread_mutex_unlock(&bunyan_mtx));
+}
+
+errf_t *
+bunyan_set_async(size_t bufsz)
+{
+	struct bunyan_ring *r;
+	int rc;
+
+	VERIFY0(pthread_mutex_lock(&bunyan_mtx));
+	if (bunyan_ring != NULL) {
+		VERIFY0(pthread_mutex_unlock(&bunyan_mtx));
+		return (ERRF_OK);
+	}
+	VERIFY0(pthread_mutex_unlock(&bunyan_mtx));
+
+	if (bufsz == 0)
+		bufsz = BR_DEFAULT_SIZE;
+	bufsz = BR_ALIGN(bufsz);
+
+	r = calloc(1, sizeof (struct bunyan_ring));
+	if (r == NULL)
+		return (ERRF_NOMEM);
+	r->br_size = bufsz;
+	r->br_buf = malloc(bufsz);
+	if (r->br_buf == NULL) {
+		free(r);
+		return (ERRF_NOMEM);
+	}
+	r->br_jfd = -1;
+#if defined(__linux__)
+	if (bunyan_detect_journald())
+		r->br_jfd = bunyan_journald_open();
+#endif
+	VERIFY0(pthread_cond_init(&r->br_cv, NULL));
+	VERIFY0(pthread_cond_init(&r->br_drained, NULL));
+
+	rc = pthread_create(&r->br_thread, NULL, bunyan_writer, r);
+	if (rc != 0) {
+		VERIFY0(pthread_cond_destroy(&r->br_cv));
+		VERIFY0(pthread_cond_destroy(&r->br_drained));
+		if (r->br_jfd != -1)
+			close(r->br_jfd);
+		free(r->br_buf);
+		free(r);
+		return (errfno("pthread_create", rc, NULL));
+	}
+	VERIFY0(pthread_detach(r->br_thread));
+
+	VERIFY0(pthread_mutex_lock(&bunyan_mtx));
+	bunyan_ring = r;
+	VERIFY0(pthread_mutex_unlock(&bunyan_mtx));
+
+	(void) atexit(bunyan_flush);
+	return (ERRF_OK);
+}
+
 static void
 bunyan_add_vars_p(struct bunyan_frame *frame, va_list ap)
 {
@@ -296,6 +658,7 @@ _bunyan_push(const char *func, ...)
 {
 	va_list ap;
 	struct bunyan_frame *frame;
+	struct bunyan_stack *thstack;
 
 	frame = calloc(1, sizeof (struct bunyan_frame));
 	VERIFY(frame != NULL);
@@ -305,12 +668,7 @@ _bunyan_push(const char *func, ...)
 	bunyan_add_vars_p(frame, ap);
 	va_end(ap);
 
-	if (thstack == NULL) {
-		thstack = calloc(1, sizeof (struct bunyan_stack));
-		VERIFY(thstack != NULL);
-		thstack->bs_next = bunyan_stacks;
-		bunyan_stacks = thstack;
-	}
+	thstack = bunyan_thstack();
 
 	frame->bf_next = thstack->bs_top;
 	thstack->bs_top = frame;
@@ -322,8 +680,8 @@ void
 bunyan_pop(struct bunyan_frame *frame)
 {
 	struct bunyan_var *var, *nvar;
+	struct bunyan_stack *thstack = bunyan_thstack();
 	VERIFY(frame != NULL);
-	VERIFY(thstack != NULL);
 	VERIFY(thstack->bs_top == frame);
 	thstack->bs_top = frame->bf_next;
 
@@ -395,7 +753,7 @@ print_frame(struct bunyan_frame *frame, uint *pn, struct bunyan_var **evars)
 }
 
 void
-bunyan_log(enum bunyan_log_level level, const char *msg, ...)
+_bunyan_log(enum bunyan_log_level level, const char *msg, ...)
 {
 	va_list ap;
 	const char *propname;
@@ -404,6 +762,11 @@ bunyan_log(enum bunyan_log_level level, const char *msg, ...)
 	uint n = 0;
 	struct bunyan_frame *frame;
 	struct bunyan_var *evars = NULL, *evar, *nevar;
+	struct bunyan_stack *thstack;
+
+	if (level < _bunyan_min_level)
+		return;
+	thstack = bunyan_thstack();
 
 	reset_buf();
 
@@ -437,11 +800,9 @@ bunyan_log(enum bunyan_log_level level, const char *msg, ...)
 
 	printf_buf("%s", msg);
 
-	if (thstack != NULL) {
-		frame = thstack->bs_top;
-		for (; frame != NULL; frame = frame->bf_next) {
-			print_frame(frame, &n, &evars);
-		}
+	frame = thstack->bs_top;
+	for (; frame != NULL; frame = frame->bf_next) {
+		print_frame(frame, &n, &evars);
 	}
 
 	va_start(ap, msg);
@@ -528,8 +889,19 @@ bunyan_log(enum bunyan_log_level level, const char *msg, ...)
 		free(evar);
 	}
 
-	if (level < bunyan_min_level) {
-		return;
+	VERIFY0(pthread_mutex_lock(&bunyan_mtx));
+	if (bunyan_ring == NULL) {
+		fprintf(stderr, "%s", thstack->bs_buf);
+	} else if (bunyan_ring_put(bunyan_ring, level, thstack->bs_buf,
+	    strlen(thstack->bs_buf))) {
+		VERIFY0(pthread_cond_signal(&bunyan_ring->br_cv));
+	} else {
+		++bunyan_ring->br_drops;
+		VERIFY0(pthread_cond_signal(&bunyan_ring->br_cv));
 	}
-	fprintf(stderr, "%s", bunyan_buf);
+	VERIFY0(pthread_mutex_unlock(&bunyan_mtx));
+
+	/* Whoever logs a FATAL is probably about to exit or abort. */
+	if (level >= BNY_FATAL)
+		bunyan_flush();
 }
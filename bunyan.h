@@ -36,12 +36,50 @@ void bunyan_init(void);
 void bunyan_unshare(void);
 void bunyan_set_name(const char *name);
 void bunyan_set_level(enum bunyan_log_level level);
+
+/*
+ * Makes bunyan_log() queue finished lines in a ring buffer of bufsz bytes
+ * (0 for the default) and write them out from a separate thread, so that
+ * logging never blocks on a slow stderr. If the ring is full, lines are
+ * dropped (and counted) rather than waiting. When stderr is connected to
+ * journald, lines are sent using its native protocol instead.
+ *
+ * Threads don't survive fork(), so call this after any daemonising.
+ */
+MUST_CHECK
+errf_t *bunyan_set_async(size_t bufsz);
+
+/*
+ * Waits (for a bounded time) for any queued lines to be written out. This is
+ * called automatically at exit and after any FATAL line.
+ */
+void bunyan_flush(void);
 enum bunyan_log_level bunyan_get_level(void);
-void bunyan_log(enum bunyan_log_level level, const char *msg, ...);
+void _bunyan_log(enum bunyan_log_level level, const char *msg, ...);
 struct bunyan_frame *_bunyan_push(const char *func, ...);
 void bunyan_add_vars(struct bunyan_frame *frame, ...);
 void bunyan_pop(struct bunyan_frame *frame);
 
 #define	bunyan_push(...)	_bunyan_push(__func__, __VA_ARGS__)
 
+/*
+ * Log sites below BUNYAN_MIN_LEVEL are compiled out entirely (e.g. build with
+ * BUNYAN_MIN_LEVEL=30 to drop all the TRACE and DEBUG lines). Sites below the
+ * level set at runtime with bunyan_set_level() cost one comparison: bunyan_log
+ * is a macro so that we check the level before evaluating any of the args.
+ */
+#if !defined(BUNYAN_MIN_LEVEL)
+#define	BUNYAN_MIN_LEVEL	BNY_TRACE
+#endif
+
+extern enum bunyan_log_level _bunyan_min_level;
+
+#define	bunyan_log_enabled(level)	\
+	((level) >= BUNYAN_MIN_LEVEL && (level) >= _bunyan_min_level)
+
+#define	bunyan_log(level, ...)	do {			\
+	if (bunyan_log_enabled(level))			\
+		_bunyan_log((level), __VA_ARGS__);	\
+	} while (0)
+
 #endif
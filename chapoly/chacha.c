@@ -6,6 +6,19 @@ Public domain.
 
 #include "chacha.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define CHACHA_SSE2
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define CHACHA_AVX2
+#endif
+#if defined(__aarch64__) && !defined(__ARM_BIG_ENDIAN)
+#include <arm_neon.h>
+#define CHACHA_NEON
+#endif
+
 /* $OpenBSD: chacha.c,v 1.1 2013/11/21 00:45:44 djm Exp $ */
 
 typedef unsigned char u8;
@@ -84,8 +97,8 @@ chacha_ivsetup(chacha_ctx *x, const u8 *iv, const u8 *counter)
   x->input[15] = U8TO32_LITTLE(iv + 4);
 }
 
-void
-chacha_encrypt_bytes(chacha_ctx *x,const u8 *m,u8 *c,u32 bytes)
+static void
+chacha_encrypt_bytes_ref(chacha_ctx *x,const u8 *m,u8 *c,u32 bytes)
 {
   u32 x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14, x15;
   u32 j0, j1, j2, j3, j4, j5, j6, j7, j8, j9, j10, j11, j12, j13, j14, j15;
@@ -215,3 +228,342 @@ chacha_encrypt_bytes(chacha_ctx *x,const u8 *m,u8 *c,u32 bytes)
     m += 64;
   }
 }
+
+/*
+ * Vectorised ChaCha20 kernels: these run 4 (SSE2, NEON) or 8 (AVX2) blocks
+ * at once, with each of the 16 state words in its own vector register and
+ * one block per lane, then transpose the results back into block order
+ * before XORing them into the output.
+ *
+ * Each kernel only does whole batches, and stops early rather than let the
+ * 32-bit block counter in input[12] wrap part-way through one: the caller
+ * finishes off whatever is left with the scalar code above.
+ */
+
+#define QUARTERROUND_V(a,b,c,d) \
+  a = VADD(a,b); d = VROT16(VXOR(d,a)); \
+  c = VADD(c,d); b = VROT12(VXOR(b,c)); \
+  a = VADD(a,b); d = VROT8(VXOR(d,a)); \
+  c = VADD(c,d); b = VROT7(VXOR(b,c));
+
+#define DOUBLEROUND_V() \
+  QUARTERROUND_V( x0, x4, x8,x12) \
+  QUARTERROUND_V( x1, x5, x9,x13) \
+  QUARTERROUND_V( x2, x6,x10,x14) \
+  QUARTERROUND_V( x3, x7,x11,x15) \
+  QUARTERROUND_V( x0, x5,x10,x15) \
+  QUARTERROUND_V( x1, x6,x11,x12) \
+  QUARTERROUND_V( x2, x7, x8,x13) \
+  QUARTERROUND_V( x3, x4, x9,x14)
+
+#define ROUNDS_V() \
+  x0 = j0; x1 = j1; x2 = j2; x3 = j3; \
+  x4 = j4; x5 = j5; x6 = j6; x7 = j7; \
+  x8 = j8; x9 = j9; x10 = j10; x11 = j11; \
+  x12 = j12; x13 = j13; x14 = j14; x15 = j15; \
+  for (i = 20;i > 0;i -= 2) { \
+    DOUBLEROUND_V() \
+  } \
+  x0 = VADD(x0,j0); x1 = VADD(x1,j1); x2 = VADD(x2,j2); x3 = VADD(x3,j3); \
+  x4 = VADD(x4,j4); x5 = VADD(x5,j5); x6 = VADD(x6,j6); x7 = VADD(x7,j7); \
+  x8 = VADD(x8,j8); x9 = VADD(x9,j9); x10 = VADD(x10,j10); \
+  x11 = VADD(x11,j11); x12 = VADD(x12,j12); x13 = VADD(x13,j13); \
+  x14 = VADD(x14,j14); x15 = VADD(x15,j15);
+
+/* Steps the 64-bit block counter on by n blocks (n never wraps input[12]) */
+#define STEP_COUNTER(x, n) \
+  do { \
+    (x)->input[12] += (n); \
+    if (!(x)->input[12]) \
+      (x)->input[13] = PLUSONE((x)->input[13]); \
+  } while (0)
+
+#if defined(CHACHA_SSE2)
+
+#define VADD(v,w) _mm_add_epi32((v),(w))
+#define VXOR(v,w) _mm_xor_si128((v),(w))
+#define VROTL(v,n) \
+  _mm_or_si128(_mm_slli_epi32((v),(n)), _mm_srli_epi32((v),32 - (n)))
+#define VROT16(v) _mm_shufflehi_epi16(_mm_shufflelo_epi16((v),0xb1),0xb1)
+#define VROT12(v) VROTL(v,12)
+#define VROT8(v) VROTL(v,8)
+#define VROT7(v) VROTL(v,7)
+
+/*
+ * Transposes words w..w+3 of the 4 blocks in a..d and XORs them into bytes
+ * 4*w..4*w+15 of each block.
+ */
+#define OUTPUT4_SSE2(a,b,c_,d,w) \
+  do { \
+    __m128i t0 = _mm_unpacklo_epi32(a,b), t1 = _mm_unpacklo_epi32(c_,d); \
+    __m128i t2 = _mm_unpackhi_epi32(a,b), t3 = _mm_unpackhi_epi32(c_,d); \
+    a = _mm_unpacklo_epi64(t0,t1); b = _mm_unpackhi_epi64(t0,t1); \
+    c_ = _mm_unpacklo_epi64(t2,t3); d = _mm_unpackhi_epi64(t2,t3); \
+    OUTPUT1_SSE2(a, 0, w); OUTPUT1_SSE2(b, 1, w); \
+    OUTPUT1_SSE2(c_, 2, w); OUTPUT1_SSE2(d, 3, w); \
+  } while (0)
+#define OUTPUT1_SSE2(v,blk,w) \
+  _mm_storeu_si128((__m128i *)(c + 64*(blk) + 4*(w)), VXOR((v), \
+      _mm_loadu_si128((const __m128i *)(m + 64*(blk) + 4*(w)))))
+
+static u32
+chacha_blocks_sse2(chacha_ctx *x,const u8 *m,u8 *c,u32 blocks)
+{
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14, x15;
+  __m128i j0, j1, j2, j3, j4, j5, j6, j7, j8, j9, j10, j11, j12, j13, j14, j15;
+  u32 done = 0;
+  u_int i;
+
+  j0 = _mm_set1_epi32(x->input[0]);
+  j1 = _mm_set1_epi32(x->input[1]);
+  j2 = _mm_set1_epi32(x->input[2]);
+  j3 = _mm_set1_epi32(x->input[3]);
+  j4 = _mm_set1_epi32(x->input[4]);
+  j5 = _mm_set1_epi32(x->input[5]);
+  j6 = _mm_set1_epi32(x->input[6]);
+  j7 = _mm_set1_epi32(x->input[7]);
+  j8 = _mm_set1_epi32(x->input[8]);
+  j9 = _mm_set1_epi32(x->input[9]);
+  j10 = _mm_set1_epi32(x->input[10]);
+  j11 = _mm_set1_epi32(x->input[11]);
+  j14 = _mm_set1_epi32(x->input[14]);
+  j15 = _mm_set1_epi32(x->input[15]);
+
+  while (blocks - done >= 4 && x->input[12] <= U32C(0xFFFFFFFF) - 3) {
+    j12 = VADD(_mm_set1_epi32(x->input[12]), _mm_set_epi32(3, 2, 1, 0));
+    j13 = _mm_set1_epi32(x->input[13]);
+
+    ROUNDS_V()
+
+    OUTPUT4_SSE2(x0, x1, x2, x3, 0);
+    OUTPUT4_SSE2(x4, x5, x6, x7, 4);
+    OUTPUT4_SSE2(x8, x9, x10, x11, 8);
+    OUTPUT4_SSE2(x12, x13, x14, x15, 12);
+
+    STEP_COUNTER(x, 4);
+    done += 4;
+    m += 256;
+    c += 256;
+  }
+  return done;
+}
+
+#undef VADD
+#undef VXOR
+#undef VROTL
+#undef VROT16
+#undef VROT12
+#undef VROT8
+#undef VROT7
+
+#endif /* CHACHA_SSE2 */
+
+#if defined(CHACHA_AVX2)
+
+#define VADD(v,w) _mm256_add_epi32((v),(w))
+#define VXOR(v,w) _mm256_xor_si256((v),(w))
+#define VROTL(v,n) \
+  _mm256_or_si256(_mm256_slli_epi32((v),(n)), _mm256_srli_epi32((v),32 - (n)))
+#define VROT16(v) _mm256_shuffle_epi8((v),rot16)
+#define VROT12(v) VROTL(v,12)
+#define VROT8(v) _mm256_shuffle_epi8((v),rot8)
+#define VROT7(v) VROTL(v,7)
+
+/*
+ * As OUTPUT4_SSE2, but each 128-bit half of a..d holds 4 blocks (0-3 and
+ * 4-7), and the halves of a (say) for words w..w+3 get paired up with the
+ * ones in e for words w+4..w+7 to make 32 bytes of each block.
+ */
+#define TRANSPOSE4_AVX2(a,b,c_,d) \
+  do { \
+    __m256i t0 = _mm256_unpacklo_epi32(a,b), t1 = _mm256_unpacklo_epi32(c_,d); \
+    __m256i t2 = _mm256_unpackhi_epi32(a,b), t3 = _mm256_unpackhi_epi32(c_,d); \
+    a = _mm256_unpacklo_epi64(t0,t1); b = _mm256_unpackhi_epi64(t0,t1); \
+    c_ = _mm256_unpacklo_epi64(t2,t3); d = _mm256_unpackhi_epi64(t2,t3); \
+  } while (0)
+#define OUTPUT2_AVX2(v,w,blk,off) \
+  do { \
+    __m256i lo = _mm256_permute2x128_si256((v),(w),0x20); \
+    __m256i hi = _mm256_permute2x128_si256((v),(w),0x31); \
+    OUTPUT1_AVX2(lo, (blk), (off)); \
+    OUTPUT1_AVX2(hi, (blk) + 4, (off)); \
+  } while (0)
+#define OUTPUT1_AVX2(v,blk,off) \
+  _mm256_storeu_si256((__m256i *)(c + 64*(blk) + (off)), VXOR((v), \
+      _mm256_loadu_si256((const __m256i *)(m + 64*(blk) + (off)))))
+#define OUTPUT8_AVX2(a,b,c_,d,e,f,g,h,off) \
+  do { \
+    TRANSPOSE4_AVX2(a,b,c_,d); \
+    TRANSPOSE4_AVX2(e,f,g,h); \
+    OUTPUT2_AVX2(a, e, 0, (off)); \
+    OUTPUT2_AVX2(b, f, 1, (off)); \
+    OUTPUT2_AVX2(c_, g, 2, (off)); \
+    OUTPUT2_AVX2(d, h, 3, (off)); \
+  } while (0)
+
+__attribute__((target("avx2")))
+static u32
+chacha_blocks_avx2(chacha_ctx *x,const u8 *m,u8 *c,u32 blocks)
+{
+  __m256i x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14, x15;
+  __m256i j0, j1, j2, j3, j4, j5, j6, j7, j8, j9, j10, j11, j12, j13, j14, j15;
+  __m256i rot16, rot8;
+  u32 done = 0;
+  u_int i;
+
+  rot16 = _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6,
+      1, 0, 3, 2, 13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+  rot8 = _mm256_set_epi8(14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7,
+      2, 1, 0, 3, 14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+
+  j0 = _mm256_set1_epi32(x->input[0]);
+  j1 = _mm256_set1_epi32(x->input[1]);
+  j2 = _mm256_set1_epi32(x->input[2]);
+  j3 = _mm256_set1_epi32(x->input[3]);
+  j4 = _mm256_set1_epi32(x->input[4]);
+  j5 = _mm256_set1_epi32(x->input[5]);
+  j6 = _mm256_set1_epi32(x->input[6]);
+  j7 = _mm256_set1_epi32(x->input[7]);
+  j8 = _mm256_set1_epi32(x->input[8]);
+  j9 = _mm256_set1_epi32(x->input[9]);
+  j10 = _mm256_set1_epi32(x->input[10]);
+  j11 = _mm256_set1_epi32(x->input[11]);
+  j14 = _mm256_set1_epi32(x->input[14]);
+  j15 = _mm256_set1_epi32(x->input[15]);
+
+  while (blocks - done >= 8 && x->input[12] <= U32C(0xFFFFFFFF) - 7) {
+    j12 = VADD(_mm256_set1_epi32(x->input[12]),
+        _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+    j13 = _mm256_set1_epi32(x->input[13]);
+
+    ROUNDS_V()
+
+    OUTPUT8_AVX2(x0, x1, x2, x3, x4, x5, x6, x7, 0);
+    OUTPUT8_AVX2(x8, x9, x10, x11, x12, x13, x14, x15, 32);
+
+    STEP_COUNTER(x, 8);
+    done += 8;
+    m += 512;
+    c += 512;
+  }
+  return done;
+}
+
+#undef VADD
+#undef VXOR
+#undef VROTL
+#undef VROT16
+#undef VROT12
+#undef VROT8
+#undef VROT7
+
+static int
+chacha_have_avx2(void)
+{
+  static int have = -1;
+  if (have == -1)
+    have = __builtin_cpu_supports("avx2") ? 1 : 0;
+  return have;
+}
+
+#endif /* CHACHA_AVX2 */
+
+#if defined(CHACHA_NEON)
+
+#define VADD(v,w) vaddq_u32((v),(w))
+#define VXOR(v,w) veorq_u32((v),(w))
+#define VROTL(v,n) vsriq_n_u32(vshlq_n_u32((v),(n)),(v),32 - (n))
+#define VROT16(v) vreinterpretq_u32_u16(vrev32q_u16(vreinterpretq_u16_u32(v)))
+#define VROT12(v) VROTL(v,12)
+#define VROT8(v) VROTL(v,8)
+#define VROT7(v) VROTL(v,7)
+
+#define OUTPUT4_NEON(a,b,c_,d,w) \
+  do { \
+    uint32x4x2_t t01 = vtrnq_u32(a,b), t23 = vtrnq_u32(c_,d); \
+    OUTPUT1_NEON(vcombine_u32(vget_low_u32(t01.val[0]), \
+        vget_low_u32(t23.val[0])), 0, w); \
+    OUTPUT1_NEON(vcombine_u32(vget_low_u32(t01.val[1]), \
+        vget_low_u32(t23.val[1])), 1, w); \
+    OUTPUT1_NEON(vcombine_u32(vget_high_u32(t01.val[0]), \
+        vget_high_u32(t23.val[0])), 2, w); \
+    OUTPUT1_NEON(vcombine_u32(vget_high_u32(t01.val[1]), \
+        vget_high_u32(t23.val[1])), 3, w); \
+  } while (0)
+#define OUTPUT1_NEON(v,blk,w) \
+  vst1q_u8(c + 64*(blk) + 4*(w), veorq_u8(vreinterpretq_u8_u32(v), \
+      vld1q_u8(m + 64*(blk) + 4*(w))))
+
+static u32
+chacha_blocks_neon(chacha_ctx *x,const u8 *m,u8 *c,u32 blocks)
+{
+  uint32x4_t x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14;
+  uint32x4_t x15;
+  uint32x4_t j0, j1, j2, j3, j4, j5, j6, j7, j8, j9, j10, j11, j12, j13, j14;
+  uint32x4_t j15;
+  static const u32 lanes[4] = { 0, 1, 2, 3 };
+  u32 done = 0;
+  u_int i;
+
+  j0 = vdupq_n_u32(x->input[0]);
+  j1 = vdupq_n_u32(x->input[1]);
+  j2 = vdupq_n_u32(x->input[2]);
+  j3 = vdupq_n_u32(x->input[3]);
+  j4 = vdupq_n_u32(x->input[4]);
+  j5 = vdupq_n_u32(x->input[5]);
+  j6 = vdupq_n_u32(x->input[6]);
+  j7 = vdupq_n_u32(x->input[7]);
+  j8 = vdupq_n_u32(x->input[8]);
+  j9 = vdupq_n_u32(x->input[9]);
+  j10 = vdupq_n_u32(x->input[10]);
+  j11 = vdupq_n_u32(x->input[11]);
+  j14 = vdupq_n_u32(x->input[14]);
+  j15 = vdupq_n_u32(x->input[15]);
+
+  while (blocks - done >= 4 && x->input[12] <= U32C(0xFFFFFFFF) - 3) {
+    j12 = VADD(vdupq_n_u32(x->input[12]), vld1q_u32(lanes));
+    j13 = vdupq_n_u32(x->input[13]);
+
+    ROUNDS_V()
+
+    OUTPUT4_NEON(x0, x1, x2, x3, 0);
+    OUTPUT4_NEON(x4, x5, x6, x7, 4);
+    OUTPUT4_NEON(x8, x9, x10, x11, 8);
+    OUTPUT4_NEON(x12, x13, x14, x15, 12);
+
+    STEP_COUNTER(x, 4);
+    done += 4;
+    m += 256;
+    c += 256;
+  }
+  return done;
+}
+
+#undef VADD
+#undef VXOR
+#undef VROTL
+#undef VROT16
+#undef VROT12
+#undef VROT8
+#undef VROT7
+
+#endif /* CHACHA_NEON */
+
+void
+chacha_encrypt_bytes(chacha_ctx *x,const u8 *m,u8 *c,u32 bytes)
+{
+  u32 blocks = bytes / 64, done = 0;
+
+#if defined(CHACHA_AVX2)
+  if (blocks >= 8 && chacha_have_avx2())
+    done += chacha_blocks_avx2(x, m, c, blocks);
+#endif
+#if defined(CHACHA_SSE2)
+  done += chacha_blocks_sse2(x, m + 64*done, c + 64*done, blocks - done);
+#endif
+#if defined(CHACHA_NEON)
+  done += chacha_blocks_neon(x, m, c, blocks);
+#endif
+
+  chacha_encrypt_bytes_ref(x, m + 64*done, c + 64*done, bytes - 64*done);
+}
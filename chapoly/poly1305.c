@@ -27,6 +27,180 @@
 		(p)[3] = (uint8_t)((v) >> 24); \
 	} while (0)
 
+#if defined(__SIZEOF_INT128__)
+
+/*
+ * poly1305-donna-64: the same algorithm on three 44/44/42-bit limbs with
+ * 64x64->128 bit multiplies, which needs a third of the multiplies of the
+ * 32-bit version below. Long messages are done two blocks at a time, as
+ * h = (h + m[i]) * r^2 + m[i+1] * r, so that the two products don't have to
+ * wait for each other.
+ */
+
+typedef unsigned __int128 uint128_t;
+
+#define mul64x64_128(a,b) ((uint128_t)(a) * (b))
+
+#define U8TO64_LE(p) \
+	(((uint64_t)U8TO32_LE(p)) | ((uint64_t)U8TO32_LE((p) + 4) << 32))
+
+#define U64TO8_LE(p, v) \
+	do { \
+		U32TO8_LE((p), (uint32_t)(v)); \
+		U32TO8_LE((p) + 4, (uint32_t)((v) >> 32)); \
+	} while (0)
+
+/* Splits a 16-byte block (plus hibit) into 44/44/42-bit limbs */
+#define POLY1305_LOAD(p, l0, l1, l2, hibit) \
+	do { \
+		uint64_t _t0 = U8TO64_LE((p)+0); \
+		uint64_t _t1 = U8TO64_LE((p)+8); \
+		l0 = (( _t0                      ) & 0xfffffffffffULL); \
+		l1 = (((_t0 >> 44) | (_t1 << 20)) & 0xfffffffffffULL); \
+		l2 = (((_t1 >> 24)               ) & 0x3ffffffffffULL) | (hibit); \
+	} while (0)
+
+/* d = a * b mod 2^130-5, with sb1 = b1 * 20 and sb2 = b2 * 20 */
+#define POLY1305_MUL(d0, d1, d2, a0, a1, a2, b0, b1, b2, sb1, sb2) \
+	do { \
+		d0 = mul64x64_128(a0,b0) + mul64x64_128(a1,sb2) + mul64x64_128(a2,sb1); \
+		d1 = mul64x64_128(a0,b1) + mul64x64_128(a1,b0) + mul64x64_128(a2,sb2); \
+		d2 = mul64x64_128(a0,b2) + mul64x64_128(a1,b1) + mul64x64_128(a2,b0); \
+	} while (0)
+
+/* Carries d back down into h */
+#define POLY1305_CARRY(h0, h1, h2, d0, d1, d2) \
+	do { \
+		uint64_t _c; \
+		             _c = (uint64_t)(d0 >> 44); h0 = (uint64_t)d0 & 0xfffffffffffULL; \
+		d1 += _c;    _c = (uint64_t)(d1 >> 44); h1 = (uint64_t)d1 & 0xfffffffffffULL; \
+		d2 += _c;    _c = (uint64_t)(d2 >> 42); h2 = (uint64_t)d2 & 0x3ffffffffffULL; \
+		h0 += _c * 5; _c = (h0 >> 44);           h0 =           h0 & 0xfffffffffffULL; \
+		h1 += _c; \
+	} while (0)
+
+void
+poly1305_auth(unsigned char out[POLY1305_TAGLEN], const unsigned char *m, size_t inlen, const unsigned char key[POLY1305_KEYLEN]) {
+	uint64_t t0,t1;
+	uint64_t h0,h1,h2;
+	uint64_t r0,r1,r2;
+	uint64_t s1,s2;
+	uint64_t q0,q1,q2;
+	uint64_t u1,u2;
+	uint64_t m0,m1,m2;
+	uint64_t g0,g1,g2;
+	uint64_t c;
+	uint128_t d0,d1,d2,e0,e1,e2;
+	unsigned char mp[16];
+	size_t j;
+
+	/* clamp key */
+	t0 = U8TO64_LE(key+0);
+	t1 = U8TO64_LE(key+8);
+
+	/* precompute multipliers */
+	r0 = ( t0                    ) & 0xffc0fffffffULL;
+	r1 = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffffULL;
+	r2 = ((t1 >> 24)             ) & 0x00ffffffc0fULL;
+
+	s1 = r1 * (5 << 2);
+	s2 = r2 * (5 << 2);
+
+	/* init state */
+	h0 = 0;
+	h1 = 0;
+	h2 = 0;
+
+	if (inlen >= 64) {
+		/* q = r^2 */
+		POLY1305_MUL(d0, d1, d2, r0, r1, r2, r0, r1, r2, s1, s2);
+		POLY1305_CARRY(q0, q1, q2, d0, d1, d2);
+		u1 = q1 * (5 << 2);
+		u2 = q2 * (5 << 2);
+
+		while (inlen >= 32) {
+			POLY1305_LOAD(m, m0, m1, m2, 1ULL << 40);
+			h0 += m0;
+			h1 += m1;
+			h2 += m2;
+			POLY1305_LOAD(m+16, m0, m1, m2, 1ULL << 40);
+			POLY1305_MUL(d0, d1, d2, h0, h1, h2, q0, q1, q2, u1, u2);
+			POLY1305_MUL(e0, e1, e2, m0, m1, m2, r0, r1, r2, s1, s2);
+			d0 += e0;
+			d1 += e1;
+			d2 += e2;
+			POLY1305_CARRY(h0, h1, h2, d0, d1, d2);
+			m += 32;
+			inlen -= 32;
+		}
+	}
+
+	/* full blocks */
+	while (inlen >= 16) {
+		POLY1305_LOAD(m, m0, m1, m2, 1ULL << 40);
+		h0 += m0;
+		h1 += m1;
+		h2 += m2;
+		POLY1305_MUL(d0, d1, d2, h0, h1, h2, r0, r1, r2, s1, s2);
+		POLY1305_CARRY(h0, h1, h2, d0, d1, d2);
+		m += 16;
+		inlen -= 16;
+	}
+
+	/* final bytes */
+	if (inlen) {
+		for (j = 0; j < inlen; j++) mp[j] = m[j];
+		mp[j++] = 1;
+		for (; j < 16; j++)	mp[j] = 0;
+
+		POLY1305_LOAD(mp, m0, m1, m2, 0);
+		h0 += m0;
+		h1 += m1;
+		h2 += m2;
+		POLY1305_MUL(d0, d1, d2, h0, h1, h2, r0, r1, r2, s1, s2);
+		POLY1305_CARRY(h0, h1, h2, d0, d1, d2);
+	}
+
+	/* fully carry h */
+	             c = (h1 >> 44); h1 &= 0xfffffffffffULL;
+	h2 +=     c; c = (h2 >> 42); h2 &= 0x3ffffffffffULL;
+	h0 += c * 5; c = (h0 >> 44); h0 &= 0xfffffffffffULL;
+	h1 +=     c; c = (h1 >> 44); h1 &= 0xfffffffffffULL;
+	h2 +=     c; c = (h2 >> 42); h2 &= 0x3ffffffffffULL;
+	h0 += c * 5; c = (h0 >> 44); h0 &= 0xfffffffffffULL;
+	h1 +=     c;
+
+	/* compute h + -p */
+	g0 = h0 + 5; c = (g0 >> 44); g0 &= 0xfffffffffffULL;
+	g1 = h1 + c; c = (g1 >> 44); g1 &= 0xfffffffffffULL;
+	g2 = h2 + c - (1ULL << 42);
+
+	/* select h if h < p, or h + -p if h >= p */
+	c = (g2 >> 63) - 1;
+	g0 &= c;
+	g1 &= c;
+	g2 &= c;
+	c = ~c;
+	h0 = (h0 & c) | g0;
+	h1 = (h1 & c) | g1;
+	h2 = (h2 & c) | g2;
+
+	/* h = (h + pad) % 2^128 */
+	t0 = U8TO64_LE(&key[16]);
+	t1 = U8TO64_LE(&key[24]);
+	h0 += (( t0                    ) & 0xfffffffffffULL)    ; c = (h0 >> 44); h0 &= 0xfffffffffffULL;
+	h1 += (((t0 >> 44) | (t1 << 20)) & 0xfffffffffffULL) + c; c = (h1 >> 44); h1 &= 0xfffffffffffULL;
+	h2 += (((t1 >> 24)             ) & 0x3ffffffffffULL) + c;                 h2 &= 0x3ffffffffffULL;
+
+	h0 = ((h0      ) | (h1 << 44));
+	h1 = ((h1 >> 20) | (h2 << 24));
+
+	U64TO8_LE(&out[0], h0);
+	U64TO8_LE(&out[8], h1);
+}
+
+#else /* !__SIZEOF_INT128__ */
+
 void
 poly1305_auth(unsigned char out[POLY1305_TAGLEN], const unsigned char *m, size_t inlen, const unsigned char key[POLY1305_KEYLEN]) {
 	uint32_t t0,t1,t2,t3;
@@ -155,3 +329,5 @@ poly1305_donna_finish:
 	U32TO8_LE(&out[ 8], f2); f3 += (f2 >> 32);
 	U32TO8_LE(&out[12], f3);
 }
+
+#endif /* __SIZEOF_INT128__ */
@@ -20,6 +20,7 @@
 #include <strings.h>
 #include <limits.h>
 #include <err.h>
+#include <pthread.h>
 
 #if defined(__APPLE__)
 #include <PCSC/wintypes.h>
@@ -360,11 +361,166 @@ out:
 	return (err);
 }
 
+/* Flag for ebox-unlock@joyent.com: don't open recovery config parts. */
+#define	EBOX_UNLOCK_F_PRIMARY	(1 << 0)
+
+errf_t *
+local_unlock_agent_ebox(struct ebox *ebox, boolean_t primary_only,
+    struct ebox_config **pconfig)
+{
+	struct ebox_config *config, *primary = NULL;
+	struct ebox_part *part;
+	struct piv_ecdh_box *rebox = NULL;
+	struct sshkey *temp = NULL, *temppub = NULL;
+	errf_t *err;
+	int rc;
+	uint i, j;
+	uint32_t n, k, ci, pi;
+	uint8_t code;
+	struct sshbuf *req = NULL, *buf = NULL, *eboxbuf = NULL, *reply = NULL;
+	struct sshbuf *boxbuf = NULL, *datab = NULL;
+
+	*pconfig = NULL;
+
+	rc = sshkey_generate(KEY_ECDSA, 256, &temp);
+	if (rc) {
+		err = ssherrf("sshkey_generate", rc);
+		goto out;
+	}
+	if ((rc = sshkey_demote(temp, &temppub))) {
+		err = ssherrf("sshkey_demote", rc);
+		goto out;
+	}
+
+	req = sshbuf_new();
+	reply = sshbuf_new();
+	buf = sshbuf_new();
+	eboxbuf = sshbuf_new();
+	if (req == NULL || reply == NULL || buf == NULL || eboxbuf == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+
+	if ((rc = sshbuf_put_u8(req, SSH2_AGENTC_EXTENSION)) ||
+	    (rc = sshbuf_put_cstring(req, "ebox-unlock@joyent.com"))) {
+		err = ssherrf("sshbuf_put_cstring", rc);
+		goto out;
+	}
+	if ((err = sshbuf_put_ebox(eboxbuf, ebox)))
+		goto out;
+	if ((rc = sshbuf_put_stringb(buf, eboxbuf)) ||
+	    (rc = sshkey_puts(temppub, buf)) ||
+	    (rc = sshbuf_put_u32(buf, primary_only ?
+	    EBOX_UNLOCK_F_PRIMARY : 0)) ||
+	    (rc = sshbuf_put_stringb(req, buf))) {
+		err = ssherrf("sshbuf_put_stringb", rc);
+		goto out;
+	}
+
+	rc = ssh_request_reply(ebox_authfd, req, reply);
+	if (rc) {
+		err = ssherrf("ssh_request_reply", rc);
+		goto out;
+	}
+
+	if ((rc = sshbuf_get_u8(reply, &code))) {
+		err = ssherrf("sshbuf_get_u8", rc);
+		goto out;
+	}
+	if (code != SSH_AGENT_SUCCESS) {
+		err = errf("SSHAgentError", NULL, "SSH agent returned "
+		    "message code %d to ebox unlock request", (int)code);
+		goto out;
+	}
+	if ((rc = sshbuf_get_u32(reply, &n))) {
+		err = ssherrf("sshbuf_get_u32", rc);
+		goto out;
+	}
+
+	for (k = 0; k < n; ++k) {
+		if ((rc = sshbuf_get_u32(reply, &ci)) ||
+		    (rc = sshbuf_get_u32(reply, &pi)) ||
+		    (rc = sshbuf_froms(reply, &boxbuf))) {
+			err = ssherrf("sshbuf_get_u32", rc);
+			goto out;
+		}
+
+		config = NULL;
+		for (i = 0; (config = ebox_next_config(ebox, config)) != NULL &&
+		    i < ci; ++i)
+			;
+		part = NULL;
+		for (j = 0; config != NULL &&
+		    (part = ebox_config_next_part(config, part)) != NULL &&
+		    j < pi; ++j)
+			;
+		if (part == NULL) {
+			err = errf("SSHAgentError", NULL, "SSH agent returned "
+			    "a box for config %u part %u, which don't exist",
+			    ci, pi);
+			goto out;
+		}
+
+		if ((err = sshbuf_get_piv_box(boxbuf, &rebox)))
+			goto out;
+		if ((err = piv_box_open_offline(temp, rebox)))
+			goto out;
+		if ((err = piv_box_take_datab(rebox, &datab)))
+			goto out;
+		if ((err = piv_box_set_datab(ebox_part_box(part), datab)))
+			goto out;
+
+		if (primary == NULL && ebox_tpl_config_type(
+		    ebox_config_tpl(config)) == EBOX_PRIMARY)
+			primary = config;
+
+		piv_box_free(rebox);
+		rebox = NULL;
+		sshbuf_free(datab);
+		datab = NULL;
+		sshbuf_free(boxbuf);
+		boxbuf = NULL;
+	}
+
+	*pconfig = primary;
+	err = ERRF_OK;
+
+out:
+	sshbuf_free(req);
+	sshbuf_free(reply);
+	sshbuf_free(buf);
+	sshbuf_free(eboxbuf);
+	sshbuf_free(boxbuf);
+	sshbuf_free(datab);
+
+	sshkey_free(temp);
+	sshkey_free(temppub);
+
+	piv_box_free(rebox);
+	return (err);
+}
+
+static void
+ebox_ctx_setup(void)
+{
+	int rc;
+
+	if (ebox_ctx_init)
+		return;
+	rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &ebox_ctx);
+	if (rc != SCARD_S_SUCCESS) {
+		errfx(EXIT_ERROR, pcscerrf("SCardEstablishContext", rc),
+		    "failed to initialise libpcsc");
+	}
+	piv_set_lazy_probe(B_TRUE);
+	piv_use_reader_cache(NULL);
+	ebox_ctx_init = B_TRUE;
+}
+
 errf_t *
 local_unlock(struct piv_ecdh_box *box, struct sshkey *cak, const char *name)
 {
 	errf_t *err, *agerr = NULL;
-	int rc;
 	struct piv_slot *slot, *cakslot;
 	struct piv_token *tokens = NULL, *token;
 
@@ -383,14 +539,7 @@ local_unlock(struct piv_ecdh_box *box, struct sshkey *cak, const char *name)
 		    "and slot information, can't unlock with local hardware"));
 	}
 
-	if (!ebox_ctx_init) {
-		rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL,
-		    &ebox_ctx);
-		if (rc != SCARD_S_SUCCESS) {
-			errfx(EXIT_ERROR, pcscerrf("SCardEstablishContext", rc),
-			    "failed to initialise libpcsc");
-		}
-	}
+	ebox_ctx_setup();
 
 	err = piv_find(ebox_ctx, piv_box_guid(box), GUID_LEN, &tokens);
 	if (errf_caused_by(err, "NotFoundError")) {
@@ -467,6 +616,606 @@ out:
 	return (err);
 }
 
+errf_t *
+local_unlock_many(struct piv_ecdh_box **boxes, size_t n, const char *name)
+{
+	errf_t *err;
+	struct piv_token *tokens = NULL, *token;
+	struct piv_token **btoken = NULL;
+	struct piv_slot **bslot = NULL;
+	struct piv_token_index *idx = NULL;
+	boolean_t prompt;
+	size_t i, j;
+
+	for (i = 0; i < n; ++i) {
+		if (!piv_box_has_guidslot(boxes[i])) {
+			return (errf("NoGUIDSlot", NULL, "box %zu does not "
+			    "have GUID and slot information, can't unlock "
+			    "with local hardware", i));
+		}
+	}
+
+	btoken = calloc(n, sizeof (struct piv_token *));
+	bslot = calloc(n, sizeof (struct piv_slot *));
+	if (btoken == NULL || bslot == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+
+	ebox_ctx_setup();
+	if ((err = piv_enumerate(ebox_ctx, &tokens)))
+		goto out;
+	if ((err = piv_token_index_new(tokens, &idx)))
+		goto out;
+	for (i = 0; i < n; ++i) {
+		err = piv_token_index_find_box(idx, boxes[i], &btoken[i],
+		    &bslot[i]);
+		if (err) {
+			err = errf("LocalUnlockError", err, "failed to find "
+			    "token with GUID %s and key for box %zu",
+			    piv_box_guid_hex(boxes[i]), i);
+			goto out;
+		}
+	}
+
+	/* Now open all the boxes for each token in one go. */
+	for (i = 0; i < n; ++i) {
+		token = btoken[i];
+		if (token == NULL)
+			continue;
+		if ((err = piv_txn_begin(token)))
+			goto out;
+		if ((err = piv_select(token))) {
+			piv_txn_end(token);
+			goto out;
+		}
+		prompt = B_FALSE;
+		assert_pin(token, name, prompt);
+		for (j = i; j < n; ++j) {
+			if (btoken[j] != token)
+				continue;
+			err = piv_box_open(token, bslot[j], boxes[j]);
+			if (errf_caused_by(err, "PermissionError") &&
+			    !prompt && !ebox_batch) {
+				errf_free(err);
+				prompt = B_TRUE;
+				assert_pin(token, name, prompt);
+				err = piv_box_open(token, bslot[j], boxes[j]);
+			}
+			if (err) {
+				piv_txn_end(token);
+				err = errf("LocalUnlockError", err, "failed "
+				    "to unlock box %zu", j);
+				goto out;
+			}
+			btoken[j] = NULL;
+		}
+		piv_txn_end(token);
+	}
+	err = ERRF_OK;
+
+out:
+	piv_token_index_free(idx);
+	piv_release(tokens);
+	free(btoken);
+	free(bslot);
+	return (err);
+}
+
+errf_t *
+local_unlock_batch(struct unlock_batch_item *items, size_t n)
+{
+	errf_t *err;
+	struct piv_token *tokens = NULL, *token;
+	struct piv_token **btoken = NULL;
+	struct piv_slot **bslot = NULL, *cakslot;
+	struct piv_token_index *idx = NULL;
+	struct unlock_batch_item *item;
+	struct sshkey *okcak;
+	boolean_t *gopen = NULL;
+	boolean_t prompt, pinned, dead, intxn;
+	size_t i, j, ngroups = 0;
+
+	for (i = 0; i < n; ++i) {
+		items[i].ubi_err = ERRF_OK;
+		items[i].ubi_opened = B_FALSE;
+		if (items[i].ubi_group >= ngroups)
+			ngroups = items[i].ubi_group + 1;
+	}
+
+	btoken = calloc(n, sizeof (struct piv_token *));
+	bslot = calloc(n, sizeof (struct piv_slot *));
+	gopen = calloc(ngroups, sizeof (boolean_t));
+	if ((n > 0 && (btoken == NULL || bslot == NULL)) ||
+	    (ngroups > 0 && gopen == NULL)) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+
+	ebox_ctx_setup();
+	if ((err = piv_enumerate(ebox_ctx, &tokens)))
+		goto out;
+	if ((err = piv_token_index_new(tokens, &idx)))
+		goto out;
+	for (i = 0; i < n; ++i) {
+		item = &items[i];
+		if (!piv_box_has_guidslot(item->ubi_box)) {
+			item->ubi_err = errf("NoGUIDSlot", NULL, "box does "
+			    "not have GUID and slot information, can't "
+			    "unlock with local hardware");
+			continue;
+		}
+		err = piv_token_index_find_box(idx, item->ubi_box, &btoken[i],
+		    &bslot[i]);
+		if (err) {
+			item->ubi_err = errf("LocalUnlockError", err, "failed "
+			    "to find token with GUID %s and key for box",
+			    piv_box_guid_hex(item->ubi_box));
+			btoken[i] = NULL;
+		}
+	}
+	err = ERRF_OK;
+
+	/*
+	 * Take each token in turn and open everything it can in one
+	 * transaction. A box whose group has already been opened by an
+	 * earlier token is left alone. Once a token refuses us (bad CAK,
+	 * PIN trouble, a dropped card) we give up on the rest of its boxes
+	 * rather than keep poking at it.
+	 */
+	for (i = 0; i < n; ++i) {
+		token = btoken[i];
+		if (token == NULL)
+			continue;
+		if ((err = piv_txn_begin(token)) == ERRF_OK &&
+		    (err = piv_select(token)) != ERRF_OK)
+			piv_txn_end(token);
+		if (err) {
+			items[i].ubi_err = errf("LocalUnlockError", err,
+			    "failed to open token %s",
+			    piv_box_guid_hex(items[i].ubi_box));
+			err = ERRF_OK;
+			dead = B_TRUE;
+			intxn = B_FALSE;
+		} else {
+			dead = B_FALSE;
+			intxn = B_TRUE;
+		}
+		okcak = NULL;
+		pinned = B_FALSE;
+		prompt = B_FALSE;
+		for (j = i; j < n; ++j) {
+			if (btoken[j] != token)
+				continue;
+			btoken[j] = NULL;
+			item = &items[j];
+			if (gopen[item->ubi_group])
+				continue;
+			if (dead) {
+				if (item->ubi_err == ERRF_OK) {
+					item->ubi_err = errf("LocalUnlockError",
+					    NULL, "token %s was unusable",
+					    piv_box_guid_hex(item->ubi_box));
+				}
+				continue;
+			}
+			if (item->ubi_cak != NULL && (okcak == NULL ||
+			    !sshkey_equal_public(okcak, item->ubi_cak))) {
+				cakslot = piv_get_slot(token,
+				    PIV_SLOT_CARD_AUTH);
+				if (cakslot == NULL &&
+				    (err = piv_read_cert(token,
+				    PIV_SLOT_CARD_AUTH)) == ERRF_OK) {
+					cakslot = piv_get_slot(token,
+					    PIV_SLOT_CARD_AUTH);
+				}
+				if (err == ERRF_OK && cakslot == NULL) {
+					err = errf("NotFoundError", NULL,
+					    "token has no CAK");
+				}
+				if (err == ERRF_OK) {
+					err = piv_auth_key(token, cakslot,
+					    item->ubi_cak);
+				}
+				if (err) {
+					item->ubi_err = errf(
+					    "CardAuthenticationError", err,
+					    "Failed to validate CAK");
+					err = ERRF_OK;
+					dead = B_TRUE;
+					continue;
+				}
+				okcak = item->ubi_cak;
+			}
+			if (!pinned) {
+				assert_pin(token, item->ubi_name, prompt);
+				pinned = B_TRUE;
+			}
+			err = piv_box_open(token, bslot[j], item->ubi_box);
+			if (errf_caused_by(err, "PermissionError") &&
+			    !prompt && !ebox_batch) {
+				errf_free(err);
+				prompt = B_TRUE;
+				assert_pin(token, item->ubi_name, prompt);
+				err = piv_box_open(token, bslot[j],
+				    item->ubi_box);
+			}
+			if (err) {
+				if (errf_caused_by(err, "PermissionError"))
+					dead = B_TRUE;
+				item->ubi_err = errf("LocalUnlockError", err,
+				    "failed to unlock box");
+				err = ERRF_OK;
+				continue;
+			}
+			item->ubi_opened = B_TRUE;
+			gopen[item->ubi_group] = B_TRUE;
+		}
+		if (intxn)
+			piv_txn_end(token);
+	}
+
+	/* Failures in a group that opened some other way are just noise. */
+	for (i = 0; i < n; ++i) {
+		if (gopen[items[i].ubi_group]) {
+			errf_free(items[i].ubi_err);
+			items[i].ubi_err = ERRF_OK;
+		}
+	}
+
+out:
+	piv_token_index_free(idx);
+	piv_release(tokens);
+	free(btoken);
+	free(bslot);
+	free(gopen);
+	return (err);
+}
+
+/*
+ * State for local_unlock_primary(). Each token we found a box for gets a
+ * worker thread, which tries all the boxes for that token (on clones of
+ * them, so the ebox itself is only touched by the caller). The set is shared
+ * by the caller and all the workers, and freed by whoever is last out, so that
+ * the caller can return as soon as one box opens and leave the stragglers
+ * to clean up after themselves (like piv_find() does with its probes).
+ */
+struct unlock_attempt {
+	struct unlock_set	*ua_set;
+	struct ebox_config	*ua_config;	/* caller only */
+	struct piv_ecdh_box	*ua_box;
+	struct sshkey		*ua_cak;
+	struct piv_token	*ua_token;
+	struct piv_slot		*ua_slot;
+	errf_t			*ua_err;
+	boolean_t		 ua_done;
+};
+
+struct unlock_set {
+	pthread_mutex_t		 us_mtx;
+	pthread_cond_t		 us_cv;
+	uint			 us_refs;
+	uint			 us_running;
+	boolean_t		 us_won;
+	char			*us_pin;
+	struct piv_token	*us_tokens;
+	uint			 us_nattempts;
+	struct unlock_attempt	*us_attempts;
+};
+
+/* Must be called with us_mtx held, and drops it. */
+static void
+unlock_set_rele(struct unlock_set *us)
+{
+	struct unlock_attempt *ua;
+	uint i;
+
+	VERIFY(us->us_refs > 0);
+	if (--us->us_refs > 0) {
+		VERIFY0(pthread_mutex_unlock(&us->us_mtx));
+		return;
+	}
+	VERIFY0(pthread_mutex_unlock(&us->us_mtx));
+	for (i = 0; i < us->us_nattempts; ++i) {
+		ua = &us->us_attempts[i];
+		piv_box_free(ua->ua_box);
+		sshkey_free(ua->ua_cak);
+		errf_free(ua->ua_err);
+	}
+	piv_release(us->us_tokens);
+	if (us->us_pin != NULL)
+		freezero(us->us_pin, strlen(us->us_pin));
+	VERIFY0(pthread_mutex_destroy(&us->us_mtx));
+	VERIFY0(pthread_cond_destroy(&us->us_cv));
+	free(us->us_attempts);
+	free(us);
+}
+
+/*
+ * The non-interactive part of local_unlock(): we never prompt for a PIN
+ * here, only use the one we already have (if any). Anything that needs more
+ * than that is left for local_unlock() to retry.
+ */
+static errf_t *
+unlock_attempt_run(struct unlock_attempt *ua)
+{
+	struct piv_token *tk = ua->ua_token;
+	struct piv_slot *cakslot;
+	const char *pin = ua->ua_set->us_pin;
+	uint retries;
+	errf_t *err;
+
+	if ((err = piv_txn_begin(tk)))
+		return (err);
+	if ((err = piv_select(tk)))
+		goto out;
+
+	if (ua->ua_cak != NULL) {
+		cakslot = piv_get_slot(tk, PIV_SLOT_CARD_AUTH);
+		if (cakslot == NULL) {
+			err = piv_read_cert(tk, PIV_SLOT_CARD_AUTH);
+			if (err) {
+				err = errf("CardAuthenticationError", err,
+				    "Failed to validate CAK");
+				goto out;
+			}
+			cakslot = piv_get_slot(tk, PIV_SLOT_CARD_AUTH);
+		}
+		if (cakslot == NULL) {
+			err = errf("CardAuthenticationError", NULL,
+			    "Failed to validate CAK");
+			goto out;
+		}
+		err = piv_auth_key(tk, cakslot, ua->ua_cak);
+		if (err) {
+			err = errf("CardAuthenticationError", err,
+			    "Failed to validate CAK");
+			goto out;
+		}
+	}
+
+	if (pin != NULL) {
+		retries = ebox_min_retries;
+		err = piv_verify_pin(tk, piv_token_default_auth(tk), pin,
+		    &retries, B_FALSE);
+		if (err)
+			goto out;
+	}
+
+	err = piv_box_open(tk, ua->ua_slot, ua->ua_box);
+
+out:
+	piv_txn_end(tk);
+	return (err);
+}
+
+static void *
+unlock_worker(void *arg)
+{
+	struct unlock_attempt *first = arg, *ua;
+	struct unlock_set *us = first->ua_set;
+	errf_t *err;
+	boolean_t won;
+	uint i;
+
+	for (i = 0; i < us->us_nattempts; ++i) {
+		ua = &us->us_attempts[i];
+		if (ua->ua_token != first->ua_token)
+			continue;
+
+		VERIFY0(pthread_mutex_lock(&us->us_mtx));
+		won = us->us_won;
+		VERIFY0(pthread_mutex_unlock(&us->us_mtx));
+		if (won)
+			break;
+
+		err = unlock_attempt_run(ua);
+		if (err) {
+			bunyan_log(BNY_DEBUG, "concurrent unlock attempt failed",
+			    "guid", BNY_STRING, piv_token_guid_hex(ua->ua_token),
+			    "error", BNY_ERF, err, NULL);
+		}
+
+		VERIFY0(pthread_mutex_lock(&us->us_mtx));
+		ua->ua_err = err;
+		ua->ua_done = B_TRUE;
+		if (err == ERRF_OK)
+			us->us_won = B_TRUE;
+		VERIFY0(pthread_cond_broadcast(&us->us_cv));
+		VERIFY0(pthread_mutex_unlock(&us->us_mtx));
+	}
+
+	VERIFY0(pthread_mutex_lock(&us->us_mtx));
+	--us->us_running;
+	VERIFY0(pthread_cond_broadcast(&us->us_cv));
+	unlock_set_rele(us);
+	return (NULL);
+}
+
+errf_t *
+local_unlock_primary(struct ebox *ebox, struct ebox_config **pconfig)
+{
+	struct ebox_config *config;
+	struct ebox_part *part;
+	struct ebox_tpl_part *tpart;
+	struct piv_ecdh_box *box;
+	struct unlock_set *us;
+	struct unlock_attempt *ua, *winner = NULL;
+	struct piv_token_index *idx = NULL;
+	struct sshkey *cak;
+	struct sshbuf *datab = NULL;
+	pthread_t thr;
+	errf_t *err;
+	uint i, j, n = 0;
+
+	config = NULL;
+	while ((config = ebox_next_config(ebox, config)) != NULL) {
+		if (ebox_tpl_config_type(ebox_config_tpl(config)) ==
+		    EBOX_PRIMARY)
+			++n;
+	}
+	if (n == 0) {
+		return (errf("NotFoundError", NULL, "ebox has no primary "
+		    "configs"));
+	}
+
+	if (ssh_get_authentication_socket(&ebox_authfd) != -1) {
+		/*
+		 * If no primary config opens, have the agent go on to the
+		 * recovery parts in the same request, so that
+		 * interactive_recovery() doesn't need to ask for them.
+		 */
+		err = local_unlock_agent_ebox(ebox, B_FALSE, &config);
+		if (err == ERRF_OK && config != NULL) {
+			*pconfig = config;
+			return (ERRF_OK);
+		}
+		errf_free(err);
+
+		/* Older agents only know how to do one part at a time. */
+		config = NULL;
+		while ((config = ebox_next_config(ebox, config)) != NULL) {
+			if (ebox_tpl_config_type(ebox_config_tpl(config)) !=
+			    EBOX_PRIMARY)
+				continue;
+			part = ebox_config_next_part(config, NULL);
+			err = local_unlock_agent(ebox_part_box(part));
+			if (err == ERRF_OK) {
+				*pconfig = config;
+				return (ERRF_OK);
+			}
+			errf_free(err);
+		}
+	}
+
+	us = calloc(1, sizeof (*us));
+	if (us == NULL)
+		return (ERRF_NOMEM);
+	us->us_attempts = calloc(n, sizeof (struct unlock_attempt));
+	if (us->us_attempts == NULL) {
+		free(us);
+		return (ERRF_NOMEM);
+	}
+	VERIFY0(pthread_mutex_init(&us->us_mtx, NULL));
+	VERIFY0(pthread_cond_init(&us->us_cv, NULL));
+	us->us_refs = 1;
+	if (ebox_pin != NULL && (us->us_pin = strdup(ebox_pin)) == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+
+	/*
+	 * Enumerate once, and match every primary config against what's
+	 * there. piv_enumerate() gives each token its own PCSC context when
+	 * there's more than one reader, so the workers can all talk to their
+	 * tokens at the same time.
+	 */
+	ebox_ctx_setup();
+	if ((err = piv_enumerate(ebox_ctx, &us->us_tokens)))
+		goto out;
+	if ((err = piv_token_index_new(us->us_tokens, &idx)))
+		goto out;
+
+	config = NULL;
+	while ((config = ebox_next_config(ebox, config)) != NULL) {
+		if (ebox_tpl_config_type(ebox_config_tpl(config)) !=
+		    EBOX_PRIMARY)
+			continue;
+		part = ebox_config_next_part(config, NULL);
+		tpart = ebox_part_tpl(part);
+		box = ebox_part_box(part);
+		if (!piv_box_has_guidslot(box))
+			continue;
+
+		ua = &us->us_attempts[us->us_nattempts];
+		err = piv_token_index_find_box(idx, box, &ua->ua_token,
+		    &ua->ua_slot);
+		if (err) {
+			errf_free(err);
+			continue;
+		}
+		++us->us_nattempts;
+		ua->ua_set = us;
+		ua->ua_config = config;
+		if ((ua->ua_box = piv_box_clone(box)) == NULL) {
+			err = ERRF_NOMEM;
+			goto out;
+		}
+		cak = ebox_tpl_part_cak(tpart);
+		if (cak != NULL && sshkey_demote(cak, &ua->ua_cak) != 0) {
+			err = ERRF_NOMEM;
+			goto out;
+		}
+	}
+	piv_token_index_free(idx);
+	idx = NULL;
+
+	VERIFY0(pthread_mutex_lock(&us->us_mtx));
+	for (i = 0; i < us->us_nattempts; ++i) {
+		ua = &us->us_attempts[i];
+		for (j = 0; j < i; ++j) {
+			if (us->us_attempts[j].ua_token == ua->ua_token)
+				break;
+		}
+		if (j < i)
+			continue;
+		VERIFY0(pthread_create(&thr, NULL, unlock_worker, ua));
+		VERIFY0(pthread_detach(thr));
+		++us->us_refs;
+		++us->us_running;
+	}
+
+	while (winner == NULL) {
+		for (i = 0; i < us->us_nattempts; ++i) {
+			ua = &us->us_attempts[i];
+			if (ua->ua_done && ua->ua_err == ERRF_OK) {
+				winner = ua;
+				break;
+			}
+		}
+		if (winner != NULL || us->us_running == 0)
+			break;
+		VERIFY0(pthread_cond_wait(&us->us_cv, &us->us_mtx));
+	}
+
+	if (winner == NULL) {
+		/* Everyone has finished, so we can look at all the errors. */
+		err = NULL;
+		for (i = 0; i < us->us_nattempts && err == NULL; ++i) {
+			ua = &us->us_attempts[i];
+			err = ua->ua_err;
+			ua->ua_err = NULL;
+		}
+		err = errf("NotFoundError", err, "no primary config could be "
+		    "unlocked without interaction using the tokens present");
+		goto outlocked;
+	}
+
+	/*
+	 * The winner's worker is done with its box, but might still be
+	 * doing others (and so might everyone else).
+	 */
+	config = winner->ua_config;
+	if ((err = piv_box_take_datab(winner->ua_box, &datab)))
+		goto outlocked;
+	part = ebox_config_next_part(config, NULL);
+	if ((err = piv_box_set_datab(ebox_part_box(part), datab)))
+		goto outlocked;
+	*pconfig = config;
+	err = ERRF_OK;
+
+outlocked:
+	unlock_set_rele(us);
+	sshbuf_free(datab);
+	return (err);
+
+out:
+	piv_token_index_free(idx);
+	VERIFY0(pthread_mutex_lock(&us->us_mtx));
+	unlock_set_rele(us);
+	return (err);
+}
+
 void
 add_answer(struct question *q, struct answer *a)
 {
@@ -766,13 +1515,19 @@ interactive_part_state(struct part_state *state)
 	return (NULL);
 }
 
+/*
+ * Reads a base64 box from the terminal, or (if outbundle is not NULL) a
+ * bundle of them. Exactly one of *outbox or *outbundle is set.
+ */
 static void
-read_b64_box(struct piv_ecdh_box **outbox)
+read_b64_box(struct piv_ecdh_box **outbox, struct ebox_bundle **outbundle)
 {
 	char *linebuf, *p, *line;
 	size_t len = 1024, pos = 0, llen;
 	struct piv_ecdh_box *box = NULL;
+	struct ebox_bundle *bundle = NULL;
 	struct sshbuf *buf;
+	errf_t *err;
 
 	linebuf = malloc(len);
 	buf = sshbuf_new();
@@ -809,13 +1564,55 @@ read_b64_box(struct piv_ecdh_box **outbox)
 			struct sshbuf *pbuf = sshbuf_fromb(buf);
 			pos = 0;
 			linebuf[0] = 0;
-			if (sshbuf_get_piv_box(pbuf, &box) == 0)
+			if (outbundle != NULL && sshbuf_is_ebox_bundle(pbuf))
+				err = sshbuf_get_ebox_bundle(pbuf, &bundle);
+			else
+				err = sshbuf_get_piv_box(pbuf, &box);
+			if (err == ERRF_OK)
 				sshbuf_free(buf);
+			errf_free(err);
 			sshbuf_free(pbuf);
 		}
-	} while (box == NULL);
+	} while (box == NULL && bundle == NULL);
 
 	*outbox = box;
+	if (outbundle != NULL)
+		*outbundle = bundle;
+}
+
+/*
+ * Processes one response during interactive_recovery(), returning B_TRUE if
+ * it was for a part we were still waiting on. Responses in a bundle which
+ * aren't for this config at all (they're for some other ebox being recovered
+ * at the same time) are skipped quietly.
+ */
+static boolean_t
+recovery_response(struct ebox_config *config, struct piv_ecdh_box *box,
+    boolean_t inbundle)
+{
+	struct ebox_part *part;
+	struct part_state *state;
+	errf_t *error;
+
+	error = ebox_challenge_response(config, box, &part);
+	if (error) {
+		if (!inbundle) {
+			warnfx(error, "failed to parse input data as a "
+			    "valid response");
+		}
+		errf_free(error);
+		return (B_FALSE);
+	}
+	state = (struct part_state *)ebox_part_private(part);
+	if (state->ps_intent != INTENT_CHAL_RESP) {
+		fprintf(stderr, "Response already processed for "
+		    "device %s!\n", state->ps_ans->a_text);
+		return (B_FALSE);
+	}
+	fprintf(stderr, "Device box for %s decrypted ok.\n",
+	    state->ps_ans->a_text);
+	state->ps_intent = INTENT_NONE;
+	return (B_TRUE);
 }
 
 errf_t *
@@ -829,9 +1626,10 @@ interactive_recovery(struct ebox_config *config, const char *what)
 	struct answer *a, *adone;
 	struct sshbuf *buf;
 	struct piv_ecdh_box *box;
+	struct ebox_bundle *bundle;
 	const struct ebox_challenge *chal;
 	char k = '0';
-	uint n, ncur;
+	uint n, ncur, nopen = 0;
 	uint i;
 	char *line;
 	char *b64;
@@ -842,6 +1640,17 @@ interactive_recovery(struct ebox_config *config, const char *what)
 	tconfig = ebox_config_tpl(config);
 	n = ebox_tpl_config_n(tconfig);
 
+	/* Parts which the agent already opened for us (local_unlock_primary) */
+	part = NULL;
+	while ((part = ebox_config_next_part(config, part)) != NULL) {
+		if (!piv_box_sealed(ebox_part_box(part)))
+			++nopen;
+	}
+	if (nopen >= n) {
+		fprintf(stderr, "-- Recovery parts opened by agent --\n");
+		return (ERRF_OK);
+	}
+
 	if (ebox_batch) {
 		error = errf("InteractiveError", NULL,
 		    "interactive recovery is required but the -b batch option "
@@ -865,7 +1674,8 @@ interactive_recovery(struct ebox_config *config, const char *what)
 		a->a_key = ++k;
 		a->a_priv = state;
 		VERIFY(state->ps_ans != NULL);
-		state->ps_intent = INTENT_NONE;
+		state->ps_intent = piv_box_sealed(ebox_part_box(part)) ?
+		    INTENT_NONE : INTENT_LOCAL;
 		make_answer_text_for_pstate(state);
 		add_answer(q, a);
 	}
@@ -912,6 +1722,12 @@ recover:
 		make_answer_text_for_pstate(state);
 		fprintf(stderr, "-- Local device %s --\n",
 		    state->ps_ans->a_text);
+		if (!piv_box_sealed(ebox_part_box(part))) {
+			fprintf(stderr, "Device box already opened by "
+			    "agent.\n");
+			++ncur;
+			continue;
+		}
 partagain:
 		error = local_unlock(ebox_part_box(part),
 		    ebox_tpl_part_cak(tpart), ebox_tpl_part_name(tpart));
@@ -984,25 +1800,37 @@ partagain:
 				continue;
 			fprintf(stderr, "  * %s\n", state->ps_ans->a_text);
 		}
-		fprintf(stderr, "\n-- Enter response followed by newline --\n");
-		read_b64_box(&box);
+		fprintf(stderr, "\n-- Enter response (or response bundle) "
+		    "followed by newline --\n");
+		read_b64_box(&box, &bundle);
 		fprintf(stderr, "-- End response --\n");
-		error = ebox_challenge_response(config, box, &part);
-		if (error) {
-			warnfx(error, "failed to parse input data as a "
-			    "valid response");
+		if (bundle == NULL) {
+			if (recovery_response(config, box, B_FALSE))
+				++ncur;
 			continue;
 		}
-		state = (struct part_state *)ebox_part_private(part);
-		if (state->ps_intent != INTENT_CHAL_RESP) {
-			fprintf(stderr, "Response already processed for "
-			    "device %s!\n", state->ps_ans->a_text);
+		if (ebox_bundle_type(bundle) != EBOX_RESP_BUNDLE) {
+			warnx("input is a bundle, but not of responses");
+			ebox_bundle_free(bundle);
 			continue;
 		}
-		fprintf(stderr, "Device box for %s decrypted ok.\n",
-		    state->ps_ans->a_text);
-		state->ps_intent = INTENT_NONE;
-		++ncur;
+		for (i = 0; i < ebox_bundle_count(bundle); ++i) {
+			struct sshbuf *ibuf;
+			ibuf = sshbuf_fromb(
+			    (struct sshbuf *)ebox_bundle_item(bundle, i));
+			VERIFY(ibuf != NULL);
+			error = sshbuf_get_piv_box(ibuf, &box);
+			sshbuf_free(ibuf);
+			if (error) {
+				warnfx(error, "failed to parse response %u "
+				    "in bundle", i);
+				errf_free(error);
+				continue;
+			}
+			if (recovery_response(config, box, B_TRUE))
+				++ncur;
+		}
+		ebox_bundle_free(bundle);
 	}
 	sshbuf_free(buf);
 	return (NULL);
@@ -1085,7 +1913,6 @@ again:
 void
 interactive_select_local_token(struct ebox_tpl_part **ppart)
 {
-	int rc;
 	errf_t *error;
 	struct piv_token *tokens = NULL, *token;
 	struct piv_slot *slot;
@@ -1098,14 +1925,7 @@ interactive_select_local_token(struct ebox_tpl_part **ppart)
 	char *line, *p;
 	unsigned long parsed;
 
-	if (!ebox_ctx_init) {
-		rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL,
-		    &ebox_ctx);
-		if (rc != SCARD_S_SUCCESS) {
-			errfx(EXIT_ERROR, pcscerrf("SCardEstablishContext", rc),
-			    "failed to initialise libpcsc");
-		}
-	}
+	ebox_ctx_setup();
 
 reenum:
 	error = piv_enumerate(ebox_ctx, &tokens);
@@ -61,6 +61,7 @@ enum ebox_exit_status {
 #define	TPL_DEFAULT_PATH	"%s/.ebox/tpl/%s"
 #define	TPL_MAX_SIZE		4096
 #define	EBOX_MAX_SIZE		16384
+#define	BUNDLE_MAX_SIZE		(1024 * 1024)
 #define	BASE64_LINE_LEN		65
 
 char *piv_token_shortid(struct piv_token *pk);
@@ -70,8 +71,59 @@ void assert_pin(struct piv_token *pk, const char *partname, boolean_t prompt);
 struct ebox_tpl *read_tpl_file(const char *tpl);
 
 errf_t *local_unlock_agent(struct piv_ecdh_box *box);
+/*
+ * Sends the whole ebox to the agent, which opens every part of it that its
+ * token can in one go. If it could open a primary config part, *config is
+ * set to that config (ready for ebox_unlock()). Otherwise, unless
+ * primary_only is set, the agent opens its recovery config parts instead,
+ * and those are left unlocked in the ebox with *config set to NULL.
+ */
+errf_t *local_unlock_agent_ebox(struct ebox *ebox, boolean_t primary_only,
+    struct ebox_config **config);
 errf_t *local_unlock(struct piv_ecdh_box *box, struct sshkey *cak,
     const char *name);
+/*
+ * Tries to unlock one of the primary configs of an ebox, using the agent or
+ * any token that's present, without prompting. All of the tokens that can
+ * open a primary config are tried at once, and we return as soon as one
+ * succeeds, with the part of that config unlocked (so it's ready for
+ * ebox_unlock()). If none can, returns a NotFoundError, and the caller
+ * should fall back to local_unlock() on each config (which can also ask for
+ * a PIN). In that case any recovery config parts the agent could open are
+ * left opened in the ebox, and interactive_recovery() uses them.
+ */
+errf_t *local_unlock_primary(struct ebox *ebox, struct ebox_config **config);
+/*
+ * Unlocks a batch of boxes (e.g. the challenges in an ebox_bundle) with local
+ * hardware, using one transaction per token for all of the boxes on it and
+ * asking for the PIN at most once. Every box must be openable, otherwise the
+ * first error is returned.
+ */
+errf_t *local_unlock_many(struct piv_ecdh_box **boxes, size_t n,
+    const char *name);
+
+struct unlock_batch_item {
+	struct piv_ecdh_box	*ubi_box;
+	struct sshkey		*ubi_cak;	/* optional */
+	const char		*ubi_name;	/* for the PIN prompt */
+	size_t			 ubi_group;
+
+	/* Filled out by local_unlock_batch() */
+	boolean_t		 ubi_opened;
+	errf_t			*ubi_err;
+};
+
+/*
+ * Unlocks as many as it can of a set of boxes drawn from many eboxes (e.g.
+ * for a bulk relock), using one transaction per token and asking for the PIN
+ * at most once. Items with the same ubi_group are alternatives for one
+ * ebox: once any of them opens, the rest of the group is skipped. Rather than
+ * stopping at the first box that fails, each item gets its own result, and
+ * ubi_err is only left set on items in groups where nothing opened. The
+ * return value is only for failures that stop the whole batch (e.g. no
+ * readers).
+ */
+errf_t *local_unlock_batch(struct unlock_batch_item *items, size_t n);
 errf_t *interactive_recovery(struct ebox_config *config, const char *what);
 
 void interactive_select_local_token(struct ebox_tpl_part **ppart);
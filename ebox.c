@@ -16,6 +16,7 @@
 #include <limits.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <sys/errno.h>
 
 #include "libssh/sshkey.h"
@@ -34,9 +35,14 @@
 #include "ebox.h"
 #include "piv.h"
 #include "bunyan.h"
+#include "usdt.h"
 
 #include "piv-internal.h"
 
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#endif
+
 #if defined(__sun) || defined(__APPLE__)
 #include <netinet/in.h>
 #define	htobe32(v)	(htonl(v))
@@ -54,6 +60,7 @@ struct ebox_tpl {
 	struct ebox_tpl_config *et_configs;
 	struct ebox_tpl_config *et_lastconfig;
 	void *et_priv;
+	struct ebox_arena *et_arena;
 };
 
 struct ebox_tpl_config {
@@ -65,6 +72,7 @@ struct ebox_tpl_config {
 	struct ebox_tpl_part *etc_parts;
 	struct ebox_tpl_part *etc_lastpart;
 	void *etc_priv;
+	struct ebox_arena *etc_arena;
 };
 
 struct ebox_tpl_part {
@@ -76,6 +84,7 @@ struct ebox_tpl_part {
 	enum piv_slotid etp_slot;
 	uint8_t etp_guid[16];
 	void *etp_priv;
+	struct ebox_arena *etp_arena;
 };
 
 struct ebox {
@@ -102,12 +111,14 @@ struct ebox {
 	uint8_t *e_token;
 
 	void *e_priv;
+	struct ebox_arena *e_arena;
 };
 
 struct ebox_ephem_key {
 	struct ebox_ephem_key *eek_next;
 	int eek_nid;
 	struct sshkey *eek_ephem;
+	struct ebox_arena *eek_arena;
 };
 
 struct ebox_config {
@@ -124,6 +135,7 @@ struct ebox_config {
 	size_t ec_noncelen;
 
 	void *ec_priv;
+	struct ebox_arena *ec_arena;
 };
 
 struct ebox_part {
@@ -135,6 +147,7 @@ struct ebox_part {
 	size_t ep_sharelen;
 	uint8_t *ep_share;
 	void *ep_priv;
+	struct ebox_arena *ep_arena;
 };
 
 enum chaltag {
@@ -171,6 +184,10 @@ struct ebox_stream {
 	char *es_cipher;
 	char *es_mac;
 	size_t es_chunklen;
+	const struct sshcipher *es_sshcipher;
+	int es_dgalg;
+	size_t es_maclen;
+	uint es_version;
 };
 
 struct ebox_stream_chunk {
@@ -193,14 +210,19 @@ enum ebox_part_tag {
 	EBOX_PART_OPTIONAL_FLAG = 0x80,
 };
 
-#define	EBOX_STREAM_DEFAULT_CHUNK	(128 * 1024)
+#define	EBOX_STREAM_MAX_IV		32
+#define	EBOX_STREAM_MAX_BLOCK		32
+#define	EBOX_STREAM_V2_SEQ		0x80000000U
 
 enum ebox_version {
 	EBOX_V1 = 0x01,
 	EBOX_V2 = 0x02,
 	EBOX_V3 = 0x03,
+	EBOX_V4 = 0x04,		/* compact encoding, see below */
 	EBOX_VNEXT,
-	EBOX_VMIN = EBOX_V1
+	EBOX_VMIN = EBOX_V1,
+	/* What we make by default: V4 is only written when asked for */
+	EBOX_VDEFAULT = EBOX_V3
 };
 
 enum ebox_tpl_version {
@@ -225,6 +247,204 @@ enum ebox_tpl_version {
     errf("NotSupportedError", cause, \
     "ebox challenge is not supported")
 
+/*
+ * Eboxes and templates which are parsed (or cloned) get built all at once and
+ * then are mostly just read and thrown away, so rather than a malloc() for
+ * every struct, string and private area in the graph, they all come out of
+ * an arena shared by the whole ebox.
+ *
+ * Every node (ebox, tpl, config, part etc) allocated from an arena holds a
+ * reference on it, so nodes can still be moved between graphs and freed in
+ * any order, and the arena goes with the last of them. Anything attached to
+ * a node later (keys, shares, challenges when unlocking) is still malloc()ed
+ * as usual. Nonces go in a separate set of concealed chunks.
+ *
+ * Nodes built with the ebox_*_alloc() functions have no arena (NULL), and
+ * all of the ebox_arena_* functions fall back to plain malloc()/free() then.
+ */
+struct ebox_arena_chunk {
+	struct ebox_arena_chunk	*eac_next;
+	size_t			 eac_size;
+	size_t			 eac_used;
+	uint8_t			 eac_data[];
+};
+
+struct ebox_arena {
+	uint			 ea_refs;
+	struct ebox_arena_chunk	*ea_chunks;
+	struct ebox_arena_chunk	*ea_conceal;
+};
+
+#define	EBOX_ARENA_CHUNK	2048
+#define	EBOX_ARENA_ALIGN	16
+
+static struct ebox_arena *
+ebox_arena_new(void)
+{
+	struct ebox_arena *ea;
+	ea = calloc(1, sizeof (struct ebox_arena));
+	VERIFY(ea != NULL);
+	return (ea);
+}
+
+static void
+ebox_arena_destroy(struct ebox_arena *ea)
+{
+	struct ebox_arena_chunk *c, *nc;
+	for (c = ea->ea_chunks; c != NULL; c = nc) {
+		nc = c->eac_next;
+		free(c);
+	}
+	for (c = ea->ea_conceal; c != NULL; c = nc) {
+		nc = c->eac_next;
+		freezero_conceal(c, sizeof (*c) + c->eac_size);
+	}
+	free(ea);
+}
+
+static void *
+ebox_arena_chunk_alloc(struct ebox_arena_chunk **head, size_t sz,
+    boolean_t conceal)
+{
+	struct ebox_arena_chunk *c = *head;
+	uintptr_t off;
+	size_t csz;
+	void *p;
+
+	if (c != NULL) {
+		off = (uintptr_t)&c->eac_data[c->eac_used];
+		off = (off + EBOX_ARENA_ALIGN - 1) & ~(EBOX_ARENA_ALIGN - 1);
+		off -= (uintptr_t)c->eac_data;
+	}
+	if (c == NULL || off + sz > c->eac_size) {
+		csz = EBOX_ARENA_CHUNK;
+		if (c != NULL && c->eac_size < 16 * EBOX_ARENA_CHUNK)
+			csz = c->eac_size * 2;
+		while (csz < sz)
+			csz *= 2;
+		if (conceal)
+			c = zalloc_conceal(sizeof (*c) + csz);
+		else
+			c = malloc(sizeof (*c) + csz);
+		VERIFY(c != NULL);
+		c->eac_next = *head;
+		c->eac_size = csz;
+		*head = c;
+		off = 0;
+	}
+	p = &c->eac_data[off];
+	c->eac_used = off + sz;
+	bzero(p, sz);
+	return (p);
+}
+
+/* Allocates zeroed memory for a field of a node using arena "ea". */
+static void *
+ebox_arena_alloc(struct ebox_arena *ea, size_t sz)
+{
+	if (ea == NULL)
+		return (calloc(1, sz));
+	return (ebox_arena_chunk_alloc(&ea->ea_chunks, sz, B_FALSE));
+}
+
+static void *
+ebox_arena_alloc_conceal(struct ebox_arena *ea, size_t sz)
+{
+	if (ea == NULL)
+		return (zalloc_conceal(sz));
+	return (ebox_arena_chunk_alloc(&ea->ea_conceal, sz, B_TRUE));
+}
+
+static char *
+ebox_arena_strdup(struct ebox_arena *ea, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *p;
+	if (ea == NULL)
+		return (strdup(str));
+	p = ebox_arena_alloc(ea, len);
+	bcopy(str, p, len);
+	return (p);
+}
+
+static void
+ebox_arena_free(struct ebox_arena *ea, void *p)
+{
+	if (ea == NULL)
+		free(p);
+}
+
+static void
+ebox_arena_freezero(struct ebox_arena *ea, void *p, size_t len)
+{
+	if (ea == NULL)
+		freezero_conceal(p, len);
+	else if (p != NULL)
+		explicit_bzero(p, len);
+}
+
+/* Allocates a new node, which takes a reference on the arena. */
+static void *
+ebox_arena_node(struct ebox_arena *ea, size_t sz)
+{
+	if (ea == NULL)
+		return (calloc(1, sz));
+	++ea->ea_refs;
+	return (ebox_arena_alloc(ea, sz));
+}
+
+static void
+ebox_arena_node_free(struct ebox_arena *ea, void *node)
+{
+	if (ea == NULL) {
+		free(node);
+		return;
+	}
+	VERIFY3U(ea->ea_refs, >, 0);
+	if (--ea->ea_refs == 0)
+		ebox_arena_destroy(ea);
+}
+
+/*
+ * Like sshbuf_get_string8() and sshbuf_get_cstring8(), but putting the
+ * result in an arena.
+ */
+static int
+sshbuf_get_string8_arena(struct sshbuf *buf, struct ebox_arena *ea,
+    boolean_t conceal, uint8_t **valp, size_t *lenp)
+{
+	const u_char *p;
+	size_t len;
+	int rc;
+
+	if ((rc = sshbuf_get_string8_direct(buf, &p, &len)))
+		return (rc);
+	if (conceal)
+		*valp = ebox_arena_alloc_conceal(ea, len + 1);
+	else
+		*valp = ebox_arena_alloc(ea, len + 1);
+	if (*valp == NULL)
+		return (SSH_ERR_ALLOC_FAIL);
+	bcopy(p, *valp, len);
+	*lenp = len;
+	return (0);
+}
+
+static int
+sshbuf_get_cstring8_arena(struct sshbuf *buf, struct ebox_arena *ea,
+    char **valp)
+{
+	const u_char *p, *z;
+	size_t len;
+
+	/* As for sshbuf_get_cstring8(), a NUL is only allowed at the end */
+	if (sshbuf_peek_string8_direct(buf, &p, &len) == 0 && len > 0 &&
+	    (z = memchr(p, '\0', len)) != NULL && z < p + len - 1)
+		return (SSH_ERR_INVALID_FORMAT);
+	return (sshbuf_get_string8_arena(buf, ea, B_FALSE, (uint8_t **)valp,
+	    &len));
+}
+
 static struct sshkey *
 ebox_get_ephem_for_nid(const struct ebox *ebox, int nid)
 {
@@ -255,7 +475,7 @@ ebox_make_ephem_for_nid(struct ebox *ebox, int nid)
 	eek->eek_next = ebox->e_ephemkeys;
 	ebox->e_ephemkeys = eek;
 	eek->eek_nid = nid;
-	VERIFY0(sshkey_generate(KEY_ECDSA, bits, &eek->eek_ephem));
+	VERIFY0(piv_box_ephem_generate(bits, &eek->eek_ephem));
 	return (eek->eek_ephem);
 }
 
@@ -280,7 +500,7 @@ void *
 ebox_tpl_alloc_private(struct ebox_tpl *tpl, size_t sz)
 {
 	VERIFY(tpl->et_priv == NULL);
-	tpl->et_priv = calloc(1, sz);
+	tpl->et_priv = ebox_arena_alloc(tpl->et_arena, sz);
 	return (tpl->et_priv);
 }
 
@@ -288,7 +508,7 @@ void
 ebox_tpl_free_private(struct ebox_tpl *tpl)
 {
 	VERIFY(tpl->et_priv != NULL);
-	free(tpl->et_priv);
+	ebox_arena_free(tpl->et_arena, tpl->et_priv);
 	tpl->et_priv = NULL;
 }
 
@@ -338,12 +558,12 @@ ebox_tpl_free(struct ebox_tpl *tpl)
 	struct ebox_tpl_config *config, *nconfig;
 	if (tpl == NULL)
 		return;
-	free(tpl->et_priv);
+	ebox_arena_free(tpl->et_arena, tpl->et_priv);
 	for (config = tpl->et_configs; config != NULL; config = nconfig) {
 		nconfig = config->etc_next;
 		ebox_tpl_config_free(config);
 	}
-	free(tpl);
+	ebox_arena_node_free(tpl->et_arena, tpl);
 }
 
 struct ebox_tpl_config *
@@ -369,7 +589,7 @@ void *
 ebox_tpl_config_alloc_private(struct ebox_tpl_config *config, size_t sz)
 {
 	VERIFY(config->etc_priv == NULL);
-	config->etc_priv = calloc(1, sz);
+	config->etc_priv = ebox_arena_alloc(config->etc_arena, sz);
 	return (config->etc_priv);
 }
 
@@ -377,7 +597,7 @@ void
 ebox_tpl_config_free_private(struct ebox_tpl_config *config)
 {
 	VERIFY(config->etc_priv != NULL);
-	free(config->etc_priv);
+	ebox_arena_free(config->etc_arena, config->etc_priv);
 	config->etc_priv = NULL;
 }
 
@@ -459,12 +679,12 @@ ebox_tpl_config_free(struct ebox_tpl_config *config)
 	struct ebox_tpl_part *part, *npart;
 	if (config == NULL)
 		return;
-	free(config->etc_priv);
+	ebox_arena_free(config->etc_arena, config->etc_priv);
 	for (part = config->etc_parts; part != NULL; part = npart) {
 		npart = part->etp_next;
 		ebox_tpl_part_free(part);
 	}
-	free(config);
+	ebox_arena_node_free(config->etc_arena, config);
 }
 
 struct ebox_tpl_part *
@@ -490,17 +710,17 @@ ebox_tpl_part_free(struct ebox_tpl_part *part)
 {
 	if (part == NULL)
 		return;
-	free(part->etp_priv);
-	free(part->etp_name);
+	ebox_arena_free(part->etp_arena, part->etp_priv);
+	ebox_arena_free(part->etp_arena, part->etp_name);
 	sshkey_free(part->etp_pubkey);
 	sshkey_free(part->etp_cak);
-	free(part);
+	ebox_arena_node_free(part->etp_arena, part);
 }
 
 void
 ebox_tpl_part_set_name(struct ebox_tpl_part *part, const char *name)
 {
-	part->etp_name = strdup(name);
+	part->etp_name = ebox_arena_strdup(part->etp_arena, name);
 	VERIFY(part->etp_name != NULL);
 }
 
@@ -520,7 +740,7 @@ void *
 ebox_tpl_part_alloc_private(struct ebox_tpl_part *part, size_t sz)
 {
 	VERIFY(part->etp_priv == NULL);
-	part->etp_priv = calloc(1, sz);
+	part->etp_priv = ebox_arena_alloc(part->etp_arena, sz);
 	return (part->etp_priv);
 }
 
@@ -528,7 +748,7 @@ void
 ebox_tpl_part_free_private(struct ebox_tpl_part *part)
 {
 	VERIFY(part->etp_priv != NULL);
-	free(part->etp_priv);
+	ebox_arena_free(part->etp_arena, part->etp_priv);
 	part->etp_priv = NULL;
 }
 
@@ -568,17 +788,19 @@ ebox_tpl_clone(const struct ebox_tpl *tpl)
 	struct ebox_tpl *ntpl;
 	struct ebox_tpl_config *pconfig, *nconfig, *config;
 	struct ebox_tpl_part *ppart, *npart, *part;
+	struct ebox_arena *ea;
 
-	ntpl = calloc(1, sizeof (struct ebox_tpl));
-	VERIFY(ntpl != NULL);
+	ea = ebox_arena_new();
+	ntpl = ebox_arena_node(ea, sizeof (struct ebox_tpl));
+	ntpl->et_arena = ea;
 
 	ntpl->et_version = tpl->et_version;
 
 	pconfig = NULL;
 	config = tpl->et_configs;
 	for (; config != NULL; config = config->etc_next) {
-		nconfig = calloc(1, sizeof (struct ebox_tpl_config));
-		VERIFY(nconfig != NULL);
+		nconfig = ebox_arena_node(ea, sizeof (struct ebox_tpl_config));
+		nconfig->etc_arena = ea;
 		if (pconfig != NULL) {
 			pconfig->etc_next = nconfig;
 			nconfig->etc_prev = pconfig;
@@ -593,8 +815,9 @@ ebox_tpl_clone(const struct ebox_tpl *tpl)
 		ppart = NULL;
 		part = config->etc_parts;
 		for (; part != NULL; part = part->etp_next) {
-			npart = calloc(1, sizeof (struct ebox_tpl_part));
-			VERIFY(npart != NULL);
+			npart = ebox_arena_node(ea,
+			    sizeof (struct ebox_tpl_part));
+			npart->etp_arena = ea;
 			if (ppart != NULL) {
 				ppart->etp_next = npart;
 				npart->etp_prev = ppart;
@@ -602,8 +825,10 @@ ebox_tpl_clone(const struct ebox_tpl *tpl)
 				nconfig->etc_parts = npart;
 			}
 			nconfig->etc_lastpart = npart;
-			if (part->etp_name != NULL)
-				npart->etp_name = strdup(part->etp_name);
+			if (part->etp_name != NULL) {
+				npart->etp_name = ebox_arena_strdup(ea,
+				    part->etp_name);
+			}
 			bcopy(part->etp_guid, npart->etp_guid,
 			    sizeof (npart->etp_guid));
 			npart->etp_slot = part->etp_slot;
@@ -696,21 +921,24 @@ out:
 }
 
 static errf_t *
-sshbuf_get_ebox_tpl_part(struct sshbuf *buf, struct ebox_tpl_part **ppart)
+sshbuf_get_ebox_tpl_part(struct sshbuf *buf, struct ebox_arena *ea,
+    struct ebox_tpl_part **ppart)
 {
 	struct ebox_tpl_part *part;
 	struct sshbuf *kbuf;
 	int rc = 0;
 	errf_t *err = NULL;
 	size_t len;
-	uint8_t tag, *guid;
+	uint8_t tag;
+	const uint8_t *guid;
 	char *tname = NULL;
 	struct sshkey *k;
 	uint8_t slotid = PIV_SLOT_KEY_MGMT;
 	boolean_t gotguid = B_FALSE;
 
-	part = calloc(1, sizeof (struct ebox_tpl_part));
+	part = ebox_arena_node(ea, sizeof (struct ebox_tpl_part));
 	VERIFY(part != NULL);
+	part->etp_arena = ea;
 
 	kbuf = sshbuf_new();
 	VERIFY(kbuf != NULL);
@@ -768,14 +996,15 @@ sshbuf_get_ebox_tpl_part(struct sshbuf *buf, struct ebox_tpl_part **ppart)
 			}
 			break;
 		case EBOX_PART_NAME:
-			rc = sshbuf_get_cstring8(buf, &part->etp_name, &len);
+			rc = sshbuf_get_cstring8_arena(buf, ea,
+			    &part->etp_name);
 			if (rc) {
 				err = ssherrf("sshbuf_get_cstring8", rc);
 				goto out;
 			}
 			break;
 		case EBOX_PART_GUID:
-			rc = sshbuf_get_string8(buf, &guid, &len);
+			rc = sshbuf_get_string8_direct(buf, &guid, &len);
 			if (rc) {
 				err = ssherrf("sshbuf_get_string8", rc);
 				goto out;
@@ -787,8 +1016,6 @@ sshbuf_get_ebox_tpl_part(struct sshbuf *buf, struct ebox_tpl_part **ppart)
 				goto out;
 			}
 			bcopy(guid, part->etp_guid, len);
-			free(guid);
-			guid = NULL;
 			gotguid = B_TRUE;
 			break;
 		case EBOX_PART_SLOT:
@@ -862,7 +1089,8 @@ sshbuf_put_ebox_tpl_config(struct sshbuf *buf, struct ebox_tpl_config *config)
 }
 
 static errf_t *
-sshbuf_get_ebox_tpl_config(struct sshbuf *buf, struct ebox_tpl_config **pconfig)
+sshbuf_get_ebox_tpl_config(struct sshbuf *buf, struct ebox_arena *ea,
+    struct ebox_tpl_config **pconfig)
 {
 	struct ebox_tpl_config *config;
 	struct ebox_tpl_part *part;
@@ -871,8 +1099,9 @@ sshbuf_get_ebox_tpl_config(struct sshbuf *buf, struct ebox_tpl_config **pconfig)
 	uint8_t type;
 	uint i;
 
-	config = calloc(1, sizeof (struct ebox_tpl_config));
+	config = ebox_arena_node(ea, sizeof (struct ebox_tpl_config));
 	VERIFY(config != NULL);
+	config->etc_arena = ea;
 
 	if ((rc = sshbuf_get_u8(buf, &type)) ||
 	    (rc = sshbuf_get_u8(buf, &config->etc_n)) ||
@@ -894,7 +1123,7 @@ sshbuf_get_ebox_tpl_config(struct sshbuf *buf, struct ebox_tpl_config **pconfig)
 		goto out;
 	}
 
-	if ((err = sshbuf_get_ebox_tpl_part(buf, &part))) {
+	if ((err = sshbuf_get_ebox_tpl_part(buf, ea, &part))) {
 		err = errf("PartError", err, "error reading part 0");
 		goto out;
 	}
@@ -902,7 +1131,8 @@ sshbuf_get_ebox_tpl_config(struct sshbuf *buf, struct ebox_tpl_config **pconfig)
 	config->etc_lastpart = part;
 
 	for (i = 1; i < config->etc_m; ++i) {
-		if ((err = sshbuf_get_ebox_tpl_part(buf, &part->etp_next))) {
+		err = sshbuf_get_ebox_tpl_part(buf, ea, &part->etp_next);
+		if (err) {
 			err = errf("PartError", err, "error reading part %u", i);
 			goto out;
 		}
@@ -1007,7 +1237,7 @@ void *
 ebox_alloc_private(struct ebox *ebox, size_t sz)
 {
 	VERIFY(ebox->e_priv == NULL);
-	ebox->e_priv = calloc(1, sz);
+	ebox->e_priv = ebox_arena_alloc(ebox->e_arena, sz);
 	return (ebox->e_priv);
 }
 
@@ -1020,9 +1250,12 @@ sshbuf_get_ebox_tpl(struct sshbuf *buf, struct ebox_tpl **ptpl)
 	errf_t *err;
 	uint8_t ver, magic[2], type, nconfigs;
 	uint i;
+	struct ebox_arena *ea;
 
-	tpl = calloc(1, sizeof (struct ebox_tpl));
+	ea = ebox_arena_new();
+	tpl = ebox_arena_node(ea, sizeof (struct ebox_tpl));
 	VERIFY(tpl != NULL);
+	tpl->et_arena = ea;
 
 	if ((rc = sshbuf_get_u8(buf, &magic[0])) ||
 	    (rc = sshbuf_get_u8(buf, &magic[1]))) {
@@ -1056,7 +1289,7 @@ sshbuf_get_ebox_tpl(struct sshbuf *buf, struct ebox_tpl **ptpl)
 		goto out;
 	}
 
-	if ((err = sshbuf_get_ebox_tpl_config(buf, &config))) {
+	if ((err = sshbuf_get_ebox_tpl_config(buf, ea, &config))) {
 		err = boxderrf(errf("ConfigError", err,
 		    "failed to read config 0"));
 		goto out;
@@ -1065,7 +1298,8 @@ sshbuf_get_ebox_tpl(struct sshbuf *buf, struct ebox_tpl **ptpl)
 	tpl->et_lastconfig = config;
 
 	for (i = 1; i < nconfigs; ++i) {
-		if ((err = sshbuf_get_ebox_tpl_config(buf, &config->etc_next))) {
+		err = sshbuf_get_ebox_tpl_config(buf, ea, &config->etc_next);
+		if (err) {
 			err = boxderrf(errf("ConfigError", err,
 			    "failed to read config %u", i));
 			goto out;
@@ -1090,12 +1324,9 @@ ebox_part_free(struct ebox_part *part)
 		return;
 	piv_box_free(part->ep_box);
 	ebox_challenge_free(part->ep_chal);
-	if (part->ep_share != NULL) {
-		explicit_bzero(part->ep_share, part->ep_sharelen);
-		free(part->ep_share);
-	}
-	free(part->ep_priv);
-	free(part);
+	freezero_conceal(part->ep_share, part->ep_sharelen);
+	ebox_arena_free(part->ep_arena, part->ep_priv);
+	ebox_arena_node_free(part->ep_arena, part);
 }
 
 void
@@ -1106,13 +1337,14 @@ ebox_config_free(struct ebox_config *config)
 		return;
 	if (config->ec_chalkey != NULL)
 		sshkey_free(config->ec_chalkey);
-	freezero(config->ec_nonce, config->ec_noncelen);
-	free(config->ec_priv);
+	ebox_arena_freezero(config->ec_arena, config->ec_nonce,
+	    config->ec_noncelen);
+	ebox_arena_free(config->ec_arena, config->ec_priv);
 	for (part = config->ec_parts; part != NULL; part = npart) {
 		npart = part->ep_next;
 		ebox_part_free(part);
 	}
-	free(config);
+	ebox_arena_node_free(config->ec_arena, config);
 }
 
 void
@@ -1122,29 +1354,14 @@ ebox_free(struct ebox *box)
 	struct ebox_ephem_key *eek, *neek;
 	if (box == NULL)
 		return;
-	free(box->e_priv);
-	if (box->e_key != NULL) {
-		explicit_bzero(box->e_key, box->e_keylen);
-		free(box->e_key);
-	}
-	if (box->e_token != NULL) {
-		explicit_bzero(box->e_token, box->e_tokenlen);
-		free(box->e_token);
-	}
-	if (box->e_rcv_key.b_data != NULL) {
-		explicit_bzero(box->e_rcv_key.b_data, box->e_rcv_key.b_len);
-		free(box->e_rcv_key.b_data);
-	}
-	free(box->e_rcv_cipher);
-	if (box->e_rcv_iv.b_data != NULL)
-		free(box->e_rcv_iv.b_data);
-	if (box->e_rcv_enc.b_data != NULL)
-		free(box->e_rcv_enc.b_data);
-	if (box->e_rcv_plain.b_data != NULL) {
-		explicit_bzero(box->e_rcv_plain.b_data,
-		    box->e_rcv_plain.b_len);
-		free(box->e_rcv_plain.b_data);
-	}
+	ebox_arena_free(box->e_arena, box->e_priv);
+	freezero_conceal(box->e_key, box->e_keylen);
+	freezero_conceal(box->e_token, box->e_tokenlen);
+	freezero_conceal(box->e_rcv_key.b_data, box->e_rcv_key.b_len);
+	ebox_arena_free(box->e_arena, box->e_rcv_cipher);
+	ebox_arena_free(box->e_arena, box->e_rcv_iv.b_data);
+	ebox_arena_free(box->e_arena, box->e_rcv_enc.b_data);
+	freezero_conceal(box->e_rcv_plain.b_data, box->e_rcv_plain.b_len);
 	for (config = box->e_configs; config != NULL; config = nconfig) {
 		nconfig = config->ec_next;
 		ebox_config_free(config);
@@ -1152,10 +1369,10 @@ ebox_free(struct ebox *box)
 	for (eek = box->e_ephemkeys; eek != NULL; eek = neek) {
 		neek = eek->eek_next;
 		sshkey_free(eek->eek_ephem);
-		free(eek);
+		ebox_arena_node_free(eek->eek_arena, eek);
 	}
 	ebox_tpl_free(box->e_tpl);
-	free(box);
+	ebox_arena_node_free(box->e_arena, box);
 }
 
 void *
@@ -1168,7 +1385,7 @@ void *
 ebox_config_alloc_private(struct ebox_config *config, size_t sz)
 {
 	VERIFY(config->ec_priv == NULL);
-	config->ec_priv = calloc(1, sz);
+	config->ec_priv = ebox_arena_alloc(config->ec_arena, sz);
 	return (config->ec_priv);
 }
 
@@ -1176,7 +1393,7 @@ void
 ebox_config_free_private(struct ebox_config *config)
 {
 	VERIFY(config->ec_priv != NULL);
-	free(config->ec_priv);
+	ebox_arena_free(config->ec_arena, config->ec_priv);
 	config->ec_priv = NULL;
 }
 
@@ -1190,7 +1407,7 @@ void *
 ebox_part_alloc_private(struct ebox_part *part, size_t sz)
 {
 	VERIFY(part->ep_priv == NULL);
-	part->ep_priv = calloc(1, sz);
+	part->ep_priv = ebox_arena_alloc(part->ep_arena, sz);
 	return (part->ep_priv);
 }
 
@@ -1198,12 +1415,40 @@ void
 ebox_part_free_private(struct ebox_part *part)
 {
 	VERIFY(part->ep_priv != NULL);
-	free(part->ep_priv);
+	ebox_arena_free(part->ep_arena, part->ep_priv);
 	part->ep_priv = NULL;
 }
 
+/*
+ * Picks the fastest of the AEAD stream ciphers for this machine: AES-GCM if
+ * the CPU has AES and carry-less multiply instructions, otherwise
+ * ChaCha20-Poly1305 (which is much faster than AES in software).
+ */
+static const char *
+ebox_stream_aead_cipher(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul"))
+		return ("aes256-gcm");
+#elif defined(__aarch64__) && defined(__linux__)
+	const unsigned long hwcap = getauxval(AT_HWCAP);
+	if ((hwcap & HWCAP_AES) && (hwcap & HWCAP_PMULL))
+		return ("aes256-gcm");
+#elif defined(__aarch64__) && defined(__APPLE__)
+	return ("aes256-gcm");
+#endif
+	return ("chacha20-poly1305");
+}
+
 errf_t *
 ebox_stream_new(const struct ebox_tpl *tpl, struct ebox_stream **str)
+{
+	return (ebox_stream_new_cipher(tpl, NULL, str));
+}
+
+errf_t *
+ebox_stream_new_cipher(const struct ebox_tpl *tpl, const char *ciphername,
+    struct ebox_stream **str)
 {
 	struct ebox_stream *es;
 	uint8_t *key;
@@ -1211,17 +1456,43 @@ ebox_stream_new(const struct ebox_tpl *tpl, struct ebox_stream **str)
 	errf_t *err;
 	const struct sshcipher *cipher;
 
+	if (ciphername == NULL)
+		ciphername = "aes256-ctr";
+	else if (strcmp(ciphername, "aead") == 0)
+		ciphername = ebox_stream_aead_cipher();
+	if (strcmp(ciphername, "aes256-ctr") != 0 &&
+	    strcmp(ciphername, "aes256-gcm") != 0 &&
+	    strcmp(ciphername, "chacha20-poly1305") != 0) {
+		return (argerrf("cipher", "one of 'aes256-ctr', 'aes256-gcm', "
+		    "'chacha20-poly1305' or 'aead'", "'%s'", ciphername));
+	}
+	cipher = cipher_by_name(ciphername);
+	if (cipher == NULL) {
+		return (boxverrf(errf("BadAlgorithmError", NULL,
+		    "unsupported cipher '%s'", ciphername)));
+	}
+
 	es = calloc(1, sizeof (struct ebox_stream));
 	VERIFY(es != NULL);
 	es->es_chunklen = EBOX_STREAM_DEFAULT_CHUNK;
+	es->es_version = 1;
 
-	es->es_cipher = strdup("aes256-ctr");
+	/*
+	 * The AEAD ciphers carry their own tag and don't use the MAC, but we
+	 * still record "sha256" as the MAC algorithm: older versions refuse
+	 * to open a stream with any MAC they don't know.
+	 */
+	es->es_cipher = strdup(ciphername);
 	es->es_mac = strdup("sha256");
-	cipher = cipher_by_name(es->es_cipher);
-	VERIFY(cipher != NULL);
+	VERIFY(es->es_cipher != NULL && es->es_mac != NULL);
 	keylen = cipher_keylen(cipher);
+	es->es_sshcipher = cipher;
+	es->es_dgalg = ssh_digest_alg_by_name(es->es_mac);
+	VERIFY(es->es_dgalg != -1);
+	if (cipher_authlen(cipher) == 0)
+		es->es_maclen = ssh_digest_bytes(es->es_dgalg);
 
-	key = malloc_conceal(keylen);
+	key = zalloc_conceal(keylen);
 	VERIFY(key != NULL);
 	arc4random_buf(key, keylen);
 
@@ -1342,7 +1613,7 @@ sshbuf_get_ebox_stream(struct sshbuf *buf, struct ebox_stream **pes)
 	if (err)
 		return (err);
 
-	if (e->e_type != EBOX_STREAM) {
+	if (e->e_type != EBOX_STREAM && e->e_type != EBOX_STREAM_V2) {
 		err = boxverrf(errf("EboxTypeError", NULL,
 		    "buffer contains an ebox, but not an ebox stream"));
 		goto out;
@@ -1354,6 +1625,7 @@ sshbuf_get_ebox_stream(struct sshbuf *buf, struct ebox_stream **pes)
 		goto out;
 	}
 	es->es_ebox = e;
+	es->es_version = (e->e_type == EBOX_STREAM_V2) ? 2 : 1;
 	e = NULL;
 
 	if ((rc = sshbuf_get_u64(buf, &chunklen))) {
@@ -1365,6 +1637,11 @@ sshbuf_get_ebox_stream(struct sshbuf *buf, struct ebox_stream **pes)
 		    "stream chunk size (%" PRIu64 ") too large", chunklen));
 		goto out;
 	}
+	if (chunklen == 0) {
+		err = boxderrf(errf("LengthError", NULL,
+		    "stream chunk size is zero"));
+		goto out;
+	}
 	es->es_chunklen = chunklen;
 
 	if ((rc = sshbuf_get_cstring8(buf, &es->es_cipher, NULL)) ||
@@ -1385,6 +1662,10 @@ sshbuf_get_ebox_stream(struct sshbuf *buf, struct ebox_stream **pes)
 		    "unsupported MAC algorithm '%s'", es->es_mac));
 		goto out;
 	}
+	es->es_sshcipher = cipher;
+	es->es_dgalg = dgalg;
+	if (cipher_authlen(cipher) == 0)
+		es->es_maclen = ssh_digest_bytes(dgalg);
 
 	*pes = es;
 	es = NULL;
@@ -1409,10 +1690,16 @@ ebox_stream_encrypt_chunk(struct ebox_stream_chunk *esc)
 	struct ssh_hmac_ctx *hctx = NULL;
 
 	es = esc->esc_stream;
+	if (es->es_version != 1) {
+		return (argerrf("chunk", "a chunk of a v1 stream",
+		    "a v%u stream chunk (use the _data functions)",
+		    es->es_version));
+	}
 	plainlen = esc->esc_plainlen;
+	PIVY_PROBE2(stream__encrypt__start, (uint)esc->esc_seqnr,
+	    (size_t)plainlen);
 
-	cipher = cipher_by_name(es->es_cipher);
-	VERIFY(cipher != NULL);
+	cipher = es->es_sshcipher;
 	ivlen = cipher_ivlen(cipher);
 	authlen = cipher_authlen(cipher);
 	blocksz = cipher_blocksize(cipher);
@@ -1427,9 +1714,8 @@ ebox_stream_encrypt_chunk(struct ebox_stream_chunk *esc)
 	}
 
 	if (authlen == 0) {
-		dgalg = ssh_digest_alg_by_name(es->es_mac);
-		VERIFY(dgalg != -1);
-		maclen = ssh_digest_bytes(dgalg);
+		dgalg = es->es_dgalg;
+		maclen = es->es_maclen;
 	} else {
 		maclen = 0;
 	}
@@ -1463,6 +1749,8 @@ ebox_stream_encrypt_chunk(struct ebox_stream_chunk *esc)
 	VERIFY0(cipher_crypt(cctx, esc->esc_seqnr, enc, plain, plainlen, 0,
 	    authlen));
 	cipher_free(cctx);
+	free(iv);
+	freezero(plain, plainlen);
 
 	if (dgalg != -1) {
 		hctx = ssh_hmac_start(dgalg);
@@ -1473,11 +1761,13 @@ ebox_stream_encrypt_chunk(struct ebox_stream_chunk *esc)
 		ssh_hmac_free(hctx);
 	}
 
+	PIVY_PROBE2(stream__encrypt__done, (uint)esc->esc_seqnr,
+	    (size_t)enclen);
 	return (ERRF_OK);
 }
 
-errf_t *
-ebox_stream_decrypt_chunk(struct ebox_stream_chunk *esc)
+static errf_t *
+ebox_stream_decrypt_chunk_impl(struct ebox_stream_chunk *esc)
 {
 	struct ebox_stream *es;
 	const struct sshcipher *cipher;
@@ -1491,9 +1781,13 @@ ebox_stream_decrypt_chunk(struct ebox_stream_chunk *esc)
 	errf_t *err;
 
 	es = esc->esc_stream;
+	if (es->es_version != 1) {
+		return (argerrf("chunk", "a chunk of a v1 stream",
+		    "a v%u stream chunk (use the _data functions)",
+		    es->es_version));
+	}
 
-	cipher = cipher_by_name(es->es_cipher);
-	VERIFY(cipher != NULL);
+	cipher = es->es_sshcipher;
 	ivlen = cipher_ivlen(cipher);
 	authlen = cipher_authlen(cipher);
 	blocksz = cipher_blocksize(cipher);
@@ -1508,9 +1802,8 @@ ebox_stream_decrypt_chunk(struct ebox_stream_chunk *esc)
 	}
 
 	if (authlen == 0) {
-		dgalg = ssh_digest_alg_by_name(es->es_mac);
-		VERIFY(dgalg != -1);
-		maclen = ssh_digest_bytes(dgalg);
+		dgalg = es->es_dgalg;
+		maclen = es->es_maclen;
 	} else {
 		maclen = 0;
 	}
@@ -1557,6 +1850,7 @@ ebox_stream_decrypt_chunk(struct ebox_stream_chunk *esc)
 	rc = cipher_crypt(cctx, esc->esc_seqnr, plain, enc,
 	    enclen - authlen - maclen, 0, authlen);
 	cipher_free(cctx);
+	free(iv);
 
 	if (rc != 0) {
 		err = ssherrf("cipher_crypt", rc);
@@ -1588,6 +1882,356 @@ paderr:
 	return (err);
 }
 
+errf_t *
+ebox_stream_decrypt_chunk(struct ebox_stream_chunk *esc)
+{
+	errf_t *err;
+
+	PIVY_PROBE2(stream__decrypt__start, (uint)esc->esc_seqnr,
+	    (size_t)esc->esc_enclen);
+	err = ebox_stream_decrypt_chunk_impl(esc);
+	PIVY_PROBE3(stream__decrypt__done, (uint)esc->esc_seqnr,
+	    (size_t)esc->esc_plainlen, (int)(err == ERRF_OK));
+	return (err);
+}
+
+/*
+ * Per-thread state for sshbuf_{put,get}_ebox_stream_data(). Setting up the
+ * cipher key schedule and keying the HMAC is done once here, so that each
+ * chunk after that only has to set a new IV and restart the HMAC.
+ */
+struct ebox_stream_ctx {
+	const struct ebox_stream	*esx_stream;
+	struct sshcipher_ctx		*esx_cctx;
+	struct ssh_hmac_ctx		*esx_hctx;
+};
+
+errf_t *
+ebox_stream_ctx_new(const struct ebox_stream *es, boolean_t encrypt,
+    struct ebox_stream_ctx **pctx)
+{
+	struct ebox_stream_ctx *ctx;
+	const struct sshcipher *cipher = es->es_sshcipher;
+	const uint8_t *key = es->es_ebox->e_key;
+	size_t keylen = cipher_keylen(cipher);
+	uint8_t iv[EBOX_STREAM_MAX_IV];
+	size_t ivlen;
+	int rc;
+	errf_t *err;
+
+	if (key == NULL) {
+		return (argerrf("stream", "an unlocked ebox stream",
+		    "a stream without its key"));
+	}
+	VERIFY3U(es->es_ebox->e_keylen, >=, keylen);
+	VERIFY3U(cipher_blocksize(cipher), <=, EBOX_STREAM_MAX_BLOCK);
+	ivlen = cipher_ivlen(cipher);
+	VERIFY3U(ivlen, <=, EBOX_STREAM_MAX_IV);
+	bzero(iv, sizeof (iv));
+
+	ctx = calloc(1, sizeof (struct ebox_stream_ctx));
+	if (ctx == NULL)
+		return (ERRF_NOMEM);
+	ctx->esx_stream = es;
+
+	rc = cipher_init(&ctx->esx_cctx, cipher, key, keylen, iv, ivlen,
+	    encrypt ? CIPHER_ENCRYPT : CIPHER_DECRYPT);
+	if (rc != 0) {
+		err = ssherrf("cipher_init", rc);
+		goto out;
+	}
+
+	if (es->es_maclen > 0) {
+		ctx->esx_hctx = ssh_hmac_start(es->es_dgalg);
+		if (ctx->esx_hctx == NULL) {
+			err = ERRF_NOMEM;
+			goto out;
+		}
+		if (ssh_hmac_init(ctx->esx_hctx, key, keylen) != 0) {
+			err = errf("HMACError", NULL, "failed to key HMAC");
+			goto out;
+		}
+	}
+
+	*pctx = ctx;
+	ctx = NULL;
+	err = ERRF_OK;
+
+out:
+	ebox_stream_ctx_free(ctx);
+	return (err);
+}
+
+void
+ebox_stream_ctx_free(struct ebox_stream_ctx *ctx)
+{
+	if (ctx == NULL)
+		return;
+	cipher_free(ctx->esx_cctx);
+	ssh_hmac_free(ctx->esx_hctx);
+	free(ctx);
+}
+
+/*
+ * Restarts the cipher with the IV for chunk number seqnr, and the HMAC (if
+ * any) from its keyed state.
+ *
+ * In v2 streams, the number that goes into the IV (and is passed to the
+ * cipher as its sequence number) has EBOX_STREAM_V2_SEQ set, and the HMAC
+ * covers it as well as the ciphertext. This means v2 chunks always fail
+ * validation if they're read as v1 (e.g. if someone edits the header to
+ * make a reader skip checking the footer). Returns the number to give
+ * cipher_crypt().
+ */
+static uint32_t
+ebox_stream_ctx_reset(struct ebox_stream_ctx *ctx, uint32_t seqnr)
+{
+	const struct ebox_stream *es = ctx->esx_stream;
+	const struct sshcipher *cipher = es->es_sshcipher;
+	uint8_t iv[EBOX_STREAM_MAX_IV], tbuf[sizeof (uint32_t)];
+	size_t ivlen;
+	uint32_t tweak = seqnr;
+
+	if (es->es_version >= 2)
+		tweak |= EBOX_STREAM_V2_SEQ;
+
+	ivlen = cipher_ivlen(cipher);
+	if (ivlen > 0) {
+		VERIFY3U(ivlen, >=, sizeof (uint32_t));
+		bzero(iv, ivlen);
+		*(uint32_t *)iv = htobe32(tweak);
+	}
+	VERIFY0(cipher_reset_iv(ctx->esx_cctx, iv, ivlen));
+	if (ctx->esx_hctx != NULL) {
+		VERIFY0(ssh_hmac_init(ctx->esx_hctx, NULL, 0));
+		if (es->es_version >= 2) {
+			POKE_U32(tbuf, tweak);
+			VERIFY0(ssh_hmac_update(ctx->esx_hctx, tbuf,
+			    sizeof (tbuf)));
+		}
+	}
+	return (tweak);
+}
+
+errf_t *
+sshbuf_put_ebox_stream_data(struct sshbuf *buf, struct ebox_stream_ctx *ctx,
+    uint32_t seqnr, const void *data, size_t len)
+{
+	const struct ebox_stream *es = ctx->esx_stream;
+	const struct sshcipher *cipher = es->es_sshcipher;
+	int rc;
+	size_t blocksz, authlen, maclen, bulk, tail, padding, enclen;
+	uint8_t last[EBOX_STREAM_MAX_BLOCK];
+	uint8_t *enc;
+	uint32_t tweak;
+
+	if (es->es_version >= 2 &&
+	    (seqnr == 0 || (seqnr & EBOX_STREAM_V2_SEQ) != 0)) {
+		return (argerrf("seqnr", "a chunk number between 1 and "
+		    "2^31-1", "%u", seqnr));
+	}
+
+	authlen = cipher_authlen(cipher);
+	blocksz = cipher_blocksize(cipher);
+	maclen = es->es_maclen;
+
+	/*
+	 * Same PKCS#7 padding as ebox_stream_encrypt_chunk(), but we only
+	 * copy the final partial block to pad it: everything before that is
+	 * encrypted straight from the caller's buffer into buf.
+	 */
+	tail = len % blocksz;
+	bulk = len - tail;
+	padding = blocksz - tail;
+	bcopy((const uint8_t *)data + bulk, last, tail);
+	memset(last + tail, padding, padding);
+
+	enclen = bulk + blocksz + authlen + maclen;
+	if (enclen > UINT32_MAX)
+		return (argerrf("len", "a chunk length", "%zu", len));
+
+	rc = sshbuf_reserve(buf, 2 * sizeof (uint32_t) + enclen, &enc);
+	if (rc != 0)
+		return (ssherrf("sshbuf_reserve", rc));
+	POKE_U32(enc, seqnr);
+	POKE_U32(enc + sizeof (uint32_t), enclen);
+	enc += 2 * sizeof (uint32_t);
+
+	tweak = ebox_stream_ctx_reset(ctx, seqnr);
+	if (authlen == 0) {
+		if (bulk > 0) {
+			VERIFY0(cipher_crypt(ctx->esx_cctx, tweak, enc, data,
+			    bulk, 0, 0));
+		}
+		VERIFY0(cipher_crypt(ctx->esx_cctx, tweak, enc + bulk, last,
+		    blocksz, 0, 0));
+	} else {
+		/*
+		 * AEAD ciphers have to see the whole message in one call, so
+		 * assemble it in the output and encrypt it in place.
+		 */
+		bcopy(data, enc, bulk);
+		bcopy(last, enc + bulk, blocksz);
+		VERIFY0(cipher_crypt(ctx->esx_cctx, tweak, enc, enc,
+		    bulk + blocksz, 0, authlen));
+	}
+	explicit_bzero(last, sizeof (last));
+
+	if (ctx->esx_hctx != NULL) {
+		VERIFY0(ssh_hmac_update(ctx->esx_hctx, enc, enclen - maclen));
+		VERIFY0(ssh_hmac_final(ctx->esx_hctx, &enc[enclen - maclen],
+		    maclen));
+	}
+
+	return (ERRF_OK);
+}
+
+errf_t *
+ebox_stream_frame_peek(const uint8_t *p, size_t len, size_t *framelen)
+{
+	uint32_t elen;
+
+	*framelen = 0;
+	if (len < 2 * sizeof (uint32_t)) {
+		return (boxderrf(ssherrf("sshbuf_get_u32",
+		    SSH_ERR_MESSAGE_INCOMPLETE)));
+	}
+	elen = PEEK_U32(p + sizeof (uint32_t));
+	if (elen > SSHBUF_SIZE_MAX - 2 * sizeof (uint32_t)) {
+		return (boxderrf(ssherrf("sshbuf_get_string",
+		    SSH_ERR_STRING_TOO_LARGE)));
+	}
+	*framelen = 2 * sizeof (uint32_t) + elen;
+	if (len < *framelen) {
+		return (boxderrf(ssherrf("sshbuf_get_string",
+		    SSH_ERR_MESSAGE_INCOMPLETE)));
+	}
+	return (ERRF_OK);
+}
+
+/*
+ * Finds the extent of the chunk at the start of buf, without consuming it.
+ */
+static errf_t *
+ebox_stream_frame(const struct sshbuf *buf, uint32_t *seqnr,
+    const uint8_t **enc, size_t *enclen)
+{
+	const uint8_t *p = sshbuf_ptr(buf);
+	size_t framelen;
+	errf_t *err;
+
+	if ((err = ebox_stream_frame_peek(p, sshbuf_len(buf), &framelen)))
+		return (err);
+	if (seqnr != NULL)
+		*seqnr = PEEK_U32(p);
+	if (enc != NULL)
+		*enc = p + 2 * sizeof (uint32_t);
+	if (enclen != NULL)
+		*enclen = framelen - 2 * sizeof (uint32_t);
+	return (ERRF_OK);
+}
+
+errf_t *
+sshbuf_get_ebox_stream_frame(struct sshbuf *buf, struct sshbuf *out)
+{
+	errf_t *err;
+	size_t enclen;
+	int rc;
+
+	if ((err = ebox_stream_frame(buf, NULL, NULL, &enclen)))
+		return (err);
+	enclen += 2 * sizeof (uint32_t);
+	if ((rc = sshbuf_put(out, sshbuf_ptr(buf), enclen)))
+		return (ssherrf("sshbuf_put", rc));
+	VERIFY0(sshbuf_consume(buf, enclen));
+	return (ERRF_OK);
+}
+
+errf_t *
+sshbuf_get_ebox_stream_data(struct sshbuf *buf, struct ebox_stream_ctx *ctx,
+    uint32_t *seqnrp, struct sshbuf *out)
+{
+	const struct ebox_stream *es = ctx->esx_stream;
+	const struct sshcipher *cipher = es->es_sshcipher;
+	int rc;
+	size_t blocksz, authlen, maclen, enclen, plainlen;
+	size_t padding, i;
+	uint32_t seqnr, tweak;
+	uint8_t mac[SSH_DIGEST_MAX_LENGTH];
+	const uint8_t *enc;
+	uint8_t *plain;
+	errf_t *err;
+
+	if ((err = ebox_stream_frame(buf, &seqnr, &enc, &enclen)))
+		return (err);
+	if (es->es_version >= 2 &&
+	    (seqnr == 0 || (seqnr & EBOX_STREAM_V2_SEQ) != 0)) {
+		return (boxderrf(errf("SequenceError", NULL, "chunk has "
+		    "invalid sequence number %u", seqnr)));
+	}
+
+	authlen = cipher_authlen(cipher);
+	blocksz = cipher_blocksize(cipher);
+	maclen = es->es_maclen;
+
+	if (enclen < authlen + maclen + blocksz) {
+		return (errf("LengthError", NULL, "Ciphertext length (%zu) "
+		    "is smaller than minimum length (auth tag + 1 block = %zu)",
+		    enclen, authlen + maclen + blocksz));
+	}
+
+	tweak = ebox_stream_ctx_reset(ctx, seqnr);
+
+	if (ctx->esx_hctx != NULL) {
+		VERIFY3U(maclen, <=, sizeof (mac));
+		VERIFY0(ssh_hmac_update(ctx->esx_hctx, enc, enclen - maclen));
+		VERIFY0(ssh_hmac_final(ctx->esx_hctx, mac, maclen));
+		if (timingsafe_bcmp(mac, &enc[enclen - maclen], maclen) != 0) {
+			explicit_bzero(mac, maclen);
+			return (errf("MACError", NULL, "Ciphertext MAC failed "
+			    "validation"));
+		}
+		explicit_bzero(mac, maclen);
+	}
+
+	plainlen = enclen - authlen - maclen;
+	if ((rc = sshbuf_reserve(out, plainlen, &plain)))
+		return (ssherrf("sshbuf_reserve", rc));
+
+	rc = cipher_crypt(ctx->esx_cctx, tweak, plain, enc, plainlen, 0,
+	    authlen);
+	if (rc == SSH_ERR_MAC_INVALID) {
+		err = errf("MACError", ssherrf("cipher_crypt", rc),
+		    "Ciphertext MAC failed validation");
+		goto bad;
+	} else if (rc != 0) {
+		err = ssherrf("cipher_crypt", rc);
+		goto bad;
+	}
+
+	/* Strip off the pkcs#7 padding and verify it. */
+	padding = plain[plainlen - 1];
+	if (padding < 1 || padding > blocksz)
+		goto paderr;
+	for (i = plainlen - padding; i < plainlen; ++i) {
+		if (plain[i] != padding)
+			goto paderr;
+	}
+	VERIFY0(sshbuf_consume_end(out, padding));
+	VERIFY0(sshbuf_consume(buf, 2 * sizeof (uint32_t) + enclen));
+
+	if (seqnrp != NULL)
+		*seqnrp = seqnr;
+	return (ERRF_OK);
+
+paderr:
+	err = errf("PaddingError", NULL, "Padding failed validation");
+bad:
+	explicit_bzero(plain, plainlen);
+	VERIFY0(sshbuf_consume_end(out, plainlen));
+	return (err);
+}
+
 const uint8_t *
 ebox_stream_chunk_data(const struct ebox_stream_chunk *esc, size_t *size)
 {
@@ -1654,29 +2298,544 @@ ebox_stream_chunk_size(const struct ebox_stream *es)
 	return (es->es_chunklen);
 }
 
-static errf_t *
-sshbuf_get_ebox_part(struct sshbuf *buf, const struct ebox *ebox,
-    struct ebox_part **ppart)
+/*
+ * The encoded size of a whole chunk of this stream (every chunk except the
+ * last one is whole, since we always fill a chunk before starting the next).
+ */
+static size_t
+ebox_stream_frame_len(const struct ebox_stream *es)
+{
+	const struct sshcipher *cipher = es->es_sshcipher;
+	const size_t blocksz = cipher_blocksize(cipher);
+	const size_t chunklen = es->es_chunklen;
+
+	return (2 * sizeof (uint32_t) + chunklen - (chunklen % blocksz) +
+	    blocksz + cipher_authlen(cipher) + es->es_maclen);
+}
+
+size_t
+ebox_stream_seek_offset(const struct ebox_stream *es, size_t offset)
+{
+	return ((offset / es->es_chunklen) * ebox_stream_frame_len(es));
+}
+
+errf_t *
+ebox_stream_pread_range(struct ebox_stream_ctx *ctx, int fd, off_t base,
+    uint64_t offset, size_t len, struct sshbuf *out)
+{
+	const struct ebox_stream *es = ctx->esx_stream;
+	const size_t framelen = ebox_stream_frame_len(es);
+	struct sshbuf *frame = NULL, *plain = NULL;
+	uint64_t seqnr64;
+	uint32_t seqnr;
+	size_t skip, take;
+	boolean_t last;
+	uint8_t *p;
+	ssize_t done;
+	off_t foff;
+	errf_t *err;
+	int rc;
+
+	frame = sshbuf_new();
+	plain = sshbuf_new();
+	if (frame == NULL || plain == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+
+	skip = offset % es->es_chunklen;
+	seqnr64 = offset / es->es_chunklen + 1;
+	foff = base + (off_t)ebox_stream_seek_offset(es, offset);
+
+	while (len > 0) {
+		if (seqnr64 > UINT32_MAX) {
+			err = ERRF_OK;
+			goto out;
+		}
+		if ((rc = sshbuf_reserve(frame, framelen, &p))) {
+			err = ssherrf("sshbuf_reserve", rc);
+			goto out;
+		}
+		do {
+			done = pread(fd, p, framelen, foff);
+		} while (done == -1 && errno == EINTR);
+		if (done == -1) {
+			err = errfno("pread", errno, "reading stream chunk");
+			goto out;
+		}
+		VERIFY0(sshbuf_consume_end(frame, framelen - done));
+		/* Past the end of the stream: nothing more to give. */
+		if (done == 0)
+			break;
+		/* The v2 footer also marks the end. */
+		if (es->es_version >= 2 && sshbuf_len(frame) >= 4 &&
+		    PEEK_U32(sshbuf_ptr(frame)) == 0)
+			break;
+
+		err = sshbuf_get_ebox_stream_data(frame, ctx, &seqnr, plain);
+		if (err)
+			goto out;
+		if (seqnr != seqnr64) {
+			err = boxderrf(errf("SequenceError", NULL, "expected "
+			    "chunk %" PRIu64 " at offset %lld, found chunk %u",
+			    seqnr64, (long long)foff, seqnr));
+			goto out;
+		}
+
+		/* A short chunk can only be the last one. */
+		last = (sshbuf_len(plain) < es->es_chunklen);
+
+		if (skip >= sshbuf_len(plain))
+			break;
+		take = sshbuf_len(plain) - skip;
+		if (take > len)
+			take = len;
+		if ((rc = sshbuf_put(out, sshbuf_ptr(plain) + skip, take))) {
+			err = ssherrf("sshbuf_put", rc);
+			goto out;
+		}
+		len -= take;
+		skip = 0;
+
+		if (last)
+			break;
+		VERIFY0(sshbuf_consume(frame, sshbuf_len(frame)));
+		VERIFY0(sshbuf_consume(plain, sshbuf_len(plain)));
+		foff += framelen;
+		++seqnr64;
+	}
+	err = ERRF_OK;
+
+out:
+	sshbuf_free(frame);
+	sshbuf_free(plain);
+	return (err);
+}
+uint
+ebox_stream_version(const struct ebox_stream *es)
+{
+	return (es->es_version);
+}
+
+errf_t *
+ebox_stream_set_chunk_size(struct ebox_stream *es, size_t chunklen)
+{
+	if (chunklen < EBOX_STREAM_MIN_CHUNK ||
+	    chunklen > EBOX_STREAM_MAX_CHUNK) {
+		return (argerrf("chunklen", "between %u and %u bytes",
+		    "%zu", EBOX_STREAM_MIN_CHUNK, EBOX_STREAM_MAX_CHUNK,
+		    chunklen));
+	}
+	es->es_chunklen = chunklen;
+	return (ERRF_OK);
+}
+
+errf_t *
+ebox_stream_set_version(struct ebox_stream *es, uint version)
+{
+	if (version < 1 || version > 2) {
+		return (argerrf("version", "an ebox stream version (1 or 2)",
+		    "%u", version));
+	}
+	es->es_version = version;
+	es->es_ebox->e_type = (version >= 2) ? EBOX_STREAM_V2 : EBOX_STREAM;
+	return (ERRF_OK);
+}
+
+/*
+ * The v2 stream footer is a frame (like a chunk) with sequence number 0,
+ * whose contents are:
+ *
+ *   u8		EBOX_STREAM_FOOTER_VERSION
+ *   u32	number of chunks
+ *   u64	encoded length of one whole chunk
+ *   u64	encoded length of all chunks together
+ *   string	merkle root over the chunks' MACs/tags
+ *   (bytes)	HMAC over u32 0 + all of the above, with the stream key
+ *
+ * Since every chunk but the last is the same length, the chunk lengths give
+ * the offset of any chunk (see ebox_stream_seek_offset()), so we don't need
+ * to store a separate table of offsets.
+ *
+ * The merkle tree has a leaf for each chunk, H(0x00 || tag), and each inner
+ * node is H(0x01 || left || right), using SHA-256. When the number of nodes
+ * at a level is odd, the last one moves up to the next level as-is. We
+ * compute it as we go with one pending node per level (like a binary
+ * counter), so memory use is logarithmic in the stream length.
+ */
+#define	EBOX_STREAM_FOOTER_VERSION	1
+#define	EBOX_STREAM_MERKLE_LEN		32
+#define	EBOX_STREAM_MERKLE_LEVELS	33
+
+struct ebox_stream_summary {
+	const struct ebox_stream	*ess_stream;
+	uint32_t			 ess_nchunks;
+	uint64_t			 ess_enclen;
+	boolean_t			 ess_footer;
+	uint64_t			 ess_pending;
+	uint8_t				 ess_tree[EBOX_STREAM_MERKLE_LEVELS]
+					    [EBOX_STREAM_MERKLE_LEN];
+};
+
+static void
+merkle_hash(uint8_t prefix, const uint8_t *a, size_t alen, const uint8_t *b,
+    size_t blen, uint8_t *out)
+{
+	struct ssh_digest_ctx *dctx;
+
+	dctx = ssh_digest_start(SSH_DIGEST_SHA256);
+	VERIFY(dctx != NULL);
+	VERIFY0(ssh_digest_update(dctx, &prefix, 1));
+	VERIFY0(ssh_digest_update(dctx, a, alen));
+	if (b != NULL)
+		VERIFY0(ssh_digest_update(dctx, b, blen));
+	VERIFY0(ssh_digest_final(dctx, out, EBOX_STREAM_MERKLE_LEN));
+	ssh_digest_free(dctx);
+}
+
+static void
+ebox_stream_summary_leaf(struct ebox_stream_summary *sum, const uint8_t *tag,
+    size_t taglen)
+{
+	uint8_t node[EBOX_STREAM_MERKLE_LEN];
+	uint l;
+
+	merkle_hash(0x00, tag, taglen, NULL, 0, node);
+	for (l = 0; (sum->ess_pending & (1ULL << l)) != 0; ++l) {
+		merkle_hash(0x01, sum->ess_tree[l], sizeof (node), node,
+		    sizeof (node), node);
+		sum->ess_pending &= ~(1ULL << l);
+	}
+	VERIFY3U(l, <, EBOX_STREAM_MERKLE_LEVELS);
+	bcopy(node, sum->ess_tree[l], sizeof (node));
+	sum->ess_pending |= (1ULL << l);
+}
+
+static void
+ebox_stream_summary_root(const struct ebox_stream_summary *sum, uint8_t *root)
+{
+	boolean_t have = B_FALSE;
+	uint l;
+
+	bzero(root, EBOX_STREAM_MERKLE_LEN);
+	for (l = 0; l < EBOX_STREAM_MERKLE_LEVELS; ++l) {
+		if ((sum->ess_pending & (1ULL << l)) == 0)
+			continue;
+		if (!have) {
+			bcopy(sum->ess_tree[l], root, EBOX_STREAM_MERKLE_LEN);
+			have = B_TRUE;
+			continue;
+		}
+		merkle_hash(0x01, sum->ess_tree[l], EBOX_STREAM_MERKLE_LEN,
+		    root, EBOX_STREAM_MERKLE_LEN, root);
+	}
+}
+
+/* Writes the body of the footer frame (everything after the u32 0). */
+static errf_t *
+ebox_stream_footer_body(const struct ebox_stream_summary *sum,
+    struct sshbuf *buf)
+{
+	const struct ebox_stream *es = sum->ess_stream;
+	uint8_t root[EBOX_STREAM_MERKLE_LEN], zero[sizeof (uint32_t)];
+	struct sshbuf *b;
+	struct ssh_hmac_ctx *hctx;
+	const size_t maclen = ssh_hmac_bytes(es->es_dgalg);
+	uint8_t *mac;
+	errf_t *err;
+	int rc;
+
+	ebox_stream_summary_root(sum, root);
+
+	if ((b = sshbuf_new()) == NULL)
+		return (ERRF_NOMEM);
+	if ((rc = sshbuf_put_u8(b, EBOX_STREAM_FOOTER_VERSION)) ||
+	    (rc = sshbuf_put_u32(b, sum->ess_nchunks)) ||
+	    (rc = sshbuf_put_u64(b, ebox_stream_frame_len(es))) ||
+	    (rc = sshbuf_put_u64(b, sum->ess_enclen)) ||
+	    (rc = sshbuf_put_string(b, root, sizeof (root))) ||
+	    (rc = sshbuf_reserve(b, maclen, &mac))) {
+		err = ssherrf("sshbuf_put", rc);
+		goto out;
+	}
+
+	hctx = ssh_hmac_start(es->es_dgalg);
+	VERIFY(hctx != NULL);
+	VERIFY0(ssh_hmac_init(hctx, es->es_ebox->e_key,
+	    es->es_ebox->e_keylen));
+	bzero(zero, sizeof (zero));
+	VERIFY0(ssh_hmac_update(hctx, zero, sizeof (zero)));
+	VERIFY0(ssh_hmac_update(hctx, sshbuf_ptr(b), sshbuf_len(b) - maclen));
+	VERIFY0(ssh_hmac_final(hctx, mac, maclen));
+	ssh_hmac_free(hctx);
+
+	if ((rc = sshbuf_putb(buf, b))) {
+		err = ssherrf("sshbuf_putb", rc);
+		goto out;
+	}
+	err = ERRF_OK;
+
+out:
+	sshbuf_free(b);
+	return (err);
+}
+
+errf_t *
+ebox_stream_summary_new(const struct ebox_stream *es,
+    struct ebox_stream_summary **psum)
+{
+	struct ebox_stream_summary *sum;
+
+	sum = calloc(1, sizeof (struct ebox_stream_summary));
+	if (sum == NULL)
+		return (ERRF_NOMEM);
+	sum->ess_stream = es;
+	*psum = sum;
+	return (ERRF_OK);
+}
+
+void
+ebox_stream_summary_free(struct ebox_stream_summary *sum)
+{
+	free(sum);
+}
+
+errf_t *
+ebox_stream_summary_add(struct ebox_stream_summary *sum,
+    const struct sshbuf *frame, boolean_t *footer)
+{
+	const struct ebox_stream *es = sum->ess_stream;
+	const struct sshcipher *cipher = es->es_sshcipher;
+	struct sshbuf *want = NULL;
+	const uint8_t *enc;
+	size_t enclen, taglen;
+	uint32_t seqnr;
+	errf_t *err;
+
+	*footer = B_FALSE;
+
+	if ((err = ebox_stream_frame(frame, &seqnr, &enc, &enclen)))
+		return (err);
+	if (sum->ess_footer) {
+		return (boxderrf(errf("TrailingDataError", NULL,
+		    "stream has data after its footer")));
+	}
+
+	if (seqnr == 0 && es->es_version >= 2) {
+		if ((want = sshbuf_new()) == NULL)
+			return (ERRF_NOMEM);
+		err = ebox_stream_footer_body(sum, want);
+		if (err) {
+			sshbuf_free(want);
+			return (err);
+		}
+		if (sshbuf_len(want) != enclen ||
+		    timingsafe_bcmp(sshbuf_ptr(want), enc, enclen) != 0) {
+			sshbuf_free(want);
+			return (boxderrf(errf("FooterMismatchError", NULL,
+			    "stream footer does not match the %u chunks "
+			    "before it (chunks may be missing or altered)",
+			    sum->ess_nchunks)));
+		}
+		sshbuf_free(want);
+		sum->ess_footer = B_TRUE;
+		*footer = B_TRUE;
+		return (ERRF_OK);
+	}
+
+	if (seqnr != sum->ess_nchunks + 1) {
+		return (boxderrf(errf("SequenceError", NULL, "expected "
+		    "chunk %u, found chunk %u", sum->ess_nchunks + 1, seqnr)));
+	}
+	taglen = cipher_authlen(cipher) + es->es_maclen;
+	if (enclen < taglen) {
+		return (errf("LengthError", NULL, "Ciphertext length (%zu) "
+		    "is smaller than its tag (%zu)", enclen, taglen));
+	}
+	ebox_stream_summary_leaf(sum, enc + enclen - taglen, taglen);
+	++sum->ess_nchunks;
+	sum->ess_enclen += 2 * sizeof (uint32_t) + enclen;
+
+	return (ERRF_OK);
+}
+
+errf_t *
+ebox_stream_summary_finish(const struct ebox_stream_summary *sum)
+{
+	if (sum->ess_stream->es_version >= 2 && !sum->ess_footer) {
+		return (errf("TruncatedStreamError", NULL, "stream ended "
+		    "after %u chunks without a footer (it may have been "
+		    "truncated)", sum->ess_nchunks));
+	}
+	return (ERRF_OK);
+}
+
+errf_t *
+sshbuf_put_ebox_stream_footer(struct sshbuf *buf,
+    struct ebox_stream_summary *sum)
+{
+	struct sshbuf *body;
+	errf_t *err;
+	int rc;
+
+	if (sum->ess_stream->es_version < 2) {
+		return (argerrf("stream", "a v2 ebox stream",
+		    "a v%u stream", sum->ess_stream->es_version));
+	}
+	if (sum->ess_footer) {
+		return (argerrf("summary", "a stream without a footer yet",
+		    "one that already has one"));
+	}
+	if ((body = sshbuf_new()) == NULL)
+		return (ERRF_NOMEM);
+	if ((err = ebox_stream_footer_body(sum, body)))
+		goto out;
+	if ((rc = sshbuf_put_u32(buf, 0)) ||
+	    (rc = sshbuf_put_stringb(buf, body))) {
+		err = ssherrf("sshbuf_put", rc);
+		goto out;
+	}
+	sum->ess_footer = B_TRUE;
+	err = ERRF_OK;
+out:
+	sshbuf_free(body);
+	return (err);
+}
+
+/*
+ * Incremental stream frame reader. We read the u32 sequence number and u32
+ * length of each frame first, then exactly the rest of it, so the caller can
+ * read the body straight into its final buffer in one go.
+ */
+struct ebox_stream_reader {
+	const struct ebox_stream	*esr_stream;
+	size_t				 esr_max;	/* longest frame */
+	boolean_t			 esr_body;	/* have the prefix */
+	size_t				 esr_want;	/* bytes of frame */
+	size_t				 esr_have;
+	size_t				 esr_space;	/* reserved in buf */
+};
+
+errf_t *
+ebox_stream_reader_new(const struct ebox_stream *es,
+    struct ebox_stream_reader **prdr)
+{
+	struct ebox_stream_reader *rdr;
+	size_t footerlen;
+
+	rdr = calloc(1, sizeof (*rdr));
+	if (rdr == NULL)
+		return (ERRF_NOMEM);
+	rdr->esr_stream = es;
+
+	/* The footer can be longer than a whole chunk if chunks are tiny. */
+	footerlen = 2 * sizeof (uint32_t) + 1 + sizeof (uint32_t) +
+	    2 * sizeof (uint64_t) + sizeof (uint32_t) +
+	    EBOX_STREAM_MERKLE_LEN + ssh_hmac_bytes(es->es_dgalg);
+	rdr->esr_max = ebox_stream_frame_len(es);
+	if (rdr->esr_max < footerlen)
+		rdr->esr_max = footerlen;
+
+	rdr->esr_want = 2 * sizeof (uint32_t);
+
+	*prdr = rdr;
+	return (ERRF_OK);
+}
+
+void
+ebox_stream_reader_free(struct ebox_stream_reader *rdr)
+{
+	free(rdr);
+}
+
+boolean_t
+ebox_stream_reader_partial(const struct ebox_stream_reader *rdr)
+{
+	return (rdr->esr_have > 0);
+}
+
+errf_t *
+ebox_stream_reader_next(struct ebox_stream_reader *rdr, struct sshbuf *buf,
+    uint8_t **ptr, size_t *len)
+{
+	size_t n;
+	int rc;
+
+	VERIFY3U(rdr->esr_space, ==, 0);
+	VERIFY3U(rdr->esr_have, <, rdr->esr_want);
+	n = rdr->esr_want - rdr->esr_have;
+	if ((rc = sshbuf_reserve(buf, n, ptr)))
+		return (ssherrf("sshbuf_reserve", rc));
+	rdr->esr_space = n;
+	*len = n;
+	return (ERRF_OK);
+}
+
+errf_t *
+ebox_stream_reader_advance(struct ebox_stream_reader *rdr,
+    struct sshbuf *buf, size_t n, boolean_t *done)
+{
+	const uint8_t *p;
+	uint32_t elen;
+
+	VERIFY3U(n, <=, rdr->esr_space);
+	VERIFY0(sshbuf_consume_end(buf, rdr->esr_space - n));
+	rdr->esr_space = 0;
+	rdr->esr_have += n;
+	*done = B_FALSE;
+
+	if (rdr->esr_have < rdr->esr_want)
+		return (ERRF_OK);
+
+	if (!rdr->esr_body) {
+		p = sshbuf_ptr(buf) + sshbuf_len(buf) - rdr->esr_have;
+		elen = PEEK_U32(p + sizeof (uint32_t));
+		if (elen > rdr->esr_max - 2 * sizeof (uint32_t)) {
+			return (errf("LengthError", NULL, "Stream frame length "
+			    "(%u) is longer than a whole chunk (%zu)", elen,
+			    rdr->esr_max - 2 * sizeof (uint32_t)));
+		}
+		rdr->esr_body = B_TRUE;
+		rdr->esr_want += elen;
+		if (rdr->esr_have < rdr->esr_want)
+			return (ERRF_OK);
+	}
+
+	rdr->esr_body = B_FALSE;
+	rdr->esr_want = 2 * sizeof (uint32_t);
+	rdr->esr_have = 0;
+	*done = B_TRUE;
+	return (ERRF_OK);
+}
+
+
+static errf_t *
+sshbuf_get_ebox_part(struct sshbuf *buf, const struct ebox *ebox,
+    struct ebox_part **ppart)
 {
 	struct ebox_part *part;
 	struct ebox_tpl_part *tpart;
 	struct sshbuf *kbuf;
 	int rc = 0;
 	size_t len;
-	uint8_t tag, *guid;
+	uint8_t tag;
+	const uint8_t *guid;
 	errf_t *err = NULL;
 	char *tname = NULL;
 	struct sshkey *k = NULL, *ephk;
 	struct piv_ecdh_box *box = NULL;
 	boolean_t gotguid = B_FALSE;
 	uint8_t slot = PIV_SLOT_KEY_MGMT;
+	struct ebox_arena *ea = ebox->e_arena;
 
-	part = calloc(1, sizeof (struct ebox_part));
+	part = ebox_arena_node(ea, sizeof (struct ebox_part));
 	VERIFY(part != NULL);
+	part->ep_arena = ea;
 
-	part->ep_tpl = calloc(1, sizeof (struct ebox_tpl_part));
+	part->ep_tpl = ebox_arena_node(ea, sizeof (struct ebox_tpl_part));
 	VERIFY(part->ep_tpl != NULL);
 	tpart = part->ep_tpl;
+	tpart->etp_arena = ea;
 
 	kbuf = sshbuf_new();
 	VERIFY(kbuf != NULL);
@@ -1736,7 +2895,8 @@ sshbuf_get_ebox_part(struct sshbuf *buf, const struct ebox *ebox,
 			}
 			break;
 		case EBOX_PART_NAME:
-			rc = sshbuf_get_cstring8(buf, &tpart->etp_name, &len);
+			rc = sshbuf_get_cstring8_arena(buf, ea,
+			    &tpart->etp_name);
 			if (rc) {
 				err = ssherrf("sshbuf_get_cstring8", rc);
 				goto out;
@@ -1750,7 +2910,7 @@ sshbuf_get_ebox_part(struct sshbuf *buf, const struct ebox *ebox,
 			}
 			break;
 		case EBOX_PART_GUID:
-			rc = sshbuf_get_string8(buf, &guid, &len);
+			rc = sshbuf_get_string8_direct(buf, &guid, &len);
 			if (rc) {
 				err = ssherrf("sshbuf_get_string8", rc);
 				goto out;
@@ -1761,8 +2921,6 @@ sshbuf_get_ebox_part(struct sshbuf *buf, const struct ebox *ebox,
 				goto out;
 			}
 			bcopy(guid, tpart->etp_guid, len);
-			free(guid);
-			guid = NULL;
 			gotguid = B_TRUE;
 			break;
 		case EBOX_PART_BOX:
@@ -1912,6 +3070,8 @@ sshbuf_get_ebox_part(struct sshbuf *buf, const struct ebox *ebox,
 	part = NULL;
 out:
 	sshbuf_free(kbuf);
+	if (part != NULL)
+		ebox_tpl_part_free(part->ep_tpl);
 	ebox_part_free(part);
 	piv_box_free(box);
 	sshkey_free(k);
@@ -1931,13 +3091,16 @@ sshbuf_get_ebox_config(struct sshbuf *buf, const struct ebox *ebox,
 	uint8_t type;
 	uint i, id;
 	errf_t *err = NULL;
+	struct ebox_arena *ea = ebox->e_arena;
 
-	config = calloc(1, sizeof (struct ebox_config));
+	config = ebox_arena_node(ea, sizeof (struct ebox_config));
 	VERIFY(config != NULL);
+	config->ec_arena = ea;
 
-	config->ec_tpl = calloc(1, sizeof (struct ebox_tpl_config));
+	config->ec_tpl = ebox_arena_node(ea, sizeof (struct ebox_tpl_config));
 	VERIFY(config->ec_tpl != NULL);
 	tconfig = config->ec_tpl;
+	tconfig->etc_arena = ea;
 
 	if ((rc = sshbuf_get_u8(buf, &type)) ||
 	    (rc = sshbuf_get_u8(buf, &tconfig->etc_n)) ||
@@ -1953,8 +3116,8 @@ sshbuf_get_ebox_config(struct sshbuf *buf, const struct ebox *ebox,
 		goto out;
 	}
 	if (ebox->e_version >= EBOX_V3) {
-		rc = sshbuf_get_string8(buf, &config->ec_nonce,
-		    &config->ec_noncelen);
+		rc = sshbuf_get_string8_arena(buf, ea, B_TRUE,
+		    &config->ec_nonce, &config->ec_noncelen);
 		if (rc) {
 			err = ssherrf("sshbuf_get_string8", rc);
 			goto out;
@@ -1991,68 +3154,758 @@ sshbuf_get_ebox_config(struct sshbuf *buf, const struct ebox *ebox,
 		part->ep_tpl->etp_prev = tpart;
 		tpart = part->ep_tpl;
 	}
-
-	*pconfig = config;
-	config = NULL;
+
+	*pconfig = config;
+	config = NULL;
+
+out:
+	if (config != NULL)
+		ebox_tpl_config_free(config->ec_tpl);
+	ebox_config_free(config);
+	return (err);
+}
+
+static errf_t *
+sshbuf_get_ebox_ephem_key(struct sshbuf *buf, struct ebox_arena *ea,
+    struct ebox_ephem_key **peek)
+{
+	struct ebox_ephem_key *eek = NULL;
+	char *tname = NULL;
+	struct sshkey *k = NULL;
+	errf_t *err = NULL;
+	int rc;
+
+	eek = ebox_arena_node(ea, sizeof (struct ebox_ephem_key));
+	if (eek == NULL)
+		return (ERRF_NOMEM);
+	eek->eek_arena = ea;
+
+	if ((rc = sshbuf_get_cstring8(buf, &tname, NULL))) {
+		err = ssherrf("sshbuf_get_cstring8", rc);
+		goto out;
+	}
+	eek->eek_ephem = (k = sshkey_new(KEY_ECDSA));
+	if (k == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+	k->ecdsa_nid = (eek->eek_nid = sshkey_curve_name_to_nid(tname));
+	if (k->ecdsa_nid == -1) {
+		err = errf("CurveError", NULL, "EC curve '%s' "
+		    "not supported", tname);
+		goto out;
+	}
+	k->ecdsa = EC_KEY_new_by_curve_name(k->ecdsa_nid);
+	VERIFY(k->ecdsa != NULL);
+	rc = sshbuf_get_eckey8(buf, k->ecdsa);
+	if (rc) {
+		err = ssherrf("sshbuf_get_eckey8", rc);
+		goto out;
+	}
+	rc = sshkey_ec_validate_public(
+	    EC_KEY_get0_group(k->ecdsa),
+	    EC_KEY_get0_public_key(k->ecdsa));
+	if (rc) {
+		err = ssherrf("sshkey_ec_validate_public", rc);
+		goto out;
+	}
+
+	*peek = eek;
+	eek = NULL;
+	k = NULL;
+	err = ERRF_OK;
+
+out:
+	sshkey_free(k);
+	if (eek != NULL)
+		ebox_arena_node_free(ea, eek);
+	free(tname);
+	return (err);
+}
+
+/*
+ * The V4 "compact" encoding holds exactly what a V3 ebox does, but is meant
+ * for where eboxes are stored by the thousand (ZFS user properties, LUKS2
+ * tokens), so it drops most of the redundancy in the V3 layout:
+ *
+ *  - curve, cipher and KDF names become one-byte IDs (with 0 meaning "some
+ *    other name follows as a cstring8")
+ *  - EC public keys (including an EC CAK) are a curve ID and a bare
+ *    compressed point, whose length follows from the curve
+ *  - the box cipher and KDF, which are nearly always the same for every
+ *    part, are given once in the header and only repeated by a part which
+ *    differs
+ *  - the part TLV tags become a single flags byte, the GUID is a bare 16
+ *    bytes and the slot is only present when it's not 9D
+ *  - data lengths are varints rather than u32s
+ *
+ * It is only written when asked for (sshbuf_put_ebox_compact()), so that
+ * eboxes still go to older versions as V3 by default.
+ */
+enum ebox_cpart_flag {
+	EBOX_CPART_NAME = 1 << 0,
+	EBOX_CPART_CAK = 1 << 1,
+	EBOX_CPART_SLOT = 1 << 2,
+	EBOX_CPART_ALGS = 1 << 3,
+	EBOX_CPART_KNOWN_FLAGS = 0x0f
+};
+
+static const int ebox_curve_ids[] = {
+	-1,
+	NID_X9_62_prime256v1,
+	NID_secp384r1,
+	NID_secp521r1
+};
+static const char *ebox_cipher_ids[] = {
+	NULL,
+	"chacha20-poly1305",
+	"aes256-gcm",
+	"aes128-gcm"
+};
+static const char *ebox_kdf_ids[] = {
+	NULL,
+	"sha512",
+	"sha384",
+	"sha256"
+};
+#define	EBOX_NIDS(tbl)	(sizeof (tbl) / sizeof (tbl[0]))
+
+/* Largest length we'll write as a varint (3 bytes of 7 bits) */
+#define	EBOX_VLEN_MAX	((1U << 21) - 1)
+
+static int
+sshbuf_put_vlen(struct sshbuf *buf, size_t len)
+{
+	int rc;
+
+	if (len > EBOX_VLEN_MAX)
+		return (SSH_ERR_INVALID_ARGUMENT);
+	while (len >= 0x80) {
+		if ((rc = sshbuf_put_u8(buf, 0x80 | (len & 0x7f))))
+			return (rc);
+		len >>= 7;
+	}
+	return (sshbuf_put_u8(buf, len));
+}
+
+static int
+sshbuf_get_vlen(struct sshbuf *buf, size_t *lenp)
+{
+	size_t len = 0;
+	uint8_t v;
+	uint i;
+	int rc;
+
+	for (i = 0; i < 3; ++i) {
+		if ((rc = sshbuf_get_u8(buf, &v)))
+			return (rc);
+		len |= (size_t)(v & 0x7f) << (7 * i);
+		if ((v & 0x80) == 0) {
+			*lenp = len;
+			return (0);
+		}
+	}
+	return (SSH_ERR_INVALID_FORMAT);
+}
+
+static int
+sshbuf_put_ebox_alg(struct sshbuf *buf, const char **tbl, size_t ntbl,
+    const char *name)
+{
+	uint8_t i;
+	int rc;
+
+	for (i = 1; i < ntbl; ++i) {
+		if (strcmp(tbl[i], name) == 0)
+			return (sshbuf_put_u8(buf, i));
+	}
+	if ((rc = sshbuf_put_u8(buf, 0)))
+		return (rc);
+	return (sshbuf_put_cstring8(buf, name));
+}
+
+/* The name we get back is malloc()ed. */
+static int
+sshbuf_get_ebox_alg(struct sshbuf *buf, const char **tbl, size_t ntbl,
+    char **namep)
+{
+	uint8_t id;
+	int rc;
+
+	if ((rc = sshbuf_get_u8(buf, &id)))
+		return (rc);
+	if (id == 0)
+		return (sshbuf_get_cstring8(buf, namep, NULL));
+	if (id >= ntbl)
+		return (SSH_ERR_INVALID_FORMAT);
+	if ((*namep = strdup(tbl[id])) == NULL)
+		return (SSH_ERR_ALLOC_FAIL);
+	return (0);
+}
+
+static int
+sshbuf_put_ebox_point(struct sshbuf *buf, const struct sshkey *k)
+{
+	u_char d[SSHBUF_MAX_ECPOINT];
+	const EC_GROUP *g = EC_KEY_get0_group(k->ecdsa);
+	const EC_POINT *pt = EC_KEY_get0_public_key(k->ecdsa);
+	size_t len;
+	uint8_t id;
+	int rc;
+
+	for (id = 1; id < EBOX_NIDS(ebox_curve_ids); ++id) {
+		if (ebox_curve_ids[id] == k->ecdsa_nid)
+			break;
+	}
+	if (id >= EBOX_NIDS(ebox_curve_ids))
+		return (SSH_ERR_EC_CURVE_INVALID);
+	len = EC_POINT_point2oct(g, pt, POINT_CONVERSION_COMPRESSED, d,
+	    sizeof (d), NULL);
+	if (len == 0)
+		return (SSH_ERR_LIBCRYPTO_ERROR);
+	if ((rc = sshbuf_put_u8(buf, id)) || (rc = sshbuf_put(buf, d, len)))
+		return (rc);
+	return (0);
+}
+
+static errf_t *
+sshbuf_get_ebox_point(struct sshbuf *buf, struct sshkey **pk)
+{
+	struct sshkey *k = NULL;
+	const EC_GROUP *g;
+	EC_POINT *pt = NULL;
+	const u_char *d;
+	size_t len;
+	uint8_t id;
+	errf_t *err = ERRF_OK;
+	int rc;
+
+	if ((rc = sshbuf_get_u8(buf, &id)))
+		return (ssherrf("sshbuf_get_u8", rc));
+	if (id == 0 || id >= EBOX_NIDS(ebox_curve_ids)) {
+		return (errf("CurveError", NULL, "EC curve ID %u not "
+		    "supported", id));
+	}
+	if ((k = sshkey_new(KEY_ECDSA)) == NULL)
+		return (ERRF_NOMEM);
+	k->ecdsa_nid = ebox_curve_ids[id];
+	k->ecdsa = EC_KEY_new_by_curve_name(k->ecdsa_nid);
+	VERIFY(k->ecdsa != NULL);
+	g = EC_KEY_get0_group(k->ecdsa);
+
+	len = 1 + (EC_GROUP_get_degree(g) + 7) / 8;
+	d = sshbuf_ptr(buf);
+	if (sshbuf_len(buf) < len || (d[0] & ~0x1) !=
+	    POINT_CONVERSION_COMPRESSED) {
+		err = errf("InvalidDataError", NULL, "truncated or invalid "
+		    "EC point");
+		goto out;
+	}
+	if ((pt = EC_POINT_new(g)) == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+	if (EC_POINT_oct2point(g, pt, d, len, NULL) != 1 ||
+	    EC_KEY_set_public_key(k->ecdsa, pt) != 1) {
+		err = errf("InvalidDataError", NULL, "invalid EC point");
+		goto out;
+	}
+	VERIFY0(sshbuf_consume(buf, len));
+	rc = sshkey_ec_validate_public(g, EC_KEY_get0_public_key(k->ecdsa));
+	if (rc) {
+		err = ssherrf("sshkey_ec_validate_public", rc);
+		goto out;
+	}
+	*pk = k;
+	k = NULL;
+
+out:
+	EC_POINT_free(pt);
+	sshkey_free(k);
+	return (err);
+}
+
+struct ebox_compact_algs {
+	char	*eca_cipher;
+	char	*eca_kdf;
+};
+
+static errf_t *
+sshbuf_get_ebox_compact_part(struct sshbuf *buf, const struct ebox *ebox,
+    const struct ebox_compact_algs *algs, struct ebox_part **ppart)
+{
+	struct ebox_part *part;
+	struct ebox_tpl_part *tpart;
+	struct piv_ecdh_box *box = NULL;
+	struct sshkey *ephk;
+	struct ebox_arena *ea = ebox->e_arena;
+	const u_char *p;
+	uint8_t flags, slot = PIV_SLOT_KEY_MGMT, id;
+	size_t len;
+	errf_t *err = NULL;
+	int rc;
+
+	part = ebox_arena_node(ea, sizeof (struct ebox_part));
+	VERIFY(part != NULL);
+	part->ep_arena = ea;
+
+	part->ep_tpl = ebox_arena_node(ea, sizeof (struct ebox_tpl_part));
+	VERIFY(part->ep_tpl != NULL);
+	tpart = part->ep_tpl;
+	tpart->etp_arena = ea;
+
+	if ((rc = sshbuf_get_u8(buf, &flags)) ||
+	    (rc = sshbuf_get(buf, tpart->etp_guid,
+	    sizeof (tpart->etp_guid)))) {
+		err = ssherrf("sshbuf_get", rc);
+		goto out;
+	}
+	if ((flags & ~EBOX_CPART_KNOWN_FLAGS) != 0) {
+		err = errf("TagError", NULL, "unknown ebox part flags 0x%02x",
+		    flags);
+		goto out;
+	}
+	if ((flags & EBOX_CPART_SLOT) &&
+	    (rc = sshbuf_get_u8(buf, &slot))) {
+		err = ssherrf("sshbuf_get_u8", rc);
+		goto out;
+	}
+	if ((flags & EBOX_CPART_NAME) &&
+	    (rc = sshbuf_get_cstring8_arena(buf, ea, &tpart->etp_name))) {
+		err = ssherrf("sshbuf_get_cstring8", rc);
+		goto out;
+	}
+	if (flags & EBOX_CPART_CAK) {
+		/* An EC CAK is compact, anything else is an SSH key blob. */
+		if (sshbuf_len(buf) < 1) {
+			err = ssherrf("sshbuf_get_u8",
+			    SSH_ERR_MESSAGE_INCOMPLETE);
+			goto out;
+		}
+		if (*sshbuf_ptr(buf) != 0) {
+			err = sshbuf_get_ebox_point(buf, &tpart->etp_cak);
+			if (err)
+				goto out;
+		} else if ((rc = sshbuf_get_u8(buf, &id)) ||
+		    (rc = sshbuf_get_vlen(buf, &len))) {
+			err = ssherrf("sshbuf_get_vlen", rc);
+			goto out;
+		} else if (sshbuf_len(buf) < len) {
+			err = ssherrf("sshbuf_get", SSH_ERR_MESSAGE_INCOMPLETE);
+			goto out;
+		} else {
+			p = sshbuf_ptr(buf);
+			rc = sshkey_from_blob(p, len, &tpart->etp_cak);
+			if (rc) {
+				err = ssherrf("sshkey_from_blob", rc);
+				goto out;
+			}
+			VERIFY0(sshbuf_consume(buf, len));
+		}
+	}
+
+	box = piv_box_new();
+	if (box == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+	box->pdb_guidslot_valid = B_TRUE;
+	box->pdb_free_str = B_TRUE;
+	if (flags & EBOX_CPART_ALGS) {
+		if ((rc = sshbuf_get_ebox_alg(buf, ebox_cipher_ids,
+		    EBOX_NIDS(ebox_cipher_ids), (char **)&box->pdb_cipher)) ||
+		    (rc = sshbuf_get_ebox_alg(buf, ebox_kdf_ids,
+		    EBOX_NIDS(ebox_kdf_ids), (char **)&box->pdb_kdf))) {
+			err = ssherrf("sshbuf_get_ebox_alg", rc);
+			goto out;
+		}
+	} else {
+		box->pdb_cipher = strdup(algs->eca_cipher);
+		box->pdb_kdf = strdup(algs->eca_kdf);
+		if (box->pdb_cipher == NULL || box->pdb_kdf == NULL) {
+			err = ERRF_NOMEM;
+			goto out;
+		}
+	}
+	rc = sshbuf_get_string8(buf, &box->pdb_nonce.b_data,
+	    &box->pdb_nonce.b_size);
+	if (rc) {
+		err = ssherrf("sshbuf_get_string8", rc);
+		goto out;
+	}
+	box->pdb_nonce.b_len = box->pdb_nonce.b_size;
+
+	if ((err = sshbuf_get_ebox_point(buf, &box->pdb_pub)))
+		goto out;
+	ephk = ebox_get_ephem_for_nid(ebox, box->pdb_pub->ecdsa_nid);
+	if (ephk == NULL) {
+		err = errf("CurveError", NULL, "No ephemeral key found for "
+		    "EC curve '%s'",
+		    sshkey_curve_nid_to_name(box->pdb_pub->ecdsa_nid));
+		goto out;
+	}
+	VERIFY0(sshkey_demote(ephk, &box->pdb_ephem_pub));
+
+	if ((rc = sshbuf_get_string8(buf, &box->pdb_iv.b_data,
+	    &box->pdb_iv.b_size))) {
+		err = ssherrf("sshbuf_get_string8", rc);
+		goto out;
+	}
+	box->pdb_iv.b_len = box->pdb_iv.b_size;
+
+	if ((rc = sshbuf_get_vlen(buf, &len))) {
+		err = ssherrf("sshbuf_get_vlen", rc);
+		goto out;
+	}
+	if ((box->pdb_enc.b_data = malloc(len + 1)) == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+	box->pdb_enc.b_size = len;
+	if ((rc = sshbuf_get(buf, box->pdb_enc.b_data, len))) {
+		err = ssherrf("sshbuf_get", rc);
+		goto out;
+	}
+	box->pdb_enc.b_len = len;
+
+	box->pdb_slot = slot;
+	tpart->etp_slot = slot;
+	bcopy(tpart->etp_guid, box->pdb_guid, sizeof (box->pdb_guid));
+	rc = sshkey_demote(box->pdb_pub, &tpart->etp_pubkey);
+	if (rc) {
+		err = ssherrf("sshkey_demote", rc);
+		goto out;
+	}
+	part->ep_box = box;
+	box = NULL;
+
+	*ppart = part;
+	part = NULL;
+out:
+	if (part != NULL)
+		ebox_tpl_part_free(part->ep_tpl);
+	ebox_part_free(part);
+	piv_box_free(box);
+	return (err);
+}
+
+static errf_t *
+sshbuf_get_ebox_compact_config(struct sshbuf *buf, const struct ebox *ebox,
+    const struct ebox_compact_algs *algs, struct ebox_config **pconfig)
+{
+	struct ebox_config *config;
+	struct ebox_tpl_config *tconfig;
+	struct ebox_part *part, **pnext;
+	struct ebox_tpl_part *tpart = NULL;
+	int rc = 0;
+	uint8_t type;
+	uint i;
+	errf_t *err = NULL;
+	struct ebox_arena *ea = ebox->e_arena;
+
+	config = ebox_arena_node(ea, sizeof (struct ebox_config));
+	VERIFY(config != NULL);
+	config->ec_arena = ea;
+
+	config->ec_tpl = ebox_arena_node(ea, sizeof (struct ebox_tpl_config));
+	VERIFY(config->ec_tpl != NULL);
+	tconfig = config->ec_tpl;
+	tconfig->etc_arena = ea;
+
+	if ((rc = sshbuf_get_u8(buf, &type)) ||
+	    (rc = sshbuf_get_u8(buf, &tconfig->etc_n)) ||
+	    (rc = sshbuf_get_u8(buf, &tconfig->etc_m))) {
+		err = ssherrf("sshbuf_get_u8", rc);
+		goto out;
+	}
+	tconfig->etc_type = (enum ebox_config_type)type;
+	if (tconfig->etc_type != EBOX_PRIMARY &&
+	    tconfig->etc_type != EBOX_RECOVERY) {
+		err = errf("UnknownConfigType", NULL,
+		    "ebox config has unknown type: 0x%02x", tconfig->etc_type);
+		goto out;
+	}
+	rc = sshbuf_get_string8_arena(buf, ea, B_TRUE, &config->ec_nonce,
+	    &config->ec_noncelen);
+	if (rc) {
+		err = ssherrf("sshbuf_get_string8", rc);
+		goto out;
+	}
+	if (config->ec_noncelen > 0 && tconfig->etc_type != EBOX_RECOVERY) {
+		err = errf("InvalidConfig", NULL,
+		    "ebox config is PRIMARY but has config nonce");
+		goto out;
+	}
+	if (tconfig->etc_type == EBOX_PRIMARY && tconfig->etc_n > 1) {
+		err = errf("InvalidConfig", NULL,
+		    "ebox config is PRIMARY but has n > 1 (n = %d)",
+		    tconfig->etc_n);
+		goto out;
+	}
+	if (tconfig->etc_m < 1) {
+		err = errf("InvalidConfig", NULL, "ebox config has no parts");
+		goto out;
+	}
+
+	pnext = &config->ec_parts;
+	for (i = 0; i < tconfig->etc_m; ++i) {
+		err = sshbuf_get_ebox_compact_part(buf, ebox, algs, pnext);
+		if (err)
+			goto out;
+		part = *pnext;
+		part->ep_id = i + 1;
+		if (tpart == NULL) {
+			tconfig->etc_parts = part->ep_tpl;
+		} else {
+			tpart->etp_next = part->ep_tpl;
+			part->ep_tpl->etp_prev = tpart;
+		}
+		tpart = part->ep_tpl;
+		pnext = &part->ep_next;
+	}
+
+	*pconfig = config;
+	config = NULL;
+
+out:
+	if (config != NULL)
+		ebox_tpl_config_free(config->ec_tpl);
+	ebox_config_free(config);
+	return (err);
+}
+
+/* Everything after the magic, version and type. */
+static errf_t *
+sshbuf_get_ebox_compact(struct sshbuf *buf, struct ebox *box)
+{
+	struct ebox_compact_algs algs;
+	struct ebox_ephem_key *eek;
+	struct ebox_config *config, **pnext;
+	struct ebox_tpl_config *tconfig = NULL;
+	struct ebox_arena *ea = box->e_arena;
+	uint8_t neeks, nconfigs;
+	char *cipher = NULL;
+	errf_t *err = NULL;
+	uint i;
+	int rc;
+
+	bzero(&algs, sizeof (algs));
+
+	rc = sshbuf_get_ebox_alg(buf, ebox_cipher_ids,
+	    EBOX_NIDS(ebox_cipher_ids), &cipher);
+	if (rc) {
+		err = ssherrf("sshbuf_get_ebox_alg", rc);
+		goto out;
+	}
+	box->e_rcv_cipher = ebox_arena_strdup(ea, cipher);
+	if (box->e_rcv_cipher == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+	if ((rc = sshbuf_get_string8_arena(buf, ea, B_FALSE,
+	    &box->e_rcv_iv.b_data, &box->e_rcv_iv.b_len)) ||
+	    (rc = sshbuf_get_string8_arena(buf, ea, B_FALSE,
+	    &box->e_rcv_enc.b_data, &box->e_rcv_enc.b_len))) {
+		err = ssherrf("sshbuf_get_string8", rc);
+		goto out;
+	}
+	if ((rc = sshbuf_get_ebox_alg(buf, ebox_cipher_ids,
+	    EBOX_NIDS(ebox_cipher_ids), &algs.eca_cipher)) ||
+	    (rc = sshbuf_get_ebox_alg(buf, ebox_kdf_ids,
+	    EBOX_NIDS(ebox_kdf_ids), &algs.eca_kdf))) {
+		err = ssherrf("sshbuf_get_ebox_alg", rc);
+		goto out;
+	}
+
+	if ((rc = sshbuf_get_u8(buf, &neeks))) {
+		err = ssherrf("sshbuf_get_u8", rc);
+		goto out;
+	}
+	for (i = 0; i < neeks; ++i) {
+		eek = ebox_arena_node(ea, sizeof (struct ebox_ephem_key));
+		if (eek == NULL) {
+			err = ERRF_NOMEM;
+			goto out;
+		}
+		eek->eek_arena = ea;
+		if ((err = sshbuf_get_ebox_point(buf, &eek->eek_ephem))) {
+			ebox_arena_node_free(ea, eek);
+			goto out;
+		}
+		eek->eek_nid = eek->eek_ephem->ecdsa_nid;
+		eek->eek_next = box->e_ephemkeys;
+		box->e_ephemkeys = eek;
+	}
+
+	if ((rc = sshbuf_get_u8(buf, &nconfigs))) {
+		err = ssherrf("sshbuf_get_u8", rc);
+		goto out;
+	}
+	if (nconfigs < 1) {
+		err = errf("InvalidDataError", NULL, "ebox has no configs");
+		goto out;
+	}
+	pnext = &box->e_configs;
+	for (i = 0; i < nconfigs; ++i) {
+		err = sshbuf_get_ebox_compact_config(buf, box, &algs, pnext);
+		if (err)
+			goto out;
+		config = *pnext;
+		if (tconfig == NULL) {
+			box->e_tpl->et_configs = config->ec_tpl;
+		} else {
+			tconfig->etc_next = config->ec_tpl;
+			config->ec_tpl->etc_prev = tconfig;
+		}
+		tconfig = config->ec_tpl;
+		pnext = &config->ec_next;
+	}
 
 out:
-	ebox_config_free(config);
+	free(cipher);
+	free(algs.eca_cipher);
+	free(algs.eca_kdf);
 	return (err);
 }
 
 static errf_t *
-sshbuf_get_ebox_ephem_key(struct sshbuf *buf, struct ebox_ephem_key **peek)
+sshbuf_put_ebox_compact_part(struct sshbuf *buf,
+    const struct ebox_compact_algs *algs, struct ebox_part *part)
 {
-	struct ebox_ephem_key *eek = NULL;
-	char *tname = NULL;
-	struct sshkey *k = NULL;
-	errf_t *err = NULL;
+	struct ebox_tpl_part *tpart = part->ep_tpl;
+	struct piv_ecdh_box *box = part->ep_box;
+	const char *cipher = piv_box_cipher(box), *kdf = piv_box_kdf(box);
+	struct sshbuf *kbuf = NULL;
+	uint8_t flags = 0;
+	errf_t *err = ERRF_OK;
 	int rc;
 
-	eek = calloc(1, sizeof (struct ebox_ephem_key));
-	if (eek == NULL)
-		return (ERRF_NOMEM);
-
-	if ((rc = sshbuf_get_cstring8(buf, &tname, NULL))) {
-		err = ssherrf("sshbuf_get_cstring8", rc);
-		goto out;
+	if (tpart->etp_name != NULL)
+		flags |= EBOX_CPART_NAME;
+	if (tpart->etp_cak != NULL)
+		flags |= EBOX_CPART_CAK;
+	if (tpart->etp_slot != PIV_SLOT_KEY_MGMT)
+		flags |= EBOX_CPART_SLOT;
+	if (strcmp(cipher, algs->eca_cipher) != 0 ||
+	    strcmp(kdf, algs->eca_kdf) != 0)
+		flags |= EBOX_CPART_ALGS;
+
+	if ((rc = sshbuf_put_u8(buf, flags)) ||
+	    (rc = sshbuf_put(buf, tpart->etp_guid,
+	    sizeof (tpart->etp_guid)))) {
+		return (ssherrf("sshbuf_put", rc));
 	}
-	eek->eek_ephem = (k = sshkey_new(KEY_ECDSA));
-	if (k == NULL) {
-		err = ERRF_NOMEM;
-		goto out;
+	if ((flags & EBOX_CPART_SLOT) &&
+	    (rc = sshbuf_put_u8(buf, tpart->etp_slot)))
+		return (ssherrf("sshbuf_put_u8", rc));
+	if ((flags & EBOX_CPART_NAME) &&
+	    (rc = sshbuf_put_cstring8(buf, tpart->etp_name)))
+		return (ssherrf("sshbuf_put_cstring8", rc));
+	if ((flags & EBOX_CPART_CAK) && tpart->etp_cak->type == KEY_ECDSA) {
+		if ((rc = sshbuf_put_ebox_point(buf, tpart->etp_cak)))
+			return (ssherrf("sshbuf_put_ebox_point", rc));
+	} else if (flags & EBOX_CPART_CAK) {
+		if ((kbuf = sshbuf_new()) == NULL)
+			return (ERRF_NOMEM);
+		if ((rc = sshkey_putb(tpart->etp_cak, kbuf)) ||
+		    (rc = sshbuf_put_u8(buf, 0)) ||
+		    (rc = sshbuf_put_vlen(buf, sshbuf_len(kbuf))) ||
+		    (rc = sshbuf_putb(buf, kbuf))) {
+			err = ssherrf("sshbuf_put_*", rc);
+		}
+		sshbuf_free(kbuf);
+		if (err)
+			return (err);
 	}
-	k->ecdsa_nid = (eek->eek_nid = sshkey_curve_name_to_nid(tname));
-	if (k->ecdsa_nid == -1) {
-		err = errf("CurveError", NULL, "EC curve '%s' "
-		    "not supported", tname);
-		goto out;
+	if ((flags & EBOX_CPART_ALGS) &&
+	    ((rc = sshbuf_put_ebox_alg(buf, ebox_cipher_ids,
+	    EBOX_NIDS(ebox_cipher_ids), cipher)) ||
+	    (rc = sshbuf_put_ebox_alg(buf, ebox_kdf_ids,
+	    EBOX_NIDS(ebox_kdf_ids), kdf)))) {
+		return (ssherrf("sshbuf_put_ebox_alg", rc));
+	}
+
+	VERIFY3U(box->pdb_version, >=, PIV_BOX_V2);
+	if ((rc = sshbuf_put_string8(buf, box->pdb_nonce.b_data,
+	    box->pdb_nonce.b_len)) ||
+	    (rc = sshbuf_put_ebox_point(buf, box->pdb_pub)) ||
+	    (rc = sshbuf_put_string8(buf, box->pdb_iv.b_data,
+	    box->pdb_iv.b_len)) ||
+	    (rc = sshbuf_put_vlen(buf, box->pdb_enc.b_len)) ||
+	    (rc = sshbuf_put(buf, box->pdb_enc.b_data, box->pdb_enc.b_len))) {
+		return (ssherrf("sshbuf_put_*", rc));
 	}
-	k->ecdsa = EC_KEY_new_by_curve_name(k->ecdsa_nid);
-	VERIFY(k->ecdsa != NULL);
-	rc = sshbuf_get_eckey8(buf, k->ecdsa);
-	if (rc) {
-		err = ssherrf("sshbuf_get_eckey8", rc);
-		goto out;
+	return (ERRF_OK);
+}
+
+static errf_t *
+sshbuf_put_ebox_compact_body(struct sshbuf *buf, struct ebox *ebox)
+{
+	struct ebox_compact_algs algs;
+	struct ebox_config *config;
+	struct ebox_part *part;
+	struct ebox_ephem_key *eek;
+	uint8_t n = 0;
+	errf_t *err;
+	int rc;
+
+	/* Whatever the first part uses is the default for the rest. */
+	VERIFY(ebox->e_configs != NULL);
+	part = ebox->e_configs->ec_parts;
+	algs.eca_cipher = (char *)piv_box_cipher(part->ep_box);
+	algs.eca_kdf = (char *)piv_box_kdf(part->ep_box);
+
+	if ((rc = sshbuf_put_ebox_alg(buf, ebox_cipher_ids,
+	    EBOX_NIDS(ebox_cipher_ids), ebox->e_rcv_cipher)) ||
+	    (rc = sshbuf_put_string8(buf, ebox->e_rcv_iv.b_data,
+	    ebox->e_rcv_iv.b_len)) ||
+	    (rc = sshbuf_put_string8(buf, ebox->e_rcv_enc.b_data,
+	    ebox->e_rcv_enc.b_len)) ||
+	    (rc = sshbuf_put_ebox_alg(buf, ebox_cipher_ids,
+	    EBOX_NIDS(ebox_cipher_ids), algs.eca_cipher)) ||
+	    (rc = sshbuf_put_ebox_alg(buf, ebox_kdf_ids,
+	    EBOX_NIDS(ebox_kdf_ids), algs.eca_kdf))) {
+		return (ssherrf("sshbuf_put_*", rc));
 	}
-	rc = sshkey_ec_validate_public(
-	    EC_KEY_get0_group(k->ecdsa),
-	    EC_KEY_get0_public_key(k->ecdsa));
-	if (rc) {
-		err = ssherrf("sshkey_ec_validate_public", rc);
-		goto out;
+
+	for (eek = ebox->e_ephemkeys; eek != NULL; eek = eek->eek_next)
+		++n;
+	if ((rc = sshbuf_put_u8(buf, n)))
+		return (ssherrf("sshbuf_put_u8", rc));
+	for (eek = ebox->e_ephemkeys; eek != NULL; eek = eek->eek_next) {
+		if ((rc = sshbuf_put_ebox_point(buf, eek->eek_ephem)))
+			return (ssherrf("sshbuf_put_ebox_point", rc));
 	}
 
-	*peek = eek;
-	eek = NULL;
-	k = NULL;
-	err = ERRF_OK;
+	n = 0;
+	for (config = ebox->e_configs; config != NULL; config = config->ec_next)
+		++n;
+	if ((rc = sshbuf_put_u8(buf, n)))
+		return (ssherrf("sshbuf_put_u8", rc));
+	for (config = ebox->e_configs; config != NULL;
+	    config = config->ec_next) {
+		if ((rc = sshbuf_put_u8(buf, config->ec_tpl->etc_type)) ||
+		    (rc = sshbuf_put_u8(buf, config->ec_tpl->etc_n)) ||
+		    (rc = sshbuf_put_u8(buf, config->ec_tpl->etc_m))) {
+			return (ssherrf("sshbuf_put_u8", rc));
+		}
+		if (config->ec_noncelen > 0 && config->ec_nonce != NULL) {
+			rc = sshbuf_put_string8(buf, config->ec_nonce,
+			    config->ec_noncelen);
+		} else {
+			rc = sshbuf_put_u8(buf, 0);
+		}
+		if (rc)
+			return (ssherrf("sshbuf_put_string8", rc));
+		for (part = config->ec_parts; part != NULL;
+		    part = part->ep_next) {
+			err = sshbuf_put_ebox_compact_part(buf, &algs, part);
+			if (err)
+				return (err);
+		}
+	}
 
-out:
-	sshkey_free(k);
-	free(eek);
-	free(tname);
-	return (err);
+	return (ERRF_OK);
 }
 
 errf_t *
@@ -2065,12 +3918,16 @@ sshbuf_get_ebox(struct sshbuf *buf, struct ebox **pbox)
 	uint8_t ver, magic[2], type, nconfigs;
 	uint i;
 	errf_t *err = NULL;
+	struct ebox_arena *ea;
 
-	box = calloc(1, sizeof (struct ebox));
+	ea = ebox_arena_new();
+	box = ebox_arena_node(ea, sizeof (struct ebox));
 	VERIFY(box != NULL);
+	box->e_arena = ea;
 
-	box->e_tpl = calloc(1, sizeof (struct ebox_tpl));
+	box->e_tpl = ebox_arena_node(ea, sizeof (struct ebox_tpl));
 	VERIFY(box->e_tpl != NULL);
+	box->e_tpl->et_arena = ea;
 
 	box->e_tpl->et_version = EBOX_TPL_VNEXT - 1;
 
@@ -2095,7 +3952,8 @@ sshbuf_get_ebox(struct sshbuf *buf, struct ebox **pbox)
 		    "unsupported version number 0x%02x", ver));
 		goto out;
 	}
-	if (type != EBOX_KEY && type != EBOX_STREAM) {
+	if (type != EBOX_KEY && type != EBOX_STREAM &&
+	    type != EBOX_STREAM_V2) {
 		err = boxderrf(errf("EboxTypeError", NULL,
 		    "buffer does not contain an ebox"));
 		goto out;
@@ -2103,19 +3961,27 @@ sshbuf_get_ebox(struct sshbuf *buf, struct ebox **pbox)
 	box->e_version = ver;
 	box->e_type = (enum ebox_type)type;
 
-	if ((rc = sshbuf_get_cstring8(buf, &box->e_rcv_cipher, NULL))) {
+	if (box->e_version >= EBOX_V4) {
+		if ((err = sshbuf_get_ebox_compact(buf, box))) {
+			err = boxderrf(err);
+			goto out;
+		}
+		goto done;
+	}
+
+	if ((rc = sshbuf_get_cstring8_arena(buf, ea, &box->e_rcv_cipher))) {
 		err = boxderrf(ssherrf("sshbuf_get_u8", rc));
 		goto out;
 	}
-	rc = sshbuf_get_string8(buf, &box->e_rcv_iv.b_data,
+	rc = sshbuf_get_string8_arena(buf, ea, B_FALSE, &box->e_rcv_iv.b_data,
 	    &box->e_rcv_iv.b_len);
 	if (rc) {
 		err = boxderrf(ssherrf("sshbuf_get_string8", rc));
 		goto out;
 	}
 
-	rc = sshbuf_get_string8(buf, &box->e_rcv_enc.b_data,
-	    &box->e_rcv_enc.b_len);
+	rc = sshbuf_get_string8_arena(buf, ea, B_FALSE,
+	    &box->e_rcv_enc.b_data, &box->e_rcv_enc.b_len);
 	if (rc) {
 		err = boxderrf(ssherrf("sshbuf_get_string8", rc));
 		goto out;
@@ -2131,7 +3997,8 @@ sshbuf_get_ebox(struct sshbuf *buf, struct ebox **pbox)
 		}
 
 		for (i = 0; i < neeks; ++i) {
-			if ((err = sshbuf_get_ebox_ephem_key(buf, &eek))) {
+			err = sshbuf_get_ebox_ephem_key(buf, ea, &eek);
+			if (err) {
 				err = boxderrf(err);
 				goto out;
 			}
@@ -2165,6 +4032,7 @@ sshbuf_get_ebox(struct sshbuf *buf, struct ebox **pbox)
 		tconfig = config->ec_tpl;
 	}
 
+done:
 	*pbox = box;
 	box = NULL;
 
@@ -2361,6 +4229,9 @@ sshbuf_put_ebox(struct sshbuf *buf, struct ebox *ebox)
 		return (ssherrf("sshbuf_put_u8", rc));
 	}
 
+	if (ebox->e_version >= EBOX_V4)
+		return (sshbuf_put_ebox_compact_body(buf, ebox));
+
 	if ((rc = sshbuf_put_cstring8(buf, ebox->e_rcv_cipher))) {
 		return (ssherrf("sshbuf_put_cstring8", rc));
 	}
@@ -2401,6 +4272,24 @@ sshbuf_put_ebox(struct sshbuf *buf, struct ebox *ebox)
 	return (NULL);
 }
 
+errf_t *
+sshbuf_put_ebox_compact(struct sshbuf *buf, struct ebox *ebox)
+{
+	int rc;
+
+	/* V1 eboxes don't share their ephemeral keys, so can't be compacted */
+	if (ebox->e_version < EBOX_V2)
+		return (sshbuf_put_ebox(buf, ebox));
+
+	if ((rc = sshbuf_put_u8(buf, 0xEB)) ||
+	    (rc = sshbuf_put_u8(buf, 0x0C)) ||
+	    (rc = sshbuf_put_u8(buf, EBOX_V4)) ||
+	    (rc = sshbuf_put_u8(buf, ebox->e_type))) {
+		return (ssherrf("sshbuf_put_u8", rc));
+	}
+	return (sshbuf_put_ebox_compact_body(buf, ebox));
+}
+
 struct ebox_config *
 ebox_next_config(const struct ebox *box, const struct ebox_config *prev)
 {
@@ -2589,12 +4478,13 @@ ebox_encrypt_recovery(struct ebox *box)
 	VERIFY3U(padding, <=, blocksz);
 	VERIFY3U(padding, >, 0);
 	plainlen += padding;
-	plain = malloc_conceal(plainlen);
+	plain = zalloc_conceal(plainlen);
+	VERIFY(plain != NULL);
 	bcopy(box->e_rcv_plain.b_data, plain, box->e_rcv_plain.b_len);
 	for (i = box->e_rcv_plain.b_len; i < plainlen; ++i)
 		plain[i] = padding;
 
-	freezero(box->e_rcv_plain.b_data, box->e_rcv_plain.b_len);
+	freezero_conceal(box->e_rcv_plain.b_data, box->e_rcv_plain.b_len);
 	box->e_rcv_plain.b_data = NULL;
 	box->e_rcv_plain.b_len = 0;
 
@@ -2603,7 +4493,7 @@ ebox_encrypt_recovery(struct ebox *box)
 	VERIFY(iv != NULL);
 	arc4random_buf(iv, ivlen);
 
-	box->e_rcv_key.b_data = (key = malloc_conceal(keylen));
+	box->e_rcv_key.b_data = (key = zalloc_conceal(keylen));
 	VERIFY(key != NULL);
 	box->e_rcv_key.b_len = keylen;
 	arc4random_buf(key, keylen);
@@ -2615,15 +4505,108 @@ ebox_encrypt_recovery(struct ebox *box)
 	VERIFY0(cipher_crypt(cctx, 0, enc, plain, plainlen, 0, authlen));
 	cipher_free(cctx);
 
-	freezero(plain, plainlen);
+	freezero_conceal(plain, plainlen);
 
 	box->e_rcv_enc.b_data = enc;
 	box->e_rcv_enc.b_len = enclen;
 }
 
-errf_t *
-ebox_create(const struct ebox_tpl *tpl, const uint8_t *key, size_t keylen,
-    const uint8_t *token, size_t tokenlen, struct ebox **pebox)
+/*
+ * The expensive part of ebox_create() is piv_box_seal_offline() for each part
+ * (an ECDH, KDF and cipher pass each), and those are all independent of each
+ * other once the ephemeral keys and shares have been made. So we build the
+ * whole ebox first with the part boxes ready to seal, and then seal them all
+ * on a pool of threads.
+ */
+struct ebox_seal_job {
+	struct sshkey		*esj_pubkey;
+	struct piv_ecdh_box	*esj_box;
+	errf_t			*esj_err;
+};
+
+struct ebox_seal_pool {
+	pthread_mutex_t		 esp_mtx;
+	struct ebox_seal_job	*esp_jobs;
+	size_t			 esp_njobs;
+	size_t			 esp_next;
+};
+
+/* Below this many parts, it's not worth starting threads. */
+#define	EBOX_SEAL_MIN_PARALLEL	4
+#define	EBOX_SEAL_MAX_THREADS	16
+
+static void *
+ebox_seal_worker(void *arg)
+{
+	struct ebox_seal_pool *esp = arg;
+	struct ebox_seal_job *job;
+	size_t i;
+
+	for (;;) {
+		VERIFY0(pthread_mutex_lock(&esp->esp_mtx));
+		i = esp->esp_next++;
+		VERIFY0(pthread_mutex_unlock(&esp->esp_mtx));
+		if (i >= esp->esp_njobs)
+			break;
+		job = &esp->esp_jobs[i];
+		job->esj_err = piv_box_seal_offline(job->esj_pubkey,
+		    job->esj_box);
+	}
+	return (NULL);
+}
+
+static errf_t *
+ebox_seal_all(struct ebox_seal_job *jobs, size_t njobs)
+{
+	struct ebox_seal_pool esp;
+	pthread_t thr[EBOX_SEAL_MAX_THREADS];
+	long ncpu;
+	size_t i, nthr = 1;
+	errf_t *err = ERRF_OK;
+
+	bzero(&esp, sizeof (esp));
+	esp.esp_jobs = jobs;
+	esp.esp_njobs = njobs;
+	VERIFY0(pthread_mutex_init(&esp.esp_mtx, NULL));
+
+	if (njobs >= EBOX_SEAL_MIN_PARALLEL) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		if (ncpu > 1)
+			nthr = ncpu;
+		if (nthr > njobs)
+			nthr = njobs;
+		if (nthr > EBOX_SEAL_MAX_THREADS)
+			nthr = EBOX_SEAL_MAX_THREADS;
+	}
+	/* We're one of the workers too, so start one fewer threads. */
+	for (i = 0; i + 1 < nthr; ++i) {
+		if (pthread_create(&thr[i], NULL, ebox_seal_worker, &esp) != 0)
+			break;
+	}
+	nthr = i;
+	(void) ebox_seal_worker(&esp);
+	for (i = 0; i < nthr; ++i)
+		VERIFY0(pthread_join(thr[i], NULL));
+	VERIFY0(pthread_mutex_destroy(&esp.esp_mtx));
+
+	for (i = 0; i < njobs; ++i) {
+		if (jobs[i].esj_err != ERRF_OK && err == ERRF_OK)
+			err = jobs[i].esj_err;
+		else
+			errf_free(jobs[i].esj_err);
+		jobs[i].esj_err = ERRF_OK;
+	}
+	return (err);
+}
+
+/*
+ * Builds an ebox from a template, with the part boxes ready to seal. They're
+ * added to "*jobs" (which is "*njobs" long) for the caller to seal.
+ */
+static void
+ebox_create_unsealed(const struct ebox_tpl *tpl, const uint8_t *key,
+    size_t keylen, const uint8_t *token, size_t tokenlen,
+    struct ebox **pebox, struct ebox_seal_job **jobs, size_t *njobs)
 {
 	struct ebox *box;
 	struct ebox_tpl_config *tconfig;
@@ -2637,12 +4620,13 @@ ebox_create(const struct ebox_tpl *tpl, const uint8_t *key, size_t keylen,
 	struct piv_ecdh_box *pbox;
 	sss_Keyshare *share, *shares = NULL;
 	size_t shareslen = 0;
+	struct ebox_seal_job *job;
 	uint i;
 
 	box = calloc(1, sizeof (struct ebox));
 	VERIFY(box != NULL);
 
-	box->e_version = EBOX_VNEXT - 1;
+	box->e_version = EBOX_VDEFAULT;
 	box->e_type = EBOX_KEY;
 
 	/* Need a cipher with a 32-byte key, AES256-GCM is the easiest. */
@@ -2658,7 +4642,7 @@ ebox_create(const struct ebox_tpl *tpl, const uint8_t *key, size_t keylen,
 	VERIFY0(sshbuf_put_u8(buf, EBOX_RECOV_KEY));
 	VERIFY0(sshbuf_put_string8(buf, key, keylen));
 	plainlen = sshbuf_len(buf);
-	box->e_rcv_plain.b_data = (plain = malloc_conceal(plainlen));
+	box->e_rcv_plain.b_data = (plain = zalloc_conceal(plainlen));
 	VERIFY(plain != NULL);
 	box->e_rcv_plain.b_len = plainlen;
 	VERIFY0(sshbuf_get(buf, plain, plainlen));
@@ -2691,18 +4675,18 @@ ebox_create(const struct ebox_tpl *tpl, const uint8_t *key, size_t keylen,
 			VERIFY(nconfig->ec_nonce != NULL);
 			arc4random_buf(nconfig->ec_nonce, nconfig->ec_noncelen);
 
-			configkey = calloc_conceal(1, nconfig->ec_noncelen);
+			configkey = zalloc_conceal(nconfig->ec_noncelen);
 			for (i = 0; i < nconfig->ec_noncelen; ++i) {
 				configkey[i] = nconfig->ec_nonce[i] ^
 				    box->e_rcv_key.b_data[i];
 			}
 
 			shareslen = tconfig->etc_m * sizeof (sss_Keyshare);
-			shares = calloc_conceal(1, shareslen);
+			shares = zalloc_conceal(shareslen);
 			sss_create_keyshares(shares, configkey, tconfig->etc_m,
 			    tconfig->etc_n);
 
-			freezero(configkey, nconfig->ec_noncelen);
+			freezero_conceal(configkey, nconfig->ec_noncelen);
 		}
 
 		ppart = NULL;
@@ -2752,13 +4736,19 @@ ebox_create(const struct ebox_tpl *tpl, const uint8_t *key, size_t keylen,
 			}
 			pbox->pdb_ephem = ebox_make_ephem_for_nid(box,
 			    tpart->etp_pubkey->ecdsa_nid);
-			VERIFY0(piv_box_seal_offline(tpart->etp_pubkey, pbox));
+
+			*jobs = recallocarray(*jobs, *njobs, *njobs + 1,
+			    sizeof (struct ebox_seal_job));
+			VERIFY(*jobs != NULL);
+			job = &(*jobs)[(*njobs)++];
+			job->esj_pubkey = tpart->etp_pubkey;
+			job->esj_box = pbox;
 
 			ppart = npart;
 		}
 
 		if (shares != NULL) {
-			freezero(shares, shareslen);
+			freezero_conceal(shares, shareslen);
 			shares = NULL;
 			shareslen = 0;
 		}
@@ -2767,6 +4757,50 @@ ebox_create(const struct ebox_tpl *tpl, const uint8_t *key, size_t keylen,
 	}
 
 	*pebox = box;
+}
+
+errf_t *
+ebox_create_many(const struct ebox_tpl *tpl, struct ebox_create_item *items,
+    size_t n)
+{
+	struct ebox_seal_job *jobs = NULL;
+	size_t njobs = 0;
+	size_t i;
+	errf_t *err;
+
+	for (i = 0; i < n; ++i) {
+		ebox_create_unsealed(tpl, items[i].eci_key, items[i].eci_keylen,
+		    items[i].eci_rtoken, items[i].eci_rtokenlen,
+		    &items[i].eci_ebox, &jobs, &njobs);
+	}
+
+	err = ebox_seal_all(jobs, njobs);
+	free(jobs);
+
+	if (err != ERRF_OK) {
+		for (i = 0; i < n; ++i) {
+			ebox_free(items[i].eci_ebox);
+			items[i].eci_ebox = NULL;
+		}
+	}
+	return (err);
+}
+
+errf_t *
+ebox_create(const struct ebox_tpl *tpl, const uint8_t *key, size_t keylen,
+    const uint8_t *token, size_t tokenlen, struct ebox **pebox)
+{
+	struct ebox_create_item item;
+	errf_t *err;
+
+	bzero(&item, sizeof (item));
+	item.eci_key = key;
+	item.eci_keylen = keylen;
+	item.eci_rtoken = token;
+	item.eci_rtokenlen = tokenlen;
+	if ((err = ebox_create_many(tpl, &item, 1)))
+		return (err);
+	*pebox = item.eci_ebox;
 	return (ERRF_OK);
 }
 
@@ -2801,7 +4835,7 @@ ebox_recover(struct ebox *ebox, struct ebox_config *config)
 	struct ebox_tpl_config *tconfig = config->ec_tpl;
 	struct sshbuf *buf = NULL;
 	uint n = tconfig->etc_n, m = tconfig->etc_m;
-	uint i = 0, j;
+	uint i = 0;
 	errf_t *err;
 	int rc;
 	uint8_t tag;
@@ -2822,7 +4856,7 @@ ebox_recover(struct ebox *ebox, struct ebox_config *config)
 		    "ebox has already been recovered"));
 	}
 
-	shares = calloc_conceal(m, sizeof (sss_Keyshare));
+	shares = zalloc_conceal(m * sizeof (sss_Keyshare));
 
 	for (part = config->ec_parts; part != NULL; part = part->ep_next) {
 		if (part->ep_share != NULL && part->ep_sharelen >= 1) {
@@ -2853,16 +4887,18 @@ ebox_recover(struct ebox *ebox, struct ebox_config *config)
 
 	/* sss_* only supports 32-byte keys */
 	ebox->e_rcv_key.b_len = (cklen = 32);
-	ebox->e_rcv_key.b_data = calloc_conceal(1, cklen);
+	ebox->e_rcv_key.b_data = zalloc_conceal(cklen);
 
-	configkey = calloc_conceal(1, cklen);
+	configkey = zalloc_conceal(cklen);
 	sss_combine_keyshares(configkey, (const sss_Keyshare *)shares, n);
 
 	if (config->ec_noncelen > 0 && config->ec_nonce != NULL) {
 		if (config->ec_noncelen < cklen) {
-			free(ebox->e_rcv_key.b_data);
-			freezero(configkey, cklen);
-			freezero(shares, m * sizeof (sss_Keyshare));
+			freezero_conceal(ebox->e_rcv_key.b_data, cklen);
+			ebox->e_rcv_key.b_data = NULL;
+			ebox->e_rcv_key.b_len = 0;
+			freezero_conceal(configkey, cklen);
+			freezero_conceal(shares, m * sizeof (sss_Keyshare));
 			return (errf("RecoveryFailed", errf("BadConfigNonce",
 			    NULL, "recovery config nonce has bad length: %zu "
 			    "(need %zu bytes)", config->ec_noncelen, cklen),
@@ -2876,7 +4912,7 @@ ebox_recover(struct ebox *ebox, struct ebox_config *config)
 	} else {
 		bcopy(configkey, ebox->e_rcv_key.b_data, cklen);
 	}
-	free(configkey);
+	freezero_conceal(configkey, cklen);
 
 	err = ebox_decrypt_recovery(ebox);
 	if (err) {
@@ -2916,12 +4952,12 @@ ebox_recover(struct ebox *ebox, struct ebox_config *config)
 
 	for (part = config->ec_parts; part != NULL; part = part->ep_next) {
 		if (part->ep_share != NULL) {
-			freezero(part->ep_share, part->ep_sharelen);
+			freezero_conceal(part->ep_share, part->ep_sharelen);
 			part->ep_share = NULL;
 			part->ep_sharelen = 0;
 		}
 		if (!piv_box_sealed(part->ep_box)) {
-			freezero(part->ep_box->pdb_plain.b_data,
+			freezero_conceal(part->ep_box->pdb_plain.b_data,
 			    part->ep_box->pdb_plain.b_size);
 			part->ep_box->pdb_plain.b_data = NULL;
 			part->ep_box->pdb_plain.b_len = 0;
@@ -2933,9 +4969,7 @@ ebox_recover(struct ebox *ebox, struct ebox_config *config)
 
 out:
 	sshbuf_free(buf);
-	for (j = 0; j < m; ++j)
-		explicit_bzero(&shares[j], sizeof (sss_Keyshare));
-	free(shares);
+	freezero_conceal(shares, m * sizeof (sss_Keyshare));
 	return (err);
 }
 
@@ -3502,3 +5536,188 @@ ebox_challenge_free(struct ebox_challenge *chal)
 	explicit_bzero(chal->c_words, sizeof (chal->c_words));
 	free(chal);
 }
+
+struct ebox_bundle {
+	enum ebox_type eb_type;
+	uint eb_n;
+	struct sshbuf **eb_items;
+};
+
+enum ebox_bundle_version {
+	EBOX_BUNDLE_V1 = 0x01,
+	EBOX_BUNDLE_VNEXT
+};
+
+/* Far more than anyone should need to send a single custodian at once. */
+#define	EBOX_BUNDLE_MAX_ITEMS	4096
+
+struct ebox_bundle *
+ebox_bundle_new(enum ebox_type type)
+{
+	struct ebox_bundle *bundle;
+	VERIFY(type == EBOX_CHAL_BUNDLE || type == EBOX_RESP_BUNDLE);
+	bundle = calloc(1, sizeof (struct ebox_bundle));
+	if (bundle == NULL)
+		return (NULL);
+	bundle->eb_type = type;
+	return (bundle);
+}
+
+void
+ebox_bundle_free(struct ebox_bundle *bundle)
+{
+	uint i;
+	if (bundle == NULL)
+		return;
+	for (i = 0; i < bundle->eb_n; ++i)
+		sshbuf_free(bundle->eb_items[i]);
+	free(bundle->eb_items);
+	free(bundle);
+}
+
+enum ebox_type
+ebox_bundle_type(const struct ebox_bundle *bundle)
+{
+	return (bundle->eb_type);
+}
+
+uint
+ebox_bundle_count(const struct ebox_bundle *bundle)
+{
+	return (bundle->eb_n);
+}
+
+const struct sshbuf *
+ebox_bundle_item(const struct ebox_bundle *bundle, uint i)
+{
+	VERIFY3U(i, <, bundle->eb_n);
+	return (bundle->eb_items[i]);
+}
+
+errf_t *
+ebox_bundle_add(struct ebox_bundle *bundle, const struct sshbuf *item)
+{
+	struct sshbuf **nitems;
+	struct sshbuf *copy;
+	int rc;
+
+	if (bundle->eb_n >= EBOX_BUNDLE_MAX_ITEMS) {
+		return (errf("LengthError", NULL, "ebox bundles can hold at "
+		    "most %u items", EBOX_BUNDLE_MAX_ITEMS));
+	}
+	if ((copy = sshbuf_new()) == NULL)
+		return (ERRF_NOMEM);
+	if ((rc = sshbuf_putb(copy, item))) {
+		sshbuf_free(copy);
+		return (ssherrf("sshbuf_putb", rc));
+	}
+	nitems = recallocarray(bundle->eb_items, bundle->eb_n,
+	    bundle->eb_n + 1, sizeof (struct sshbuf *));
+	if (nitems == NULL) {
+		sshbuf_free(copy);
+		return (ERRF_NOMEM);
+	}
+	bundle->eb_items = nitems;
+	bundle->eb_items[bundle->eb_n++] = copy;
+	return (ERRF_OK);
+}
+
+boolean_t
+sshbuf_is_ebox_bundle(const struct sshbuf *buf)
+{
+	const uint8_t *p = sshbuf_ptr(buf);
+	if (sshbuf_len(buf) < 4)
+		return (B_FALSE);
+	return (p[0] == 0xEB && p[1] == 0x0C &&
+	    (p[3] == EBOX_CHAL_BUNDLE || p[3] == EBOX_RESP_BUNDLE));
+}
+
+errf_t *
+sshbuf_put_ebox_bundle(struct sshbuf *buf, const struct ebox_bundle *bundle)
+{
+	int rc;
+	uint i;
+
+	if ((rc = sshbuf_put_u8(buf, 0xEB)) ||
+	    (rc = sshbuf_put_u8(buf, 0x0C)) ||
+	    (rc = sshbuf_put_u8(buf, EBOX_BUNDLE_VNEXT - 1)) ||
+	    (rc = sshbuf_put_u8(buf, bundle->eb_type)) ||
+	    (rc = sshbuf_put_u32(buf, bundle->eb_n)))
+		return (ssherrf("sshbuf_put_u8/u32", rc));
+	for (i = 0; i < bundle->eb_n; ++i) {
+		if ((rc = sshbuf_put_stringb(buf, bundle->eb_items[i])))
+			return (ssherrf("sshbuf_put_stringb", rc));
+	}
+	return (ERRF_OK);
+}
+
+errf_t *
+sshbuf_get_ebox_bundle(struct sshbuf *buf, struct ebox_bundle **pbundle)
+{
+	struct ebox_bundle *bundle = NULL;
+	struct sshbuf *item = NULL;
+	uint8_t magic[2], ver, type;
+	uint32_t n, i;
+	errf_t *err;
+	int rc;
+
+	if ((rc = sshbuf_get_u8(buf, &magic[0])) ||
+	    (rc = sshbuf_get_u8(buf, &magic[1]))) {
+		err = boxderrf(errf("MagicError",
+		    ssherrf("sshbuf_get_u8", rc), "failed reading ebox magic"));
+		goto out;
+	}
+	if (magic[0] != 0xEB || magic[1] != 0x0C) {
+		err = boxderrf(errf("MagicError", NULL,
+		    "bad ebox magic number"));
+		goto out;
+	}
+	if ((rc = sshbuf_get_u8(buf, &ver)) ||
+	    (rc = sshbuf_get_u8(buf, &type)) ||
+	    (rc = sshbuf_get_u32(buf, &n))) {
+		err = boxderrf(ssherrf("sshbuf_get_u8/u32", rc));
+		goto out;
+	}
+	if (ver < EBOX_BUNDLE_V1 || ver >= EBOX_BUNDLE_VNEXT) {
+		err = boxverrf(errf("VersionError", NULL,
+		    "unsupported bundle version number 0x%02x", ver));
+		goto out;
+	}
+	if (type != EBOX_CHAL_BUNDLE && type != EBOX_RESP_BUNDLE) {
+		err = boxderrf(errf("EboxTypeError", NULL,
+		    "buffer does not contain an ebox bundle"));
+		goto out;
+	}
+	if (n > EBOX_BUNDLE_MAX_ITEMS) {
+		err = boxderrf(errf("LengthError", NULL, "ebox bundle has "
+		    "too many items (%u)", n));
+		goto out;
+	}
+
+	bundle = ebox_bundle_new((enum ebox_type)type);
+	if (bundle == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+	bundle->eb_items = calloc(n, sizeof (struct sshbuf *));
+	if (n > 0 && bundle->eb_items == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+	for (i = 0; i < n; ++i) {
+		if ((rc = sshbuf_froms(buf, &item))) {
+			err = boxderrf(ssherrf("sshbuf_froms", rc));
+			goto out;
+		}
+		bundle->eb_items[bundle->eb_n++] = item;
+		item = NULL;
+	}
+
+	*pbundle = bundle;
+	bundle = NULL;
+	err = ERRF_OK;
+
+out:
+	ebox_bundle_free(bundle);
+	return (err);
+}
@@ -48,7 +48,10 @@
 enum ebox_type {
 	EBOX_TEMPLATE = 0x01,
 	EBOX_KEY = 0x02,
-	EBOX_STREAM = 0x03
+	EBOX_STREAM = 0x03,
+	EBOX_STREAM_V2 = 0x04,	/* stream with footer, see ebox_stream_summary */
+	EBOX_CHAL_BUNDLE = 0x05,	/* see struct ebox_bundle */
+	EBOX_RESP_BUNDLE = 0x06
 };
 
 enum ebox_config_type {
@@ -145,12 +148,33 @@ errf_t *sshbuf_put_ebox_tpl(struct sshbuf *buf, struct ebox_tpl *tpl);
 
 /*
  * Creates a new ebox based on a given template, sealing up the provided key
- * and (optional) recovery token.
+ * and (optional) recovery token. The parts are sealed in parallel if there
+ * are enough of them to make it worthwhile.
  */
 MUST_CHECK
 errf_t *ebox_create(const struct ebox_tpl *tpl, const uint8_t *key,
     size_t keylen, const uint8_t *rtoken, size_t rtokenlen,
     struct ebox **pebox);
+
+struct ebox_create_item {
+	const uint8_t	*eci_key;
+	size_t		 eci_keylen;
+	const uint8_t	*eci_rtoken;	/* optional */
+	size_t		 eci_rtokenlen;
+
+	/* Filled out by ebox_create_many() */
+	struct ebox	*eci_ebox;
+};
+
+/*
+ * Creates an ebox for each of a batch of keys (e.g. when rekeying a set of
+ * datasets) with the same template, sealing all of their parts on one pool
+ * of threads. Either every item gets an ebox, or none do and an error is
+ * returned.
+ */
+MUST_CHECK
+errf_t *ebox_create_many(const struct ebox_tpl *tpl,
+    struct ebox_create_item *items, size_t n);
 void ebox_free(struct ebox *box);
 
 uint ebox_version(const struct ebox *ebox);
@@ -200,6 +224,15 @@ MUST_CHECK
 errf_t *sshbuf_get_ebox(struct sshbuf *buf, struct ebox **box);
 MUST_CHECK
 errf_t *sshbuf_put_ebox(struct sshbuf *buf, struct ebox *box);
+/*
+ * Serialise an ebox in the compact (V4) encoding, which is a good deal
+ * smaller but can only be read by versions which know about it. This is for
+ * eboxes kept in bulk in places like ZFS properties and LUKS tokens.
+ * sshbuf_get_ebox() reads either encoding, and an ebox read from a compact
+ * one stays compact when written out again with sshbuf_put_ebox().
+ */
+MUST_CHECK
+errf_t *sshbuf_put_ebox_compact(struct sshbuf *buf, struct ebox *box);
 
 /*
  * Unlock an ebox using a primary config.
@@ -307,6 +340,41 @@ MUST_CHECK
 errf_t *sshbuf_put_ebox_challenge_response(struct sshbuf *buf,
     const struct ebox_challenge *chal);
 
+/*
+ * A bundle packs a set of serialised challenges (type EBOX_CHAL_BUNDLE) or
+ * responses (EBOX_RESP_BUNDLE) into one message, so that a custodian who has
+ * to answer challenges to the same device for many eboxes (e.g. recovering a
+ * whole fleet) can be sent them all at once and reply with all the responses.
+ *
+ * Each item is exactly what sshbuf_put_ebox_challenge() or
+ * sshbuf_put_ebox_challenge_response() would write for it on its own.
+ */
+struct ebox_bundle;
+
+struct ebox_bundle *ebox_bundle_new(enum ebox_type type);
+void ebox_bundle_free(struct ebox_bundle *bundle);
+enum ebox_type ebox_bundle_type(const struct ebox_bundle *bundle);
+uint ebox_bundle_count(const struct ebox_bundle *bundle);
+const struct sshbuf *ebox_bundle_item(const struct ebox_bundle *bundle,
+    uint i);
+
+/* Copies the contents of "item" into a new item in the bundle. */
+MUST_CHECK
+errf_t *ebox_bundle_add(struct ebox_bundle *bundle, const struct sshbuf *item);
+
+/*
+ * Returns B_TRUE if the data in "buf" looks like a bundle (rather than a
+ * single challenge or response), without consuming any of it.
+ */
+boolean_t sshbuf_is_ebox_bundle(const struct sshbuf *buf);
+
+MUST_CHECK
+errf_t *sshbuf_put_ebox_bundle(struct sshbuf *buf,
+    const struct ebox_bundle *bundle);
+MUST_CHECK
+errf_t *sshbuf_get_ebox_bundle(struct sshbuf *buf,
+    struct ebox_bundle **bundle);
+
 /*
  * Process an incoming response to a recovery challenge for the given config.
  *
@@ -335,10 +403,35 @@ struct ebox *ebox_stream_ebox(const struct ebox_stream *str);
 const char *ebox_stream_cipher(const struct ebox_stream *str);
 const char *ebox_stream_mac(const struct ebox_stream *str);
 size_t ebox_stream_chunk_size(const struct ebox_stream *str);
+/*
+ * Sets the length of plaintext in each chunk of a new stream (recorded in its
+ * header), before the header is written. Longer chunks spread the framing
+ * and MAC over more data, shorter ones mean less to buffer before output and
+ * finer granularity for ebox_stream_pread_range().
+ */
+#define	EBOX_STREAM_DEFAULT_CHUNK	(128 * 1024)
+#define	EBOX_STREAM_MIN_CHUNK		(1024)
+#define	EBOX_STREAM_MAX_CHUNK		(16 * 1024 * 1024)
+MUST_CHECK
+errf_t *ebox_stream_set_chunk_size(struct ebox_stream *str, size_t chunklen);
+/*
+ * Returns the offset (from the end of the stream header) of the chunk that
+ * holds byte number "offset" of the plaintext.
+ */
 size_t ebox_stream_seek_offset(const struct ebox_stream *str, size_t offset);
 
 MUST_CHECK
 errf_t *ebox_stream_new(const struct ebox_tpl *tpl, struct ebox_stream **str);
+/*
+ * Like ebox_stream_new(), but with a choice of chunk cipher: "aes256-ctr"
+ * (the default, with a separate HMAC-SHA256 over each chunk),
+ * "aes256-gcm", "chacha20-poly1305", or "aead" to pick whichever of the
+ * last two is faster on this machine. The cipher is recorded in the stream
+ * header, so readers don't need to be told which one was used.
+ */
+MUST_CHECK
+errf_t *ebox_stream_new_cipher(const struct ebox_tpl *tpl, const char *cipher,
+    struct ebox_stream **str);
 MUST_CHECK
 errf_t *ebox_stream_chunk_new(const struct ebox_stream *str, const void *data,
     size_t size, size_t seqnr, struct ebox_stream_chunk **chunk);
@@ -350,6 +443,136 @@ errf_t *ebox_stream_encrypt_chunk(struct ebox_stream_chunk *chunk);
 const uint8_t *ebox_stream_chunk_data(const struct ebox_stream_chunk *chunk,
     size_t *size);
 
+/*
+ * Chunk encryption and decryption without a struct ebox_stream_chunk.
+ *
+ * These use a struct ebox_stream_ctx, which holds a keyed cipher and HMAC
+ * for the stream so they don't have to be set up again for each chunk. A
+ * context can only be used by one thread at a time (give each thread its own)
+ * and only in the direction it was made for. The stream must have its key
+ * available (i.e. be unlocked) when the context is made.
+ *
+ * sshbuf_put_ebox_stream_data() encrypts len bytes at data as chunk number
+ * seqnr and appends it to buf in the same form as
+ * sshbuf_put_ebox_stream_chunk(). The ciphertext is written straight into
+ * buf, and nothing else is allocated.
+ *
+ * sshbuf_get_ebox_stream_data() validates and decrypts the chunk at the
+ * start of buf, appends its plaintext to out and consumes it from buf.
+ * sshbuf_get_ebox_stream_frame() moves the chunk at the start of buf to out
+ * as-is (e.g. to hand it to another thread for decryption).
+ *
+ * If buf doesn't hold a whole chunk yet, these return an error caused by
+ * IncompleteMessageError. On any error, neither buffer is modified.
+ */
+struct ebox_stream_ctx;
+
+MUST_CHECK
+errf_t *ebox_stream_ctx_new(const struct ebox_stream *str, boolean_t encrypt,
+    struct ebox_stream_ctx **ctx);
+void ebox_stream_ctx_free(struct ebox_stream_ctx *ctx);
+
+MUST_CHECK
+errf_t *sshbuf_put_ebox_stream_data(struct sshbuf *buf,
+    struct ebox_stream_ctx *ctx, uint32_t seqnr, const void *data,
+    size_t len);
+MUST_CHECK
+errf_t *sshbuf_get_ebox_stream_data(struct sshbuf *buf,
+    struct ebox_stream_ctx *ctx, uint32_t *seqnr, struct sshbuf *out);
+MUST_CHECK
+errf_t *sshbuf_get_ebox_stream_frame(struct sshbuf *buf, struct sshbuf *out);
+/*
+ * Finds the length of the frame (chunk or footer) at the start of the len
+ * bytes at data, for callers that want to split up a stream in place. If
+ * there isn't a whole frame there, returns an IncompleteMessageError and
+ * sets *framelen to the length needed if it's known (or 0 if not).
+ */
+MUST_CHECK
+errf_t *ebox_stream_frame_peek(const uint8_t *data, size_t len,
+    size_t *framelen);
+
+/*
+ * Stream format version. New streams are v1 unless ebox_stream_set_version()
+ * is called before the header is written. v2 streams end with a footer
+ * which records how many chunks there were, how long they were, and a merkle
+ * root over their MACs, so truncation and missing or re-ordered chunks can
+ * be detected. Only newer versions of pivy can read v2 streams.
+ */
+uint ebox_stream_version(const struct ebox_stream *str);
+MUST_CHECK
+errf_t *ebox_stream_set_version(struct ebox_stream *str, uint version);
+
+/*
+ * A running summary of the chunks in a stream, for writing or checking the
+ * v2 footer.
+ *
+ * ebox_stream_summary_add() must be given each encoded frame of the stream
+ * in order (as produced by sshbuf_put_ebox_stream_data() or split out by
+ * sshbuf_get_ebox_stream_frame()). It checks sequence numbers (for both v1
+ * and v2 streams). If the frame is a v2 footer, it checks it against the
+ * chunks so far and sets *footer. ebox_stream_summary_finish() should be
+ * called at the end of input: it returns an error for a v2 stream that has
+ * not had its footer yet.
+ *
+ * sshbuf_put_ebox_stream_footer() writes the footer for the chunks given to
+ * the summary so far, after the last chunk of a v2 stream.
+ */
+struct ebox_stream_summary;
+
+MUST_CHECK
+errf_t *ebox_stream_summary_new(const struct ebox_stream *str,
+    struct ebox_stream_summary **sum);
+void ebox_stream_summary_free(struct ebox_stream_summary *sum);
+MUST_CHECK
+errf_t *ebox_stream_summary_add(struct ebox_stream_summary *sum,
+    const struct sshbuf *frame, boolean_t *footer);
+MUST_CHECK
+errf_t *ebox_stream_summary_finish(const struct ebox_stream_summary *sum);
+MUST_CHECK
+errf_t *sshbuf_put_ebox_stream_footer(struct sshbuf *buf,
+    struct ebox_stream_summary *sum);
+
+/*
+ * Random access to a stream stored in a file: reads (with pread()) and
+ * decrypts just the chunks covering len bytes of plaintext starting at
+ * offset, and appends that plaintext to out. base is the file offset of the
+ * first chunk (i.e. the length of the stream header). Stops early (without
+ * an error) at the end of the stream.
+ */
+MUST_CHECK
+errf_t *ebox_stream_pread_range(struct ebox_stream_ctx *ctx, int fd,
+    off_t base, uint64_t offset, size_t len, struct sshbuf *out);
+
+/*
+ * Reads the frames of a stream incrementally (e.g. from a pipe), without
+ * having to buffer and re-parse them.
+ *
+ * ebox_stream_reader_next() reserves space at the end of buf for the next
+ * part of the current frame and returns it in *ptr and *len. The caller
+ * reads up to *len bytes into it and calls ebox_stream_reader_advance() with
+ * how many it got, which sets *done once buf holds a whole frame (ready for
+ * ebox_stream_summary_add() and sshbuf_get_ebox_stream_data()). The length
+ * prefix of each frame is read first, so the rest of it can then be read in
+ * one go, and a frame longer than a whole chunk is rejected before any space
+ * is reserved for it. buf should be empty at the start of each frame.
+ *
+ * ebox_stream_reader_partial() returns B_TRUE if a frame has been started
+ * but not finished (i.e. if input ending now would be truncated).
+ */
+struct ebox_stream_reader;
+
+MUST_CHECK
+errf_t *ebox_stream_reader_new(const struct ebox_stream *str,
+    struct ebox_stream_reader **rdr);
+void ebox_stream_reader_free(struct ebox_stream_reader *rdr);
+MUST_CHECK
+errf_t *ebox_stream_reader_next(struct ebox_stream_reader *rdr,
+    struct sshbuf *buf, uint8_t **ptr, size_t *len);
+MUST_CHECK
+errf_t *ebox_stream_reader_advance(struct ebox_stream_reader *rdr,
+    struct sshbuf *buf, size_t n, boolean_t *done);
+boolean_t ebox_stream_reader_partial(const struct ebox_stream_reader *rdr);
+
 void ebox_stream_free(struct ebox_stream *str);
 void ebox_stream_chunk_free(struct ebox_stream_chunk *chunk);
 
@@ -13,6 +13,7 @@
 
 typedef int32_t crypto_int32;
 typedef uint32_t crypto_uint32;
+typedef uint64_t crypto_uint64;
 
 uint32_t arc4random(void);
 void arc4random_buf(void *_buf, size_t n);
@@ -12,6 +12,9 @@
 
 #include "fe25519.h"
 
+/* See fe25519_51.c for these when FE25519_51 is defined. */
+#if !defined(FE25519_51)
+
 static crypto_uint32 equal(crypto_uint32 a,crypto_uint32 b) /* 16-bit inputs */
 {
   crypto_uint32 x = a ^ b; /* 0: yes; 1..65535: no */
@@ -214,6 +217,8 @@ void fe25519_square(fe25519 *r, const fe25519 *x)
   fe25519_mul(r, x, x);
 }
 
+#endif /* !FE25519_51 */
+
 void fe25519_invert(fe25519 *r, const fe25519 *x)
 {
 	fe25519 z2;
@@ -0,0 +1,239 @@
+/*
+ * Public Domain.
+ *
+ * Arithmetic modulo 2^255-19 on five 51-bit limbs held in 64-bit words, in
+ * the style of the "ref10" and "donna-64" implementations. This replaces the
+ * byte-limbed reference code in fe25519.c wherever the compiler gives us a
+ * 128-bit integer type (see FE25519_51 in fe25519.h); it provides the same
+ * functions with the same semantics, and is likewise free of secret-dependent
+ * branches and memory accesses (apart from fe25519_iseq_vartime, as its name
+ * says).
+ *
+ * Limbs are kept "loosely reduced": every function here leaves each limb
+ * below 2^51 + 2^18, and accepts input limbs of that size, which keeps all
+ * the intermediate products in fe25519_mul() and fe25519_square() well
+ * inside 128 bits.
+ */
+
+#include "fe25519.h"
+
+#if defined(FE25519_51)
+
+typedef unsigned __int128 crypto_uint128;
+
+#define MASK51 ((((crypto_uint64)1) << 51) - 1)
+
+static crypto_uint64 load64(const unsigned char *x)
+{
+  crypto_uint64 r = 0;
+  int i;
+  for(i=7;i>=0;i--)
+    r = (r << 8) | x[i];
+  return r;
+}
+
+static void store64(unsigned char *r, crypto_uint64 x)
+{
+  int i;
+  for(i=0;i<8;i++)
+  {
+    r[i] = x & 0xff;
+    x >>= 8;
+  }
+}
+
+/* One pass of carries, folding the top back into v[0] times 19 */
+static void carry(fe25519 *r)
+{
+  crypto_uint64 c;
+  c = r->v[0] >> 51; r->v[0] &= MASK51; r->v[1] += c;
+  c = r->v[1] >> 51; r->v[1] &= MASK51; r->v[2] += c;
+  c = r->v[2] >> 51; r->v[2] &= MASK51; r->v[3] += c;
+  c = r->v[3] >> 51; r->v[3] &= MASK51; r->v[4] += c;
+  c = r->v[4] >> 51; r->v[4] &= MASK51; r->v[0] += 19 * c;
+}
+
+/* Carries a 128-bit product back down into loosely reduced limbs */
+static void carry_wide(fe25519 *r, crypto_uint128 t[5])
+{
+  crypto_uint64 c;
+  t[1] += (crypto_uint64)(t[0] >> 51);
+  t[2] += (crypto_uint64)(t[1] >> 51);
+  t[3] += (crypto_uint64)(t[2] >> 51);
+  t[4] += (crypto_uint64)(t[3] >> 51);
+  c = (crypto_uint64)(t[4] >> 51);
+  r->v[0] = ((crypto_uint64)t[0] & MASK51) + 19 * c;
+  r->v[1] = (crypto_uint64)t[1] & MASK51;
+  r->v[2] = (crypto_uint64)t[2] & MASK51;
+  r->v[3] = (crypto_uint64)t[3] & MASK51;
+  r->v[4] = (crypto_uint64)t[4] & MASK51;
+  c = r->v[0] >> 51; r->v[0] &= MASK51; r->v[1] += c;
+}
+
+/* reduction modulo 2^255-19 */
+void fe25519_freeze(fe25519 *r)
+{
+  crypto_uint64 q;
+
+  carry(r);
+  carry(r);
+  /* Now r < 2^255 + 19, so r >= p iff r + 19 >= 2^255 */
+  q = (r->v[0] + 19) >> 51;
+  q = (r->v[1] + q) >> 51;
+  q = (r->v[2] + q) >> 51;
+  q = (r->v[3] + q) >> 51;
+  q = (r->v[4] + q) >> 51;
+
+  r->v[0] += 19 * q;
+  q = r->v[0] >> 51; r->v[0] &= MASK51; r->v[1] += q;
+  q = r->v[1] >> 51; r->v[1] &= MASK51; r->v[2] += q;
+  q = r->v[2] >> 51; r->v[2] &= MASK51; r->v[3] += q;
+  q = r->v[3] >> 51; r->v[3] &= MASK51; r->v[4] += q;
+  r->v[4] &= MASK51;
+}
+
+void fe25519_unpack(fe25519 *r, const unsigned char x[32])
+{
+  r->v[0] = load64(x) & MASK51;
+  r->v[1] = (load64(x + 6) >> 3) & MASK51;
+  r->v[2] = (load64(x + 12) >> 6) & MASK51;
+  r->v[3] = (load64(x + 19) >> 1) & MASK51;
+  r->v[4] = (load64(x + 24) >> 12) & MASK51;
+}
+
+void fe25519_pack(unsigned char r[32], const fe25519 *x)
+{
+  fe25519 y = *x;
+  fe25519_freeze(&y);
+  store64(r, y.v[0] | (y.v[1] << 51));
+  store64(r + 8, (y.v[1] >> 13) | (y.v[2] << 38));
+  store64(r + 16, (y.v[2] >> 26) | (y.v[3] << 25));
+  store64(r + 24, (y.v[3] >> 39) | (y.v[4] << 12));
+}
+
+int fe25519_iszero(const fe25519 *x)
+{
+  unsigned char s[32];
+  crypto_uint32 a = 0;
+  int i;
+  fe25519_pack(s, x);
+  for(i=0;i<32;i++)
+    a |= s[i];
+  return (a - 1) >> 31;
+}
+
+int fe25519_iseq_vartime(const fe25519 *x, const fe25519 *y)
+{
+  unsigned char s1[32], s2[32];
+  int i;
+  fe25519_pack(s1, x);
+  fe25519_pack(s2, y);
+  for(i=0;i<32;i++)
+    if(s1[i] != s2[i]) return 0;
+  return 1;
+}
+
+void fe25519_cmov(fe25519 *r, const fe25519 *x, unsigned char b)
+{
+  int i;
+  crypto_uint64 mask = b;
+  mask = -mask;
+  for(i=0;i<5;i++) r->v[i] ^= mask & (x->v[i] ^ r->v[i]);
+}
+
+unsigned char fe25519_getparity(const fe25519 *x)
+{
+  fe25519 t = *x;
+  fe25519_freeze(&t);
+  return t.v[0] & 1;
+}
+
+void fe25519_setone(fe25519 *r)
+{
+  r->v[0] = 1;
+  r->v[1] = r->v[2] = r->v[3] = r->v[4] = 0;
+}
+
+void fe25519_setzero(fe25519 *r)
+{
+  r->v[0] = r->v[1] = r->v[2] = r->v[3] = r->v[4] = 0;
+}
+
+void fe25519_neg(fe25519 *r, const fe25519 *x)
+{
+  fe25519 t;
+  fe25519_setzero(&t);
+  fe25519_sub(r, &t, x);
+}
+
+void fe25519_add(fe25519 *r, const fe25519 *x, const fe25519 *y)
+{
+  int i;
+  for(i=0;i<5;i++) r->v[i] = x->v[i] + y->v[i];
+  carry(r);
+}
+
+void fe25519_sub(fe25519 *r, const fe25519 *x, const fe25519 *y)
+{
+  /* Add 4p first so that no limb can go negative */
+  r->v[0] = (x->v[0] + 0x1FFFFFFFFFFFB4ULL) - y->v[0];
+  r->v[1] = (x->v[1] + 0x1FFFFFFFFFFFFCULL) - y->v[1];
+  r->v[2] = (x->v[2] + 0x1FFFFFFFFFFFFCULL) - y->v[2];
+  r->v[3] = (x->v[3] + 0x1FFFFFFFFFFFFCULL) - y->v[3];
+  r->v[4] = (x->v[4] + 0x1FFFFFFFFFFFFCULL) - y->v[4];
+  carry(r);
+}
+
+void fe25519_mul(fe25519 *r, const fe25519 *x, const fe25519 *y)
+{
+  crypto_uint128 t[5];
+  crypto_uint64 x0 = x->v[0], x1 = x->v[1], x2 = x->v[2], x3 = x->v[3],
+      x4 = x->v[4];
+  crypto_uint64 y0 = y->v[0], y1 = y->v[1], y2 = y->v[2], y3 = y->v[3],
+      y4 = y->v[4];
+  crypto_uint64 y1_19 = 19 * y1, y2_19 = 19 * y2, y3_19 = 19 * y3,
+      y4_19 = 19 * y4;
+
+  t[0] = (crypto_uint128)x0 * y0 + (crypto_uint128)x1 * y4_19 +
+      (crypto_uint128)x2 * y3_19 + (crypto_uint128)x3 * y2_19 +
+      (crypto_uint128)x4 * y1_19;
+  t[1] = (crypto_uint128)x0 * y1 + (crypto_uint128)x1 * y0 +
+      (crypto_uint128)x2 * y4_19 + (crypto_uint128)x3 * y3_19 +
+      (crypto_uint128)x4 * y2_19;
+  t[2] = (crypto_uint128)x0 * y2 + (crypto_uint128)x1 * y1 +
+      (crypto_uint128)x2 * y0 + (crypto_uint128)x3 * y4_19 +
+      (crypto_uint128)x4 * y3_19;
+  t[3] = (crypto_uint128)x0 * y3 + (crypto_uint128)x1 * y2 +
+      (crypto_uint128)x2 * y1 + (crypto_uint128)x3 * y0 +
+      (crypto_uint128)x4 * y4_19;
+  t[4] = (crypto_uint128)x0 * y4 + (crypto_uint128)x1 * y3 +
+      (crypto_uint128)x2 * y2 + (crypto_uint128)x3 * y1 +
+      (crypto_uint128)x4 * y0;
+
+  carry_wide(r, t);
+}
+
+void fe25519_square(fe25519 *r, const fe25519 *x)
+{
+  crypto_uint128 t[5];
+  crypto_uint64 x0 = x->v[0], x1 = x->v[1], x2 = x->v[2], x3 = x->v[3],
+      x4 = x->v[4];
+  crypto_uint64 x0_2 = 2 * x0, x1_2 = 2 * x1;
+  crypto_uint64 x1_38 = 38 * x1, x2_38 = 38 * x2, x3_38 = 38 * x3;
+  crypto_uint64 x3_19 = 19 * x3, x4_19 = 19 * x4;
+
+  t[0] = (crypto_uint128)x0 * x0 + (crypto_uint128)x1_38 * x4 +
+      (crypto_uint128)x2_38 * x3;
+  t[1] = (crypto_uint128)x0_2 * x1 + (crypto_uint128)x2_38 * x4 +
+      (crypto_uint128)x3_19 * x3;
+  t[2] = (crypto_uint128)x0_2 * x2 + (crypto_uint128)x1 * x1 +
+      (crypto_uint128)x3_38 * x4;
+  t[3] = (crypto_uint128)x0_2 * x3 + (crypto_uint128)x1_2 * x2 +
+      (crypto_uint128)x4_19 * x4;
+  t[4] = (crypto_uint128)x0_2 * x4 + (crypto_uint128)x1_2 * x3 +
+      (crypto_uint128)x2 * x2;
+
+  carry_wide(r, t);
+}
+
+#endif /* FE25519_51 */
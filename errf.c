@@ -23,6 +23,7 @@ struct errf {
 	char errf_function[64];
 	char errf_file[64];
 	uint errf_line;
+	boolean_t errf_static;	/* not to be freed (e.g. ERRF_NOMEM) */
 };
 
 /*
@@ -85,10 +86,31 @@ struct errf errf_nomem = {
     .errf_name = "OutOfMemoryError",
     .errf_message = "Process failed to allocate new memory",
     .errf_file = "erf.c",
-    .errf_line = __LINE__
+    .errf_line = __LINE__,
+    .errf_static = B_TRUE
+};
+
+struct errf errf_notfound = {
+    .errf_errno = ENOENT,
+    .errf_name = "NotFoundError",
+    .errf_message = "Requested object was not found",
+    .errf_file = "erf.c",
+    .errf_line = __LINE__,
+    .errf_static = B_TRUE
+};
+
+struct errf errf_notsup = {
+    .errf_errno = ENOTSUP,
+    .errf_name = "NotSupportedError",
+    .errf_message = "Requested operation or object is not supported",
+    .errf_file = "erf.c",
+    .errf_line = __LINE__,
+    .errf_static = B_TRUE
 };
 
 struct errf *ERRF_NOMEM = &errf_nomem;
+struct errf *ERRF_NOTFOUND = &errf_notfound;
+struct errf *ERRF_NOTSUP = &errf_notsup;
 
 const char *
 errf_name(const struct errf *e)
@@ -274,7 +296,7 @@ errf_free(struct errf *ep)
 	while (ep != NULL) {
 		struct errf *tofree = ep;
 		ep = ep->errf_cause;
-		if (tofree != ERRF_NOMEM)
+		if (!tofree->errf_static)
 			free(tofree);
 	}
 }
@@ -58,6 +58,18 @@ typedef struct errf errf_t;
 #define ERRF_OK     NULL
 extern struct errf *ERRF_NOMEM;
 
+/*
+ * Preallocated errors for conditions which are expected and normally just
+ * checked with errf_caused_by() and thrown away (e.g. finding an empty slot
+ * while enumerating a token), so that returning them doesn't allocate or
+ * format anything. Like ERRF_NOMEM, they can be passed to errf_free() or used
+ * as the cause of another error. They only have a generic message and no
+ * function/file/line, though, so errors which are likely to be shown to a
+ * user should still use errf().
+ */
+extern struct errf *ERRF_NOTFOUND;	/* "NotFoundError" */
+extern struct errf *ERRF_NOTSUP;	/* "NotSupportedError" */
+
 /* Print an errf_t and message to stderr, like warnx/warn */
 void warnfx(const struct errf *e, const char *fmt, ...);
 /* Print an errf_t and message to stderr and exit, like errx/err */
@@ -270,6 +270,174 @@ out:
 	return r;
 }
 
+void
+ssh_free_x509certs(struct ssh_x509certs *certs)
+{
+	size_t i;
+
+	if (certs == NULL)
+		return;
+	for (i = 0; i < certs->ncerts; ++i) {
+		sshkey_free(certs->certs[i].key);
+		free(certs->certs[i].cert);
+	}
+	free(certs->certs);
+	free(certs);
+}
+
+/*
+ * Asks the agent for the certificates in the given slots (or all of them if
+ * nslots is 0) on the card holding "key".
+ */
+int
+ssh_agent_get_x509certs(int sock, const struct sshkey *key,
+    const u_char *slots, size_t nslots, struct ssh_x509certs **pcerts)
+{
+	struct sshbuf *msg, *inner = NULL;
+	struct ssh_x509certs *certs = NULL;
+	struct ssh_x509cert *c;
+	const u_char *guid;
+	size_t guidlen;
+	u_int count, i;
+	int r;
+	uint8_t type;
+
+	*pcerts = NULL;
+
+	if ((msg = sshbuf_new()) == NULL || (inner = sshbuf_new()) == NULL) {
+		r = SSH_ERR_ALLOC_FAIL;
+		goto out;
+	}
+	if ((r = sshkey_puts(key, inner)) != 0 ||
+	    (r = sshbuf_put_u32(inner, 0)) != 0 ||
+	    (r = sshbuf_put_string(inner, slots, nslots)) != 0 ||
+	    (r = sshbuf_put_u8(msg, SSH2_AGENTC_EXTENSION)) != 0 ||
+	    (r = sshbuf_put_cstring(msg, "x509-certs@joyent.com")) != 0 ||
+	    (r = sshbuf_put_stringb(msg, inner)) != 0)
+		goto out;
+
+	if ((r = ssh_request_reply(sock, msg, msg)) != 0)
+		goto out;
+	if ((r = sshbuf_get_u8(msg, &type)) != 0)
+		goto out;
+	if (agent_failed(type) || type == SSH2_AGENT_EXT_FAILURE) {
+		r = SSH_ERR_AGENT_FAILURE;
+		goto out;
+	} else if (type != SSH_AGENT_SUCCESS) {
+		r = SSH_ERR_INVALID_FORMAT;
+		goto out;
+	}
+
+	if ((r = sshbuf_get_string_direct(msg, &guid, &guidlen)) != 0 ||
+	    (r = sshbuf_get_u32(msg, &count)) != 0)
+		goto out;
+	if (guidlen != sizeof (certs->guid) || count > 256) {
+		r = SSH_ERR_INVALID_FORMAT;
+		goto out;
+	}
+
+	if ((certs = calloc(1, sizeof (*certs))) == NULL ||
+	    (certs->certs = calloc(count, sizeof (*c))) == NULL) {
+		r = SSH_ERR_ALLOC_FAIL;
+		goto out;
+	}
+	bcopy(guid, certs->guid, guidlen);
+	for (i = 0; i < count; ++i) {
+		c = &certs->certs[i];
+		++certs->ncerts;
+		if ((r = sshbuf_get_u8(msg, &c->slot)) != 0 ||
+		    (r = sshkey_froms(msg, &c->key)) != 0 ||
+		    (r = sshbuf_get_string(msg, &c->cert, &c->certlen)) != 0)
+			goto out;
+	}
+
+	*pcerts = certs;
+	certs = NULL;
+	r = 0;
+out:
+	ssh_free_x509certs(certs);
+	sshbuf_free(inner);
+	sshbuf_free(msg);
+	return r;
+}
+
+/*
+ * Like ssh_agent_get_x509certs(), but for the card with the given GUID (or
+ * GUID prefix), rather than the one holding a particular key. If guidlen is
+ * 0, the agent must only have one card. Returns SSH_ERR_KEY_NOT_FOUND if no
+ * card matches, and SSH_ERR_INVALID_ARGUMENT if more than one does.
+ */
+int
+ssh_agent_find_x509certs(int sock, const u_char *guid, size_t guidlen,
+    const u_char *slots, size_t nslots, struct ssh_x509certs **pcerts)
+{
+	struct ssh_identitylist *idl = NULL;
+	struct ssh_x509certs *certs = NULL, *found = NULL;
+	u_char (*seen)[16] = NULL;
+	size_t i, j, nseen = 0;
+	int r;
+
+	*pcerts = NULL;
+
+	if (guidlen > sizeof (certs->guid))
+		return SSH_ERR_INVALID_ARGUMENT;
+	if ((r = ssh_fetch_identitylist(sock, &idl)) != 0) {
+		if (r == SSH_ERR_AGENT_NO_IDENTITIES)
+			r = SSH_ERR_KEY_NOT_FOUND;
+		return r;
+	}
+	if ((seen = calloc(idl->nkeys, sizeof (*seen))) == NULL) {
+		r = SSH_ERR_ALLOC_FAIL;
+		goto out;
+	}
+
+	/*
+	 * The identity list doesn't say which card each key is on, so ask
+	 * about each one until we've seen all the cards.
+	 */
+	for (i = 0; i < idl->nkeys; ++i) {
+		if ((r = ssh_agent_get_x509certs(sock, idl->keys[i], slots,
+		    nslots, &certs)) != 0)
+			goto out;
+		for (j = 0; j < nseen; ++j) {
+			if (memcmp(seen[j], certs->guid, sizeof (seen[j])) == 0)
+				break;
+		}
+		if (j < nseen) {
+			/* Another key on a card we've already seen. */
+			ssh_free_x509certs(certs);
+			certs = NULL;
+			continue;
+		}
+		memcpy(seen[nseen++], certs->guid, sizeof (seen[0]));
+		if (guidlen > 0 && memcmp(certs->guid, guid, guidlen) != 0) {
+			ssh_free_x509certs(certs);
+			certs = NULL;
+			continue;
+		}
+		if (found != NULL) {
+			r = SSH_ERR_INVALID_ARGUMENT;
+			goto out;
+		}
+		found = certs;
+		certs = NULL;
+	}
+	if (found == NULL) {
+		r = SSH_ERR_KEY_NOT_FOUND;
+		goto out;
+	}
+
+	*pcerts = found;
+	found = NULL;
+	r = 0;
+out:
+	ssh_free_x509certs(certs);
+	ssh_free_x509certs(found);
+	free(seen);
+	ssh_free_identitylist(idl);
+	return r;
+}
+
 /* ask agent to sign data, returns err.h code on error, 0 on success */
 int
 ssh_agent_sign(int sock, const struct sshkey *key,
@@ -46,6 +46,26 @@ void	ssh_free_x509chain(struct ssh_x509chain *chain);
 int	ssh_agent_get_x509(int sock, const struct sshkey *key,
     struct ssh_x509chain **pchain);
 
+/* Slot certificates from pivy-agent's x509-certs@joyent.com extension */
+struct ssh_x509cert {
+	u_char slot;
+	struct sshkey *key;
+	u_char *cert;
+	size_t certlen;
+};
+
+struct ssh_x509certs {
+	u_char guid[16];
+	size_t ncerts;
+	struct ssh_x509cert *certs;
+};
+
+void	ssh_free_x509certs(struct ssh_x509certs *certs);
+int	ssh_agent_get_x509certs(int sock, const struct sshkey *key,
+    const u_char *slots, size_t nslots, struct ssh_x509certs **pcerts);
+int	ssh_agent_find_x509certs(int sock, const u_char *guid, size_t guidlen,
+    const u_char *slots, size_t nslots, struct ssh_x509certs **pcerts);
+
 /* Messages for the authentication agent connection. */
 #define SSH_AGENTC_REQUEST_RSA_IDENTITIES	1
 #define SSH_AGENT_RSA_IDENTITIES_ANSWER		2
@@ -701,6 +701,34 @@ cipher_set_keyiv(struct sshcipher_ctx *cc, const u_char *iv)
 	return 0;
 }
 
+/*
+ * Restarts a context with a new IV, but keeps its key (so we don't have to
+ * redo the key schedule, unlike cipher_init()).
+ */
+int
+cipher_reset_iv(struct sshcipher_ctx *cc, const u_char *iv, u_int ivlen)
+{
+	if (ivlen < cipher_ivlen(cc->cipher))
+		return SSH_ERR_INVALID_ARGUMENT;
+	if ((cc->cipher->flags & (CFLAG_CHACHAPOLY | CFLAG_NONE)) != 0)
+		return 0;
+#ifndef WITH_OPENSSL
+	if ((cc->cipher->flags & CFLAG_AESCTR) != 0) {
+		aesctr_ivsetup(&cc->ac_ctx, iv);
+		return 0;
+	}
+	return SSH_ERR_INVALID_ARGUMENT;
+#else
+	if (EVP_CipherInit_ex(cc->evp, NULL, NULL, NULL, iv, -1) == 0)
+		return SSH_ERR_LIBCRYPTO_ERROR;
+	if (cipher_authlen(cc->cipher) &&
+	    !EVP_CIPHER_CTX_ctrl(cc->evp, EVP_CTRL_GCM_SET_IV_FIXED,
+	    -1, (u_char *)iv))
+		return SSH_ERR_LIBCRYPTO_ERROR;
+	return 0;
+#endif
+}
+
 #ifdef WITH_OPENSSL
 #define EVP_X_STATE(evp)	(evp)->cipher_data
 #define EVP_X_STATE_LEN(evp)	(evp)->cipher->ctx_size
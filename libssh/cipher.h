@@ -138,6 +138,7 @@ u_int	 cipher_ctx_get_number(struct sshcipher_ctx *);
 u_int	 cipher_get_number(const struct sshcipher *);
 int	 cipher_get_keyiv(struct sshcipher_ctx *, u_char *, u_int);
 int	 cipher_set_keyiv(struct sshcipher_ctx *, const u_char *);
+int	 cipher_reset_iv(struct sshcipher_ctx *, const u_char *, u_int);
 int	 cipher_get_keyiv_len(const struct sshcipher_ctx *);
 int	 cipher_get_keycontext(const struct sshcipher_ctx *, u_char *);
 void	 cipher_set_keycontext(struct sshcipher_ctx *, const u_char *);
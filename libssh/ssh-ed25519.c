@@ -161,7 +161,6 @@ ssh_ed25519_verify(const struct sshkey *key,
 	memcpy(sm, sigblob, len);
 	memcpy(sm+len, data, datalen);
 	ret = crypto_sign_ed25519_open(m, &mlen, sm, smlen, key->ed25519_pk);
-	assert(ret != 0);
 	if (ret != 0 || mlen != datalen) {
 		r = SSH_ERR_SIGNATURE_INVALID;
 		goto out;
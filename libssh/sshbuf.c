@@ -24,6 +24,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #include "../utils.h"
 #include "ssherr.h"
@@ -71,12 +72,113 @@ sshbuf_maybe_pack(struct sshbuf *buf, int force)
 	}
 }
 
+/*
+ * Pool of released buffers for sshbuf_pool_enable(). Everything in here has
+ * already been scrubbed, and is chained through "parent". The ones on
+ * sshbuf_pool_data still own their "d" allocation (of "alloc" bytes); the
+ * ones on sshbuf_pool_bare are just the struct.
+ */
+static pthread_mutex_t sshbuf_pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct sshbuf *sshbuf_pool_data;
+static struct sshbuf *sshbuf_pool_bare;
+static u_int sshbuf_pool_n;
+static u_int sshbuf_pool_max;
+
+/*
+ * Takes a buffer from the pool, preferring one with an allocation if "data"
+ * is set. Never returns one with an allocation if it isn't.
+ */
+static struct sshbuf *
+sshbuf_pool_get(int data)
+{
+	struct sshbuf *buf, **list;
+
+	if (sshbuf_pool_max == 0)
+		return NULL;
+	pthread_mutex_lock(&sshbuf_pool_mtx);
+	if (data && sshbuf_pool_data != NULL)
+		list = &sshbuf_pool_data;
+	else
+		list = &sshbuf_pool_bare;
+	if ((buf = *list) != NULL) {
+		*list = buf->parent;
+		buf->parent = NULL;
+		sshbuf_pool_n--;
+	}
+	pthread_mutex_unlock(&sshbuf_pool_mtx);
+	return buf;
+}
+
+/*
+ * Puts a scrubbed buffer (with refcount 0) into the pool. Returns 0 if the
+ * pool is full or disabled, in which case the caller still has to free it.
+ */
+static int
+sshbuf_pool_put(struct sshbuf *buf)
+{
+	u_char *d = NULL;
+	size_t alloc = 0;
+
+	if (sshbuf_pool_max == 0)
+		return 0;
+	pthread_mutex_lock(&sshbuf_pool_mtx);
+	if (sshbuf_pool_n >= sshbuf_pool_max) {
+		pthread_mutex_unlock(&sshbuf_pool_mtx);
+		return 0;
+	}
+	if (!buf->readonly && buf->alloc <= SSHBUF_POOL_MAXALLOC) {
+		d = buf->d;
+		alloc = buf->alloc;
+	} else if (!buf->readonly) {
+		free(buf->d);
+	}
+	explicit_bzero(buf, sizeof(*buf));
+	if (d != NULL) {
+		buf->cd = buf->d = d;
+		buf->alloc = alloc;
+		buf->parent = sshbuf_pool_data;
+		sshbuf_pool_data = buf;
+	} else {
+		buf->parent = sshbuf_pool_bare;
+		sshbuf_pool_bare = buf;
+	}
+	sshbuf_pool_n++;
+	pthread_mutex_unlock(&sshbuf_pool_mtx);
+	return 1;
+}
+
+void
+sshbuf_pool_enable(u_int max)
+{
+	struct sshbuf *buf;
+
+	pthread_mutex_lock(&sshbuf_pool_mtx);
+	sshbuf_pool_max = max;
+	while (sshbuf_pool_n > max) {
+		if ((buf = sshbuf_pool_bare) != NULL) {
+			sshbuf_pool_bare = buf->parent;
+		} else {
+			buf = sshbuf_pool_data;
+			sshbuf_pool_data = buf->parent;
+			free(buf->d);
+		}
+		free(buf);
+		sshbuf_pool_n--;
+	}
+	pthread_mutex_unlock(&sshbuf_pool_mtx);
+}
+
 struct sshbuf *
 sshbuf_new(void)
 {
 	struct sshbuf *ret;
 
-	if ((ret = calloc(sizeof(*ret), 1)) == NULL)
+	if ((ret = sshbuf_pool_get(1)) != NULL && ret->d != NULL) {
+		ret->max_size = SSHBUF_SIZE_MAX;
+		ret->refcount = 1;
+		return ret;
+	}
+	if (ret == NULL && (ret = calloc(sizeof(*ret), 1)) == NULL)
 		return NULL;
 	ret->alloc = SSHBUF_SIZE_INIT;
 	ret->max_size = SSHBUF_SIZE_MAX;
@@ -95,7 +197,9 @@ sshbuf_from(const void *blob, size_t len)
 {
 	struct sshbuf *ret;
 
-	if (blob == NULL || len > SSHBUF_SIZE_MAX ||
+	if (blob == NULL || len > SSHBUF_SIZE_MAX)
+		return NULL;
+	if ((ret = sshbuf_pool_get(0)) == NULL &&
 	    (ret = calloc(sizeof(*ret), 1)) == NULL)
 		return NULL;
 	ret->alloc = ret->size = ret->max_size = len;
@@ -179,10 +283,12 @@ sshbuf_free(struct sshbuf *buf)
 	if (buf->refcount > 0)
 		return;
 	dont_free = buf->dont_free;
-	if (!buf->readonly) {
+	if (!buf->readonly)
 		explicit_bzero(buf->d, buf->alloc);
+	if (!dont_free && sshbuf_pool_put(buf))
+		return;
+	if (!buf->readonly)
 		free(buf->d);
-	}
 	explicit_bzero(buf, sizeof(*buf));
 	if (!dont_free)
 		free(buf);
@@ -201,7 +307,9 @@ sshbuf_reset(struct sshbuf *buf)
 	if (sshbuf_check_sanity(buf) == 0)
 		explicit_bzero(buf->d, buf->alloc);
 	buf->off = buf->size = 0;
-	if (buf->alloc != SSHBUF_SIZE_INIT) {
+	/* When pooling, keep any allocation the pool would have kept. */
+	if (buf->alloc != SSHBUF_SIZE_INIT && (sshbuf_pool_max == 0 ||
+	    buf->alloc > SSHBUF_POOL_MAXALLOC)) {
 		if ((d = realloc(buf->d, SSHBUF_SIZE_INIT)) != NULL) {
 			buf->cd = buf->d = d;
 			buf->alloc = SSHBUF_SIZE_INIT;
@@ -90,6 +90,15 @@ int	sshbuf_froms(struct sshbuf *buf, struct sshbuf **bufp);
  */
 void	sshbuf_free(struct sshbuf *buf);
 
+/*
+ * Keep up to "max" released buffers (scrubbed, but with their allocations
+ * intact if reasonably small) for reuse by sshbuf_new() and sshbuf_from(),
+ * so that programs which churn through lots of short-lived buffers don't
+ * keep going back to malloc. Setting max to 0 empties and disables the pool
+ * (the default). Must be called before any other threads are using sshbufs.
+ */
+void	sshbuf_pool_enable(u_int max);
+
 /*
  * Reset buf, clearing its contents. NB. max_size is preserved.
  */
@@ -335,6 +344,7 @@ u_int	sshbuf_refcount(const struct sshbuf *buf);
 # define SSHBUF_SIZE_INIT	256		/* Initial allocation */
 # define SSHBUF_SIZE_INC	256		/* Preferred increment length */
 # define SSHBUF_PACK_MIN	8192		/* Minimim packable offset */
+# define SSHBUF_POOL_MAXALLOC	16384		/* Largest d kept when pooled */
 
 /* # define SSHBUF_ABORT abort */
 /* # define SSHBUF_DEBUG */
@@ -35,6 +35,7 @@
 #include "debug.h"
 #if defined(__sun)
 #include <sys/fork.h>
+#include <ucred.h>
 #endif
 #include <sys/wait.h>
 #include <sys/stat.h>
@@ -67,7 +68,7 @@
 
 #define	PIVY_AGENT_ENV_DIR	"%s/.config/pivy-agent"
 #define	PIVY_AGENT_ENV_FILE	"%s/.config/pivy-agent/%s"
-#define	PIVY_AGENT_SOCKET	"%s/piv-ssh-%s.socket"
+#define	PIVY_AGENT_SOCKET	"/run/user/%d/piv-ssh-%s.socket"
 #define	SSH_AUTH_KEYS		"%s/.ssh/authorized_keys"
 
 struct keylist {
@@ -112,6 +113,72 @@ piv_token_shortid(struct piv_token *pk)
 	return (guid);
 }
 
+static int
+pam_key_allowed(const struct keylist *keys, const struct sshkey *pubk)
+{
+	const struct keylist *keyle;
+
+	for (keyle = keys; keyle != NULL; keyle = keyle->kl_next) {
+		if (sshkey_equal_public(keyle->kl_key, pubk))
+			return (1);
+	}
+	return (0);
+}
+
+/*
+ * Returns the first slot we've read so far which holds one of the allowed
+ * keys, or NULL if there isn't one.
+ */
+static struct piv_slot *
+pam_allowed_slot(struct piv_token *token, const struct keylist *keys)
+{
+	struct piv_slot *slot = NULL;
+
+	while ((slot = piv_slot_next(token, slot)) != NULL) {
+		if (pam_key_allowed(keys, piv_slot_pubkey(slot)))
+			return (slot);
+	}
+	return (NULL);
+}
+
+static int
+hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return (c - '0');
+	if (c >= 'a' && c <= 'f')
+		return (c - 'a' + 10);
+	if (c >= 'A' && c <= 'F')
+		return (c - 'A' + 10);
+	return (-1);
+}
+
+static uint8_t *
+parse_hex(const char *str, size_t *outlen)
+{
+	const size_t len = strlen(str);
+	uint8_t *data;
+	size_t i;
+	int hi, lo;
+
+	if (len == 0 || (len % 2) != 0)
+		return (NULL);
+	data = calloc(1, len / 2);
+	if (data == NULL)
+		return (NULL);
+	for (i = 0; i < len; i += 2) {
+		hi = hexval(str[i]);
+		lo = hexval(str[i + 1]);
+		if (hi < 0 || lo < 0) {
+			free(data);
+			return (NULL);
+		}
+		data[i / 2] = (hi << 4) | lo;
+	}
+	*outlen = len / 2;
+	return (data);
+}
+
 static int
 get_agent_socket(const char *authsocket, int *fdp)
 {
@@ -143,10 +210,108 @@ get_agent_socket(const char *authsocket, int *fdp)
 	return 0;
 }
 
+static int
+get_peer_uid(int fd, uid_t *uidp)
+{
+#if defined(__sun)
+	ucred_t *peer = NULL;
+
+	if (getpeerucred(fd, &peer) != 0)
+		return (-1);
+	*uidp = ucred_geteuid(peer);
+	ucred_free(peer);
+	return (0);
+#elif defined(__OpenBSD__)
+	struct sockpeercred peer;
+	socklen_t len = sizeof (peer);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &len) != 0)
+		return (-1);
+	*uidp = peer.uid;
+	return (0);
+#elif defined(SO_PEERCRED)
+	struct ucred peer;
+	socklen_t len = sizeof (peer);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &len) != 0)
+		return (-1);
+	*uidp = peer.uid;
+	return (0);
+#else
+	gid_t gid;
+
+	return (getpeereid(fd, uidp, &gid));
+#endif
+}
+
+/*
+ * Has the agent on "fd" sign a fresh random challenge with "key", and checks
+ * the signature against it.
+ */
+static int
+pam_agent_challenge(int fd, const struct sshkey *key)
+{
+	uint8_t chal[32];
+	u_char *sig = NULL;
+	size_t siglen;
+	int rc;
+
+	arc4random_buf(chal, sizeof (chal));
+	rc = ssh_agent_sign(fd, key, &sig, &siglen, chal, sizeof (chal),
+	    NULL, 0);
+	if (rc != 0)
+		return (0);
+	rc = sshkey_verify(key, sig, siglen, chal, sizeof (chal), 0);
+	free(sig);
+	return (rc == 0);
+}
+
+/*
+ * Asks the pivy-agent listening on the token's socket to prove that it
+ * holds the card (by signing a challenge with the CAK in 9E), and then to
+ * sign another with one of the allowed keys. This only works if the agent
+ * already has the card and its PIN, but when it does we don't need to touch
+ * any readers at all.
+ *
+ * The socket lives under the user's /run/user directory (never wherever
+ * the caller's environment says), and must be served by a process running
+ * as the user themselves.
+ */
+static int
+pam_agent_auth(const struct tkconfig *tkc, uid_t uid,
+    const struct keylist *keys)
+{
+	struct ssh_identitylist *idl = NULL;
+	uid_t peer;
+	size_t i;
+	int fd, ok = 0;
+
+	if (get_agent_socket(tkc->tkc_sockpath, &fd) != 0)
+		return (0);
+	if (get_peer_uid(fd, &peer) != 0 || peer != uid)
+		goto out;
+	if (!pam_agent_challenge(fd, tkc->tkc_cak))
+		goto out;
+	if (ssh_fetch_identitylist(fd, &idl) != 0)
+		goto out;
+
+	for (i = 0; i < idl->nkeys && !ok; ++i) {
+		if (!pam_key_allowed(keys, idl->keys[i]))
+			continue;
+		ok = pam_agent_challenge(fd, idl->keys[i]);
+	}
+
+out:
+	if (idl != NULL)
+		ssh_free_identitylist(idl);
+	close(fd);
+	return (ok);
+}
+
 PAM_EXTERN int
 pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 {
-	const char *user, *env;
+	const char *user;
 	const struct passwd *pwent;
 	int res = PAM_AUTHINFO_UNAVAIL;
 	int rc;
@@ -154,7 +319,7 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 	struct piv_token *tokens = NULL, *token;
 	struct keylist *keys = NULL, *keyle, *nkeyle;
 	struct tkconfig *tkcs = NULL, *tkc, *ntkc;
-	char *akpath = NULL, *lbuf = NULL, *cp, *spath = NULL, *rdir = NULL;
+	char *akpath = NULL, *lbuf = NULL, *cp, *spath = NULL;
 	char *pin = NULL;
 	size_t lsz;
 	struct dirent *de;
@@ -162,7 +327,14 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 	DIR *d = NULL;
 	FILE *f = NULL;
 	errf_t *err = NULL;
-	int fd;
+	int fd, i, try_agent = 0;
+	uint8_t *guid;
+	size_t guidlen;
+
+	for (i = 0; i < argc; ++i) {
+		if (strcmp(argv[i], "try_agent") == 0)
+			try_agent = 1;
+	}
 
 	if ((res = pam_get_user(pamh, &user, NULL)) != PAM_SUCCESS)
 		return (res);
@@ -174,6 +346,13 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 	res = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &ctx);
 	if (res != SCARD_S_SUCCESS)
 		return (PAM_AUTHINFO_UNAVAIL);
+	/* We mostly only look at GUIDs, so read the rest on demand. */
+	piv_set_lazy_probe(B_TRUE);
+	/*
+	 * No piv_use_reader_cache() here: we're usually running as root on
+	 * behalf of some user, and its default path comes from their
+	 * environment, which we mustn't go creating files in.
+	 */
 
 	akpath = malloc(PATH_MAX);
 	if (akpath == NULL) {
@@ -225,14 +404,6 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 		goto out;
 	}
 
-	env = getenv("XDG_RUNTIME_DIR");
-	if (env != NULL) {
-		rdir = strdup(env);
-	} else {
-		rdir = malloc(PATH_MAX);
-		snprintf(rdir, PATH_MAX, "/run/user/%d", pwent->pw_uid);
-	}
-
 	snprintf(akpath, PATH_MAX, PIVY_AGENT_ENV_DIR, pwent->pw_dir);
 	d = opendir(akpath);
 	if (d != NULL) {
@@ -250,7 +421,7 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 			tkc->tkc_next = tkcs;
 			tkc->tkc_source = strdup(akpath);
 			snprintf(spath, PATH_MAX, PIVY_AGENT_SOCKET,
-			    rdir, de->d_name);
+			    (int)pwent->pw_uid, de->d_name);
 			tkc->tkc_sockpath = strdup(spath);
 			while (getline(&lbuf, &lsz, f) != -1) {
 				if (strncmp(lbuf, "PIV_AGENT_GUID=", 15) == 0) {
@@ -289,66 +460,71 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 		d = NULL;
 	}
 
-	err = piv_enumerate(ctx, &tokens);
-	if (err) {
-		errf_free(err);
-		res = PAM_AUTHINFO_UNAVAIL;
-		goto out;
+	/*
+	 * If the agent for one of these tokens is already holding the card
+	 * (and its PIN), a signature from it is all we need.
+	 */
+	for (tkc = tkcs; try_agent && tkc != NULL; tkc = tkc->tkc_next) {
+		if (pam_agent_auth(tkc, pwent->pw_uid, keys)) {
+			res = PAM_SUCCESS;
+			goto out;
+		}
 	}
 
-	for (token = tokens; token != NULL; token = piv_token_next(token)) {
-		int found = 0;
-
-		for (tkc = tkcs; tkc != NULL; tkc = tkc->tkc_next) {
-			const int cmp = strncasecmp(tkc->tkc_guidhex,
-			    piv_token_guid_hex(token),
-			    strlen(tkc->tkc_guidhex));
-			if (cmp == 0) {
-				err = piv_txn_begin(token);
-				if (err) {
-					errf_free(err);
-					continue;
-				}
-
-				err = piv_select(token);
-				if (err == NULL)
-					err = piv_read_all_certs(token);
-				slot = piv_get_slot(token, PIV_SLOT_CARD_AUTH);
-				if (err == NULL && slot != NULL) {
-					err = piv_auth_key(token, slot,
-					    tkc->tkc_cak);
-				}
+	/*
+	 * Otherwise, find each of the user's tokens directly by GUID rather
+	 * than probing every reader on the system for all of them.
+	 */
+	for (tkc = tkcs; tkc != NULL; tkc = tkc->tkc_next) {
+		piv_release(tokens);
+		tokens = NULL;
 
-				if (err) {
-					piv_txn_end(token);
-					errf_free(err);
-					continue;
-				}
+		guid = parse_hex(tkc->tkc_guidhex, &guidlen);
+		if (guid == NULL)
+			continue;
+		err = piv_find(ctx, guid, guidlen, &tokens);
+		free(guid);
+		if (err) {
+			errf_free(err);
+			continue;
+		}
+		token = tokens;
 
-				slot = NULL;
-				while ((slot = piv_slot_next(token, slot))) {
-					const struct sshkey *pubk =
-					    piv_slot_pubkey(slot);
-					for (keyle = keys; keyle != NULL;
-					    keyle = keyle->kl_next) {
-						if (sshkey_equal_public(
-						    keyle->kl_key,
-						    pubk)) {
-							found = 1;
-							break;
-						}
-					}
-					if (found)
-						break;
-				}
-				if (found)
-					break;
-				piv_txn_end(token);
-			}
+		err = piv_txn_begin(token);
+		if (err) {
+			errf_free(err);
+			continue;
 		}
 
-		if (!found)
+		/*
+		 * We only need 9E to check the CAK, and it's usually the key
+		 * we're looking for as well. If it isn't, 9A is the next most
+		 * likely, and only then do we read all the rest.
+		 */
+		err = piv_select(token);
+		if (err == NULL)
+			err = piv_read_certs(token, PIV_SLOTMASK_9E);
+		slot = piv_get_slot(token, PIV_SLOT_CARD_AUTH);
+		if (err == NULL && slot != NULL)
+			err = piv_auth_key(token, slot, tkc->tkc_cak);
+		if (err == NULL)
+			slot = pam_allowed_slot(token, keys);
+		if (err == NULL && slot == NULL) {
+			err = piv_read_certs(token, PIV_SLOTMASK_9A);
+			if (err == NULL)
+				slot = pam_allowed_slot(token, keys);
+		}
+		if (err == NULL && slot == NULL) {
+			err = piv_read_certs(token, PIV_SLOTMASK_ALL &
+			    ~(PIV_SLOTMASK_9E | PIV_SLOTMASK_9A));
+			if (err == NULL)
+				slot = pam_allowed_slot(token, keys);
+		}
+		if (err || slot == NULL) {
+			piv_txn_end(token);
+			errf_free(err);
 			continue;
+		}
 
 again:
 		err = piv_auth_key(token, slot, piv_slot_pubkey(slot));
@@ -498,7 +674,6 @@ out:
 	free(akpath);
 	free(spath);
 	free(lbuf);
-	free(rdir);
 	if (pin != NULL) {
 		explicit_bzero(pin, strlen(pin));
 		free(pin);
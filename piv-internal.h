@@ -85,4 +85,32 @@ enum piv_certinfo_flags {
 	PIV_CI_COMPTYPE = 0x03,
 };
 
+extern const uint8_t AID_PIV[11];
+
+/*
+ * The transport underneath a piv_token: normally libpcsc, but we can also
+ * talk to a virtual in-process token (see piv-virt.c). The return values are
+ * PCSC codes (SCARD_S_SUCCESS etc) either way, so that all the error handling
+ * in piv.c works the same.
+ */
+struct piv_transport {
+	LONG	(*ptr_begin)(void *);
+	LONG	(*ptr_end)(void *, boolean_t reset);
+	LONG	(*ptr_transmit)(void *, const uint8_t *cmd, size_t cmdlen,
+		    uint8_t *resp, DWORD *resplen);
+	void	(*ptr_disconnect)(void *);
+};
+
+extern const struct piv_transport piv_virt_transport;
+
+/* How many virtual tokens were set up by piv_virt_init() */
+uint piv_virt_count(void);
+
+/*
+ * Returns the transport argument (and reader name and ATR) to use for talking
+ * to a virtual token.
+ */
+void *piv_virt_open(uint idx, const char **rdrname, const uint8_t **atr,
+    size_t *atrlen);
+
 #endif
@@ -0,0 +1,977 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2019, Joyent Inc
+ */
+
+/*
+ * Virtual PIV tokens: a small software implementation of the PIV applet,
+ * living in-process, which piv.c can talk to through a piv_transport instead
+ * of going to PCSC. It exists so that we can benchmark and load-test the rest
+ * of the stack (agent, ebox, TLV etc) without real cards, and without their
+ * latency getting mixed into the numbers (or with a known amount of it added
+ * back in, if we want that).
+ *
+ * It implements just enough of [piv] 800-73-4 part 2 for what piv.c uses:
+ * SELECT, GET DATA, PUT DATA, VERIFY, GENERAL AUTHENTICATE (signing, ECDH and
+ * 9B admin auth) and GENERATE ASYMMETRIC KEY PAIR, with command chaining and
+ * GET RESPONSE. Everything else gets SW_INS_NOT_SUP, so it looks like a
+ * plain (non-YubiKey) PIV card.
+ *
+ * None of this is meant to be secure! The keys are in ordinary memory and go
+ * away when the process exits.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#if defined(__APPLE__)
+#include <PCSC/wintypes.h>
+#include <PCSC/winscard.h>
+#else
+#include <wintypes.h>
+#include <winscard.h>
+#endif
+
+#include "libssh/sshkey.h"
+#include "libssh/sshbuf.h"
+#include "libssh/cipher.h"
+
+#include <openssl/x509.h>
+#include <openssl/ecdsa.h>
+#include <openssl/ecdh.h>
+#include <openssl/rsa.h>
+
+#include "debug.h"
+#include "tlv.h"
+#include "piv.h"
+#include "bunyan.h"
+#include "utils.h"
+#include "piv-internal.h"
+
+#define	VIRT_MAX_TOKENS		64
+#define	VIRT_PIN		"123456"
+#define	VIRT_PIN_RETRIES	3
+
+/*
+ * T=1, and historical bytes with card capabilities saying we can do
+ * extended length APDUs (see piv_probe_ext_apdu() in piv.c).
+ */
+static const uint8_t virt_atr[] = {
+	0x3B, 0x85, 0x01,		/* TS, T0 (5 hist bytes), TD1 (T=1) */
+	0x80, 0x73, 0x00, 0x00, 0x40,	/* Card capabilities */
+	0x37				/* TCK */
+};
+
+static const uint8_t virt_admin_default[] = {
+	0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+	0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+	0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08
+};
+
+static const enum piv_alg virt_algs[] = {
+	PIV_ALG_3DES, PIV_ALG_RSA1024, PIV_ALG_RSA2048, PIV_ALG_ECCP256,
+	PIV_ALG_ECCP384
+};
+
+/* The slots we put keys in at startup, and their cert objects. */
+static const struct {
+	enum piv_slotid vs_slot;
+	uint vs_tag;
+} virt_slots[] = {
+	{ PIV_SLOT_9A, PIV_TAG_CERT_9A },
+	{ PIV_SLOT_9C, PIV_TAG_CERT_9C },
+	{ PIV_SLOT_9D, PIV_TAG_CERT_9D },
+	{ PIV_SLOT_9E, PIV_TAG_CERT_9E }
+};
+
+struct virt_obj {
+	struct virt_obj *vo_next;
+	uint vo_tag;
+	uint8_t *vo_data;
+	size_t vo_len;
+};
+
+struct virt_card {
+	uint vc_idx;
+	char vc_rdrname[32];
+	uint8_t vc_guid[GUID_LEN];
+
+	/*
+	 * Held for the length of a transaction. piv.c only ever sends APDUs
+	 * inside one, so this protects everything below too.
+	 */
+	pthread_mutex_t vc_txn;
+
+	boolean_t vc_selected;
+	struct virt_obj *vc_objs;
+
+	/* Indexed by slot ID */
+	struct sshkey *vc_keys[256];
+	enum piv_alg vc_keyalgs[256];
+
+	char vc_pin[9];
+	uint vc_pin_retries;
+	boolean_t vc_pin_ok;
+
+	uint8_t vc_admin[sizeof (virt_admin_default)];
+	uint8_t vc_chal[8];
+	boolean_t vc_chal_valid;
+	boolean_t vc_admin_ok;
+
+	/* Command data so far, if the host is chaining. */
+	struct sshbuf *vc_cmd;
+	/* Reply data waiting for INS_CONTINUE, and its eventual SW. */
+	struct sshbuf *vc_resp;
+	uint16_t vc_resp_sw;
+};
+
+struct virt_apdu {
+	uint8_t va_cla;
+	uint8_t va_ins;
+	uint8_t va_p1;
+	uint8_t va_p2;
+	const uint8_t *va_data;
+	size_t va_lc;
+	size_t va_le;
+};
+
+struct virt_tlv {
+	uint vt_tag;
+	const uint8_t *vt_data;
+	size_t vt_len;
+};
+
+static struct virt_card *virt_cards = NULL;
+static uint virt_ncards = 0;
+static useconds_t virt_latency = 0;
+
+static void
+virt_obj_put(struct virt_card *vc, uint tag, const uint8_t *data, size_t len)
+{
+	struct virt_obj *vo, **pvo;
+
+	for (pvo = &vc->vc_objs; (vo = *pvo) != NULL; pvo = &vo->vo_next) {
+		if (vo->vo_tag == tag)
+			break;
+	}
+	if (vo == NULL) {
+		vo = calloc(1, sizeof (*vo));
+		VERIFY(vo != NULL);
+		vo->vo_tag = tag;
+		*pvo = vo;
+	}
+	free(vo->vo_data);
+	vo->vo_data = malloc(len);
+	VERIFY(len == 0 || vo->vo_data != NULL);
+	bcopy(data, vo->vo_data, len);
+	vo->vo_len = len;
+}
+
+static const struct virt_obj *
+virt_obj_get(const struct virt_card *vc, uint tag)
+{
+	const struct virt_obj *vo;
+
+	for (vo = vc->vc_objs; vo != NULL; vo = vo->vo_next) {
+		if (vo->vo_tag == tag)
+			return (vo);
+	}
+	return (NULL);
+}
+
+/*
+ * Splits up a template (like the 7C in GENERAL AUTHENTICATE) into the tags
+ * directly under it. Returns the number found (anything past max is
+ * ignored), or -1 if it doesn't parse.
+ */
+static int
+virt_split(const uint8_t *data, size_t len, uint tag, struct virt_tlv *tlvs,
+    uint max)
+{
+	struct tlv_state *tlv;
+	errf_t *err;
+	uint t;
+	int n = 0;
+
+	if (len == 0)
+		return (-1);
+	tlv = tlv_init(data, 0, len);
+	VERIFY(tlv != NULL);
+	if ((err = tlv_read_tag(tlv, &t)))
+		goto bad;
+	if (t != tag)
+		goto bad;
+	while (!tlv_at_end(tlv)) {
+		if ((err = tlv_read_tag(tlv, &t)))
+			goto bad;
+		if (n < max) {
+			tlvs[n].vt_tag = t;
+			tlvs[n].vt_data = tlv_ptr(tlv);
+			tlvs[n].vt_len = tlv_rem(tlv);
+			++n;
+		}
+		tlv_skip(tlv);
+	}
+	if ((err = tlv_end(tlv)))
+		goto bad;
+	tlv_free(tlv);
+	return (n);
+
+bad:
+	errf_free(err);
+	tlv_abort(tlv);
+	tlv_free(tlv);
+	return (-1);
+}
+
+/*
+ * Parses the 5C tag list at the start of GET DATA and PUT DATA, and the 53
+ * object after it (for PUT DATA, when objp != NULL).
+ */
+static boolean_t
+virt_parse_obj(const uint8_t *data, size_t len, uint *tagp,
+    const uint8_t **objp, size_t *objlenp)
+{
+	struct tlv_state *tlv;
+	errf_t *err = ERRF_OK;
+	uint t;
+	uint32_t tag;
+
+	if (len == 0)
+		return (B_FALSE);
+	tlv = tlv_init(data, 0, len);
+	VERIFY(tlv != NULL);
+	if ((err = tlv_read_tag(tlv, &t)))
+		goto bad;
+	if (t != 0x5C)
+		goto bad;
+	if ((err = tlv_read_u8to32(tlv, &tag)) || (err = tlv_end(tlv)))
+		goto bad;
+	*tagp = tag;
+	if (objp != NULL) {
+		if ((err = tlv_read_tag(tlv, &t)))
+			goto bad;
+		if (t != 0x53)
+			goto bad;
+		*objp = tlv_ptr(tlv);
+		*objlenp = tlv_rem(tlv);
+		tlv_skip(tlv);
+	}
+	tlv_free(tlv);
+	return (B_TRUE);
+
+bad:
+	errf_free(err);
+	tlv_abort(tlv);
+	tlv_free(tlv);
+	return (B_FALSE);
+}
+
+static void
+virt_put_tlv(struct sshbuf *out, struct tlv_state *tlv)
+{
+	VERIFY0(sshbuf_put(out, tlv_buf(tlv), tlv_len(tlv)));
+	tlv_free(tlv);
+}
+
+static uint16_t
+virt_select(struct virt_card *vc, const struct virt_apdu *a,
+    const uint8_t *data, size_t len, struct sshbuf *out)
+{
+	struct tlv_state *tlv;
+	uint i;
+
+	if (a->va_p1 != SEL_APP_AID || len == 0 || len > sizeof (AID_PIV) ||
+	    bcmp(data, AID_PIV, len) != 0) {
+		vc->vc_selected = B_FALSE;
+		return (SW_FILE_NOT_FOUND);
+	}
+	vc->vc_selected = B_TRUE;
+
+	tlv = tlv_init_write();
+	VERIFY(tlv != NULL);
+	tlv_push(tlv, 0x61);		/* Application property template */
+	tlv_push(tlv, 0x4F);		/* AID */
+	tlv_write(tlv, AID_PIV, sizeof (AID_PIV));
+	tlv_pop(tlv);
+	tlv_push(tlv, 0xAC);		/* Supported algorithms */
+	for (i = 0; i < sizeof (virt_algs) / sizeof (virt_algs[0]); ++i) {
+		tlv_push(tlv, 0x80);
+		tlv_write_byte(tlv, virt_algs[i]);
+		tlv_pop(tlv);
+	}
+	tlv_push(tlv, 0x06);
+	tlv_pop(tlv);
+	tlv_pop(tlv);
+	tlv_pop(tlv);
+	virt_put_tlv(out, tlv);
+
+	return (SW_NO_ERROR);
+}
+
+static uint16_t
+virt_get_data(struct virt_card *vc, const struct virt_apdu *a,
+    const uint8_t *data, size_t len, struct sshbuf *out)
+{
+	const struct virt_obj *vo;
+	struct tlv_state *tlv;
+	uint tag;
+
+	if (a->va_p1 != 0x3F || a->va_p2 != 0xFF)
+		return (SW_INCORRECT_P1P2);
+	if (!virt_parse_obj(data, len, &tag, NULL, NULL))
+		return (SW_WRONG_DATA);
+	if ((vo = virt_obj_get(vc, tag)) == NULL)
+		return (SW_FILE_NOT_FOUND);
+
+	tlv = tlv_init_write();
+	VERIFY(tlv != NULL);
+	tlv_pushl(tlv, 0x53, vo->vo_len);
+	tlv_write(tlv, vo->vo_data, vo->vo_len);
+	tlv_pop(tlv);
+	virt_put_tlv(out, tlv);
+
+	return (SW_NO_ERROR);
+}
+
+static uint16_t
+virt_put_data(struct virt_card *vc, const struct virt_apdu *a,
+    const uint8_t *data, size_t len)
+{
+	const uint8_t *obj;
+	size_t objlen;
+	uint tag;
+
+	if (a->va_p1 != 0x3F || a->va_p2 != 0xFF)
+		return (SW_INCORRECT_P1P2);
+	if (!vc->vc_admin_ok)
+		return (SW_SECURITY_STATUS_NOT_SATISFIED);
+	if (!virt_parse_obj(data, len, &tag, &obj, &objlen))
+		return (SW_WRONG_DATA);
+	virt_obj_put(vc, tag, obj, objlen);
+
+	return (SW_NO_ERROR);
+}
+
+static uint16_t
+virt_verify(struct virt_card *vc, const struct virt_apdu *a,
+    const uint8_t *data, size_t len)
+{
+	size_t pinlen;
+
+	if (a->va_p2 != PIV_PIN)
+		return (SW_INCORRECT_P1P2);
+	if (a->va_p1 == 0xFF) {
+		/* Reset the security status */
+		vc->vc_pin_ok = B_FALSE;
+		return (SW_NO_ERROR);
+	}
+	if (a->va_p1 != 0x00)
+		return (SW_INCORRECT_P1P2);
+
+	if (len == 0) {
+		if (vc->vc_pin_ok)
+			return (SW_NO_ERROR);
+		if (vc->vc_pin_retries == 0)
+			return (SW_FILE_INVALID);
+		return (SW_INCORRECT_PIN | vc->vc_pin_retries);
+	}
+	if (len != 8)
+		return (SW_WRONG_LENGTH);
+	if (vc->vc_pin_retries == 0)
+		return (SW_FILE_INVALID);
+
+	for (pinlen = 0; pinlen < len && data[pinlen] != 0xFF; ++pinlen)
+		;
+	if (pinlen == strlen(vc->vc_pin) &&
+	    timingsafe_bcmp(data, vc->vc_pin, pinlen) == 0) {
+		vc->vc_pin_retries = VIRT_PIN_RETRIES;
+		vc->vc_pin_ok = B_TRUE;
+		return (SW_NO_ERROR);
+	}
+	vc->vc_pin_ok = B_FALSE;
+	if (--vc->vc_pin_retries == 0)
+		return (SW_FILE_INVALID);
+	return (SW_INCORRECT_PIN | vc->vc_pin_retries);
+}
+
+/*
+ * The 9B admin key: we only do the single-step challenge-response that
+ * piv_auth_admin() uses (card sends a challenge, host encrypts it).
+ */
+static uint16_t
+virt_admin_auth(struct virt_card *vc, uint8_t alg, const struct virt_tlv *chal,
+    const struct virt_tlv *resp, struct sshbuf *out)
+{
+	const struct sshcipher *cipher;
+	struct sshcipher_ctx *cctx;
+	struct tlv_state *tlv;
+	uint8_t iv[8], expect[sizeof (vc->vc_chal)];
+	boolean_t ok;
+
+	if (alg != PIV_ALG_3DES)
+		return (SW_INCORRECT_P1P2);
+
+	if (chal != NULL && chal->vt_len == 0) {
+		arc4random_buf(vc->vc_chal, sizeof (vc->vc_chal));
+		vc->vc_chal_valid = B_TRUE;
+		vc->vc_admin_ok = B_FALSE;
+
+		tlv = tlv_init_write();
+		VERIFY(tlv != NULL);
+		tlv_push(tlv, 0x7C);
+		tlv_push(tlv, 0x81);
+		tlv_write(tlv, vc->vc_chal, sizeof (vc->vc_chal));
+		tlv_pop(tlv);
+		tlv_pop(tlv);
+		virt_put_tlv(out, tlv);
+		return (SW_NO_ERROR);
+	}
+
+	if (resp == NULL || !vc->vc_chal_valid)
+		return (SW_WRONG_DATA);
+	vc->vc_chal_valid = B_FALSE;
+
+	cipher = cipher_by_name("3des-cbc");
+	VERIFY(cipher != NULL);
+	VERIFY3U(cipher_ivlen(cipher), ==, sizeof (iv));
+	bzero(iv, sizeof (iv));
+	VERIFY0(cipher_init(&cctx, cipher, vc->vc_admin, sizeof (vc->vc_admin),
+	    iv, sizeof (iv), 1));
+	VERIFY0(cipher_crypt(cctx, 0, expect, vc->vc_chal, sizeof (expect),
+	    0, 0));
+	cipher_free(cctx);
+
+	ok = (resp->vt_len == sizeof (expect) &&
+	    timingsafe_bcmp(resp->vt_data, expect, sizeof (expect)) == 0);
+	explicit_bzero(expect, sizeof (expect));
+	if (!ok)
+		return (SW_WRONG_DATA);
+	vc->vc_admin_ok = B_TRUE;
+	return (SW_NO_ERROR);
+}
+
+static uint16_t
+virt_gen_auth(struct virt_card *vc, const struct virt_apdu *a,
+    const uint8_t *data, size_t len, struct sshbuf *out)
+{
+	struct virt_tlv t[4];
+	const struct virt_tlv *chal = NULL, *resp = NULL, *exp = NULL;
+	struct sshkey *k;
+	struct tlv_state *tlv;
+	uint8_t res[512], *p;
+	int i, n, rv;
+	ECDSA_SIG *sig;
+	const EC_GROUP *g;
+	EC_POINT *point;
+
+	if ((n = virt_split(data, len, 0x7C, t, 4)) < 0)
+		return (SW_WRONG_DATA);
+	for (i = 0; i < n; ++i) {
+		switch (t[i].vt_tag) {
+		case 0x81:
+			chal = &t[i];
+			break;
+		case 0x82:
+			resp = &t[i];
+			break;
+		case 0x85:
+			exp = &t[i];
+			break;
+		}
+	}
+
+	if (a->va_p2 == PIV_SLOT_ADMIN)
+		return (virt_admin_auth(vc, a->va_p1, chal, resp, out));
+
+	k = vc->vc_keys[a->va_p2];
+	if (k == NULL || a->va_p1 != vc->vc_keyalgs[a->va_p2])
+		return (SW_INCORRECT_P1P2);
+	if (a->va_p2 != PIV_SLOT_CARD_AUTH && !vc->vc_pin_ok)
+		return (SW_SECURITY_STATUS_NOT_SATISFIED);
+	if (resp == NULL || resp->vt_len != 0)
+		return (SW_WRONG_DATA);
+
+	if (chal != NULL && k->type == KEY_ECDSA) {
+		VERIFY3S(ECDSA_size(k->ecdsa), <=, sizeof (res));
+		sig = ECDSA_do_sign(chal->vt_data, chal->vt_len, k->ecdsa);
+		if (sig == NULL)
+			return (SW_WRONG_DATA);
+		p = res;
+		rv = i2d_ECDSA_SIG(sig, &p);
+		ECDSA_SIG_free(sig);
+		if (rv <= 0)
+			return (SW_WRONG_DATA);
+
+	} else if (chal != NULL && k->type == KEY_RSA) {
+		VERIFY3S(RSA_size(k->rsa), <=, sizeof (res));
+		if (chal->vt_len != (size_t)RSA_size(k->rsa))
+			return (SW_WRONG_LENGTH);
+		rv = RSA_private_encrypt(chal->vt_len, chal->vt_data, res,
+		    k->rsa, RSA_NO_PADDING);
+		if (rv <= 0)
+			return (SW_WRONG_DATA);
+
+	} else if (exp != NULL && k->type == KEY_ECDSA) {
+		g = EC_KEY_get0_group(k->ecdsa);
+		point = EC_POINT_new(g);
+		VERIFY(point != NULL);
+		if (EC_POINT_oct2point(g, point, exp->vt_data, exp->vt_len,
+		    NULL) != 1) {
+			EC_POINT_free(point);
+			return (SW_WRONG_DATA);
+		}
+		rv = ECDH_compute_key(res, (EC_GROUP_get_degree(g) + 7) / 8,
+		    point, k->ecdsa, NULL);
+		EC_POINT_free(point);
+		if (rv <= 0)
+			return (SW_WRONG_DATA);
+
+	} else {
+		return (SW_WRONG_DATA);
+	}
+
+	tlv = tlv_init_write();
+	VERIFY(tlv != NULL);
+	tlv_pushl(tlv, 0x7C, rv + 4);
+	tlv_pushl(tlv, 0x82, rv);
+	tlv_write(tlv, res, rv);
+	tlv_pop(tlv);
+	tlv_pop(tlv);
+	virt_put_tlv(out, tlv);
+	explicit_bzero(res, sizeof (res));
+
+	return (SW_NO_ERROR);
+}
+
+static void
+virt_write_bn(struct tlv_state *tlv, uint tag, const BIGNUM *v)
+{
+	uint8_t buf[512];
+	int len;
+
+	len = BN_num_bytes(v);
+	VERIFY3S(len, <=, sizeof (buf));
+	VERIFY3S(BN_bn2bin(v, buf), ==, len);
+	tlv_pushl(tlv, tag, len);
+	tlv_write(tlv, buf, len);
+	tlv_pop(tlv);
+}
+
+static uint16_t
+virt_generate(struct virt_card *vc, const struct virt_apdu *a,
+    const uint8_t *data, size_t len, struct sshbuf *out)
+{
+	struct virt_tlv t[2];
+	struct sshkey *k;
+	struct tlv_state *tlv;
+	uint8_t pt[133];
+	size_t ptlen;
+	int i, n, type;
+	uint bits;
+	enum piv_alg alg = 0;
+
+	if (!vc->vc_admin_ok)
+		return (SW_SECURITY_STATUS_NOT_SATISFIED);
+	if (a->va_p1 != 0x00 || a->va_p2 == PIV_SLOT_ADMIN)
+		return (SW_INCORRECT_P1P2);
+	if ((n = virt_split(data, len, 0xAC, t, 2)) < 0)
+		return (SW_WRONG_DATA);
+	for (i = 0; i < n; ++i) {
+		if (t[i].vt_tag == 0x80 && t[i].vt_len == 1)
+			alg = t[i].vt_data[0];
+	}
+	switch (alg) {
+	case PIV_ALG_RSA1024:
+		type = KEY_RSA;
+		bits = 1024;
+		break;
+	case PIV_ALG_RSA2048:
+		type = KEY_RSA;
+		bits = 2048;
+		break;
+	case PIV_ALG_ECCP256:
+		type = KEY_ECDSA;
+		bits = 256;
+		break;
+	case PIV_ALG_ECCP384:
+		type = KEY_ECDSA;
+		bits = 384;
+		break;
+	default:
+		return (SW_WRONG_DATA);
+	}
+	if (sshkey_generate(type, bits, &k) != 0)
+		return (SW_OUT_OF_MEMORY);
+	sshkey_free(vc->vc_keys[a->va_p2]);
+	vc->vc_keys[a->va_p2] = k;
+	vc->vc_keyalgs[a->va_p2] = alg;
+
+	tlv = tlv_init_write();
+	VERIFY(tlv != NULL);
+	tlv_pushl(tlv, 0x7F49, 600);
+	if (type == KEY_ECDSA) {
+		ptlen = EC_POINT_point2oct(EC_KEY_get0_group(k->ecdsa),
+		    EC_KEY_get0_public_key(k->ecdsa),
+		    POINT_CONVERSION_UNCOMPRESSED, pt, sizeof (pt), NULL);
+		VERIFY(ptlen > 0);
+		tlv_push(tlv, 0x86);
+		tlv_write(tlv, pt, ptlen);
+		tlv_pop(tlv);
+	} else {
+		virt_write_bn(tlv, 0x81, k->rsa->n);
+		virt_write_bn(tlv, 0x82, k->rsa->e);
+	}
+	tlv_pop(tlv);
+	virt_put_tlv(out, tlv);
+
+	return (SW_NO_ERROR);
+}
+
+static uint16_t
+virt_exec(struct virt_card *vc, const struct virt_apdu *a,
+    const uint8_t *data, size_t len, struct sshbuf *out)
+{
+	if (a->va_ins == INS_SELECT)
+		return (virt_select(vc, a, data, len, out));
+	if (!vc->vc_selected)
+		return (SW_INS_NOT_SUP);
+
+	switch (a->va_ins) {
+	case INS_GET_DATA:
+		return (virt_get_data(vc, a, data, len, out));
+	case INS_PUT_DATA:
+		return (virt_put_data(vc, a, data, len));
+	case INS_VERIFY:
+		return (virt_verify(vc, a, data, len));
+	case INS_GEN_AUTH:
+		return (virt_gen_auth(vc, a, data, len, out));
+	case INS_GEN_ASYM:
+		return (virt_generate(vc, a, data, len, out));
+	default:
+		return (SW_INS_NOT_SUP);
+	}
+}
+
+/*
+ * Splits up a command APDU, short or extended. See [iso7816] part 3 for the
+ * four cases (no data or Le, Le only, data only, data and Le).
+ */
+static boolean_t
+virt_apdu_parse(const uint8_t *cmd, size_t len, struct virt_apdu *a)
+{
+	size_t n;
+
+	bzero(a, sizeof (*a));
+	if (len < 4)
+		return (B_FALSE);
+	a->va_cla = cmd[0];
+	a->va_ins = cmd[1];
+	a->va_p1 = cmd[2];
+	a->va_p2 = cmd[3];
+	a->va_le = 256;
+	if (len == 4)
+		return (B_TRUE);
+
+	if (len == 5) {
+		a->va_le = (cmd[4] == 0) ? 256 : cmd[4];
+		return (B_TRUE);
+	}
+
+	if (cmd[4] != 0) {
+		a->va_lc = cmd[4];
+		a->va_data = &cmd[5];
+		n = 5 + a->va_lc;
+		if (len == n + 1)
+			a->va_le = (cmd[n] == 0) ? 256 : cmd[n];
+		else if (len != n)
+			return (B_FALSE);
+		return (B_TRUE);
+	}
+
+	/* Extended length */
+	if (len < 7)
+		return (B_FALSE);
+	if (len == 7) {
+		a->va_le = (cmd[5] << 8) | cmd[6];
+		if (a->va_le == 0)
+			a->va_le = 65536;
+		return (B_TRUE);
+	}
+	a->va_lc = (cmd[5] << 8) | cmd[6];
+	a->va_data = &cmd[7];
+	n = 7 + a->va_lc;
+	if (len == n + 2) {
+		a->va_le = (cmd[n] << 8) | cmd[n + 1];
+		if (a->va_le == 0)
+			a->va_le = 65536;
+	} else if (len != n) {
+		return (B_FALSE);
+	}
+	return (B_TRUE);
+}
+
+static LONG
+virt_begin(void *arg)
+{
+	struct virt_card *vc = arg;
+
+	VERIFY0(pthread_mutex_lock(&vc->vc_txn));
+	return (SCARD_S_SUCCESS);
+}
+
+static LONG
+virt_end(void *arg, boolean_t reset)
+{
+	struct virt_card *vc = arg;
+
+	if (reset) {
+		vc->vc_selected = B_FALSE;
+		vc->vc_pin_ok = B_FALSE;
+		vc->vc_admin_ok = B_FALSE;
+		vc->vc_chal_valid = B_FALSE;
+	}
+	sshbuf_reset(vc->vc_cmd);
+	sshbuf_reset(vc->vc_resp);
+	VERIFY0(pthread_mutex_unlock(&vc->vc_txn));
+	return (SCARD_S_SUCCESS);
+}
+
+static LONG
+virt_transmit(void *arg, const uint8_t *cmd, size_t cmdlen, uint8_t *resp,
+    DWORD *resplen)
+{
+	struct virt_card *vc = arg;
+	struct virt_apdu a;
+	size_t n, rem;
+	uint16_t sw;
+
+	if (virt_latency > 0)
+		(void) usleep(virt_latency);
+
+	if (*resplen < 2)
+		return (SCARD_E_INSUFFICIENT_BUFFER);
+
+	if (!virt_apdu_parse(cmd, cmdlen, &a)) {
+		sshbuf_reset(vc->vc_resp);
+		vc->vc_resp_sw = SW_WRONG_LENGTH;
+	} else if (a.va_ins == INS_CONTINUE) {
+		if (sshbuf_len(vc->vc_resp) == 0)
+			vc->vc_resp_sw = SW_WRONG_DATA;
+	} else {
+		sshbuf_reset(vc->vc_resp);
+		if (a.va_lc > 0)
+			VERIFY0(sshbuf_put(vc->vc_cmd, a.va_data, a.va_lc));
+		if (a.va_cla & CLA_CHAIN) {
+			vc->vc_resp_sw = SW_NO_ERROR;
+		} else {
+			vc->vc_resp_sw = virt_exec(vc, &a,
+			    sshbuf_ptr(vc->vc_cmd), sshbuf_len(vc->vc_cmd),
+			    vc->vc_resp);
+			sshbuf_reset(vc->vc_cmd);
+		}
+	}
+
+	n = sshbuf_len(vc->vc_resp);
+	if (n > a.va_le)
+		n = a.va_le;
+	if (n > *resplen - 2)
+		n = *resplen - 2;
+	bcopy(sshbuf_ptr(vc->vc_resp), resp, n);
+	VERIFY0(sshbuf_consume(vc->vc_resp, n));
+
+	rem = sshbuf_len(vc->vc_resp);
+	if (rem > 0)
+		sw = SW_BYTES_REMAINING_00 | (rem > 0xFF ? 0 : rem);
+	else
+		sw = vc->vc_resp_sw;
+	resp[n] = sw >> 8;
+	resp[n + 1] = sw & 0xFF;
+	*resplen = n + 2;
+
+	return (SCARD_S_SUCCESS);
+}
+
+static void
+virt_disconnect(void *arg)
+{
+	/* The card state lives as long as the process does. */
+}
+
+const struct piv_transport piv_virt_transport = {
+	.ptr_begin = virt_begin,
+	.ptr_end = virt_end,
+	.ptr_transmit = virt_transmit,
+	.ptr_disconnect = virt_disconnect
+};
+
+static void
+virt_make_cert(struct virt_card *vc, enum piv_slotid slotid, uint tag)
+{
+	struct sshkey *k = vc->vc_keys[slotid];
+	struct tlv_state *tlv;
+	EVP_PKEY *pkey;
+	X509 *cert;
+	X509_NAME *subj;
+	char cn[32];
+	uint8_t *der = NULL;
+	int len;
+
+	pkey = EVP_PKEY_new();
+	VERIFY(pkey != NULL);
+	VERIFY(EVP_PKEY_set1_EC_KEY(pkey, k->ecdsa) == 1);
+
+	cert = X509_new();
+	VERIFY(cert != NULL);
+	VERIFY(X509_set_version(cert, 2) == 1);
+	VERIFY(ASN1_INTEGER_set(X509_get_serialNumber(cert), slotid) == 1);
+	VERIFY(X509_gmtime_adj(X509_get_notBefore(cert), 0) != NULL);
+	VERIFY(X509_gmtime_adj(X509_get_notAfter(cert), 315360000L) != NULL);
+
+	(void) snprintf(cn, sizeof (cn), "virtual-%u-%02x", vc->vc_idx,
+	    (uint)slotid);
+	subj = X509_get_subject_name(cert);
+	VERIFY(X509_NAME_add_entry_by_NID(subj, NID_commonName,
+	    MBSTRING_ASC, (unsigned char *)cn, -1, -1, 0) == 1);
+	VERIFY(X509_set_issuer_name(cert, subj) == 1);
+	VERIFY(X509_set_pubkey(cert, pkey) == 1);
+	VERIFY(X509_sign(cert, pkey, EVP_sha256()) > 0);
+
+	len = i2d_X509(cert, &der);
+	VERIFY(len > 0);
+
+	tlv = tlv_init_write();
+	VERIFY(tlv != NULL);
+	tlv_pushl(tlv, 0x70, len);
+	tlv_write(tlv, der, len);
+	tlv_pop(tlv);
+	tlv_push(tlv, 0x71);
+	tlv_write_byte(tlv, PIV_COMP_NONE);
+	tlv_pop(tlv);
+	virt_obj_put(vc, tag, tlv_buf(tlv), tlv_len(tlv));
+	tlv_free(tlv);
+
+	OPENSSL_free(der);
+	X509_free(cert);
+	EVP_PKEY_free(pkey);
+}
+
+static void
+virt_card_init(struct virt_card *vc, uint idx)
+{
+	struct tlv_state *tlv;
+	enum piv_slotid slotid;
+	uint i;
+
+	vc->vc_idx = idx;
+	(void) snprintf(vc->vc_rdrname, sizeof (vc->vc_rdrname),
+	    "Virtual PIV Token %u", idx);
+	VERIFY0(pthread_mutex_init(&vc->vc_txn, NULL));
+
+	/*
+	 * The GUID only depends on the index, so that it's the same from one
+	 * run to the next (and can go in an agent's config).
+	 */
+	bcopy("pivy-virtual", vc->vc_guid, 12);
+	vc->vc_guid[12] = (idx >> 24) & 0xFF;
+	vc->vc_guid[13] = (idx >> 16) & 0xFF;
+	vc->vc_guid[14] = (idx >> 8) & 0xFF;
+	vc->vc_guid[15] = idx & 0xFF;
+
+	bcopy(VIRT_PIN, vc->vc_pin, sizeof (VIRT_PIN));
+	vc->vc_pin_retries = VIRT_PIN_RETRIES;
+	bcopy(virt_admin_default, vc->vc_admin, sizeof (vc->vc_admin));
+
+	vc->vc_cmd = sshbuf_new();
+	VERIFY(vc->vc_cmd != NULL);
+	vc->vc_resp = sshbuf_new();
+	VERIFY(vc->vc_resp != NULL);
+
+	tlv = tlv_init_write();
+	VERIFY(tlv != NULL);
+	tlv_push(tlv, 0x34);		/* Card GUID */
+	tlv_write(tlv, vc->vc_guid, sizeof (vc->vc_guid));
+	tlv_pop(tlv);
+	tlv_push(tlv, 0x35);		/* Expiration date */
+	tlv_write(tlv, (const uint8_t *)"20991231", 8);
+	tlv_pop(tlv);
+	tlv_push(tlv, 0x3E);		/* Signature (none) */
+	tlv_pop(tlv);
+	tlv_push(tlv, 0xFE);		/* CRC */
+	tlv_pop(tlv);
+	virt_obj_put(vc, PIV_TAG_CHUID, tlv_buf(tlv), tlv_len(tlv));
+	tlv_free(tlv);
+
+	for (i = 0; i < sizeof (virt_slots) / sizeof (virt_slots[0]); ++i) {
+		slotid = virt_slots[i].vs_slot;
+		VERIFY0(sshkey_generate(KEY_ECDSA, 256, &vc->vc_keys[slotid]));
+		vc->vc_keyalgs[slotid] = PIV_ALG_ECCP256;
+		virt_make_cert(vc, slotid, virt_slots[i].vs_tag);
+	}
+}
+
+errf_t *
+piv_virt_init(const char *spec)
+{
+	unsigned long count, latency = 0;
+	char *p;
+	uint i;
+
+	if (virt_cards != NULL) {
+		return (errf("AlreadyInitError", NULL,
+		    "Virtual tokens have already been set up"));
+	}
+
+	errno = 0;
+	count = strtoul(spec, &p, 10);
+	if (errno == 0 && *p == ':')
+		latency = strtoul(p + 1, &p, 10);
+	if (errno != 0 || *p != '\0' || count < 1 ||
+	    count > VIRT_MAX_TOKENS || latency >= 1000000) {
+		return (argerrf("spec", "'count[:latency_us]' with 1-%u "
+		    "tokens and under 1s latency", "'%s'", VIRT_MAX_TOKENS,
+		    spec));
+	}
+
+	virt_cards = calloc(count, sizeof (struct virt_card));
+	VERIFY(virt_cards != NULL);
+	for (i = 0; i < count; ++i)
+		virt_card_init(&virt_cards[i], i);
+	virt_ncards = count;
+	virt_latency = latency;
+
+	bunyan_log(BNY_INFO, "set up virtual PIV tokens",
+	    "count", BNY_UINT, (uint)count,
+	    "latency_us", BNY_UINT, (uint)latency, NULL);
+
+	return (ERRF_OK);
+}
+
+uint
+piv_virt_count(void)
+{
+	return (virt_ncards);
+}
+
+void *
+piv_virt_open(uint idx, const char **rdrname, const uint8_t **atr,
+    size_t *atrlen)
+{
+	struct virt_card *vc;
+
+	VERIFY3U(idx, <, virt_ncards);
+	vc = &virt_cards[idx];
+	*rdrname = vc->vc_rdrname;
+	*atr = virt_atr;
+	*atrlen = sizeof (virt_atr);
+	return (vc);
+}
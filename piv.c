@@ -25,6 +25,7 @@
 #include <stddef.h>
 #include <errno.h>
 #include <strings.h>
+#include <pthread.h>
 
 #if defined(__APPLE__)
 #include <PCSC/wintypes.h>
@@ -39,6 +40,7 @@
 #include <sys/types.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
+#include <sys/stat.h>
 
 #include <zlib.h>
 
@@ -57,6 +59,7 @@
 #include "piv.h"
 #include "bunyan.h"
 #include "utils.h"
+#include "usdt.h"
 #include "debug.h"
 
 /* Contains structs apdubuf, piv_ecdh_box, and enum piv_box_version */
@@ -64,6 +67,12 @@
 
 #define	PIV_MAX_CERT_LEN		16384
 
+/*
+ * Room for the command data of a GET DATA: a 5C tag holding the (at most
+ * 3-byte) tag of the object we want.
+ */
+#define	GET_DATA_CMD_LEN		8
+
 const uint8_t AID_PIV[] = {
 	0xA0, 0x00, 0x00, 0x03, 0x08, 0x00, 0x00, 0x10, 0x00, 0x01, 0x00
 };
@@ -137,8 +146,58 @@ struct apdu {
 	struct apdubuf a_cmd;
 	uint16_t a_sw;
 	struct apdubuf a_reply;
+
+	/* Use extended Lc/Le (set by piv_apdu_transceive_chain) */
+	boolean_t a_ext;
+
+	/* If a_reply came out of a token's arena, which one and where. */
+	struct piv_apdu_arena *a_arena;
+	uint a_arena_slot;
+};
+
+/*
+ * Each token has one of these, set up on first use, which holds the buffer
+ * that APDU commands are marshalled into and a few reply buffers. It's all
+ * one mmap()ed region that we try to mlock() and keep out of core dumps,
+ * so that replies (which can include key material) aren't left all over
+ * the heap, and we don't hit malloc for every APDU during long chained
+ * reads and writes.
+ *
+ * Reply buffers which have been given back are scrubbed when the
+ * transaction ends (or when they're handed out again, if that's sooner).
+ */
+#define	PIV_ARENA_NREPLY	4
+#define	PIV_ARENA_CMD_SIZE	APDU_CMD_SIZE(PIV_EXT_CMD_MAX)
+
+/*
+ * The most command data we'll put in one extended-length APDU before
+ * falling back to chaining. Cards can take more than this, but few tell us
+ * how much, and this already gets an RSA-2048 signature or most certs into
+ * a single command.
+ */
+#define	PIV_EXT_CMD_MAX		2048
+
+/* Worst case size of an encoded APDU with "len" bytes of command data */
+#define	APDU_CMD_SIZE(len)	(4 + 3 + (len) + 2)
+
+struct piv_apdu_arena {
+	uint8_t *pa_base;
+	size_t pa_size;
+	boolean_t pa_locked;
+	uint8_t *pa_cmd;
+	uint8_t *pa_reply[PIV_ARENA_NREPLY];
+	boolean_t pa_busy[PIV_ARENA_NREPLY];
+	size_t pa_dirty[PIV_ARENA_NREPLY];	/* bytes needing a scrub */
 };
 
+static void piv_arena_free(struct piv_apdu_arena *);
+static void piv_probe_ext_apdu(struct piv_token *);
+static void piv_token_want(const struct piv_token *, uint);
+static boolean_t piv_probe_token(struct piv_token *, boolean_t,
+    const uint8_t *, size_t);
+static void piv_probe_free(struct piv_token *);
+static const struct piv_transport piv_pcsc_transport;
+
 /* Tags used in the GENERAL AUTHENTICATE command. */
 enum gen_auth_tag {
 	GA_TAG_WITNESS = 0x80,
@@ -166,6 +225,13 @@ struct piv_slot {
 
 	enum piv_slotid ps_slot;
 	enum piv_alg ps_alg;
+	/*
+	 * The cert as read from the card. In compact mode (see
+	 * piv_set_compact_slots()) ps_x509 is only decoded from this when
+	 * piv_slot_cert() is first called for the slot.
+	 */
+	uint8_t *ps_der;
+	size_t ps_derlen;
 	X509 *ps_x509;
 	const char *ps_subj;
 	struct sshkey *ps_pubkey;
@@ -184,6 +250,21 @@ struct piv_token {
 	SCARDHANDLE pt_cardhdl;
 	DWORD pt_proto;
 	SCARD_IO_REQUEST pt_sendpci;
+	/*
+	 * If this token was found by a parallel probe, it was connected under
+	 * a context of its own (which we have to release along with it).
+	 */
+	SCARDCONTEXT pt_ctx;
+	boolean_t pt_ownctx;
+	/*
+	 * What we send APDUs through: piv_pcsc_transport (with the token
+	 * itself as the argument) unless this is a virtual token.
+	 */
+	const struct piv_transport *pt_tr;
+	void *pt_trarg;
+	/* ATR as of when we connected */
+	uint8_t pt_atr[MAX_ATR_SIZE];
+	size_t pt_atrlen;
 
 	/* Are we in a transaction right now? */
 	boolean_t pt_intxn;
@@ -192,6 +273,12 @@ struct piv_token {
 	 * a PIN VERIFY command and it succeeded)
 	 */
 	boolean_t pt_reset;
+	/*
+	 * Has this handle selected the PIV applet, with nothing we know of
+	 * (a reset, a failed command) having happened since? See
+	 * piv_select_lazy().
+	 */
+	boolean_t pt_selected;
 
 	/*
 	 * Our GUID. This can either be the GUID from our CHUID file, or if
@@ -247,8 +334,39 @@ struct piv_token {
 
 	boolean_t pt_ykserial_valid;	/* YubiKey serial # only on YK5 */
 	uint32_t pt_ykserial;
+
+	struct piv_apdu_arena *pt_arena;
+
+	/* Card and reader both do extended length APDUs (T=1 only) */
+	boolean_t pt_ext_apdu;
+
+	/* Running totals for piv_token_apdu_stats() */
+	uint64_t pt_apdu_count;
+	uint64_t pt_apdu_txbytes;
+	uint64_t pt_apdu_rxbytes;
+	/* Have we dumped the APDU trace since the last good exchange? */
+	boolean_t pt_trace_dumped;
+
+	/*
+	 * Which of the optional objects we've read from the card so far
+	 * (PIV_LOADED_*). In lazy probe mode these are filled in by the
+	 * accessors the first time they're needed.
+	 */
+	uint pt_loaded;
 };
 
+enum piv_loaded {
+	PIV_LOADED_DISCOV	= (1 << 0),	/* discovery object */
+	PIV_LOADED_KEYHIST	= (1 << 1),	/* key history object */
+	PIV_LOADED_YK		= (1 << 2),	/* YubicoPIV version/serial */
+	PIV_LOADED_ALL		= 0x07
+};
+
+static boolean_t piv_lazy = B_FALSE;
+static boolean_t piv_compact_slots = B_FALSE;
+/* Protects the lazy ps_x509 decode in piv_slot_cert(). */
+static pthread_mutex_t piv_slot_x509_mtx = PTHREAD_MUTEX_INITIALIZER;
+
 /* Helper to dump out APDU data */
 static inline void
 debug_dump(errf_t *err, struct apdu *apdu)
@@ -395,12 +513,14 @@ piv_token_has_signed_chuid(const struct piv_token *token)
 enum piv_pin
 piv_token_default_auth(const struct piv_token *token)
 {
+	piv_token_want(token, PIV_LOADED_DISCOV);
 	return (token->pt_auth);
 }
 
 boolean_t
 piv_token_has_auth(const struct piv_token *token, enum piv_pin auth)
 {
+	piv_token_want(token, PIV_LOADED_DISCOV);
 	switch (auth) {
 	case PIV_PIN:
 		return (token->pt_pin_app);
@@ -418,36 +538,51 @@ piv_token_has_auth(const struct piv_token *token, enum piv_pin auth)
 boolean_t
 piv_token_has_vci(const struct piv_token *token)
 {
+	piv_token_want(token, PIV_LOADED_DISCOV);
 	return (token->pt_vci);
 }
 
 uint
 piv_token_keyhistory_oncard(const struct piv_token *token)
 {
+	piv_token_want(token, PIV_LOADED_KEYHIST);
 	return (token->pt_hist_oncard);
 }
 
 uint
 piv_token_keyhistory_offcard(const struct piv_token *token)
 {
+	piv_token_want(token, PIV_LOADED_KEYHIST);
 	return (token->pt_hist_offcard);
 }
 
 const char *
 piv_token_offcard_url(const struct piv_token *token)
 {
+	piv_token_want(token, PIV_LOADED_KEYHIST);
 	return (token->pt_hist_url);
 }
 
+void
+piv_token_apdu_stats(const struct piv_token *token, uint64_t *count,
+    uint64_t *txbytes, uint64_t *rxbytes)
+{
+	*count = token->pt_apdu_count;
+	*txbytes = token->pt_apdu_txbytes;
+	*rxbytes = token->pt_apdu_rxbytes;
+}
+
 boolean_t
 piv_token_is_ykpiv(const struct piv_token *token)
 {
+	piv_token_want(token, PIV_LOADED_YK);
 	return (token->pt_ykpiv);
 }
 
 const uint8_t *
 ykpiv_token_version(const struct piv_token *token)
 {
+	piv_token_want(token, PIV_LOADED_YK);
 	VERIFY(token->pt_ykpiv);
 	return (token->pt_ykver);
 }
@@ -456,6 +591,7 @@ int
 ykpiv_version_compare(const struct piv_token *token, uint8_t major,
     uint8_t minor, uint8_t patch)
 {
+	piv_token_want(token, PIV_LOADED_YK);
 	VERIFY(token->pt_ykpiv);
 	if (token->pt_ykver[0] < major)
 		return (-1);
@@ -475,6 +611,7 @@ ykpiv_version_compare(const struct piv_token *token, uint8_t major,
 boolean_t
 ykpiv_token_has_serial(const struct piv_token *token)
 {
+	piv_token_want(token, PIV_LOADED_YK);
 	VERIFY(token->pt_ykpiv);
 	return (token->pt_ykserial_valid);
 }
@@ -482,6 +619,7 @@ ykpiv_token_has_serial(const struct piv_token *token)
 uint32_t
 ykpiv_token_serial(const struct piv_token *token)
 {
+	piv_token_want(token, PIV_LOADED_YK);
 	VERIFY(token->pt_ykpiv);
 	VERIFY(token->pt_ykserial_valid);
 	return (token->pt_ykserial);
@@ -670,11 +808,13 @@ piv_read_discov(struct piv_token *pk)
 	errf_t *err;
 	struct apdu *apdu;
 	struct tlv_state *tlv;
+	struct tlv_state tlvs;
+	uint8_t cmd[GET_DATA_CMD_LEN];
 	uint tag, policy;
 
 	VERIFY(pk->pt_intxn == B_TRUE);
 
-	tlv = tlv_init_write();
+	tlv = tlv_init_write_at(&tlvs, cmd, sizeof (cmd));
 	tlv_push(tlv, 0x5C);
 	tlv_write_u8to32(tlv, PIV_TAG_DISCOV);
 	tlv_pop(tlv);
@@ -697,8 +837,8 @@ piv_read_discov(struct piv_token *pk)
 	if (apdu->a_sw == SW_NO_ERROR ||
 	    (apdu->a_sw & 0xFF00) == SW_WARNING_NO_CHANGE_00 ||
 	    (apdu->a_sw & 0xFF00) == SW_WARNING_00) {
-		tlv = tlv_init(apdu->a_reply.b_data, apdu->a_reply.b_offset,
-		    apdu->a_reply.b_len);
+		tlv = tlv_init_at(&tlvs, apdu->a_reply.b_data,
+		    apdu->a_reply.b_offset, apdu->a_reply.b_len);
 		if ((err = tlv_read_tag(tlv, &tag)))
 			goto invdata;
 		if (tag != 0x7E) {
@@ -764,13 +904,11 @@ piv_read_discov(struct piv_token *pk)
 
 	} else if (apdu->a_sw == SW_FILE_NOT_FOUND ||
 	    apdu->a_sw == SW_WRONG_DATA) {
-		err = errf("NotFoundError", swerrf("INS_GET_DATA", apdu->a_sw),
-		    "PIV discovery object was not found on device '%s'",
-		    pk->pt_rdrname);
+		/* Lots of cards have no discovery object: don't allocate. */
+		err = ERRF_NOTFOUND;
 
 	} else if (apdu->a_sw == SW_FUNC_NOT_SUPPORTED) {
-		err = notsuperrf(swerrf("INS_GET_DATA", apdu->a_sw),
-		    pk->pt_rdrname, "PIV discovery object");
+		err = ERRF_NOTSUP;
 
 	} else {
 		err = swerrf("INS_GET_DATA", apdu->a_sw);
@@ -802,11 +940,13 @@ piv_read_keyhist(struct piv_token *pk)
 	errf_t *rv;
 	struct apdu *apdu;
 	struct tlv_state *tlv;
+	struct tlv_state tlvs;
+	uint8_t cmd[GET_DATA_CMD_LEN];
 	uint tag, uval;
 
 	VERIFY(pk->pt_intxn == B_TRUE);
 
-	tlv = tlv_init_write();
+	tlv = tlv_init_write_at(&tlvs, cmd, sizeof (cmd));
 	tlv_push(tlv, 0x5C);
 	tlv_write_u8to32(tlv, PIV_TAG_KEYHIST);
 	tlv_pop(tlv);
@@ -835,8 +975,8 @@ piv_read_keyhist(struct piv_token *pk)
 			    "INS_GET_DATA(KEYHIST)");
 			goto invdata;
 		}
-		tlv = tlv_init(apdu->a_reply.b_data, apdu->a_reply.b_offset,
-		    apdu->a_reply.b_len);
+		tlv = tlv_init_at(&tlvs, apdu->a_reply.b_data,
+		    apdu->a_reply.b_offset, apdu->a_reply.b_len);
 		if ((rv = tlv_read_tag(tlv, &tag)))
 			goto invdata;
 		if (tag != 0x53) {
@@ -884,13 +1024,10 @@ piv_read_keyhist(struct piv_token *pk)
 
 	} else if (apdu->a_sw == SW_FILE_NOT_FOUND ||
 	    apdu->a_sw == SW_WRONG_DATA) {
-		rv = errf("NotFoundError", swerrf("INS_GET_DATA", apdu->a_sw),
-		    "PIV key history object not found on device '%s'",
-		    pk->pt_rdrname);
+		rv = ERRF_NOTFOUND;
 
 	} else if (apdu->a_sw == SW_FUNC_NOT_SUPPORTED) {
-		rv = notsuperrf(swerrf("INS_GET_DATA", apdu->a_sw),
-		    pk->pt_rdrname, "PIV key history object");
+		rv = ERRF_NOTSUP;
 
 	} else {
 		rv = swerrf("INS_GET_DATA", apdu->a_sw);
@@ -923,11 +1060,13 @@ piv_read_chuid(struct piv_token *pk)
 	errf_t *err;
 	struct apdu *apdu;
 	struct tlv_state *tlv;
+	struct tlv_state tlvs;
+	uint8_t cmd[GET_DATA_CMD_LEN];
 	uint tag, i;
 
 	VERIFY(pk->pt_intxn == B_TRUE);
 
-	tlv = tlv_init_write();
+	tlv = tlv_init_write_at(&tlvs, cmd, sizeof (cmd));
 	tlv_push(tlv, 0x5C);
 	tlv_write_u8to32(tlv, PIV_TAG_CHUID);
 	tlv_pop(tlv);
@@ -952,8 +1091,8 @@ piv_read_chuid(struct piv_token *pk)
 	if (apdu->a_sw == SW_NO_ERROR ||
 	    (apdu->a_sw & 0xFF00) == SW_WARNING_NO_CHANGE_00 ||
 	    (apdu->a_sw & 0xFF00) == SW_WARNING_00) {
-		tlv = tlv_init(apdu->a_reply.b_data, apdu->a_reply.b_offset,
-		    apdu->a_reply.b_len);
+		tlv = tlv_init_at(&tlvs, apdu->a_reply.b_data,
+		    apdu->a_reply.b_offset, apdu->a_reply.b_len);
 		if ((err = tlv_read_tag(tlv, &tag)))
 			goto invdata;
 		if (tag != 0x53) {
@@ -1047,9 +1186,7 @@ piv_read_chuid(struct piv_token *pk)
 		err = ERRF_OK;
 
 	} else if (apdu->a_sw == SW_FILE_NOT_FOUND) {
-		err = errf("NotFoundError", swerrf("INS_GET_DATA", apdu->a_sw),
-		    "PIV CHUID object was not found on device '%s'",
-		    pk->pt_rdrname);
+		err = ERRF_NOTFOUND;
 
 	} else {
 		err = swerrf("INS_GET_DATA(CHUID)", apdu->a_sw);
@@ -1070,258 +1207,20 @@ invdata:
 	goto out;
 }
 
-errf_t *
-piv_enumerate(SCARDCONTEXT ctx, struct piv_token **tokens)
-{
-	DWORD rv, readersLen = 0;
-	LPTSTR readers, thisrdr;
-	struct piv_token *ks = NULL;
-	errf_t *err;
-
-	rv = SCardListReaders(ctx, NULL, NULL, &readersLen);
-	if (rv != SCARD_S_SUCCESS) {
-		return (pcscerrf("SCardListReaders", rv));
-	}
-	readers = calloc(1, readersLen);
-	rv = SCardListReaders(ctx, NULL, readers, &readersLen);
-	if (rv != SCARD_S_SUCCESS) {
-		free(readers);
-		return (pcscerrf("SCardListReaders", rv));
-	}
-
-	for (thisrdr = readers; *thisrdr != 0; thisrdr += strlen(thisrdr) + 1) {
-		SCARDHANDLE card;
-		struct piv_token *key;
-		DWORD activeProtocol;
-
-		rv = SCardConnect(ctx, thisrdr, SCARD_SHARE_SHARED,
-		    SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &card,
-		    &activeProtocol);
-		if (rv != SCARD_S_SUCCESS) {
-			err = pcscrerrf("SCardConnect", thisrdr, rv);
-			bunyan_log(BNY_DEBUG, "SCardConnect failed",
-			    "error", BNY_ERF, err, NULL);
-			errf_free(err);
-			continue;
-		}
-
-		key = calloc(1, sizeof (struct piv_token));
-		key->pt_cardhdl = card;
-		key->pt_rdrname = strdup(thisrdr);
-		key->pt_proto = activeProtocol;
-
-		switch (activeProtocol) {
-		case SCARD_PROTOCOL_T0:
-			key->pt_sendpci = *SCARD_PCI_T0;
-			break;
-		case SCARD_PROTOCOL_T1:
-			key->pt_sendpci = *SCARD_PCI_T1;
-			break;
-		default:
-			VERIFY(0);
-		}
-
-		if ((err = piv_txn_begin(key))) {
-			bunyan_log(BNY_DEBUG, "piv_txn_begin failed",
-			    "error", BNY_ERF, err, NULL);
-			errf_free(err);
-			continue;
-		}
-		err = piv_select(key);
-		if (err == ERRF_OK) {
-			err = piv_read_chuid(key);
-			if (errf_caused_by(err, "NotFoundError")) {
-				errf_free(err);
-				err = ERRF_OK;
-				key->pt_nochuid = B_TRUE;
-			}
-		}
-		if (err == ERRF_OK) {
-			err = piv_read_discov(key);
-			if (errf_caused_by(err, "NotFoundError") ||
-			    errf_caused_by(err, "NotSupportedError")) {
-				errf_free(err);
-				err = ERRF_OK;
-				/*
-				 * Default to preferring the application PIN if
-				 * we have no discovery object.
-				 */
-				key->pt_pin_app = B_TRUE;
-				key->pt_auth = PIV_PIN;
-			}
-		}
-		if (err == ERRF_OK) {
-			err = piv_read_keyhist(key);
-			if (errf_caused_by(err, "NotFoundError") ||
-			    errf_caused_by(err, "NotSupportedError")) {
-				errf_free(err);
-				err = ERRF_OK;
-			}
-		}
-		if (err == ERRF_OK) {
-			err = ykpiv_get_version(key);
-			if (err == ERRF_OK) {
-				err = ykpiv_read_serial(key);
-			}
-			if (errf_caused_by(err, "NotSupportedError")) {
-				errf_free(err);
-				err = ERRF_OK;
-			}
-		}
-		piv_txn_end(key);
-
-		if (err == ERRF_OK) {
-			key->pt_next = ks;
-			ks = key;
-		} else {
-			bunyan_log(BNY_DEBUG, "piv_enumerate() eliminated reader "
-			    "due to error", "reader", BNY_STRING, thisrdr,
-			    "error", BNY_ERF, err, NULL);
-			errf_free(err);
-			(void) SCardDisconnect(card, SCARD_RESET_CARD);
-		}
-	}
-
-	*tokens = ks;
-
-	free(readers);
-	return (ERRF_OK);
-}
-
-errf_t *
-piv_find(SCARDCONTEXT ctx, const uint8_t *guid, size_t guidlen,
-    struct piv_token **token)
+/*
+ * Reads whichever of the optional objects in "what" we haven't read yet. The
+ * ones that a card simply doesn't have (NotFound/NotSupported) count as read.
+ */
+static errf_t *
+piv_token_load(struct piv_token *pk, uint what)
 {
-	DWORD rv, readersLen = 0;
-	LPTSTR readers, thisrdr;
-	struct piv_token *found = NULL, *key;
 	errf_t *err;
 
-	rv = SCardListReaders(ctx, NULL, NULL, &readersLen);
-	if (rv != SCARD_S_SUCCESS) {
-		return (pcscerrf("SCardListReaders", rv));
-	}
-	readers = calloc(1, readersLen);
-	rv = SCardListReaders(ctx, NULL, readers, &readersLen);
-	if (rv != SCARD_S_SUCCESS) {
-		free(readers);
-		return (pcscerrf("SCardListReaders", rv));
-	}
-
-	key = calloc(1, sizeof (struct piv_token));
-	VERIFY(key != NULL);
-
-	for (thisrdr = readers; *thisrdr != 0; thisrdr += strlen(thisrdr) + 1) {
-		SCARDHANDLE card;
-		DWORD activeProtocol;
-
-		rv = SCardConnect(ctx, thisrdr, SCARD_SHARE_SHARED,
-		    SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &card,
-		    &activeProtocol);
-		if (rv != SCARD_S_SUCCESS) {
-			err = pcscrerrf("SCardConnect", thisrdr, rv);
-			bunyan_log(BNY_DEBUG, "SCardConnect failed",
-			    "error", BNY_ERF, err, NULL);
-			errf_free(err);
-			continue;
-		}
-
-		key->pt_cardhdl = card;
-		key->pt_rdrname = strdup(thisrdr);
-		VERIFY(key->pt_rdrname != NULL);
-		key->pt_proto = activeProtocol;
-
-		switch (activeProtocol) {
-		case SCARD_PROTOCOL_T0:
-			key->pt_sendpci = *SCARD_PCI_T0;
-			break;
-		case SCARD_PROTOCOL_T1:
-			key->pt_sendpci = *SCARD_PCI_T1;
-			break;
-		default:
-			VERIFY(0);
-		}
-
-		if ((err = piv_txn_begin(key))) {
-			errf_free(err);
-			goto nopenotxn;
-		}
-		err = piv_select(key);
-		if (err) {
-			errf_free(err);
-			goto nope;
-		}
-		err = piv_read_chuid(key);
-		if (errf_caused_by(err, "NotFoundError") && guidlen == 0) {
-			errf_free(err);
-			err = ERRF_OK;
-			key->pt_nochuid = B_TRUE;
-			if (found != NULL) {
-				piv_txn_end(key);
-				(void) SCardDisconnect(card, SCARD_RESET_CARD);
-				free((char *)key->pt_rdrname);
-				free(key);
-				piv_txn_end(found);
-				(void) SCardDisconnect(found->pt_cardhdl,
-				    SCARD_RESET_CARD);
-				free((char *)found->pt_rdrname);
-				free(found);
-				free(readers);
-				return (errf("DuplicateError", NULL,
-				    "More than one PIV token matched GUID"));
-			}
-			found = key;
-			key = calloc(1, sizeof (struct piv_token));
-			continue;
-		} else if (err) {
-			bunyan_log(BNY_DEBUG, "piv_find() eliminated reader "
-			    "due to error", "reader", BNY_STRING, thisrdr,
-			    "error", BNY_ERF, err, NULL);
-			errf_free(err);
-			goto nope;
-		}
-		if (guidlen == 0 || bcmp(guid, key->pt_guid, guidlen) != 0)
-			goto nope;
-
-		if (found != NULL) {
-			piv_txn_end(key);
-			(void) SCardDisconnect(card, SCARD_RESET_CARD);
-			free((char *)key->pt_rdrname);
-			free(key);
-			piv_txn_end(found);
-			(void) SCardDisconnect(found->pt_cardhdl,
-			    SCARD_RESET_CARD);
-			free((char *)found->pt_rdrname);
-			free(found);
-			free(readers);
-			return (errf("DuplicateError", NULL,
-			    "More than one PIV token matched GUID"));
-		}
-		found = key;
-		key = calloc(1, sizeof (struct piv_token));
-		continue;
-
-nope:
-		piv_txn_end(key);
-nopenotxn:
-		(void) SCardDisconnect(card, SCARD_RESET_CARD);
-		free((char *)key->pt_rdrname);
-		bzero(key, sizeof (struct piv_token));
-	}
-
-	free(key);
-
-	if (found == NULL) {
-		free(readers);
-		return (errf("NotFoundError", NULL,
-		    "No PIV token found matching GUID"));
-	}
-
-	key = found;
-	err = ERRF_OK;
+	VERIFY(pk->pt_intxn);
+	what &= ~pk->pt_loaded;
 
-	if (err == ERRF_OK) {
-		err = piv_read_discov(key);
+	if (what & PIV_LOADED_DISCOV) {
+		err = piv_read_discov(pk);
 		if (errf_caused_by(err, "NotFoundError") ||
 		    errf_caused_by(err, "NotSupportedError")) {
 			errf_free(err);
@@ -1330,89 +1229,874 @@ nopenotxn:
 			 * Default to preferring the application PIN if
 			 * we have no discovery object.
 			 */
-			key->pt_pin_app = B_TRUE;
-			key->pt_auth = PIV_PIN;
+			pk->pt_pin_app = B_TRUE;
+			pk->pt_auth = PIV_PIN;
 		}
+		if (err)
+			return (err);
+		pk->pt_loaded |= PIV_LOADED_DISCOV;
 	}
-	if (err == ERRF_OK) {
-		err = piv_read_keyhist(key);
+	if (what & PIV_LOADED_KEYHIST) {
+		err = piv_read_keyhist(pk);
 		if (errf_caused_by(err, "NotFoundError") ||
 		    errf_caused_by(err, "NotSupportedError")) {
 			errf_free(err);
 			err = ERRF_OK;
 		}
+		if (err)
+			return (err);
+		pk->pt_loaded |= PIV_LOADED_KEYHIST;
 	}
-	if (err == ERRF_OK) {
-		err = ykpiv_get_version(key);
+	if (what & PIV_LOADED_YK) {
+		err = ykpiv_get_version(pk);
 		if (err == ERRF_OK) {
-			err = ykpiv_read_serial(key);
+			err = ykpiv_read_serial(pk);
 		}
 		if (errf_caused_by(err, "NotSupportedError")) {
 			errf_free(err);
 			err = ERRF_OK;
 		}
+		if (err)
+			return (err);
+		pk->pt_loaded |= PIV_LOADED_YK;
+		/* This depends on the YubicoPIV version. */
+		piv_probe_ext_apdu(pk);
 	}
-	piv_txn_end(key);
 
+	return (ERRF_OK);
+}
+
+/*
+ * Used by the accessors (which take a const token) to load things on demand.
+ * If the caller isn't in a transaction already, we take one just long enough
+ * to do the reads. Errors here are logged and otherwise ignored (the caller
+ * just sees the defaults), and we'll try again next time.
+ */
+static void
+piv_token_want(const struct piv_token *token, uint what)
+{
+	struct piv_token *pk = (struct piv_token *)token;
+	boolean_t ourtxn = B_FALSE;
+	errf_t *err;
+
+	if ((pk->pt_loaded & what) == what)
+		return;
+
+	if (!pk->pt_intxn) {
+		if ((err = piv_txn_begin(pk)))
+			goto out;
+		ourtxn = B_TRUE;
+		if ((err = piv_select(pk)))
+			goto out;
+	}
+	err = piv_token_load(pk, what);
+
+out:
+	if (ourtxn)
+		piv_txn_end(pk);
 	if (err) {
-		bunyan_log(BNY_DEBUG, "piv_find() eliminated reader "
-		    "due to error", "reader", BNY_STRING, thisrdr,
+		bunyan_log(BNY_WARN, "failed to load token attributes",
+		    "reader", BNY_STRING, pk->pt_rdrname,
 		    "error", BNY_ERF, err, NULL);
 		errf_free(err);
-		(void) SCardDisconnect(key->pt_cardhdl, SCARD_RESET_CARD);
-		free((char *)key->pt_rdrname);
-		free(key);
 	}
-
-	*token = key;
-	free(readers);
-	return (ERRF_OK);
 }
 
 void
-piv_release(struct piv_token *pk)
+piv_set_lazy_probe(boolean_t lazy)
 {
-	struct piv_token *next;
-	struct piv_slot *ps, *psnext;
-
-	for (; pk != NULL; pk = next) {
-		VERIFY(pk->pt_intxn == B_FALSE);
-		(void) SCardDisconnect(pk->pt_cardhdl, SCARD_LEAVE_CARD);
-
-		for (ps = pk->pt_slots; ps != NULL; ps = psnext) {
-			OPENSSL_free((void *)ps->ps_subj);
-			X509_free(ps->ps_x509);
-			sshkey_free(ps->ps_pubkey);
-			psnext = ps->ps_next;
-			free(ps);
-		}
-		free(pk->pt_hist_url);
-		free((char *)pk->pt_rdrname);
-		free(pk->pt_guidhex);
+	piv_lazy = lazy;
+}
 
-		next = pk->pt_next;
-		free(pk);
-	}
+void
+piv_set_compact_slots(boolean_t compact)
+{
+	piv_compact_slots = compact;
 }
 
-struct piv_slot *
-piv_get_slot(struct piv_token *tk, enum piv_slotid slotid)
+/* Frees everything hanging off a slot, leaving it empty. */
+static void
+piv_slot_clear(struct piv_slot *slot)
 {
-	struct piv_slot *s;
-	for (s = tk->pt_slots; s != NULL; s = s->ps_next) {
-		if (s->ps_slot == slotid)
-			return (s);
-	}
-	return (NULL);
+	OPENSSL_free((void *)slot->ps_subj);
+	X509_free(slot->ps_x509);
+	free(slot->ps_der);
+	sshkey_free(slot->ps_pubkey);
+	slot->ps_subj = NULL;
+	slot->ps_x509 = NULL;
+	slot->ps_der = NULL;
+	slot->ps_derlen = 0;
+	slot->ps_pubkey = NULL;
 }
 
-struct piv_slot *
-piv_force_slot(struct piv_token *tk, enum piv_slotid slotid, enum piv_alg alg)
+/*
+ * Connects to the card in one reader and probes it. If find is set then this
+ * is for piv_find(): we stop after reading the CHUID (without trying all the
+ * other objects) if it doesn't match guid. Returns NULL in *tokenp if there's
+ * no PIV token there that we want.
+ */
+static void
+piv_probe_reader(SCARDCONTEXT ctx, const char *rdr, boolean_t find,
+    const uint8_t *guid, size_t guidlen, struct piv_token **tokenp)
 {
-	struct piv_slot *s;
-	for (s = tk->pt_slots; s != NULL; s = s->ps_next) {
-		if (s->ps_slot == slotid)
-			break;
+	DWORD rv;
+	SCARDHANDLE card;
+	DWORD activeProtocol, atrlen, rdrlen = 0, state, proto;
+	struct piv_token *key;
+	errf_t *err;
+
+	*tokenp = NULL;
+
+	rv = SCardConnect(ctx, rdr, SCARD_SHARE_SHARED,
+	    SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &card,
+	    &activeProtocol);
+	if (rv != SCARD_S_SUCCESS) {
+		err = pcscrerrf("SCardConnect", rdr, rv);
+		bunyan_log(BNY_DEBUG, "SCardConnect failed",
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+		return;
+	}
+
+	key = calloc(1, sizeof (struct piv_token));
+	VERIFY(key != NULL);
+	key->pt_tr = &piv_pcsc_transport;
+	key->pt_trarg = key;
+	key->pt_cardhdl = card;
+	key->pt_rdrname = strdup(rdr);
+	VERIFY(key->pt_rdrname != NULL);
+	key->pt_proto = activeProtocol;
+
+	switch (activeProtocol) {
+	case SCARD_PROTOCOL_T0:
+		key->pt_sendpci = *SCARD_PCI_T0;
+		break;
+	case SCARD_PROTOCOL_T1:
+		key->pt_sendpci = *SCARD_PCI_T1;
+		break;
+	default:
+		VERIFY(0);
+	}
+
+	atrlen = sizeof (key->pt_atr);
+	rv = SCardStatus(card, NULL, &rdrlen, &state, &proto, key->pt_atr,
+	    &atrlen);
+	key->pt_atrlen = (rv == SCARD_S_SUCCESS) ? atrlen : 0;
+
+	if (!piv_probe_token(key, find, guid, guidlen)) {
+		(void) SCardDisconnect(card, SCARD_RESET_CARD);
+		piv_probe_free(key);
+		return;
+	}
+	*tokenp = key;
+}
+
+/*
+ * Sets up a token for one of the virtual readers from piv_virt_init() and
+ * probes it, just like piv_probe_reader().
+ */
+static void
+piv_probe_virt(uint idx, boolean_t find, const uint8_t *guid, size_t guidlen,
+    struct piv_token **tokenp)
+{
+	struct piv_token *key;
+	const char *rdr;
+	const uint8_t *atr;
+	size_t atrlen;
+
+	*tokenp = NULL;
+
+	key = calloc(1, sizeof (struct piv_token));
+	VERIFY(key != NULL);
+	key->pt_tr = &piv_virt_transport;
+	key->pt_trarg = piv_virt_open(idx, &rdr, &atr, &atrlen);
+	key->pt_rdrname = strdup(rdr);
+	VERIFY(key->pt_rdrname != NULL);
+	key->pt_proto = SCARD_PROTOCOL_T1;
+	VERIFY3U(atrlen, <=, sizeof (key->pt_atr));
+	bcopy(atr, key->pt_atr, atrlen);
+	key->pt_atrlen = atrlen;
+
+	if (!piv_probe_token(key, find, guid, guidlen)) {
+		key->pt_tr->ptr_disconnect(key->pt_trarg);
+		piv_probe_free(key);
+		return;
+	}
+	*tokenp = key;
+}
+
+static void
+piv_probe_free(struct piv_token *key)
+{
+	piv_arena_free(key->pt_arena);
+	free((char *)key->pt_rdrname);
+	free(key);
+}
+
+/*
+ * The part of probing that happens once we're connected (and which doesn't
+ * care how): returns B_FALSE if this isn't a token we want.
+ */
+static boolean_t
+piv_probe_token(struct piv_token *key, boolean_t find, const uint8_t *guid,
+    size_t guidlen)
+{
+	errf_t *err;
+
+	if ((err = piv_txn_begin(key))) {
+		bunyan_log(BNY_DEBUG, "piv_txn_begin failed",
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+		return (B_FALSE);
+	}
+	err = piv_select(key);
+	if (err == ERRF_OK) {
+		err = piv_read_chuid(key);
+		if (errf_caused_by(err, "NotFoundError") &&
+		    (!find || guidlen == 0)) {
+			errf_free(err);
+			err = ERRF_OK;
+			key->pt_nochuid = B_TRUE;
+		}
+	}
+	if (err == ERRF_OK && find && !key->pt_nochuid &&
+	    (guidlen == 0 || bcmp(guid, key->pt_guid, guidlen) != 0)) {
+		/* Not the one we're looking for. */
+		goto nope;
+	}
+	if (err == ERRF_OK && !piv_lazy)
+		err = piv_token_load(key, PIV_LOADED_ALL);
+	if (err) {
+		bunyan_log(BNY_DEBUG, "eliminated reader due to error",
+		    "reader", BNY_STRING, key->pt_rdrname,
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+		goto nope;
+	}
+	piv_txn_end(key);
+	return (B_TRUE);
+
+nope:
+	piv_txn_end(key);
+	return (B_FALSE);
+}
+
+/*
+ * The reader cache remembers which GUID we last saw in each reader (and the
+ * ATR it had at the time), so that piv_find() can go straight to the most
+ * likely reader instead of connecting to all of them. It's only ever a hint:
+ * we still check the CHUID, and fall back to a full scan if it's wrong.
+ *
+ * The file is plain text, one line per reader:
+ *   <guid hex> <atr hex> <reader name>
+ */
+#define	RDRCACHE_MAX		32
+
+struct rdrcache_ent {
+	uint8_t re_guid[GUID_LEN];
+	uint8_t re_atr[MAX_ATR_SIZE];
+	size_t re_atrlen;
+	char *re_rdr;
+};
+
+static char *piv_rdrcache_path = NULL;
+
+void
+piv_use_reader_cache(const char *path)
+{
+	const char *dir;
+	char *p = NULL;
+
+	if (path != NULL) {
+		p = strdup(path);
+	} else if ((dir = getenv("XDG_RUNTIME_DIR")) != NULL && *dir != 0) {
+		if (asprintf(&p, "%s/pivy-readers", dir) < 0)
+			p = NULL;
+	} else if ((dir = getenv("HOME")) != NULL && *dir != 0) {
+		if (asprintf(&p, "%s/.cache/pivy-readers", dir) < 0)
+			p = NULL;
+	}
+	free(piv_rdrcache_path);
+	piv_rdrcache_path = p;
+}
+
+static boolean_t
+rdrcache_unhex(const char *str, size_t slen, uint8_t *out, size_t max,
+    size_t *outlen)
+{
+	size_t i;
+	uint v;
+
+	if (slen % 2 != 0 || slen / 2 > max)
+		return (B_FALSE);
+	for (i = 0; i < slen / 2; ++i) {
+		if (sscanf(&str[i * 2], "%02x", &v) != 1)
+			return (B_FALSE);
+		out[i] = v;
+	}
+	*outlen = i;
+	return (B_TRUE);
+}
+
+static void
+rdrcache_free(struct rdrcache_ent *ents, uint n)
+{
+	uint i;
+	for (i = 0; i < n; ++i)
+		free(ents[i].re_rdr);
+}
+
+static uint
+rdrcache_read(struct rdrcache_ent *ents)
+{
+	FILE *f;
+	char line[512];
+	char *guid, *atr, *rdr, *lasts;
+	size_t len;
+	uint n = 0;
+
+	if (piv_rdrcache_path == NULL)
+		return (0);
+	if ((f = fopen(piv_rdrcache_path, "r")) == NULL)
+		return (0);
+	while (n < RDRCACHE_MAX && fgets(line, sizeof (line), f) != NULL) {
+		struct rdrcache_ent *re = &ents[n];
+
+		line[strcspn(line, "\n")] = '\0';
+		if ((guid = strtok_r(line, " ", &lasts)) == NULL ||
+		    (atr = strtok_r(NULL, " ", &lasts)) == NULL ||
+		    (rdr = strtok_r(NULL, "", &lasts)) == NULL)
+			continue;
+		if (!rdrcache_unhex(guid, strlen(guid), re->re_guid,
+		    sizeof (re->re_guid), &len) || len != GUID_LEN)
+			continue;
+		if (strcmp(atr, "-") == 0)
+			re->re_atrlen = 0;
+		else if (!rdrcache_unhex(atr, strlen(atr), re->re_atr,
+		    sizeof (re->re_atr), &re->re_atrlen))
+			continue;
+		re->re_rdr = strdup(rdr);
+		VERIFY(re->re_rdr != NULL);
+		++n;
+	}
+	fclose(f);
+	return (n);
+}
+
+static void
+rdrcache_write(struct rdrcache_ent *ents, uint n)
+{
+	char *tmp = NULL, *hex;
+	FILE *f;
+	int fd;
+	uint i;
+
+	if (asprintf(&tmp, "%s.XXXXXX", piv_rdrcache_path) < 0)
+		return;
+	if ((fd = mkstemp(tmp)) < 0) {
+		bunyan_log(BNY_DEBUG, "failed to write reader cache",
+		    "path", BNY_STRING, piv_rdrcache_path,
+		    "errno", BNY_INT, errno, NULL);
+		free(tmp);
+		return;
+	}
+	(void) fchmod(fd, 0600);
+	VERIFY((f = fdopen(fd, "w")) != NULL);
+	for (i = 0; i < n; ++i) {
+		hex = buf_to_hex(ents[i].re_guid, GUID_LEN, B_FALSE);
+		fprintf(f, "%s ", hex);
+		free(hex);
+		if (ents[i].re_atrlen == 0) {
+			fprintf(f, "- ");
+		} else {
+			hex = buf_to_hex(ents[i].re_atr, ents[i].re_atrlen,
+			    B_FALSE);
+			fprintf(f, "%s ", hex);
+			free(hex);
+		}
+		fprintf(f, "%s\n", ents[i].re_rdr);
+	}
+	if (fclose(f) != 0 || rename(tmp, piv_rdrcache_path) != 0)
+		(void) unlink(tmp);
+	free(tmp);
+}
+
+/*
+ * Records where we saw some tokens. If "all" is set, then tks is everything
+ * on the system (from piv_enumerate()) and replaces what's in the cache,
+ * otherwise it's merged in.
+ */
+static void
+rdrcache_update(const struct piv_token *tks, boolean_t all)
+{
+	struct rdrcache_ent ents[RDRCACHE_MAX];
+	const struct piv_token *pt;
+	uint n = 0, i, j;
+
+	if (piv_rdrcache_path == NULL)
+		return;
+	if (!all)
+		n = rdrcache_read(ents);
+
+	for (pt = tks; pt != NULL; pt = pt->pt_next) {
+		if (pt->pt_nochuid || pt->pt_tr != &piv_pcsc_transport)
+			continue;
+		/* Drop anything we had for this reader or this GUID. */
+		for (i = 0, j = 0; i < n; ++i) {
+			if (strcmp(ents[i].re_rdr, pt->pt_rdrname) == 0 ||
+			    bcmp(ents[i].re_guid, pt->pt_guid,
+			    GUID_LEN) == 0) {
+				free(ents[i].re_rdr);
+				continue;
+			}
+			ents[j++] = ents[i];
+		}
+		n = j;
+		if (n >= RDRCACHE_MAX) {
+			free(ents[0].re_rdr);
+			bcopy(&ents[1], &ents[0], (n - 1) * sizeof (ents[0]));
+			--n;
+		}
+		bcopy(pt->pt_guid, ents[n].re_guid, GUID_LEN);
+		bcopy(pt->pt_atr, ents[n].re_atr, pt->pt_atrlen);
+		ents[n].re_atrlen = pt->pt_atrlen;
+		ents[n].re_rdr = strdup(pt->pt_rdrname);
+		VERIFY(ents[n].re_rdr != NULL);
+		++n;
+	}
+
+	rdrcache_write(ents, n);
+	rdrcache_free(ents, n);
+}
+
+/*
+ * Tries the reader the cache says we last saw this GUID in. Only the ATR is
+ * checked before connecting (which doesn't need us to talk to the card).
+ */
+static struct piv_token *
+rdrcache_find(SCARDCONTEXT ctx, const uint8_t *guid)
+{
+	struct rdrcache_ent ents[RDRCACHE_MAX];
+	SCARD_READERSTATE rs;
+	struct piv_token *key = NULL;
+	uint n, i;
+	DWORD rv;
+
+	n = rdrcache_read(ents);
+	for (i = 0; i < n; ++i) {
+		if (bcmp(ents[i].re_guid, guid, GUID_LEN) == 0)
+			break;
+	}
+	if (i >= n)
+		goto out;
+
+	bzero(&rs, sizeof (rs));
+	rs.szReader = ents[i].re_rdr;
+	rs.dwCurrentState = SCARD_STATE_UNAWARE;
+	rv = SCardGetStatusChange(ctx, 0, &rs, 1);
+	if (rv != SCARD_S_SUCCESS || !(rs.dwEventState & SCARD_STATE_PRESENT))
+		goto out;
+	if (ents[i].re_atrlen != 0 && (rs.cbAtr != ents[i].re_atrlen ||
+	    bcmp(rs.rgbAtr, ents[i].re_atr, rs.cbAtr) != 0))
+		goto out;
+
+	piv_probe_reader(ctx, ents[i].re_rdr, B_TRUE, guid, GUID_LEN, &key);
+	if (key != NULL) {
+		bunyan_log(BNY_DEBUG, "found token via reader cache",
+		    "reader", BNY_STRING, key->pt_rdrname, NULL);
+	}
+
+out:
+	rdrcache_free(ents, n);
+	return (key);
+}
+
+/*
+ * With more than one reader we probe them all at once, one thread each.
+ * PCSC contexts can't be shared between threads, so each thread makes its
+ * own, and the token it finds keeps it (see pt_ctx).
+ *
+ * The probe_set is shared by the caller and all the threads, and freed by
+ * whoever is last out, so that piv_find() can return as soon as it gets an
+ * exact match and leave the stragglers to clean up after themselves.
+ */
+struct piv_probe {
+	struct piv_probe_set *pp_set;
+	const char *pp_rdr;
+	struct piv_token *pp_token;
+	boolean_t pp_done;
+};
+
+struct piv_probe_set {
+	pthread_mutex_t ps_mtx;
+	pthread_cond_t ps_cv;
+	uint ps_refs;
+	char *ps_readers;
+	boolean_t ps_find;
+	uint8_t ps_guidbuf[GUID_LEN];
+	size_t ps_guidlen;
+	uint ps_nprobes;
+	struct piv_probe *ps_probes;
+};
+
+static void
+piv_probe_set_rele(struct piv_probe_set *ps)
+{
+	uint i;
+
+	VERIFY(ps->ps_refs > 0);
+	if (--ps->ps_refs > 0) {
+		VERIFY0(pthread_mutex_unlock(&ps->ps_mtx));
+		return;
+	}
+	VERIFY0(pthread_mutex_unlock(&ps->ps_mtx));
+	for (i = 0; i < ps->ps_nprobes; ++i)
+		piv_release(ps->ps_probes[i].pp_token);
+	VERIFY0(pthread_mutex_destroy(&ps->ps_mtx));
+	VERIFY0(pthread_cond_destroy(&ps->ps_cv));
+	free(ps->ps_probes);
+	free(ps->ps_readers);
+	free(ps);
+}
+
+static void *
+piv_probe_thread(void *arg)
+{
+	struct piv_probe *pp = arg;
+	struct piv_probe_set *ps = pp->pp_set;
+	struct piv_token *tk = NULL;
+	SCARDCONTEXT ctx;
+	errf_t *err;
+	DWORD rv;
+
+	rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &ctx);
+	if (rv != SCARD_S_SUCCESS) {
+		err = pcscerrf("SCardEstablishContext", rv);
+		bunyan_log(BNY_DEBUG, "failed to set up context for reader",
+		    "reader", BNY_STRING, pp->pp_rdr,
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+	} else {
+		piv_probe_reader(ctx, pp->pp_rdr, ps->ps_find,
+		    ps->ps_guidbuf, ps->ps_guidlen, &tk);
+		if (tk != NULL) {
+			tk->pt_ctx = ctx;
+			tk->pt_ownctx = B_TRUE;
+		} else {
+			(void) SCardReleaseContext(ctx);
+		}
+	}
+
+	VERIFY0(pthread_mutex_lock(&ps->ps_mtx));
+	pp->pp_token = tk;
+	pp->pp_done = B_TRUE;
+	VERIFY0(pthread_cond_broadcast(&ps->ps_cv));
+	piv_probe_set_rele(ps);
+	return (NULL);
+}
+
+/*
+ * Starts probing every reader on the system in parallel. Returns NULL in
+ * *psp if there are fewer than two readers (in which case the caller should
+ * just do it itself), with the reader list in *readersp.
+ */
+static errf_t *
+piv_probe_start(SCARDCONTEXT ctx, boolean_t find, const uint8_t *guid,
+    size_t guidlen, char **readersp, struct piv_probe_set **psp)
+{
+	DWORD rv, readersLen = 0;
+	char *readers, *thisrdr;
+	struct piv_probe_set *ps;
+	uint i, n = 0;
+	pthread_t thread;
+
+	*psp = NULL;
+	*readersp = NULL;
+
+	rv = SCardListReaders(ctx, NULL, NULL, &readersLen);
+	if (rv != SCARD_S_SUCCESS && piv_virt_count() > 0) {
+		/* No real readers (or no pcscd), but the virtual ones'll do */
+		bunyan_log(BNY_DEBUG, "SCardListReaders failed, using only "
+		    "virtual tokens",
+		    "err", BNY_STRING, pcsc_stringify_error(rv), NULL);
+		*readersp = calloc(1, 1);
+		VERIFY(*readersp != NULL);
+		return (ERRF_OK);
+	}
+	if (rv != SCARD_S_SUCCESS) {
+		return (pcscerrf("SCardListReaders", rv));
+	}
+	readers = calloc(1, readersLen);
+	VERIFY(readers != NULL);
+	rv = SCardListReaders(ctx, NULL, readers, &readersLen);
+	if (rv != SCARD_S_SUCCESS) {
+		free(readers);
+		return (pcscerrf("SCardListReaders", rv));
+	}
+
+	for (thisrdr = readers; *thisrdr != 0; thisrdr += strlen(thisrdr) + 1)
+		++n;
+	if (n < 2) {
+		*readersp = readers;
+		return (ERRF_OK);
+	}
+
+	ps = calloc(1, sizeof (*ps));
+	VERIFY(ps != NULL);
+	VERIFY0(pthread_mutex_init(&ps->ps_mtx, NULL));
+	VERIFY0(pthread_cond_init(&ps->ps_cv, NULL));
+	ps->ps_readers = readers;
+	ps->ps_find = find;
+	VERIFY3U(guidlen, <=, GUID_LEN);
+	if (guidlen > 0)
+		bcopy(guid, ps->ps_guidbuf, guidlen);
+	ps->ps_guidlen = guidlen;
+	ps->ps_nprobes = n;
+	ps->ps_probes = calloc(n, sizeof (struct piv_probe));
+	VERIFY(ps->ps_probes != NULL);
+	/* One ref for us, plus one for each probe. */
+	ps->ps_refs = n + 1;
+
+	i = 0;
+	for (thisrdr = readers; *thisrdr != 0; thisrdr += strlen(thisrdr) + 1) {
+		struct piv_probe *pp = &ps->ps_probes[i++];
+		pp->pp_set = ps;
+		pp->pp_rdr = thisrdr;
+		if (pthread_create(&thread, NULL, piv_probe_thread, pp) != 0) {
+			/* Just do this one ourselves, then. */
+			(void) piv_probe_thread(pp);
+			continue;
+		}
+		VERIFY0(pthread_detach(thread));
+	}
+
+	*psp = ps;
+	return (ERRF_OK);
+}
+
+errf_t *
+piv_enumerate(SCARDCONTEXT ctx, struct piv_token **tokens)
+{
+	char *readers, *thisrdr;
+	struct piv_token *ks = NULL, *key;
+	struct piv_probe_set *ps;
+	struct piv_probe *pp;
+	errf_t *err;
+	uint i;
+
+	if ((err = piv_probe_start(ctx, B_FALSE, NULL, 0, &readers, &ps)))
+		return (err);
+
+	if (ps == NULL) {
+		for (thisrdr = readers; *thisrdr != 0;
+		    thisrdr += strlen(thisrdr) + 1) {
+			piv_probe_reader(ctx, thisrdr, B_FALSE, NULL, 0, &key);
+			if (key != NULL) {
+				key->pt_next = ks;
+				ks = key;
+			}
+		}
+		free(readers);
+		goto out;
+	}
+
+	/*
+	 * Collect them in reader order (and build the list back-to-front
+	 * like the serial version does) so the result doesn't depend on
+	 * which card answered first.
+	 */
+	VERIFY0(pthread_mutex_lock(&ps->ps_mtx));
+	for (i = 0; i < ps->ps_nprobes; ++i) {
+		pp = &ps->ps_probes[i];
+		while (!pp->pp_done)
+			VERIFY0(pthread_cond_wait(&ps->ps_cv, &ps->ps_mtx));
+		key = pp->pp_token;
+		pp->pp_token = NULL;
+		if (key != NULL) {
+			key->pt_next = ks;
+			ks = key;
+		}
+	}
+	piv_probe_set_rele(ps);
+
+out:
+	/* Virtual tokens (if there are any) always come after real ones. */
+	for (i = 0; i < piv_virt_count(); ++i) {
+		piv_probe_virt(i, B_FALSE, NULL, 0, &key);
+		if (key != NULL) {
+			key->pt_next = ks;
+			ks = key;
+		}
+	}
+	rdrcache_update(ks, B_TRUE);
+	*tokens = ks;
+	return (ERRF_OK);
+}
+
+errf_t *
+piv_find(SCARDCONTEXT ctx, const uint8_t *guid, size_t guidlen,
+    struct piv_token **token)
+{
+	char *readers, *thisrdr;
+	struct piv_token *found = NULL, *key;
+	struct piv_probe_set *ps;
+	struct piv_probe *pp;
+	errf_t *err;
+	uint i, ndone;
+	boolean_t dup = B_FALSE;
+
+	if (guidlen == GUID_LEN &&
+	    (found = rdrcache_find(ctx, guid)) != NULL) {
+		*token = found;
+		return (ERRF_OK);
+	}
+
+	if ((err = piv_probe_start(ctx, B_TRUE, guid, guidlen, &readers,
+	    &ps)))
+		return (err);
+
+	if (ps == NULL) {
+		for (thisrdr = readers; *thisrdr != 0;
+		    thisrdr += strlen(thisrdr) + 1) {
+			piv_probe_reader(ctx, thisrdr, B_TRUE, guid, guidlen,
+			    &key);
+			if (key == NULL)
+				continue;
+			if (found != NULL) {
+				piv_release(key);
+				dup = B_TRUE;
+				break;
+			}
+			found = key;
+		}
+		free(readers);
+		goto out;
+	}
+
+	/*
+	 * Take matches as they come in. With a full GUID there's no need to
+	 * wait for the rest of the readers: we can have the first match.
+	 */
+	VERIFY0(pthread_mutex_lock(&ps->ps_mtx));
+	while (1) {
+		ndone = 0;
+		for (i = 0; i < ps->ps_nprobes; ++i) {
+			pp = &ps->ps_probes[i];
+			if (!pp->pp_done)
+				continue;
+			++ndone;
+			if ((key = pp->pp_token) == NULL)
+				continue;
+			if (found != NULL && key != found) {
+				dup = B_TRUE;
+				break;
+			}
+			found = key;
+		}
+		if (dup || ndone == ps->ps_nprobes)
+			break;
+		if (found != NULL && guidlen == GUID_LEN)
+			break;
+		VERIFY0(pthread_cond_wait(&ps->ps_cv, &ps->ps_mtx));
+	}
+	if (found != NULL && !dup) {
+		/* Take it off the set so it doesn't get released. */
+		for (i = 0; i < ps->ps_nprobes; ++i) {
+			if (ps->ps_probes[i].pp_token == found)
+				ps->ps_probes[i].pp_token = NULL;
+		}
+	}
+	if (dup)
+		found = NULL;
+	piv_probe_set_rele(ps);
+
+out:
+	for (i = 0; i < piv_virt_count() && !dup; ++i) {
+		if (found != NULL && guidlen == GUID_LEN)
+			break;
+		piv_probe_virt(i, B_TRUE, guid, guidlen, &key);
+		if (key == NULL)
+			continue;
+		if (found != NULL) {
+			piv_release(key);
+			dup = B_TRUE;
+			break;
+		}
+		found = key;
+	}
+	if (dup) {
+		if (found != NULL)
+			piv_release(found);
+		return (errf("DuplicateError", NULL,
+		    "More than one PIV token matched GUID"));
+	}
+	if (found == NULL) {
+		return (errf("NotFoundError", NULL,
+		    "No PIV token found matching GUID"));
+	}
+	rdrcache_update(found, B_FALSE);
+	*token = found;
+	return (ERRF_OK);
+}
+
+errf_t *
+piv_open_reader(SCARDCONTEXT ctx, const char *rdrname,
+    struct piv_token **token)
+{
+	struct piv_token *key;
+
+	piv_probe_reader(ctx, rdrname, B_FALSE, NULL, 0, &key);
+	if (key == NULL) {
+		return (errf("NotFoundError", NULL,
+		    "No PIV token found in reader '%s'", rdrname));
+	}
+	*token = key;
+	return (ERRF_OK);
+}
+
+void
+piv_release(struct piv_token *pk)
+{
+	struct piv_token *next;
+	struct piv_slot *ps, *psnext;
+
+	for (; pk != NULL; pk = next) {
+		VERIFY(pk->pt_intxn == B_FALSE);
+		pk->pt_tr->ptr_disconnect(pk->pt_trarg);
+
+		for (ps = pk->pt_slots; ps != NULL; ps = psnext) {
+			piv_slot_clear(ps);
+			psnext = ps->ps_next;
+			free(ps);
+		}
+		free(pk->pt_hist_url);
+		free((char *)pk->pt_rdrname);
+		free(pk->pt_guidhex);
+		piv_arena_free(pk->pt_arena);
+
+		next = pk->pt_next;
+		free(pk);
+	}
+}
+
+struct piv_slot *
+piv_get_slot(struct piv_token *tk, enum piv_slotid slotid)
+{
+	struct piv_slot *s;
+	for (s = tk->pt_slots; s != NULL; s = s->ps_next) {
+		if (s->ps_slot == slotid)
+			return (s);
+	}
+	return (NULL);
+}
+
+struct piv_slot *
+piv_force_slot(struct piv_token *tk, enum piv_slotid slotid, enum piv_alg alg)
+{
+	struct piv_slot *s;
+	for (s = tk->pt_slots; s != NULL; s = s->ps_next) {
+		if (s->ps_slot == slotid)
+			break;
 	}
 	if (s == NULL) {
 		s = calloc(1, sizeof (struct piv_slot));
@@ -1450,9 +2134,35 @@ piv_slot_alg(const struct piv_slot *slot)
 }
 
 X509 *
-piv_slot_cert(const struct piv_slot *slot)
+piv_slot_cert(const struct piv_slot *cslot)
+{
+	/* Materialising the X509 doesn't change what the slot represents. */
+	struct piv_slot *slot = (struct piv_slot *)cslot;
+	const uint8_t *p;
+	X509 *cert;
+
+	if (slot->ps_der == NULL)
+		return (slot->ps_x509);
+
+	VERIFY0(pthread_mutex_lock(&piv_slot_x509_mtx));
+	if (slot->ps_x509 == NULL) {
+		p = slot->ps_der;
+		/* We decoded this once already when we read it. */
+		cert = d2i_X509(NULL, &p, slot->ps_derlen);
+		VERIFY(cert != NULL);
+		slot->ps_x509 = cert;
+	}
+	cert = slot->ps_x509;
+	VERIFY0(pthread_mutex_unlock(&piv_slot_x509_mtx));
+
+	return (cert);
+}
+
+const uint8_t *
+piv_slot_cert_der(const struct piv_slot *slot, size_t *len)
 {
-	return (slot->ps_x509);
+	*len = slot->ps_derlen;
+	return (slot->ps_der);
 }
 
 const char *
@@ -1478,11 +2188,122 @@ piv_apdu_make(enum iso_class cls, enum iso_ins ins, uint8_t p1, uint8_t p2)
 	return (a);
 }
 
+static struct piv_apdu_arena *
+piv_arena_get(struct piv_token *tk)
+{
+	struct piv_apdu_arena *pa;
+	long pgsz;
+	uint i;
+
+	if (tk->pt_arena != NULL)
+		return (tk->pt_arena);
+
+	pa = calloc(1, sizeof (*pa));
+	if (pa == NULL)
+		return (NULL);
+	pgsz = sysconf(_SC_PAGESIZE);
+	pa->pa_size = PIV_ARENA_CMD_SIZE + PIV_ARENA_NREPLY * MAX_APDU_SIZE;
+	pa->pa_size = (pa->pa_size + pgsz - 1) & ~(pgsz - 1);
+	pa->pa_base = mmap(NULL, pa->pa_size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (pa->pa_base == MAP_FAILED) {
+		free(pa);
+		return (NULL);
+	}
+#if defined(MADV_DONTDUMP)
+	(void) madvise(pa->pa_base, pa->pa_size, MADV_DONTDUMP);
+#endif
+	pa->pa_locked = (mlock(pa->pa_base, pa->pa_size) == 0);
+	if (!pa->pa_locked) {
+		bunyan_log(BNY_DEBUG, "failed to mlock APDU arena",
+		    "error", BNY_STRING, strerror(errno), NULL);
+	}
+
+	/* Reply buffers first so they stay page-aligned. */
+	for (i = 0; i < PIV_ARENA_NREPLY; ++i)
+		pa->pa_reply[i] = pa->pa_base + i * MAX_APDU_SIZE;
+	pa->pa_cmd = pa->pa_base + PIV_ARENA_NREPLY * MAX_APDU_SIZE;
+
+	tk->pt_arena = pa;
+	return (pa);
+}
+
+/* Scrubs every reply buffer which has been given back. */
+static void
+piv_arena_scrub(struct piv_apdu_arena *pa)
+{
+	uint i;
+
+	for (i = 0; i < PIV_ARENA_NREPLY; ++i) {
+		if (pa->pa_busy[i] || pa->pa_dirty[i] == 0)
+			continue;
+		explicit_bzero(pa->pa_reply[i], pa->pa_dirty[i]);
+		pa->pa_dirty[i] = 0;
+	}
+}
+
+static void
+piv_arena_free(struct piv_apdu_arena *pa)
+{
+	if (pa == NULL)
+		return;
+	explicit_bzero(pa->pa_base, pa->pa_size);
+	if (pa->pa_locked)
+		(void) munlock(pa->pa_base, pa->pa_size);
+	(void) munmap(pa->pa_base, pa->pa_size);
+	free(pa);
+}
+
+/* Hands out a zeroed reply buffer, or returns B_FALSE if there isn't one */
+static boolean_t
+piv_arena_take_reply(struct piv_apdu_arena *pa, struct apdu *apdu)
+{
+	struct apdubuf *r = &apdu->a_reply;
+	uint i;
+
+	for (i = 0; i < PIV_ARENA_NREPLY; ++i) {
+		if (!pa->pa_busy[i])
+			break;
+	}
+	if (i >= PIV_ARENA_NREPLY)
+		return (B_FALSE);
+	if (pa->pa_dirty[i] > 0) {
+		explicit_bzero(pa->pa_reply[i], pa->pa_dirty[i]);
+		pa->pa_dirty[i] = 0;
+	}
+	pa->pa_busy[i] = B_TRUE;
+	r->b_data = pa->pa_reply[i];
+	r->b_size = MAX_APDU_SIZE;
+	r->b_offset = 0;
+	r->b_len = 0;
+	apdu->a_arena = pa;
+	apdu->a_arena_slot = i;
+	return (B_TRUE);
+}
+
+static void
+piv_arena_give_reply(struct apdu *apdu, size_t dirty)
+{
+	struct piv_apdu_arena *pa = apdu->a_arena;
+	uint i = apdu->a_arena_slot;
+
+	VERIFY(pa->pa_busy[i]);
+	VERIFY(apdu->a_reply.b_data == pa->pa_reply[i]);
+	pa->pa_busy[i] = B_FALSE;
+	pa->pa_dirty[i] = (dirty > MAX_APDU_SIZE) ? MAX_APDU_SIZE : dirty;
+	apdu->a_arena = NULL;
+	bzero(&apdu->a_reply, sizeof (struct apdubuf));
+}
+
 void
 piv_apdu_free(struct apdu *a)
 {
-	if (a->a_reply.b_data != NULL) {
-		freezero(a->a_reply.b_data, a->a_reply.b_size);
+	struct apdubuf *r = &a->a_reply;
+
+	if (a->a_arena != NULL) {
+		piv_arena_give_reply(a, r->b_offset + r->b_len + 2);
+	} else if (r->b_data != NULL) {
+		freezero(r->b_data, r->b_size);
 	}
 	free(a);
 }
@@ -1509,21 +2330,26 @@ piv_apdu_get_reply(const struct apdu *apdu, size_t *len)
 	return (apdu->a_reply.b_data + apdu->a_reply.b_offset);
 }
 
-static uint8_t *
-apdu_to_buffer(struct apdu *apdu, uint *outlen)
+/* "buf" must have room for APDU_CMD_SIZE(apdu->a_cmd.b_len) bytes */
+static void
+apdu_to_buffer(struct apdu *apdu, uint8_t *buf, uint *outlen)
 {
 	struct apdubuf *d = &(apdu->a_cmd);
-	uint8_t *buf = calloc(1, 6 + d->b_len);
+	struct apdubuf *r = &(apdu->a_reply);
+	size_t le, avail;
+	uint n;
+
 	buf[0] = apdu->a_cls;
 	buf[1] = apdu->a_ins;
 	buf[2] = apdu->a_p1;
 	buf[3] = apdu->a_p2;
-	if (d->b_data == NULL) {
-		buf[4] = apdu->a_le;
-		*outlen = 5;
-		return (buf);
-	} else {
-		/* TODO: maybe look at handling ext APDUs? */
+
+	if (!apdu->a_ext) {
+		if (d->b_data == NULL) {
+			buf[4] = apdu->a_le;
+			*outlen = 5;
+			return;
+		}
 		VERIFY(d->b_len < 256 && d->b_len > 0);
 		buf[4] = d->b_len;
 		bcopy(d->b_data + d->b_offset, buf + 5, d->b_len);
@@ -1533,8 +2359,113 @@ apdu_to_buffer(struct apdu *apdu, uint *outlen)
 			buf[d->b_len + 5] = apdu->a_le;
 			*outlen = d->b_len + 6;
 		}
-		return (buf);
+		return;
 	}
+
+	/*
+	 * Extended length: a zero byte, then 2-byte Lc (if there's data) and
+	 * 2-byte Le. Unless the caller asked for a particular Le, we ask for
+	 * as much as will fit in the reply buffer.
+	 */
+	le = apdu->a_le;
+	if (le == 0) {
+		if (r->b_data == NULL)
+			avail = MAX_APDU_SIZE;
+		else if (r->b_size > r->b_offset)
+			avail = r->b_size - r->b_offset;
+		else
+			avail = 0;
+		/* Leave room for the SW, but never ask for 0 (= 65536). */
+		le = (avail > 3) ? avail - 2 : 1;
+		if (le > 0xFFFF)
+			le = 0;		/* means 65536 */
+	}
+	buf[4] = 0;
+	n = 5;
+	if (d->b_data != NULL) {
+		VERIFY(d->b_len > 0 && d->b_len <= 0xFFFF);
+		buf[n++] = (d->b_len >> 8) & 0xFF;
+		buf[n++] = d->b_len & 0xFF;
+		bcopy(d->b_data + d->b_offset, buf + n, d->b_len);
+		n += d->b_len;
+		if (apdu->a_cls & CLA_CHAIN) {
+			*outlen = n;
+			return;
+		}
+	}
+	buf[n++] = (le >> 8) & 0xFF;
+	buf[n++] = le & 0xFF;
+	*outlen = n;
+}
+
+/*
+ * Works out whether we can use extended length APDUs with this token: the
+ * card has to say so (either in the card capabilities in its ATR historical
+ * bytes, or by being a YubiKey 4 or later) and we have to be using T=1.
+ */
+static void
+piv_probe_ext_apdu(struct piv_token *pk)
+{
+	const uint8_t *atr = pk->pt_atr;
+	size_t atrlen = pk->pt_atrlen;
+	uint i, y, k, tag, len, nhist = 0;
+
+	pk->pt_ext_apdu = B_FALSE;
+	if (pk->pt_proto != SCARD_PROTOCOL_T1)
+		return;
+
+	if (pk->pt_ykpiv && pk->pt_ykver[0] >= 4) {
+		pk->pt_ext_apdu = B_TRUE;
+		goto out;
+	}
+
+	if (atrlen < 2)
+		return;
+
+	/* Skip TS, T0 and the interface bytes to find the historical bytes */
+	k = atr[1] & 0x0F;
+	y = atr[1] >> 4;
+	i = 2;
+	while (i < atrlen) {
+		if (y & 0x1)
+			++i;
+		if (y & 0x2)
+			++i;
+		if (y & 0x4)
+			++i;
+		if ((y & 0x8) == 0)
+			break;
+		if (i >= atrlen)
+			return;
+		y = atr[i] >> 4;
+		++i;
+	}
+	if (i + k > atrlen)
+		return;
+	nhist = k;
+
+	/* Category 0x80: a list of COMPACT-TLV objects */
+	if (nhist < 1 || atr[i] != 0x80)
+		return;
+	for (++i, --nhist; nhist > 0; i += len, nhist -= len) {
+		tag = atr[i] >> 4;
+		len = atr[i] & 0x0F;
+		++i;
+		--nhist;
+		if (len > nhist)
+			return;
+		/* Card capabilities, third byte, b7: extended Lc and Le */
+		if (tag == 0x7 && len >= 3 && (atr[i + 2] & 0x40)) {
+			pk->pt_ext_apdu = B_TRUE;
+			break;
+		}
+	}
+	if (!pk->pt_ext_apdu)
+		return;
+
+out:
+	bunyan_log(BNY_DEBUG, "using extended length APDUs",
+	    "reader", BNY_STRING, pk->pt_rdrname, NULL);
 }
 
 static const char *
@@ -1578,10 +2509,105 @@ ins_to_name(enum iso_ins ins)
 	}
 }
 
-/*
- * The basic APDU transceiver function. Doesn't handle any chaining or length
- * correction logic at all.
- */
+/*
+ * The basic APDU transceiver function. Doesn't handle any chaining or length
+ * correction logic at all.
+ */
+/*
+ * A small always-on ring of recent APDU exchanges (across all tokens), kept
+ * as compact binary records so that it's cheap enough to leave running in
+ * production. It gets dumped to the log when the card path fails, and the
+ * agent can hand it out for diagnosing slow cards.
+ */
+#define	PIV_TRACE_LEN		256
+#define	PIV_TRACE_DUMP		16
+
+static pthread_mutex_t piv_trace_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct piv_apdu_trace piv_trace[PIV_TRACE_LEN];
+static uint64_t piv_trace_next = 0;
+
+uint64_t
+piv_trace_now(void)
+{
+	struct timespec ts;
+
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return ((uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000);
+}
+
+static void
+piv_trace_add(const struct piv_apdu_trace *rec)
+{
+	VERIFY0(pthread_mutex_lock(&piv_trace_mtx));
+	piv_trace[piv_trace_next++ % PIV_TRACE_LEN] = *rec;
+	VERIFY0(pthread_mutex_unlock(&piv_trace_mtx));
+}
+
+size_t
+piv_apdu_trace_get(struct piv_apdu_trace *recs, size_t max)
+{
+	uint64_t first;
+	size_t n, i;
+
+	VERIFY0(pthread_mutex_lock(&piv_trace_mtx));
+	n = piv_trace_next;
+	if (n > PIV_TRACE_LEN)
+		n = PIV_TRACE_LEN;
+	if (n > max)
+		n = max;
+	first = piv_trace_next - n;
+	for (i = 0; i < n; ++i)
+		recs[i] = piv_trace[(first + i) % PIV_TRACE_LEN];
+	VERIFY0(pthread_mutex_unlock(&piv_trace_mtx));
+
+	return (n);
+}
+
+/*
+ * Logs the last few exchanges with this token. Only does it once per run of
+ * failures, so that a card that's gone away doesn't flood the log.
+ */
+static void
+piv_trace_dump(struct piv_token *pk)
+{
+	struct piv_apdu_trace recs[PIV_TRACE_LEN];
+	const struct piv_apdu_trace *r;
+	size_t n, i, shown = 0;
+
+	if (pk->pt_trace_dumped)
+		return;
+	pk->pt_trace_dumped = B_TRUE;
+
+	n = piv_apdu_trace_get(recs, PIV_TRACE_LEN);
+	for (i = 0; i < n; ++i) {
+		r = &recs[i];
+		if (bcmp(r->pat_guid, pk->pt_guid, sizeof (r->pat_guid)) == 0)
+			++shown;
+	}
+	/* shown is now how many there are, skip all but the last few */
+	for (i = 0; i < n; ++i) {
+		r = &recs[i];
+		if (bcmp(r->pat_guid, pk->pt_guid, sizeof (r->pat_guid)) != 0)
+			continue;
+		if (shown-- > PIV_TRACE_DUMP)
+			continue;
+		bunyan_log(BNY_WARN, "APDU trace",
+		    "reader", BNY_STRING, pk->pt_rdrname,
+		    "ins_name", BNY_STRING, ins_to_name(r->pat_ins),
+		    "class", BNY_UINT, (uint)r->pat_cls,
+		    "ins", BNY_UINT, (uint)r->pat_ins,
+		    "p1", BNY_UINT, (uint)r->pat_p1,
+		    "p2", BNY_UINT, (uint)r->pat_p2,
+		    "lc", BNY_UINT, (uint)r->pat_lc,
+		    "le", BNY_UINT, (uint)r->pat_le,
+		    "sw", BNY_UINT, (uint)r->pat_sw,
+		    "lr", BNY_UINT, (uint)r->pat_lr,
+		    "pcsc_rv", BNY_UINT, (uint)r->pat_rv,
+		    "usec", BNY_UINT, (uint)(r->pat_end - r->pat_start),
+		    NULL);
+	}
+}
+
 errf_t *
 piv_apdu_transceive(struct piv_token *key, struct apdu *apdu)
 {
@@ -1589,24 +2615,38 @@ piv_apdu_transceive(struct piv_token *key, struct apdu *apdu)
 	int rv;
 	errf_t *err;
 
-	boolean_t freedata = B_FALSE;
+	boolean_t freedata = B_FALSE, freecmd = B_FALSE;
 	DWORD recvLength;
 	uint8_t *cmd;
 	struct apdubuf *r = &(apdu->a_reply);
+	struct piv_apdu_arena *pa;
+	struct piv_apdu_trace tr;
 
 	VERIFY(key->pt_intxn == B_TRUE);
 
-	cmd = apdu_to_buffer(apdu, &cmdLen);
-	VERIFY(cmd != NULL);
-	if (cmd == NULL || cmdLen < 5)
-		return (ERRF_NOMEM);
-
+	pa = piv_arena_get(key);
 	if (r->b_data == NULL) {
-		r->b_data = calloc(1, MAX_APDU_SIZE);
-		r->b_size = MAX_APDU_SIZE;
-		r->b_offset = 0;
+		if (pa == NULL || !piv_arena_take_reply(pa, apdu)) {
+			r->b_data = calloc(1, MAX_APDU_SIZE);
+			if (r->b_data == NULL)
+				return (ERRF_NOMEM);
+			r->b_size = MAX_APDU_SIZE;
+			r->b_offset = 0;
+		}
 		freedata = B_TRUE;
 	}
+
+	if (pa != NULL &&
+	    APDU_CMD_SIZE(apdu->a_cmd.b_len) <= PIV_ARENA_CMD_SIZE) {
+		cmd = pa->pa_cmd;
+	} else {
+		cmd = calloc(1, APDU_CMD_SIZE(apdu->a_cmd.b_len));
+		VERIFY(cmd != NULL);
+		freecmd = B_TRUE;
+	}
+	/* Must come after the reply buffer is set up (for extended Le) */
+	apdu_to_buffer(apdu, cmd, &cmdLen);
+	VERIFY3U(cmdLen, >=, 5);
 	recvLength = r->b_size - r->b_offset;
 	VERIFY(r->b_data != NULL);
 
@@ -1616,9 +2656,44 @@ piv_apdu_transceive(struct piv_token *key, struct apdu *apdu)
 		    NULL);
 	}
 
-	rv = SCardTransmit(key->pt_cardhdl, &key->pt_sendpci, cmd,
-	    cmdLen, NULL, r->b_data + r->b_offset, &recvLength);
-	freezero(cmd, cmdLen);
+	bzero(&tr, sizeof (tr));
+	bcopy(key->pt_guid, tr.pat_guid, sizeof (tr.pat_guid));
+	tr.pat_cls = apdu->a_cls;
+	tr.pat_ins = apdu->a_ins;
+	tr.pat_p1 = apdu->a_p1;
+	tr.pat_p2 = apdu->a_p2;
+	tr.pat_ext = apdu->a_ext;
+	tr.pat_lc = apdu->a_cmd.b_len;
+	tr.pat_le = apdu->a_le;
+	tr.pat_start = piv_trace_now();
+
+	PIVY_PROBE5(apdu__send, key->pt_guid, (uint)apdu->a_ins,
+	    (uint)apdu->a_p1, (uint)apdu->a_p2, (uint)apdu->a_cmd.b_len);
+	rv = key->pt_tr->ptr_transmit(key->pt_trarg, cmd, cmdLen,
+	    r->b_data + r->b_offset, &recvLength);
+	tr.pat_end = piv_trace_now();
+	tr.pat_rv = rv;
+	if (rv == SCARD_S_SUCCESS && recvLength >= 2) {
+		key->pt_trace_dumped = B_FALSE;
+		tr.pat_lr = recvLength - 2;
+		tr.pat_sw = (r->b_data[r->b_offset + recvLength - 2] << 8) |
+		    r->b_data[r->b_offset + recvLength - 1];
+	}
+	PIVY_PROBE5(apdu__recv, key->pt_guid, (uint)apdu->a_ins, (long)rv,
+	    (uint)tr.pat_sw, (uint)tr.pat_lr);
+	piv_trace_add(&tr);
+
+	if (freecmd)
+		freezero(cmd, cmdLen);
+	else
+		explicit_bzero(cmd, cmdLen);
+
+	key->pt_apdu_count++;
+	key->pt_apdu_txbytes += cmdLen;
+	if (rv == SCARD_S_SUCCESS)
+		key->pt_apdu_rxbytes += recvLength;
+	else
+		key->pt_selected = B_FALSE;
 
 	if (piv_full_apdu_debug) {
 		bunyan_log(BNY_TRACE, "received APDU",
@@ -1630,8 +2705,11 @@ piv_apdu_transceive(struct piv_token *key, struct apdu *apdu)
 		err = pcscrerrf("SCardTransmit", key->pt_rdrname, rv);
 		bunyan_log(BNY_DEBUG, "SCardTransmit failed",
 		    "error", BNY_ERF, err, NULL);
-		if (freedata) {
-			free(r->b_data);
+		piv_trace_dump(key);
+		if (freedata && apdu->a_arena != NULL) {
+			piv_arena_give_reply(apdu, MAX_APDU_SIZE);
+		} else if (freedata) {
+			freezero(r->b_data, r->b_size);
 			bzero(r, sizeof (struct apdubuf));
 		}
 		return (err);
@@ -1648,7 +2726,8 @@ piv_apdu_transceive(struct piv_token *key, struct apdu *apdu)
 	    "ins_name", BNY_STRING, ins_to_name(apdu->a_ins),
 	    "p1", BNY_UINT, (uint)apdu->a_p1,
 	    "p2", BNY_UINT, (uint)apdu->a_p2,
-	    "lc", BNY_UINT, (uint)(cmdLen - 5),
+	    "ext", BNY_INT, (int)apdu->a_ext,
+	    "lc", BNY_UINT, (uint)apdu->a_cmd.b_len,
 	    "le", BNY_UINT, (uint)apdu->a_le,
 	    "sw", BNY_UINT, (uint)apdu->a_sw,
 	    "sw_name", BNY_STRING, sw_to_name(apdu->a_sw),
@@ -1666,19 +2745,24 @@ errf_t *
 piv_apdu_transceive_chain(struct piv_token *pk, struct apdu *apdu)
 {
 	errf_t *rv;
-	size_t offset;
+	size_t offset, cmdoff, maxseg;
 	size_t rem;
-	boolean_t gotok = B_FALSE;
+	boolean_t gotok = B_FALSE, extreply;
+	const uint8_t le = apdu->a_le;
 
 	VERIFY(pk->pt_intxn == B_TRUE);
 
 	/* First, send the command. */
+	cmdoff = apdu->a_cmd.b_offset;
 	rem = apdu->a_cmd.b_len;
+resegment:
+	apdu->a_ext = pk->pt_ext_apdu;
+	maxseg = apdu->a_ext ? PIV_EXT_CMD_MAX : 0xFF;
 	do {
 		/* Is there another block needed in the chain? */
-		if (rem > 0xFF) {
+		if (rem > maxseg) {
 			apdu->a_cls |= CLA_CHAIN;
-			apdu->a_cmd.b_len = 0xFF;
+			apdu->a_cmd.b_len = maxseg;
 		} else {
 			apdu->a_cls &= ~CLA_CHAIN;
 			apdu->a_cmd.b_len = rem;
@@ -1687,6 +2771,23 @@ again:
 		rv = piv_apdu_transceive(pk, apdu);
 		if (rv)
 			return (rv);
+		/*
+		 * If the card rejects the very first extended APDU with
+		 * WRONG_LENGTH, then it (or the reader) doesn't really do
+		 * them: go back to short APDUs and chaining for good. Only
+		 * an explicit rejection counts -- after a transport error
+		 * we can't know whether the card acted on the command, and
+		 * sending e.g. a VERIFY again could cost a PIN retry.
+		 */
+		if (apdu->a_ext && apdu->a_cmd.b_offset == cmdoff &&
+		    apdu->a_sw == SW_WRONG_LENGTH) {
+			bunyan_log(BNY_DEBUG, "extended APDU rejected, "
+			    "falling back to chaining",
+			    "sw", BNY_UINT, (uint)apdu->a_sw, NULL);
+			pk->pt_ext_apdu = B_FALSE;
+			apdu->a_le = le;
+			goto resegment;
+		}
 		if ((apdu->a_sw & 0xFF00) == SW_CORRECT_LE_00) {
 			apdu->a_le = apdu->a_sw & 0x00FF;
 			/*
@@ -1722,12 +2823,19 @@ again:
 	 *
 	 * Note the case where we got SW_NO_ERROR but max length data -- we try
 	 * a CONTINUE just in case -- there are a few cards which are buggy
-	 * and don't always give us SW_BYTES_REMAINING.
+	 * and don't always give us SW_BYTES_REMAINING. (An extended length
+	 * reply over 0xFF bytes is normal though, so that doesn't count.)
+	 *
+	 * The CONTINUEs themselves are always short APDUs.
 	 */
+	extreply = apdu->a_ext;
 	while ((apdu->a_sw & 0xFF00) == SW_BYTES_REMAINING_00 ||
-	    (apdu->a_sw == SW_NO_ERROR && apdu->a_reply.b_len >= 0xFF)) {
+	    (!extreply && apdu->a_sw == SW_NO_ERROR &&
+	    apdu->a_reply.b_len >= 0xFF)) {
 		if (apdu->a_sw == SW_NO_ERROR)
 			gotok = B_TRUE;
+		extreply = B_FALSE;
+		apdu->a_ext = B_FALSE;
 		apdu->a_cls = CLA_ISO;
 		apdu->a_ins = INS_CONTINUE;
 		apdu->a_p1 = 0;
@@ -1755,28 +2863,77 @@ again:
 	return (ERRF_OK);
 }
 
-errf_t *
-piv_txn_begin(struct piv_token *key)
+static LONG
+pcsc_begin(void *arg)
 {
-	VERIFY(key->pt_intxn == B_FALSE);
+	struct piv_token *key = arg;
 	LONG rv;
-	errf_t *err;
 	DWORD activeProtocol = 0;
-retry:
-	rv = SCardBeginTransaction(key->pt_cardhdl);
-	if (rv == SCARD_W_RESET_CARD) {
+
+	while ((rv = SCardBeginTransaction(key->pt_cardhdl)) ==
+	    SCARD_W_RESET_CARD) {
+		key->pt_selected = B_FALSE;
 		rv = SCardReconnect(key->pt_cardhdl, SCARD_SHARE_SHARED,
 		    SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, SCARD_RESET_CARD,
 		    &activeProtocol);
-		if (rv == SCARD_S_SUCCESS) {
-			goto retry;
-		} else {
-			err = ioerrf(pcscerrf("SCardReconnect", rv),
-			    key->pt_rdrname);
-			return (err);
+		if (rv != SCARD_S_SUCCESS) {
+			bunyan_log(BNY_DEBUG, "SCardReconnect failed",
+			    "reader", BNY_STRING, key->pt_rdrname,
+			    "err", BNY_STRING, pcsc_stringify_error(rv),
+			    NULL);
+			break;
 		}
 	}
+	return (rv);
+}
+
+static LONG
+pcsc_end(void *arg, boolean_t reset)
+{
+	struct piv_token *key = arg;
+
+	return (SCardEndTransaction(key->pt_cardhdl,
+	    reset ? SCARD_RESET_CARD : SCARD_LEAVE_CARD));
+}
+
+static LONG
+pcsc_transmit(void *arg, const uint8_t *cmd, size_t cmdlen, uint8_t *resp,
+    DWORD *resplen)
+{
+	struct piv_token *key = arg;
+
+	return (SCardTransmit(key->pt_cardhdl, &key->pt_sendpci, cmd,
+	    cmdlen, NULL, resp, resplen));
+}
+
+static void
+pcsc_disconnect(void *arg)
+{
+	struct piv_token *key = arg;
+
+	(void) SCardDisconnect(key->pt_cardhdl, SCARD_LEAVE_CARD);
+	if (key->pt_ownctx)
+		(void) SCardReleaseContext(key->pt_ctx);
+}
+
+static const struct piv_transport piv_pcsc_transport = {
+	.ptr_begin = pcsc_begin,
+	.ptr_end = pcsc_end,
+	.ptr_transmit = pcsc_transmit,
+	.ptr_disconnect = pcsc_disconnect
+};
+
+errf_t *
+piv_txn_begin(struct piv_token *key)
+{
+	VERIFY(key->pt_intxn == B_FALSE);
+	LONG rv;
+	errf_t *err;
+
+	rv = key->pt_tr->ptr_begin(key->pt_trarg);
+	PIVY_PROBE3(txn__begin, key->pt_guid, key->pt_rdrname, (long)rv);
 	if (rv != SCARD_S_SUCCESS) {
+		key->pt_selected = B_FALSE;
 		err = ioerrf(pcscerrf("SCardBeginTransaction", rv),
 		    key->pt_rdrname);
 		return (err);
@@ -1790,8 +2947,10 @@ piv_txn_end(struct piv_token *key)
 {
 	VERIFY(key->pt_intxn == B_TRUE);
 	LONG rv;
-	rv = SCardEndTransaction(key->pt_cardhdl,
-	    key->pt_reset ? SCARD_RESET_CARD : SCARD_LEAVE_CARD);
+	rv = key->pt_tr->ptr_end(key->pt_trarg, key->pt_reset);
+	PIVY_PROBE3(txn__end, key->pt_guid, key->pt_rdrname, (long)rv);
+	if (key->pt_reset || rv != SCARD_S_SUCCESS)
+		key->pt_selected = B_FALSE;
 	if (rv != SCARD_S_SUCCESS) {
 		bunyan_log(BNY_ERROR, "SCardEndTransaction failed",
 		    "reader", BNY_STRING, key->pt_rdrname,
@@ -1800,6 +2959,8 @@ piv_txn_end(struct piv_token *key)
 	}
 	key->pt_intxn = B_FALSE;
 	key->pt_reset = B_FALSE;
+	if (key->pt_arena != NULL)
+		piv_arena_scrub(key->pt_arena);
 }
 
 errf_t *
@@ -1808,10 +2969,12 @@ piv_select(struct piv_token *tk)
 	errf_t *rv = ERRF_OK;
 	struct apdu *apdu;
 	struct tlv_state *tlv = NULL;
+	struct tlv_state tlvs;
 	uint tag, idx, uval;
 
 	VERIFY(tk->pt_intxn == B_TRUE);
 
+	tk->pt_selected = B_FALSE;
 	apdu = piv_apdu_make(CLA_ISO, INS_SELECT, SEL_APP_AID, 0);
 	apdu->a_cmd.b_data = (uint8_t *)AID_PIV;
 	apdu->a_cmd.b_len = sizeof (AID_PIV);
@@ -1830,8 +2993,8 @@ piv_select(struct piv_token *tk)
 		 * [piv] 800-73-4 part 2, section 3.1.1
 		 * In particular, table 3 has the list of tags here.
 		 */
-		tlv = tlv_init(apdu->a_reply.b_data, apdu->a_reply.b_offset,
-		    apdu->a_reply.b_len);
+		tlv = tlv_init_at(&tlvs, apdu->a_reply.b_data,
+		    apdu->a_reply.b_offset, apdu->a_reply.b_len);
 		if ((rv = tlv_read_tag(tlv, &tag)))
 			goto invdata;
 		if (tag != PIV_TAG_APT) {
@@ -1885,6 +3048,7 @@ piv_select(struct piv_token *tk)
 		if ((rv = tlv_end(tlv)))
 			goto invdata;
 		rv = NULL;
+		tk->pt_selected = B_TRUE;
 	} else {
 		rv = errf("NotFoundError", swerrf("INS_SELECT", apdu->a_sw),
 		    "PIV applet was not found on device '%s'", tk->pt_rdrname);
@@ -1904,6 +3068,15 @@ invdata:
 	goto out;
 }
 
+errf_t *
+piv_select_lazy(struct piv_token *tk)
+{
+	VERIFY(tk->pt_intxn == B_TRUE);
+	if (tk->pt_selected)
+		return (ERRF_OK);
+	return (piv_select(tk));
+}
+
 /*
  * see [piv] 800-73-4 part 2 appendix A.1
  */
@@ -2092,42 +3265,49 @@ invdata:
 }
 
 /*
- * see [piv] 800-73-4 part 2 section 3.3.1
+ * PUT DATA bodies are the object tag (in a 0x5C) followed by len bytes of
+ * contents (in a 0x53). We always work out the total size first so that the
+ * whole body can be written once into an exactly sized buffer, which the
+ * chaining code then sends straight out of.
  */
-errf_t *
-piv_write_file(struct piv_token *pt, uint tag, const uint8_t *data, size_t len)
+static size_t
+piv_file_size(uint tag, size_t len)
 {
-	errf_t *err;
-	struct apdu *apdu;
-	struct tlv_state *tlv;
-
-	VERIFY(pt->pt_intxn == B_TRUE);
+	return (tlv_size(0x5C, tlv_tag_size(tag)) + tlv_size(0x53, len));
+}
 
-	tlv = tlv_init_write();
-	tlv_push(tlv, 0x5C);
+/* Leaves the 0x53 open for the caller to write the contents and tlv_pop() */
+static void
+piv_file_begin(struct tlv_state *tlv, uint tag, size_t len)
+{
+	tlv_pushlen(tlv, 0x5C, tlv_tag_size(tag));
 	tlv_write_u8to32(tlv, tag);
 	tlv_pop(tlv);
-	tlv_pushl(tlv, 0x53, len + 8);
-	tlv_write(tlv, (uint8_t *)data, len);
-	tlv_pop(tlv);
+	tlv_pushlen(tlv, 0x53, len);
+}
+
+/*
+ * see [piv] 800-73-4 part 2 section 3.3.1
+ */
+static errf_t *
+piv_put_data(struct piv_token *pt, uint tag, uint8_t *buf, size_t len)
+{
+	errf_t *err;
+	struct apdu *apdu;
 
 	apdu = piv_apdu_make(CLA_ISO, INS_PUT_DATA, 0x3F, 0xFF);
-	apdu->a_cmd.b_data = tlv_buf(tlv);
-	apdu->a_cmd.b_len = tlv_len(tlv);
+	apdu->a_cmd.b_data = buf;
+	apdu->a_cmd.b_len = len;
 
 	err = piv_apdu_transceive_chain(pt, apdu);
 	if (err) {
 		err = ioerrf(err, pt->pt_rdrname);
 		bunyan_log(BNY_WARN, "piv_write_file.transceive_chain failed",
 		    "error", BNY_ERF, err, NULL);
-		tlv_free(tlv);
 		piv_apdu_free(apdu);
 		return (err);
 	}
 
-	tlv_free(tlv);
-	tlv = NULL;
-
 	if (apdu->a_sw == SW_NO_ERROR) {
 		err = ERRF_OK;
 	} else if (apdu->a_sw == SW_OUT_OF_MEMORY) {
@@ -2149,6 +3329,34 @@ piv_write_file(struct piv_token *pt, uint tag, const uint8_t *data, size_t len)
 	return (err);
 }
 
+errf_t *
+piv_write_file(struct piv_token *pt, uint tag, const uint8_t *data, size_t len)
+{
+	errf_t *err;
+	struct tlv_state tlvs;
+	uint8_t *buf;
+	size_t blen;
+
+	VERIFY(pt->pt_intxn == B_TRUE);
+
+	blen = piv_file_size(tag, len);
+	buf = malloc(blen);
+	if (buf == NULL)
+		return (ERRF_NOMEM);
+
+	tlv_init_write_at(&tlvs, buf, blen);
+	piv_file_begin(&tlvs, tag, len);
+	tlv_write(&tlvs, data, len);
+	tlv_pop(&tlvs);
+	VERIFY3U(tlv_len(&tlvs), ==, blen);
+	tlv_free(&tlvs);
+
+	err = piv_put_data(pt, tag, buf, blen);
+
+	freezero(buf, blen);
+	return (err);
+}
+
 /*
  * see [piv] 800-73-4 part 2 section 3.3.2
  */
@@ -2331,7 +3539,7 @@ ykpiv_generate(struct piv_token *pt, enum piv_slotid slotid,
 	VERIFY(pt->pt_intxn);
 
 	/* Reject if this isn't a YubicoPIV card. */
-	if (!pt->pt_ykpiv)
+	if (!piv_token_is_ykpiv(pt))
 		return (argerrf("tk", "a YubicoPIV-compatible token", "not"));
 	/* The TOUCH_CACHED option is only supported on versions >=4.3 */
 	if (touchpolicy == YKPIV_TOUCH_CACHED &&
@@ -2366,30 +3574,19 @@ ykpiv_generate(struct piv_token *pt, enum piv_slotid slotid,
 	return (piv_generate_common(pt, apdu, tlv, alg, slotid, pubkey));
 }
 
+/* Caller must have allowed tlv_size(tag, BN_num_bytes(v)) for this. */
 errf_t *
 tlv_write_bignum(struct tlv_state *tlv, uint tag, const BIGNUM *v)
 {
-	u_char *d = NULL;
 	errf_t *err = NULL;
 	size_t len;
 
-	d = malloc(SSHBUF_MAX_BIGNUM);
-	if (d == NULL) {
-		err = ERRF_NOMEM;
-		goto out;
-	}
-
 	len = BN_num_bytes(v);
-	if (BN_bn2bin(v, d) != len) {
+	tlv_pushlen(tlv, tag, len);
+	if (BN_bn2bin(v, tlv_write_ptr(tlv, len)) != len)
 		make_sslerrf(err, "BN_bn2bin", "bignum too long");
-		goto out;
-	}
-	tlv_pushl(tlv, tag, len);
-	tlv_write(tlv, d, len);
 	tlv_pop(tlv);
 
-out:
-	free(d);
 	return (err);
 }
 
@@ -2400,15 +3597,21 @@ errf_t *
 ykpiv_import(struct piv_token *pt, enum piv_slotid slotid, struct sshkey *key,
     enum ykpiv_pin_policy pinpolicy, enum ykpiv_touch_policy touchpolicy)
 {
-	struct tlv_state *tlv;
+	struct tlv_state tlvs;
 	errf_t *err;
 	enum piv_alg alg;
 	struct apdu *apdu = NULL;
+	const BIGNUM *bn[5];
+	uint tag0, nbn, i;
+	uint8_t *buf = NULL;
+	size_t blen = 0;
 
 	VERIFY(pt->pt_intxn);
 
-	tlv = tlv_init_write();
-
+	/*
+	 * The key parts go in consecutive tags starting at tag0: P, Q, DP,
+	 * DQ and QINV for RSA, or just the private scalar for EC.
+	 */
 	switch (key->type) {
 	case KEY_RSA:
 		switch (sshkey_size(key)) {
@@ -2424,11 +3627,13 @@ ykpiv_import(struct piv_token *pt, enum piv_slotid slotid, struct sshkey *key,
 			    sshkey_size(key));
 			goto out;
 		}
-		tlv_write_bignum(tlv, 0x01, key->rsa->p);
-		tlv_write_bignum(tlv, 0x02, key->rsa->q);
-		tlv_write_bignum(tlv, 0x03, key->rsa->dmp1);
-		tlv_write_bignum(tlv, 0x04, key->rsa->dmq1);
-		tlv_write_bignum(tlv, 0x05, key->rsa->iqmp);
+		tag0 = 0x01;
+		bn[0] = key->rsa->p;
+		bn[1] = key->rsa->q;
+		bn[2] = key->rsa->dmp1;
+		bn[3] = key->rsa->dmq1;
+		bn[4] = key->rsa->iqmp;
+		nbn = 5;
 		break;
 	case KEY_ECDSA:
 		switch (sshkey_size(key)) {
@@ -2444,8 +3649,9 @@ ykpiv_import(struct piv_token *pt, enum piv_slotid slotid, struct sshkey *key,
 			    sshkey_size(key));
 			goto out;
 		}
-		tlv_write_bignum(tlv, 0x06,
-		    EC_KEY_get0_private_key(key->ecdsa));
+		tag0 = 0x06;
+		bn[0] = EC_KEY_get0_private_key(key->ecdsa);
+		nbn = 1;
 		break;
 	default:
 		err = argerrf("privkey", "an RSA or ECDSA private key",
@@ -2453,9 +3659,27 @@ ykpiv_import(struct piv_token *pt, enum piv_slotid slotid, struct sshkey *key,
 		goto out;
 	}
 
+	for (i = 0; i < nbn; ++i)
+		blen += tlv_size(tag0 + i, BN_num_bytes(bn[i]));
+	buf = malloc(blen);
+	if (buf == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+	tlv_init_write_at(&tlvs, buf, blen);
+	for (i = 0; i < nbn; ++i) {
+		err = tlv_write_bignum(&tlvs, tag0 + i, bn[i]);
+		if (err != ERRF_OK)
+			break;
+	}
+	VERIFY(err != ERRF_OK || tlv_len(&tlvs) == blen);
+	tlv_free(&tlvs);
+	if (err != ERRF_OK)
+		goto out;
+
 	apdu = piv_apdu_make(CLA_ISO, INS_IMPORT_ASYM, alg, slotid);
-	apdu->a_cmd.b_data = tlv_buf(tlv);
-	apdu->a_cmd.b_len = tlv_len(tlv);
+	apdu->a_cmd.b_data = buf;
+	apdu->a_cmd.b_len = blen;
 
 	err = piv_apdu_transceive_chain(pt, apdu);
 	if (err) {
@@ -2463,9 +3687,6 @@ ykpiv_import(struct piv_token *pt, enum piv_slotid slotid, struct sshkey *key,
 		goto out;
 	}
 
-	tlv_free(tlv);
-	tlv = NULL;
-
 	if (apdu->a_sw == SW_NO_ERROR) {
 		err = ERRF_OK;
 	} else if (apdu->a_sw == SW_OUT_OF_MEMORY) {
@@ -2485,7 +3706,8 @@ ykpiv_import(struct piv_token *pt, enum piv_slotid slotid, struct sshkey *key,
 
 out:
 	piv_apdu_free(apdu);
-	tlv_free(tlv);
+	if (buf != NULL)
+		freezero(buf, blen);
 	return (err);
 }
 
@@ -2546,7 +3768,9 @@ piv_write_cert(struct piv_token *pk, enum piv_slotid slotid,
     const uint8_t *data, size_t datalen, uint flags)
 {
 	errf_t *err;
-	struct tlv_state *tlv;
+	struct tlv_state tlvs;
+	uint8_t *buf;
+	size_t len, blen;
 	uint tag;
 
 	VERIFY(pk->pt_intxn == B_TRUE);
@@ -2574,18 +3798,28 @@ piv_write_cert(struct piv_token *pk, enum piv_slotid slotid,
 		    "%02x", slotid));
 	}
 
-	tlv = tlv_init_write();
-	tlv_pushl(tlv, 0x70, datalen + 3);
-	tlv_write(tlv, data, datalen);
-	tlv_pop(tlv);
-	tlv_push(tlv, 0x71);
-	tlv_write_byte(tlv, (uint8_t)flags);
-	tlv_pop(tlv);
+	/* The certificate goes straight into the PUT DATA body. */
+	len = tlv_size(0x70, datalen) + tlv_size(0x71, 1);
+	blen = piv_file_size(tag, len);
+	buf = malloc(blen);
+	if (buf == NULL)
+		return (ERRF_NOMEM);
 
-	err = piv_write_file(pk, tag, tlv_buf(tlv), tlv_len(tlv));
+	tlv_init_write_at(&tlvs, buf, blen);
+	piv_file_begin(&tlvs, tag, len);
+	tlv_pushlen(&tlvs, 0x70, datalen);
+	tlv_write(&tlvs, data, datalen);
+	tlv_pop(&tlvs);
+	tlv_pushlen(&tlvs, 0x71, 1);
+	tlv_write_byte(&tlvs, (uint8_t)flags);
+	tlv_pop(&tlvs);
+	tlv_pop(&tlvs);
+	VERIFY3U(tlv_len(&tlvs), ==, blen);
+	tlv_free(&tlvs);
 
-	tlv_free(tlv);
+	err = piv_put_data(pk, tag, buf, blen);
 
+	free(buf);
 	return (err);
 }
 
@@ -2603,7 +3837,7 @@ ykpiv_attest(struct piv_token *pt, struct piv_slot *slot, uint8_t **data,
 	struct apdu *apdu;
 
 	VERIFY(pt->pt_intxn == B_TRUE);
-	if (!pt->pt_ykpiv)
+	if (!piv_token_is_ykpiv(pt))
 		return (argerrf("tk", "a YubicoPIV-compatible token", "not"));
 
 	apdu = piv_apdu_make(CLA_ISO, INS_ATTEST, (uint8_t)slot->ps_slot, 0x00);
@@ -2665,11 +3899,13 @@ piv_read_file(struct piv_token *pt, uint tag, uint8_t **data, size_t *len)
 	errf_t *err;
 	struct apdu *apdu;
 	struct tlv_state *tlv;
+	struct tlv_state tlvs;
+	uint8_t cmd[GET_DATA_CMD_LEN];
 	uint rtag;
 
 	VERIFY(pt->pt_intxn);
 
-	tlv = tlv_init_write();
+	tlv = tlv_init_write_at(&tlvs, cmd, sizeof (cmd));
 	tlv_push(tlv, 0x5C);
 	tlv_write_u8to32(tlv, tag);
 	tlv_pop(tlv);
@@ -2700,8 +3936,8 @@ piv_read_file(struct piv_token *pt, uint tag, uint8_t **data, size_t *len)
 			    "INS_GET_DATA(%x)", tag), pt->pt_rdrname);
 			goto out;
 		}
-		tlv = tlv_init(apdu->a_reply.b_data, apdu->a_reply.b_offset,
-		    apdu->a_reply.b_len);
+		tlv = tlv_init_at(&tlvs, apdu->a_reply.b_data,
+		    apdu->a_reply.b_offset, apdu->a_reply.b_len);
 		if ((err = tlv_read_tag(tlv, &rtag)))
 			goto invdata;
 		if (rtag != 0x53) {
@@ -2755,24 +3991,165 @@ piv_file_data_free(uint8_t *data, size_t len)
  * Towards the end of Appendix A (after table 39 or so) there is some
  * additional text explaining how CertInfo works and compression.
  */
-errf_t *
-piv_read_cert(struct piv_token *pk, enum piv_slotid slotid)
+/*
+ * Decoding a certificate (inflate, d2i_X509, pulling out the public key and
+ * formatting the subject) costs a lot more than reading it, and we tend to
+ * read the same ones over and over (e.g. the agent re-probing its token). So
+ * we keep the decoded results for the last few certs we've seen, keyed on a
+ * hash of the raw GET DATA reply.
+ */
+#define	CERTCACHE_MAX		32
+#define	CERTCACHE_HASHLEN	32
+
+struct certcache_ent {
+	uint8_t cc_hash[CERTCACHE_HASHLEN];
+	uint8_t *cc_der;
+	size_t cc_derlen;
+	X509 *cc_x509;		/* NULL if only seen in compact mode */
+	char *cc_subj;
+	struct sshkey *cc_pubkey;
+	enum piv_alg cc_alg;
+	uint64_t cc_used;
+};
+
+static pthread_mutex_t certcache_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct certcache_ent certcache[CERTCACHE_MAX];
+static uint64_t certcache_clock = 0;
+
+static boolean_t
+certcache_get(const uint8_t *hash, struct piv_slot *pc)
+{
+	struct certcache_ent *cc;
+	boolean_t hit = B_FALSE;
+	uint i;
+
+	VERIFY0(pthread_mutex_lock(&certcache_mtx));
+	for (i = 0; i < CERTCACHE_MAX; ++i) {
+		cc = &certcache[i];
+		if (cc->cc_der == NULL ||
+		    bcmp(cc->cc_hash, hash, CERTCACHE_HASHLEN) != 0)
+			continue;
+		if (sshkey_demote(cc->cc_pubkey, &pc->ps_pubkey) != 0)
+			break;
+		pc->ps_der = malloc(cc->cc_derlen);
+		VERIFY(pc->ps_der != NULL);
+		bcopy(cc->cc_der, pc->ps_der, cc->cc_derlen);
+		pc->ps_derlen = cc->cc_derlen;
+		if (cc->cc_x509 != NULL && !piv_compact_slots) {
+			VERIFY(X509_up_ref(cc->cc_x509) == 1);
+			pc->ps_x509 = cc->cc_x509;
+		}
+		pc->ps_subj = OPENSSL_strdup(cc->cc_subj);
+		VERIFY(pc->ps_subj != NULL);
+		pc->ps_alg = cc->cc_alg;
+		cc->cc_used = ++certcache_clock;
+		hit = B_TRUE;
+		break;
+	}
+	VERIFY0(pthread_mutex_unlock(&certcache_mtx));
+	return (hit);
+}
+
+static void
+certcache_put(const uint8_t *hash, const struct piv_slot *pc)
+{
+	struct certcache_ent *cc, *victim = NULL;
+	struct sshkey *pubkey;
+	uint i;
+
+	if (sshkey_demote(pc->ps_pubkey, &pubkey) != 0)
+		return;
+
+	VERIFY0(pthread_mutex_lock(&certcache_mtx));
+	for (i = 0; i < CERTCACHE_MAX; ++i) {
+		cc = &certcache[i];
+		if (cc->cc_der != NULL &&
+		    bcmp(cc->cc_hash, hash, CERTCACHE_HASHLEN) == 0) {
+			/* Someone else beat us to it. */
+			VERIFY0(pthread_mutex_unlock(&certcache_mtx));
+			sshkey_free(pubkey);
+			return;
+		}
+		if (victim == NULL || cc->cc_der == NULL ||
+		    (victim->cc_der != NULL && cc->cc_used < victim->cc_used))
+			victim = cc;
+	}
+	X509_free(victim->cc_x509);
+	free(victim->cc_der);
+	OPENSSL_free(victim->cc_subj);
+	sshkey_free(victim->cc_pubkey);
+
+	bcopy(hash, victim->cc_hash, CERTCACHE_HASHLEN);
+	victim->cc_der = malloc(pc->ps_derlen);
+	VERIFY(victim->cc_der != NULL);
+	bcopy(pc->ps_der, victim->cc_der, pc->ps_derlen);
+	victim->cc_derlen = pc->ps_derlen;
+	victim->cc_x509 = pc->ps_x509;
+	if (victim->cc_x509 != NULL)
+		VERIFY(X509_up_ref(victim->cc_x509) == 1);
+	victim->cc_subj = OPENSSL_strdup(pc->ps_subj);
+	VERIFY(victim->cc_subj != NULL);
+	victim->cc_pubkey = pubkey;
+	victim->cc_alg = pc->ps_alg;
+	victim->cc_used = ++certcache_clock;
+	VERIFY0(pthread_mutex_unlock(&certcache_mtx));
+}
+
+/*
+ * Finds the slot struct for slotid on the token, or makes a new one. Any
+ * existing cert and key on it are freed, ready to be replaced.
+ */
+static struct piv_slot *
+piv_slot_replace(struct piv_token *pk, enum piv_slotid slotid)
+{
+	struct piv_slot *pc;
+
+	for (pc = pk->pt_slots; pc != NULL; pc = pc->ps_next) {
+		if (pc->ps_slot == slotid)
+			break;
+	}
+	if (pc == NULL) {
+		pc = calloc(1, sizeof (struct piv_slot));
+		VERIFY(pc != NULL);
+		if (pk->pt_last_slot == NULL) {
+			pk->pt_slots = pc;
+		} else {
+			pk->pt_last_slot->ps_next = pc;
+		}
+		pk->pt_last_slot = pc;
+	} else {
+		piv_slot_clear(pc);
+	}
+	pc->ps_slot = slotid;
+	return (pc);
+}
+
+/*
+ * If "quiet" is set, the caller is just going to throw away a NotFoundError
+ * (it's enumerating slots), so an empty slot gets ERRF_NOTFOUND.
+ */
+static errf_t *
+piv_read_cert_common(struct piv_token *pk, enum piv_slotid slotid,
+    boolean_t quiet)
 {
 	errf_t *err;
 	int rv;
 	struct apdu *apdu;
 	struct tlv_state *tlv;
+	struct tlv_state tlvs;
+	uint8_t cmd[GET_DATA_CMD_LEN];
 	uint tag;
-	uint8_t *ptr, *buf = NULL;
+	uint8_t *ptr, *der, *buf = NULL;
 	size_t len = 0;
 	X509 *cert;
-	struct piv_slot *pc;
+	struct piv_slot *pc, cached;
 	EVP_PKEY *pkey;
 	uint8_t certinfo = 0;
+	uint8_t hash[CERTCACHE_HASHLEN];
 
 	VERIFY(pk->pt_intxn == B_TRUE);
 
-	tlv = tlv_init_write();
+	tlv = tlv_init_write_at(&tlvs, cmd, sizeof (cmd));
 	tlv_push(tlv, 0x5C);
 	switch (slotid) {
 	case PIV_SLOT_9A:
@@ -2831,8 +4208,25 @@ piv_read_cert(struct piv_token *pk, enum piv_slotid slotid)
 			    "for slot %02x", slotid), pk->pt_rdrname);
 			goto out;
 		}
-		tlv = tlv_init(apdu->a_reply.b_data, apdu->a_reply.b_offset,
-		    apdu->a_reply.b_len);
+
+		VERIFY0(ssh_digest_memory(SSH_DIGEST_SHA256,
+		    apdu->a_reply.b_data + apdu->a_reply.b_offset,
+		    apdu->a_reply.b_len, hash, sizeof (hash)));
+		bzero(&cached, sizeof (cached));
+		if (certcache_get(hash, &cached)) {
+			pc = piv_slot_replace(pk, slotid);
+			pc->ps_der = cached.ps_der;
+			pc->ps_derlen = cached.ps_derlen;
+			pc->ps_x509 = cached.ps_x509;
+			pc->ps_subj = cached.ps_subj;
+			pc->ps_pubkey = cached.ps_pubkey;
+			pc->ps_alg = cached.ps_alg;
+			err = NULL;
+			goto out;
+		}
+
+		tlv = tlv_init_at(&tlvs, apdu->a_reply.b_data,
+		    apdu->a_reply.b_offset, apdu->a_reply.b_len);
 		if ((err = tlv_read_tag(tlv, &tag)))
 			goto invdata;
 		if (tag != 0x53) {
@@ -2912,6 +4306,7 @@ piv_read_cert(struct piv_token *pk, enum piv_slotid slotid)
 			goto invdata;
 		}
 
+		der = ptr;
 		cert = d2i_X509(NULL, (const uint8_t **)&ptr, len);
 		if (cert == NULL) {
 			make_sslerrf(err, "d2i_X509", "parsing cert %02x",
@@ -2919,29 +4314,14 @@ piv_read_cert(struct piv_token *pk, enum piv_slotid slotid)
 			goto invdata;
 		}
 
+		pc = piv_slot_replace(pk, slotid);
+		pc->ps_derlen = ptr - der;
+		pc->ps_der = malloc(pc->ps_derlen);
+		VERIFY(pc->ps_der != NULL);
+		bcopy(der, pc->ps_der, pc->ps_derlen);
 		free(buf);
 		buf = NULL;
 
-		for (pc = pk->pt_slots; pc != NULL; pc = pc->ps_next) {
-			if (pc->ps_slot == slotid)
-				break;
-		}
-		if (pc == NULL) {
-			pc = calloc(1, sizeof (struct piv_slot));
-			VERIFY(pc != NULL);
-			if (pk->pt_last_slot == NULL) {
-				pk->pt_slots = pc;
-			} else {
-				pk->pt_last_slot->ps_next = pc;
-			}
-			pk->pt_last_slot = pc;
-		} else {
-			OPENSSL_free((void *)pc->ps_subj);
-			X509_free(pc->ps_x509);
-			sshkey_free(pc->ps_pubkey);
-		}
-		pc->ps_slot = slotid;
-		pc->ps_x509 = cert;
 		pc->ps_subj = X509_NAME_oneline(
 		    X509_get_subject_name(cert), NULL, 0);
 		pkey = X509_get_pubkey(cert);
@@ -2949,6 +4329,10 @@ piv_read_cert(struct piv_token *pk, enum piv_slotid slotid)
 		rv = sshkey_from_evp_pkey(pkey, KEY_UNSPEC,
 		    &pc->ps_pubkey);
 		EVP_PKEY_free(pkey);
+		if (piv_compact_slots)
+			X509_free(cert);
+		else
+			pc->ps_x509 = cert;
 		if (rv != 0) {
 			err = ssherrf("sshkey_from_evp_pkey", rv);
 			goto invdata;
@@ -2995,6 +4379,12 @@ piv_read_cert(struct piv_token *pk, enum piv_slotid slotid)
 			    "%s", sshkey_type(pc->ps_pubkey)), pk->pt_rdrname);
 		}
 
+		if (err == NULL)
+			certcache_put(hash, pc);
+
+	} else if (apdu->a_sw == SW_FILE_NOT_FOUND && quiet) {
+		err = ERRF_NOTFOUND;
+
 	} else if (apdu->a_sw == SW_FILE_NOT_FOUND) {
 		err = errf("NotFoundError", swerrf("INS_GET_DATA", apdu->a_sw),
 		    "No certificate found for slot %02x in device '%s'",
@@ -3022,60 +4412,200 @@ out:
 	piv_apdu_free(apdu);
 	return (err);
 
-invdata:
-	err = invderrf(err, pk->pt_rdrname);
-	debug_dump(err, apdu);
-	tlv_abort(tlv);
-	goto out;
-}
+invdata:
+	err = invderrf(err, pk->pt_rdrname);
+	debug_dump(err, apdu);
+	tlv_abort(tlv);
+	goto out;
+}
+
+errf_t *
+piv_read_cert(struct piv_token *pk, enum piv_slotid slotid)
+{
+	return (piv_read_cert_common(pk, slotid, B_FALSE));
+}
+
+static inline int
+read_all_aborts_on(errf_t *err)
+{
+	return (err &&
+	    !errf_caused_by(err, "NotFoundError") &&
+	    !errf_caused_by(err, "PermissionError") &&
+	    !errf_caused_by(err, "NotSupportedError"));
+}
+
+errf_t *
+piv_read_certs(struct piv_token *tk, uint mask)
+{
+	static const struct {
+		uint m;
+		enum piv_slotid s;
+	} std[] = {
+		{ PIV_SLOTMASK_9E, PIV_SLOT_9E },
+		{ PIV_SLOTMASK_9A, PIV_SLOT_9A },
+		{ PIV_SLOTMASK_9C, PIV_SLOT_9C },
+		{ PIV_SLOTMASK_9D, PIV_SLOT_9D },
+	};
+	errf_t *err;
+	uint i;
+
+	VERIFY(tk->pt_intxn == B_TRUE);
+
+	for (i = 0; i < sizeof (std) / sizeof (std[0]); ++i) {
+		if ((mask & std[i].m) == 0)
+			continue;
+		err = piv_read_cert_common(tk, std[i].s, B_TRUE);
+		if (read_all_aborts_on(err))
+			return (err);
+		else if (err)
+			errf_free(err);
+	}
+
+	if ((mask & PIV_SLOTMASK_RETIRED) == 0)
+		return (ERRF_OK);
+
+	for (i = 0; i < piv_token_keyhistory_oncard(tk); ++i) {
+		err = piv_read_cert_common(tk, PIV_SLOT_RETIRED_1 + i,
+		    B_TRUE);
+		if (read_all_aborts_on(err) && !errf_caused_by(err, "APDUError"))
+			return (err);
+		else if (err)
+			errf_free(err);
+	}
+
+	return (ERRF_OK);
+}
+
+errf_t *
+piv_read_all_certs(struct piv_token *tk)
+{
+	return (piv_read_certs(tk, PIV_SLOTMASK_ALL));
+}
+
+#define	PIV_STATE_MAGIC		"piv-token-state"
+#define	PIV_STATE_VERSION	1
+
+static void
+piv_token_change_token(const struct piv_token *tk, struct sshbuf *buf)
+{
+	piv_token_want(tk, PIV_LOADED_KEYHIST | PIV_LOADED_YK);
+	VERIFY0(sshbuf_put(buf, tk->pt_guid, sizeof (tk->pt_guid)));
+	VERIFY0(sshbuf_put_u8(buf, tk->pt_nochuid));
+	VERIFY0(sshbuf_put_u8(buf, tk->pt_signedchuid));
+	VERIFY0(sshbuf_put_string(buf, tk->pt_fascn, tk->pt_fascn_len));
+	VERIFY0(sshbuf_put(buf, tk->pt_expiry, sizeof (tk->pt_expiry)));
+	VERIFY0(sshbuf_put_u8(buf, tk->pt_haschuuid));
+	VERIFY0(sshbuf_put(buf, tk->pt_chuuid, sizeof (tk->pt_chuuid)));
+	VERIFY0(sshbuf_put_u8(buf, tk->pt_hist_oncard));
+	VERIFY0(sshbuf_put_u8(buf, tk->pt_hist_offcard));
+	VERIFY0(sshbuf_put_u8(buf, tk->pt_ykpiv));
+	VERIFY0(sshbuf_put(buf, tk->pt_ykver, sizeof (tk->pt_ykver)));
+	VERIFY0(sshbuf_put_u32(buf, tk->pt_ykserial_valid ?
+	    tk->pt_ykserial : 0));
+}
+
+errf_t *
+piv_token_state_save(const struct piv_token *tk, struct sshbuf *buf)
+{
+	struct sshbuf *chtok;
+	struct piv_slot *slot;
+	uint n = 0;
+	int rc;
+
+	chtok = sshbuf_new();
+	VERIFY(chtok != NULL);
+	piv_token_change_token(tk, chtok);
+
+	for (slot = tk->pt_slots; slot != NULL; slot = slot->ps_next)
+		++n;
+
+	if ((rc = sshbuf_put_cstring(buf, PIV_STATE_MAGIC)) ||
+	    (rc = sshbuf_put_u8(buf, PIV_STATE_VERSION)) ||
+	    (rc = sshbuf_put_stringb(buf, chtok)) ||
+	    (rc = sshbuf_put_u8(buf, n))) {
+		sshbuf_free(chtok);
+		return (ssherrf("sshbuf_put_*", rc));
+	}
+	sshbuf_free(chtok);
+
+	for (slot = tk->pt_slots; slot != NULL; slot = slot->ps_next) {
+		if ((rc = sshbuf_put_u8(buf, slot->ps_slot)) ||
+		    (rc = sshbuf_put_u8(buf, slot->ps_alg)) ||
+		    (rc = sshkey_puts(slot->ps_pubkey, buf)) ||
+		    (rc = sshbuf_put_cstring(buf, slot->ps_subj))) {
+			return (ssherrf("sshbuf_put_*", rc));
+		}
+	}
 
-static inline int
-read_all_aborts_on(errf_t *err)
-{
-	return (err &&
-	    !errf_caused_by(err, "NotFoundError") &&
-	    !errf_caused_by(err, "PermissionError") &&
-	    !errf_caused_by(err, "NotSupportedError"));
+	return (ERRF_OK);
 }
 
 errf_t *
-piv_read_all_certs(struct piv_token *tk)
+piv_token_state_load(struct piv_token *tk, struct sshbuf *buf)
 {
-	errf_t *err;
+	struct sshbuf *chtok = NULL, *want = NULL;
+	struct sshkey *pubkey = NULL;
+	struct piv_slot *slot;
+	char *magic = NULL, *subj = NULL;
+	size_t subjlen;
+	uint8_t ver, n, slotid, alg;
 	uint i;
+	errf_t *err = ERRF_OK;
+	int rc;
 
-	VERIFY(tk->pt_intxn == B_TRUE);
+	if ((rc = sshbuf_get_cstring(buf, &magic, NULL)) ||
+	    (rc = sshbuf_get_u8(buf, &ver)) ||
+	    (rc = sshbuf_froms(buf, &chtok)) ||
+	    (rc = sshbuf_get_u8(buf, &n))) {
+		err = errf("InvalidDataError", ssherrf("sshbuf_get_*", rc),
+		    "failed to parse saved token state header");
+		goto out;
+	}
+	if (strcmp(magic, PIV_STATE_MAGIC) != 0 || ver != PIV_STATE_VERSION) {
+		err = errf("InvalidDataError", NULL, "saved token state has "
+		    "unknown magic or version");
+		goto out;
+	}
 
-	err = piv_read_cert(tk, PIV_SLOT_9E);
-	if (read_all_aborts_on(err))
-		return (err);
-	else if (err)
-		errf_free(err);
-	err = piv_read_cert(tk, PIV_SLOT_9A);
-	if (read_all_aborts_on(err))
-		return (err);
-	else if (err)
-		errf_free(err);
-	err = piv_read_cert(tk, PIV_SLOT_9C);
-	if (read_all_aborts_on(err))
-		return (err);
-	else if (err)
-		errf_free(err);
-	err = piv_read_cert(tk, PIV_SLOT_9D);
-	if (read_all_aborts_on(err))
-		return (err);
-	else if (err)
-		errf_free(err);
+	want = sshbuf_new();
+	VERIFY(want != NULL);
+	piv_token_change_token(tk, want);
+	if (sshbuf_len(chtok) != sshbuf_len(want) ||
+	    bcmp(sshbuf_ptr(chtok), sshbuf_ptr(want), sshbuf_len(want)) != 0) {
+		err = errf("StaleDataError", NULL, "saved token state does "
+		    "not match token %s", piv_token_guid_hex(tk));
+		goto out;
+	}
 
-	for (i = 0; i < tk->pt_hist_oncard; ++i) {
-		err = piv_read_cert(tk, PIV_SLOT_RETIRED_1 + i);
-		if (read_all_aborts_on(err) && !errf_caused_by(err, "APDUError"))
-			return (err);
-		else if (err)
-			errf_free(err);
+	for (i = 0; i < n; ++i) {
+		if ((rc = sshbuf_get_u8(buf, &slotid)) ||
+		    (rc = sshbuf_get_u8(buf, &alg)) ||
+		    (rc = sshkey_froms(buf, &pubkey)) ||
+		    (rc = sshbuf_get_cstring(buf, &subj, &subjlen))) {
+			err = errf("InvalidDataError",
+			    ssherrf("sshbuf_get_*", rc),
+			    "failed to parse saved token state slot %u", i);
+			goto out;
+		}
+		slot = piv_force_slot(tk, slotid, alg);
+		piv_slot_clear(slot);
+		slot->ps_pubkey = pubkey;
+		pubkey = NULL;
+		/* ps_subj is freed with OPENSSL_free, see piv_release() */
+		slot->ps_subj = OPENSSL_malloc(subjlen + 1);
+		VERIFY(slot->ps_subj != NULL);
+		bcopy(subj, (char *)slot->ps_subj, subjlen + 1);
+		free(subj);
+		subj = NULL;
 	}
 
-	return (ERRF_OK);
+out:
+	sshkey_free(pubkey);
+	sshbuf_free(chtok);
+	sshbuf_free(want);
+	free(magic);
+	free(subj);
+	return (err);
 }
 
 /*
@@ -3225,7 +4755,7 @@ ykpiv_reset(struct piv_token *pt)
 	struct apdu *apdu;
 
 	VERIFY(pt->pt_intxn);
-	if (!pt->pt_ykpiv)
+	if (!piv_token_is_ykpiv(pt))
 		return (argerrf("tk", "a YubicoPIV-compatible token", "not"));
 
 	apdu = piv_apdu_make(CLA_ISO, INS_RESET, 0, 0);
@@ -3270,7 +4800,7 @@ ykpiv_set_pin_retries(struct piv_token *pk, uint pintries, uint puktries)
 	struct apdu *apdu;
 
 	VERIFY(pk->pt_intxn);
-	if (!pk->pt_ykpiv)
+	if (!piv_token_is_ykpiv(pk))
 		return (argerrf("tk", "a YubicoPIV-compatible token", "not"));
 
 	apdu = piv_apdu_make(CLA_ISO, INS_SET_PIN_RETRIES, pintries, puktries);
@@ -3319,7 +4849,7 @@ ykpiv_set_admin(struct piv_token *pk, const uint8_t *key, size_t keylen,
 	uint p2;
 
 	VERIFY(pk->pt_intxn);
-	if (!pk->pt_ykpiv) {
+	if (!piv_token_is_ykpiv(pk)) {
 		return (argerrf("tk", "a YubicoPIV-compatible PIV token",
 		    "not"));
 	}
@@ -3381,8 +4911,8 @@ ykpiv_set_admin(struct piv_token *pk, const uint8_t *key, size_t keylen,
 	return (err);
 }
 
-errf_t *
-piv_verify_pin(struct piv_token *pk, enum piv_pin type, const char *pin,
+static errf_t *
+piv_verify_pin_impl(struct piv_token *pk, enum piv_pin type, const char *pin,
     uint *retries, boolean_t canskip)
 {
 	errf_t *err;
@@ -3569,6 +5099,102 @@ piv_verify_pin(struct piv_token *pk, enum piv_pin type, const char *pin,
 	return (err);
 }
 
+errf_t *
+piv_verify_pin(struct piv_token *pk, enum piv_pin type, const char *pin,
+    uint *retries, boolean_t canskip)
+{
+	errf_t *err;
+
+	PIVY_PROBE2(pin__verify__start, pk->pt_guid, (uint)type);
+	err = piv_verify_pin_impl(pk, type, pin, retries, canskip);
+	PIVY_PROBE3(pin__verify__done, pk->pt_guid, (uint)type,
+	    (int)(err == ERRF_OK));
+	return (err);
+}
+
+/*
+ * Signs a digest that has already been placed at the start of "buf" (which is
+ * "inplen" bytes long, the size of the key). For RSA keys this builds the
+ * PKCS#1 padded DigestInfo around it in place first.
+ */
+static errf_t *
+piv_sign_digest_buf(struct piv_token *tk, struct piv_slot *slot,
+    enum sshdigest_types hashalgo, uint8_t *buf, size_t inplen, size_t dglen,
+    uint8_t **signature, size_t *siglen)
+{
+	size_t nread;
+
+	/*
+	 * If it's an RSA signature, we have to generate the PKCS#1 style
+	 * padded signing blob around the hash.
+	 *
+	 * ECDSA is so much nicer than this. Why can't we just use it? Oh,
+	 * because Java ruined everything. Right.
+	 */
+	if (slot->ps_alg == PIV_ALG_RSA1024 ||
+	    slot->ps_alg == PIV_ALG_RSA2048) {
+		int nid;
+		/*
+		 * Roll up your sleeves, folks, we're going in (to the dank
+		 * and musty corners of OpenSSL where few dare tread)
+		 */
+		X509_SIG digestInfo;
+		X509_ALGOR algor;
+		ASN1_TYPE parameter;
+		ASN1_OCTET_STRING digest;
+		uint8_t *tmp, *out;
+
+		tmp = calloc(1, inplen);
+		VERIFY(tmp != NULL);
+		out = NULL;
+
+		/*
+		 * XXX: I thought this should be sha256WithRSAEncryption (etc)
+		 *      rather than just NID_sha256 but that doesn't work
+		 */
+		switch (hashalgo) {
+		case SSH_DIGEST_SHA1:
+			nid = NID_sha1;
+			break;
+		case SSH_DIGEST_SHA256:
+			nid = NID_sha256;
+			break;
+		case SSH_DIGEST_SHA512:
+			nid = NID_sha512;
+			break;
+		default:
+			VERIFY(0);
+			nid = -1;
+		}
+		bcopy(buf, tmp, dglen);
+		digestInfo.algor = &algor;
+		digestInfo.algor->algorithm = OBJ_nid2obj(nid);
+		digestInfo.algor->parameter = &parameter;
+		digestInfo.algor->parameter->type = V_ASN1_NULL;
+		digestInfo.algor->parameter->value.ptr = NULL;
+		digestInfo.digest = &digest;
+		digestInfo.digest->data = tmp;
+		digestInfo.digest->length = (int)dglen;
+		nread = i2d_X509_SIG(&digestInfo, &out);
+
+		/*
+		 * There is another undocumented openssl function that does
+		 * this padding bit, but eh.
+		 */
+		memset(buf, 0xFF, inplen);
+		buf[0] = 0x00;
+		/* The second byte is the block type -- 0x01 here means 0xFF */
+		buf[1] = 0x01;
+		buf[inplen - nread - 1] = 0x00;
+		bcopy(out, buf + (inplen - nread), nread);
+
+		free(tmp);
+		OPENSSL_free(out);
+	}
+
+	return (piv_sign_prehash(tk, slot, buf, inplen, signature, siglen));
+}
+
 errf_t *
 piv_sign(struct piv_token *tk, struct piv_slot *slot, const uint8_t *data,
     size_t datalen, enum sshdigest_types *hashalgo, uint8_t **signature,
@@ -3578,7 +5204,7 @@ piv_sign(struct piv_token *tk, struct piv_slot *slot, const uint8_t *data,
 	errf_t *err;
 	struct ssh_digest_ctx *hctx;
 	uint8_t *buf;
-	size_t nread, dglen, inplen;
+	size_t dglen, inplen;
 	boolean_t cardhash = B_FALSE, ch_sha256 = B_FALSE, ch_sha384 = B_FALSE;
 	enum piv_alg oldalg;
 
@@ -3728,83 +5354,174 @@ piv_sign(struct piv_token *tk, struct piv_slot *slot, const uint8_t *data,
 		inplen = datalen;
 	}
 
-	/*
-	 * If it's an RSA signature, we have to generate the PKCS#1 style
-	 * padded signing blob around the hash.
-	 *
-	 * ECDSA is so much nicer than this. Why can't we just use it? Oh,
-	 * because Java ruined everything. Right.
-	 */
-	if (slot->ps_alg == PIV_ALG_RSA1024 ||
-	    slot->ps_alg == PIV_ALG_RSA2048) {
-		int nid;
-		/*
-		 * Roll up your sleeves, folks, we're going in (to the dank
-		 * and musty corners of OpenSSL where few dare tread)
-		 */
-		X509_SIG digestInfo;
-		X509_ALGOR algor;
-		ASN1_TYPE parameter;
-		ASN1_OCTET_STRING digest;
-		uint8_t *tmp, *out;
+	err = piv_sign_digest_buf(tk, slot, *hashalgo, buf, inplen, dglen,
+	    signature, siglen);
 
-		tmp = calloc(1, inplen);
-		VERIFY(tmp != NULL);
-		out = NULL;
+	if (!cardhash)
+		free(buf);
 
-		/*
-		 * XXX: I thought this should be sha256WithRSAEncryption (etc)
-		 *      rather than just NID_sha256 but that doesn't work
-		 */
-		switch (*hashalgo) {
-		case SSH_DIGEST_SHA1:
-			nid = NID_sha1;
-			break;
-		case SSH_DIGEST_SHA256:
-			nid = NID_sha256;
+	if (cardhash)
+		slot->ps_alg = oldalg;
+
+	return (err);
+}
+
+/*
+ * Whether the card only does ECDSA with "alg" by hashing on-card (see the
+ * PivApplet comments in piv_sign()).
+ */
+static boolean_t
+piv_alg_cardhash(const struct piv_token *tk, enum piv_alg alg)
+{
+	int i;
+
+	for (i = 0; i < tk->pt_alg_count; ++i) {
+		switch (tk->pt_algs[i]) {
+		case PIV_ALG_ECCP256_SHA1:
+		case PIV_ALG_ECCP256_SHA256:
+			if (alg == PIV_ALG_ECCP256)
+				return (B_TRUE);
 			break;
-		case SSH_DIGEST_SHA512:
-			nid = NID_sha512;
+		case PIV_ALG_ECCP384_SHA1:
+		case PIV_ALG_ECCP384_SHA256:
+		case PIV_ALG_ECCP384_SHA384:
+			if (alg == PIV_ALG_ECCP384)
+				return (B_TRUE);
 			break;
 		default:
-			VERIFY(0);
-			nid = -1;
+			break;
 		}
-		bcopy(buf, tmp, dglen);
-		digestInfo.algor = &algor;
-		digestInfo.algor->algorithm = OBJ_nid2obj(nid);
-		digestInfo.algor->parameter = &parameter;
-		digestInfo.algor->parameter->type = V_ASN1_NULL;
-		digestInfo.algor->parameter->value.ptr = NULL;
-		digestInfo.digest = &digest;
-		digestInfo.digest->data = tmp;
-		digestInfo.digest->length = (int)dglen;
-		nread = i2d_X509_SIG(&digestInfo, &out);
+	}
+	return (B_FALSE);
+}
 
-		/*
-		 * There is another undocumented openssl function that does
-		 * this padding bit, but eh.
-		 */
-		memset(buf, 0xFF, inplen);
-		buf[0] = 0x00;
-		/* The second byte is the block type -- 0x01 here means 0xFF */
-		buf[1] = 0x01;
-		buf[inplen - nread - 1] = 0x00;
-		bcopy(out, buf + (inplen - nread), nread);
+errf_t *
+piv_sign_digest_alg(struct piv_token *tk, struct piv_slot *slot,
+    enum sshdigest_types *hashalgo)
+{
+	switch (slot->ps_alg) {
+	case PIV_ALG_RSA1024:
+	case PIV_ALG_RSA2048:
+	case PIV_ALG_ECCP256:
+		*hashalgo = SSH_DIGEST_SHA256;
+		break;
+	case PIV_ALG_ECCP384:
+		*hashalgo = SSH_DIGEST_SHA384;
+		break;
+	default:
+		return (errf("NotSupportedError", NULL, "Unsupported key "
+		    "algorithm used in slot %x (%d) of PIV device '%s'",
+		    slot->ps_slot, slot->ps_alg, tk->pt_rdrname));
+	}
+	if (piv_alg_cardhash(tk, slot->ps_alg)) {
+		return (errf("NotSupportedError", NULL, "PIV device '%s' can "
+		    "only sign with slot %x by hashing the data on the card",
+		    tk->pt_rdrname, slot->ps_slot));
+	}
+	return (ERRF_OK);
+}
 
-		free(tmp);
-		OPENSSL_free(out);
+errf_t *
+piv_sign_digest(struct piv_token *tk, struct piv_slot *slot,
+    enum sshdigest_types hashalgo, const uint8_t *digest, size_t dglen,
+    uint8_t **signature, size_t *siglen)
+{
+	errf_t *err;
+	uint8_t *buf;
+	size_t inplen;
+	boolean_t ok;
+
+	VERIFY(tk->pt_intxn);
+
+	/* The same hashes piv_sign() will use for each key type. */
+	switch (slot->ps_alg) {
+	case PIV_ALG_RSA1024:
+		inplen = 128;
+		ok = (hashalgo == SSH_DIGEST_SHA1 ||
+		    hashalgo == SSH_DIGEST_SHA256);
+		break;
+	case PIV_ALG_RSA2048:
+		inplen = 256;
+		ok = (hashalgo == SSH_DIGEST_SHA1 ||
+		    hashalgo == SSH_DIGEST_SHA256 ||
+		    hashalgo == SSH_DIGEST_SHA512);
+		break;
+	case PIV_ALG_ECCP256:
+		inplen = 32;
+		ok = (hashalgo == SSH_DIGEST_SHA1 ||
+		    hashalgo == SSH_DIGEST_SHA256);
+		break;
+	case PIV_ALG_ECCP384:
+		inplen = 48;
+		ok = (hashalgo == SSH_DIGEST_SHA1 ||
+		    hashalgo == SSH_DIGEST_SHA256 ||
+		    hashalgo == SSH_DIGEST_SHA384);
+		break;
+	default:
+		return (errf("NotSupportedError", NULL, "Unsupported key "
+		    "algorithm used in slot %x (%d) of PIV device '%s'",
+		    slot->ps_slot, slot->ps_alg, tk->pt_rdrname));
 	}
+	if (!ok) {
+		return (errf("ArgumentError", NULL, "Hash algorithm %s can't "
+		    "be used with the key in slot %x",
+		    ssh_digest_alg_name(hashalgo), slot->ps_slot));
+	}
+	if (dglen != ssh_digest_bytes(hashalgo)) {
+		return (argerrf("dglen", "the length of a %s digest",
+		    "%zu bytes", ssh_digest_alg_name(hashalgo), dglen));
+	}
+	if (piv_alg_cardhash(tk, slot->ps_alg)) {
+		return (errf("NotSupportedError", NULL, "PIV device '%s' can "
+		    "only sign with slot %x by hashing the data on the card",
+		    tk->pt_rdrname, slot->ps_slot));
+	}
+
+	buf = calloc(1, inplen);
+	VERIFY(buf != NULL);
+	bcopy(digest, buf, dglen);
+	err = piv_sign_digest_buf(tk, slot, hashalgo, buf, inplen, dglen,
+	    signature, siglen);
+	free(buf);
 
-	err = piv_sign_prehash(tk, slot, buf, inplen, signature, siglen);
+	return (err);
+}
 
-	if (!cardhash)
-		free(buf);
+errf_t *
+piv_sign_batch(struct piv_token *tk, struct piv_slot *slot,
+    struct piv_sign_item *items, size_t n)
+{
+	struct piv_sign_item *it;
+	size_t i, failed;
+
+	VERIFY(tk->pt_intxn);
 
-	if (cardhash)
-		slot->ps_alg = oldalg;
+	for (i = 0; i < n; ++i) {
+		it = &items[i];
+		it->psi_sig = NULL;
+		it->psi_siglen = 0;
+		it->psi_err = piv_sign(tk, slot, it->psi_data, it->psi_datalen,
+		    &it->psi_hashalgo, &it->psi_sig, &it->psi_siglen);
+		if (!errf_caused_by(it->psi_err, "IOError"))
+			continue;
+		/*
+		 * If we can't talk to the card any more there's no point
+		 * trying the rest: they'll all fail the same way (and slowly).
+		 */
+		failed = i;
+		for (++i; i < n; ++i) {
+			items[i].psi_sig = NULL;
+			items[i].psi_siglen = 0;
+			items[i].psi_err = errf("BatchAbortedError", NULL,
+			    "Not attempted: item %zu of the batch failed with "
+			    "an I/O error", failed);
+		}
+		return (errf("BatchAbortedError", NULL, "Signing batch "
+		    "aborted at item %zu of %zu after an I/O error", failed,
+		    n));
+	}
 
-	return (err);
+	return (ERRF_OK);
 }
 
 errf_t *
@@ -3814,6 +5531,7 @@ piv_sign_prehash(struct piv_token *pk, struct piv_slot *pc,
 	errf_t *err;
 	struct apdu *apdu;
 	struct tlv_state *tlv;
+	struct tlv_state tlvs;
 	uint tag;
 	uint8_t *buf = NULL;
 
@@ -3848,8 +5566,8 @@ piv_sign_prehash(struct piv_token *pk, struct piv_slot *pc,
 	if (apdu->a_sw == SW_NO_ERROR ||
 	    (apdu->a_sw & 0xFF00) == SW_WARNING_NO_CHANGE_00 ||
 	    (apdu->a_sw & 0xFF00) == SW_WARNING_00) {
-		tlv = tlv_init(apdu->a_reply.b_data, apdu->a_reply.b_offset,
-		    apdu->a_reply.b_len);
+		tlv = tlv_init_at(&tlvs, apdu->a_reply.b_data,
+		    apdu->a_reply.b_offset, apdu->a_reply.b_len);
 		if ((err = tlv_read_tag(tlv, &tag)))
 			goto invdata;
 		if (tag != 0x7C) {
@@ -3913,6 +5631,7 @@ piv_ecdh(struct piv_token *pk, struct piv_slot *slot, struct sshkey *pubkey,
 	errf_t *err;
 	struct apdu *apdu;
 	struct tlv_state *tlv;
+	struct tlv_state tlvs;
 	uint tag;
 	uint8_t *buf = NULL;
 	struct sshbuf *sbuf;
@@ -3960,8 +5679,8 @@ piv_ecdh(struct piv_token *pk, struct piv_slot *slot, struct sshkey *pubkey,
 	if (apdu->a_sw == SW_NO_ERROR ||
 	    (apdu->a_sw & 0xFF00) == SW_WARNING_NO_CHANGE_00 ||
 	    (apdu->a_sw & 0xFF00) == SW_WARNING_00) {
-		tlv = tlv_init(apdu->a_reply.b_data, apdu->a_reply.b_offset,
-		    apdu->a_reply.b_len);
+		tlv = tlv_init_at(&tlvs, apdu->a_reply.b_data,
+		    apdu->a_reply.b_offset, apdu->a_reply.b_len);
 		if ((err = tlv_read_tag(tlv, &tag)))
 			goto invdata;
 		if (tag != 0x7C) {
@@ -4057,11 +5776,16 @@ piv_box_clone(const struct piv_ecdh_box *box)
 		bcopy(box->pdb_nonce.b_data + box->pdb_nonce.b_offset,
 		    nbox->pdb_nonce.b_data, box->pdb_nonce.b_len);
 	}
+	/*
+	 * The IV is zero-length for chacha20-poly1305, but piv_box_open()
+	 * still wants a buffer there (as sshbuf_get_piv_box() would leave
+	 * it), so always allocate one.
+	 */
+	nbox->pdb_iv.b_data = malloc(box->pdb_iv.b_len + 1);
+	if (nbox->pdb_iv.b_data == NULL)
+		goto err;
+	nbox->pdb_iv.b_len = (nbox->pdb_iv.b_size = box->pdb_iv.b_len);
 	if (box->pdb_iv.b_len > 0) {
-		nbox->pdb_iv.b_data = malloc(box->pdb_iv.b_len);
-		if (nbox->pdb_iv.b_data == NULL)
-			goto err;
-		nbox->pdb_iv.b_len = (nbox->pdb_iv.b_size = box->pdb_iv.b_len);
 		bcopy(box->pdb_iv.b_data + box->pdb_iv.b_offset,
 		    nbox->pdb_iv.b_data, box->pdb_iv.b_len);
 	}
@@ -4106,7 +5830,7 @@ piv_box_free(struct piv_ecdh_box *box)
 	free(box->pdb_nonce.b_data);
 	free(box->pdb_guidhex);
 	if (box->pdb_plain.b_data != NULL) {
-		freezero(box->pdb_plain.b_data, box->pdb_plain.b_size);
+		freezero_conceal(box->pdb_plain.b_data, box->pdb_plain.b_size);
 	}
 	free(box);
 }
@@ -4163,7 +5887,7 @@ piv_box_take_data(struct piv_ecdh_box *box, uint8_t **data, size_t *len)
 	*len = box->pdb_plain.b_len;
 	bcopy(box->pdb_plain.b_data + box->pdb_plain.b_offset, *data, *len);
 
-	freezero(box->pdb_plain.b_data, box->pdb_plain.b_size);
+	freezero_conceal(box->pdb_plain.b_data, box->pdb_plain.b_size);
 	box->pdb_plain.b_data = NULL;
 	box->pdb_plain.b_size = 0;
 	box->pdb_plain.b_len = 0;
@@ -4186,7 +5910,7 @@ piv_box_take_datab(struct piv_ecdh_box *box, struct sshbuf **pbuf)
 	sshbuf_put(buf, box->pdb_plain.b_data + box->pdb_plain.b_offset,
 	    box->pdb_plain.b_len);
 
-	freezero(box->pdb_plain.b_data, box->pdb_plain.b_size);
+	freezero_conceal(box->pdb_plain.b_data, box->pdb_plain.b_size);
 	box->pdb_plain.b_data = NULL;
 	box->pdb_plain.b_size = 0;
 	box->pdb_plain.b_len = 0;
@@ -4205,7 +5929,7 @@ piv_box_open_offline(struct sshkey *privkey, struct piv_ecdh_box *box)
 	struct sshcipher_ctx *cctx;
 	struct ssh_digest_ctx *dgctx;
 	uint8_t *iv, *key, *sec, *enc, *plain;
-	size_t ivlen, authlen, blocksz, keylen, dglen, seclen;
+	size_t ivlen, authlen, blocksz, keylen, dglen, seclen, secsz;
 	size_t fieldsz, plainlen, enclen;
 	size_t reallen, padding, i;
 	errf_t *err;
@@ -4243,17 +5967,18 @@ piv_box_open_offline(struct sshkey *privkey, struct piv_ecdh_box *box)
 
 	fieldsz = EC_GROUP_get_degree(EC_KEY_get0_group(privkey->ecdsa));
 	seclen = (fieldsz + 7) / 8;
-	sec = calloc_conceal(1, seclen);
+	sec = zalloc_conceal(seclen);
 	VERIFY(sec != NULL);
 	rv = ECDH_compute_key(sec, seclen,
 	    EC_KEY_get0_public_key(box->pdb_ephem_pub->ecdsa), privkey->ecdsa,
 	    NULL);
 	if (rv <= 0) {
-		free(sec);
+		freezero_conceal(sec, seclen);
 		make_sslerrf(err, "ECDH_compute_key", "performing ECDH");
 		err = boxderrf(err);
 		return (err);
 	}
+	secsz = seclen;
 	seclen = (size_t)rv;
 
 	dgctx = ssh_digest_start(dgalg);
@@ -4274,12 +5999,12 @@ piv_box_open_offline(struct sshkey *privkey, struct piv_ecdh_box *box)
 		VERIFY0(ssh_digest_update(dgctx, box->pdb_nonce.b_data +
 		    box->pdb_nonce.b_offset, box->pdb_nonce.b_len));
 	}
-	key = calloc_conceal(1, dglen);
+	key = zalloc_conceal(dglen);
 	VERIFY3P(key, !=, NULL);
 	VERIFY0(ssh_digest_final(dgctx, key, dglen));
 	ssh_digest_free(dgctx);
 
-	freezero(sec, seclen);
+	freezero_conceal(sec, secsz);
 
 	VERIFYB(box->pdb_iv);
 	iv = box->pdb_iv.b_data + box->pdb_iv.b_offset;
@@ -4300,7 +6025,7 @@ piv_box_open_offline(struct sshkey *privkey, struct piv_ecdh_box *box)
 	}
 
 	plainlen = enclen - authlen;
-	plain = calloc_conceal(1, plainlen);
+	plain = zalloc_conceal(plainlen);
 	VERIFY3P(plain, !=, NULL);
 
 	VERIFY0(cipher_init(&cctx, cipher, key, keylen, iv, ivlen, 0));
@@ -4308,9 +6033,10 @@ piv_box_open_offline(struct sshkey *privkey, struct piv_ecdh_box *box)
 	    authlen);
 	cipher_free(cctx);
 
-	freezero(key, dglen);
+	freezero_conceal(key, dglen);
 
 	if (rv != 0) {
+		freezero_conceal(plain, plainlen);
 		err = boxderrf(ssherrf("cipher_crypt", rv));
 		return (err);
 	}
@@ -4327,7 +6053,7 @@ piv_box_open_offline(struct sshkey *privkey, struct piv_ecdh_box *box)
 	}
 
 	if (box->pdb_plain.b_data != NULL) {
-		freezero(box->pdb_plain.b_data, box->pdb_plain.b_size);
+		freezero_conceal(box->pdb_plain.b_data, box->pdb_plain.b_size);
 	}
 	box->pdb_plain.b_data = plain;
 	box->pdb_plain.b_size = plainlen;
@@ -4338,7 +6064,7 @@ piv_box_open_offline(struct sshkey *privkey, struct piv_ecdh_box *box)
 
 paderr:
 	err = boxderrf(errf("PaddingError", NULL, "Padding failed validation"));
-	freezero(plain, plainlen);
+	freezero_conceal(plain, plainlen);
 	return (err);
 }
 
@@ -4406,7 +6132,7 @@ piv_box_open(struct piv_token *tk, struct piv_slot *slot,
 		VERIFY0(ssh_digest_update(dgctx, box->pdb_nonce.b_data +
 		    box->pdb_nonce.b_offset, box->pdb_nonce.b_len));
 	}
-	key = calloc_conceal(1, dglen);
+	key = zalloc_conceal(dglen);
 	VERIFY3P(key, !=, NULL);
 	VERIFY0(ssh_digest_final(dgctx, key, dglen));
 	ssh_digest_free(dgctx);
@@ -4432,7 +6158,7 @@ piv_box_open(struct piv_token *tk, struct piv_slot *slot,
 	}
 
 	plainlen = enclen - authlen;
-	plain = calloc_conceal(1, plainlen);
+	plain = zalloc_conceal(plainlen);
 	VERIFY3P(plain, !=, NULL);
 
 	VERIFY0(cipher_init(&cctx, cipher, key, keylen, iv, ivlen, 0));
@@ -4440,9 +6166,10 @@ piv_box_open(struct piv_token *tk, struct piv_slot *slot,
 	    authlen);
 	cipher_free(cctx);
 
-	freezero(key, dglen);
+	freezero_conceal(key, dglen);
 
 	if (rv != 0) {
+		freezero_conceal(plain, plainlen);
 		err = boxderrf(ssherrf("cipher_crypt", rv));
 		return (err);
 	}
@@ -4459,7 +6186,7 @@ piv_box_open(struct piv_token *tk, struct piv_slot *slot,
 	}
 
 	if (box->pdb_plain.b_data != NULL) {
-		freezero(box->pdb_plain.b_data, box->pdb_plain.b_size);
+		freezero_conceal(box->pdb_plain.b_data, box->pdb_plain.b_size);
 	}
 	box->pdb_plain.b_data = plain;
 	box->pdb_plain.b_offset = 0;
@@ -4470,10 +6197,330 @@ piv_box_open(struct piv_token *tk, struct piv_slot *slot,
 
 paderr:
 	err = boxderrf(errf("PaddingError", NULL, "Padding failed validation"));
-	freezero(plain, plainlen);
+	freezero_conceal(plain, plainlen);
 	return (err);
 }
 
+/*
+ * The ephemeral key pool (see piv_box_ephem_pool_start()). Each pooled key is
+ * kept only as its raw private scalar and public point, in the concealed
+ * arena, and is turned back into an sshkey (without any EC scalar mult) as
+ * it's handed out.
+ */
+#define	EPHEM_MAX_PRIV	66	/* P-521 */
+#define	EPHEM_MAX_PUB	(1 + 2 * EPHEM_MAX_PRIV)
+
+struct ephem_ent {
+	uint8_t		pe_priv[EPHEM_MAX_PRIV];
+	size_t		pe_privlen;
+	uint8_t		pe_pub[EPHEM_MAX_PUB];
+	size_t		pe_publen;
+};
+
+struct ephem_curve {
+	uint		 epc_bits;
+	int		 epc_nid;
+	/*
+	 * We only fill curves that something has actually asked for, so the
+	 * thread doesn't sit making P-521 keys no-one will use.
+	 */
+	boolean_t	 epc_wanted;
+	uint		 epc_n;
+	struct ephem_ent **epc_ents;
+};
+
+static pthread_mutex_t ephem_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ephem_cv = PTHREAD_COND_INITIALIZER;
+static pthread_once_t ephem_atfork_once = PTHREAD_ONCE_INIT;
+static pthread_t ephem_thread;
+static boolean_t ephem_running = B_FALSE;
+static boolean_t ephem_stop = B_FALSE;
+static uint ephem_depth = 0;
+static struct ephem_curve ephem_curves[] = {
+	{ 256, NID_X9_62_prime256v1 },
+	{ 384, NID_secp384r1 },
+	{ 521, NID_secp521r1 },
+};
+#define	EPHEM_NCURVES	\
+    (sizeof (ephem_curves) / sizeof (ephem_curves[0]))
+
+static struct ephem_curve *
+ephem_curve_for_bits(uint bits)
+{
+	uint i;
+	for (i = 0; i < EPHEM_NCURVES; ++i) {
+		if (ephem_curves[i].epc_bits == bits)
+			return (&ephem_curves[i]);
+	}
+	return (NULL);
+}
+
+static struct ephem_ent *
+ephem_ent_make(const struct ephem_curve *epc)
+{
+	struct ephem_ent *ent;
+	struct sshkey *k;
+	const EC_KEY *ec;
+	const BIGNUM *priv;
+	int rv;
+
+	if (sshkey_generate(KEY_ECDSA, epc->epc_bits, &k) != 0)
+		return (NULL);
+	ec = k->ecdsa;
+	priv = EC_KEY_get0_private_key(ec);
+
+	ent = zalloc_conceal(sizeof (struct ephem_ent));
+	VERIFY(ent != NULL);
+	ent->pe_privlen = (EC_GROUP_get_degree(EC_KEY_get0_group(ec)) + 7) / 8;
+	VERIFY3U(ent->pe_privlen, <=, sizeof (ent->pe_priv));
+	rv = BN_bn2binpad(priv, ent->pe_priv, ent->pe_privlen);
+	VERIFY3S(rv, ==, ent->pe_privlen);
+	ent->pe_publen = EC_POINT_point2oct(EC_KEY_get0_group(ec),
+	    EC_KEY_get0_public_key(ec), POINT_CONVERSION_UNCOMPRESSED,
+	    ent->pe_pub, sizeof (ent->pe_pub), NULL);
+	VERIFY(ent->pe_publen > 0);
+
+	sshkey_free(k);
+	return (ent);
+}
+
+static struct sshkey *
+ephem_ent_take(const struct ephem_curve *epc, struct ephem_ent *ent)
+{
+	struct sshkey *k;
+	const EC_GROUP *g;
+	BIGNUM *priv;
+	EC_POINT *pub;
+
+	k = sshkey_new(KEY_ECDSA);
+	VERIFY(k != NULL);
+	k->ecdsa_nid = epc->epc_nid;
+	k->ecdsa = EC_KEY_new_by_curve_name(epc->epc_nid);
+	VERIFY(k->ecdsa != NULL);
+	EC_KEY_set_asn1_flag(k->ecdsa, OPENSSL_EC_NAMED_CURVE);
+	g = EC_KEY_get0_group(k->ecdsa);
+
+	priv = BN_bin2bn(ent->pe_priv, ent->pe_privlen, NULL);
+	VERIFY(priv != NULL);
+	VERIFY3S(EC_KEY_set_private_key(k->ecdsa, priv), ==, 1);
+	BN_clear_free(priv);
+
+	pub = EC_POINT_new(g);
+	VERIFY(pub != NULL);
+	VERIFY3S(EC_POINT_oct2point(g, pub, ent->pe_pub, ent->pe_publen,
+	    NULL), ==, 1);
+	VERIFY3S(EC_KEY_set_public_key(k->ecdsa, pub), ==, 1);
+	EC_POINT_free(pub);
+
+	freezero_conceal(ent, sizeof (struct ephem_ent));
+	return (k);
+}
+
+static void *
+ephem_pool_thread(void *arg)
+{
+	struct ephem_curve *epc;
+	struct ephem_ent *ent;
+	uint i;
+
+	VERIFY0(pthread_mutex_lock(&ephem_mtx));
+	while (!ephem_stop) {
+		/* Top up whichever wanted curve is emptiest first. */
+		epc = NULL;
+		for (i = 0; i < EPHEM_NCURVES; ++i) {
+			struct ephem_curve *c = &ephem_curves[i];
+			if (!c->epc_wanted || c->epc_n >= ephem_depth)
+				continue;
+			if (epc == NULL || c->epc_n < epc->epc_n)
+				epc = c;
+		}
+		if (epc == NULL) {
+			VERIFY0(pthread_cond_wait(&ephem_cv, &ephem_mtx));
+			continue;
+		}
+
+		VERIFY0(pthread_mutex_unlock(&ephem_mtx));
+		ent = ephem_ent_make(epc);
+		VERIFY0(pthread_mutex_lock(&ephem_mtx));
+
+		if (ent == NULL) {
+			bunyan_log(BNY_WARN, "failed to generate pooled "
+			    "ephemeral key, stopping pool",
+			    "bits", BNY_UINT, epc->epc_bits, NULL);
+			break;
+		}
+		if (ephem_stop || epc->epc_n >= ephem_depth) {
+			freezero_conceal(ent, sizeof (struct ephem_ent));
+			continue;
+		}
+		epc->epc_ents[epc->epc_n++] = ent;
+	}
+	VERIFY0(pthread_mutex_unlock(&ephem_mtx));
+	return (arg);
+}
+
+/*
+ * Across fork() we hold ephem_mtx, so that the child gets the pool in a
+ * consistent state. The child must never hand out the same keys as the
+ * parent, though, and it has no pool thread, so it wipes the lot and turns
+ * the pool off. This can't use freezero_conceal(), since some other thread
+ * may have held conceal_mtx at the time of the fork (the slots just leak).
+ */
+static void
+ephem_atfork_prepare(void)
+{
+	VERIFY0(pthread_mutex_lock(&ephem_mtx));
+}
+
+static void
+ephem_atfork_parent(void)
+{
+	VERIFY0(pthread_mutex_unlock(&ephem_mtx));
+}
+
+static void
+ephem_atfork_child(void)
+{
+	struct ephem_curve *epc;
+	uint i, j;
+
+	for (i = 0; i < EPHEM_NCURVES; ++i) {
+		epc = &ephem_curves[i];
+		for (j = 0; j < epc->epc_n; ++j) {
+			explicit_bzero(epc->epc_ents[j],
+			    sizeof (struct ephem_ent));
+			epc->epc_ents[j] = NULL;
+		}
+		epc->epc_n = 0;
+		epc->epc_wanted = B_FALSE;
+	}
+	ephem_depth = 0;
+	ephem_running = B_FALSE;
+	ephem_stop = B_FALSE;
+	VERIFY0(pthread_cond_init(&ephem_cv, NULL));
+	VERIFY0(pthread_mutex_unlock(&ephem_mtx));
+}
+
+static void
+ephem_atfork_register(void)
+{
+	VERIFY0(pthread_atfork(ephem_atfork_prepare, ephem_atfork_parent,
+	    ephem_atfork_child));
+}
+
+errf_t *
+piv_box_ephem_pool_start(uint depth)
+{
+	uint i;
+	int rv;
+
+	if (depth == 0)
+		return (argerrf("depth", "at least 1", "%u", depth));
+
+	VERIFY0(pthread_once(&ephem_atfork_once, ephem_atfork_register));
+
+	VERIFY0(pthread_mutex_lock(&ephem_mtx));
+	if (ephem_running) {
+		VERIFY0(pthread_mutex_unlock(&ephem_mtx));
+		return (errf("AlreadyRunningError", NULL, "ephemeral key pool "
+		    "has already been started"));
+	}
+	for (i = 0; i < EPHEM_NCURVES; ++i) {
+		ephem_curves[i].epc_ents = calloc(depth,
+		    sizeof (struct ephem_ent *));
+		VERIFY(ephem_curves[i].epc_ents != NULL);
+		ephem_curves[i].epc_n = 0;
+	}
+	ephem_depth = depth;
+	ephem_stop = B_FALSE;
+	rv = pthread_create(&ephem_thread, NULL, ephem_pool_thread, NULL);
+	if (rv != 0) {
+		for (i = 0; i < EPHEM_NCURVES; ++i) {
+			free(ephem_curves[i].epc_ents);
+			ephem_curves[i].epc_ents = NULL;
+		}
+		ephem_depth = 0;
+		VERIFY0(pthread_mutex_unlock(&ephem_mtx));
+		return (errfno("pthread_create", rv, NULL));
+	}
+	ephem_running = B_TRUE;
+	VERIFY0(pthread_mutex_unlock(&ephem_mtx));
+	return (ERRF_OK);
+}
+
+void
+piv_box_ephem_pool_stop(void)
+{
+	struct ephem_curve *epc;
+	uint i, j;
+
+	VERIFY0(pthread_mutex_lock(&ephem_mtx));
+	if (!ephem_running) {
+		VERIFY0(pthread_mutex_unlock(&ephem_mtx));
+		return;
+	}
+	ephem_stop = B_TRUE;
+	VERIFY0(pthread_cond_broadcast(&ephem_cv));
+	VERIFY0(pthread_mutex_unlock(&ephem_mtx));
+
+	VERIFY0(pthread_join(ephem_thread, NULL));
+
+	VERIFY0(pthread_mutex_lock(&ephem_mtx));
+	for (i = 0; i < EPHEM_NCURVES; ++i) {
+		epc = &ephem_curves[i];
+		for (j = 0; j < epc->epc_n; ++j) {
+			freezero_conceal(epc->epc_ents[j],
+			    sizeof (struct ephem_ent));
+		}
+		free(epc->epc_ents);
+		epc->epc_ents = NULL;
+		epc->epc_n = 0;
+		epc->epc_wanted = B_FALSE;
+	}
+	ephem_depth = 0;
+	ephem_running = B_FALSE;
+	VERIFY0(pthread_mutex_unlock(&ephem_mtx));
+}
+
+void
+piv_box_ephem_pool_want(uint bits)
+{
+	struct ephem_curve *epc;
+
+	VERIFY0(pthread_mutex_lock(&ephem_mtx));
+	if ((epc = ephem_curve_for_bits(bits)) != NULL) {
+		epc->epc_wanted = B_TRUE;
+		VERIFY0(pthread_cond_signal(&ephem_cv));
+	}
+	VERIFY0(pthread_mutex_unlock(&ephem_mtx));
+}
+
+int
+piv_box_ephem_generate(uint bits, struct sshkey **keyp)
+{
+	struct ephem_curve *epc;
+	struct ephem_ent *ent = NULL;
+
+	VERIFY0(pthread_mutex_lock(&ephem_mtx));
+	if (ephem_running && (epc = ephem_curve_for_bits(bits)) != NULL) {
+		if (!epc->epc_wanted)
+			epc->epc_wanted = B_TRUE;
+		if (epc->epc_n > 0) {
+			ent = epc->epc_ents[--epc->epc_n];
+			epc->epc_ents[epc->epc_n] = NULL;
+		}
+		VERIFY0(pthread_cond_signal(&ephem_cv));
+		if (ent != NULL) {
+			*keyp = ephem_ent_take(epc, ent);
+			VERIFY0(pthread_mutex_unlock(&ephem_mtx));
+			return (0);
+		}
+	}
+	VERIFY0(pthread_mutex_unlock(&ephem_mtx));
+
+	return (sshkey_generate(KEY_ECDSA, bits, keyp));
+}
+
 errf_t *
 piv_box_seal_offline(struct sshkey *pubk, struct piv_ecdh_box *box)
 {
@@ -4495,7 +6542,7 @@ piv_box_seal_offline(struct sshkey *pubk, struct piv_ecdh_box *box)
 	}
 
 	if (box->pdb_ephem == NULL) {
-		rv = sshkey_generate(KEY_ECDSA, sshkey_size(pubk), &pkey);
+		rv = piv_box_ephem_generate(sshkey_size(pubk), &pkey);
 		if (rv != 0) {
 			err = boxaerrf(ssherrf("sshkey_generate", rv));
 			return (err);
@@ -4613,7 +6660,7 @@ piv_box_seal_offline(struct sshkey *pubk, struct piv_ecdh_box *box)
 	for (i = box->pdb_plain.b_len; i < plainlen; ++i)
 		plain[i] = padding;
 
-	freezero(box->pdb_plain.b_data, box->pdb_plain.b_size);
+	freezero_conceal(box->pdb_plain.b_data, box->pdb_plain.b_size);
 	box->pdb_plain.b_data = NULL;
 	box->pdb_plain.b_size = 0;
 	box->pdb_plain.b_len = 0;
@@ -4718,6 +6765,317 @@ out:
 	return (ERRF_OK);
 }
 
+struct piv_tkidx_ent {
+	struct piv_tkidx_ent	*pte_next;
+	/* GUID (in the guid table) or SHA-256 of the pubkey blob */
+	uint8_t			 pte_key[32];
+	struct piv_token	*pte_token;
+	struct piv_slot		*pte_slot;
+};
+
+/* A slot we tried to read a cert from and couldn't. */
+struct piv_tkidx_miss {
+	struct piv_tkidx_miss	*ptm_next;
+	struct piv_token	*ptm_token;
+	enum piv_slotid		 ptm_slot;
+};
+
+struct piv_token_index {
+	struct piv_token	 *pti_tokens;
+	size_t			  pti_nbuckets;		/* power of 2 */
+	struct piv_tkidx_ent	**pti_guids;
+	struct piv_tkidx_ent	**pti_keys;
+	struct piv_tkidx_miss	 *pti_misses;
+};
+
+/*
+ * Both GUIDs and key hashes are uniformly distributed, so their first few
+ * bytes make a perfectly good hash.
+ */
+static inline size_t
+piv_tkidx_bucket(const struct piv_token_index *idx, const uint8_t *key)
+{
+	uint32_t h;
+	bcopy(key, &h, sizeof (h));
+	return (h & (idx->pti_nbuckets - 1));
+}
+
+static errf_t *
+piv_key_hash(const struct sshkey *pubkey, uint8_t *hash)
+{
+	u_char *fp = NULL;
+	size_t fplen = 0;
+	int rc;
+
+	rc = sshkey_fingerprint_raw(pubkey, SSH_DIGEST_SHA256, &fp, &fplen);
+	if (rc != 0)
+		return (ssherrf("sshkey_fingerprint_raw", rc));
+	VERIFY3U(fplen, ==, 32);
+	bcopy(fp, hash, fplen);
+	free(fp);
+	return (ERRF_OK);
+}
+
+static errf_t *
+piv_tkidx_add_slot(struct piv_token_index *idx, struct piv_token *pt,
+    struct piv_slot *s)
+{
+	struct piv_tkidx_ent *e;
+	errf_t *err;
+	size_t b;
+
+	if (s->ps_pubkey == NULL)
+		return (ERRF_OK);
+	e = calloc(1, sizeof (*e));
+	if (e == NULL)
+		return (ERRF_NOMEM);
+	if ((err = piv_key_hash(s->ps_pubkey, e->pte_key))) {
+		free(e);
+		return (err);
+	}
+	e->pte_token = pt;
+	e->pte_slot = s;
+	b = piv_tkidx_bucket(idx, e->pte_key);
+	e->pte_next = idx->pti_keys[b];
+	idx->pti_keys[b] = e;
+	return (ERRF_OK);
+}
+
+void
+piv_token_index_free(struct piv_token_index *idx)
+{
+	struct piv_tkidx_ent *e, *ne;
+	struct piv_tkidx_miss *m, *nm;
+	size_t i;
+
+	if (idx == NULL)
+		return;
+	for (i = 0; i < idx->pti_nbuckets; ++i) {
+		for (e = idx->pti_guids[i]; e != NULL; e = ne) {
+			ne = e->pte_next;
+			free(e);
+		}
+		for (e = idx->pti_keys[i]; e != NULL; e = ne) {
+			ne = e->pte_next;
+			free(e);
+		}
+	}
+	for (m = idx->pti_misses; m != NULL; m = nm) {
+		nm = m->ptm_next;
+		free(m);
+	}
+	free(idx->pti_guids);
+	free(idx->pti_keys);
+	free(idx);
+}
+
+errf_t *
+piv_token_index_new(struct piv_token *tks, struct piv_token_index **pidx)
+{
+	struct piv_token_index *idx;
+	struct piv_tkidx_ent *e;
+	struct piv_token *pt;
+	struct piv_slot *s;
+	size_t n = 0;
+	size_t b;
+	errf_t *err;
+
+	for (pt = tks; pt != NULL; pt = pt->pt_next) {
+		++n;
+		for (s = pt->pt_slots; s != NULL; s = s->ps_next)
+			++n;
+	}
+
+	idx = calloc(1, sizeof (*idx));
+	if (idx == NULL)
+		return (ERRF_NOMEM);
+	idx->pti_tokens = tks;
+	idx->pti_nbuckets = 16;
+	while (idx->pti_nbuckets < n)
+		idx->pti_nbuckets <<= 1;
+	idx->pti_guids = calloc(idx->pti_nbuckets, sizeof (*idx->pti_guids));
+	idx->pti_keys = calloc(idx->pti_nbuckets, sizeof (*idx->pti_keys));
+	if (idx->pti_guids == NULL || idx->pti_keys == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+
+	for (pt = tks; pt != NULL; pt = pt->pt_next) {
+		e = calloc(1, sizeof (*e));
+		if (e == NULL) {
+			err = ERRF_NOMEM;
+			goto out;
+		}
+		bcopy(pt->pt_guid, e->pte_key, sizeof (pt->pt_guid));
+		e->pte_token = pt;
+		b = piv_tkidx_bucket(idx, e->pte_key);
+		e->pte_next = idx->pti_guids[b];
+		idx->pti_guids[b] = e;
+
+		for (s = pt->pt_slots; s != NULL; s = s->ps_next) {
+			if ((err = piv_tkidx_add_slot(idx, pt, s)))
+				goto out;
+		}
+	}
+
+	*pidx = idx;
+	idx = NULL;
+	err = ERRF_OK;
+
+out:
+	piv_token_index_free(idx);
+	return (err);
+}
+
+/*
+ * Reads the cert for a slot we haven't seen yet (as piv_box_find_token()
+ * does), and adds it to the index. Remembers failures so that we only go to
+ * the card once for any given slot, no matter how many boxes we're matching.
+ */
+static struct piv_slot *
+piv_tkidx_load_slot(struct piv_token_index *idx, struct piv_token *pt,
+    enum piv_slotid slotid, errf_t **errp)
+{
+	struct piv_tkidx_miss *m;
+	struct piv_slot *s;
+	errf_t *err;
+
+	for (m = idx->pti_misses; m != NULL; m = m->ptm_next) {
+		if (m->ptm_token == pt && m->ptm_slot == slotid) {
+			*errp = errf("NotFoundError", NULL, "Slot %02x on "
+			    "PIV token could not be read", slotid);
+			return (NULL);
+		}
+	}
+
+	if ((err = piv_txn_begin(pt)) != 0)
+		goto miss;
+	if ((err = piv_select(pt)) != 0 ||
+	    (err = piv_read_cert(pt, slotid)) != 0) {
+		piv_txn_end(pt);
+		goto miss;
+	}
+	piv_txn_end(pt);
+	s = piv_get_slot(pt, slotid);
+	if (s == NULL) {
+		err = errf("NotFoundError", NULL, "Slot %02x on PIV token "
+		    "has no key", slotid);
+		goto miss;
+	}
+	if ((err = piv_tkidx_add_slot(idx, pt, s))) {
+		*errp = err;
+		return (NULL);
+	}
+	*errp = ERRF_OK;
+	return (s);
+
+miss:
+	m = calloc(1, sizeof (*m));
+	if (m != NULL) {
+		m->ptm_token = pt;
+		m->ptm_slot = slotid;
+		m->ptm_next = idx->pti_misses;
+		idx->pti_misses = m;
+	}
+	*errp = err;
+	return (NULL);
+}
+
+errf_t *
+piv_token_index_find_box(struct piv_token_index *idx,
+    struct piv_ecdh_box *box, struct piv_token **tk, struct piv_slot **slot)
+{
+	struct piv_tkidx_ent *e;
+	struct piv_token *pt = NULL;
+	struct piv_slot *s;
+	uint8_t hash[32];
+	enum piv_slotid slotid;
+	errf_t *err;
+
+	e = idx->pti_guids[piv_tkidx_bucket(idx, box->pdb_guid)];
+	for (; e != NULL; e = e->pte_next) {
+		if (bcmp(e->pte_key, box->pdb_guid,
+		    sizeof (box->pdb_guid)) == 0) {
+			pt = e->pte_token;
+			break;
+		}
+	}
+
+	if (pt != NULL) {
+		s = piv_get_slot(pt, box->pdb_slot);
+		if (s == NULL) {
+			s = piv_tkidx_load_slot(idx, pt, box->pdb_slot, &err);
+			if (s == NULL)
+				return (err);
+		}
+		if (!sshkey_equal_public(s->ps_pubkey, box->pdb_pub)) {
+			return (errf("NotFoundError", NULL, "PIV token on "
+			    "system with matching GUID for box has different "
+			    "keys"));
+		}
+		goto out;
+	}
+
+	if ((err = piv_key_hash(box->pdb_pub, hash)))
+		return (err);
+	for (e = idx->pti_keys[piv_tkidx_bucket(idx, hash)]; e != NULL;
+	    e = e->pte_next) {
+		if (bcmp(e->pte_key, hash, sizeof (hash)) == 0 &&
+		    sshkey_equal_public(e->pte_slot->ps_pubkey,
+		    box->pdb_pub)) {
+			pt = e->pte_token;
+			s = e->pte_slot;
+			goto out;
+		}
+	}
+
+	/*
+	 * Nothing we've seen so far has this key, so try reading the slot the
+	 * box mentions from any token where we haven't yet.
+	 */
+	slotid = box->pdb_slot;
+	if (slotid == 0 || slotid == 0xFF)
+		slotid = PIV_SLOT_KEY_MGMT;
+	for (pt = idx->pti_tokens; pt != NULL; pt = pt->pt_next) {
+		if (piv_get_slot(pt, slotid) != NULL)
+			continue;
+		s = piv_tkidx_load_slot(idx, pt, slotid, &err);
+		if (s == NULL) {
+			errf_free(err);
+			continue;
+		}
+		if (sshkey_equal_public(s->ps_pubkey, box->pdb_pub))
+			goto out;
+	}
+	return (errf("NotFoundError", NULL, "No PIV token found on "
+	    "system to unlock box"));
+
+out:
+	*tk = pt;
+	*slot = s;
+	return (ERRF_OK);
+}
+
+errf_t *
+piv_box_find_tokens(struct piv_token *tks, struct piv_box_match *items,
+    size_t n)
+{
+	struct piv_token_index *idx;
+	errf_t *err;
+	size_t i;
+
+	if ((err = piv_token_index_new(tks, &idx)))
+		return (err);
+	for (i = 0; i < n; ++i) {
+		items[i].pbm_token = NULL;
+		items[i].pbm_slot = NULL;
+		items[i].pbm_err = piv_token_index_find_box(idx,
+		    items[i].pbm_box, &items[i].pbm_token, &items[i].pbm_slot);
+	}
+	piv_token_index_free(idx);
+	return (ERRF_OK);
+}
+
 errf_t *
 sshbuf_put_piv_box(struct sshbuf *buf, struct piv_ecdh_box *box)
 {
@@ -224,6 +224,10 @@ struct piv_token;
  * yet and you should use piv_read_cert() / piv_read_all_certs() to populate
  * the list of slots if you want to use one.
  *
+ * If there is more than one reader, they are probed in parallel (each on a
+ * thread with its own PCSC context, which the returned token then owns). The
+ * list is still returned in the same order regardless.
+ *
  * Errors:
  *  - PCSCError: a PCSC call failed in a way that is not retryable
  */
@@ -237,7 +241,9 @@ errf_t *piv_enumerate(SCARDCONTEXT ctx, struct piv_token **tokens);
  *
  * This is faster than using piv_enumerate() and searching the list yourself
  * since it doesn't try to fully probe each token for capabilities before
- * checking the GUID.
+ * checking the GUID. Readers are probed in parallel as in piv_enumerate(),
+ * and if a full GUID is given we return as soon as a match turns up rather
+ * than waiting for every reader to answer.
  *
  * Errors:
  *  - PCSCError: a PCSC call failed in a way that is not retryable
@@ -248,6 +254,69 @@ MUST_CHECK
 errf_t *piv_find(SCARDCONTEXT ctx, const uint8_t *guid, size_t guidlen,
     struct piv_token **token);
 
+/*
+ * Connects to and probes just the token in the named PCSC reader, the same
+ * way piv_enumerate() would, without touching any of the other readers
+ * (which might be busy in long transactions of their own).
+ *
+ * Errors:
+ *  - NotFoundError: no PIV token could be found in that reader
+ */
+MUST_CHECK
+errf_t *piv_open_reader(SCARDCONTEXT ctx, const char *rdrname,
+    struct piv_token **token);
+
+/*
+ * Turns on (or off) lazy probing for subsequent piv_enumerate() and
+ * piv_find() calls. Normally these read the discovery object, key history
+ * and YubicoPIV version/serial of every token up front. In lazy mode they
+ * only SELECT and read the CHUID, and the rest is read the first time one of
+ * the piv_token_* or ykpiv_token_* accessors needs it (using the current
+ * transaction if there is one, or a short one of its own if not).
+ *
+ * Useful for callers which are mostly only interested in GUIDs.
+ */
+void piv_set_lazy_probe(boolean_t lazy);
+
+/*
+ * Turns on (or off) compact slots for certs read from now on. Normally each
+ * slot keeps the parsed X509 certificate alive for as long as the token. In
+ * compact mode a slot only keeps the cert's DER encoding, its public key and
+ * subject, and piv_slot_cert() decodes the X509 the first time it's called.
+ *
+ * Useful for long-running processes that hold many tokens (e.g. pivy-agent)
+ * and rarely look at the certs themselves.
+ */
+void piv_set_compact_slots(boolean_t compact);
+
+/*
+ * Turns on the reader cache, which remembers which reader each GUID was last
+ * seen in (and the ATR at the time). piv_find() with a full GUID then tries
+ * that reader first, checking its CHUID, before falling back to scanning
+ * every reader. piv_enumerate() and successful scans keep it up to date.
+ *
+ * If path is NULL, uses $XDG_RUNTIME_DIR/pivy-readers, or
+ * $HOME/.cache/pivy-readers.
+ */
+void piv_use_reader_cache(const char *path);
+
+/*
+ * Sets up some virtual PIV tokens: software-only PIV applets that live in
+ * this process, with freshly generated EC P-256 keys (and self-signed certs)
+ * in slots 9A, 9C, 9D and 9E. They show up as extra readers in
+ * piv_enumerate() and piv_find(). This is only intended for benchmarking and
+ * load testing -- the keys are kept in ordinary memory and the PIN is always
+ * "123456" (and the admin key is the default 3DES one). Their GUIDs depend
+ * only on their index, so they stay the same from one run to the next, but
+ * the keys don't.
+ *
+ * The spec is "count[:latency]", where latency (in microseconds) is added to
+ * every APDU exchanged with them, to simulate a real card. Can only be called
+ * once, before any tokens are enumerated.
+ */
+MUST_CHECK
+errf_t *piv_virt_init(const char *spec);
+
 /*
  * Returns the next token on a list of tokens such as that returned by
  * piv_enumerate().
@@ -324,6 +393,13 @@ uint piv_token_keyhistory_offcard(const struct piv_token *token);
 /* Returns the URL used to retrieve off-card key history certs. */
 const char *piv_token_offcard_url(const struct piv_token *token);
 
+/*
+ * Returns running totals of APDUs exchanged with the token since it was
+ * enumerated, and the number of command and response bytes they carried.
+ */
+void piv_token_apdu_stats(const struct piv_token *token, uint64_t *count,
+    uint64_t *txbytes, uint64_t *rxbytes);
+
 /*
  * Returns true if the card advertises that it implements YubicoPIV extensions
  */
@@ -378,9 +454,16 @@ enum piv_alg piv_slot_alg(const struct piv_slot *slot);
  * Returns the certificate stored for a given slot.
  *
  * The memory referenced by the returned pointer should be treated as const
- * and not freed or modified (it will be freed with the piv_slot).
+ * and not freed or modified (it will be freed with the piv_slot). In compact
+ * mode (see piv_set_compact_slots()) the first call for a slot decodes the
+ * certificate from its DER encoding.
  */
 X509 *piv_slot_cert(const struct piv_slot *slot);
+/*
+ * Returns the DER encoding of the certificate for a slot, as read from the
+ * card, without decoding it. NULL if the slot has no certificate loaded.
+ */
+const uint8_t *piv_slot_cert_der(const struct piv_slot *slot, size_t *len);
 /* Helper: retrieves the subject DN from the certificate for a slot. */
 const char *piv_slot_subject(const struct piv_slot *slot);
 
@@ -423,6 +506,20 @@ boolean_t piv_token_in_txn(const struct piv_token *token);
 MUST_CHECK
 errf_t *piv_select(struct piv_token *tk);
 
+/*
+ * Like piv_select(), but skips the SELECT if this handle already selected
+ * the PIV applet and we've seen nothing since which would undo that: no
+ * reset of the card (whether ours at the end of a txn after a PIN VERIFY,
+ * or someone else's, which SCardBeginTransaction tells us about) and no
+ * failure to talk to it.
+ *
+ * PC/SC doesn't let us see whether another client has selected some other
+ * applet in between our transactions, so this is only safe to use when
+ * nothing else is talking to the card.
+ */
+MUST_CHECK
+errf_t *piv_select_lazy(struct piv_token *tk);
+
 /*
  * Reads the certificate in a given slot on the card, and updates the list
  * of struct piv_slots with info about it.
@@ -451,6 +548,59 @@ errf_t *piv_read_cert(struct piv_token *tk, enum piv_slotid slotid);
 MUST_CHECK
 errf_t *piv_read_all_certs(struct piv_token *tk);
 
+enum piv_slotmask {
+	PIV_SLOTMASK_9A		= (1 << 0),
+	PIV_SLOTMASK_9C		= (1 << 1),
+	PIV_SLOTMASK_9D		= (1 << 2),
+	PIV_SLOTMASK_9E		= (1 << 3),
+	/* All the retired slots the key history object says are on-card */
+	PIV_SLOTMASK_RETIRED	= (1 << 4),
+
+	PIV_SLOTMASK_STANDARD	= 0x0F,
+	PIV_SLOTMASK_ALL	= 0x1F
+};
+
+/*
+ * Like piv_read_all_certs(), but only reads the slots in mask (a set of
+ * enum piv_slotmask bits). Slots not in the mask are left alone, so anything
+ * read previously is still there; use piv_read_cert() to read any others
+ * later as they're needed.
+ */
+MUST_CHECK
+errf_t *piv_read_certs(struct piv_token *tk, uint mask);
+
+/*
+ * Serialises the public state of a token which piv_read_all_certs() would
+ * otherwise have to fetch from the card (each slot's algorithm, public key
+ * and certificate subject), so that it can be cached somewhere and restored
+ * later with piv_token_state_load().
+ *
+ * Along with the slots we record a "change token" made up of the card's
+ * GUID, CHUID fields, key history counts and YubiKey version/serial. These
+ * are all read by piv_find() and piv_enumerate() anyway, so checking them
+ * costs nothing extra. Note that they won't necessarily change if a key is
+ * regenerated, so cached state should still be revalidated eventually.
+ */
+MUST_CHECK
+errf_t *piv_token_state_save(const struct piv_token *tk, struct sshbuf *buf);
+
+/*
+ * Restores slots saved by piv_token_state_save(). The token must have come
+ * from piv_find() or piv_enumerate(), but doesn't need to be in a txn --
+ * this doesn't talk to the card at all.
+ *
+ * Slots restored this way have no X509 certificate attached:
+ * piv_slot_cert() (and piv_slot_cert_der()) will return NULL for them until
+ * piv_read_cert() is used.
+ *
+ * Errors:
+ *  - InvalidDataError: the saved state is corrupt or an unknown version
+ *  - StaleDataError: the saved state is for a different token, or the
+ *                    token's change token doesn't match any more
+ */
+MUST_CHECK
+errf_t *piv_token_state_load(struct piv_token *tk, struct sshbuf *buf);
+
 /*
  * Authenticates as the card administrator using a 3DES key.
  *
@@ -790,6 +940,66 @@ MUST_CHECK
 errf_t *piv_sign_prehash(struct piv_token *tk, struct piv_slot *slot,
     const uint8_t *hash, size_t hashlen, uint8_t **signature, size_t *siglen);
 
+/*
+ * For signing payloads that are too big to hold in memory: the caller hashes
+ * the payload itself, incrementally, and then hands just the digest to
+ * piv_sign_digest(). The signature is the same one piv_sign() would make
+ * over the whole payload with that hash.
+ *
+ * piv_sign_digest_alg() picks the hash to use for the key in "slot" (SHA-256
+ * for RSA and P-256, SHA-384 for P-384). It must be called after
+ * piv_select(), since it checks the card's algorithm list.
+ *
+ * piv_sign_digest() accepts any hash piv_sign() would for the key, and
+ * "dglen" must be its full length.
+ *
+ * Errors:
+ *   - NotSupportedError: the key algorithm is not supported, or the card can
+ *                        only sign with the hash computed on the card
+ *                        itself (in which case use piv_sign())
+ *   - ArgumentError: the hash is not one that can be used with this key, or
+ *                    the digest is the wrong length
+ *   - as for piv_sign()
+ */
+MUST_CHECK
+errf_t *piv_sign_digest_alg(struct piv_token *tk, struct piv_slot *slot,
+    enum sshdigest_types *hashalgo);
+MUST_CHECK
+errf_t *piv_sign_digest(struct piv_token *tk, struct piv_slot *slot,
+    enum sshdigest_types hashalgo, const uint8_t *digest, size_t dglen,
+    uint8_t **signature, size_t *siglen);
+
+struct piv_sign_item {
+	/* Filled out by the caller */
+	const uint8_t		*psi_data;
+	size_t			 psi_datalen;
+	/* As for piv_sign(): the hash wanted going in, and the one used */
+	enum sshdigest_types	 psi_hashalgo;
+
+	/* Filled out by piv_sign_batch() */
+	uint8_t			*psi_sig;
+	size_t			 psi_siglen;
+	errf_t			*psi_err;
+};
+
+/*
+ * Signs a batch of payloads with the same key, one after the other within
+ * the current transaction. Each item is exactly as for piv_sign(), and gets
+ * its own signature or error (which the caller must free). If an item fails
+ * with an IOError, the remaining items are not attempted and get a
+ * BatchAbortedError instead.
+ *
+ * Nothing is done about PINs here: for a slot whose PIN policy is "always"
+ * (e.g. 9C) the items after the first will fail with PermissionError, and the
+ * caller should verify the PIN and use piv_sign() for each instead.
+ *
+ * Errors (for the batch as a whole; the items always have their own too):
+ *   - BatchAbortedError: an item failed with an IOError
+ */
+MUST_CHECK
+errf_t *piv_sign_batch(struct piv_token *tk, struct piv_slot *slot,
+    struct piv_sign_item *items, size_t n);
+
 /*
  * Performs an ECDH key derivation between the private key on the token and
  * the given EC public key.
@@ -830,6 +1040,41 @@ errf_t *piv_box_seal_offline(struct sshkey *pubk, struct piv_ecdh_box *box);
 MUST_CHECK
 errf_t *piv_box_to_binary(struct piv_ecdh_box *box, uint8_t **output, size_t *len);
 
+/*
+ * Starts a background thread which keeps up to "depth" freshly generated
+ * ephemeral keys ready for each curve that boxes are being sealed to, so that
+ * piv_box_seal_offline() (and ebox_create()) can take one instead of
+ * generating it on the spot. This is for processes which seal boxes at a high
+ * rate; each pooled key is kept in concealed memory and handed out to exactly
+ * one box, then destroyed. When the pool for a curve is empty, keys are
+ * generated on demand as usual. A child process created with fork() starts
+ * with the pool wiped and stopped, so it never shares keys with its parent.
+ *
+ * Errors:
+ *  - ArgumentError: depth was 0
+ *  - AlreadyRunningError: the pool has already been started
+ *  - SystemError: the thread could not be created
+ */
+MUST_CHECK
+errf_t *piv_box_ephem_pool_start(uint depth);
+
+/* Stops the pool thread and destroys any keys still in the pool. */
+void piv_box_ephem_pool_stop(void);
+
+/*
+ * Normally the pool only starts filling a curve once the first key for it
+ * has been asked for. This marks a curve (by key size in bits) as wanted
+ * straight away, so that the pool can fill up ahead of time.
+ */
+void piv_box_ephem_pool_want(uint bits);
+
+/*
+ * As sshkey_generate(KEY_ECDSA, bits, keyp), but takes the key from the pool
+ * if it's running and has one.
+ */
+MUST_CHECK
+int piv_box_ephem_generate(uint bits, struct sshkey **keyp);
+
 boolean_t piv_box_has_guidslot(const struct piv_ecdh_box *box);
 const uint8_t *piv_box_guid(const struct piv_ecdh_box *box);
 const char *piv_box_guid_hex(const struct piv_ecdh_box *box);
@@ -855,6 +1100,48 @@ errf_t *piv_box_from_binary(const uint8_t *input, size_t len,
 MUST_CHECK
 errf_t *piv_box_find_token(struct piv_token *tks, struct piv_ecdh_box *box,
     struct piv_token **tk, struct piv_slot **slot);
+
+/*
+ * An index over a list of tokens (as returned by piv_enumerate()) by GUID and
+ * by the public keys in their slots, for matching many boxes against the same
+ * set of tokens without walking every token and slot for each one.
+ *
+ * The index points into the token list, so it must be freed before the
+ * tokens are. Slots which had to be read from the card while matching are
+ * added as they're found.
+ */
+struct piv_token_index;
+
+MUST_CHECK
+errf_t *piv_token_index_new(struct piv_token *tks,
+    struct piv_token_index **idx);
+void piv_token_index_free(struct piv_token_index *idx);
+
+/*
+ * As for piv_box_find_token(), but using an index. Must be called without a
+ * transaction open on any of the tokens.
+ */
+MUST_CHECK
+errf_t *piv_token_index_find_box(struct piv_token_index *idx,
+    struct piv_ecdh_box *box, struct piv_token **tk, struct piv_slot **slot);
+
+struct piv_box_match {
+	struct piv_ecdh_box	*pbm_box;
+
+	/* Filled out by piv_box_find_tokens() */
+	struct piv_token	*pbm_token;
+	struct piv_slot		*pbm_slot;
+	errf_t			*pbm_err;
+};
+
+/*
+ * Finds the token and slot for each of a batch of boxes, building an index
+ * over "tks" once for all of them. Each item gets either a token and slot, or
+ * an error (exactly as from piv_box_find_token()) which the caller must free.
+ */
+MUST_CHECK
+errf_t *piv_box_find_tokens(struct piv_token *tks, struct piv_box_match *items,
+    size_t n);
 MUST_CHECK
 errf_t *piv_box_open(struct piv_token *tk, struct piv_slot *slot,
     struct piv_ecdh_box *box);
@@ -975,4 +1262,34 @@ errf_t *piv_apdu_transceive_chain(struct piv_token *pk, struct apdu *apdu);
  */
 extern boolean_t piv_full_apdu_debug;
 
+/*
+ * A record from the APDU trace ring. This is always on, and only records the
+ * header fields, lengths and status (never the data), so it's safe to hand
+ * out. Times are from CLOCK_MONOTONIC in usec (see piv_trace_now()).
+ */
+struct piv_apdu_trace {
+	uint64_t	pat_start;
+	uint64_t	pat_end;
+	uint8_t		pat_guid[4];	/* first bytes of the token's GUID */
+	uint8_t		pat_cls;
+	uint8_t		pat_ins;
+	uint8_t		pat_p1;
+	uint8_t		pat_p2;
+	uint8_t		pat_ext;	/* extended length? */
+	uint16_t	pat_lc;
+	uint16_t	pat_le;
+	uint16_t	pat_sw;		/* 0 if the transmit failed */
+	uint16_t	pat_lr;		/* reply length */
+	uint32_t	pat_rv;		/* PCSC return value */
+};
+
+/*
+ * Copies out up to max of the most recent APDU trace records, oldest first.
+ * Returns the number copied.
+ */
+size_t piv_apdu_trace_get(struct piv_apdu_trace *recs, size_t max);
+
+/* The clock used for piv_apdu_trace timestamps. */
+uint64_t piv_trace_now(void);
+
 #endif
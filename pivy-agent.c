@@ -72,12 +72,14 @@
 #include <sys/mman.h>
 
 #include <openssl/evp.h>
+#include <openssl/err.h>
 
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <paths.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -97,9 +99,12 @@
 #include "debug.h"
 #include "tlv.h"
 #include "piv.h"
+#include "ebox.h"
 #include "errf.h"
+#include "usdt.h"
 
 #if defined(__APPLE__)
+#include <launch.h>
 #include <PCSC/wintypes.h>
 #include <PCSC/winscard.h>
 #else
@@ -107,6 +112,14 @@
 #include <winscard.h>
 #endif
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#elif defined(__sun)
+#include <port.h>
+#else
+#include <sys/event.h>
+#endif
+
 #if defined(__sun)
 #include <ucred.h>
 #include <procfs.h>
@@ -144,36 +157,29 @@
 #define	flagserrf(val)		\
     errf("FlagsError", NULL, "unsupported flags value: %x", val)
 
-static struct piv_token *ks = NULL;
-static struct piv_token *selk = NULL;
-static boolean_t txnopen = B_FALSE;
-static uint64_t txntimeout = 0;
-static SCARDCONTEXT ctx;
-static uint64_t last_update;
-static uint64_t last_op;
-static uint8_t *guid = NULL;
-static size_t guid_len = 0;
 static boolean_t sign_9d = B_FALSE;
 static boolean_t check_client_uid = B_TRUE;
 #if defined(__sun)
 static boolean_t check_client_zoneid = B_TRUE;
 #endif
 
-static char *pinmem = NULL;
-static char *pin = NULL;
-static size_t pin_len = 0;
+/* Maximum accepted message length */
+#define AGENT_MAX_LEN	(256*1024)
 
-static struct sshkey *cak = NULL;
+/* How much we ask for in each read() on a connection */
+#define	AGENT_READ_CHUNK	(64*1024)
 
-static struct bunyan_frame *msg_log_frame;
+/* Maximum number of requests from one connection at the card at once */
+#define	AGENT_MAX_INFLIGHT	8
 
-/* Maximum accepted message length */
-#define AGENT_MAX_LEN	(256*1024)
+/* Number of released sshbufs we keep around for reuse */
+#define	AGENT_SSHBUF_POOL	64
 
 typedef enum {
 	AUTH_UNUSED,
 	AUTH_SOCKET,
-	AUTH_CONNECTION
+	AUTH_CONNECTION,
+	AUTH_NOTIFY		/* read end of card_done_pipe */
 } sock_type;
 
 typedef struct {
@@ -185,19 +191,346 @@ typedef struct {
 	struct sshbuf *input;
 	struct sshbuf *output;
 	struct sshbuf *request;
+	/*
+	 * Bumped every time this entry is re-used for a new connection, so
+	 * that a card_job which completes after its connection has closed
+	 * can tell and discard its reply.
+	 */
+	u_int gen;
+	/* Number of requests from this connection with the card executors */
+	u_int inflight;
+	/* Sequence number for the next request, and for the next reply due */
+	u_int seq_next;
+	u_int seq_reply;
+	/* Finished jobs waiting on earlier requests, in sequence order */
+	struct card_job *held;
+	/* Registered with the event backend for writability too. */
+	boolean_t evwrite;
 } SocketEntry;
 
+/*
+ * The main loop's event backend: epoll, kqueue or event ports where we have
+ * them, with poll(2) as the fallback (or if built with -DAGENT_USE_POLL).
+ * The native backends register each socket once, in new_socket(), and only
+ * touch the registration again when a connection starts or stops having
+ * output to write, so a wakeup only costs as much as the sockets that are
+ * actually ready.
+ */
+#if defined(AGENT_USE_POLL)
+#elif defined(__linux__)
+#define	EV_EPOLL
+#elif defined(__sun)
+#define	EV_PORT
+#elif defined(__APPLE__) || defined(__OpenBSD__) || defined(__FreeBSD__) || \
+    defined(__NetBSD__)
+#define	EV_KQUEUE
+#endif
+
+static void ev_add(SocketEntry *);
+static void ev_del(SocketEntry *);
+static void ev_sync(SocketEntry *);
+
+struct card_job;
+static void card_job_free(struct card_job *);
+static void cards_start(void);
+
+/*
+ * All card I/O (and all the state that goes with it -- the open txn, the
+ * PIN etc) lives on a card executor thread, one per token. The main thread
+ * only runs the poll() loop: it frames incoming messages, hands each one to
+ * the right token's executor as a card_job and goes back to servicing other
+ * sockets. When an executor finishes a job it puts it on the card_done list
+ * and writes a byte to card_done_pipe, which the main loop watches as an
+ * AUTH_NOTIFY socket, and the reply is then copied to the connection's
+ * output buffer.
+ *
+ * Requests which concern every token (listing identities, lock/unlock) are
+ * "fanned out": the main thread creates a parent job with one child per
+ * token, and once all the children are done their replies are merged by
+ * the parent's cj_merge function.
+ *
+ * A connection can have up to AGENT_MAX_INFLIGHT requests queued at once
+ * (so a client which pipelines requests doesn't wait for a round trip
+ * through the main loop between each). Each one gets a sequence number, and
+ * replies which finish early (e.g. on another token) are held until the
+ * ones before them are done, so replies always go out in request order.
+ */
+struct agent_token;
+
+struct card_job {
+	struct card_job *cj_next;
+	struct agent_token *cj_token;
+	u_int cj_socknum;
+	u_int cj_sockgen;
+	u_int cj_seq;			/* order on the connection */
+	u_char cj_type;
+	int cj_fd;
+	pid_t cj_pid;
+	char *cj_exepath;
+	struct sshbuf *cj_request;
+	struct sshbuf *cj_output;
+	boolean_t cj_failed;
+	uint64_t cj_start;		/* monotime_usec() at creation */
+	uint64_t cj_apdus;		/* APDUs it cost, incl children */
+	uint64_t cj_apdu_bytes;
+
+	/* Fan-out: children point at their parent, parent holds the list */
+	struct card_job *cj_parent;
+	struct card_job *cj_children;
+	struct card_job *cj_sibling;
+	u_int cj_pending;
+	void (*cj_merge)(struct card_job *);
+};
+
+struct card_executor {
+	pthread_t ce_thread;
+	pthread_mutex_t ce_mtx;
+	pthread_cond_t ce_cv;
+	struct card_job *ce_queue;
+	struct card_job **ce_queue_tail;
+	boolean_t ce_presence;		/* presence_readers has changed */
+};
+
+/*
+ * A small open-addressed hash table from public key blob to slot ID, so
+ * that finding the slot a request refers to costs one hash and one memcmp
+ * instead of an sshkey_equal() against every slot on every token.
+ */
+struct keyidx_ent {
+	uint64_t kie_hash;
+	u_char *kie_blob;		/* NULL if this entry is empty */
+	size_t kie_len;
+	enum piv_slotid kie_slot;
+};
+
+struct keyidx {
+	size_t ki_size;			/* always a power of 2 */
+	struct keyidx_ent *ki_ents;
+};
+
+/*
+ * Counters and latency histograms reported by the agent-stats@joyent.com
+ * extension. Histogram bucket n counts samples of less than 2^n usec (the
+ * last bucket takes everything bigger). All of these are protected by
+ * stats_mtx, since they're updated from both the main thread and the
+ * executors.
+ */
+#define	STATS_HIST_BUCKETS	24
+
+struct stats_hist {
+	uint64_t sh_count;
+	uint64_t sh_sum_us;
+	uint64_t sh_buckets[STATS_HIST_BUCKETS];
+};
+
+struct msg_stats {
+	uint64_t ms_count;
+	uint64_t ms_failures;
+	uint64_t ms_apdus;
+	uint64_t ms_apdu_bytes;
+	struct stats_hist ms_latency;
+};
+
+struct token_stats {
+	uint64_t ts_txn_opens;
+	uint64_t ts_txn_reuses;		/* agent_piv_open with txn still open */
+	uint64_t ts_txn_closes;
+	struct stats_hist ts_txn_hold;
+	uint64_t ts_finds;
+	uint64_t ts_find_failures;
+	uint64_t ts_pin_ok;
+	uint64_t ts_pin_fail;
+	uint64_t ts_txn_hold_ms;	/* at_txnhold, for reporting */
+};
+
+/*
+ * State for each PIV token we've been asked to manage (once per -g option).
+ *
+ * Everything except the at_pub_* and at_ids_* fields belongs to the token's
+ * executor thread and must not be touched from anywhere else. The at_pub_*
+ * fields are a snapshot of the token's GUID, public keys and identity list,
+ * published by the executor whenever it reads the certs, which the main
+ * thread uses to decide which executor a request should go to and to answer
+ * REQUEST_IDENTITIES without a trip to the card. at_ids_gen belongs to the
+ * main thread.
+ */
+struct agent_token {
+	struct agent_token *at_next;
+	uint8_t *at_guid;		/* -g value, may be a prefix */
+	size_t at_guid_len;
+	struct card_executor at_exec;
+	SCARDCONTEXT at_ctx;
+
+	struct piv_token *at_ks;
+	struct piv_token *at_selk;
+	boolean_t at_txnopen;
+	uint64_t at_txntimeout;
+	uint64_t at_txnstart;		/* monotime_usec() */
+	uint64_t at_txnlast;		/* monotime() of last agent_piv_open */
+	uint64_t at_txngap;		/* moving avg gap between those, ms */
+	uint64_t at_txnhold;		/* hold time from txn_hold_time() */
+	uint64_t at_last_update;
+	uint64_t at_last_op;
+	time_t at_probe_interval;
+	uint at_probe_fails;
+
+	char *at_cache_path;
+	struct sshbuf *at_cache;	/* contents of at_cache_path */
+	boolean_t at_revalidate;	/* slots came from at_cache */
+	uint at_refresh;		/* piv_slotmask bits left to re-read */
+	uint64_t at_refresh_next;	/* next group is due by, even if busy */
+	boolean_t at_skip_cache;
+
+	char *at_pinmem;
+	char *at_pin;
+	size_t at_pin_len;
+	struct sshkey *at_cak;
+	uint64_t at_cak_ok;		/* monotime() of last CAK proof, or 0 */
+	uint at_cak_gen;		/* presence_gen when that proof began */
+	char *at_cak_rdr;		/* reader the card was in */
+	uint8_t at_cak_guid[GUID_LEN];
+
+	pthread_mutex_t at_bcache_mtx;
+	struct box_cache_ent *at_bcache;	/* most recent first */
+	uint at_bcache_n;
+
+	struct attest_cache_ent *at_attest;
+
+	struct bunyan_frame *at_log_frame;
+
+	pthread_mutex_t at_pub_mtx;
+	boolean_t at_pub_valid;
+	uint8_t at_pub_guid[GUID_LEN];
+	struct keyidx *at_pub_idx;
+	struct sshbuf *at_pub_ids;	/* see process_request_identities */
+	uint at_pub_gen;		/* bumped on every publish */
+
+	uint at_ids_gen;		/* at_pub_gen that ids_answer used */
+
+	struct token_stats at_stats;	/* protected by stats_mtx */
+};
+
+static struct agent_token *tokens = NULL;
+static uint ntokens = 0;
+
+/* Pre-built REQUEST_IDENTITIES answer (main thread only) */
+static struct sshbuf *ids_answer = NULL;
+
+static pthread_mutex_t card_done_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct card_job *card_done = NULL;
+static struct card_job **card_done_tail = &card_done;
+static int card_done_pipe[2] = { -1, -1 };
+
+static u_int sock_gen = 0;
+
+/*
+ * Names of the readers which currently have a card in them, as last seen by
+ * the presence watcher thread. presence_watching is B_FALSE if the watcher
+ * isn't working, in which case we fall back to finding out about card
+ * removal by probing. presence_gen is bumped every time the watcher sees a
+ * card come or go (or stops watching), so a CAK proof made at one value
+ * still holds as long as it hasn't moved (see auth_cak()).
+ */
+static pthread_mutex_t presence_mtx = PTHREAD_MUTEX_INITIALIZER;
+static boolean_t presence_watching = B_FALSE;
+static uint presence_gen = 0;
+static char **presence_readers = NULL;
+static uint presence_nreaders = 0;
+
+static pthread_mutex_t stats_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct msg_stats msg_stats[256];
+static uint64_t stats_start;
+
 u_int sockets_alloc = 0;
 SocketEntry *sockets = NULL;
 
 int max_fd = 0;
 
+/*
+ * How long we hang on to the card transaction after a request, in the hope
+ * that another one comes along and we can skip piv_txn_begin() and
+ * piv_select() (set with -T):
+ *
+ *  fixed[:ms]          always txn_hold_ms (the default, 2 sec)
+ *  adaptive[:min:max]  TXN_ADAPTIVE_FACTOR times the recent average gap
+ *                      between requests, within [min, max] ms. When the
+ *                      average gap is longer than max (i.e. we're mostly
+ *                      idle) we hold for just min.
+ *  exclusive           never let go of the card unless something goes
+ *                      wrong, for hosts where nothing else uses it
+ */
+enum txn_policy {
+	TXN_FIXED = 0,
+	TXN_ADAPTIVE,
+	TXN_EXCLUSIVE
+};
+#define	TXN_ADAPTIVE_FACTOR	4
+#define	TXN_FOREVER		UINT64_MAX
+
+static enum txn_policy txn_policy = TXN_FIXED;
+static uint64_t txn_hold_ms = 2000;
+
+/*
+ * Nothing else talks to the card (-S, or implied by -T exclusive), so when we
+ * begin a new transaction the PIV applet is still selected unless the card
+ * has been reset, and we can use piv_select_lazy() rather than sending
+ * another SELECT.
+ */
+static boolean_t card_unshared = B_FALSE;
+
+/*
+ * Opt-in (-B ttl[:count]) cache of recently opened boxes, so that a tool
+ * which opens the same box again a moment later (e.g. a script running
+ * pivy-zfs or pivy-luks on each of a set of datasets that share an ebox)
+ * doesn't cost another card operation each time. Entries are keyed on a
+ * hash of the whole box (so its ephemeral key, slot and ciphertext), hold the
+ * plaintext in concealed memory, and are thrown away after box_cache_ttl ms,
+ * when there are more than box_cache_max, or whenever we drop the PIN (on
+ * lock, card removal etc).
+ */
+struct box_cache_ent {
+	struct box_cache_ent *bce_next;
+	uint8_t bce_hash[32];
+	uint64_t bce_expiry;		/* monotime() */
+	uint8_t *bce_data;
+	size_t bce_len;
+};
+
+#define	BOX_CACHE_MAX_TTL	300	/* sec */
+#define	BOX_CACHE_MAX_COUNT	256
+
+#define	CAK_REPROOF_MAX		86400	/* sec */
+
+/*
+ * Results of YK_ATTEST for each slot we've been asked about. The attestation
+ * cert and chain only change when the slot's key does, so we keep them
+ * (keyed on the slot ID and the key blob) until agent_token_publish() finds
+ * a different key in that slot, and answer repeat requests without going to
+ * the card. Executor only, like the rest of the token state.
+ */
+struct attest_cache_ent {
+	struct attest_cache_ent *ace_next;
+	enum piv_slotid ace_slotid;
+	u_char *ace_blob;
+	size_t ace_bloblen;
+	uint8_t *ace_cert;
+	size_t ace_certlen;
+	uint8_t *ace_chain;		/* contents of the 0x70 tag */
+	size_t ace_chainlen;
+};
+
+static uint64_t box_cache_ttl = 0;	/* ms, 0 = off */
+static uint box_cache_max = 16;
+static uint64_t txn_hold_min = 500;
+static uint64_t txn_hold_max = 30000;
+static uint64_t cak_reproof = 3600000;	/* ms, 0 = prove every time */
+
 const time_t card_probe_interval_nopin = 120;
 const time_t card_probe_interval_pin = 30;
+const time_t card_probe_interval_watched = 600;
 const uint card_probe_limit = 3;
-
-time_t card_probe_interval = 120; /* card_probe_interval_nopin */
-uint card_probe_fails = 0;
+/* How long a busy executor may put off reading the next at_refresh group. */
+const uint64_t card_refresh_defer = 5000;	/* ms */
 
 /* pid of shell == parent of agent */
 pid_t parent_pid = -1;
@@ -210,6 +543,15 @@ pid_t cleanup_pid = 0;
 char socket_name[PATH_MAX + 20];
 char socket_dir[PATH_MAX];
 
+/*
+ * We were handed our listening socket by systemd or launchd, so the socket
+ * file belongs to them. In this case we also don't touch PCSC until the
+ * first request comes in (see cards_start()).
+ */
+static boolean_t socket_activated = B_FALSE;
+static boolean_t cards_started = B_FALSE;
+static boolean_t virt_tokens = B_FALSE;
+
 
 /* locking */
 #define LOCK_SIZE	32
@@ -281,220 +623,860 @@ monotime(void)
 	return (msec);
 }
 
+static uint64_t
+monotime_usec(void)
+{
+	struct timeval tv;
+	uint64_t usec;
+	gettimeofday(&tv, NULL);
+	usec = tv.tv_sec * 1000000ULL;
+	usec += tv.tv_usec;
+	return (usec);
+}
+
+/* Caller must hold stats_mtx. */
+static void
+stats_hist_add(struct stats_hist *sh, uint64_t usec)
+{
+	uint i = 0;
+
+	while (i < STATS_HIST_BUCKETS - 1 && usec >= (1ULL << i))
+		++i;
+	sh->sh_count++;
+	sh->sh_sum_us += usec;
+	sh->sh_buckets[i]++;
+}
+
+static void
+stats_pin(struct agent_token *at, errf_t *err)
+{
+	VERIFY0(pthread_mutex_lock(&stats_mtx));
+	if (err == ERRF_OK)
+		at->at_stats.ts_pin_ok++;
+	else if (errf_caused_by(err, "PermissionError"))
+		at->at_stats.ts_pin_fail++;
+	VERIFY0(pthread_mutex_unlock(&stats_mtx));
+}
+
+/*
+ * Called every time a request wants the card: updates the average gap
+ * between requests and works out how long to hold the txn this time.
+ */
+static uint64_t
+txn_hold_time(struct agent_token *at)
+{
+	uint64_t now = monotime(), gap, hold;
+
+	if (at->at_txnlast != 0) {
+		gap = now - at->at_txnlast;
+		if (at->at_txngap == 0)
+			at->at_txngap = gap;
+		else
+			at->at_txngap = (at->at_txngap * 3 + gap) / 4;
+	}
+	at->at_txnlast = now;
+
+	switch (txn_policy) {
+	case TXN_EXCLUSIVE:
+		hold = TXN_FOREVER;
+		break;
+	case TXN_ADAPTIVE:
+		hold = at->at_txngap * TXN_ADAPTIVE_FACTOR;
+		if (at->at_txngap == 0 || at->at_txngap > txn_hold_max ||
+		    hold < txn_hold_min)
+			hold = txn_hold_min;
+		else if (hold > txn_hold_max)
+			hold = txn_hold_max;
+		break;
+	default:
+		hold = txn_hold_ms;
+		break;
+	}
+	at->at_txnhold = hold;
+	if (hold == TXN_FOREVER)
+		return (TXN_FOREVER);
+	return (now + hold);
+}
+
 static void
-agent_piv_close(boolean_t force)
+agent_piv_close(struct agent_token *at, boolean_t force)
 {
 	uint64_t now = monotime();
-	VERIFY(txnopen);
-	if (force || now >= txntimeout) {
+	VERIFY(at->at_txnopen);
+	if (force || now >= at->at_txntimeout) {
 		bunyan_log(BNY_TRACE, "closing txn",
 		    "now", BNY_UINT64, now,
-		    "txntimeout", BNY_UINT64, txntimeout, NULL);
-		piv_txn_end(selk);
-		txnopen = B_FALSE;
+		    "txntimeout", BNY_UINT64, at->at_txntimeout, NULL);
+		piv_txn_end(at->at_selk);
+		at->at_txnopen = B_FALSE;
+
+		VERIFY0(pthread_mutex_lock(&stats_mtx));
+		at->at_stats.ts_txn_closes++;
+		stats_hist_add(&at->at_stats.ts_txn_hold,
+		    monotime_usec() - at->at_txnstart);
+		VERIFY0(pthread_mutex_unlock(&stats_mtx));
+	}
+}
+
+static void
+box_cache_ent_free(struct box_cache_ent *bce)
+{
+	freezero_conceal(bce->bce_data, bce->bce_len);
+	free(bce);
+}
+
+/*
+ * Throws away expired entries, and everything past the first "keep" (which
+ * is 0 to empty the cache).
+ */
+static void
+box_cache_trim(struct agent_token *at, uint keep)
+{
+	struct box_cache_ent *bce, **pp;
+	uint64_t now = monotime();
+	uint n = 0;
+
+	VERIFY0(pthread_mutex_lock(&at->at_bcache_mtx));
+	pp = &at->at_bcache;
+	while ((bce = *pp) != NULL) {
+		if (n >= keep || now >= bce->bce_expiry) {
+			*pp = bce->bce_next;
+			box_cache_ent_free(bce);
+			continue;
+		}
+		++n;
+		pp = &bce->bce_next;
 	}
+	at->at_bcache_n = n;
+	VERIFY0(pthread_mutex_unlock(&at->at_bcache_mtx));
 }
 
 static void
-drop_pin(void)
+drop_pin(struct agent_token *at)
 {
-	if (pin_len != 0) {
+	if (at->at_pin_len != 0) {
 		bunyan_log(BNY_INFO, "clearing PIN from memory", NULL);
-		explicit_bzero(pin, pin_len);
+		explicit_bzero(at->at_pin, at->at_pin_len);
 	}
-	pin_len = 0;
-	card_probe_interval = card_probe_interval_nopin;
+	at->at_pin_len = 0;
+	at->at_probe_interval = card_probe_interval_nopin;
+	if (at->at_bcache != NULL) {
+		bunyan_log(BNY_INFO, "clearing box cache", NULL);
+		box_cache_trim(at, 0);
+	}
+}
+
+static void
+cak_forget(struct agent_token *at)
+{
+	at->at_cak_ok = 0;
+	free(at->at_cak_rdr);
+	at->at_cak_rdr = NULL;
+}
+
+/*
+ * A CAK proof only tells us which card was in the reader at the time, so we
+ * can go on trusting it for as long as we know that card hasn't been pulled
+ * or swapped since. That needs the presence watcher to be running (and not
+ * to have seen anything happen in the meantime), the same reader and GUID,
+ * and no resets in between (agent_piv_open() forgets the proof when it loses
+ * its handle). Even then we prove it again every cak_reproof ms.
+ */
+static boolean_t
+cak_still_proven(struct agent_token *at)
+{
+	boolean_t ok;
+
+	if (at->at_cak_ok == 0 || cak_reproof == 0)
+		return (B_FALSE);
+	if (monotime() - at->at_cak_ok >= cak_reproof)
+		return (B_FALSE);
+	if (strcmp(at->at_cak_rdr, piv_token_rdrname(at->at_selk)) != 0)
+		return (B_FALSE);
+	if (bcmp(at->at_cak_guid, piv_token_guid(at->at_selk), GUID_LEN) != 0)
+		return (B_FALSE);
+
+	VERIFY0(pthread_mutex_lock(&presence_mtx));
+	ok = (presence_watching && presence_gen == at->at_cak_gen);
+	VERIFY0(pthread_mutex_unlock(&presence_mtx));
+	return (ok);
 }
 
 static errf_t *
-auth_cak(void)
+auth_cak(struct agent_token *at)
 {
 	struct piv_slot *slot;
 	errf_t *err;
-	slot = piv_get_slot(selk, PIV_SLOT_CARD_AUTH);
+	uint gen;
+
+	if (cak_still_proven(at)) {
+		bunyan_log(BNY_TRACE, "CAK proof still valid",
+		    "age_ms", BNY_UINT64, monotime() - at->at_cak_ok, NULL);
+		return (NULL);
+	}
+	cak_forget(at);
+
+	/* Taken first, so a removal during the proof still counts. */
+	VERIFY0(pthread_mutex_lock(&presence_mtx));
+	gen = presence_gen;
+	VERIFY0(pthread_mutex_unlock(&presence_mtx));
+
+	slot = piv_get_slot(at->at_selk, PIV_SLOT_CARD_AUTH);
 	if (slot == NULL) {
 		err = errf("CAKAuthError", NULL, "No key was found in the "
 		    "CARD_AUTH (CAK) slot");
 		return (err);
 	}
-	err = piv_auth_key(selk, slot, cak);
+	err = piv_auth_key(at->at_selk, slot, at->at_cak);
 	if (err) {
 		err = errf("CAKAuthError", err, "Key in CARD_AUTH slot (CAK) "
 		    "does not match the configured CAK: this card may be "
 		    "a fake!");
 		return (err);
 	}
+	at->at_cak_ok = monotime();
+	at->at_cak_gen = gen;
+	at->at_cak_rdr = strdup(piv_token_rdrname(at->at_selk));
+	VERIFY(at->at_cak_rdr != NULL);
+	bcopy(piv_token_guid(at->at_selk), at->at_cak_guid, GUID_LEN);
 	return (NULL);
 }
 
-static errf_t *
-agent_piv_open(void)
+/* FNV-1a */
+static uint64_t
+keyidx_hash(const u_char *blob, size_t len)
 {
-	struct piv_slot *slot;
-	errf_t *err = NULL;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
 
-	if (txnopen) {
-		txntimeout = monotime() + 2000;
-		return (NULL);
+	for (i = 0; i < len; ++i) {
+		h ^= blob[i];
+		h *= 0x100000001b3ULL;
 	}
+	return (h);
+}
 
-	if (selk == NULL || (err = piv_txn_begin(selk))) {
-		errf_free(err);
-
-		selk = NULL;
-		if (ks != NULL)
-			piv_release(ks);
-
-		err = piv_find(ctx, guid, guid_len, &ks);
-		if (err) {
-			ks = NULL;
-			err = errf("EnumerationError", err, "Failed to "
-			    "find specified PIV token on the system");
-			return (err);
-		}
-		selk = ks;
+static struct keyidx *
+keyidx_new(size_t n)
+{
+	struct keyidx *ki;
+
+	ki = calloc(1, sizeof (struct keyidx));
+	VERIFY(ki != NULL);
+	/* Keep it at most half full. */
+	ki->ki_size = 8;
+	while (ki->ki_size < n * 2)
+		ki->ki_size <<= 1;
+	ki->ki_ents = calloc(ki->ki_size, sizeof (struct keyidx_ent));
+	VERIFY(ki->ki_ents != NULL);
+	return (ki);
+}
 
-		if (selk == NULL) {
-			err = errf("NotFoundError", NULL, "PIV card with "
-			    "given GUID is not present on the system");
-			if (monotime() - last_update > 5000)
-				drop_pin();
-			return (err);
-		}
+static void
+keyidx_free(struct keyidx *ki)
+{
+	size_t i;
 
-		if ((err = piv_txn_begin(selk))) {
-			return (err);
-		}
+	if (ki == NULL)
+		return;
+	for (i = 0; i < ki->ki_size; ++i)
+		free(ki->ki_ents[i].kie_blob);
+	free(ki->ki_ents);
+	free(ki);
+}
 
-		if ((err = piv_select(selk))) {
-			piv_txn_end(selk);
-			return (err);
-		}
+static void
+keyidx_add(struct keyidx *ki, const struct sshkey *key, enum piv_slotid slot)
+{
+	struct keyidx_ent *ent;
+	u_char *blob;
+	size_t len, i;
+	uint64_t h;
+
+	VERIFY0(sshkey_to_blob(key, &blob, &len));
+	h = keyidx_hash(blob, len);
+	for (i = h & (ki->ki_size - 1); ki->ki_ents[i].kie_blob != NULL;
+	    i = (i + 1) & (ki->ki_size - 1))
+		;
+	ent = &ki->ki_ents[i];
+	ent->kie_hash = h;
+	ent->kie_blob = blob;
+	ent->kie_len = len;
+	ent->kie_slot = slot;
+}
 
-		err = piv_read_all_certs(selk);
-		if (err && !errf_caused_by(err, "NotFoundError") &&
-		    !errf_caused_by(err, "NotSupportedError")) {
-			piv_txn_end(selk);
-			return (err);
-		}
-		if (cak != NULL && (err = auth_cak())) {
-			piv_txn_end(selk);
-			drop_pin();
-			return (err);
-		}
-		last_update = monotime();
+static boolean_t
+keyidx_find(const struct keyidx *ki, const u_char *blob, size_t len,
+    enum piv_slotid *slot)
+{
+	const struct keyidx_ent *ent;
+	uint64_t h;
+	size_t i;
 
-	} else {
-		if ((err = piv_select(selk))) {
-			piv_txn_end(selk);
-			return (err);
+	if (ki == NULL)
+		return (B_FALSE);
+	h = keyidx_hash(blob, len);
+	for (i = h & (ki->ki_size - 1); ki->ki_ents[i].kie_blob != NULL;
+	    i = (i + 1) & (ki->ki_size - 1)) {
+		ent = &ki->ki_ents[i];
+		if (ent->kie_hash == h && ent->kie_len == len &&
+		    bcmp(ent->kie_blob, blob, len) == 0) {
+			*slot = ent->kie_slot;
+			return (B_TRUE);
 		}
 	}
-	if (cak == NULL) {
-		slot = piv_get_slot(selk, PIV_SLOT_CARD_AUTH);
-		if (slot != NULL)
-			VERIFY0(sshkey_demote(piv_slot_pubkey(slot), &cak));
+	return (B_FALSE);
+}
+
+static void
+agent_token_set_pub(struct agent_token *at, struct keyidx *idx,
+    struct sshbuf *ids)
+{
+	VERIFY0(pthread_mutex_lock(&at->at_pub_mtx));
+	keyidx_free(at->at_pub_idx);
+	sshbuf_free(at->at_pub_ids);
+	at->at_pub_idx = idx;
+	at->at_pub_ids = ids;
+	at->at_pub_valid = (ids != NULL);
+	if (at->at_pub_valid) {
+		bcopy(piv_token_guid(at->at_selk), at->at_pub_guid,
+		    GUID_LEN);
 	}
-	bunyan_log(BNY_TRACE, "opened new txn", NULL);
-	txnopen = B_TRUE;
-	txntimeout = monotime() + 2000;
-	card_probe_fails = 0;
-	return (NULL);
+	++at->at_pub_gen;
+	VERIFY0(pthread_mutex_unlock(&at->at_pub_mtx));
 }
 
 static void
-probe_card(void)
+attest_cache_ent_free(struct attest_cache_ent *ace)
 {
-	errf_t *err;
-	if (card_probe_fails > card_probe_limit)
+	if (ace == NULL)
 		return;
-	bunyan_log(BNY_TRACE, "doing idle probe", NULL);
+	free(ace->ace_blob);
+	free(ace->ace_cert);
+	free(ace->ace_chain);
+	free(ace);
+}
 
-	last_op = monotime();
-	if ((err = agent_piv_open())) {
-		bunyan_log(BNY_TRACE, "error opening for idle probe",
-		    "error", BNY_ERF, err, NULL);
-		errf_free(err);
-		/*
-		 * Allow one failure due to connectivity issues before we
-		 * drop the PIN (so that transient glitches aren't so
-		 * inconvenient).
-		 */
-		if (card_probe_fails++ > 0)
-			drop_pin();
-		selk = NULL;
-		return;
-	}
-	if (cak != NULL && (err = auth_cak())) {
-		bunyan_log(BNY_WARN, "CAK authentication failed",
-		    "error", BNY_ERF, err, NULL);
-		agent_piv_close(B_TRUE);
-		/* Always drop PIN on a CAK failure. */
-		drop_pin();
-		selk = NULL;
-		card_probe_fails++;
-		return;
+static struct attest_cache_ent *
+attest_cache_find(struct agent_token *at, const u_char *blob, size_t len)
+{
+	struct attest_cache_ent *ace;
+	enum piv_slotid slotid;
+
+	/* Only while the card is present and still has this key. */
+	if (!keyidx_find(at->at_pub_idx, blob, len, &slotid))
+		return (NULL);
+	for (ace = at->at_attest; ace != NULL; ace = ace->ace_next) {
+		if (ace->ace_slotid == slotid && ace->ace_bloblen == len &&
+		    bcmp(ace->ace_blob, blob, len) == 0)
+			return (ace);
 	}
-	agent_piv_close(B_FALSE);
-	card_probe_fails = 0;
+	return (NULL);
 }
 
-static errf_t *
-wrap_pin_error(errf_t *err, int retries)
+static void
+attest_cache_add(struct agent_token *at, enum piv_slotid slotid,
+    const u_char *blob, size_t bloblen, const uint8_t *cert, size_t certlen,
+    const uint8_t *chain, size_t chainlen)
 {
-	if (errf_caused_by(err, "PermissionError")) {
-		if (retries == 0) {
-			err = errf("TokenLocked", err,
-			    "PIV token is locked due to too many "
-			    "invalid PIN code attempts");
-		} else {
-			err = errf("InvalidPIN", err,
-			    "Invalid PIN code supplied (%d attempts "
-			    "remaining)", retries);
-			drop_pin();
+	struct attest_cache_ent *ace, **pp;
+
+	/* Replace whatever we had for this slot before. */
+	for (pp = &at->at_attest; (ace = *pp) != NULL; pp = &ace->ace_next) {
+		if (ace->ace_slotid == slotid) {
+			*pp = ace->ace_next;
+			attest_cache_ent_free(ace);
+			break;
 		}
-	} else if (errf_caused_by(err, "MinRetriesError")) {
-		err = errf("TokenLocked", err,
-		    "Refusing to use up the last PIN code attempt: "
-		    "unlock the token with another tool to clear "
-		    "the counter");
-		drop_pin();
 	}
-	return (err);
+
+	ace = calloc(1, sizeof (*ace));
+	VERIFY(ace != NULL);
+	ace->ace_slotid = slotid;
+	ace->ace_blob = malloc(bloblen);
+	ace->ace_cert = malloc(certlen);
+	ace->ace_chain = malloc(chainlen);
+	VERIFY(ace->ace_blob != NULL && ace->ace_cert != NULL &&
+	    ace->ace_chain != NULL);
+	bcopy(blob, ace->ace_blob, bloblen);
+	ace->ace_bloblen = bloblen;
+	bcopy(cert, ace->ace_cert, certlen);
+	ace->ace_certlen = certlen;
+	bcopy(chain, ace->ace_chain, chainlen);
+	ace->ace_chainlen = chainlen;
+
+	ace->ace_next = at->at_attest;
+	at->at_attest = ace;
 }
 
-static errf_t *
-agent_piv_try_pin(boolean_t canskip)
+/*
+ * Drops any entries whose key isn't in the same slot of idx any more (the
+ * key was regenerated or imported, or this is a different card).
+ */
+static void
+attest_cache_prune(struct agent_token *at, const struct keyidx *idx)
 {
-	errf_t *err = NULL;
-	uint retries = 1;
-	if (pin_len != 0) {
-		err = piv_verify_pin(selk, piv_token_default_auth(selk),
-		    pin, &retries, canskip);
-		err = wrap_pin_error(err, retries);
+	struct attest_cache_ent *ace, **pp;
+	enum piv_slotid slotid;
+
+	pp = &at->at_attest;
+	while ((ace = *pp) != NULL) {
+		if (!keyidx_find(idx, ace->ace_blob, ace->ace_bloblen,
+		    &slotid) || slotid != ace->ace_slotid) {
+			bunyan_log(BNY_DEBUG, "dropping cached attestation",
+			    "slotid", BNY_UINT, (uint)ace->ace_slotid, NULL);
+			*pp = ace->ace_next;
+			attest_cache_ent_free(ace);
+			continue;
+		}
+		pp = &ace->ace_next;
 	}
-	return (err);
 }
 
+/*
+ * Publishes the token's GUID, key index and identity list for the main
+ * thread to use. Called on the executor after (re-)reading the certs.
+ *
+ * The identity list is what goes into an IDENTITIES_ANSWER, except that
+ * each (key, comment) is preceded by its slot ID so that build_identities()
+ * can sort the 9D keys to the end when merging lists from several tokens.
+ */
 static void
-close_socket(SocketEntry *e)
+agent_token_publish(struct agent_token *at)
 {
-	close(e->fd);
-	e->fd = -1;
-	e->type = AUTH_UNUSED;
-	sshbuf_free(e->input);
-	sshbuf_free(e->output);
-	sshbuf_free(e->request);
-	if (e->exepath != NULL)
-		free(e->exepath);
-}
+	struct piv_slot *slot = NULL;
+	struct keyidx *idx;
+	struct sshbuf *ids;
+	char comment[256];
+	size_t n = 0;
+	int r;
 
-static int
-set_nonblock(int fd)
-{
-	int val;
+	while ((slot = piv_slot_next(at->at_selk, slot)) != NULL)
+		++n;
+	idx = keyidx_new(n);
+	if ((ids = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	while ((slot = piv_slot_next(at->at_selk, slot)) != NULL) {
+		keyidx_add(idx, piv_slot_pubkey(slot), piv_slot_id(slot));
 
-	val = fcntl(fd, F_GETFL);
+		comment[0] = 0;
+		if (ntokens > 1) {
+			snprintf(comment, sizeof (comment), "PIV_slot_%02X %s "
+			    "(%.8s)", piv_slot_id(slot), piv_slot_subject(slot),
+			    piv_token_guid_hex(at->at_selk));
+		} else {
+			snprintf(comment, sizeof (comment), "PIV_slot_%02X %s",
+			    piv_slot_id(slot), piv_slot_subject(slot));
+		}
+		if ((r = sshbuf_put_u8(ids, piv_slot_id(slot))) != 0 ||
+		    (r = sshkey_puts(piv_slot_pubkey(slot), ids)) != 0 ||
+		    (r = sshbuf_put_cstring(ids, comment)) != 0) {
+			fatal("%s: put key/comment: %s", __func__,
+			    ssh_err(r));
+		}
+	}
+
+	attest_cache_prune(at, idx);
+	agent_token_set_pub(at, idx, ids);
+}
+
+/*
+ * Finds the slot holding the key with the given blob. Executor only: the
+ * executor is the only writer of at_pub_idx, so it can read it unlocked.
+ */
+static struct piv_slot *
+agent_find_slot(struct agent_token *at, const u_char *blob, size_t len)
+{
+	enum piv_slotid slotid;
+
+	if (!keyidx_find(at->at_pub_idx, blob, len, &slotid))
+		return (NULL);
+	return (piv_get_slot(at->at_selk, slotid));
+}
+
+/* The card has gone away: stop advertising its keys. */
+static void
+agent_token_unpublish(struct agent_token *at)
+{
+	if (at->at_pub_valid)
+		agent_token_set_pub(at, NULL, NULL);
+}
+
+/*
+ * The token state cache: a file per token (named after the -g value) in
+ * cache_dir holding the output of piv_token_state_save(). This lets us skip
+ * piv_read_all_certs() (which is slow, since it reads and parses every cert
+ * on the card) when we first find the card, and then re-read everything in
+ * the background once we're idle.
+ */
+static char *cache_dir = NULL;
+
+static void
+agent_cache_load(struct agent_token *at)
+{
+	char *hex;
+	int fd;
+	ssize_t done;
+	struct stat st;
+	u_char *p;
+	int r;
+
+	if (cache_dir == NULL)
+		return;
+
+	hex = buf_to_hex(at->at_guid, at->at_guid_len, B_FALSE);
+	VERIFY(hex != NULL);
+	if (asprintf(&at->at_cache_path, "%s/%s.state", cache_dir, hex) < 0)
+		fatal("%s: asprintf failed", __func__);
+	free(hex);
+
+	if ((fd = open(at->at_cache_path, O_RDONLY)) < 0)
+		return;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+	    st.st_size > AGENT_MAX_LEN) {
+		close(fd);
+		return;
+	}
+	if ((at->at_cache = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((r = sshbuf_reserve(at->at_cache, st.st_size, &p)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	done = read(fd, p, st.st_size);
+	close(fd);
+	if (done != st.st_size) {
+		sshbuf_free(at->at_cache);
+		at->at_cache = NULL;
+	}
+}
+
+static void
+agent_cache_save(struct agent_token *at)
+{
+	struct sshbuf *buf;
+	char *tmp = NULL;
+	int fd = -1;
+	ssize_t done;
+	errf_t *err;
+
+	if (at->at_cache_path == NULL)
+		return;
+
+	if ((buf = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((err = piv_token_state_save(at->at_selk, buf))) {
+		bunyan_log(BNY_WARN, "failed to serialise token state",
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+		sshbuf_free(buf);
+		return;
+	}
+	if (at->at_cache != NULL && sshbuf_len(at->at_cache) ==
+	    sshbuf_len(buf) && bcmp(sshbuf_ptr(at->at_cache), sshbuf_ptr(buf),
+	    sshbuf_len(buf)) == 0) {
+		/* Nothing's changed. */
+		sshbuf_free(buf);
+		return;
+	}
+
+	(void) mkdir(cache_dir, 0700);
+	if (asprintf(&tmp, "%s.%ld", at->at_cache_path, (long)getpid()) < 0)
+		fatal("%s: asprintf failed", __func__);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		goto fail;
+	done = write(fd, sshbuf_ptr(buf), sshbuf_len(buf));
+	if (done < 0 || (size_t)done != sshbuf_len(buf))
+		goto fail;
+	if (close(fd) != 0) {
+		fd = -1;
+		goto fail;
+	}
+	fd = -1;
+	if (rename(tmp, at->at_cache_path) != 0)
+		goto fail;
+
+	bunyan_log(BNY_DEBUG, "saved token state to cache",
+	    "path", BNY_STRING, at->at_cache_path, NULL);
+	sshbuf_free(at->at_cache);
+	at->at_cache = buf;
+	free(tmp);
+	return;
+
+fail:
+	bunyan_log(BNY_WARN, "failed to write token state cache file",
+	    "path", BNY_STRING, at->at_cache_path,
+	    "error", BNY_STRING, strerror(errno), NULL);
+	if (fd != -1)
+		close(fd);
+	(void) unlink(tmp);
+	free(tmp);
+	sshbuf_free(buf);
+}
+
+/*
+ * Tries to fill in the slots on a freshly found token from the cache, so we
+ * don't have to read all the certs. Returns B_FALSE if we need to go read
+ * them after all.
+ */
+static boolean_t
+agent_cache_restore(struct agent_token *at)
+{
+	struct sshbuf *b;
+	errf_t *err;
+
+	if (at->at_cache == NULL || at->at_skip_cache)
+		return (B_FALSE);
+
+	if ((b = sshbuf_fromb(at->at_cache)) == NULL)
+		fatal("%s: sshbuf_fromb failed", __func__);
+	err = piv_token_state_load(at->at_selk, b);
+	sshbuf_free(b);
+	if (err) {
+		bunyan_log(BNY_DEBUG, "not using cached token state",
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+		return (B_FALSE);
+	}
+	bunyan_log(BNY_DEBUG, "restored token state from cache", NULL);
+	at->at_revalidate = B_TRUE;
+	return (B_TRUE);
+}
+
+static errf_t *
+agent_piv_open(struct agent_token *at)
+{
+	struct piv_slot *slot;
+	errf_t *err = NULL;
+
+	if (at->at_txnopen) {
+		at->at_txntimeout = txn_hold_time(at);
+		VERIFY0(pthread_mutex_lock(&stats_mtx));
+		at->at_stats.ts_txn_reuses++;
+		at->at_stats.ts_txn_hold_ms = at->at_txnhold;
+		VERIFY0(pthread_mutex_unlock(&stats_mtx));
+		return (NULL);
+	}
+
+	if (at->at_selk != NULL && (err = piv_txn_begin(at->at_selk))) {
+		/*
+		 * Most likely the card was reset or pulled, which the
+		 * presence watcher can't always tell us about (a reset by
+		 * another process, or a quick swap). Either way we can't
+		 * vouch for what's in the reader now.
+		 */
+		errf_free(err);
+		err = ERRF_OK;
+		cak_forget(at);
+		at->at_selk = NULL;
+	}
+
+	if (at->at_selk == NULL) {
+		if (at->at_ks != NULL)
+			piv_release(at->at_ks);
+
+		err = piv_find(at->at_ctx, at->at_guid, at->at_guid_len,
+		    &at->at_ks);
+		VERIFY0(pthread_mutex_lock(&stats_mtx));
+		at->at_stats.ts_finds++;
+		if (err != ERRF_OK || at->at_ks == NULL)
+			at->at_stats.ts_find_failures++;
+		VERIFY0(pthread_mutex_unlock(&stats_mtx));
+		if (err) {
+			at->at_ks = NULL;
+			agent_token_unpublish(at);
+			err = errf("EnumerationError", err, "Failed to "
+			    "find specified PIV token on the system");
+			return (err);
+		}
+		at->at_selk = at->at_ks;
+
+		if (at->at_selk == NULL) {
+			agent_token_unpublish(at);
+			err = errf("NotFoundError", NULL, "PIV card with "
+			    "given GUID is not present on the system");
+			if (monotime() - at->at_last_update > 5000)
+				drop_pin(at);
+			return (err);
+		}
+
+		if ((err = piv_txn_begin(at->at_selk))) {
+			return (err);
+		}
+
+		if ((err = piv_select(at->at_selk))) {
+			piv_txn_end(at->at_selk);
+			return (err);
+		}
+
+		if (!agent_cache_restore(at)) {
+			err = piv_read_all_certs(at->at_selk);
+			if (err && !errf_caused_by(err, "NotFoundError") &&
+			    !errf_caused_by(err, "NotSupportedError")) {
+				piv_txn_end(at->at_selk);
+				return (err);
+			}
+			errf_free(err);
+			err = ERRF_OK;
+			agent_cache_save(at);
+		}
+		if (at->at_cak != NULL && (err = auth_cak(at))) {
+			piv_txn_end(at->at_selk);
+			drop_pin(at);
+			return (err);
+		}
+		at->at_last_update = monotime();
+		agent_token_publish(at);
+
+	} else {
+		if (card_unshared || txn_policy == TXN_EXCLUSIVE)
+			err = piv_select_lazy(at->at_selk);
+		else
+			err = piv_select(at->at_selk);
+		if (err) {
+			piv_txn_end(at->at_selk);
+			return (err);
+		}
+	}
+	if (at->at_cak == NULL) {
+		slot = piv_get_slot(at->at_selk, PIV_SLOT_CARD_AUTH);
+		if (slot != NULL) {
+			VERIFY0(sshkey_demote(piv_slot_pubkey(slot),
+			    &at->at_cak));
+		}
+	}
+	bunyan_log(BNY_TRACE, "opened new txn", NULL);
+	at->at_txnopen = B_TRUE;
+	at->at_txnstart = monotime_usec();
+	VERIFY0(pthread_mutex_lock(&stats_mtx));
+	at->at_stats.ts_txn_opens++;
+	VERIFY0(pthread_mutex_unlock(&stats_mtx));
+	at->at_txntimeout = txn_hold_time(at);
+	at->at_probe_fails = 0;
+	VERIFY0(pthread_mutex_lock(&stats_mtx));
+	at->at_stats.ts_txn_hold_ms = at->at_txnhold;
+	VERIFY0(pthread_mutex_unlock(&stats_mtx));
+	return (NULL);
+}
+
+static void
+probe_card(struct agent_token *at)
+{
+	errf_t *err;
+	uint64_t now;
+	if (at->at_probe_fails > card_probe_limit)
+		return;
+	bunyan_log(BNY_TRACE, "doing idle probe", NULL);
+
+	at->at_last_op = monotime();
+	if ((err = agent_piv_open(at))) {
+		bunyan_log(BNY_TRACE, "error opening for idle probe",
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+		/*
+		 * Allow one failure due to connectivity issues before we
+		 * drop the PIN (so that transient glitches aren't so
+		 * inconvenient).
+		 */
+		if (at->at_probe_fails++ > 0)
+			drop_pin(at);
+		at->at_selk = NULL;
+		agent_token_unpublish(at);
+		return;
+	}
+	if (at->at_cak != NULL && (err = auth_cak(at))) {
+		bunyan_log(BNY_WARN, "CAK authentication failed",
+		    "error", BNY_ERF, err, NULL);
+		agent_piv_close(at, B_TRUE);
+		/* Always drop PIN on a CAK failure. */
+		drop_pin(at);
+		at->at_selk = NULL;
+		agent_token_unpublish(at);
+		at->at_probe_fails++;
+		return;
+	}
+	/*
+	 * Re-read the certs every so often in case they've been changed
+	 * by some other tool. This used to be done on REQUEST_IDENTITIES,
+	 * which is now answered without touching the card. The reading
+	 * itself happens a slot at a time in between requests (see
+	 * agent_token_refresh()), so that nobody has to wait for all of it.
+	 */
+	now = monotime();
+	if ((now - at->at_last_update) >= at->at_probe_interval * 1000) {
+		at->at_last_update = now;
+		at->at_refresh = PIV_SLOTMASK_ALL;
+		at->at_refresh_next = now + card_refresh_defer;
+	}
+	agent_piv_close(at, B_FALSE);
+	at->at_probe_fails = 0;
+}
+
+static errf_t *
+wrap_pin_error(struct agent_token *at, errf_t *err, int retries)
+{
+	if (errf_caused_by(err, "PermissionError")) {
+		if (retries == 0) {
+			err = errf("TokenLocked", err,
+			    "PIV token is locked due to too many "
+			    "invalid PIN code attempts");
+		} else {
+			err = errf("InvalidPIN", err,
+			    "Invalid PIN code supplied (%d attempts "
+			    "remaining)", retries);
+			drop_pin(at);
+		}
+	} else if (errf_caused_by(err, "MinRetriesError")) {
+		err = errf("TokenLocked", err,
+		    "Refusing to use up the last PIN code attempt: "
+		    "unlock the token with another tool to clear "
+		    "the counter");
+		drop_pin(at);
+	}
+	return (err);
+}
+
+static errf_t *
+agent_piv_try_pin(struct agent_token *at, boolean_t canskip)
+{
+	errf_t *err = NULL;
+	uint retries = 1;
+	if (at->at_pin_len != 0) {
+		err = piv_verify_pin(at->at_selk,
+		    piv_token_default_auth(at->at_selk), at->at_pin, &retries,
+		    canskip);
+		stats_pin(at, err);
+		err = wrap_pin_error(at, err, retries);
+	}
+	return (err);
+}
+
+static void
+close_socket(SocketEntry *e)
+{
+	struct card_job *job;
+
+	ev_del(e);
+	close(e->fd);
+	e->fd = -1;
+	e->type = AUTH_UNUSED;
+	while ((job = e->held) != NULL) {
+		e->held = job->cj_next;
+		card_job_free(job);
+	}
+	e->inflight = 0;
+	sshbuf_free(e->input);
+	sshbuf_free(e->output);
+	sshbuf_free(e->request);
+	if (e->exepath != NULL)
+		free(e->exepath);
+}
+
+static int
+set_nonblock(int fd)
+{
+	int val;
+
+	val = fcntl(fd, F_GETFL);
 	if (val < 0) {
 		error("fcntl(%d, F_GETFL): %s", fd, strerror(errno));
 		return (-1);
@@ -557,82 +1539,257 @@ send_extfail(SocketEntry *e)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 }
 
-/* send list of supported public keys to 'client' */
+/*
+ * Copy this token's identity list (see agent_token_publish()) into
+ * e->output for merge_identities(). This is never the whole reply: it's
+ * always run as one child of a fanned-out REQUEST_IDENTITIES, which only
+ * happens when some token doesn't have a list published yet (otherwise the
+ * main thread answers from ids_answer).
+ */
 static errf_t *
-process_request_identities(SocketEntry *e)
+process_request_identities(struct agent_token *at, SocketEntry *e)
 {
-	struct sshbuf *msg;
-	struct piv_slot *slot = NULL;
-	char comment[256];
-	uint64_t now;
-	int r, n;
 	errf_t *err = NULL;
+	int r;
 
-	if ((msg = sshbuf_new()) == NULL)
-		fatal("%s: sshbuf_new failed", __func__);
+	if ((err = agent_piv_open(at)))
+		return (err);
+	agent_piv_close(at, B_FALSE);
 
-	if ((err = agent_piv_open()))
-		goto out;
+	VERIFY0(pthread_mutex_lock(&at->at_pub_mtx));
+	if (!at->at_pub_valid) {
+		VERIFY0(pthread_mutex_unlock(&at->at_pub_mtx));
+		return (errf("NotFoundError", NULL, "PIV token has no "
+		    "identities published"));
+	}
+	r = sshbuf_putb(e->output, at->at_pub_ids);
+	VERIFY0(pthread_mutex_unlock(&at->at_pub_mtx));
+	if (r != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 
-	now = monotime();
-	if ((now - last_update) >= card_probe_interval * 1000) {
-		last_update = now;
-		err = piv_read_all_certs(selk);
-		errf_free(err);
-		if (cak != NULL && (err = auth_cak())) {
-			agent_piv_close(B_TRUE);
-			drop_pin();
-			goto out;
+	return (NULL);
+}
+
+static void
+build_identities_pass(struct sshbuf **lists, uint nlists, struct sshbuf *msg,
+    boolean_t km)
+{
+	struct sshbuf *b;
+	const u_char *kblob, *cmt;
+	size_t klen, clen;
+	u_char slotid;
+	uint i;
+	int r;
+
+	for (i = 0; i < nlists; ++i) {
+		if (lists[i] == NULL)
+			continue;
+		b = sshbuf_fromb(lists[i]);
+		VERIFY(b != NULL);
+		while (sshbuf_len(b) > 0) {
+			if ((r = sshbuf_get_u8(b, &slotid)) != 0 ||
+			    (r = sshbuf_get_string_direct(b, &kblob,
+			    &klen)) != 0 ||
+			    (r = sshbuf_get_string_direct(b, &cmt,
+			    &clen)) != 0) {
+				fatal("%s: buffer error: %s", __func__,
+				    ssh_err(r));
+			}
+			if ((slotid == PIV_SLOT_KEY_MGMT) != km)
+				continue;
+			if ((r = sshbuf_put_string(msg, kblob, klen)) != 0 ||
+			    (r = sshbuf_put_string(msg, cmt, clen)) != 0) {
+				fatal("%s: buffer error: %s", __func__,
+				    ssh_err(r));
+			}
 		}
+		sshbuf_free(b);
 	}
-	agent_piv_close(B_FALSE);
+}
 
-	n = 0;
-	while ((slot = piv_slot_next(selk, slot)) != NULL)
-		++n;
+/*
+ * Builds a complete (framed) IDENTITIES_ANSWER in "out" from one identity
+ * list per token (NULL entries are skipped). Replies with failure if
+ * there were none at all.
+ */
+static void
+build_identities(struct sshbuf **lists, uint nlists, struct sshbuf *out)
+{
+	struct sshbuf *msg, *b;
+	u_char slotid;
+	uint i, n = 0, ok = 0;
+	int r;
+
+	for (i = 0; i < nlists; ++i) {
+		if (lists[i] == NULL)
+			continue;
+		++ok;
+		b = sshbuf_fromb(lists[i]);
+		VERIFY(b != NULL);
+		while (sshbuf_len(b) > 0) {
+			if ((r = sshbuf_get_u8(b, &slotid)) != 0 ||
+			    (r = sshbuf_skip_string(b)) != 0 ||
+			    (r = sshbuf_skip_string(b)) != 0)
+				fatal("%s: buffer error: %s", __func__,
+				    ssh_err(r));
+			++n;
+		}
+		sshbuf_free(b);
+	}
+	if (ok == 0) {
+		if ((r = sshbuf_put_u32(out, 1)) != 0 ||
+		    (r = sshbuf_put_u8(out, SSH_AGENT_FAILURE)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		return;
+	}
 
+	if ((msg = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
 	if ((r = sshbuf_put_u8(msg, SSH2_AGENT_IDENTITIES_ANSWER)) != 0 ||
 	    (r = sshbuf_put_u32(msg, n)) != 0)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 
-	while ((slot = piv_slot_next(selk, slot)) != NULL) {
-		if (piv_slot_id(slot) == PIV_SLOT_KEY_MGMT)
-			continue;
-		comment[0] = 0;
-		snprintf(comment, sizeof (comment), "PIV_slot_%02X %s",
-		    piv_slot_id(slot), piv_slot_subject(slot));
-		if ((r = sshkey_puts(piv_slot_pubkey(slot), msg)) != 0 ||
-		    (r = sshbuf_put_cstring(msg, comment)) != 0) {
-			fatal("%s: put key/comment: %s", __func__,
-			    ssh_err(r));
-		}
-	}
 	/*
 	 * Always put key mgmt last so that SSH clients not aware of the fact
 	 * that this slot is not used for signing by default will be unlikely
 	 * to try using it.
 	 */
-	if ((slot = piv_get_slot(selk, PIV_SLOT_KEY_MGMT)) != NULL) {
-		comment[0] = 0;
-		snprintf(comment, sizeof (comment), "PIV_slot_%02X %s",
-		    piv_slot_id(slot), piv_slot_subject(slot));
-		if ((r = sshkey_puts(piv_slot_pubkey(slot), msg)) != 0 ||
-		    (r = sshbuf_put_cstring(msg, comment)) != 0) {
-			fatal("%s: put key/comment: %s", __func__,
-			    ssh_err(r));
-		}
-	}
-	if ((r = sshbuf_put_stringb(e->output, msg)) != 0)
-		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	build_identities_pass(lists, nlists, msg, B_FALSE);
+	build_identities_pass(lists, nlists, msg, B_TRUE);
 
-out:
+	if ((r = sshbuf_put_stringb(out, msg)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 	sshbuf_free(msg);
-	return (err);
+}
+
+/*
+ * Runs on the main thread once every token has answered a fanned-out
+ * REQUEST_IDENTITIES, and builds the real reply out of their lists.
+ */
+static void
+merge_identities(struct card_job *job)
+{
+	struct sshbuf **lists;
+	struct card_job *cj;
+	uint i = 0;
+
+	lists = calloc(ntokens, sizeof (struct sshbuf *));
+	VERIFY(lists != NULL);
+	for (cj = job->cj_children; cj != NULL; cj = cj->cj_sibling) {
+		VERIFY3U(i, <, ntokens);
+		lists[i++] = cj->cj_failed ? NULL : cj->cj_output;
+	}
+	build_identities(lists, i, job->cj_output);
+	free(lists);
+}
+
+/*
+ * Answers REQUEST_IDENTITIES straight from the lists the executors have
+ * published, without touching the card at all. The answer is only rebuilt
+ * when some token has published a new list since last time. Returns B_FALSE
+ * if some token doesn't have a list yet (e.g. because we've never managed
+ * to talk to it), in which case the request has to go to the executors.
+ */
+static boolean_t
+answer_identities(SocketEntry *e)
+{
+	struct agent_token *at;
+	struct sshbuf **lists;
+	boolean_t stale = (ids_answer == NULL), ok = B_TRUE;
+	uint i;
+	int r;
+
+	for (at = tokens; at != NULL; at = at->at_next) {
+		VERIFY0(pthread_mutex_lock(&at->at_pub_mtx));
+		if (!at->at_pub_valid)
+			ok = B_FALSE;
+		if (at->at_pub_gen != at->at_ids_gen)
+			stale = B_TRUE;
+		VERIFY0(pthread_mutex_unlock(&at->at_pub_mtx));
+	}
+	if (!ok)
+		return (B_FALSE);
+
+	if (stale) {
+		lists = calloc(ntokens, sizeof (struct sshbuf *));
+		VERIFY(lists != NULL);
+		for (at = tokens, i = 0; at != NULL; at = at->at_next, ++i) {
+			if ((lists[i] = sshbuf_new()) == NULL)
+				fatal("%s: sshbuf_new failed", __func__);
+			VERIFY0(pthread_mutex_lock(&at->at_pub_mtx));
+			if (!at->at_pub_valid)
+				ok = B_FALSE;
+			else if ((r = sshbuf_putb(lists[i], at->at_pub_ids)))
+				fatal("%s: buffer error: %s", __func__,
+				    ssh_err(r));
+			at->at_ids_gen = at->at_pub_gen;
+			VERIFY0(pthread_mutex_unlock(&at->at_pub_mtx));
+		}
+		sshbuf_free(ids_answer);
+		ids_answer = NULL;
+		if (ok) {
+			if ((ids_answer = sshbuf_new()) == NULL)
+				fatal("%s: sshbuf_new failed", __func__);
+			build_identities(lists, ntokens, ids_answer);
+		}
+		for (i = 0; i < ntokens; ++i)
+			sshbuf_free(lists[i]);
+		free(lists);
+		if (!ok)
+			return (B_FALSE);
+		bunyan_log(BNY_DEBUG, "rebuilt identities answer", NULL);
+	}
+
+	if ((r = sshbuf_putb(e->output, ids_answer)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	return (B_TRUE);
+}
+
+/*
+ * Merges the replies to a fanned-out request which just wants a status
+ * back (lock, unlock, remove-all): we only report success if every token
+ * succeeded.
+ */
+static void
+merge_status(struct card_job *job)
+{
+	struct card_job *cj;
+	int r, success = 1;
+
+	for (cj = job->cj_children; cj != NULL; cj = cj->cj_sibling) {
+		if (cj->cj_failed)
+			success = 0;
+	}
+	if ((r = sshbuf_put_u32(job->cj_output, 1)) != 0 ||
+	    (r = sshbuf_put_u8(job->cj_output, success ?
+	    SSH_AGENT_SUCCESS : SSH_AGENT_FAILURE)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 }
 
 /* ssh2 only */
+/* Works out the hash to use for a signature, as for SSH2_AGENTC_SIGN_REQUEST */
+static enum sshdigest_types
+sign_hashalg(const struct sshkey *key, u_int flags)
+{
+	if (key->type == KEY_RSA) {
+		if (flags & SSH_AGENT_RSA_SHA2_256)
+			return (SSH_DIGEST_SHA256);
+		else if (flags & SSH_AGENT_RSA_SHA2_512)
+			return (SSH_DIGEST_SHA512);
+		return (SSH_DIGEST_SHA1);
+	} else if (key->type == KEY_ECDSA) {
+		switch (sshkey_curve_nid_to_bits(key->ecdsa_nid)) {
+		case 384:
+			return (SSH_DIGEST_SHA384);
+		case 521:
+			return (SSH_DIGEST_SHA512);
+		}
+	}
+	return (SSH_DIGEST_SHA256);
+}
+
 static errf_t *
-process_sign_request2(SocketEntry *e)
+process_sign_request2(struct agent_token *at, SocketEntry *e)
 {
 	const u_char *data;
 	u_char *signature = NULL;
@@ -645,34 +1802,31 @@ process_sign_request2(SocketEntry *e)
 	struct sshbuf *buf;
 	struct sshkey *key = NULL;
 	struct piv_slot *slot = NULL;
-	int found = 0;
+	const u_char *kblob;
+	size_t kblen;
 	enum sshdigest_types hashalg, ohashalg;
 	boolean_t canskip = B_TRUE;
 
 	if ((msg = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
-	if ((r = sshkey_froms(e->request, &key)) != 0 ||
+	/* kblob stays valid until e->request is next modified */
+	if ((r = sshbuf_peek_string_direct(e->request, &kblob, &kblen)) != 0 ||
+	    (r = sshkey_froms(e->request, &key)) != 0 ||
 	    (r = sshbuf_get_string_direct(e->request, &data, &dlen)) != 0 ||
 	    (r = sshbuf_get_u32(e->request, &flags)) != 0) {
 		err = parserrf("sshbuf_get_string", r);
 		goto out;
 	}
 
-	if ((err = agent_piv_open()))
+	if ((err = agent_piv_open(at)))
 		goto out;
 
-	while ((slot = piv_slot_next(selk, slot)) != NULL) {
-		if (sshkey_equal(piv_slot_pubkey(slot), key)) {
-			found = 1;
-			break;
-		}
-	}
-	if (!found || slot == NULL) {
-		agent_piv_close(B_FALSE);
+	if ((slot = agent_find_slot(at, kblob, kblen)) == NULL) {
+		agent_piv_close(at, B_FALSE);
 		err = errf("NotFoundError", NULL, "specified key not found");
 		goto out;
 	}
-	bunyan_add_vars(msg_log_frame,
+	bunyan_add_vars(at->at_log_frame,
 	    "slotid", BNY_UINT, (uint)piv_slot_id(slot), NULL);
 
 	if (piv_slot_id(slot) == PIV_SLOT_KEY_MGMT && !sign_9d) {
@@ -685,36 +1839,17 @@ process_sign_request2(SocketEntry *e)
 		canskip = B_FALSE;
 
 pin_again:
-	if ((err = agent_piv_try_pin(canskip))) {
-		agent_piv_close(B_TRUE);
+	if ((err = agent_piv_try_pin(at, canskip))) {
+		agent_piv_close(at, B_TRUE);
 		goto out;
 	}
-	if (key->type == KEY_RSA) {
-		hashalg = SSH_DIGEST_SHA1;
-		if (flags & SSH_AGENT_RSA_SHA2_256)
-			hashalg = SSH_DIGEST_SHA256;
-		else if (flags & SSH_AGENT_RSA_SHA2_512)
-			hashalg = SSH_DIGEST_SHA512;
-	} else if (key->type == KEY_ECDSA) {
-		switch (sshkey_curve_nid_to_bits(key->ecdsa_nid)) {
-		case 256:
-			hashalg = SSH_DIGEST_SHA256;
-			break;
-		case 384:
-			hashalg = SSH_DIGEST_SHA384;
-			break;
-		case 521:
-			hashalg = SSH_DIGEST_SHA512;
-			break;
-		default:
-			hashalg = SSH_DIGEST_SHA256;
-		}
-	}
+	hashalg = sign_hashalg(key, flags);
 	ohashalg = hashalg;
-	err = piv_sign(selk, slot, data, dlen, &hashalg, &rawsig, &rslen);
+	err = piv_sign(at->at_selk, slot, data, dlen, &hashalg, &rawsig,
+	    &rslen);
 
-	if (errf_caused_by(err, "PermissionError") && pin_len != 0 &&
-	    piv_token_is_ykpiv(selk) && canskip) {
+	if (errf_caused_by(err, "PermissionError") && at->at_pin_len != 0 &&
+	    piv_token_is_ykpiv(at->at_selk) && canskip) {
 		/*
 		 * On a Yubikey, slots other than 9C (SIGNATURE) can also be
 		 * set to "PIN Always" mode. We might have one, so try again
@@ -723,14 +1858,14 @@ pin_again:
 		canskip = B_FALSE;
 		goto pin_again;
 	} else if (errf_caused_by(err, "PermissionError")) {
-		agent_piv_close(B_TRUE);
+		agent_piv_close(at, B_TRUE);
 		err = nopinerrf(err);
 		goto out;
 	} else if (err) {
-		agent_piv_close(B_TRUE);
+		agent_piv_close(at, B_TRUE);
 		goto out;
 	}
-	agent_piv_close(B_FALSE);
+	agent_piv_close(at, B_FALSE);
 
 	if (hashalg != ohashalg) {
 		err = errf("HashMismatch", NULL,
@@ -786,21 +1921,38 @@ valid_pin(const char *pin)
 }
 
 static errf_t *
-process_remove_all_identities(SocketEntry *e)
+process_remove_all_identities(struct agent_token *at, SocketEntry *e)
 {
-	drop_pin();
+	drop_pin(at);
 	send_status(e, 1);
 	return (NULL);
 }
 
+/*
+ * How the main thread picks which token an extension request is sent to:
+ * by the key it names, by the box it carries, or (for those which don't
+ * care) just the first one.
+ */
+enum ext_route {
+	ROUTE_ANY = 0,
+	ROUTE_KEY,
+	ROUTE_BOX,
+	ROUTE_BOXES,		/* u32 count, then boxes as for ROUTE_BOX */
+	ROUTE_EBOX		/* a whole ebox, by the first part we hold */
+};
+
 struct exthandler {
 	const char *eh_name;
-	errf_t *(*eh_handler)(SocketEntry *, struct sshbuf *);
+	errf_t *(*eh_handler)(struct agent_token *, SocketEntry *,
+	    struct sshbuf *);
+	enum ext_route eh_route;
 };
 struct exthandler exthandlers[];
+static const char *msg_type_to_name(int);
 
 static errf_t *
-process_ext_ecdh(SocketEntry *e, struct sshbuf *buf)
+process_ext_ecdh(struct agent_token *at, SocketEntry *e,
+    struct sshbuf *buf)
 {
 	int r;
 	errf_t *err;
@@ -811,12 +1963,14 @@ process_ext_ecdh(SocketEntry *e, struct sshbuf *buf)
 	uint8_t *secret;
 	size_t seclen;
 	uint flags;
-	int found = 0;
+	const u_char *kblob;
+	size_t kblen;
 	boolean_t canskip = B_TRUE;
 
 	if ((msg = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
-	if ((r = sshkey_froms(buf, &key)) ||
+	if ((r = sshbuf_peek_string_direct(buf, &kblob, &kblen)) ||
+	    (r = sshkey_froms(buf, &key)) ||
 	    (r = sshkey_froms(buf, &partner))) {
 		err = parserrf("sshkey_froms", r);
 		goto out;
@@ -831,25 +1985,19 @@ process_ext_ecdh(SocketEntry *e, struct sshbuf *buf)
 		goto out;
 	}
 
-	if ((err = agent_piv_open()))
+	if ((err = agent_piv_open(at)))
 		goto out;
 
-	while ((slot = piv_slot_next(selk, slot)) != NULL) {
-		if (sshkey_equal(piv_slot_pubkey(slot), key) == 1) {
-			found = 1;
-			break;
-		}
-	}
-	if (!found) {
-		agent_piv_close(B_FALSE);
+	if ((slot = agent_find_slot(at, kblob, kblen)) == NULL) {
+		agent_piv_close(at, B_FALSE);
 		err = errf("NotFoundError", NULL, "specified key not found");
 		goto out;
 	}
-	bunyan_add_vars(msg_log_frame,
+	bunyan_add_vars(at->at_log_frame,
 	    "slotid", BNY_UINT, (uint)piv_slot_id(slot), NULL);
 
 	if (key->type != KEY_ECDSA || partner->type != KEY_ECDSA) {
-		agent_piv_close(B_FALSE);
+		agent_piv_close(at, B_FALSE);
 		err = errf("InvalidKeysError", NULL,
 		    "keys are not both EC keys (%s and %s)",
 		    sshkey_type(key), sshkey_type(partner));
@@ -860,25 +2008,25 @@ process_ext_ecdh(SocketEntry *e, struct sshbuf *buf)
 		canskip = B_FALSE;
 
 pin_again:
-	if ((err = agent_piv_try_pin(canskip))) {
-		agent_piv_close(B_TRUE);
+	if ((err = agent_piv_try_pin(at, canskip))) {
+		agent_piv_close(at, B_TRUE);
 		goto out;
 	}
-	err = piv_ecdh(selk, slot, partner, &secret, &seclen);
-	if (errf_caused_by(err, "PermissionError") && pin_len != 0 &&
-	    piv_token_is_ykpiv(selk) && canskip) {
+	err = piv_ecdh(at->at_selk, slot, partner, &secret, &seclen);
+	if (errf_caused_by(err, "PermissionError") && at->at_pin_len != 0 &&
+	    piv_token_is_ykpiv(at->at_selk) && canskip) {
 		/* Yubikey can have slots other than 9C as "PIN Always" */
 		canskip = B_FALSE;
 		goto pin_again;
 	} else if (errf_caused_by(err, "PermissionError")) {
-		agent_piv_close(B_TRUE);
+		agent_piv_close(at, B_TRUE);
 		err = nopinerrf(err);
 		goto out;
 	} else if (err) {
-		agent_piv_close(B_TRUE);
+		agent_piv_close(at, B_TRUE);
 		goto out;
 	}
-	agent_piv_close(B_FALSE);
+	agent_piv_close(at, B_FALSE);
 
 	if ((r = sshbuf_put_u8(msg, SSH_AGENT_SUCCESS)) != 0 ||
 	    (r = sshbuf_put_string(msg, secret, seclen)) != 0)
@@ -896,33 +2044,51 @@ out:
 	return (err);
 }
 
+/*
+ * One box to be re-wrapped, as sent in an ecdh-rebox@joyent.com request (or
+ * as one item of an ecdh-rebox-batch@joyent.com request).
+ */
+struct rebox_item {
+	uint8_t ri_hash[32];		/* for the box cache */
+	struct sshbuf *ri_guidb;
+	uint8_t ri_slotid;
+	struct sshkey *ri_partner;
+	struct piv_ecdh_box *ri_box;
+	struct piv_slot *ri_slot;
+	uint8_t *ri_secret;
+	size_t ri_seclen;
+	errf_t *ri_err;
+};
+
+static void
+rebox_item_free(struct rebox_item *ri)
+{
+	piv_box_free(ri->ri_box);
+	freezero_conceal(ri->ri_secret, ri->ri_seclen);
+	sshkey_free(ri->ri_partner);
+	sshbuf_free(ri->ri_guidb);
+	errf_free(ri->ri_err);
+	bzero(ri, sizeof (*ri));
+}
+
 static errf_t *
-process_ext_rebox(SocketEntry *e, struct sshbuf *buf)
+rebox_item_parse(struct sshbuf *buf, struct rebox_item *ri)
 {
 	int r;
 	errf_t *err;
-	struct sshbuf *msg, *boxbuf = NULL, *guidb = NULL;
-	struct sshkey *partner = NULL;
-	struct piv_ecdh_box *box = NULL, *newbox = NULL;
-	uint8_t slotid;
+	struct sshbuf *boxbuf = NULL;
 	uint flags;
-	struct piv_slot *slot;
-	struct piv_token *tk;
-	uint8_t *secret = NULL, *out = NULL;
-	size_t seclen, outlen;
 
-	if ((msg = sshbuf_new()) == NULL)
-		fatal("%s: sshbuf_new failed", __func__);
 	if ((r = sshbuf_froms(buf, &boxbuf)) != 0 ||
-	    (r = sshbuf_froms(buf, &guidb)) != 0) {
+	    (r = sshbuf_froms(buf, &ri->ri_guidb)) != 0) {
 		err = parserrf("sshbuf_froms", r);
 		goto out;
 	}
-	if ((r = sshbuf_get_u8(buf, &slotid)) != 0) {
+	if ((r = sshbuf_get_u8(buf, &ri->ri_slotid)) != 0) {
 		err = parserrf("sshbuf_get_u8(slotid)", r);
 		goto out;
 	}
-	if ((r = sshkey_froms(buf, &partner)) != 0) {
+	if ((r = sshkey_froms(buf, &ri->ri_partner)) != 0) {
 		err = parserrf("sshkey_froms(partner)", r);
 		goto out;
 	}
@@ -936,45 +2102,172 @@ process_ext_rebox(SocketEntry *e, struct sshbuf *buf)
 		goto out;
 	}
 
-	err = sshbuf_get_piv_box(boxbuf, &box);
+	if (box_cache_ttl != 0) {
+		VERIFY0(ssh_digest_memory(SSH_DIGEST_SHA256,
+		    sshbuf_ptr(boxbuf), sshbuf_len(boxbuf), ri->ri_hash,
+		    sizeof (ri->ri_hash)));
+	}
+	err = sshbuf_get_piv_box(boxbuf, &ri->ri_box);
+
+out:
+	sshbuf_free(boxbuf);
+	return (err);
+}
+
+/*
+ * If the box in ri was opened recently, fills in its plaintext from the box
+ * cache and returns B_TRUE. Should be called after rebox_item_find(), so
+ * we know the box is for this token.
+ */
+static boolean_t
+rebox_item_cached(struct agent_token *at, struct rebox_item *ri)
+{
+	struct box_cache_ent *bce;
+	uint64_t now = monotime();
+	boolean_t hit = B_FALSE;
+
+	if (box_cache_ttl == 0)
+		return (B_FALSE);
+	VERIFY0(pthread_mutex_lock(&at->at_bcache_mtx));
+	for (bce = at->at_bcache; bce != NULL; bce = bce->bce_next) {
+		if (now >= bce->bce_expiry)
+			continue;
+		if (timingsafe_bcmp(bce->bce_hash, ri->ri_hash,
+		    sizeof (bce->bce_hash)) != 0)
+			continue;
+		ri->ri_secret = zalloc_conceal(bce->bce_len);
+		VERIFY(ri->ri_secret != NULL);
+		bcopy(bce->bce_data, ri->ri_secret, bce->bce_len);
+		ri->ri_seclen = bce->bce_len;
+		hit = B_TRUE;
+		break;
+	}
+	VERIFY0(pthread_mutex_unlock(&at->at_bcache_mtx));
+	if (hit)
+		bunyan_log(BNY_DEBUG, "box opened from cache", NULL);
+	return (hit);
+}
+
+/* Remembers the plaintext of a box we just opened. */
+static void
+rebox_item_cache(struct agent_token *at, const struct rebox_item *ri)
+{
+	struct box_cache_ent *bce;
+
+	if (box_cache_ttl == 0)
+		return;
+	bce = calloc(1, sizeof (*bce));
+	VERIFY(bce != NULL);
+	bce->bce_data = zalloc_conceal(ri->ri_seclen);
+	VERIFY(bce->bce_data != NULL);
+	bcopy(ri->ri_secret, bce->bce_data, ri->ri_seclen);
+	bce->bce_len = ri->ri_seclen;
+	bcopy(ri->ri_hash, bce->bce_hash, sizeof (bce->bce_hash));
+	bce->bce_expiry = monotime() + box_cache_ttl;
+
+	VERIFY0(pthread_mutex_lock(&at->at_bcache_mtx));
+	bce->bce_next = at->at_bcache;
+	at->at_bcache = bce;
+	++at->at_bcache_n;
+	VERIFY0(pthread_mutex_unlock(&at->at_bcache_mtx));
+
+	box_cache_trim(at, box_cache_max);
+}
+
+/* Must be called without a transaction open: see piv_box_find_token(). */
+static errf_t *
+rebox_item_find(struct agent_token *at, struct rebox_item *ri)
+{
+	errf_t *err;
+	struct piv_token *tk;
+
+	err = piv_box_find_token(at->at_selk, ri->ri_box, &tk, &ri->ri_slot);
 	if (err)
+		return (err);
+	if (tk != at->at_selk) {
+		return (errf("WrongTokenError", NULL, "box can only be "
+		    "unlocked by a different PIV device"));
+	}
+	return (ERRF_OK);
+}
+
+/* Must be called with the txn open and PIN verified. */
+static errf_t *
+rebox_item_open(struct agent_token *at, struct rebox_item *ri)
+{
+	errf_t *err;
+
+	if ((err = piv_box_open(at->at_selk, ri->ri_slot, ri->ri_box)))
+		return (err);
+	VERIFY0(piv_box_take_data(ri->ri_box, &ri->ri_secret,
+	    &ri->ri_seclen));
+	rebox_item_cache(at, ri);
+	return (ERRF_OK);
+}
+
+static errf_t *
+rebox_item_seal(struct rebox_item *ri, uint8_t **out, size_t *outlen)
+{
+	errf_t *err;
+	struct piv_ecdh_box *newbox;
+
+	newbox = piv_box_new();
+	VERIFY(newbox != NULL);
+
+	if (sshbuf_len(ri->ri_guidb) > 0) {
+		piv_box_set_guid(newbox, sshbuf_ptr(ri->ri_guidb), GUID_LEN);
+		piv_box_set_slot(newbox, ri->ri_slotid);
+	}
+	VERIFY0(piv_box_set_data(newbox, ri->ri_secret, ri->ri_seclen));
+	if ((err = piv_box_seal_offline(ri->ri_partner, newbox)))
 		goto out;
 
-	err = piv_box_find_token(selk, box, &tk, &slot);
-	if (err)
+	VERIFY0(piv_box_to_binary(newbox, out, outlen));
+
+out:
+	piv_box_free(newbox);
+	return (err);
+}
+
+static errf_t *
+process_ext_rebox(struct agent_token *at, SocketEntry *e,
+    struct sshbuf *buf)
+{
+	int r;
+	errf_t *err;
+	struct sshbuf *msg;
+	struct rebox_item ri;
+	uint8_t *out = NULL;
+	size_t outlen;
+
+	bzero(&ri, sizeof (ri));
+	if ((msg = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+
+	if ((err = rebox_item_parse(buf, &ri)))
 		goto out;
-	if (tk != selk) {
-		err = errf("WrongTokenError", NULL, "box can only be unlocked "
-		    "by a different PIV device");
+	if ((err = rebox_item_find(at, &ri)))
 		goto out;
-	}
 
-	if ((err = agent_piv_open()))
+	if (rebox_item_cached(at, &ri))
+		goto seal;
+	if ((err = agent_piv_open(at)))
 		goto out;
-	if ((err = agent_piv_try_pin(B_FALSE))) {
-		agent_piv_close(B_TRUE);
+	if ((err = agent_piv_try_pin(at, B_FALSE))) {
+		agent_piv_close(at, B_TRUE);
 		goto out;
 	}
-	if ((err = piv_box_open(selk, slot, box))) {
-		agent_piv_close(B_TRUE);
+	if ((err = rebox_item_open(at, &ri))) {
+		agent_piv_close(at, B_TRUE);
 		goto out;
 	}
-	VERIFY0(piv_box_take_data(box, &secret, &seclen));
-	agent_piv_close(B_FALSE);
+	agent_piv_close(at, B_FALSE);
 
-	newbox = piv_box_new();
-	VERIFY(newbox != NULL);
+seal:
 
-	if (sshbuf_len(guidb) > 0) {
-		piv_box_set_guid(newbox, sshbuf_ptr(guidb), GUID_LEN);
-		piv_box_set_slot(newbox, slotid);
-	}
-	VERIFY0(piv_box_set_data(newbox, secret, seclen));
-	if ((err = piv_box_seal_offline(partner, newbox)))
+	if ((err = rebox_item_seal(&ri, &out, &outlen)))
 		goto out;
 
-	VERIFY0(piv_box_to_binary(newbox, &out, &outlen));
-
 	if ((r = sshbuf_put_u8(msg, SSH_AGENT_SUCCESS)) != 0 ||
 	    (r = sshbuf_put_string(msg, out, outlen)) != 0)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
@@ -983,295 +2276,1973 @@ process_ext_rebox(SocketEntry *e, struct sshbuf *buf)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 
 out:
-	piv_box_free(box);
-	piv_box_free(newbox);
-	if (secret != NULL) {
-		explicit_bzero(secret, seclen);
-		free(secret);
-	}
+	rebox_item_free(&ri);
 	if (out != NULL) {
 		explicit_bzero(out, outlen);
 		free(out);
 	}
 	sshbuf_free(msg);
-	sshkey_free(partner);
-	sshbuf_free(boxbuf);
-	sshbuf_free(guidb);
 	return (err);
 }
 
+#define	REBOX_BATCH_MAX		1024
+
+/*
+ * Opens (or fetches from the box cache) each of "ris" which is for this
+ * token, all under one transaction and one PIN verify. Per-box failures
+ * are left in ri_err; the return value is only for failures that affect
+ * the whole set (e.g. the card went away, or the PIN was wrong).
+ */
 static errf_t *
-process_ext_x509_certs(SocketEntry *e, struct sshbuf *buf)
+rebox_items_open(struct agent_token *at, struct rebox_item *ris, uint32_t n)
 {
-	/*int r;
-	struct sshbuf *msg;*/
-	return (errf("NotImplementedError", NULL,
-	    "x509 certs ext not implemented yet"));
+	errf_t *err;
+	uint32_t i;
+	uint nopen = 0;
+
+	/*
+	 * piv_box_find_token() can need to read a cert, which it does in
+	 * its own txn, so this has to happen before we open ours.
+	 */
+	if (at->at_selk == NULL) {
+		if ((err = agent_piv_open(at)))
+			return (err);
+		agent_piv_close(at, B_TRUE);
+	}
+	for (i = 0; i < n; ++i) {
+		if (ris[i].ri_err != ERRF_OK)
+			continue;
+		ris[i].ri_err = rebox_item_find(at, &ris[i]);
+		if (ris[i].ri_err == ERRF_OK && !rebox_item_cached(at, &ris[i]))
+			++nopen;
+	}
+	if (nopen == 0)
+		return (ERRF_OK);
+
+	if ((err = agent_piv_open(at)))
+		return (err);
+	if ((err = agent_piv_try_pin(at, B_FALSE))) {
+		agent_piv_close(at, B_TRUE);
+		return (err);
+	}
+	for (i = 0; i < n; ++i) {
+		if (ris[i].ri_err != ERRF_OK || ris[i].ri_secret != NULL)
+			continue;
+		ris[i].ri_err = rebox_item_open(at, &ris[i]);
+	}
+	agent_piv_close(at, B_FALSE);
+
+	return (ERRF_OK);
 }
 
+/*
+ * Like ecdh-rebox@joyent.com, but for many boxes at once, all under one
+ * transaction and one PIN verify. The request is a u32 count followed by
+ * that many ecdh-rebox@joyent.com requests. The reply has a u32 count and
+ * then for each box in order either u8 0 and the new box, or u8 1 and the
+ * name and message of the error for that box.
+ *
+ * The request is routed to the token holding the first box. Boxes for any
+ * other token fail with WrongTokenError, so callers with boxes for several
+ * tokens should send one batch per token.
+ */
 static errf_t *
-process_ext_attest(SocketEntry *e, struct sshbuf *buf)
+process_ext_rebox_batch(struct agent_token *at, SocketEntry *e,
+    struct sshbuf *buf)
 {
 	int r;
-	errf_t *err;
+	errf_t *err = ERRF_OK;
 	struct sshbuf *msg;
-	struct sshkey *key = NULL;
-	struct piv_slot *slot = NULL;
-	uint8_t *cert = NULL, *chain = NULL, *ptr;
-	size_t certlen, chainlen = 0, len;
-	uint flags;
-	int found = 0;
-	uint tag;
-	struct tlv_state *tlv = NULL;
+	struct rebox_item *ris = NULL;
+	uint32_t n, i;
+	uint8_t *out;
+	size_t outlen;
 
 	if ((msg = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
-	if ((r = sshkey_froms(buf, &key)) != 0 ||
-	    (r = sshbuf_get_u32(buf, &flags)) != 0) {
-		err = parserrf("sshkey_froms", r);
-		goto out;
-	}
 
-	if (flags != 0) {
-		err = flagserrf(flags);
-		goto out;
-	}
-
-	if ((err = agent_piv_open()))
-		goto out;
-
-	while ((slot = piv_slot_next(selk, slot)) != NULL) {
-		if (sshkey_equal(piv_slot_pubkey(slot), key)) {
-			found = 1;
-			break;
-		}
-	}
-	if (!found) {
-		agent_piv_close(B_FALSE);
-		err = errf("NotFoundError", NULL, "specified key not found");
+	if ((r = sshbuf_get_u32(buf, &n)) != 0) {
+		err = parserrf("sshbuf_get_u32(count)", r);
 		goto out;
 	}
-	bunyan_add_vars(msg_log_frame,
-	    "slotid", BNY_UINT, (uint)piv_slot_id(slot), NULL);
-
-	err = ykpiv_attest(selk, slot, &cert, &certlen);
-	if (err) {
-		agent_piv_close(B_TRUE);
+	if (n > REBOX_BATCH_MAX) {
+		err = errf("ArgumentError", NULL, "too many boxes in batch "
+		    "(%u, max is %u)", n, REBOX_BATCH_MAX);
+		n = 0;
 		goto out;
 	}
-	err = piv_read_file(selk, PIV_TAG_CERT_YK_ATTESTATION, &chain, &chainlen);
-	if (err) {
-		agent_piv_close(B_TRUE);
-		goto out;
+	ris = calloc(n + 1, sizeof (struct rebox_item));
+	VERIFY(ris != NULL);
+	for (i = 0; i < n; ++i) {
+		if ((err = rebox_item_parse(buf, &ris[i])))
+			goto out;
 	}
-	agent_piv_close(B_FALSE);
 
-	tlv = tlv_init(chain, 0, chainlen);
-	if ((err = tlv_read_tag(tlv, &tag)))
-		goto out;
-	if (tag != 0x70) {
-		err = errf("InvalidDataError", NULL, "PIV device returned "
-		    "wrong tag at start of attestation cert");
+	if ((err = rebox_items_open(at, ris, n)))
 		goto out;
-	}
-	ptr = tlv_ptr(tlv);
-	len = tlv_rem(tlv);
-	tlv_skip(tlv);
 
 	if ((r = sshbuf_put_u8(msg, SSH_AGENT_SUCCESS)) != 0 ||
-	    (r = sshbuf_put_u32(msg, 2)) != 0)
-		fatal("%s: buffer error: %s", __func__, ssh_err(r));
-
-	if ((r = sshbuf_put_string(msg, cert, certlen)) != 0 ||
-	    (r = sshbuf_put_string(msg, ptr, len)) != 0)
+	    (r = sshbuf_put_u32(msg, n)) != 0)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	for (i = 0; i < n; ++i) {
+		if (ris[i].ri_err == ERRF_OK)
+			ris[i].ri_err = rebox_item_seal(&ris[i], &out, &outlen);
+		if (ris[i].ri_err != ERRF_OK) {
+			bunyan_log(BNY_DEBUG, "failed to rebox batch item",
+			    "item", BNY_UINT, i,
+			    "error", BNY_ERF, ris[i].ri_err, NULL);
+			if ((r = sshbuf_put_u8(msg, 1)) != 0 ||
+			    (r = sshbuf_put_cstring(msg,
+			    errf_name(ris[i].ri_err))) != 0 ||
+			    (r = sshbuf_put_cstring(msg,
+			    errf_message(ris[i].ri_err))) != 0)
+				fatal("%s: buffer error: %s", __func__,
+				    ssh_err(r));
+			continue;
+		}
+		if ((r = sshbuf_put_u8(msg, 0)) != 0 ||
+		    (r = sshbuf_put_string(msg, out, outlen)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		explicit_bzero(out, outlen);
+		free(out);
+	}
 
 	if ((r = sshbuf_put_stringb(e->output, msg)) != 0)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 
 out:
-	if (tlv != NULL)
-		tlv_free(tlv);
-	free(cert);
-	piv_file_data_free(chain, chainlen);
+	for (i = 0; ris != NULL && i < n; ++i)
+		rebox_item_free(&ris[i]);
+	free(ris);
 	sshbuf_free(msg);
-	sshkey_free(key);
 	return (err);
 }
 
+/*
+ * Sets up "ri" to re-wrap the part box "box" of an ebox to "partner", just
+ * as if it had come in an ecdh-rebox@joyent.com request.
+ */
 static errf_t *
-process_ext_query(SocketEntry *e, struct sshbuf *buf)
+rebox_item_from_part(struct rebox_item *ri, struct piv_ecdh_box *box,
+    const struct sshkey *partner)
 {
-	int r, n = 0;
-	struct exthandler *h;
-	struct sshbuf *msg;
+	int r;
+	errf_t *err = ERRF_OK;
+	struct sshbuf *boxbuf;
 
-	if ((msg = sshbuf_new()) == NULL)
+	if ((boxbuf = sshbuf_new()) == NULL ||
+	    (ri->ri_guidb = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
+	if ((r = sshkey_demote(partner, &ri->ri_partner)) != 0)
+		fatal("%s: sshkey_demote failed: %s", __func__, ssh_err(r));
 
-	for (h = exthandlers; h->eh_name != NULL; ++h)
-		++n;
-
-	if ((r = sshbuf_put_u8(msg, SSH_AGENT_SUCCESS)) != 0 ||
-	    (r = sshbuf_put_u32(msg, n)) != 0)
-		fatal("%s: buffer error: %s", __func__, ssh_err(r));
-	for (h = exthandlers; h->eh_name != NULL; ++h) {
-		if ((r = sshbuf_put_cstring(msg, h->eh_name)) != 0)
+	if (piv_box_has_guidslot(box)) {
+		if ((r = sshbuf_put(ri->ri_guidb, piv_box_guid(box),
+		    GUID_LEN)) != 0)
 			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		ri->ri_slotid = piv_box_slot(box);
 	}
 
-	if ((r = sshbuf_put_stringb(e->output, msg)) != 0)
-		fatal("%s: buffer error: %s", __func__, ssh_err(r));
-	sshbuf_free(msg);
-
-	return (NULL);
-}
+	/*
+	 * Round-trip the box through its wire form rather than cloning it,
+	 * so that it ends up exactly as rebox_item_parse() would have left
+	 * it (and hashes the same, to share the cache).
+	 */
+	if ((err = sshbuf_put_piv_box(boxbuf, box)))
+		goto out;
+	if (box_cache_ttl != 0) {
+		VERIFY0(ssh_digest_memory(SSH_DIGEST_SHA256,
+		    sshbuf_ptr(boxbuf), sshbuf_len(boxbuf), ri->ri_hash,
+		    sizeof (ri->ri_hash)));
+	}
+	err = sshbuf_get_piv_box(boxbuf, &ri->ri_box);
 
-struct exthandler exthandlers[] = {
-	{ "query", process_ext_query },
-	{ "ecdh@joyent.com", process_ext_ecdh },
-	{ "ecdh-rebox@joyent.com", process_ext_rebox },
-	{ "x509-certs@joyent.com", process_ext_x509_certs },
-	{ "ykpiv-attest@joyent.com", process_ext_attest },
-	{ NULL, NULL }
+out:
+	sshbuf_free(boxbuf);
+	return (err);
+}
+
+#define	EBOX_UNLOCK_MAX_PARTS	256
+
+/* Only look at primary configs (don't go on to recovery shares). */
+#define	EBOX_UNLOCK_F_PRIMARY	(1 << 0)
+
+struct ebox_unlock_ref {
+	uint32_t	eur_config;
+	uint32_t	eur_part;
 };
 
+/*
+ * Unlocks a whole ebox in one request, rather than one ecdh-rebox@joyent.com
+ * per part. The request is:
+ *
+ *   string	ebox (as written by sshbuf_put_ebox(), any version)
+ *   string	partner public key blob (EC)
+ *   u32	flags (EBOX_UNLOCK_F_*)
+ *
+ * We open every primary config part on this token, all under one
+ * transaction and PIN verify. If there aren't any (and the request didn't
+ * set EBOX_UNLOCK_F_PRIMARY), we open every recovery config part on this
+ * token instead, which gives the caller our share of each recovery config.
+ * The reply is:
+ *
+ *   byte	SSH_AGENT_SUCCESS
+ *   u32	count
+ *   count * {
+ *     u32	config index (in the order of ebox_next_config())
+ *     u32	part index (in the order of ebox_config_next_part())
+ *     string	new box holding the part's data, sealed to the partner key
+ *   }
+ *
+ * The caller puts each part's data back into its own copy of the ebox and
+ * runs ebox_unlock() or ebox_recover() on it. Parts that we can't open are
+ * left out; if there are none at all, the request fails.
+ */
 static errf_t *
-process_extension(SocketEntry *e)
+process_ext_ebox_unlock(struct agent_token *at, SocketEntry *e,
+    struct sshbuf *buf)
 {
-	errf_t *err;
 	int r;
-	char *extname = NULL;
-	size_t enlen;
-	struct sshbuf *inner = NULL;
-	struct exthandler *h, *hdlr = NULL;
+	errf_t *err = ERRF_OK;
+	struct sshbuf *msg, *eboxbuf = NULL;
+	struct ebox *ebox = NULL;
+	struct ebox_config *config;
+	struct ebox_part *part;
+	struct sshkey *partner = NULL;
+	struct rebox_item *ris = NULL;
+	struct ebox_unlock_ref *refs = NULL;
+	enum ebox_config_type type;
+	uint32_t n = 0, nprimary = 0, nout = 0, i, ci, pi, pass;
+	uint flags;
+	uint8_t *out;
+	size_t outlen;
 
-	if ((r = sshbuf_get_cstring(e->request, &extname, &enlen)))
-		return (parserrf("sshbuf_get_cstring", r));
+	if ((msg = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
 
-	if ((r = sshbuf_froms(e->request, &inner))) {
+	if ((r = sshbuf_froms(buf, &eboxbuf)) != 0) {
 		err = parserrf("sshbuf_froms", r);
 		goto out;
 	}
-	VERIFY(extname != NULL);
-	VERIFY(inner != NULL);
+	if ((r = sshkey_froms(buf, &partner)) != 0) {
+		err = parserrf("sshkey_froms(partner)", r);
+		goto out;
+	}
+	if ((r = sshbuf_get_u32(buf, &flags)) != 0) {
+		err = parserrf("sshbuf_get_u32(flags)", r);
+		goto out;
+	}
+	if ((flags & ~EBOX_UNLOCK_F_PRIMARY) != 0) {
+		err = flagserrf(flags);
+		goto out;
+	}
+	if ((err = sshbuf_get_ebox(eboxbuf, &ebox)))
+		goto out;
 
-	for (h = exthandlers; h->eh_name != NULL; ++h) {
-		if (strcmp(h->eh_name, extname) == 0) {
-			hdlr = h;
-			break;
+	config = NULL;
+	while ((config = ebox_next_config(ebox, config)) != NULL) {
+		part = NULL;
+		while ((part = ebox_config_next_part(config, part)) != NULL)
+			++n;
+	}
+	if (n > EBOX_UNLOCK_MAX_PARTS) {
+		err = errf("ArgumentError", NULL, "too many parts in ebox "
+		    "(%u, max is %u)", n, EBOX_UNLOCK_MAX_PARTS);
+		n = 0;
+		goto out;
+	}
+	ris = calloc(n + 1, sizeof (struct rebox_item));
+	refs = calloc(n + 1, sizeof (struct ebox_unlock_ref));
+	VERIFY(ris != NULL && refs != NULL);
+
+	/*
+	 * Primary config parts go first in ris[], so that we can open just
+	 * those and only go on to the recovery parts if none of them are
+	 * ours.
+	 */
+	i = 0;
+	for (pass = 0; pass < 2; ++pass) {
+		config = NULL;
+		for (ci = 0; (config = ebox_next_config(ebox, config)) != NULL;
+		    ++ci) {
+			type = ebox_tpl_config_type(ebox_config_tpl(config));
+			if ((type == EBOX_PRIMARY) != (pass == 0))
+				continue;
+			part = NULL;
+			for (pi = 0; (part = ebox_config_next_part(config,
+			    part)) != NULL; ++pi) {
+				refs[i].eur_config = ci;
+				refs[i].eur_part = pi;
+				err = rebox_item_from_part(&ris[i],
+				    ebox_part_box(part), partner);
+				++i;
+				if (err)
+					goto out;
+			}
 		}
+		if (pass == 0)
+			nprimary = i;
 	}
-	if (hdlr == NULL) {
-		err = errf("UnknownExtension", NULL,
-		    "unsupported extension '%s'", extname);
+	VERIFY3U(i, ==, n);
+
+	if ((err = rebox_items_open(at, ris, nprimary)))
 		goto out;
+	for (i = 0; i < nprimary; ++i) {
+		if (ris[i].ri_err == ERRF_OK && ris[i].ri_secret != NULL)
+			++nout;
+	}
+	if (nout == 0 && !(flags & EBOX_UNLOCK_F_PRIMARY)) {
+		if ((err = rebox_items_open(at, &ris[nprimary], n - nprimary)))
+			goto out;
+		for (i = nprimary; i < n; ++i) {
+			if (ris[i].ri_err == ERRF_OK &&
+			    ris[i].ri_secret != NULL)
+				++nout;
+		}
 	}
 
-	bunyan_add_vars(msg_log_frame,
-	    "extension", BNY_STRING, h->eh_name, NULL);
-	err = hdlr->eh_handler(e, inner);
+	if (nout == 0) {
+		for (i = 0; i < n && err == ERRF_OK; ++i) {
+			err = ris[i].ri_err;
+			ris[i].ri_err = ERRF_OK;
+		}
+		err = errf("NotFoundError", err, "no part of this ebox can be "
+		    "unlocked by this PIV device");
+		goto out;
+	}
+	bunyan_log(BNY_DEBUG, "opened ebox parts",
+	    "count", BNY_UINT, (uint)nout, NULL);
 
-	if (err) {
-		send_extfail(e);
-		bunyan_log(BNY_WARN, "failed to process extension command",
-		    "error", BNY_ERF, err, NULL);
-		if (errf_caused_by(err, "NoPINError") &&
-		    bunyan_get_level() > BNY_WARN) {
-			warnfx(err, "denied command due to lack of PIN");
+	if ((r = sshbuf_put_u8(msg, SSH_AGENT_SUCCESS)) != 0 ||
+	    (r = sshbuf_put_u32(msg, nout)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	for (i = 0; i < n; ++i) {
+		if (ris[i].ri_err != ERRF_OK || ris[i].ri_secret == NULL)
+			continue;
+		if ((err = rebox_item_seal(&ris[i], &out, &outlen)))
+			goto out;
+		if ((r = sshbuf_put_u32(msg, refs[i].eur_config)) != 0 ||
+		    (r = sshbuf_put_u32(msg, refs[i].eur_part)) != 0 ||
+		    (r = sshbuf_put_string(msg, out, outlen)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		explicit_bzero(out, outlen);
+		free(out);
+	}
+
+	if ((r = sshbuf_put_stringb(e->output, msg)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+
+out:
+	for (i = 0; ris != NULL && i < n; ++i)
+		rebox_item_free(&ris[i]);
+	free(ris);
+	free(refs);
+	ebox_free(ebox);
+	sshkey_free(partner);
+	sshbuf_free(eboxbuf);
+	sshbuf_free(msg);
+	return (err);
+}
+
+/*
+ * Returns the certificates on the card holding the given key, from the slot
+ * state we already have (so this never talks to the card). The request is:
+ *
+ *   string	key blob (any key on the card, used to pick the card)
+ *   u32	flags (must be 0)
+ *   string	slot IDs, one byte each (empty for every slot)
+ *
+ * and the reply is:
+ *
+ *   byte	SSH_AGENT_SUCCESS
+ *   string	GUID of the card
+ *   u32	count
+ *   count * {
+ *     byte	slot ID
+ *     string	public key blob
+ *     string	certificate (DER)
+ *   }
+ *
+ * Slots that were restored from the state cache and haven't been re-read
+ * since have no certificate loaded, and are left out (as are any of the
+ * requested slots that are empty).
+ */
+static errf_t *
+process_ext_x509_certs(struct agent_token *at, SocketEntry *e,
+    struct sshbuf *buf)
+{
+	int r;
+	errf_t *err = ERRF_OK;
+	struct sshbuf *msg, *certs;
+	struct piv_slot *slot = NULL;
+	const u_char *kblob, *slots;
+	size_t kblen, nslots, i;
+	uint flags, n = 0;
+	const uint8_t *der;
+	size_t derlen;
+
+	if ((msg = sshbuf_new()) == NULL || (certs = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((r = sshbuf_get_string_direct(buf, &kblob, &kblen)) ||
+	    (r = sshbuf_get_u32(buf, &flags)) ||
+	    (r = sshbuf_get_string_direct(buf, &slots, &nslots))) {
+		err = parserrf("sshbuf_get_string", r);
+		goto out;
+	}
+
+	if (flags != 0) {
+		err = flagserrf(flags);
+		goto out;
+	}
+
+	if (at->at_selk == NULL || agent_find_slot(at, kblob, kblen) == NULL) {
+		err = errf("NotFoundError", NULL, "specified key not found");
+		goto out;
+	}
+
+	while ((slot = piv_slot_next(at->at_selk, slot)) != NULL) {
+		if (nslots > 0) {
+			for (i = 0; i < nslots; ++i) {
+				if (slots[i] == piv_slot_id(slot))
+					break;
+			}
+			if (i == nslots)
+				continue;
+		}
+		/* Straight from the card, so no need to decode the X509. */
+		if ((der = piv_slot_cert_der(slot, &derlen)) == NULL)
+			continue;
+		if ((r = sshbuf_put_u8(certs, piv_slot_id(slot))) ||
+		    (r = sshkey_puts(piv_slot_pubkey(slot), certs)) ||
+		    (r = sshbuf_put_string(certs, der, derlen)))
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		++n;
+	}
+
+	if ((r = sshbuf_put_u8(msg, SSH_AGENT_SUCCESS)) ||
+	    (r = sshbuf_put_string(msg, piv_token_guid(at->at_selk),
+	    GUID_LEN)) ||
+	    (r = sshbuf_put_u32(msg, n)) ||
+	    (r = sshbuf_putb(msg, certs)))
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+
+	if ((r = sshbuf_put_stringb(e->output, msg)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+
+out:
+	sshbuf_free(certs);
+	sshbuf_free(msg);
+	return (err);
+}
+
+static errf_t *
+process_ext_attest(struct agent_token *at, SocketEntry *e,
+    struct sshbuf *buf)
+{
+	int r;
+	errf_t *err;
+	struct sshbuf *msg;
+	struct sshkey *key = NULL;
+	struct piv_slot *slot = NULL;
+	uint8_t *cert = NULL, *chain = NULL, *ptr;
+	size_t certlen, chainlen = 0, len;
+	uint flags;
+	const u_char *kblob;
+	size_t kblen;
+	uint tag;
+	struct tlv_state *tlv = NULL;
+	struct attest_cache_ent *ace;
+
+	if ((msg = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((r = sshbuf_peek_string_direct(buf, &kblob, &kblen)) != 0 ||
+	    (r = sshkey_froms(buf, &key)) != 0 ||
+	    (r = sshbuf_get_u32(buf, &flags)) != 0) {
+		err = parserrf("sshkey_froms", r);
+		goto out;
+	}
+
+	if (flags != 0) {
+		err = flagserrf(flags);
+		goto out;
+	}
+
+	if ((ace = attest_cache_find(at, kblob, kblen)) != NULL) {
+		bunyan_add_vars(at->at_log_frame,
+		    "slotid", BNY_UINT, (uint)ace->ace_slotid, NULL);
+		bunyan_log(BNY_DEBUG, "using cached attestation", NULL);
+		ptr = ace->ace_chain;
+		len = ace->ace_chainlen;
+		goto reply;
+	}
+
+	if ((err = agent_piv_open(at)))
+		goto out;
+
+	if ((slot = agent_find_slot(at, kblob, kblen)) == NULL) {
+		agent_piv_close(at, B_FALSE);
+		err = errf("NotFoundError", NULL, "specified key not found");
+		goto out;
+	}
+	bunyan_add_vars(at->at_log_frame,
+	    "slotid", BNY_UINT, (uint)piv_slot_id(slot), NULL);
+
+	err = ykpiv_attest(at->at_selk, slot, &cert, &certlen);
+	if (err) {
+		agent_piv_close(at, B_TRUE);
+		goto out;
+	}
+	err = piv_read_file(at->at_selk, PIV_TAG_CERT_YK_ATTESTATION, &chain,
+	    &chainlen);
+	if (err) {
+		agent_piv_close(at, B_TRUE);
+		goto out;
+	}
+	agent_piv_close(at, B_FALSE);
+
+	tlv = tlv_init(chain, 0, chainlen);
+	if ((err = tlv_read_tag(tlv, &tag)))
+		goto out;
+	if (tag != 0x70) {
+		err = errf("InvalidDataError", NULL, "PIV device returned "
+		    "wrong tag at start of attestation cert");
+		goto out;
+	}
+	ptr = tlv_ptr(tlv);
+	len = tlv_rem(tlv);
+	tlv_skip(tlv);
+
+	attest_cache_add(at, piv_slot_id(slot), kblob, kblen, cert, certlen,
+	    ptr, len);
+	ace = at->at_attest;
+
+reply:
+	if ((r = sshbuf_put_u8(msg, SSH_AGENT_SUCCESS)) != 0 ||
+	    (r = sshbuf_put_u32(msg, 2)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+
+	if ((r = sshbuf_put_string(msg, ace->ace_cert,
+	    ace->ace_certlen)) != 0 ||
+	    (r = sshbuf_put_string(msg, ptr, len)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+
+	if ((r = sshbuf_put_stringb(e->output, msg)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+
+out:
+	if (tlv != NULL)
+		tlv_free(tlv);
+	free(cert);
+	piv_file_data_free(chain, chainlen);
+	sshbuf_free(msg);
+	sshkey_free(key);
+	return (err);
+}
+
+static errf_t *
+process_ext_query(struct agent_token *at, SocketEntry *e,
+    struct sshbuf *buf)
+{
+	int r, n = 0;
+	struct exthandler *h;
+	struct sshbuf *msg;
+
+	if ((msg = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+
+	for (h = exthandlers; h->eh_name != NULL; ++h)
+		++n;
+
+	if ((r = sshbuf_put_u8(msg, SSH_AGENT_SUCCESS)) != 0 ||
+	    (r = sshbuf_put_u32(msg, n)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	for (h = exthandlers; h->eh_name != NULL; ++h) {
+		if ((r = sshbuf_put_cstring(msg, h->eh_name)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	}
+
+	if ((r = sshbuf_put_stringb(e->output, msg)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	sshbuf_free(msg);
+
+	return (NULL);
+}
+
+static void
+put_stats_hist(struct sshbuf *msg, const struct stats_hist *sh)
+{
+	int r;
+	uint i;
+
+	if ((r = sshbuf_put_u64(msg, sh->sh_count)) != 0 ||
+	    (r = sshbuf_put_u64(msg, sh->sh_sum_us)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	for (i = 0; i < STATS_HIST_BUCKETS; ++i) {
+		if ((r = sshbuf_put_u64(msg, sh->sh_buckets[i])) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	}
+}
+
+/*
+ * Reply format (all counters u64, histograms as count, sum of usec, then
+ * STATS_HIST_BUCKETS bucket counts):
+ *
+ *   u32 version (2), u64 uptime (ms), u32 nbuckets
+ *   u32 ntypes, then per type:
+ *     cstring name, count, failures, apdus, apdu_bytes, latency hist
+ *   u32 ntokens, then per token:
+ *     cstring guid, txn_opens, txn_closes, txn hold hist, finds,
+ *     find_failures, pin_ok, pin_fail, then (since version 2)
+ *     txn_reuses and the current txn hold time in ms (UINT64_MAX
+ *     for -T exclusive)
+ */
+static errf_t *
+process_ext_stats(struct agent_token *at, SocketEntry *e,
+    struct sshbuf *buf)
+{
+	int r;
+	uint i, n = 0;
+	struct sshbuf *msg;
+	struct agent_token *t;
+	const struct msg_stats *ms;
+	const struct token_stats *ts;
+	char *guidhex;
+
+	if ((msg = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+
+	VERIFY0(pthread_mutex_lock(&stats_mtx));
+	for (i = 0; i < 256; ++i) {
+		if (msg_stats[i].ms_count > 0)
+			++n;
+	}
+	if ((r = sshbuf_put_u8(msg, SSH_AGENT_SUCCESS)) != 0 ||
+	    (r = sshbuf_put_u32(msg, 2)) != 0 ||
+	    (r = sshbuf_put_u64(msg, monotime() - stats_start)) != 0 ||
+	    (r = sshbuf_put_u32(msg, STATS_HIST_BUCKETS)) != 0 ||
+	    (r = sshbuf_put_u32(msg, n)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	for (i = 0; i < 256; ++i) {
+		ms = &msg_stats[i];
+		if (ms->ms_count == 0)
+			continue;
+		if ((r = sshbuf_put_cstring(msg, msg_type_to_name(i))) != 0 ||
+		    (r = sshbuf_put_u64(msg, ms->ms_count)) != 0 ||
+		    (r = sshbuf_put_u64(msg, ms->ms_failures)) != 0 ||
+		    (r = sshbuf_put_u64(msg, ms->ms_apdus)) != 0 ||
+		    (r = sshbuf_put_u64(msg, ms->ms_apdu_bytes)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		put_stats_hist(msg, &ms->ms_latency);
+	}
+
+	if ((r = sshbuf_put_u32(msg, ntokens)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	for (t = tokens; t != NULL; t = t->at_next) {
+		ts = &t->at_stats;
+		guidhex = buf_to_hex(t->at_guid, t->at_guid_len, B_FALSE);
+		if ((r = sshbuf_put_cstring(msg, guidhex)) != 0 ||
+		    (r = sshbuf_put_u64(msg, ts->ts_txn_opens)) != 0 ||
+		    (r = sshbuf_put_u64(msg, ts->ts_txn_closes)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		put_stats_hist(msg, &ts->ts_txn_hold);
+		if ((r = sshbuf_put_u64(msg, ts->ts_finds)) != 0 ||
+		    (r = sshbuf_put_u64(msg, ts->ts_find_failures)) != 0 ||
+		    (r = sshbuf_put_u64(msg, ts->ts_pin_ok)) != 0 ||
+		    (r = sshbuf_put_u64(msg, ts->ts_pin_fail)) != 0 ||
+		    (r = sshbuf_put_u64(msg, ts->ts_txn_reuses)) != 0 ||
+		    (r = sshbuf_put_u64(msg, ts->ts_txn_hold_ms)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		free(guidhex);
+	}
+	VERIFY0(pthread_mutex_unlock(&stats_mtx));
+
+	if ((r = sshbuf_put_stringb(e->output, msg)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	sshbuf_free(msg);
+
+	return (NULL);
+}
+
+/*
+ * Signs a batch of payloads with one key, in one transaction and with one
+ * PIN check (or one per item, for slots which need the PIN every time). The
+ * request is:
+ *   string key, u32 flags (as for SSH2_AGENTC_SIGN_REQUEST), u32 count,
+ *   then count x string data
+ * and the reply:
+ *   u8 SSH_AGENT_SUCCESS, u32 count, then for each item either
+ *     u8 0, string signature
+ *   or
+ *     u8 1, string error name, string error message
+ */
+#define	SIGN_BATCH_MAX		1024
+
+static errf_t *
+process_ext_sign_batch(struct agent_token *at, SocketEntry *e,
+    struct sshbuf *buf)
+{
+	int r;
+	errf_t *err = ERRF_OK;
+	struct sshbuf *msg, *sigbuf;
+	struct sshkey *key = NULL;
+	struct piv_slot *slot;
+	struct piv_sign_item *items = NULL, *it;
+	const u_char *kblob, *data;
+	size_t kblen, dlen;
+	uint32_t flags, n = 0, i, j;
+	enum sshdigest_types hashalg;
+	boolean_t canskip = B_TRUE, broken = B_FALSE;
+
+	if ((msg = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+
+	/* kblob and the data stay valid until buf is next modified */
+	if ((r = sshbuf_peek_string_direct(buf, &kblob, &kblen)) != 0 ||
+	    (r = sshkey_froms(buf, &key)) != 0 ||
+	    (r = sshbuf_get_u32(buf, &flags)) != 0 ||
+	    (r = sshbuf_get_u32(buf, &n)) != 0) {
+		err = parserrf("sshbuf_get_*", r);
+		n = 0;
+		goto out;
+	}
+	if (n > SIGN_BATCH_MAX) {
+		err = errf("ArgumentError", NULL, "too many items in batch "
+		    "(%u, max is %u)", n, SIGN_BATCH_MAX);
+		n = 0;
+		goto out;
+	}
+	hashalg = sign_hashalg(key, flags);
+	items = calloc(n + 1, sizeof (struct piv_sign_item));
+	VERIFY(items != NULL);
+	for (i = 0; i < n; ++i) {
+		if ((r = sshbuf_get_string_direct(buf, &data, &dlen)) != 0) {
+			err = parserrf("sshbuf_get_string", r);
+			n = 0;
+			goto out;
+		}
+		items[i].psi_data = data;
+		items[i].psi_datalen = dlen;
+		items[i].psi_hashalgo = hashalg;
+	}
+
+	if ((err = agent_piv_open(at)))
+		goto out;
+
+	if ((slot = agent_find_slot(at, kblob, kblen)) == NULL) {
+		agent_piv_close(at, B_FALSE);
+		err = errf("NotFoundError", NULL, "specified key not found");
+		goto out;
+	}
+	bunyan_add_vars(at->at_log_frame,
+	    "slotid", BNY_UINT, (uint)piv_slot_id(slot), NULL);
+
+	if (piv_slot_id(slot) == PIV_SLOT_KEY_MGMT && !sign_9d) {
+		agent_piv_close(at, B_FALSE);
+		err = errf("PermissionError", NULL, "key management key (9d) "
+		    "is not allowed to sign data without the -m option");
+		goto out;
+	}
+	if (piv_slot_id(slot) == PIV_SLOT_SIGNATURE)
+		canskip = B_FALSE;
+
+	if (canskip) {
+		if ((err = agent_piv_try_pin(at, B_TRUE))) {
+			agent_piv_close(at, B_TRUE);
+			goto out;
+		}
+		err = piv_sign_batch(at->at_selk, slot, items, n);
+		if (err != ERRF_OK)
+			broken = B_TRUE;
+		errf_free(err);
+		err = ERRF_OK;
+	}
+
+	/*
+	 * Anything that needs the PIN again for every signature (9C, or a
+	 * YubiKey slot set to "PIN Always") gets done one at a time.
+	 */
+	for (i = 0; i < n && !broken; ++i) {
+		it = &items[i];
+		if (canskip && (!errf_caused_by(it->psi_err,
+		    "PermissionError") || at->at_pin_len == 0 ||
+		    !piv_token_is_ykpiv(at->at_selk)))
+			continue;
+		errf_free(it->psi_err);
+		it->psi_err = agent_piv_try_pin(at, B_FALSE);
+		if (it->psi_err != ERRF_OK) {
+			/* Don't burn PIN retries on the rest. */
+			for (j = i + 1; j < n; ++j) {
+				errf_free(items[j].psi_err);
+				freezero(items[j].psi_sig, items[j].psi_siglen);
+				items[j].psi_sig = NULL;
+				items[j].psi_err = errf("BatchAbortedError",
+				    NULL, "Not attempted: PIN failed");
+			}
+			broken = B_TRUE;
+			break;
+		}
+		it->psi_hashalgo = hashalg;
+		it->psi_err = piv_sign(at->at_selk, slot, it->psi_data,
+		    it->psi_datalen, &it->psi_hashalgo, &it->psi_sig,
+		    &it->psi_siglen);
+		if (errf_caused_by(it->psi_err, "IOError"))
+			broken = B_TRUE;
+	}
+	agent_piv_close(at, broken);
+
+	if ((r = sshbuf_put_u8(msg, SSH_AGENT_SUCCESS)) != 0 ||
+	    (r = sshbuf_put_u32(msg, n)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	for (i = 0; i < n; ++i) {
+		it = &items[i];
+		if (it->psi_err == ERRF_OK && it->psi_hashalgo != hashalg) {
+			it->psi_err = errf("HashMismatch", NULL,
+			    "PIV device signed with a different hash algorithm "
+			    "to the one requested (wanted %d, got %d)",
+			    (int)hashalg, (int)it->psi_hashalgo);
+		}
+		if (it->psi_err != ERRF_OK) {
+			bunyan_log(BNY_DEBUG, "failed to sign batch item",
+			    "item", BNY_UINT, i,
+			    "error", BNY_ERF, it->psi_err, NULL);
+			if ((r = sshbuf_put_u8(msg, 1)) != 0 ||
+			    (r = sshbuf_put_cstring(msg,
+			    errf_name(it->psi_err))) != 0 ||
+			    (r = sshbuf_put_cstring(msg,
+			    errf_message(it->psi_err))) != 0)
+				fatal("%s: buffer error: %s", __func__,
+				    ssh_err(r));
+			continue;
+		}
+		if ((sigbuf = sshbuf_new()) == NULL)
+			fatal("%s: sshbuf_new failed", __func__);
+		VERIFY0(sshkey_sig_from_asn1(piv_slot_pubkey(slot),
+		    it->psi_hashalgo, it->psi_sig, it->psi_siglen, sigbuf));
+		if ((r = sshbuf_put_u8(msg, 0)) != 0 ||
+		    (r = sshbuf_put_stringb(msg, sigbuf)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		sshbuf_free(sigbuf);
+	}
+
+	if ((r = sshbuf_put_stringb(e->output, msg)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+
+out:
+	for (i = 0; items != NULL && i < n; ++i) {
+		errf_free(items[i].psi_err);
+		freezero(items[i].psi_sig, items[i].psi_siglen);
+	}
+	free(items);
+	sshkey_free(key);
+	sshbuf_free(msg);
+	return (err);
+}
+
+/*
+ * Hands out the APDU trace ring (see piv_apdu_trace_get()). The reply is:
+ *   u8 SSH_AGENT_SUCCESS, u32 version (1), u64 now (usec, same clock as the
+ *   records), u32 count, then for each record (oldest first):
+ *     string guid prefix, u8 cls, u8 ins, u8 p1, u8 p2, u8 ext,
+ *     u32 lc, u32 le, u32 sw, u32 reply len, u32 pcsc rv,
+ *     u64 start, u64 end
+ */
+#define	APDU_TRACE_MAX		256
+
+static errf_t *
+process_ext_apdu_trace(struct agent_token *at, SocketEntry *e,
+    struct sshbuf *buf)
+{
+	struct piv_apdu_trace *recs, *tr;
+	struct sshbuf *msg;
+	size_t n, i;
+	int r;
+
+	recs = calloc(APDU_TRACE_MAX, sizeof (struct piv_apdu_trace));
+	VERIFY(recs != NULL);
+	n = piv_apdu_trace_get(recs, APDU_TRACE_MAX);
+
+	if ((msg = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((r = sshbuf_put_u8(msg, SSH_AGENT_SUCCESS)) != 0 ||
+	    (r = sshbuf_put_u32(msg, 1)) != 0 ||
+	    (r = sshbuf_put_u64(msg, piv_trace_now())) != 0 ||
+	    (r = sshbuf_put_u32(msg, n)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	for (i = 0; i < n; ++i) {
+		tr = &recs[i];
+		if ((r = sshbuf_put_string(msg, tr->pat_guid,
+		    sizeof (tr->pat_guid))) != 0 ||
+		    (r = sshbuf_put_u8(msg, tr->pat_cls)) != 0 ||
+		    (r = sshbuf_put_u8(msg, tr->pat_ins)) != 0 ||
+		    (r = sshbuf_put_u8(msg, tr->pat_p1)) != 0 ||
+		    (r = sshbuf_put_u8(msg, tr->pat_p2)) != 0 ||
+		    (r = sshbuf_put_u8(msg, tr->pat_ext)) != 0 ||
+		    (r = sshbuf_put_u32(msg, tr->pat_lc)) != 0 ||
+		    (r = sshbuf_put_u32(msg, tr->pat_le)) != 0 ||
+		    (r = sshbuf_put_u32(msg, tr->pat_sw)) != 0 ||
+		    (r = sshbuf_put_u32(msg, tr->pat_lr)) != 0 ||
+		    (r = sshbuf_put_u32(msg, tr->pat_rv)) != 0 ||
+		    (r = sshbuf_put_u64(msg, tr->pat_start)) != 0 ||
+		    (r = sshbuf_put_u64(msg, tr->pat_end)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	}
+	free(recs);
+
+	if ((r = sshbuf_put_stringb(e->output, msg)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	sshbuf_free(msg);
+
+	return (NULL);
+}
+
+struct exthandler exthandlers[] = {
+	{ "query", process_ext_query, ROUTE_ANY },
+	{ "ecdh@joyent.com", process_ext_ecdh, ROUTE_KEY },
+	{ "sign-batch@joyent.com", process_ext_sign_batch, ROUTE_KEY },
+	{ "ecdh-rebox@joyent.com", process_ext_rebox, ROUTE_BOX },
+	{ "ecdh-rebox-batch@joyent.com", process_ext_rebox_batch,
+	    ROUTE_BOXES },
+	{ "ebox-unlock@joyent.com", process_ext_ebox_unlock, ROUTE_EBOX },
+	{ "x509-certs@joyent.com", process_ext_x509_certs, ROUTE_KEY },
+	{ "ykpiv-attest@joyent.com", process_ext_attest, ROUTE_KEY },
+	{ "agent-stats@joyent.com", process_ext_stats, ROUTE_ANY },
+	{ "apdu-trace@joyent.com", process_ext_apdu_trace, ROUTE_ANY },
+	{ NULL, NULL, ROUTE_ANY }
+};
+
+static errf_t *
+process_extension(struct agent_token *at, SocketEntry *e)
+{
+	errf_t *err;
+	int r;
+	char *extname = NULL;
+	size_t enlen;
+	struct sshbuf *inner = NULL;
+	struct exthandler *h, *hdlr = NULL;
+
+	if ((r = sshbuf_get_cstring(e->request, &extname, &enlen)))
+		return (parserrf("sshbuf_get_cstring", r));
+
+	if ((r = sshbuf_froms(e->request, &inner))) {
+		err = parserrf("sshbuf_froms", r);
+		goto out;
+	}
+	VERIFY(extname != NULL);
+	VERIFY(inner != NULL);
+
+	for (h = exthandlers; h->eh_name != NULL; ++h) {
+		if (strcmp(h->eh_name, extname) == 0) {
+			hdlr = h;
+			break;
+		}
+	}
+	if (hdlr == NULL) {
+		err = errf("UnknownExtension", NULL,
+		    "unsupported extension '%s'", extname);
+		goto out;
+	}
+
+	bunyan_add_vars(at->at_log_frame,
+	    "extension", BNY_STRING, h->eh_name, NULL);
+	err = hdlr->eh_handler(at, e, inner);
+
+	if (err) {
+		send_extfail(e);
+		bunyan_log(BNY_WARN, "failed to process extension command",
+		    "error", BNY_ERF, err, NULL);
+		if (errf_caused_by(err, "NoPINError") &&
+		    bunyan_get_level() > BNY_WARN) {
+			warnfx(err, "denied command due to lack of PIN");
+		}
+		errf_free(err);
+		err = ERRF_OK;
+	}
+
+out:
+	sshbuf_free(inner);
+	free(extname);
+	return (err);
+}
+
+static errf_t *
+process_lock_agent(struct agent_token *at, SocketEntry *e, int lock)
+{
+	int r;
+	char *passwd;
+	size_t pwlen;
+	uint retries = 1;
+	errf_t *err = NULL;
+
+	/*
+	 * This is deliberately fatal: the user has requested that we lock,
+	 * but we can't parse their request properly. The only safe thing to
+	 * do is abort.
+	 */
+	if ((r = sshbuf_get_cstring(e->request, &passwd, &pwlen)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	VERIFY(passwd != NULL);
+
+	if (lock) {
+		drop_pin(at);
+		send_status(e, 1);
+	} else {
+		if ((err = valid_pin(passwd)))
+			goto out;
+
+		if ((err = agent_piv_open(at)))
+			goto out;
+
+		err = piv_verify_pin(at->at_selk,
+		    piv_token_default_auth(at->at_selk), passwd, &retries,
+		    B_FALSE);
+		stats_pin(at, err);
+
+		if (err == ERRF_OK) {
+			agent_piv_close(at, B_FALSE);
+			if (at->at_pin_len != 0)
+				explicit_bzero(at->at_pin, at->at_pin_len);
+			at->at_pin_len = pwlen;
+			bcopy(passwd, at->at_pin, pwlen + 1);
+			send_status(e, 1);
+			bunyan_log(BNY_INFO, "storing PIN in memory", NULL);
+			at->at_probe_interval = card_probe_interval_pin;
+			goto out;
+		}
+		agent_piv_close(at, B_TRUE);
+
+		err = wrap_pin_error(at, err, retries);
+	}
+out:
+	explicit_bzero(passwd, pwlen);
+	free(passwd);
+	return (err);
+}
+
+static const char *
+msg_type_to_name(int msg)
+{
+	switch (msg) {
+	case SSH_AGENTC_LOCK:
+		return ("LOCK");
+	case SSH_AGENTC_UNLOCK:
+		return ("UNLOCK");
+	case SSH2_AGENTC_SIGN_REQUEST:
+		return ("SIGN_REQUEST");
+	case SSH2_AGENTC_ADD_IDENTITY:
+		return ("ADD_IDENTITY");
+	case SSH2_AGENTC_REMOVE_IDENTITY:
+		return ("REMOVE_IDENTITY");
+	case SSH2_AGENTC_REQUEST_IDENTITIES:
+		return ("REQUEST_IDENTITIES");
+	case SSH2_AGENTC_REMOVE_ALL_IDENTITIES:
+		return ("REMOVE_ALL_IDENTITIES");
+	case SSH_AGENTC_ADD_SMARTCARD_KEY:
+		return ("ADD_SMARTCARD_KEY");
+	case SSH_AGENTC_REMOVE_SMARTCARD_KEY:
+		return ("REMOVE_SMARTCARD_KEY");
+	case SSH2_AGENTC_EXTENSION:
+		return ("EXTENSION");
+	default:
+		return ("UNKNOWN");
+	}
+}
+
+/*
+ * Runs a single agent message on a token's card executor thread. "e" here
+ * is a stand-in built by run_card_job(), not a member of sockets[].
+ */
+static boolean_t
+dispatch_message(struct agent_token *at, SocketEntry *e, u_char type)
+{
+	errf_t *err;
+	boolean_t ok = B_TRUE;
+
+	at->at_log_frame = bunyan_push(
+	    "fd", BNY_INT, e->fd,
+	    "msg_type", BNY_INT, (int)type,
+	    "msg_type_name", BNY_STRING, msg_type_to_name(type),
+	    "remote_pid", BNY_INT, (int)e->pid,
+	    "remote_cmd", BNY_STRING, (e->exepath == NULL) ? "???" : e->exepath,
+	    NULL);
+	if (at->at_selk != NULL) {
+		bunyan_add_vars(at->at_log_frame,
+		    "guid", BNY_STRING, piv_token_guid_hex(at->at_selk), NULL);
+	}
+	bunyan_log(BNY_DEBUG, "received ssh-agent message", NULL);
+
+	at->at_last_op = monotime();
+
+	switch (type) {
+	case SSH_AGENTC_LOCK:
+	case SSH_AGENTC_UNLOCK:
+		err = process_lock_agent(at, e, type == SSH_AGENTC_LOCK);
+		break;
+	/* ssh2 */
+	case SSH2_AGENTC_SIGN_REQUEST:
+		err = process_sign_request2(at, e);
+		break;
+	case SSH2_AGENTC_REQUEST_IDENTITIES:
+		err = process_request_identities(at, e);
+		break;
+	case SSH2_AGENTC_REMOVE_ALL_IDENTITIES:
+		err = process_remove_all_identities(at, e);
+		break;
+	case SSH2_AGENTC_EXTENSION:
+		err = process_extension(at, e);
+		break;
+	default:
+		/* Unknown message.  Respond with failure. */
+		err = errf("UnknownMessageError", NULL,
+		    "unknown/unsupported agent protocol message %d", type);
+		break;
+	}
+
+	if (err) {
+		bunyan_log(BNY_WARN, "failed to process command",
+		    "error", BNY_ERF, err, NULL);
+		if (errf_caused_by(err, "NoPINError") &&
+		    bunyan_get_level() > BNY_WARN) {
+			warnfx(err, "denied command due to lack of PIN");
+		}
+		sshbuf_reset(e->request);
+		sshbuf_reset(e->output);
+		send_status(e, 0);
+		errf_free(err);
+		ok = B_FALSE;
+	} else {
+		bunyan_log(BNY_INFO, "processed ssh-agent message", NULL);
+	}
+
+	bunyan_pop(at->at_log_frame);
+	at->at_log_frame = NULL;
+	return (ok);
+}
+
+static void
+card_job_free(struct card_job *job)
+{
+	struct card_job *cj, *next;
+
+	if (job == NULL)
+		return;
+	for (cj = job->cj_children; cj != NULL; cj = next) {
+		next = cj->cj_sibling;
+		card_job_free(cj);
+	}
+	sshbuf_free(job->cj_request);
+	sshbuf_free(job->cj_output);
+	free(job->cj_exepath);
+	free(job);
+}
+
+static void
+run_card_job(struct card_job *job)
+{
+	SocketEntry je;
+	struct agent_token *at = job->cj_token;
+	struct piv_token *pt;
+	uint64_t n0 = 0, tx0 = 0, rx0 = 0, n1, tx1, rx1;
+
+	bzero(&je, sizeof (je));
+	je.fd = job->cj_fd;
+	je.type = AUTH_CONNECTION;
+	je.pid = job->cj_pid;
+	je.exepath = job->cj_exepath;
+	je.request = job->cj_request;
+	je.output = job->cj_output;
+
+	if ((pt = at->at_selk) != NULL)
+		piv_token_apdu_stats(pt, &n0, &tx0, &rx0);
+
+	job->cj_failed = !dispatch_message(at, &je, job->cj_type);
+
+	/*
+	 * If the token got re-enumerated along the way, the counters
+	 * started again from zero on the new piv_token.
+	 */
+	if (at->at_selk != NULL) {
+		if (at->at_selk != pt)
+			n0 = tx0 = rx0 = 0;
+		piv_token_apdu_stats(at->at_selk, &n1, &tx1, &rx1);
+		job->cj_apdus = n1 - n0;
+		job->cj_apdu_bytes = (tx1 - tx0) + (rx1 - rx0);
+	}
+}
+
+/* Updates the per-message-type stats for a job which is about to reply. */
+static void
+stats_job(u_char type, uint64_t start, boolean_t failed, uint64_t apdus,
+    uint64_t apdu_bytes)
+{
+	struct msg_stats *ms = &msg_stats[type];
+
+	VERIFY0(pthread_mutex_lock(&stats_mtx));
+	ms->ms_count++;
+	if (failed)
+		ms->ms_failures++;
+	ms->ms_apdus += apdus;
+	ms->ms_apdu_bytes += apdu_bytes;
+	stats_hist_add(&ms->ms_latency, monotime_usec() - start);
+	VERIFY0(pthread_mutex_unlock(&stats_mtx));
+}
+
+/* Hands a finished job back to the main thread. */
+static void
+card_job_done(struct card_job *job)
+{
+	const u_char c = 0;
+	ssize_t n;
+
+	job->cj_next = NULL;
+	VERIFY0(pthread_mutex_lock(&card_done_mtx));
+	*card_done_tail = job;
+	card_done_tail = &job->cj_next;
+	VERIFY0(pthread_mutex_unlock(&card_done_mtx));
+
+	/*
+	 * The pipe is non-blocking: if it's full then the main loop already
+	 * has a wakeup pending and will pick this job up with the others.
+	 */
+	do {
+		n = write(card_done_pipe[1], &c, 1);
+	} while (n == -1 && errno == EINTR);
+	if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+		fatal("%s: write: %s", __func__, strerror(errno));
+}
+
+static void
+card_executor_submit(struct card_executor *ce, struct card_job *job)
+{
+	job->cj_next = NULL;
+	VERIFY0(pthread_mutex_lock(&ce->ce_mtx));
+	*ce->ce_queue_tail = job;
+	ce->ce_queue_tail = &job->cj_next;
+	VERIFY0(pthread_cond_signal(&ce->ce_cv));
+	VERIFY0(pthread_mutex_unlock(&ce->ce_mtx));
+}
+
+/*
+ * The idle-time housekeeping which used to live in the main loop: closing
+ * the transaction once it's been held for long enough, and probing the card
+ * every at_probe_interval.
+ */
+/*
+ * While the presence watcher is running we hear about card removal straight
+ * away, so the probe is only needed to re-check the CAK and re-read certs,
+ * and can happen much less often.
+ */
+static time_t
+agent_probe_interval(struct agent_token *at)
+{
+	time_t interval = at->at_probe_interval;
+
+	VERIFY0(pthread_mutex_lock(&presence_mtx));
+	if (interval != 0 && presence_watching &&
+	    interval < card_probe_interval_watched)
+		interval = card_probe_interval_watched;
+	VERIFY0(pthread_mutex_unlock(&presence_mtx));
+	return (interval);
+}
+
+static void
+card_executor_timers(struct agent_token *at)
+{
+	uint64_t now = monotime();
+	time_t interval = agent_probe_interval(at);
+
+	if (interval != 0 && (now - at->at_last_op) >= interval * 1000) {
+		probe_card(at);
+	} else if (at->at_selk != NULL && at->at_refresh == 0 &&
+	    (now - at->at_last_update) >= at->at_probe_interval * 1000) {
+		/*
+		 * A busy card never goes idle for long enough to be probed,
+		 * but still needs its CAK re-proven and its certs re-read
+		 * now and then. probe_card() does both (and is cheap when
+		 * we already hold the transaction from the last job).
+		 */
+		probe_card(at);
+	}
+	if (at->at_txnopen && now >= at->at_txntimeout)
+		agent_piv_close(at, B_TRUE);
+}
+
+/*
+ * Waits (with ce_mtx held) until either there is work on the queue or one of
+ * the deadlines handled by card_executor_timers() has arrived.
+ */
+static void
+card_executor_wait(struct agent_token *at)
+{
+	struct card_executor *ce = &at->at_exec;
+	uint64_t now, deadline = 0, probe;
+	time_t interval = agent_probe_interval(at);
+	struct timeval tv;
+	struct timespec ts;
+	int r;
+
+	now = monotime();
+	if (at->at_txnopen && at->at_txntimeout != TXN_FOREVER)
+		deadline = at->at_txntimeout;
+	if (interval != 0) {
+		probe = at->at_last_op + interval * 1000;
+		deadline = (deadline == 0) ? probe : MINIMUM(deadline, probe);
+	}
+
+	if (deadline == 0) {
+		VERIFY0(pthread_cond_wait(&ce->ce_cv, &ce->ce_mtx));
+		return;
+	}
+	if (deadline <= now)
+		return;
+
+	gettimeofday(&tv, NULL);
+	ts.tv_sec = tv.tv_sec + (deadline - now) / 1000;
+	ts.tv_nsec = tv.tv_usec * 1000 + ((deadline - now) % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	r = pthread_cond_timedwait(&ce->ce_cv, &ce->ce_mtx, &ts);
+	VERIFY(r == 0 || r == ETIMEDOUT);
+}
+
+/*
+ * Throws away the slots we restored from the cache and re-finds the card
+ * and reads all its certs for real (which also updates the cache file).
+ */
+static void
+agent_token_revalidate(struct agent_token *at)
+{
+	errf_t *err;
+
+	at->at_revalidate = B_FALSE;
+	if (at->at_txnopen)
+		agent_piv_close(at, B_TRUE);
+	at->at_selk = NULL;
+	at->at_skip_cache = B_TRUE;
+	err = agent_piv_open(at);
+	at->at_skip_cache = B_FALSE;
+	if (err) {
+		bunyan_log(BNY_DEBUG, "failed to revalidate cached token state",
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+		return;
+	}
+	agent_piv_close(at, B_TRUE);
+}
+
+/*
+ * Re-reads one group of slots from at_refresh (a single standard slot, or all
+ * of the retired ones). The executor calls this when it has no requests
+ * queued (or at most once every card_refresh_defer ms when it's busy), and
+ * checks again between each group, so a request never waits for more than
+ * one slot's worth of reading. Once everything has been read, the new slot
+ * set goes out with agent_token_publish().
+ */
+static void
+agent_token_refresh(struct agent_token *at)
+{
+	uint bit = at->at_refresh & -at->at_refresh;
+	errf_t *err;
+
+	if ((err = agent_piv_open(at))) {
+		bunyan_log(BNY_DEBUG, "failed to open card for cert refresh",
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+		at->at_refresh = 0;
+		return;
+	}
+	err = piv_read_certs(at->at_selk, bit);
+	agent_piv_close(at, B_FALSE);
+	if (err) {
+		bunyan_log(BNY_DEBUG, "cert refresh failed",
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+		at->at_refresh = 0;
+		return;
+	}
+	at->at_refresh &= ~bit;
+	at->at_refresh_next = monotime() + card_refresh_defer;
+	if (at->at_refresh == 0) {
+		bunyan_log(BNY_TRACE, "cert refresh done", NULL);
+		agent_cache_save(at);
+		agent_token_publish(at);
+	}
+}
+
+/*
+ * Runs on the executor when the presence watcher has seen a card come or go.
+ * If our card has been pulled we forget about it (and the PIN) right away,
+ * rather than waiting for the next request to fail its transaction. If we
+ * don't have a card and a new one has turned up, we try to open it now so
+ * that the first request after insertion doesn't have to pay for finding
+ * the card and reading its certs.
+ */
+static void
+agent_token_presence(struct agent_token *at)
+{
+	const char *rdr;
+	boolean_t present = B_FALSE;
+	uint i, n;
+	errf_t *err;
+
+	VERIFY0(pthread_mutex_lock(&presence_mtx));
+	n = presence_nreaders;
+	if (at->at_selk != NULL) {
+		rdr = piv_token_rdrname(at->at_selk);
+		for (i = 0; i < n; ++i) {
+			if (strcmp(presence_readers[i], rdr) == 0) {
+				present = B_TRUE;
+				break;
+			}
+		}
+	}
+	VERIFY0(pthread_mutex_unlock(&presence_mtx));
+
+	if (at->at_selk != NULL && !present) {
+		bunyan_log(BNY_INFO, "card removed", NULL);
+		if (at->at_txnopen)
+			agent_piv_close(at, B_TRUE);
+		at->at_selk = NULL;
+		cak_forget(at);
+		at->at_refresh = 0;
+		agent_token_unpublish(at);
+		drop_pin(at);
+		return;
+	}
+
+	if (at->at_selk == NULL && n > 0) {
+		bunyan_log(BNY_DEBUG, "card inserted, trying to open", NULL);
+		at->at_last_op = monotime();
+		if ((err = agent_piv_open(at))) {
+			bunyan_log(BNY_DEBUG, "failed to open new card",
+			    "error", BNY_ERF, err, NULL);
+			errf_free(err);
+			return;
+		}
+		agent_piv_close(at, B_TRUE);
+	}
+}
+
+static void *
+card_executor_main(void *arg)
+{
+	struct agent_token *at = arg;
+	struct card_executor *ce = &at->at_exec;
+	struct card_job *job;
+	errf_t *err;
+
+	err = agent_piv_open(at);
+	if (err) {
+		errf_free(err);
+	} else {
+		agent_piv_close(at, B_TRUE);
+	}
+	at->at_last_op = monotime();
+
+	VERIFY0(pthread_mutex_lock(&ce->ce_mtx));
+	while (1) {
+		if (ce->ce_presence) {
+			/* Before any jobs, so they don't hit a dead card. */
+			ce->ce_presence = B_FALSE;
+			VERIFY0(pthread_mutex_unlock(&ce->ce_mtx));
+			agent_token_presence(at);
+			VERIFY0(pthread_mutex_lock(&ce->ce_mtx));
+			continue;
+		}
+		if ((job = ce->ce_queue) == NULL && at->at_revalidate) {
+			/* Only do this when there's nothing else to do. */
+			VERIFY0(pthread_mutex_unlock(&ce->ce_mtx));
+			agent_token_revalidate(at);
+			VERIFY0(pthread_mutex_lock(&ce->ce_mtx));
+			continue;
+		}
+		/*
+		 * Refresh reads normally wait for a gap between jobs, but
+		 * one group is let in every card_refresh_defer ms so that a
+		 * steady stream of requests can't hold them off for good.
+		 */
+		if (at->at_refresh != 0 &&
+		    (job == NULL || monotime() >= at->at_refresh_next)) {
+			VERIFY0(pthread_mutex_unlock(&ce->ce_mtx));
+			agent_token_refresh(at);
+			VERIFY0(pthread_mutex_lock(&ce->ce_mtx));
+			continue;
+		}
+		if (job == NULL) {
+			card_executor_wait(at);
+			if (ce->ce_presence)
+				continue;
+			VERIFY0(pthread_mutex_unlock(&ce->ce_mtx));
+			card_executor_timers(at);
+			VERIFY0(pthread_mutex_lock(&ce->ce_mtx));
+			continue;
+		}
+		ce->ce_queue = job->cj_next;
+		if (ce->ce_queue == NULL)
+			ce->ce_queue_tail = &ce->ce_queue;
+		VERIFY0(pthread_mutex_unlock(&ce->ce_mtx));
+
+		run_card_job(job);
+		card_job_done(job);
+		card_executor_timers(at);
+
+		VERIFY0(pthread_mutex_lock(&ce->ce_mtx));
+	}
+	/* NOTREACHED */
+	return (NULL);
+}
+
+static void
+card_executor_start(struct agent_token *at)
+{
+	struct card_executor *ce = &at->at_exec;
+	sigset_t set, oset;
+
+	VERIFY0(pthread_mutex_init(&ce->ce_mtx, NULL));
+	VERIFY0(pthread_cond_init(&ce->ce_cv, NULL));
+	ce->ce_queue = NULL;
+	ce->ce_queue_tail = &ce->ce_queue;
+
+	/* Signals are handled on the main thread only. */
+	sigfillset(&set);
+	VERIFY0(pthread_sigmask(SIG_BLOCK, &set, &oset));
+	VERIFY0(pthread_create(&ce->ce_thread, NULL, card_executor_main, at));
+	VERIFY0(pthread_sigmask(SIG_SETMASK, &oset, NULL));
+}
+
+/*
+ * Replaces presence_readers with the readers in "st" which have a card in
+ * them, and tells every executor to go and look.
+ */
+static void
+presence_publish(const SCARD_READERSTATE *st, DWORD nst)
+{
+	struct agent_token *at;
+	char **rdrs;
+	uint i, n = 0;
+
+	rdrs = calloc(nst + 1, sizeof (char *));
+	VERIFY(rdrs != NULL);
+	for (i = 0; i < nst; ++i) {
+		if ((st[i].dwEventState & SCARD_STATE_PRESENT) == 0)
+			continue;
+		rdrs[n] = strdup(st[i].szReader);
+		VERIFY(rdrs[n] != NULL);
+		++n;
+	}
+
+	VERIFY0(pthread_mutex_lock(&presence_mtx));
+	for (i = 0; i < presence_nreaders; ++i)
+		free(presence_readers[i]);
+	free(presence_readers);
+	presence_readers = rdrs;
+	presence_nreaders = n;
+	presence_watching = B_TRUE;
+	presence_gen++;
+	VERIFY0(pthread_mutex_unlock(&presence_mtx));
+
+	for (at = tokens; at != NULL; at = at->at_next) {
+		VERIFY0(pthread_mutex_lock(&at->at_exec.ce_mtx));
+		at->at_exec.ce_presence = B_TRUE;
+		VERIFY0(pthread_cond_signal(&at->at_exec.ce_cv));
+		VERIFY0(pthread_mutex_unlock(&at->at_exec.ce_mtx));
+	}
+}
+
+static void
+presence_stop_watching(void)
+{
+	VERIFY0(pthread_mutex_lock(&presence_mtx));
+	presence_watching = B_FALSE;
+	presence_gen++;
+	VERIFY0(pthread_mutex_unlock(&presence_mtx));
+}
+
+/*
+ * The presence watcher sits in SCardGetStatusChange() on all the readers
+ * (plus the PnP pseudo-reader, so we hear about readers coming and going)
+ * and calls presence_publish() whenever a card is inserted or removed. If
+ * PCSC is unhappy it backs off and tries again, and the executors go back
+ * to probing in the meantime.
+ */
+static void *
+presence_watcher_main(void *arg)
+{
+	SCARDCONTEXT ctx;
+	SCARD_READERSTATE *st = NULL;
+	DWORD nst = 0, rdrlen, i, timeout, pnpstate = SCARD_STATE_UNAWARE;
+	char *rdrs = NULL, *p;
+	boolean_t changed, relist;
+	uint64_t last_list = 0;
+	LONG rv;
+
+	rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &ctx);
+	if (rv != SCARD_S_SUCCESS) {
+		bunyan_log(BNY_WARN, "presence watcher: SCardEstablishContext "
+		    "failed", "error", BNY_STRING, pcsc_stringify_error(rv),
+		    NULL);
+		return (NULL);
+	}
+
+	while (1) {
+		/* Don't spin if PCSC keeps telling us to re-list. */
+		if (monotime() - last_list < 1000)
+			sleep(1);
+		last_list = monotime();
+
+		free(st);
+		st = NULL;
+		free(rdrs);
+		rdrs = NULL;
+		rdrlen = 0;
+		rv = SCardListReaders(ctx, NULL, NULL, &rdrlen);
+		if (rv == SCARD_S_SUCCESS) {
+			rdrs = calloc(1, rdrlen);
+			VERIFY(rdrs != NULL);
+			rv = SCardListReaders(ctx, NULL, rdrs, &rdrlen);
+		}
+		if (rv == SCARD_E_NO_READERS_AVAILABLE) {
+			rdrlen = 0;
+		} else if (rv != SCARD_S_SUCCESS) {
+			bunyan_log(BNY_WARN, "presence watcher: "
+			    "SCardListReaders failed",
+			    "error", BNY_STRING, pcsc_stringify_error(rv),
+			    NULL);
+			presence_stop_watching();
+			sleep(5);
+			continue;
+		}
+
+		nst = 1;
+		for (p = rdrs; rdrlen > 0 && *p != '\0'; p += strlen(p) + 1)
+			++nst;
+		st = calloc(nst, sizeof (SCARD_READERSTATE));
+		VERIFY(st != NULL);
+		st[0].szReader = "\\\\?PnP?\\Notification";
+		st[0].dwCurrentState = pnpstate;
+		i = 1;
+		for (p = rdrs; rdrlen > 0 && *p != '\0'; p += strlen(p) + 1) {
+			st[i].szReader = p;
+			st[i].dwCurrentState = SCARD_STATE_UNAWARE;
+			++i;
+		}
+
+		/* Get the initial state of everything. */
+		rv = SCardGetStatusChange(ctx, 0, st, nst);
+		if (rv != SCARD_S_SUCCESS && rv != SCARD_E_TIMEOUT)
+			goto pcscerr;
+		for (i = 0; i < nst; ++i)
+			st[i].dwCurrentState = st[i].dwEventState;
+		pnpstate = st[0].dwCurrentState;
+		presence_publish(&st[1], nst - 1);
+
+		relist = B_FALSE;
+		while (!relist) {
+			/*
+			 * Without PnP notifications (e.g. on macOS) we have
+			 * to re-list every so often to spot new readers.
+			 */
+			timeout = (pnpstate & SCARD_STATE_UNKNOWN) ?
+			    10000 : INFINITE;
+			rv = SCardGetStatusChange(ctx, timeout, st, nst);
+			if (rv == SCARD_E_TIMEOUT) {
+				relist = ((pnpstate & SCARD_STATE_UNKNOWN) != 0);
+				continue;
+			}
+			if (rv == SCARD_E_UNKNOWN_READER ||
+			    rv == SCARD_E_READER_UNAVAILABLE) {
+				relist = B_TRUE;
+				continue;
+			}
+			if (rv != SCARD_S_SUCCESS)
+				goto pcscerr;
+
+			changed = B_FALSE;
+			for (i = 1; i < nst; ++i) {
+				if ((st[i].dwEventState &
+				    SCARD_STATE_CHANGED) == 0)
+					continue;
+				/*
+				 * The top 16 bits are the reader's card event
+				 * count, which catches a pull and re-insert
+				 * that happened too fast for us to see.
+				 */
+				if ((st[i].dwEventState ^ st[i].dwCurrentState) &
+				    (SCARD_STATE_PRESENT | SCARD_STATE_EMPTY |
+				    0xFFFF0000))
+					changed = B_TRUE;
+				st[i].dwCurrentState = st[i].dwEventState;
+			}
+			if (st[0].dwEventState & SCARD_STATE_CHANGED)
+				relist = B_TRUE;
+			st[0].dwCurrentState = st[0].dwEventState;
+			pnpstate = st[0].dwCurrentState;
+			if (changed && !relist)
+				presence_publish(&st[1], nst - 1);
+		}
+		continue;
+
+pcscerr:
+		bunyan_log(BNY_WARN, "presence watcher: "
+		    "SCardGetStatusChange failed",
+		    "error", BNY_STRING, pcsc_stringify_error(rv), NULL);
+		presence_stop_watching();
+		if (rv == SCARD_E_NO_SERVICE || rv == SCARD_E_INVALID_HANDLE) {
+			(void) SCardReleaseContext(ctx);
+			sleep(5);
+			rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL,
+			    NULL, &ctx);
+			if (rv != SCARD_S_SUCCESS) {
+				bunyan_log(BNY_WARN, "presence watcher: "
+				    "SCardEstablishContext failed",
+				    "error", BNY_STRING,
+				    pcsc_stringify_error(rv), NULL);
+				break;
+			}
+		} else {
+			sleep(5);
+		}
+	}
+
+	free(st);
+	free(rdrs);
+	return (NULL);
+}
+
+static void
+presence_watcher_start(void)
+{
+	pthread_t thread;
+	sigset_t set, oset;
+
+	sigfillset(&set);
+	VERIFY0(pthread_sigmask(SIG_BLOCK, &set, &oset));
+	VERIFY0(pthread_create(&thread, NULL, presence_watcher_main, NULL));
+	VERIFY0(pthread_sigmask(SIG_SETMASK, &oset, NULL));
+	VERIFY0(pthread_detach(thread));
+}
+
+static struct agent_token *
+token_for_blob(const u_char *blob, size_t len)
+{
+	struct agent_token *at;
+	enum piv_slotid slotid;
+	boolean_t match;
+
+	for (at = tokens; at != NULL; at = at->at_next) {
+		VERIFY0(pthread_mutex_lock(&at->at_pub_mtx));
+		match = keyidx_find(at->at_pub_idx, blob, len, &slotid);
+		VERIFY0(pthread_mutex_unlock(&at->at_pub_mtx));
+		if (match)
+			return (at);
+	}
+	return (NULL);
+}
+
+static struct agent_token *
+token_for_key(const struct sshkey *key)
+{
+	struct agent_token *at;
+	u_char *blob;
+	size_t len;
+
+	if (sshkey_to_blob(key, &blob, &len) != 0)
+		return (NULL);
+	at = token_for_blob(blob, len);
+	free(blob);
+	return (at);
+}
+
+static struct agent_token *
+token_for_guid(const uint8_t *guid)
+{
+	struct agent_token *at;
+	boolean_t match;
+
+	for (at = tokens; at != NULL; at = at->at_next) {
+		VERIFY0(pthread_mutex_lock(&at->at_pub_mtx));
+		match = at->at_pub_valid &&
+		    bcmp(at->at_pub_guid, guid, GUID_LEN) == 0;
+		VERIFY0(pthread_mutex_unlock(&at->at_pub_mtx));
+		if (match)
+			return (at);
+	}
+	return (NULL);
+}
+
+/*
+ * Picks the token holding a part of the ebox, preferring primary config
+ * parts (which is what process_ext_ebox_unlock() will open first).
+ */
+static struct agent_token *
+token_for_ebox(const struct ebox *ebox)
+{
+	struct ebox_config *config;
+	struct ebox_part *part;
+	struct piv_ecdh_box *box;
+	struct agent_token *at = NULL;
+	uint pass;
+
+	for (pass = 0; pass < 2 && at == NULL; ++pass) {
+		config = NULL;
+		while (at == NULL &&
+		    (config = ebox_next_config(ebox, config)) != NULL) {
+			if ((ebox_tpl_config_type(ebox_config_tpl(config)) ==
+			    EBOX_PRIMARY) != (pass == 0))
+				continue;
+			part = NULL;
+			while (at == NULL &&
+			    (part = ebox_config_next_part(config, part)) !=
+			    NULL) {
+				box = ebox_part_box(part);
+				if (piv_box_has_guidslot(box))
+					at = token_for_guid(piv_box_guid(box));
+				if (at == NULL)
+					at = token_for_key(piv_box_pubkey(box));
+			}
 		}
-		errf_free(err);
-		err = ERRF_OK;
 	}
-
-out:
-	sshbuf_free(inner);
-	free(extname);
-	return (err);
+	return (at);
 }
 
-static errf_t *
-process_lock_agent(SocketEntry *e, int lock)
+/*
+ * Works out which token a request is for by peeking at the key (or box)
+ * it names, without consuming anything from "req". Anything we can't work
+ * out, or which doesn't need a particular card, goes to the first token
+ * (which will produce the same "not found" errors a single-token agent
+ * always did).
+ */
+static struct agent_token *
+route_request(u_char type, struct sshbuf *req)
 {
-	int r;
-	char *passwd;
-	size_t pwlen;
-	uint retries = 1;
-	errf_t *err = NULL;
+	struct sshbuf *b, *inner = NULL, *boxbuf = NULL;
+	const u_char *kblob;
+	size_t kblen;
+	struct piv_ecdh_box *box = NULL;
+	struct ebox *ebox = NULL;
+	struct agent_token *at = NULL;
+	struct exthandler *h;
+	char *extname = NULL;
+	errf_t *err;
 
-	/*
-	 * This is deliberately fatal: the user has requested that we lock,
-	 * but we can't parse their request properly. The only safe thing to
-	 * do is abort.
-	 */
-	if ((r = sshbuf_get_cstring(e->request, &passwd, &pwlen)) != 0)
-		fatal("%s: buffer error: %s", __func__, ssh_err(r));
-	VERIFY(passwd != NULL);
+	if (ntokens == 1)
+		return (tokens);
 
-	if (lock) {
-		drop_pin();
-		send_status(e, 1);
-	} else {
-		if ((err = valid_pin(passwd)))
-			goto out;
+	if ((b = sshbuf_fromb(req)) == NULL)
+		fatal("%s: sshbuf_fromb failed", __func__);
 
-		if ((err = agent_piv_open()))
-			goto out;
+	switch (type) {
+	case SSH2_AGENTC_SIGN_REQUEST:
+		if (sshbuf_get_string_direct(b, &kblob, &kblen) == 0)
+			at = token_for_blob(kblob, kblen);
+		break;
+	case SSH2_AGENTC_EXTENSION:
+		if (sshbuf_get_cstring(b, &extname, NULL) != 0 ||
+		    sshbuf_froms(b, &inner) != 0)
+			break;
+		for (h = exthandlers; h->eh_name != NULL; ++h) {
+			if (strcmp(h->eh_name, extname) == 0)
+				break;
+		}
+		if (h->eh_route == ROUTE_KEY) {
+			if (sshbuf_get_string_direct(inner, &kblob,
+			    &kblen) == 0)
+				at = token_for_blob(kblob, kblen);
+		} else if (h->eh_route == ROUTE_BOX ||
+		    h->eh_route == ROUTE_BOXES) {
+			if (h->eh_route == ROUTE_BOXES &&
+			    sshbuf_get_u32(inner, NULL) != 0)
+				break;
+			if (sshbuf_froms(inner, &boxbuf) != 0)
+				break;
+			if ((err = sshbuf_get_piv_box(boxbuf, &box))) {
+				errf_free(err);
+				break;
+			}
+			if (piv_box_has_guidslot(box))
+				at = token_for_guid(piv_box_guid(box));
+			if (at == NULL)
+				at = token_for_key(piv_box_pubkey(box));
+		} else if (h->eh_route == ROUTE_EBOX) {
+			if (sshbuf_froms(inner, &boxbuf) != 0)
+				break;
+			if ((err = sshbuf_get_ebox(boxbuf, &ebox))) {
+				errf_free(err);
+				break;
+			}
+			at = token_for_ebox(ebox);
+		}
+		break;
+	}
 
-		err = piv_verify_pin(selk, piv_token_default_auth(selk),
-		    passwd, &retries, B_FALSE);
+	ebox_free(ebox);
+	piv_box_free(box);
+	sshbuf_free(boxbuf);
+	sshbuf_free(inner);
+	free(extname);
+	sshbuf_free(b);
 
-		if (err == ERRF_OK) {
-			agent_piv_close(B_FALSE);
-			if (pin_len != 0)
-				explicit_bzero(pin, pin_len);
-			pin_len = pwlen;
-			bcopy(passwd, pin, pwlen + 1);
-			send_status(e, 1);
-			bunyan_log(BNY_INFO, "storing PIN in memory", NULL);
-			card_probe_interval = card_probe_interval_pin;
-			goto out;
-		}
-		agent_piv_close(B_TRUE);
+	return ((at == NULL) ? tokens : at);
+}
 
-		err = wrap_pin_error(err, retries);
+static struct card_job *
+card_job_new(SocketEntry *e, u_int socknum, u_char type)
+{
+	struct card_job *job;
+
+	job = calloc(1, sizeof (struct card_job));
+	VERIFY(job != NULL);
+	job->cj_socknum = socknum;
+	job->cj_sockgen = e->gen;
+	job->cj_type = type;
+	job->cj_start = monotime_usec();
+	job->cj_fd = e->fd;
+	job->cj_pid = e->pid;
+	if (e->exepath != NULL) {
+		job->cj_exepath = strdup(e->exepath);
+		VERIFY(job->cj_exepath != NULL);
 	}
-out:
-	explicit_bzero(passwd, pwlen);
-	free(passwd);
-	return (err);
+	if ((job->cj_output = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	return (job);
 }
 
-static const char *
-msg_type_to_name(int msg)
+/* queue one copy of the request on every token's executor */
+static void
+card_job_fanout(SocketEntry *e, u_int socknum, u_char type,
+    void (*merge)(struct card_job *))
 {
-	switch (msg) {
-	case SSH_AGENTC_LOCK:
-		return ("LOCK");
-	case SSH_AGENTC_UNLOCK:
-		return ("UNLOCK");
-	case SSH2_AGENTC_SIGN_REQUEST:
-		return ("SIGN_REQUEST");
-	case SSH2_AGENTC_ADD_IDENTITY:
-		return ("ADD_IDENTITY");
-	case SSH2_AGENTC_REMOVE_IDENTITY:
-		return ("REMOVE_IDENTITY");
-	case SSH2_AGENTC_REQUEST_IDENTITIES:
-		return ("REQUEST_IDENTITIES");
-	case SSH2_AGENTC_REMOVE_ALL_IDENTITIES:
-		return ("REMOVE_ALL_IDENTITIES");
-	case SSH_AGENTC_ADD_SMARTCARD_KEY:
-		return ("ADD_SMARTCARD_KEY");
-	case SSH_AGENTC_REMOVE_SMARTCARD_KEY:
-		return ("REMOVE_SMARTCARD_KEY");
-	case SSH2_AGENTC_EXTENSION:
-		return ("EXTENSION");
-	default:
-		return ("UNKNOWN");
+	struct card_job *job, *cj;
+	struct agent_token *at;
+	int r;
+
+	job = card_job_new(e, socknum, type);
+	job->cj_seq = e->seq_next++;
+	job->cj_merge = merge;
+	PIVY_PROBE3(agent__dispatch, socknum, (uint)type, job->cj_seq);
+	for (at = tokens; at != NULL; at = at->at_next) {
+		cj = card_job_new(e, socknum, type);
+		cj->cj_token = at;
+		cj->cj_parent = job;
+		if ((cj->cj_request = sshbuf_new()) == NULL)
+			fatal("%s: sshbuf_new failed", __func__);
+		if ((r = sshbuf_putb(cj->cj_request, e->request)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		cj->cj_sibling = job->cj_children;
+		job->cj_children = cj;
+		++job->cj_pending;
 	}
+	sshbuf_reset(e->request);
+	/*
+	 * Don't submit anything until the list is complete: children
+	 * can come back (on this thread) as soon as they're queued.
+	 */
+	for (cj = job->cj_children; cj != NULL; cj = cj->cj_sibling)
+		card_executor_submit(&cj->cj_token->at_exec, cj);
 }
 
-/* dispatch incoming messages */
+/* frame incoming messages and queue them on the card executors */
 static int
 process_message(u_int socknum)
 {
@@ -1279,8 +4250,9 @@ process_message(u_int socknum)
 	u_char type;
 	const u_char *cp;
 	int r;
-	errf_t *err;
 	SocketEntry *e;
+	struct card_job *job;
+	uint64_t start;
 
 	if (socknum >= sockets_alloc) {
 		fatal("%s: socket number %u >= allocated %u",
@@ -1288,85 +4260,153 @@ process_message(u_int socknum)
 	}
 	e = &sockets[socknum];
 
-	if (sshbuf_len(e->input) < 5)
-		return 0;		/* Incomplete message header. */
-	cp = sshbuf_ptr(e->input);
-	msg_len = PEEK_U32(cp);
-	if (msg_len > AGENT_MAX_LEN) {
-		sdebug("%s: socket %u (fd=%d) message too long %u > %u",
-		    __func__, socknum, e->fd, msg_len, AGENT_MAX_LEN);
-		return -1;
-	}
-	if (sshbuf_len(e->input) < msg_len + 4)
-		return 0;		/* Incomplete message body. */
-
-	/* move the current input to e->request */
-	sshbuf_reset(e->request);
-	if ((r = sshbuf_get_stringb(e->input, e->request)) != 0 ||
-	    (r = sshbuf_get_u8(e->request, &type)) != 0) {
-		if (r == SSH_ERR_MESSAGE_INCOMPLETE ||
-		    r == SSH_ERR_STRING_TOO_LARGE) {
-			sdebug("%s: buffer error: %s", __func__, ssh_err(r));
+	/* Take every complete message we have room for. */
+	while (e->inflight < AGENT_MAX_INFLIGHT) {
+		if (sshbuf_len(e->input) < 5)
+			return 0;	/* Incomplete message header. */
+		cp = sshbuf_ptr(e->input);
+		msg_len = PEEK_U32(cp);
+		if (msg_len > AGENT_MAX_LEN) {
+			sdebug("%s: socket %u (fd=%d) message too long %u > %u",
+			    __func__, socknum, e->fd, msg_len, AGENT_MAX_LEN);
 			return -1;
 		}
-		fatal("%s: buffer error: %s", __func__, ssh_err(r));
-	}
+		if (sshbuf_len(e->input) < msg_len + 4)
+			return 0;	/* Incomplete message body. */
 
-	msg_log_frame = bunyan_push(
-	    "fd", BNY_INT, e->fd,
-	    "msg_type", BNY_INT, (int)type,
-	    "msg_type_name", BNY_STRING, msg_type_to_name(type),
-	    "remote_pid", BNY_INT, (int)e->pid,
-	    "remote_cmd", BNY_STRING, (e->exepath == NULL) ? "???" : e->exepath,
-	    NULL);
-	bunyan_log(BNY_DEBUG, "received ssh-agent message", NULL);
+		/* move the current input to e->request */
+		sshbuf_reset(e->request);
+		if ((r = sshbuf_get_stringb(e->input, e->request)) != 0 ||
+		    (r = sshbuf_get_u8(e->request, &type)) != 0) {
+			if (r == SSH_ERR_MESSAGE_INCOMPLETE ||
+			    r == SSH_ERR_STRING_TOO_LARGE) {
+				sdebug("%s: buffer error: %s", __func__,
+				    ssh_err(r));
+				return -1;
+			}
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		}
 
-	last_op = monotime();
+		/*
+		 * We can only answer straight into e->output if that
+		 * doesn't put this reply ahead of any earlier ones.
+		 */
+		start = monotime_usec();
+		if (type == SSH2_AGENTC_REQUEST_IDENTITIES &&
+		    e->inflight == 0 && answer_identities(e)) {
+			stats_job(type, start, B_FALSE, 0, 0);
+			sshbuf_reset(e->request);
+			continue;
+		}
 
-	switch (type) {
-	case SSH_AGENTC_LOCK:
-	case SSH_AGENTC_UNLOCK:
-		err = process_lock_agent(e, type == SSH_AGENTC_LOCK);
-		break;
-	/* ssh2 */
-	case SSH2_AGENTC_SIGN_REQUEST:
-		err = process_sign_request2(e);
-		break;
-	case SSH2_AGENTC_REQUEST_IDENTITIES:
-		err = process_request_identities(e);
-		break;
-	case SSH2_AGENTC_REMOVE_ALL_IDENTITIES:
-		err = process_remove_all_identities(e);
-		break;
-	case SSH2_AGENTC_EXTENSION:
-		err = process_extension(e);
-		break;
-	default:
-		/* Unknown message.  Respond with failure. */
-		err = errf("UnknownMessageError", NULL,
-		    "unknown/unsupported agent protocol message %d", type);
-		break;
-	}
+		if (!cards_started)
+			cards_start();
 
-	if (err) {
-		bunyan_log(BNY_WARN, "failed to process command",
-		    "error", BNY_ERF, err, NULL);
-		if (errf_caused_by(err, "NoPINError") &&
-		    bunyan_get_level() > BNY_WARN) {
-			warnfx(err, "denied command due to lack of PIN");
+		++e->inflight;
+
+		switch (type) {
+		case SSH2_AGENTC_REQUEST_IDENTITIES:
+			card_job_fanout(e, socknum, type, merge_identities);
+			continue;
+		case SSH_AGENTC_LOCK:
+		case SSH_AGENTC_UNLOCK:
+		case SSH2_AGENTC_REMOVE_ALL_IDENTITIES:
+			card_job_fanout(e, socknum, type, merge_status);
+			continue;
 		}
-		sshbuf_reset(e->request);
-		send_status(e, 0);
-		errf_free(err);
-	} else {
-		bunyan_log(BNY_INFO, "processed ssh-agent message", NULL);
-	}
 
-	bunyan_pop(msg_log_frame);
+		job = card_job_new(e, socknum, type);
+		job->cj_seq = e->seq_next++;
+		job->cj_token = route_request(type, e->request);
+		PIVY_PROBE3(agent__dispatch, socknum, (uint)type, job->cj_seq);
+		/* The job takes over the request buffer. */
+		job->cj_request = e->request;
+		if ((e->request = sshbuf_new()) == NULL)
+			fatal("%s: sshbuf_new failed", __func__);
+
+		card_executor_submit(&job->cj_token->at_exec, job);
+	}
 	return 0;
 }
 
-extern void *reallocarray(void *ptr, size_t nmemb, size_t size);
+/*
+ * Files a finished job's reply on its connection: straight into e->output
+ * if it's the next one due (along with any held ones which follow it),
+ * otherwise onto e->held until the earlier ones are done.
+ */
+static void
+card_job_reply(SocketEntry *e, struct card_job *job)
+{
+	struct card_job **pp;
+	int r;
+
+	for (pp = &e->held; *pp != NULL; pp = &(*pp)->cj_next) {
+		if ((int)(job->cj_seq - (*pp)->cj_seq) < 0)
+			break;
+	}
+	job->cj_next = *pp;
+	*pp = job;
+
+	while ((job = e->held) != NULL && job->cj_seq == e->seq_reply) {
+		e->held = job->cj_next;
+		if ((r = sshbuf_putb(e->output, job->cj_output)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		++e->seq_reply;
+		card_job_free(job);
+	}
+}
+
+/* collect finished jobs from the card executors and send their replies */
+static void
+handle_card_done(void)
+{
+	u_char buf[64];
+	struct card_job *job, *next;
+	SocketEntry *e;
+
+	while (read(card_done_pipe[0], buf, sizeof (buf)) > 0)
+		;
+
+	VERIFY0(pthread_mutex_lock(&card_done_mtx));
+	job = card_done;
+	card_done = NULL;
+	card_done_tail = &card_done;
+	VERIFY0(pthread_mutex_unlock(&card_done_mtx));
+
+	for (; job != NULL; job = next) {
+		next = job->cj_next;
+		if (job->cj_parent != NULL) {
+			job->cj_parent->cj_apdus += job->cj_apdus;
+			job->cj_parent->cj_apdu_bytes += job->cj_apdu_bytes;
+			if (job->cj_failed)
+				job->cj_parent->cj_failed = B_TRUE;
+			/* Wait for the rest of the fan-out to finish. */
+			if (--job->cj_parent->cj_pending > 0)
+				continue;
+			job = job->cj_parent;
+			job->cj_merge(job);
+		}
+		stats_job(job->cj_type, job->cj_start, job->cj_failed,
+		    job->cj_apdus, job->cj_apdu_bytes);
+		PIVY_PROBE3(agent__done, (uint)job->cj_type,
+		    (int)job->cj_failed, monotime_usec() - job->cj_start);
+		VERIFY3U(job->cj_socknum, <, sockets_alloc);
+		e = &sockets[job->cj_socknum];
+		if (e->type != AUTH_CONNECTION || e->gen != job->cj_sockgen) {
+			/* Connection went away while we were busy. */
+			card_job_free(job);
+			continue;
+		}
+		VERIFY3U(e->inflight, >, 0);
+		--e->inflight;
+		card_job_reply(e, job);
+		/* There may be more requests waiting for a free slot. */
+		if (process_message(e - sockets) != 0)
+			close_socket(e);
+		else
+			ev_sync(e);
+	}
+}
 
 static SocketEntry *
 new_socket(sock_type type, int fd)
@@ -1381,6 +4421,10 @@ new_socket(sock_type type, int fd)
 	for (i = 0; i < sockets_alloc; i++)
 		if (sockets[i].type == AUTH_UNUSED) {
 			sockets[i].fd = fd;
+			sockets[i].gen = ++sock_gen;
+			sockets[i].inflight = 0;
+			sockets[i].seq_next = sockets[i].seq_reply = 0;
+			sockets[i].held = NULL;
 			if ((sockets[i].input = sshbuf_new()) == NULL)
 				fatal("%s: sshbuf_new failed", __func__);
 			if ((sockets[i].output = sshbuf_new()) == NULL)
@@ -1388,6 +4432,7 @@ new_socket(sock_type type, int fd)
 			if ((sockets[i].request = sshbuf_new()) == NULL)
 				fatal("%s: sshbuf_new failed", __func__);
 			sockets[i].type = type;
+			ev_add(&sockets[i]);
 			return (&sockets[i]);
 		}
 	old_alloc = sockets_alloc;
@@ -1398,6 +4443,10 @@ new_socket(sock_type type, int fd)
 		sockets[i].type = AUTH_UNUSED;
 	sockets_alloc = new_alloc;
 	sockets[old_alloc].fd = fd;
+	sockets[old_alloc].gen = ++sock_gen;
+	sockets[old_alloc].inflight = 0;
+	sockets[old_alloc].seq_next = sockets[old_alloc].seq_reply = 0;
+	sockets[old_alloc].held = NULL;
 	if ((sockets[old_alloc].input = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
 	if ((sockets[old_alloc].output = sshbuf_new()) == NULL)
@@ -1405,6 +4454,7 @@ new_socket(sock_type type, int fd)
 	if ((sockets[old_alloc].request = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
 	sockets[old_alloc].type = type;
+	ev_add(&sockets[old_alloc]);
 	return (&sockets[old_alloc]);
 }
 
@@ -1516,168 +4566,441 @@ handle_socket_read(u_int socknum)
 	return 0;
 }
 
+/*
+ * Reads straight into the connection's input buffer until the socket's
+ * drained (or there's already enough there for a maximum-size message), so
+ * that everything the client has pipelined is dealt with in one go.
+ */
+static int
+handle_conn_read(u_int socknum)
+{
+	SocketEntry *e = &sockets[socknum];
+	u_char *p;
+	ssize_t len;
+	int r;
+
+	while (sshbuf_len(e->input) < AGENT_MAX_LEN + 4) {
+		r = sshbuf_reserve(e->input, AGENT_READ_CHUNK, &p);
+		if (r != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		len = read(e->fd, p, AGENT_READ_CHUNK);
+		r = sshbuf_consume_end(e->input,
+		    AGENT_READ_CHUNK - (len > 0 ? len : 0));
+		if (r != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		if (len == 0)
+			return -1;
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			error("%s: read error on socket %u (fd %d): %s",
+			    __func__, socknum, e->fd, strerror(errno));
+			return -1;
+		}
+		if (len < AGENT_READ_CHUNK)
+			break;
+	}
+	return (process_message(socknum));
+}
+
+static int
+handle_conn_write(u_int socknum)
+{
+	ssize_t len;
+	int r;
+
+	if (sshbuf_len(sockets[socknum].output) == 0)
+		return 0; /* shouldn't happen */
+	if ((len = write(sockets[socknum].fd,
+	    sshbuf_ptr(sockets[socknum].output),
+	    sshbuf_len(sockets[socknum].output))) <= 0) {
+		if (len == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				return 0;
+			error("%s: read error on socket %u (fd %d): %s",
+			    __func__, socknum, sockets[socknum].fd,
+			    strerror(errno));
+		}
+		return -1;
+	}
+	if ((r = sshbuf_consume(sockets[socknum].output, len)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	return 0;
+}
+
+static void
+handle_socket_event(u_int socknum, boolean_t readable, boolean_t writable)
+{
+	switch (sockets[socknum].type) {
+	case AUTH_SOCKET:
+		if (readable && handle_socket_read(socknum) != 0)
+			close_socket(&sockets[socknum]);
+		break;
+	case AUTH_CONNECTION:
+		if (readable && handle_conn_read(socknum) != 0) {
+			close_socket(&sockets[socknum]);
+			break;
+		}
+		/*
+		 * Anything we could answer straight away goes out now, in
+		 * one write, rather than after another trip round the loop.
+		 */
+		if ((writable || sshbuf_len(sockets[socknum].output) > 0) &&
+		    handle_conn_write(socknum) != 0)
+			close_socket(&sockets[socknum]);
+		break;
+	case AUTH_NOTIFY:
+		if (readable)
+			handle_card_done();
+		break;
+	default:
+		break;
+	}
+	ev_sync(&sockets[socknum]);
+}
+
+static int
+agent_timeout(void)
+{
+	uint64_t deadline = 0;
+
+	/*
+	 * Transaction and card probe timeouts are handled by the card
+	 * executor now, so the only timer left here is the parent check.
+	 */
+	if (parent_alive_interval != 0)
+		deadline = parent_alive_interval * 1000;
+	if (deadline == 0)
+		return (-1); /* INFTIM */
+	if (deadline > INT_MAX)
+		return (INT_MAX);
+	return (deadline);
+}
+
+#if defined(EV_EPOLL)
+
+static int ev_fd = -1;
+
+static void
+ev_init(void)
+{
+	if ((ev_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		fatal("epoll_create1: %s", strerror(errno));
+}
+
+static void
+ev_ctl(SocketEntry *e, int op)
+{
+	struct epoll_event ev;
+
+	bzero(&ev, sizeof (ev));
+	ev.events = EPOLLIN;
+	if (e->evwrite)
+		ev.events |= EPOLLOUT;
+	ev.data.u32 = e - sockets;
+	if (epoll_ctl(ev_fd, op, e->fd, &ev) == -1)
+		fatal("epoll_ctl(%d): %s", e->fd, strerror(errno));
+}
+
+static void
+ev_add(SocketEntry *e)
+{
+	e->evwrite = B_FALSE;
+	ev_ctl(e, EPOLL_CTL_ADD);
+}
+
+static void
+ev_del(SocketEntry *e)
+{
+	struct epoll_event ev;
+
+	(void) epoll_ctl(ev_fd, EPOLL_CTL_DEL, e->fd, &ev);
+}
+
+static void
+ev_sync(SocketEntry *e)
+{
+	boolean_t want;
+
+	if (e->type == AUTH_UNUSED)
+		return;
+	want = (sshbuf_len(e->output) > 0);
+	if (want == e->evwrite)
+		return;
+	e->evwrite = want;
+	ev_ctl(e, EPOLL_CTL_MOD);
+}
+
 static int
-handle_conn_read(u_int socknum)
+ev_wait(int timeout)
 {
-	char buf[1024];
-	ssize_t len;
-	int r;
+	struct epoll_event evs[32];
+	u_int socknum;
+	int i, n;
 
-	if ((len = read(sockets[socknum].fd, buf, sizeof(buf))) <= 0) {
-		if (len == -1) {
-			if (errno == EAGAIN || errno == EINTR)
-				return 0;
-			error("%s: read error on socket %u (fd %d): %s",
-			    __func__, socknum, sockets[socknum].fd,
-			    strerror(errno));
-		}
-		return -1;
+	n = epoll_wait(ev_fd, evs, 32, timeout);
+	for (i = 0; i < n; ++i) {
+		socknum = evs[i].data.u32;
+		if (socknum >= sockets_alloc ||
+		    sockets[socknum].type == AUTH_UNUSED)
+			continue;
+		handle_socket_event(socknum,
+		    (evs[i].events & (EPOLLIN|EPOLLERR)) != 0,
+		    (evs[i].events & (EPOLLOUT|EPOLLHUP)) != 0);
 	}
-	if ((r = sshbuf_put(sockets[socknum].input, buf, len)) != 0)
-		fatal("%s: buffer error: %s", __func__, ssh_err(r));
-	explicit_bzero(buf, sizeof(buf));
-	process_message(socknum);
-	return 0;
+	return (n);
+}
+
+#elif defined(EV_KQUEUE)
+
+static int ev_fd = -1;
+
+static void
+ev_init(void)
+{
+	if ((ev_fd = kqueue()) == -1)
+		fatal("kqueue: %s", strerror(errno));
+}
+
+static void
+ev_change(SocketEntry *e, int filter, int flags)
+{
+	struct kevent kev;
+
+	EV_SET(&kev, e->fd, filter, flags, 0, 0,
+	    (void *)(uintptr_t)(e - sockets));
+	if (kevent(ev_fd, &kev, 1, NULL, 0, NULL) == -1 &&
+	    (flags & EV_DELETE) == 0)
+		fatal("kevent(%d): %s", e->fd, strerror(errno));
+}
+
+static void
+ev_add(SocketEntry *e)
+{
+	e->evwrite = B_FALSE;
+	ev_change(e, EVFILT_READ, EV_ADD);
+}
+
+static void
+ev_del(SocketEntry *e)
+{
+	ev_change(e, EVFILT_READ, EV_DELETE);
+	if (e->evwrite)
+		ev_change(e, EVFILT_WRITE, EV_DELETE);
+}
+
+static void
+ev_sync(SocketEntry *e)
+{
+	boolean_t want;
+
+	if (e->type == AUTH_UNUSED)
+		return;
+	want = (sshbuf_len(e->output) > 0);
+	if (want == e->evwrite)
+		return;
+	e->evwrite = want;
+	ev_change(e, EVFILT_WRITE, want ? EV_ADD : EV_DELETE);
 }
 
 static int
-handle_conn_write(u_int socknum)
+ev_wait(int timeout)
 {
-	ssize_t len;
-	int r;
+	struct kevent kevs[32];
+	struct timespec ts, *tsp = NULL;
+	u_int socknum;
+	int i, n;
 
-	if (sshbuf_len(sockets[socknum].output) == 0)
-		return 0; /* shouldn't happen */
-	if ((len = write(sockets[socknum].fd,
-	    sshbuf_ptr(sockets[socknum].output),
-	    sshbuf_len(sockets[socknum].output))) <= 0) {
-		if (len == -1) {
-			if (errno == EAGAIN || errno == EINTR)
-				return 0;
-			error("%s: read error on socket %u (fd %d): %s",
-			    __func__, socknum, sockets[socknum].fd,
-			    strerror(errno));
-		}
-		return -1;
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		tsp = &ts;
 	}
-	if ((r = sshbuf_consume(sockets[socknum].output, len)) != 0)
-		fatal("%s: buffer error: %s", __func__, ssh_err(r));
-	return 0;
+	n = kevent(ev_fd, NULL, 0, kevs, 32, tsp);
+	for (i = 0; i < n; ++i) {
+		socknum = (uintptr_t)kevs[i].udata;
+		if (socknum >= sockets_alloc ||
+		    sockets[socknum].type == AUTH_UNUSED ||
+		    sockets[socknum].fd != (int)kevs[i].ident)
+			continue;
+		handle_socket_event(socknum,
+		    kevs[i].filter == EVFILT_READ,
+		    kevs[i].filter == EVFILT_WRITE);
+	}
+	return (n);
+}
+
+#elif defined(EV_PORT)
+
+static int ev_fd = -1;
+
+static void
+ev_init(void)
+{
+	if ((ev_fd = port_create()) == -1)
+		fatal("port_create: %s", strerror(errno));
 }
 
+/* Port associations are one-shot, so this is also used to re-arm. */
 static void
-after_poll(struct pollfd *pfd, size_t npfd)
+ev_assoc(SocketEntry *e)
 {
-	size_t i;
+	int events = POLLIN;
+
+	if (e->evwrite)
+		events |= POLLOUT;
+	if (port_associate(ev_fd, PORT_SOURCE_FD, e->fd, events,
+	    (void *)(uintptr_t)(e - sockets)) == -1)
+		fatal("port_associate(%d): %s", e->fd, strerror(errno));
+}
+
+static void
+ev_add(SocketEntry *e)
+{
+	e->evwrite = B_FALSE;
+	ev_assoc(e);
+}
+
+static void
+ev_del(SocketEntry *e)
+{
+	(void) port_dissociate(ev_fd, PORT_SOURCE_FD, e->fd);
+}
+
+static void
+ev_sync(SocketEntry *e)
+{
+	boolean_t want;
+
+	if (e->type == AUTH_UNUSED)
+		return;
+	want = (sshbuf_len(e->output) > 0);
+	if (want == e->evwrite)
+		return;
+	e->evwrite = want;
+	ev_assoc(e);
+}
+
+static int
+ev_wait(int timeout)
+{
+	port_event_t pevs[32];
+	struct timespec ts, *tsp = NULL;
+	uint_t i, n = 1;
 	u_int socknum;
+	SocketEntry *e;
 
-	for (i = 0; i < npfd; i++) {
-		if (pfd[i].revents == 0)
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		tsp = &ts;
+	}
+	if (port_getn(ev_fd, pevs, 32, &n, tsp) == -1) {
+		if (errno == ETIME)
+			return (0);
+		if (n == 0)
+			return (-1);
+	}
+	for (i = 0; i < n; ++i) {
+		socknum = (uintptr_t)pevs[i].portev_user;
+		if (socknum >= sockets_alloc)
 			continue;
-		/* Find sockets entry */
-		for (socknum = 0; socknum < sockets_alloc; socknum++) {
-			if (sockets[socknum].type != AUTH_SOCKET &&
-			    sockets[socknum].type != AUTH_CONNECTION)
-				continue;
-			if (pfd[i].fd == sockets[socknum].fd)
-				break;
-		}
-		if (socknum >= sockets_alloc) {
-			error("%s: no socket for fd %d", __func__, pfd[i].fd);
+		e = &sockets[socknum];
+		if (e->type == AUTH_UNUSED ||
+		    e->fd != (int)pevs[i].portev_object)
 			continue;
-		}
-		/* Process events */
-		switch (sockets[socknum].type) {
-		case AUTH_SOCKET:
-			if ((pfd[i].revents & (POLLIN|POLLERR)) != 0 &&
-			    handle_socket_read(socknum) != 0)
-				close_socket(&sockets[socknum]);
-			break;
-		case AUTH_CONNECTION:
-			if ((pfd[i].revents & (POLLIN|POLLERR)) != 0 &&
-			    handle_conn_read(socknum) != 0) {
-				close_socket(&sockets[socknum]);
-				break;
-			}
-			if ((pfd[i].revents & (POLLOUT|POLLHUP)) != 0 &&
-			    handle_conn_write(socknum) != 0)
-				close_socket(&sockets[socknum]);
-			break;
-		default:
-			break;
-		}
+		handle_socket_event(socknum,
+		    (pevs[i].portev_events & (POLLIN|POLLERR)) != 0,
+		    (pevs[i].portev_events & (POLLOUT|POLLHUP)) != 0);
+		if (e->type != AUTH_UNUSED &&
+		    e->fd == (int)pevs[i].portev_object)
+			ev_assoc(e);
 	}
+	return (n);
+}
+
+#else	/* poll(2) */
+
+static struct pollfd *ev_pfd = NULL;
+static u_int *ev_pfdsock = NULL;
+static size_t ev_npfd = 0;
+
+static void
+ev_init(void)
+{
+}
+
+static void
+ev_add(SocketEntry *e)
+{
+}
+
+static void
+ev_del(SocketEntry *e)
+{
+}
+
+static void
+ev_sync(SocketEntry *e)
+{
 }
 
 static int
-prepare_poll(struct pollfd **pfdp, size_t *npfdp, int *timeoutp)
+ev_wait(int timeout)
 {
-	struct pollfd *pfd = *pfdp;
-	size_t i, j, npfd = 0;
-	uint64_t now, deadline;
+	size_t i, npfd = 0;
+	int result;
 
-	/* Count active sockets */
 	for (i = 0; i < sockets_alloc; i++) {
-		switch (sockets[i].type) {
-		case AUTH_SOCKET:
-		case AUTH_CONNECTION:
+		if (sockets[i].type != AUTH_UNUSED)
 			npfd++;
-			break;
-		case AUTH_UNUSED:
-			break;
-		default:
-			fatal("Unknown socket type %d", sockets[i].type);
-			break;
-		}
 	}
-	if (npfd != *npfdp &&
-	    (pfd = recallocarray(pfd, *npfdp, npfd, sizeof(struct pollfd))) == NULL)
-		fatal("%s: recallocarray failed", __func__);
-	*pfdp = pfd;
-	*npfdp = npfd;
-
-	for (i = j = 0; i < sockets_alloc; i++) {
-		switch (sockets[i].type) {
-		case AUTH_SOCKET:
-		case AUTH_CONNECTION:
-			pfd[j].fd = sockets[i].fd;
-			pfd[j].revents = 0;
-			/* XXX backoff when input buffer full */
-			pfd[j].events = POLLIN;
-			if (sshbuf_len(sockets[i].output) > 0)
-				pfd[j].events |= POLLOUT;
-			j++;
-			break;
-		default:
-			break;
-		}
+	if (npfd != ev_npfd) {
+		ev_pfd = recallocarray(ev_pfd, ev_npfd, npfd,
+		    sizeof (struct pollfd));
+		ev_pfdsock = recallocarray(ev_pfdsock, ev_npfd, npfd,
+		    sizeof (u_int));
+		if (ev_pfd == NULL || ev_pfdsock == NULL)
+			fatal("%s: recallocarray failed", __func__);
+		ev_npfd = npfd;
 	}
-	now = monotime();
-	deadline = txnopen ? (txntimeout - now) : 0;
-	if (parent_alive_interval != 0)
-		deadline = (deadline == 0) ? parent_alive_interval * 1000 :
-		    MINIMUM(deadline, parent_alive_interval * 1000);
-	if (card_probe_interval != 0)
-		deadline = (deadline == 0) ? card_probe_interval * 1000 :
-		    MINIMUM(deadline, card_probe_interval * 1000);
-	if (deadline == 0) {
-		*timeoutp = -1; /* INFTIM */
-	} else {
-		if (deadline > INT_MAX)
-			*timeoutp = INT_MAX;
-		else
-			*timeoutp = deadline;
+	for (i = npfd = 0; i < sockets_alloc; i++) {
+		if (sockets[i].type == AUTH_UNUSED)
+			continue;
+		ev_pfd[npfd].fd = sockets[i].fd;
+		ev_pfd[npfd].revents = 0;
+		/* XXX backoff when input buffer full */
+		ev_pfd[npfd].events = POLLIN;
+		if (sshbuf_len(sockets[i].output) > 0)
+			ev_pfd[npfd].events |= POLLOUT;
+		ev_pfdsock[npfd] = i;
+		npfd++;
+	}
+
+	result = poll(ev_pfd, npfd, timeout);
+	for (i = 0; result > 0 && i < npfd; i++) {
+		if (ev_pfd[i].revents == 0)
+			continue;
+		if (sockets[ev_pfdsock[i]].fd != ev_pfd[i].fd)
+			continue;
+		handle_socket_event(ev_pfdsock[i],
+		    (ev_pfd[i].revents & (POLLIN|POLLERR)) != 0,
+		    (ev_pfd[i].revents & (POLLOUT|POLLHUP)) != 0);
 	}
-	return (1);
+	return (result);
 }
 
+#endif
+
 static void
 cleanup_socket(void)
 {
 	if (cleanup_pid != 0 && getpid() != cleanup_pid)
 		return;
 	sdebug("%s: cleanup", __func__);
-	if (socket_name[0])
+	if (socket_name[0] && !socket_activated)
 		unlink(socket_name);
 	if (socket_dir[0])
 		rmdir(socket_dir);
@@ -1694,11 +5017,15 @@ cleanup_exit(int i)
 static void
 cleanup_handler(int sig)
 {
+	struct agent_token *at;
+
 	cleanup_socket();
-	if (selk != NULL && piv_token_in_txn(selk))
-		piv_txn_end(selk);
-	piv_release(ks);
-	SCardReleaseContext(ctx);
+	for (at = tokens; at != NULL; at = at->at_next) {
+		if (at->at_selk != NULL && piv_token_in_txn(at->at_selk))
+			piv_txn_end(at->at_selk);
+		piv_release(at->at_ks);
+		SCardReleaseContext(at->at_ctx);
+	}
 	_exit(2);
 }
 
@@ -1721,8 +5048,9 @@ static void
 usage(void)
 {
 	fprintf(stderr,
-	    "usage: pivy-agent [-c | -s] [-Ddim] [-a bind_address] [-E fingerprint_hash]\n"
-	    "                  [-K cak] -g guid [command [arg ...]]\n"
+	    "usage: pivy-agent [-c | -s] [-DdimS] [-a bind_address] [-E fingerprint_hash]\n"
+	    "                  [-B ttl[:count]] [-C cache_dir] [-T txn_policy]\n"
+	    "                  [-K cak [-V secs]] -g guid [-g guid ...] [command [arg ...]]\n"
 	    "       pivy-agent [-c | -s] -k\n"
 	    "\n"
 	    "An ssh-agent work-alike which always contains the keys stored on\n"
@@ -1730,16 +5058,31 @@ usage(void)
 	    "\n"
 	    "Options:\n"
 	    "  -a bind_address       Bind to a specific UNIX domain socket\n"
+	    "  -B ttl[:count]        Remember up to count (default 16) opened\n"
+	    "                        boxes for ttl seconds (max 300), so that\n"
+	    "                        opening them again needs no card access\n"
+	    "  -C cache_dir          Cache token public state here (default\n"
+	    "                        ~/.cache/pivy-agent, 'none' to disable)\n"
 	    "  -c                    Generate csh style commands on stdout\n"
 	    "  -s                    Generate Bourne shell style commands\n"
 	    "  -D                    Foreground mode; do not fork\n"
 	    "  -d                    Debug mode\n"
 	    "  -i                    Foreground + command logging\n"
 	    "  -m                    Allow signing with 9D (KEY_MGMT) key\n"
+	    "  -S                    Nothing else uses the card: don't SELECT\n"
+	    "                        the PIV applet again between transactions\n"
 	    "  -E fp_hash            Set hash algo for fingerprints\n"
 	    "  -g guid               GUID or GUID prefix of PIV token to use\n"
+	    "                        (may be given more than once)\n"
 	    "  -K cak                9E (card auth) key to authenticate PIV token\n"
+	    "                        (the n-th -K goes with the n-th -g)\n"
+	    "  -V secs               Trust a CAK check for up to secs seconds\n"
+	    "                        (default 3600, 0 = check every time) while\n"
+	    "                        the card stays in its reader\n"
 	    "  -k                    Kill an already-running agent\n"
+	    "  -T txn_policy         How long to keep the card open between\n"
+	    "                        requests: fixed[:ms] (default 2000),\n"
+	    "                        adaptive[:min_ms:max_ms] or exclusive\n"
 	    "  -U                    Don't check client UID (allow any uid to connect)\n"
 #if defined(__sun)
 	    "  -Z                    Don't check client zoneid (allow any zone to connect)\n"
@@ -1748,6 +5091,86 @@ usage(void)
 	exit(1);
 }
 
+static boolean_t
+parse_txn_policy(const char *arg)
+{
+	const char *errstr = NULL;
+	char *buf, *p, *min, *max;
+	boolean_t ok = B_TRUE;
+
+	buf = strdup(arg);
+	VERIFY(buf != NULL);
+	if ((p = strchr(buf, ':')) != NULL)
+		*p++ = '\0';
+
+	if (strcmp(buf, "fixed") == 0) {
+		txn_policy = TXN_FIXED;
+		if (p != NULL)
+			txn_hold_ms = strtonum(p, 0, 3600000, &errstr);
+	} else if (strcmp(buf, "adaptive") == 0) {
+		txn_policy = TXN_ADAPTIVE;
+		if (p != NULL) {
+			min = p;
+			if ((max = strchr(min, ':')) == NULL) {
+				ok = B_FALSE;
+				goto out;
+			}
+			*max++ = '\0';
+			txn_hold_min = strtonum(min, 0, 3600000, &errstr);
+			if (errstr == NULL) {
+				txn_hold_max = strtonum(max, 0, 3600000,
+				    &errstr);
+			}
+			if (errstr == NULL && txn_hold_min > txn_hold_max)
+				ok = B_FALSE;
+		}
+	} else if (strcmp(buf, "exclusive") == 0 && p == NULL) {
+		txn_policy = TXN_EXCLUSIVE;
+	} else {
+		ok = B_FALSE;
+	}
+	if (errstr != NULL)
+		ok = B_FALSE;
+out:
+	free(buf);
+	return (ok);
+}
+
+static boolean_t
+parse_box_cache(const char *arg)
+{
+	const char *errstr = NULL;
+	char *buf, *p;
+	uint64_t ttl;
+
+	buf = strdup(arg);
+	VERIFY(buf != NULL);
+	if ((p = strchr(buf, ':')) != NULL)
+		*p++ = '\0';
+
+	ttl = strtonum(buf, 1, BOX_CACHE_MAX_TTL, &errstr);
+	if (errstr == NULL && p != NULL)
+		box_cache_max = strtonum(p, 1, BOX_CACHE_MAX_COUNT, &errstr);
+	free(buf);
+	if (errstr != NULL)
+		return (B_FALSE);
+	box_cache_ttl = ttl * 1000;
+	return (B_TRUE);
+}
+
+static boolean_t
+parse_cak_reproof(const char *arg)
+{
+	const char *errstr = NULL;
+	uint64_t secs;
+
+	secs = strtonum(arg, 0, CAK_REPROOF_MAX, &errstr);
+	if (errstr != NULL)
+		return (B_FALSE);
+	cak_reproof = secs * 1000;
+	return (B_TRUE);
+}
+
 static uint8_t *
 parse_hex(const char *str, uint *outlen)
 {
@@ -1899,6 +5322,95 @@ strtonum(const char *numstr, long long minval, long long maxval,
 }
 #endif
 
+/*
+ * Sets up a PCSC context for each token and starts the executors (which go
+ * off and find their cards) and the presence watcher. Normally done at
+ * startup, but deferred until the first request comes in if we were socket
+ * activated, so that an agent nobody is using yet costs next to nothing and
+ * session startup never waits on pcscd.
+ */
+static void
+cards_start(void)
+{
+	struct agent_token *at;
+	LONG r;
+
+	VERIFY(!cards_started);
+	cards_started = B_TRUE;
+
+	/*
+	 * Each executor gets its own PCSC context, since they're not safe to
+	 * share between threads.
+	 */
+	for (at = tokens; at != NULL; at = at->at_next) {
+		r = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL,
+		    &at->at_ctx);
+		if (r != SCARD_S_SUCCESS && virt_tokens) {
+			/* The virtual tokens don't need pcscd. */
+			at->at_ctx = 0;
+		} else if (r != SCARD_S_SUCCESS) {
+			bunyan_log(BNY_ERROR, "SCardEstablishContext failed",
+			    "error", BNY_STRING, pcsc_stringify_error(r), NULL);
+			cleanup_exit(1);
+		}
+	}
+
+	for (at = tokens; at != NULL; at = at->at_next)
+		card_executor_start(at);
+	presence_watcher_start();
+}
+
+/*
+ * Returns the listening socket we've been handed by systemd (LISTEN_FDS) or
+ * launchd (the "Listeners" entry under Sockets in our plist), or -1 if we
+ * weren't socket activated.
+ */
+static int
+activated_socket(void)
+{
+	int fd;
+#if defined(__APPLE__)
+	int *fds = NULL;
+	size_t i, nfds = 0;
+
+	if (launch_activate_socket("Listeners", &fds, &nfds) != 0 ||
+	    nfds == 0) {
+		free(fds);
+		return (-1);
+	}
+	fd = fds[0];
+	for (i = 1; i < nfds; ++i)
+		close(fds[i]);
+	free(fds);
+#else
+	const char *pidstr, *fdstr, *errstr = NULL;
+	pid_t pid;
+	long long nfds;
+
+	pidstr = getenv("LISTEN_PID");
+	fdstr = getenv("LISTEN_FDS");
+	if (pidstr == NULL || fdstr == NULL)
+		return (-1);
+	pid = (pid_t)strtonum(pidstr, 1, INT_MAX, &errstr);
+	if (errstr != NULL || pid != getpid())
+		return (-1);
+	nfds = strtonum(fdstr, 1, INT_MAX, &errstr);
+	if (errstr != NULL)
+		return (-1);
+	/* Don't pass these on to the command we run, if any. */
+	(void) unsetenv("LISTEN_PID");
+	(void) unsetenv("LISTEN_FDS");
+	(void) unsetenv("LISTEN_FDNAMES");
+
+	/* SD_LISTEN_FDS_START: we only use the first one. */
+	fd = 3;
+	for (; nfds > 1; --nfds)
+		close(fd + nfds - 1);
+#endif
+	(void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return (fd);
+}
+
 int
 main(int ac, char **av)
 {
@@ -1912,12 +5424,15 @@ main(int ac, char **av)
 	char pidstrbuf[1 + 3 * sizeof pid];
 	uint len = 0;
 	mode_t prev_mask;
-	int timeout = -1; /* INFTIM */
-	struct pollfd *pfd = NULL;
-	size_t npfd = 0;
-	uint64_t now;
 	char *ptr;
 	int r;
+	struct agent_token *at, **attail = &tokens;
+	struct sshkey **caks = NULL;
+	uint ncaks = 0;
+	uint8_t *guid;
+	boolean_t no_cache = B_FALSE;
+	const char *home;
+	const char *virt;
 	errf_t *err;
 
 #if !defined(__APPLE__)
@@ -1937,17 +5452,27 @@ main(int ac, char **av)
 	bunyan_set_name("pivy-agent");
 
 	__progname = "pivy-agent";
+	stats_start = monotime();
 
-	while ((ch = getopt(ac, av, "cDdkisE:a:P:g:K:mZU")) != -1) {
+	while ((ch = getopt(ac, av, "cDdkisE:a:B:C:P:g:K:mST:V:ZU")) != -1) {
 		switch (ch) {
 		case 'g':
 			guid = parse_hex(optarg, &len);
-			guid_len = len;
 			if (len > 16) {
 				fprintf(stderr, "error: GUID must be <=16 bytes"
 				    " in length (you gave %u)\n", len);
 				exit(3);
 			}
+			at = calloc(1, sizeof (struct agent_token));
+			VERIFY(at != NULL);
+			at->at_guid = guid;
+			at->at_guid_len = len;
+			at->at_probe_interval = card_probe_interval_nopin;
+			VERIFY0(pthread_mutex_init(&at->at_pub_mtx, NULL));
+			VERIFY0(pthread_mutex_init(&at->at_bcache_mtx, NULL));
+			*attail = at;
+			attail = &at->at_next;
+			++ntokens;
 			break;
 		case 'U':
 			check_client_uid = B_FALSE;
@@ -1958,12 +5483,16 @@ main(int ac, char **av)
 			break;
 #endif
 		case 'K':
-			cak = sshkey_new(KEY_UNSPEC);
-			VERIFY(cak != NULL);
+			caks = recallocarray(caks, ncaks, ncaks + 1,
+			    sizeof (struct sshkey *));
+			VERIFY(caks != NULL);
+			caks[ncaks] = sshkey_new(KEY_UNSPEC);
+			VERIFY(caks[ncaks] != NULL);
 			ptr = optarg;
-			r = sshkey_read(cak, &ptr);
+			r = sshkey_read(caks[ncaks], &ptr);
 			if (r != 0)
 				fatal("Invalid CAK key given: %ld", r);
+			++ncaks;
 			break;
 		case 'E':
 			fingerprint_hash = ssh_digest_alg_by_name(optarg);
@@ -1984,6 +5513,9 @@ main(int ac, char **av)
 		case 'm':
 			sign_9d = B_TRUE;
 			break;
+		case 'S':
+			card_unshared = B_TRUE;
+			break;
 		case 's':
 			if (c_flag)
 				usage();
@@ -2003,6 +5535,36 @@ main(int ac, char **av)
 		case 'a':
 			agentsocket = optarg;
 			break;
+		case 'T':
+			if (!parse_txn_policy(optarg)) {
+				fprintf(stderr, "error: invalid -T policy "
+				    "'%s'\n", optarg);
+				usage();
+			}
+			break;
+		case 'V':
+			if (!parse_cak_reproof(optarg)) {
+				fprintf(stderr, "error: invalid -V interval "
+				    "'%s'\n", optarg);
+				usage();
+			}
+			break;
+		case 'B':
+			if (!parse_box_cache(optarg)) {
+				fprintf(stderr, "error: invalid -B cache "
+				    "setting '%s'\n", optarg);
+				usage();
+			}
+			break;
+		case 'C':
+			if (strcmp(optarg, "none") == 0) {
+				cache_dir = NULL;
+				no_cache = B_TRUE;
+			} else {
+				cache_dir = strdup(optarg);
+				VERIFY(cache_dir != NULL);
+			}
+			break;
 		default:
 			usage();
 		}
@@ -2019,8 +5581,25 @@ main(int ac, char **av)
 		    strncmp(shell + len - 3, "csh", 3) == 0)
 			c_flag = 1;
 	}
-	if (guid == NULL)
+	if (tokens == NULL)
 		usage();
+	/* The n-th -K option goes with the n-th -g. */
+	if (ncaks > ntokens)
+		usage();
+	for (at = tokens, len = 0; len < ncaks; at = at->at_next, ++len)
+		at->at_cak = caks[len];
+	free(caks);
+	if (cache_dir == NULL && !no_cache && (home = getenv("HOME")) != NULL) {
+		/* Make sure ~/.cache exists too (ignore errors) */
+		if (asprintf(&cache_dir, "%s/.cache", home) < 0)
+			fatal("asprintf failed");
+		(void) mkdir(cache_dir, 0700);
+		free(cache_dir);
+		if (asprintf(&cache_dir, "%s/.cache/pivy-agent", home) < 0)
+			fatal("asprintf failed");
+	}
+	for (at = tokens; at != NULL; at = at->at_next)
+		agent_cache_load(at);
 	if (k_flag) {
 		const char *errstr = NULL;
 
@@ -2049,6 +5628,23 @@ main(int ac, char **av)
 	}
 	parent_pid = getpid();
 
+	if ((sock = activated_socket()) != -1) {
+		struct sockaddr_un addr;
+		socklen_t slen = sizeof (addr);
+
+		socket_activated = B_TRUE;
+		socket_dir[0] = '\0';
+		bzero(&addr, sizeof (addr));
+		if (getsockname(sock, (struct sockaddr *)&addr, &slen) == 0 &&
+		    addr.sun_family == AF_UNIX) {
+			strlcpy(socket_name, addr.sun_path, sizeof (socket_name));
+		} else {
+			strlcpy(socket_name, "(unknown)", sizeof (socket_name));
+		}
+		set_nonblock(sock);
+		goto listening;
+	}
+
 	if (agentsocket == NULL) {
 		/* Create private directory for agent socket */
 		mktemp_proto(socket_dir, sizeof(socket_dir));
@@ -2073,6 +5669,8 @@ main(int ac, char **av)
 	}
 	umask(prev_mask);
 
+listening:
+
 	if (d_flag) {
 		ssh_dbglevel = BNY_TRACE;
 		bunyan_set_level(BNY_TRACE);
@@ -2092,7 +5690,8 @@ main(int ac, char **av)
 	 * Fork, and have the parent execute the command, if any, or present
 	 * the socket data.  The child continues as the authentication agent.
 	 */
-	if (D_flag || d_flag || i_flag) {
+	/* The service manager is already looking after us: don't fork. */
+	if (D_flag || d_flag || i_flag || socket_activated) {
 		format = c_flag ? "setenv %s %s;\n" : "%s=%s; export %s;\n";
 		printf(format, SSH_AUTHSOCKET_ENV_NAME, socket_name,
 		    SSH_AUTHSOCKET_ENV_NAME);
@@ -2170,6 +5769,22 @@ main(int ac, char **av)
 
 skip:
 
+	/*
+	 * Don't let a slow or stalled stderr (or journald) hold up the event
+	 * loop (possibly in the middle of a card transaction).
+	 */
+	if ((err = bunyan_set_async(0)) != ERRF_OK) {
+		bunyan_log(BNY_WARN, "failed to set up async logging",
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+	}
+
+	/*
+	 * Every request and reply goes through a few short-lived sshbufs:
+	 * recycle them rather than going back to malloc for each one.
+	 */
+	sshbuf_pool_enable(AGENT_SSHBUF_POOL);
+
 	r = mlockall(MCL_CURRENT | MCL_FUTURE);
 	if (r != 0) {
 		bunyan_log(BNY_WARN, "mlockall() failed, sensitive data (e.g. PIN) "
@@ -2178,24 +5793,29 @@ skip:
 	}
 
 	long pgsz = sysconf(_SC_PAGESIZE);
-	pinmem = mmap(NULL, 3*pgsz, PROT_READ | PROT_WRITE,
-	    MAP_PRIVATE | MAP_ANON, -1, 0);
-	VERIFY(pinmem != MAP_FAILED);
+	for (at = tokens; at != NULL; at = at->at_next) {
+		at->at_pinmem = mmap(NULL, 3*pgsz, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANON, -1, 0);
+		VERIFY(at->at_pinmem != MAP_FAILED);
 #if defined(MADV_DONTDUMP)
-	r = madvise(pinmem, 3*pgsz, MADV_DONTDUMP);
-	if (r != 0) {
-		bunyan_log(BNY_WARN, "madvice(MADV_DONTDUMP) failed, sensitive "
-		    "data (e.g. PIN) may be contined in core dumps",
-		    "error", BNY_STRING, strerror(errno), NULL);
-	}
+		r = madvise(at->at_pinmem, 3*pgsz, MADV_DONTDUMP);
+		if (r != 0) {
+			bunyan_log(BNY_WARN, "madvice(MADV_DONTDUMP) failed, "
+			    "sensitive data (e.g. PIN) may be contined in "
+			    "core dumps",
+			    "error", BNY_STRING, strerror(errno), NULL);
+		}
 #endif
-	VERIFY0(mprotect(pinmem, pgsz, PROT_NONE));
-	VERIFY0(mprotect(pinmem + 2*pgsz, pgsz, PROT_NONE));
-	pin = pinmem + pgsz;
-	explicit_bzero(pin, MAX_PIN_LEN);
+		VERIFY0(mprotect(at->at_pinmem, pgsz, PROT_NONE));
+		VERIFY0(mprotect(at->at_pinmem + 2*pgsz, pgsz, PROT_NONE));
+		at->at_pin = at->at_pinmem + pgsz;
+		explicit_bzero(at->at_pin, MAX_PIN_LEN);
+	}
 
 	cleanup_pid = getpid();
 
+	/* After the fork: kqueues aren't inherited. */
+	ev_init();
 	new_socket(AUTH_SOCKET, sock);
 	if (ac > 0)
 		parent_alive_interval = 10;
@@ -2208,41 +5828,40 @@ skip:
 	signal(SIGHUP, cleanup_handler);
 	signal(SIGTERM, cleanup_handler);
 
-	r = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &ctx);
-	if (r != SCARD_S_SUCCESS) {
-		bunyan_log(BNY_ERROR, "SCardEstablishContext failed",
-		    "error", BNY_STRING, pcsc_stringify_error(r), NULL);
-		return (1);
-	}
+	piv_use_reader_cache(NULL);
+	/* We hardly ever need the X509s themselves, only keys and subjects */
+	piv_set_compact_slots(B_TRUE);
 
-	err = agent_piv_open();
-	if (err) {
-		errf_free(err);
-	} else {
-		agent_piv_close(B_TRUE);
+	/* For benchmarks and load testing: see piv_virt_init() */
+	if ((virt = getenv("PIVY_VIRTUAL_TOKENS")) != NULL) {
+		errf_t *err = piv_virt_init(virt);
+		if (err) {
+			bunyan_log(BNY_ERROR, "invalid PIVY_VIRTUAL_TOKENS",
+			    "error", BNY_ERF, err, NULL);
+			return (1);
+		}
+		virt_tokens = B_TRUE;
 	}
-	last_op = monotime();
+
+	if (pipe(card_done_pipe) != 0)
+		fatal("pipe: %s", strerror(errno));
+	set_nonblock(card_done_pipe[1]);
+	new_socket(AUTH_NOTIFY, card_done_pipe[0]);
+
+	if (!socket_activated)
+		cards_start();
 
 	while (1) {
-		prepare_poll(&pfd, &npfd, &timeout);
-		result = poll(pfd, npfd, timeout);
+		result = ev_wait(agent_timeout());
 		saved_errno = errno;
 		if (parent_alive_interval != 0)
 			check_parent_exists();
-		now = monotime();
-		if (card_probe_interval != 0 &&
-		    (now - last_op) >= card_probe_interval * 1000) {
-			probe_card();
-		}
-		if (txnopen && now >= txntimeout)
-			agent_piv_close(B_TRUE);
 		/*(void) reaper();*/	/* remove expired keys */
 		if (result < 0) {
 			if (saved_errno == EINTR)
 				continue;
-			fatal("poll: %s", strerror(saved_errno));
-		} else if (result > 0)
-			after_poll(pfd, npfd);
+			fatal("event wait: %s", strerror(saved_errno));
+		}
 	}
 	/* NOTREACHED */
 }
@@ -0,0 +1,1083 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2026, Joyent Inc
+ */
+
+/*
+ * Micro-benchmarks for the parts of pivy that don't need a card: TLV
+ * encoding, offline ECDH boxes, signature checks, eboxes and their streams,
+ * SSS and logging.
+ *
+ * Each benchmark is run for at least a minimum wall-clock time (doubling the
+ * iteration count until it gets there), and the result is printed to stdout
+ * as one JSON object per line, e.g.
+ *
+ *   {"bench":"stream.encrypt","param":"aes256-ctr/16384","iters":32768,
+ *    "ns":251264915,"ns_per_op":7668.0,"bytes_per_sec":2136624012.3}
+ *
+ * so that runs from different releases can be compared mechanically.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <time.h>
+
+#if defined(__APPLE__)
+#include <PCSC/wintypes.h>
+#include <PCSC/winscard.h>
+#else
+#include <wintypes.h>
+#include <winscard.h>
+#endif
+
+#include <sys/types.h>
+#include "debug.h"
+
+#include "libssh/sshkey.h"
+#include "libssh/sshbuf.h"
+#include "libssh/ssherr.h"
+
+#include "sss/hazmat.h"
+
+#include "chapoly/chacha.h"
+#include "chapoly/poly1305.h"
+
+#include "tlv.h"
+#include "errf.h"
+#include "ebox.h"
+#include "piv.h"
+#include "bunyan.h"
+#include "utils.h"
+
+enum pivybench_exit_status {
+	EXIT_OK = 0,
+	EXIT_USAGE = 1,
+	EXIT_ERROR = 2,
+};
+
+/* Default minimum run time for each benchmark, in msec (see -t). */
+#define	BENCH_DEFAULT_MSEC	250
+#define	NSEC_PER_SEC		1000000000ULL
+#define	NSEC_PER_MSEC		1000000ULL
+
+static uint64_t bench_min_ns = BENCH_DEFAULT_MSEC * NSEC_PER_MSEC;
+static char **bench_filters = NULL;
+static int bench_nfilters = 0;
+
+typedef void (*bench_op_t)(void *);
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return ((uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec);
+}
+
+static boolean_t
+bench_selected(const char *name)
+{
+	int i;
+
+	if (bench_nfilters == 0)
+		return (B_TRUE);
+	for (i = 0; i < bench_nfilters; ++i) {
+		if (strncmp(name, bench_filters[i],
+		    strlen(bench_filters[i])) == 0) {
+			return (B_TRUE);
+		}
+	}
+	return (B_FALSE);
+}
+
+/*
+ * Runs op(arg) repeatedly and prints the result. "bytes" is the amount of
+ * data processed by each op, or 0 if throughput isn't meaningful for it.
+ */
+static void
+bench_run(const char *name, const char *param, size_t bytes, bench_op_t op,
+    void *arg)
+{
+	uint64_t iters = 1, i, start, elapsed;
+	double nsop;
+
+	/* One untimed op to get any lazy setup out of the way. */
+	op(arg);
+
+	for (;;) {
+		start = now_ns();
+		for (i = 0; i < iters; ++i)
+			op(arg);
+		elapsed = now_ns() - start;
+		if (elapsed >= bench_min_ns)
+			break;
+		iters *= 2;
+	}
+
+	nsop = (double)elapsed / iters;
+	printf("{\"bench\":\"%s\",\"param\":\"%s\",\"iters\":%llu,"
+	    "\"ns\":%llu,\"ns_per_op\":%.1f", name, param,
+	    (unsigned long long)iters, (unsigned long long)elapsed, nsop);
+	if (bytes > 0) {
+		printf(",\"bytes_per_sec\":%.1f",
+		    (double)bytes * NSEC_PER_SEC / nsop);
+	}
+	printf("}\n");
+	fflush(stdout);
+}
+
+static struct sshkey *
+gen_eckey(uint bits)
+{
+	struct sshkey *k;
+	int rc;
+
+	if ((rc = sshkey_generate(KEY_ECDSA, bits, &k)))
+		errfx(EXIT_ERROR, ssherrf("sshkey_generate", rc), "keygen");
+	return (k);
+}
+
+/*
+ * TLV: a certificate object in the same shape as the ones written and read
+ * by piv_write_cert() and piv_read_cert().
+ */
+
+#define	TLV_BENCH_CERTLEN	1024
+
+struct tlv_bench {
+	uint8_t		 tb_cert[TLV_BENCH_CERTLEN];
+	uint8_t		*tb_enc;
+	size_t		 tb_enclen;
+};
+
+static void
+tlv_bench_write(void *arg)
+{
+	struct tlv_bench *tb = arg;
+	struct tlv_state *tlv;
+
+	tlv = tlv_init_write();
+	VERIFY(tlv != NULL);
+	tlv_push64k(tlv, 0x53);
+	tlv_push64k(tlv, 0x70);
+	tlv_write(tlv, tb->tb_cert, sizeof (tb->tb_cert));
+	tlv_pop(tlv);
+	tlv_push(tlv, 0x71);
+	tlv_write_byte(tlv, 0x00);
+	tlv_pop(tlv);
+	tlv_push(tlv, 0xFE);
+	tlv_pop(tlv);
+	tlv_pop(tlv);
+
+	if (tb->tb_enc == NULL) {
+		tb->tb_enclen = tlv_len(tlv);
+		tb->tb_enc = malloc(tb->tb_enclen);
+		VERIFY(tb->tb_enc != NULL);
+		bcopy(tlv_buf(tlv), tb->tb_enc, tb->tb_enclen);
+	}
+	tlv_free(tlv);
+}
+
+static void
+tlv_bench_read(void *arg)
+{
+	struct tlv_bench *tb = arg;
+	struct tlv_state *tlv;
+	uint tag;
+	uint8_t *data, certinfo;
+	size_t len;
+	errf_t *err;
+
+	tlv = tlv_init(tb->tb_enc, 0, tb->tb_enclen);
+	VERIFY(tlv != NULL);
+	if ((err = tlv_read_tag(tlv, &tag)))
+		goto out;
+	VERIFY3U(tag, ==, 0x53);
+	while (!tlv_at_end(tlv)) {
+		if ((err = tlv_read_tag(tlv, &tag)))
+			goto out;
+		if (tag == 0x70) {
+			if ((err = tlv_read_alloc(tlv, &data, &len)))
+				goto out;
+			free(data);
+			if ((err = tlv_end(tlv)))
+				goto out;
+			continue;
+		} else if (tag == 0x71) {
+			if ((err = tlv_read_u8(tlv, &certinfo)))
+				goto out;
+			if ((err = tlv_end(tlv)))
+				goto out;
+			continue;
+		}
+		tlv_skip(tlv);
+	}
+	err = tlv_end(tlv);
+
+out:
+	if (err != ERRF_OK)
+		errfx(EXIT_ERROR, err, "tlv parse");
+	tlv_free(tlv);
+}
+
+static void
+bench_tlv(void)
+{
+	struct tlv_bench tb;
+
+	bzero(&tb, sizeof (tb));
+	arc4random_buf(tb.tb_cert, sizeof (tb.tb_cert));
+
+	/* Fills in tb_enc the first time, for the parse benchmark. */
+	tlv_bench_write(&tb);
+
+	if (bench_selected("tlv.serialise")) {
+		bench_run("tlv.serialise", "cert", tb.tb_enclen,
+		    tlv_bench_write, &tb);
+	}
+	if (bench_selected("tlv.parse")) {
+		bench_run("tlv.parse", "cert", tb.tb_enclen,
+		    tlv_bench_read, &tb);
+	}
+	free(tb.tb_enc);
+}
+
+/*
+ * piv_box_seal_offline() and piv_box_open_offline(), with a 32-byte payload
+ * such as a disk key. box.seal.pooled is box.seal with the ephemeral key pool
+ * running (see piv_box_ephem_pool_start()): sealing back-to-back drains the
+ * pool, so this measures the steady state with keygen moved onto the pool
+ * thread rather than the best case of a pool that's always full.
+ */
+
+#define	BOX_BENCH_POOL_DEPTH	64
+
+struct box_bench {
+	struct sshkey		*bb_key;
+	struct sshkey		*bb_pubkey;
+	uint8_t			 bb_data[32];
+	struct piv_ecdh_box	*bb_box;
+};
+
+static void
+box_bench_seal(void *arg)
+{
+	struct box_bench *bb = arg;
+	struct piv_ecdh_box *box;
+	errf_t *err;
+
+	box = piv_box_new();
+	VERIFY(box != NULL);
+	if ((err = piv_box_set_data(box, bb->bb_data, sizeof (bb->bb_data))))
+		errfx(EXIT_ERROR, err, "piv_box_set_data");
+	if ((err = piv_box_seal_offline(bb->bb_pubkey, box)))
+		errfx(EXIT_ERROR, err, "piv_box_seal_offline");
+	piv_box_free(box);
+}
+
+static void
+box_bench_open(void *arg)
+{
+	struct box_bench *bb = arg;
+	uint8_t *data;
+	size_t len;
+	errf_t *err;
+
+	if ((err = piv_box_open_offline(bb->bb_key, bb->bb_box)))
+		errfx(EXIT_ERROR, err, "piv_box_open_offline");
+	if ((err = piv_box_take_data(bb->bb_box, &data, &len)))
+		errfx(EXIT_ERROR, err, "piv_box_take_data");
+	VERIFY3U(len, ==, sizeof (bb->bb_data));
+	freezero_conceal(data, len);
+}
+
+static void
+bench_box(void)
+{
+	const uint curves[] = { 256, 384, 521 };
+	struct box_bench bb;
+	char param[16];
+	errf_t *err;
+	uint i;
+
+	if (!bench_selected("box.seal") && !bench_selected("box.seal.pooled") &&
+	    !bench_selected("box.open"))
+		return;
+
+	for (i = 0; i < sizeof (curves) / sizeof (curves[0]); ++i) {
+		bzero(&bb, sizeof (bb));
+		arc4random_buf(bb.bb_data, sizeof (bb.bb_data));
+		bb.bb_key = gen_eckey(curves[i]);
+		VERIFY0(sshkey_demote(bb.bb_key, &bb.bb_pubkey));
+		snprintf(param, sizeof (param), "p%u", curves[i]);
+
+		bb.bb_box = piv_box_new();
+		VERIFY(bb.bb_box != NULL);
+		err = piv_box_set_data(bb.bb_box, bb.bb_data,
+		    sizeof (bb.bb_data));
+		if (err == ERRF_OK)
+			err = piv_box_seal_offline(bb.bb_pubkey, bb.bb_box);
+		if (err != ERRF_OK)
+			errfx(EXIT_ERROR, err, "sealing %s box", param);
+
+		if (bench_selected("box.seal"))
+			bench_run("box.seal", param, 0, box_bench_seal, &bb);
+		if (bench_selected("box.seal.pooled")) {
+			if ((err = piv_box_ephem_pool_start(
+			    BOX_BENCH_POOL_DEPTH))) {
+				errfx(EXIT_ERROR, err, "starting ephemeral "
+				    "key pool");
+			}
+			piv_box_ephem_pool_want(curves[i]);
+			bench_run("box.seal.pooled", param, 0, box_bench_seal,
+			    &bb);
+			piv_box_ephem_pool_stop();
+		}
+		if (bench_selected("box.open"))
+			bench_run("box.open", param, 0, box_bench_open, &bb);
+
+		piv_box_free(bb.bb_box);
+		sshkey_free(bb.bb_pubkey);
+		sshkey_free(bb.bb_key);
+	}
+}
+
+/*
+ * sshkey_sign() and sshkey_verify() on a 64-byte challenge, as done when
+ * checking a card's signature after piv_sign() (or by pam_pivy). ed25519
+ * here is our bundled implementation rather than libcrypto's.
+ */
+
+struct sig_bench {
+	struct sshkey	*sb_key;
+	uint8_t		 sb_data[64];
+	u_char		*sb_sig;
+	size_t		 sb_siglen;
+};
+
+static void
+sig_bench_sign(void *arg)
+{
+	struct sig_bench *sb = arg;
+	u_char *sig;
+	size_t siglen;
+	int rc;
+
+	rc = sshkey_sign(sb->sb_key, &sig, &siglen, sb->sb_data,
+	    sizeof (sb->sb_data), NULL, 0);
+	if (rc != 0)
+		errfx(EXIT_ERROR, ssherrf("sshkey_sign", rc), "signing");
+	free(sig);
+}
+
+static void
+sig_bench_verify(void *arg)
+{
+	struct sig_bench *sb = arg;
+	int rc;
+
+	rc = sshkey_verify(sb->sb_key, sb->sb_sig, sb->sb_siglen, sb->sb_data,
+	    sizeof (sb->sb_data), 0);
+	if (rc != 0)
+		errfx(EXIT_ERROR, ssherrf("sshkey_verify", rc), "verifying");
+}
+
+static void
+bench_sig(void)
+{
+	const struct {
+		const char	*param;
+		int		 type;
+		uint		 bits;
+	} keys[] = {
+		{ "ed25519", KEY_ED25519, 256 },
+		{ "p256", KEY_ECDSA, 256 },
+	};
+	struct sig_bench sb;
+	uint i;
+	int rc;
+
+	if (!bench_selected("sig.sign") && !bench_selected("sig.verify"))
+		return;
+
+	for (i = 0; i < sizeof (keys) / sizeof (keys[0]); ++i) {
+		bzero(&sb, sizeof (sb));
+		arc4random_buf(sb.sb_data, sizeof (sb.sb_data));
+		rc = sshkey_generate(keys[i].type, keys[i].bits, &sb.sb_key);
+		if (rc != 0) {
+			errfx(EXIT_ERROR, ssherrf("sshkey_generate", rc),
+			    "keygen");
+		}
+		rc = sshkey_sign(sb.sb_key, &sb.sb_sig, &sb.sb_siglen,
+		    sb.sb_data, sizeof (sb.sb_data), NULL, 0);
+		if (rc != 0)
+			errfx(EXIT_ERROR, ssherrf("sshkey_sign", rc), "signing");
+
+		if (bench_selected("sig.sign")) {
+			bench_run("sig.sign", keys[i].param, 0, sig_bench_sign,
+			    &sb);
+		}
+		if (bench_selected("sig.verify")) {
+			bench_run("sig.verify", keys[i].param, 0,
+			    sig_bench_verify, &sb);
+		}
+
+		free(sb.sb_sig);
+		sshkey_free(sb.sb_key);
+	}
+}
+
+/*
+ * ebox_create() and sshbuf_get_ebox(), using a typical template: one primary
+ * config with a single device, and a 2-of-3 recovery config.
+ */
+
+struct ebox_bench {
+	struct ebox_tpl	*eb_tpl;
+	uint8_t		 eb_key[32];
+	uint8_t		*eb_enc;
+	size_t		 eb_enclen;
+};
+
+static void
+ebox_bench_add_part(struct ebox_tpl_config *config)
+{
+	struct ebox_tpl_part *part;
+	struct sshkey *k;
+	uint8_t guid[16];
+
+	arc4random_buf(guid, sizeof (guid));
+	k = gen_eckey(256);
+	part = ebox_tpl_part_alloc(guid, sizeof (guid), PIV_SLOT_KEY_MGMT, k);
+	VERIFY(part != NULL);
+	ebox_tpl_config_add_part(config, part);
+	sshkey_free(k);
+}
+
+static void
+ebox_bench_create(void *arg)
+{
+	struct ebox_bench *eb = arg;
+	struct ebox *ebox;
+	struct sshbuf *buf;
+	errf_t *err;
+
+	if ((err = ebox_create(eb->eb_tpl, eb->eb_key, sizeof (eb->eb_key),
+	    NULL, 0, &ebox))) {
+		errfx(EXIT_ERROR, err, "ebox_create");
+	}
+	buf = sshbuf_new();
+	VERIFY(buf != NULL);
+	if ((err = sshbuf_put_ebox(buf, ebox)))
+		errfx(EXIT_ERROR, err, "sshbuf_put_ebox");
+
+	if (eb->eb_enc == NULL) {
+		eb->eb_enclen = sshbuf_len(buf);
+		eb->eb_enc = malloc(eb->eb_enclen);
+		VERIFY(eb->eb_enc != NULL);
+		bcopy(sshbuf_ptr(buf), eb->eb_enc, eb->eb_enclen);
+	}
+	sshbuf_free(buf);
+	ebox_free(ebox);
+}
+
+static void
+ebox_bench_parse(void *arg)
+{
+	struct ebox_bench *eb = arg;
+	struct ebox *ebox;
+	struct sshbuf *buf;
+	errf_t *err;
+
+	buf = sshbuf_from(eb->eb_enc, eb->eb_enclen);
+	VERIFY(buf != NULL);
+	if ((err = sshbuf_get_ebox(buf, &ebox)))
+		errfx(EXIT_ERROR, err, "sshbuf_get_ebox");
+	sshbuf_free(buf);
+	ebox_free(ebox);
+}
+
+static void
+bench_ebox(void)
+{
+	struct ebox_bench eb;
+	struct ebox_tpl_config *config;
+	errf_t *err;
+	uint i;
+
+	if (!bench_selected("ebox.create") && !bench_selected("ebox.parse"))
+		return;
+
+	bzero(&eb, sizeof (eb));
+	arc4random_buf(eb.eb_key, sizeof (eb.eb_key));
+	eb.eb_tpl = ebox_tpl_alloc();
+	VERIFY(eb.eb_tpl != NULL);
+
+	config = ebox_tpl_config_alloc(EBOX_PRIMARY);
+	VERIFY(config != NULL);
+	ebox_bench_add_part(config);
+	ebox_tpl_add_config(eb.eb_tpl, config);
+
+	config = ebox_tpl_config_alloc(EBOX_RECOVERY);
+	VERIFY(config != NULL);
+	for (i = 0; i < 3; ++i)
+		ebox_bench_add_part(config);
+	if ((err = ebox_tpl_config_set_n(config, 2)))
+		errfx(EXIT_ERROR, err, "ebox_tpl_config_set_n");
+	ebox_tpl_add_config(eb.eb_tpl, config);
+
+	/* Fills in eb_enc the first time, for the parse benchmark. */
+	ebox_bench_create(&eb);
+
+	if (bench_selected("ebox.create")) {
+		bench_run("ebox.create", "1+2of3", 0, ebox_bench_create,
+		    &eb);
+	}
+	if (bench_selected("ebox.parse")) {
+		bench_run("ebox.parse", "1+2of3", eb.eb_enclen,
+		    ebox_bench_parse, &eb);
+	}
+
+	free(eb.eb_enc);
+	ebox_tpl_free(eb.eb_tpl);
+}
+
+/*
+ * ebox_stream_encrypt_chunk() and ebox_stream_decrypt_chunk() for each
+ * cipher, by chunk size.
+ */
+
+struct stream_bench {
+	struct ebox_stream	*sb_stream;
+	uint8_t			*sb_data;
+	size_t			 sb_len;
+	uint8_t			*sb_enc;
+	size_t			 sb_enclen;
+};
+
+static void
+stream_bench_encrypt(void *arg)
+{
+	struct stream_bench *sb = arg;
+	struct ebox_stream_chunk *chunk;
+	struct sshbuf *buf;
+	errf_t *err;
+
+	if ((err = ebox_stream_chunk_new(sb->sb_stream, sb->sb_data,
+	    sb->sb_len, 1, &chunk))) {
+		errfx(EXIT_ERROR, err, "ebox_stream_chunk_new");
+	}
+	if ((err = ebox_stream_encrypt_chunk(chunk)))
+		errfx(EXIT_ERROR, err, "ebox_stream_encrypt_chunk");
+
+	if (sb->sb_enc == NULL) {
+		buf = sshbuf_new();
+		VERIFY(buf != NULL);
+		if ((err = sshbuf_put_ebox_stream_chunk(buf, chunk)))
+			errfx(EXIT_ERROR, err, "sshbuf_put_ebox_stream_chunk");
+		sb->sb_enclen = sshbuf_len(buf);
+		sb->sb_enc = malloc(sb->sb_enclen);
+		VERIFY(sb->sb_enc != NULL);
+		bcopy(sshbuf_ptr(buf), sb->sb_enc, sb->sb_enclen);
+		sshbuf_free(buf);
+	}
+	ebox_stream_chunk_free(chunk);
+}
+
+static void
+stream_bench_decrypt(void *arg)
+{
+	struct stream_bench *sb = arg;
+	struct ebox_stream_chunk *chunk;
+	struct sshbuf *buf;
+	errf_t *err;
+
+	buf = sshbuf_from(sb->sb_enc, sb->sb_enclen);
+	VERIFY(buf != NULL);
+	if ((err = sshbuf_get_ebox_stream_chunk(buf, sb->sb_stream, &chunk)))
+		errfx(EXIT_ERROR, err, "sshbuf_get_ebox_stream_chunk");
+	if ((err = ebox_stream_decrypt_chunk(chunk)))
+		errfx(EXIT_ERROR, err, "ebox_stream_decrypt_chunk");
+	sshbuf_free(buf);
+	ebox_stream_chunk_free(chunk);
+}
+
+static void
+bench_stream(void)
+{
+	const char *ciphers[] = {
+		"aes256-ctr", "aes256-gcm", "chacha20-poly1305"
+	};
+	const size_t sizes[] = {
+		EBOX_STREAM_MIN_CHUNK, 16 * 1024, EBOX_STREAM_DEFAULT_CHUNK,
+		1024 * 1024
+	};
+	struct stream_bench sb;
+	struct ebox_tpl *tpl;
+	struct ebox_tpl_config *config;
+	char param[64];
+	errf_t *err;
+	uint i, j;
+
+	if (!bench_selected("stream.encrypt") &&
+	    !bench_selected("stream.decrypt")) {
+		return;
+	}
+
+	tpl = ebox_tpl_alloc();
+	VERIFY(tpl != NULL);
+	config = ebox_tpl_config_alloc(EBOX_PRIMARY);
+	VERIFY(config != NULL);
+	ebox_bench_add_part(config);
+	ebox_tpl_add_config(tpl, config);
+
+	for (i = 0; i < sizeof (ciphers) / sizeof (ciphers[0]); ++i) {
+		bzero(&sb, sizeof (sb));
+		if ((err = ebox_stream_new_cipher(tpl, ciphers[i],
+		    &sb.sb_stream))) {
+			errfx(EXIT_ERROR, err, "ebox_stream_new_cipher(%s)",
+			    ciphers[i]);
+		}
+		for (j = 0; j < sizeof (sizes) / sizeof (sizes[0]); ++j) {
+			sb.sb_len = sizes[j];
+			sb.sb_data = malloc(sb.sb_len);
+			VERIFY(sb.sb_data != NULL);
+			arc4random_buf(sb.sb_data, sb.sb_len);
+			snprintf(param, sizeof (param), "%s/%zu", ciphers[i],
+			    sb.sb_len);
+
+			/* Fills in sb_enc, for the decrypt benchmark. */
+			stream_bench_encrypt(&sb);
+
+			if (bench_selected("stream.encrypt")) {
+				bench_run("stream.encrypt", param, sb.sb_len,
+				    stream_bench_encrypt, &sb);
+			}
+			if (bench_selected("stream.decrypt")) {
+				bench_run("stream.decrypt", param, sb.sb_len,
+				    stream_bench_decrypt, &sb);
+			}
+
+			free(sb.sb_enc);
+			sb.sb_enc = NULL;
+			free(sb.sb_data);
+		}
+		ebox_stream_free(sb.sb_stream);
+	}
+	ebox_tpl_free(tpl);
+}
+
+/*
+ * sss_create_keyshares() and sss_combine_keyshares(), 3-of-5.
+ */
+
+#define	SSS_BENCH_N	5
+#define	SSS_BENCH_K	3
+
+struct sss_bench {
+	uint8_t		sb_key[32];
+	sss_Keyshare	sb_shares[SSS_BENCH_N];
+};
+
+static void
+sss_bench_create(void *arg)
+{
+	struct sss_bench *sb = arg;
+
+	sss_create_keyshares(sb->sb_shares, sb->sb_key, SSS_BENCH_N,
+	    SSS_BENCH_K);
+}
+
+static void
+sss_bench_combine(void *arg)
+{
+	struct sss_bench *sb = arg;
+	uint8_t key[32];
+
+	sss_combine_keyshares(key, sb->sb_shares, SSS_BENCH_K);
+	VERIFY0(bcmp(key, sb->sb_key, sizeof (key)));
+	explicit_bzero(key, sizeof (key));
+}
+
+static void
+bench_sss(void)
+{
+	struct sss_bench sb;
+
+	arc4random_buf(sb.sb_key, sizeof (sb.sb_key));
+	sss_bench_create(&sb);
+
+	if (bench_selected("sss.create"))
+		bench_run("sss.create", "3of5", 0, sss_bench_create, &sb);
+	if (bench_selected("sss.combine"))
+		bench_run("sss.combine", "3of5", 0, sss_bench_combine, &sb);
+	explicit_bzero(&sb, sizeof (sb));
+}
+
+/*
+ * bunyan_log() on a line below the current level (which should cost next to
+ * nothing) and on one that's written out. The emitted lines go to /dev/null
+ * rather than our stderr.
+ */
+
+static void
+bunyan_bench_filtered(void *arg)
+{
+	const char *reader = arg;
+
+	bunyan_log(BNY_DEBUG, "filtered bench line",
+	    "reader", BNY_STRING, reader,
+	    "slot", BNY_UINT, (uint)PIV_SLOT_KEY_MGMT, NULL);
+}
+
+static void
+bunyan_bench_emitted(void *arg)
+{
+	const char *reader = arg;
+
+	bunyan_log(BNY_INFO, "emitted bench line",
+	    "reader", BNY_STRING, reader,
+	    "slot", BNY_UINT, (uint)PIV_SLOT_KEY_MGMT, NULL);
+}
+
+static void
+bench_bunyan(void)
+{
+	const char *reader = "Yubico YubiKey OTP+FIDO+CCID 00 00";
+	int nullfd, errfd;
+
+	bunyan_set_level(BNY_INFO);
+
+	if (bench_selected("bunyan.filtered")) {
+		bench_run("bunyan.filtered", "", 0, bunyan_bench_filtered,
+		    (void *)reader);
+	}
+
+	if (bench_selected("bunyan.emitted")) {
+		nullfd = open("/dev/null", O_WRONLY);
+		if (nullfd == -1)
+			err(EXIT_ERROR, "open(/dev/null)");
+		errfd = dup(STDERR_FILENO);
+		if (errfd == -1)
+			err(EXIT_ERROR, "dup");
+		VERIFY3S(dup2(nullfd, STDERR_FILENO), ==, STDERR_FILENO);
+		bench_run("bunyan.emitted", "", 0, bunyan_bench_emitted,
+		    (void *)reader);
+		VERIFY3S(dup2(errfd, STDERR_FILENO), ==, STDERR_FILENO);
+		close(errfd);
+		close(nullfd);
+	}
+
+	bunyan_set_level(BNY_WARN);
+}
+
+/*
+ * Known-answer checks for the ChaCha20 and Poly1305 code in chapoly/, using
+ * the vectors from RFC 8439. These run before any benchmark so that a broken
+ * fast path fails loudly rather than just looking quick; "-k" runs only these.
+ *
+ * Our chacha_ivsetup() takes the original 64-bit counter and 64-bit nonce
+ * rather than RFC 8439's 32-bit counter and 96-bit nonce. The RFC's state
+ * words 12-15 are the same either way, so we put the first 4 bytes of the
+ * RFC nonce in the top half of our counter and the rest in our nonce.
+ */
+
+static const char kat_sunscreen[] = "Ladies and Gentlemen of the class of "
+    "'99: If I could offer you only one tip for the future, sunscreen would "
+    "be it.";
+
+static const char kat_ietf[] = "Any submission to the IETF intended by the "
+    "Contributor for publication as all or part of an IETF Internet-Draft or "
+    "RFC and any statement made within the context of an IETF activity is "
+    "considered an \"IETF Contribution\". Such statements include oral "
+    "statements in IETF sessions, as well as written and electronic "
+    "communications made at any time or place, which are addressed to";
+
+struct chacha_kat {
+	const char	*ck_name;
+	const char	*ck_key;
+	const char	*ck_nonce;
+	uint32_t	 ck_ctr;
+	const char	*ck_pt;
+	const char	*ck_ct;
+};
+
+static const struct chacha_kat chacha_kats[] = {
+	{ "rfc8439-2.4.2",
+	    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f",
+	    "000000000000004a00000000", 1, kat_sunscreen,
+	    "6e2e359a2568f98041ba0728dd0d6981e97e7aec1d4360c20a27afccfd9fae0b"
+	    "f91b65c5524733ab8f593dabcd62b3571639d624e65152ab8f530c359f0861d8"
+	    "07ca0dbf500d6a6156a38e088a22b65e52bc514d16ccf806818ce91ab7793736"
+	    "5af90bbf74a35be6b40b8eedf2785e42874d" },
+	{ "rfc8439-A.2#2",
+	    "0000000000000000000000000000000000000000000000000000000000000001",
+	    "000000000000000000000002", 1, kat_ietf,
+	    "a3fbf07df3fa2fde4f376ca23e82737041605d9f4f4f57bd8cff2c1d4b7955ec"
+	    "2a97948bd3722915c8f3d337f7d370050e9e96d647b7c39f56e031ca5eb6250d"
+	    "4042e02785ececfa4b4bb5e8ead0440e20b6e8db09d881a7c6132f420e527950"
+	    "42bdfa7773d8a9051447b3291ce1411c680465552aa6c405b7764d5e87bea85a"
+	    "d00f8449ed8f72d0d662ab052691ca66424bc86d2df80ea41f43abf937d3259d"
+	    "c4b2d0dfb48a6c9139ddd7f76966e928e635553ba76c5c879d7b35d49eb2e62b"
+	    "0871cdac638939e25e8a1e0ef9d5280fa8ca328b351c3c765989cbcf3daa8b6c"
+	    "cc3aaf9f3979c92b3720fc88dc95ed84a1be059c6499b9fda236e7e818b04b0b"
+	    "c39c1e876b193bfe5569753f88128cc08aaa9b63d1a16f80ef2554d7189c411f"
+	    "5869ca52c5b83fa36ff216b9c1d30062bebcfd2dc5bce0911934fda79a86f6e6"
+	    "98ced759c3ff9b6477338f3da4f9cd8514ea9982ccafb341b2384dd902f3d1ab"
+	    "7ac61dd29c6f21ba5b862f3730e37cfdc4fd806c22f221" },
+};
+
+struct poly1305_kat {
+	const char	*pk_name;
+	const char	*pk_key;
+	const char	*pk_msg;	/* hex, or NULL to use kat_ietf */
+	const char	*pk_tag;
+};
+
+static const struct poly1305_kat poly1305_kats[] = {
+	{ "rfc8439-2.5.2",
+	    "85d6be7857556d337f4452fe42d506a80103808afb0db2fd4abff6af4149f51b",
+	    "43727970746f6772617068696320466f72756d2052657365617263682047726f"
+	    "7570",
+	    "a8061dc1305136c6c22b8baf0c0127a9" },
+	{ "rfc8439-A.3#2",
+	    "0000000000000000000000000000000036e5f6b5c5e06070f0efca96227a863e",
+	    NULL,
+	    "36e5f6b5c5e06070f0efca96227a863e" },
+	{ "rfc8439-A.3#3",
+	    "36e5f6b5c5e06070f0efca96227a863e00000000000000000000000000000000",
+	    NULL,
+	    "f3477e7cd95417af89a6b8794c310cf0" },
+	{ "rfc8439-A.3#5",
+	    "0200000000000000000000000000000000000000000000000000000000000000",
+	    "ffffffffffffffffffffffffffffffff",
+	    "03000000000000000000000000000000" },
+	{ "rfc8439-A.3#6",
+	    "02000000000000000000000000000000ffffffffffffffffffffffffffffffff",
+	    "02000000000000000000000000000000",
+	    "03000000000000000000000000000000" },
+};
+
+/* Length of the buffer for the one-call vs block-at-a-time ChaCha check. */
+#define	KAT_SPLIT_LEN	1024
+
+static u_char *
+kat_unhex(const char *hex, size_t *lenp)
+{
+	size_t len = strlen(hex) / 2, i;
+	u_char *buf;
+	uint hi, lo;
+
+	VERIFY3U(strlen(hex), ==, len * 2);
+	buf = malloc(len + 1);
+	VERIFY(buf != NULL);
+	for (i = 0; i < len; ++i) {
+		VERIFY(sscanf(&hex[i * 2], "%1x%1x", &hi, &lo) == 2);
+		buf[i] = (hi << 4) | lo;
+	}
+	*lenp = len;
+	return (buf);
+}
+
+static void
+kat_chacha(const struct chacha_kat *ck)
+{
+	struct chacha_ctx ctx;
+	u_char ctr[CHACHA_CTRLEN];
+	u_char *key, *nonce, *ct, *out;
+	size_t keylen, noncelen, ctlen, ptlen;
+
+	key = kat_unhex(ck->ck_key, &keylen);
+	nonce = kat_unhex(ck->ck_nonce, &noncelen);
+	ct = kat_unhex(ck->ck_ct, &ctlen);
+	ptlen = strlen(ck->ck_pt);
+	VERIFY3U(keylen, ==, 32);
+	VERIFY3U(noncelen, ==, 12);
+	VERIFY3U(ctlen, ==, ptlen);
+
+	ctr[0] = ck->ck_ctr & 0xff;
+	ctr[1] = (ck->ck_ctr >> 8) & 0xff;
+	ctr[2] = (ck->ck_ctr >> 16) & 0xff;
+	ctr[3] = (ck->ck_ctr >> 24) & 0xff;
+	bcopy(nonce, &ctr[4], 4);
+
+	out = malloc(ptlen);
+	VERIFY(out != NULL);
+	chacha_keysetup(&ctx, key, 256);
+	chacha_ivsetup(&ctx, &nonce[4], ctr);
+	chacha_encrypt_bytes(&ctx, (const u_char *)ck->ck_pt, out, ptlen);
+	if (bcmp(out, ct, ptlen) != 0)
+		errx(EXIT_ERROR, "chacha20 known-answer check %s failed",
+		    ck->ck_name);
+
+	free(out);
+	free(ct);
+	free(nonce);
+	free(key);
+}
+
+/*
+ * The vectorised ChaCha paths only kick in for runs of several blocks, so
+ * check that one long call agrees with the same data fed a block at a time
+ * (which goes through the scalar code).
+ */
+static void
+kat_chacha_split(void)
+{
+	struct chacha_ctx ctx;
+	u_char key[32], iv[CHACHA_NONCELEN];
+	u_char *pt, *one, *split;
+	size_t off;
+
+	pt = malloc(KAT_SPLIT_LEN);
+	one = malloc(KAT_SPLIT_LEN);
+	split = malloc(KAT_SPLIT_LEN);
+	VERIFY(pt != NULL && one != NULL && split != NULL);
+	arc4random_buf(key, sizeof (key));
+	arc4random_buf(iv, sizeof (iv));
+	arc4random_buf(pt, KAT_SPLIT_LEN);
+
+	chacha_keysetup(&ctx, key, 256);
+	chacha_ivsetup(&ctx, iv, NULL);
+	chacha_encrypt_bytes(&ctx, pt, one, KAT_SPLIT_LEN);
+
+	chacha_ivsetup(&ctx, iv, NULL);
+	for (off = 0; off < KAT_SPLIT_LEN; off += CHACHA_BLOCKLEN) {
+		chacha_encrypt_bytes(&ctx, &pt[off], &split[off],
+		    CHACHA_BLOCKLEN);
+	}
+	if (bcmp(one, split, KAT_SPLIT_LEN) != 0)
+		errx(EXIT_ERROR, "chacha20 multi-block check failed");
+
+	explicit_bzero(key, sizeof (key));
+	free(split);
+	free(one);
+	free(pt);
+}
+
+static void
+kat_poly1305(const struct poly1305_kat *pk)
+{
+	u_char out[POLY1305_TAGLEN];
+	u_char *key, *msg, *tag;
+	size_t keylen, msglen, taglen;
+
+	key = kat_unhex(pk->pk_key, &keylen);
+	tag = kat_unhex(pk->pk_tag, &taglen);
+	if (pk->pk_msg != NULL) {
+		msg = kat_unhex(pk->pk_msg, &msglen);
+	} else {
+		msglen = strlen(kat_ietf);
+		msg = malloc(msglen);
+		VERIFY(msg != NULL);
+		bcopy(kat_ietf, msg, msglen);
+	}
+	VERIFY3U(keylen, ==, POLY1305_KEYLEN);
+	VERIFY3U(taglen, ==, POLY1305_TAGLEN);
+
+	poly1305_auth(out, msg, msglen, key);
+	if (bcmp(out, tag, sizeof (out)) != 0)
+		errx(EXIT_ERROR, "poly1305 known-answer check %s failed",
+		    pk->pk_name);
+
+	free(msg);
+	free(tag);
+	free(key);
+}
+
+static void
+kat_chapoly(void)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof (chacha_kats) / sizeof (chacha_kats[0]); ++i)
+		kat_chacha(&chacha_kats[i]);
+	kat_chacha_split();
+	for (i = 0; i < sizeof (poly1305_kats) /
+	    sizeof (poly1305_kats[0]); ++i)
+		kat_poly1305(&poly1305_kats[i]);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: pivy-bench [-k] [-t msec] [bench...]\n"
+	    "\n"
+	    "Runs micro-benchmarks and prints one JSON object per result.\n"
+	    "Benchmarks can be selected by name prefix (e.g. 'stream' or\n"
+	    "'box.open'). The RFC 8439 ChaCha20/Poly1305 known-answer checks\n"
+	    "always run first.\n"
+	    "\n"
+	    "Options:\n"
+	    "  -k         Run the known-answer checks only, then exit\n"
+	    "  -t msec    Minimum run time for each benchmark (default %u)\n"
+	    "\n"
+	    "Benchmarks:\n"
+	    "  tlv.serialise tlv.parse box.seal box.seal.pooled box.open\n"
+	    "  sig.sign sig.verify ebox.create ebox.parse stream.encrypt\n"
+	    "  stream.decrypt sss.create sss.combine bunyan.filtered\n"
+	    "  bunyan.emitted\n",
+	    BENCH_DEFAULT_MSEC);
+	exit(EXIT_USAGE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int c;
+	unsigned long int parsed;
+	char *p;
+	boolean_t kat_only = B_FALSE;
+
+	bunyan_init();
+	bunyan_set_name("pivy-bench");
+	bunyan_set_level(BNY_WARN);
+
+	while ((c = getopt(argc, argv, "kt:")) != -1) {
+		switch (c) {
+		case 'k':
+			kat_only = B_TRUE;
+			break;
+		case 't':
+			errno = 0;
+			parsed = strtoul(optarg, &p, 0);
+			if (errno != 0 || *p != '\0' || parsed == 0) {
+				errx(EXIT_USAGE,
+				    "invalid argument for -t: '%s'", optarg);
+			}
+			bench_min_ns = parsed * NSEC_PER_MSEC;
+			break;
+		default:
+			usage();
+		}
+	}
+	bench_filters = &argv[optind];
+	bench_nfilters = argc - optind;
+
+	kat_chapoly();
+	if (kat_only)
+		return (EXIT_OK);
+
+	bench_tlv();
+	bench_box();
+	bench_sig();
+	bench_ebox();
+	bench_stream();
+	bench_sss();
+	bench_bunyan();
+
+	return (EXIT_OK);
+}
@@ -20,6 +20,8 @@
 #include <strings.h>
 #include <limits.h>
 #include <err.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #if defined(__APPLE__)
 #include <PCSC/wintypes.h>
@@ -38,6 +40,7 @@
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <fcntl.h>
 
 #include "libssh/sshkey.h"
 #include "libssh/sshbuf.h"
@@ -64,6 +67,7 @@ static boolean_t ebox_raw_out = B_FALSE;
 static boolean_t ebox_interactive = B_FALSE;
 static struct ebox_tpl *ebox_stpl;
 static size_t ebox_keylen = 32;
+static const char *ebox_relock_outdir = NULL;
 
 static errf_t *
 parse_hex(const char *str, uint8_t **out, size_t *outlen)
@@ -109,6 +113,57 @@ parse_hex(const char *str, uint8_t **out, size_t *outlen)
 	return (ERRF_OK);
 }
 
+/*
+ * Resolves a 'local-guid' part with a running pivy-agent, if it has the card,
+ * so that we don't have to go and read the certs off the card ourselves. On
+ * success this replaces guid with the full GUID and sets the public key for
+ * the slot (and the CAK if the card has one).
+ */
+static boolean_t
+local_guid_agent(uint8_t **guid, size_t *guidlen, enum piv_slotid slotid,
+    struct sshkey **pubkey, struct sshkey **cak)
+{
+	struct ssh_x509certs *certs;
+	struct ssh_x509cert *c, *key = NULL, *cardauth = NULL;
+	u_char slots[2] = { slotid, PIV_SLOT_CARD_AUTH };
+	size_t i;
+	int rc, fd;
+
+	if (ssh_get_authentication_socket(&fd) != 0)
+		return (B_FALSE);
+	rc = ssh_agent_find_x509certs(fd, *guid, *guidlen, slots, 2, &certs);
+	close(fd);
+	if (rc != 0)
+		return (B_FALSE);
+
+	for (i = 0; i < certs->ncerts; ++i) {
+		c = &certs->certs[i];
+		if (c->slot == slotid)
+			key = c;
+		else if (c->slot == PIV_SLOT_CARD_AUTH)
+			cardauth = c;
+	}
+	if (key == NULL) {
+		ssh_free_x509certs(certs);
+		return (B_FALSE);
+	}
+
+	sshkey_free(*pubkey);
+	*pubkey = key->key;
+	key->key = NULL;
+	if (cardauth != NULL) {
+		sshkey_free(*cak);
+		*cak = cardauth->key;
+		cardauth->key = NULL;
+	}
+	free(*guid);
+	*guid = malloc(GUID_LEN);
+	VERIFY(*guid != NULL);
+	bcopy(certs->guid, *guid, GUID_LEN);
+	*guidlen = GUID_LEN;
+	ssh_free_x509certs(certs);
+	return (B_TRUE);
+}
 
 static errf_t *
 parse_keywords_part(struct ebox_tpl_config *config, int argc, char *argv[],
@@ -259,6 +314,10 @@ parse_keywords_part(struct ebox_tpl_config *config, int argc, char *argv[],
 				    "'local-guid' keyword");
 				goto out;
 			}
+			if (local_guid_agent(&guid, &guidlen, slotid, &pubkey,
+			    &cak)) {
+				continue;
+			}
 			if (!ebox_ctx_init) {
 				rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM,
 				    NULL, NULL, &ebox_ctx);
@@ -267,6 +326,8 @@ parse_keywords_part(struct ebox_tpl_config *config, int argc, char *argv[],
 					    "SCardEstablishContext", rc),
 					    "failed to initialise libpcsc");
 				}
+				piv_set_lazy_probe(B_TRUE);
+				piv_use_reader_cache(NULL);
 			}
 			error = piv_find(ebox_ctx, guid, guidlen, &token);
 			if (error) {
@@ -870,6 +931,15 @@ interactive_unlock_ebox(struct ebox *ebox)
 	struct answer *a;
 	char k = '0';
 
+	error = local_unlock_primary(ebox, &config);
+	if (error == ERRF_OK) {
+		error = ebox_unlock(ebox, config);
+		if (error)
+			return (error);
+		goto done;
+	}
+	errf_free(error);
+
 	config = NULL;
 	while ((config = ebox_next_config(ebox, config)) != NULL) {
 		tconfig = ebox_config_tpl(config);
@@ -1357,48 +1427,580 @@ cmd_key_lock(int argc, char *argv[])
 	return (ERRF_OK);
 }
 
+/*
+ * Bulk relock: a set of eboxes read from files (named on the command line,
+ * found in a directory or listed in a manifest on stdin) or from a stream of
+ * them on stdin. Each token present is opened once for all of them.
+ */
+struct relock_input {
+	char		*rli_path;	/* NULL if it came from stdin */
+	struct ebox	*rli_ebox;
+	struct ebox	*rli_nebox;
+	boolean_t	 rli_opened;
+	errf_t		*rli_err;
+};
+
+struct relock_set {
+	struct relock_input	*rls_in;
+	size_t			 rls_n;
+	size_t			 rls_alloc;
+};
+
+static struct relock_input *
+relock_set_add(struct relock_set *rs)
+{
+	struct relock_input *ri;
+	size_t nalloc;
+
+	if (rs->rls_n >= rs->rls_alloc) {
+		nalloc = rs->rls_alloc * 2 + 16;
+		rs->rls_in = recallocarray(rs->rls_in, rs->rls_alloc, nalloc,
+		    sizeof (struct relock_input));
+		if (rs->rls_in == NULL)
+			err(EXIT_ERROR, "failed to allocate memory");
+		rs->rls_alloc = nalloc;
+	}
+	ri = &rs->rls_in[rs->rls_n++];
+	bzero(ri, sizeof (*ri));
+	return (ri);
+}
+
+static int
+relock_path_cmp(const void *a, const void *b)
+{
+	const struct relock_input *ra = a, *rb = b;
+	return (strcmp(ra->rli_path, rb->rli_path));
+}
+
+static void
+relock_add_path(struct relock_set *rs, const char *path)
+{
+	struct relock_input *ri;
+	struct stat st;
+	struct dirent *de;
+	DIR *d;
+	size_t first;
+	char *fpath;
+
+	if (stat(path, &st) != 0)
+		err(EXIT_USAGE, "failed to stat '%s'", path);
+
+	if (!S_ISDIR(st.st_mode)) {
+		ri = relock_set_add(rs);
+		if ((ri->rli_path = strdup(path)) == NULL)
+			err(EXIT_ERROR, "failed to allocate memory");
+		return;
+	}
+
+	/* Directories give us every regular non-dotfile in them, sorted. */
+	if ((d = opendir(path)) == NULL)
+		err(EXIT_USAGE, "failed to open directory '%s'", path);
+	first = rs->rls_n;
+	while ((errno = 0, de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		if (asprintf(&fpath, "%s/%s", path, de->d_name) < 0)
+			err(EXIT_ERROR, "failed to allocate memory");
+		if (stat(fpath, &st) != 0 || !S_ISREG(st.st_mode)) {
+			free(fpath);
+			continue;
+		}
+		ri = relock_set_add(rs);
+		ri->rli_path = fpath;
+	}
+	if (errno != 0)
+		err(EXIT_ERROR, "failed to read directory '%s'", path);
+	closedir(d);
+	qsort(&rs->rls_in[first], rs->rls_n - first,
+	    sizeof (struct relock_input), relock_path_cmp);
+}
+
+/* A manifest is just a list of paths, one per line. */
+static void
+relock_read_manifest(struct relock_set *rs)
+{
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+
+	while ((len = getline(&line, &cap, stdin)) != -1) {
+		while (len > 0 && (line[len - 1] == '\n' ||
+		    line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if (len == 0 || line[0] == '#')
+			continue;
+		relock_add_path(rs, line);
+	}
+	if (ferror(stdin))
+		err(EXIT_USAGE, "error reading manifest");
+	free(line);
+}
+
+/* Reads all of f (up to limit bytes), NUL-terminated. */
+static char *
+relock_slurp(FILE *f, const char *what, size_t limit, size_t *lenp)
+{
+	char *data;
+	size_t n;
+
+	if ((data = malloc(limit + 1)) == NULL)
+		err(EXIT_ERROR, "failed to allocate memory");
+	n = fread(data, 1, limit, f);
+	if (ferror(f))
+		err(EXIT_USAGE, "error reading %s", what);
+	if (!feof(f) && fgetc(f) != EOF)
+		errx(EXIT_USAGE, "%s too long (max %zu bytes)", what, limit);
+	data[n] = '\0';
+	*lenp = n;
+	return (data);
+}
+
+/* Decodes b64 into buf (unless it's NULL) and parses an ebox from buf. */
 static errf_t *
-cmd_key_relock(int argc, char *argv[])
+relock_get_ebox(struct sshbuf *buf, const char *b64, struct ebox **pebox)
 {
-	struct ebox *ebox, *nebox;
 	errf_t *error;
+	int rc;
+
+	if (b64 != NULL) {
+		sshbuf_reset(buf);
+		if ((rc = sshbuf_b64tod(buf, b64))) {
+			return (errf("ParseError", ssherrf("sshbuf_b64tod", rc),
+			    "error parsing input as base64"));
+		}
+	}
+	if ((error = sshbuf_get_ebox(buf, pebox))) {
+		return (errf("ParseError", error, "failed to parse input as "
+		    "an ebox"));
+	}
+	return (ERRF_OK);
+}
+
+static void
+relock_read_file(struct relock_input *ri)
+{
+	struct sshbuf *buf;
+	char *data;
+	size_t len;
+	FILE *f;
+	int rc;
+
+	if ((f = fopen(ri->rli_path, "r")) == NULL)
+		err(EXIT_ERROR, "failed to open '%s'", ri->rli_path);
+	data = relock_slurp(f, ri->rli_path, EBOX_MAX_SIZE, &len);
+	fclose(f);
+
+	if ((buf = sshbuf_new()) == NULL)
+		err(EXIT_ERROR, "failed to allocate buffer");
+	if (!ebox_raw_in) {
+		ri->rli_err = relock_get_ebox(buf, data, &ri->rli_ebox);
+	} else if ((rc = sshbuf_put(buf, data, len))) {
+		ri->rli_err = ssherrf("sshbuf_put", rc);
+	} else {
+		ri->rli_err = relock_get_ebox(buf, NULL, &ri->rli_ebox);
+	}
+	if (ri->rli_err == NULL && sshbuf_len(buf) > 0) {
+		ri->rli_err = errf("ParseError", NULL, "trailing data after "
+		    "ebox");
+	}
+	sshbuf_free(buf);
+	free(data);
+}
+
+/*
+ * Reads a stream of eboxes from stdin: raw ones (with -r) simply follow one
+ * another, while base64 ones are separated by blank lines (which is how we
+ * write them back out).
+ */
+static void
+relock_read_stream(struct relock_set *rs)
+{
+	struct relock_input *ri;
+	struct sshbuf *buf;
+	char *data, *p, *next;
+	size_t len;
+	int rc;
+
+	data = relock_slurp(stdin, "stdin", BUNDLE_MAX_SIZE, &len);
+	if ((buf = sshbuf_new()) == NULL)
+		err(EXIT_ERROR, "failed to allocate buffer");
+
+	if (ebox_raw_in) {
+		if ((rc = sshbuf_put(buf, data, len)))
+			errfx(EXIT_ERROR, ssherrf("sshbuf_put", rc), "oom");
+		while (sshbuf_len(buf) > 0) {
+			ri = relock_set_add(rs);
+			ri->rli_err = relock_get_ebox(buf, NULL, &ri->rli_ebox);
+			/* No way to find the start of the next one. */
+			if (ri->rli_err != NULL)
+				break;
+		}
+	} else {
+		for (p = data; p != NULL; p = next) {
+			if ((next = strstr(p, "\n\n")) != NULL) {
+				*next = '\0';
+				next += 2;
+			}
+			p += strspn(p, "\r\n\t ");
+			if (*p == '\0')
+				continue;
+			ri = relock_set_add(rs);
+			ri->rli_err = relock_get_ebox(buf, p, &ri->rli_ebox);
+		}
+	}
+	sshbuf_free(buf);
+	free(data);
+}
+
+/*
+ * Writes out a relocked ebox over (or, with -o, alongside) the original,
+ * via a temporary file in the same directory, so that the old ebox is only
+ * replaced once the new one is safely on disk.
+ */
+static errf_t *
+relock_write_file(const struct relock_input *ri, struct sshbuf *buf)
+{
+	const char *base, *dir;
+	char *outpath = NULL, *tmppath = NULL, *b64;
+	struct stat st;
+	mode_t mode = 0600;
+	FILE *f = NULL;
+	int fd = -1;
+	errf_t *error = ERRF_OK;
+
+	base = strrchr(ri->rli_path, '/');
+	base = (base == NULL) ? ri->rli_path : base + 1;
+	if (ebox_relock_outdir != NULL) {
+		if (asprintf(&outpath, "%s/%s", ebox_relock_outdir, base) < 0)
+			return (ERRF_NOMEM);
+	} else if ((outpath = strdup(ri->rli_path)) == NULL) {
+		return (ERRF_NOMEM);
+	}
+	if (stat(ri->rli_path, &st) == 0)
+		mode = st.st_mode & 0777;
+
+	dir = strrchr(outpath, '/');
+	if (asprintf(&tmppath, "%.*s.%s.XXXXXX",
+	    (int)(dir == NULL ? 0 : dir - outpath + 1), outpath, base) < 0) {
+		tmppath = NULL;
+		error = ERRF_NOMEM;
+		goto out;
+	}
+	if ((fd = mkstemp(tmppath)) == -1) {
+		error = errfno("mkstemp", errno, "%s", tmppath);
+		free(tmppath);
+		tmppath = NULL;
+		goto out;
+	}
+	if (fchmod(fd, mode) != 0) {
+		error = errfno("fchmod", errno, "%s", tmppath);
+		goto out;
+	}
+	if ((f = fdopen(fd, "w")) == NULL) {
+		error = errfno("fdopen", errno, "%s", tmppath);
+		goto out;
+	}
+	fd = -1;
+	if (ebox_raw_out) {
+		fwrite(sshbuf_ptr(buf), sshbuf_len(buf), 1, f);
+	} else {
+		if ((b64 = sshbuf_dtob64(buf)) == NULL) {
+			error = ERRF_NOMEM;
+			goto out;
+		}
+		printwrap(f, b64, BASE64_LINE_LEN);
+		free(b64);
+	}
+	if (fflush(f) != 0 || ferror(f)) {
+		error = errfno("fwrite", errno, "%s", tmppath);
+		goto out;
+	}
+	if (fsync(fileno(f)) != 0) {
+		error = errfno("fsync", errno, "%s", tmppath);
+		goto out;
+	}
+	if (fclose(f) != 0) {
+		f = NULL;
+		error = errfno("fclose", errno, "%s", tmppath);
+		goto out;
+	}
+	f = NULL;
+	if (rename(tmppath, outpath) != 0) {
+		error = errfno("rename", errno, "%s", outpath);
+		goto out;
+	}
+	free(tmppath);
+	tmppath = NULL;
+
+out:
+	if (f != NULL)
+		fclose(f);
+	if (fd != -1)
+		close(fd);
+	if (tmppath != NULL) {
+		(void) unlink(tmppath);
+		free(tmppath);
+	}
+	free(outpath);
+	return (error);
+}
+
+/*
+ * Opens every ebox we can using the primary configs and the tokens that are
+ * present, visiting each token only once.
+ */
+static errf_t *
+relock_unlock_all(struct relock_set *rs)
+{
+	struct unlock_batch_item *items = NULL, *item;
+	struct ebox_config **iconfig = NULL, *config;
+	struct ebox_part *part;
+	struct ebox_tpl_part *tpart;
+	struct relock_input *ri;
+	size_t i, n = 0, nalloc = 0;
+	errf_t *error;
+
+	for (i = 0; i < rs->rls_n; ++i) {
+		ri = &rs->rls_in[i];
+		if (ri->rli_err != NULL)
+			continue;
+		config = NULL;
+		while ((config = ebox_next_config(ri->rli_ebox, config))) {
+			if (ebox_tpl_config_type(ebox_config_tpl(config)) !=
+			    EBOX_PRIMARY)
+				continue;
+			if (n >= nalloc) {
+				items = recallocarray(items, nalloc,
+				    nalloc * 2 + 16, sizeof (*items));
+				iconfig = recallocarray(iconfig, nalloc,
+				    nalloc * 2 + 16, sizeof (*iconfig));
+				if (items == NULL || iconfig == NULL)
+					return (ERRF_NOMEM);
+				nalloc = nalloc * 2 + 16;
+			}
+			part = ebox_config_next_part(config, NULL);
+			tpart = ebox_part_tpl(part);
+			item = &items[n];
+			item->ubi_box = ebox_part_box(part);
+			item->ubi_cak = ebox_tpl_part_cak(tpart);
+			item->ubi_name = ebox_tpl_part_name(tpart);
+			item->ubi_group = i;
+			iconfig[n++] = config;
+		}
+	}
+
+	if (n > 0 && (error = local_unlock_batch(items, n)))
+		goto out;
+
+	for (i = 0; i < n; ++i) {
+		if (!items[i].ubi_opened)
+			continue;
+		ri = &rs->rls_in[items[i].ubi_group];
+		ri->rli_opened = B_TRUE;
+		ri->rli_err = ebox_unlock(ri->rli_ebox, iconfig[i]);
+	}
+
+	/*
+	 * For the rest, keep the most useful reason we have (a token that
+	 * was there but refused us beats one that just wasn't plugged in).
+	 */
+	for (i = 0; i < n; ++i) {
+		ri = &rs->rls_in[items[i].ubi_group];
+		if (ri->rli_opened || items[i].ubi_err == NULL)
+			continue;
+		if (ri->rli_err != NULL && (!errf_caused_by(ri->rli_err,
+		    "NotFoundError") || errf_caused_by(items[i].ubi_err,
+		    "NotFoundError")))
+			continue;
+		errf_free(ri->rli_err);
+		ri->rli_err = items[i].ubi_err;
+		items[i].ubi_err = NULL;
+	}
+	for (i = 0; i < rs->rls_n; ++i) {
+		ri = &rs->rls_in[i];
+		if (ri->rli_ebox != NULL && !ri->rli_opened &&
+		    ri->rli_err == NULL) {
+			ri->rli_err = errf("NotFoundError", NULL, "no primary "
+			    "config could be opened with the tokens present");
+		}
+	}
+
+out:
+	for (i = 0; i < n; ++i)
+		errf_free(items[i].ubi_err);
+	free(items);
+	free(iconfig);
+	return (error);
+}
+
+/* Most ephemeral keys we'll keep ready per curve while relocking. */
+#define	RELOCK_EPHEM_MAX	1024
+
+/*
+ * Sealing the new eboxes at the end needs a fresh ephemeral key for every
+ * part of every one of them. Those get made in the background while we're
+ * busy unlocking with the cards, so that all that's left to do for each part
+ * is the ECDH and KDF.
+ */
+static void
+relock_start_ephem_pool(size_t neboxes)
+{
+	struct ebox_tpl_config *tconfig = NULL;
+	struct ebox_tpl_part *tpart;
+	size_t nparts = 0, depth;
+	errf_t *error;
+
+	while ((tconfig = ebox_tpl_next_config(ebox_stpl, tconfig)) != NULL) {
+		tpart = NULL;
+		while ((tpart = ebox_tpl_config_next_part(tconfig,
+		    tpart)) != NULL) {
+			++nparts;
+		}
+	}
+	if (nparts == 0)
+		return;
+	depth = neboxes * nparts;
+	if (depth > RELOCK_EPHEM_MAX)
+		depth = RELOCK_EPHEM_MAX;
+	if ((error = piv_box_ephem_pool_start(depth))) {
+		warnfx(error, "failed to start ephemeral key pool");
+		errf_free(error);
+		return;
+	}
+
+	tconfig = NULL;
+	while ((tconfig = ebox_tpl_next_config(ebox_stpl, tconfig)) != NULL) {
+		tpart = NULL;
+		while ((tpart = ebox_tpl_config_next_part(tconfig,
+		    tpart)) != NULL) {
+			piv_box_ephem_pool_want(
+			    sshkey_size(ebox_tpl_part_pubkey(tpart)));
+		}
+	}
+}
+
+static errf_t *
+cmd_key_relock(int argc, char *argv[])
+{
+	struct relock_set rs;
+	struct relock_input *ri;
+	struct ebox_create_item *citems;
 	struct sshbuf *buf;
-	size_t keylen;
 	const uint8_t *key;
+	errf_t *error;
+	size_t i, j, nok = 0, nfail = 0;
+	size_t keylen;
+	boolean_t stream;
+	char *b64;
+	int k;
 
-	buf = read_stdin_b64(EBOX_MAX_SIZE);
-	error = sshbuf_get_ebox(buf, &ebox);
-	if (error) {
-		errfx(EXIT_ERROR, error, "failed to parse input as "
-		    "a base64-encoded ebox");
+	bzero(&rs, sizeof (rs));
+	stream = (argc == 0);
+	if (stream) {
+		relock_read_stream(&rs);
+	} else {
+		for (k = 0; k < argc; ++k) {
+			if (strcmp(argv[k], "-") == 0)
+				relock_read_manifest(&rs);
+			else
+				relock_add_path(&rs, argv[k]);
+		}
+		for (i = 0; i < rs.rls_n; ++i)
+			relock_read_file(&rs.rls_in[i]);
 	}
+	if (rs.rls_n == 0)
+		errx(EXIT_USAGE, "no eboxes given to relock");
 
 	(void) mlockall(MCL_CURRENT | MCL_FUTURE);
 
-	error = interactive_unlock_ebox(ebox);
-	if (error)
-		return (error);
-
-	key = ebox_key(ebox, &keylen);
+	if (rs.rls_n > 1)
+		relock_start_ephem_pool(rs.rls_n);
 
-	error = ebox_create(ebox_stpl, key, keylen, NULL, 0, &nebox);
-	if (error)
+	if (stream && rs.rls_n == 1 && rs.rls_in[0].rli_err == NULL) {
+		/*
+		 * Just the one ebox: behave as we always have, which includes
+		 * the agent and interactive recovery.
+		 */
+		ri = &rs.rls_in[0];
+		error = interactive_unlock_ebox(ri->rli_ebox);
+	} else {
+		error = relock_unlock_all(&rs);
+	}
+	if (error) {
+		piv_box_ephem_pool_stop();
 		return (error);
+	}
 
-	sshbuf_reset(buf);
-
-	error = sshbuf_put_ebox(buf, nebox);
-	if (error)
+	/* Then re-seal everything that opened, all on the one thread pool. */
+	citems = calloc(rs.rls_n, sizeof (struct ebox_create_item));
+	if (citems == NULL)
+		return (ERRF_NOMEM);
+	for (i = 0, j = 0; i < rs.rls_n; ++i) {
+		ri = &rs.rls_in[i];
+		if (ri->rli_err != NULL)
+			continue;
+		key = ebox_key(ri->rli_ebox, &keylen);
+		citems[j].eci_key = key;
+		citems[j].eci_keylen = keylen;
+		++j;
+	}
+	error = ebox_create_many(ebox_stpl, citems, j);
+	piv_box_ephem_pool_stop();
+	if (error) {
+		free(citems);
 		return (error);
+	}
+	for (i = 0, j = 0; i < rs.rls_n; ++i) {
+		ri = &rs.rls_in[i];
+		if (ri->rli_err == NULL)
+			ri->rli_nebox = citems[j++].eci_ebox;
+	}
+	free(citems);
 
-	if (ebox_raw_out) {
-		fwrite(sshbuf_ptr(buf), sshbuf_len(buf), 1, stdout);
-	} else {
-		printwrap(stdout, sshbuf_dtob64(buf), BASE64_LINE_LEN);
+	buf = sshbuf_new();
+	if (buf == NULL)
+		return (ERRF_NOMEM);
+	for (i = 0; i < rs.rls_n; ++i) {
+		ri = &rs.rls_in[i];
+		if (ri->rli_nebox != NULL) {
+			sshbuf_reset(buf);
+			ri->rli_err = sshbuf_put_ebox(buf, ri->rli_nebox);
+		}
+		if (ri->rli_err == NULL && stream) {
+			if (ebox_raw_out) {
+				fwrite(sshbuf_ptr(buf), sshbuf_len(buf), 1,
+				    stdout);
+			} else {
+				if (nok > 0)
+					fprintf(stdout, "\n");
+				b64 = sshbuf_dtob64(buf);
+				printwrap(stdout, b64, BASE64_LINE_LEN);
+				free(b64);
+			}
+		} else if (ri->rli_err == NULL) {
+			ri->rli_err = relock_write_file(ri, buf);
+		}
+		if (ri->rli_err != NULL) {
+			warnfx(ri->rli_err, "failed to relock %s",
+			    ri->rli_path ? ri->rli_path : "ebox from stdin");
+			errf_free(ri->rli_err);
+			++nfail;
+		} else {
+			if (ri->rli_path != NULL && !ebox_batch)
+				fprintf(stderr, "relocked %s\n", ri->rli_path);
+			++nok;
+		}
+		ebox_free(ri->rli_ebox);
+		ebox_free(ri->rli_nebox);
+		free(ri->rli_path);
 	}
+	sshbuf_free(buf);
+	free(rs.rls_in);
 
-	ebox_free(ebox);
-	ebox_free(nebox);
+	if (nfail > 0) {
+		return (errf("RelockError", NULL, "%zu of %zu eboxes could "
+		    "not be relocked", nfail, nfail + nok));
+	}
 	return (ERRF_OK);
 }
 
@@ -1428,6 +2030,9 @@ cmd_key_info(int argc, char *argv[])
 	case EBOX_STREAM:
 		fprintf(stderr, "type: stream\n");
 		break;
+	case EBOX_STREAM_V2:
+		fprintf(stderr, "type: stream (v2)\n");
+		break;
 	default:
 		break;
 	}
@@ -1488,76 +2093,909 @@ cmd_key_unlock(int argc, char *argv[])
 	return (ERRF_OK);
 }
 
-static errf_t *
-cmd_stream_encrypt(int argc, char *argv[])
+/*
+ * Each chunk in an ebox stream is encrypted and MAC'd on its own (the IV is
+ * derived only from the chunk's sequence number), so we can spread the crypto
+ * work for a stream across several threads.
+ *
+ * The calling thread fills the input buffers of slots in a fixed-size ring,
+ * the worker threads pick up filled slots and run sp_op on them to produce
+ * their output, and a single writer thread writes out the finished slots
+ * strictly in sequence order. The size of the ring bounds how far ahead of
+ * the writer the reader can get, and thus how much memory we use. The slot
+ * buffers are re-used as we go around the ring, and each worker keeps its
+ * own ebox_stream_ctx, so once it's warmed up we don't allocate or set up
+ * anything per chunk.
+ *
+ * If anything fails, the error is recorded in sp_err and sp_abort is set,
+ * which makes all of the threads give up at their next opportunity. The
+ * writer never writes anything past the first chunk that failed.
+ *
+ * When the input is a regular file, we don't copy it into ss_in at all:
+ * instead we mmap() it a window at a time and give each slot a read-only
+ * view (ss_view) of its chunk inside the mapping. We don't map the whole
+ * file at once because of mlockall(MCL_FUTURE), which would have the entire
+ * mapping read in and locked up front. A window is held by the reader until
+ * it moves past it, and by every slot with a view into it, and the last one
+ * to let go of it unmaps it.
+ */
+struct stream_win {
+	uint8_t			*sw_map;
+	size_t			 sw_maplen;
+	const uint8_t		*sw_data;
+	size_t			 sw_len;
+	uint64_t		 sw_off;	/* file offset of sw_data */
+	uint			 sw_refs;	/* protected by sp_mtx */
+};
+
+enum stream_slot_state {
+	SS_FREE = 0,
+	SS_READY,
+	SS_BUSY,
+	SS_DONE
+};
+
+struct stream_slot {
+	enum stream_slot_state	 ss_state;
+	uint32_t		 ss_seqnr;
+	struct sshbuf		*ss_in;
+	struct sshbuf		*ss_view;	/* used instead of ss_in */
+	struct stream_win	*ss_win;	/* window ss_view is in */
+	struct sshbuf		*ss_out;
+	errf_t			*ss_err;
+};
+
+struct stream_pipe {
+	pthread_mutex_t		 sp_mtx;
+	pthread_cond_t		 sp_cv;
+	struct ebox_stream	*sp_es;
+	struct stream_slot	*sp_slots;
+	size_t			 sp_nslots;
+	uint64_t		 sp_head;	/* next slot for the reader */
+	uint64_t		 sp_next;	/* next slot for a worker */
+	uint64_t		 sp_tail;	/* next slot for the writer */
+	boolean_t		 sp_eof;
+	boolean_t		 sp_abort;
+	errf_t			*sp_err;
+	boolean_t		 sp_encrypt;
+	struct ebox_stream_summary *sp_sum;	/* writer only */
+	errf_t			*(*sp_op)(struct ebox_stream_ctx *,
+				    struct stream_slot *);
+	size_t			 sp_nworkers;
+	pthread_t		*sp_workers;
+	pthread_t		 sp_writer;
+};
+
+enum {
+	STREAM_MAX_THREADS = 64,
+	STREAM_READ_SIZE = 64 * 1024,
+	STREAM_WIN_SIZE = 4 * 1024 * 1024,
+	STREAM_AUTO_PIPE_CHUNK = 32 * 1024,
+	STREAM_AUTO_MAX_CHUNK = 4 * 1024 * 1024,
+	STREAM_AUTO_MAX_MEM = 256 * 1024 * 1024
+};
+
+static uint ebox_stream_threads = 0;
+static const char *ebox_stream_ciphername = NULL;
+static boolean_t ebox_stream_range = B_FALSE;
+static boolean_t ebox_stream_footer = B_FALSE;
+static uint64_t ebox_stream_range_off = 0;
+static uint64_t ebox_stream_range_len = UINT64_MAX;
+static const char *ebox_stream_infile = NULL;
+static const char *ebox_stream_outfile = NULL;
+static int ebox_stream_outfd = STDOUT_FILENO;
+static size_t ebox_stream_chunksz = 0;
+static boolean_t ebox_stream_chunk_auto = B_FALSE;
+
+static uint
+stream_nthreads(void)
 {
-	struct ebox_stream *es;
-	struct ebox_stream_chunk *esc;
-	errf_t *error;
-	uint8_t *ibuf;
-	struct sshbuf *obuf;
-	size_t chunksz, nread, nwrote;
-	size_t seq = 0;
-
-	(void) mlockall(MCL_CURRENT | MCL_FUTURE);
+	long ncpu;
+
+	if (ebox_stream_threads != 0)
+		return (ebox_stream_threads);
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1)
+		return (1);
+	if (ncpu > STREAM_MAX_THREADS)
+		return (STREAM_MAX_THREADS);
+	return ((uint)ncpu);
+}
 
-	error = ebox_stream_new(ebox_stpl, &es);
-	if (error)
-		return (error);
-	chunksz = ebox_stream_chunk_size(es);
-	ibuf = malloc(chunksz);
-	if (ibuf == NULL)
-		errx(EXIT_ERROR, "failed to allocate memory");
-	obuf = sshbuf_new();
-	if (obuf == NULL)
-		errx(EXIT_ERROR, "failed to allocate memory");
+/*
+ * Empties an sshbuf without giving back its allocation (unlike sshbuf_reset).
+ */
+static void
+stream_buf_clear(struct sshbuf *buf)
+{
+	VERIFY0(sshbuf_consume(buf, sshbuf_len(buf)));
+}
 
-	error = sshbuf_put_ebox_stream(obuf, es);
-	if (error)
+/* Must be called with sp_mtx held. */
+static void
+stream_pipe_fail(struct stream_pipe *sp, errf_t *err)
+{
+	if (sp->sp_err == NULL)
+		sp->sp_err = err;
+	else
+		errf_free(err);
+	sp->sp_abort = B_TRUE;
+	VERIFY0(pthread_cond_broadcast(&sp->sp_cv));
+}
+
+/*
+ * Maps len bytes of fd starting at off (which needn't be page-aligned).
+ */
+static errf_t *
+stream_win_map(int fd, uint64_t off, size_t len, struct stream_win **swp)
+{
+	struct stream_win *sw;
+	long pgsz;
+	size_t skew;
+	void *map;
+
+	pgsz = sysconf(_SC_PAGESIZE);
+	VERIFY(pgsz > 0);
+	skew = off % pgsz;
+
+	map = mmap(NULL, len + skew, PROT_READ, MAP_SHARED, fd, off - skew);
+	if (map == MAP_FAILED)
+		return (errfno("mmap", errno, "mapping input"));
+	(void) madvise(map, len + skew, MADV_SEQUENTIAL);
+
+	sw = calloc(1, sizeof (struct stream_win));
+	if (sw == NULL)
+		errx(EXIT_ERROR, "failed to allocate memory");
+	sw->sw_map = map;
+	sw->sw_maplen = len + skew;
+	sw->sw_data = sw->sw_map + skew;
+	sw->sw_len = len;
+	sw->sw_off = off;
+	sw->sw_refs = 1;
+
+	*swp = sw;
+	return (ERRF_OK);
+}
+
+static void
+stream_win_rele(struct stream_pipe *sp, struct stream_win *sw)
+{
+	uint refs;
+
+	VERIFY0(pthread_mutex_lock(&sp->sp_mtx));
+	VERIFY3U(sw->sw_refs, >, 0);
+	refs = --sw->sw_refs;
+	VERIFY0(pthread_mutex_unlock(&sp->sp_mtx));
+
+	if (refs > 0)
+		return;
+	VERIFY0(munmap(sw->sw_map, sw->sw_maplen));
+	free(sw);
+}
+
+/*
+ * Points ss at the len bytes at data inside the window sw, instead of its
+ * own input buffer.
+ */
+static void
+stream_slot_view(struct stream_pipe *sp, struct stream_slot *ss,
+    struct stream_win *sw, const uint8_t *data, size_t len)
+{
+	VERIFY3P(ss->ss_view, ==, NULL);
+	ss->ss_view = sshbuf_from(data, len);
+	if (ss->ss_view == NULL)
+		errx(EXIT_ERROR, "failed to allocate memory");
+
+	VERIFY0(pthread_mutex_lock(&sp->sp_mtx));
+	++sw->sw_refs;
+	VERIFY0(pthread_mutex_unlock(&sp->sp_mtx));
+	ss->ss_win = sw;
+}
+
+static void
+stream_slot_unview(struct stream_pipe *sp, struct stream_slot *ss)
+{
+	if (ss->ss_view == NULL)
+		return;
+	sshbuf_free(ss->ss_view);
+	ss->ss_view = NULL;
+	stream_win_rele(sp, ss->ss_win);
+	ss->ss_win = NULL;
+}
+
+static void *
+stream_worker(void *arg)
+{
+	struct stream_pipe *sp = arg;
+	struct stream_slot *ss;
+	struct ebox_stream_ctx *ctx;
+	errf_t *err;
+
+	err = ebox_stream_ctx_new(sp->sp_es, sp->sp_encrypt, &ctx);
+
+	VERIFY0(pthread_mutex_lock(&sp->sp_mtx));
+	if (err != ERRF_OK)
+		stream_pipe_fail(sp, err);
+	for (;;) {
+		if (sp->sp_abort)
+			break;
+		if (sp->sp_next < sp->sp_head) {
+			ss = &sp->sp_slots[sp->sp_next++ % sp->sp_nslots];
+			VERIFY3U(ss->ss_state, ==, SS_READY);
+			ss->ss_state = SS_BUSY;
+			VERIFY0(pthread_mutex_unlock(&sp->sp_mtx));
+
+			stream_buf_clear(ss->ss_out);
+			err = sp->sp_op(ctx, ss);
+			stream_buf_clear(ss->ss_in);
+			stream_slot_unview(sp, ss);
+
+			VERIFY0(pthread_mutex_lock(&sp->sp_mtx));
+			ss->ss_err = err;
+			ss->ss_state = SS_DONE;
+			VERIFY0(pthread_cond_broadcast(&sp->sp_cv));
+			continue;
+		}
+		if (sp->sp_eof)
+			break;
+		VERIFY0(pthread_cond_wait(&sp->sp_cv, &sp->sp_mtx));
+	}
+	VERIFY0(pthread_mutex_unlock(&sp->sp_mtx));
+	ebox_stream_ctx_free(ctx);
+	return (NULL);
+}
+
+/*
+ * Output goes straight to the fd with write(2): the chunks are already large
+ * and complete in their slot buffers, so there's nothing to gain from stdio
+ * copying them into its own buffer first.
+ */
+static errf_t *
+stream_write(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	ssize_t nwrote;
+
+	while (len > 0) {
+		nwrote = write(ebox_stream_outfd, p, len);
+		if (nwrote < 0 && errno == EINTR)
+			continue;
+		if (nwrote < 0)
+			return (errfno("write", errno, "writing output"));
+		p += nwrote;
+		len -= nwrote;
+	}
+	return (ERRF_OK);
+}
+
+static void *
+stream_writer(void *arg)
+{
+	struct stream_pipe *sp = arg;
+	struct stream_slot *ss;
+	boolean_t footer;
+	errf_t *err;
+
+	VERIFY0(pthread_mutex_lock(&sp->sp_mtx));
+	for (;;) {
+		if (sp->sp_abort)
+			break;
+		ss = &sp->sp_slots[sp->sp_tail % sp->sp_nslots];
+		if (sp->sp_tail < sp->sp_head && ss->ss_state == SS_DONE) {
+			VERIFY0(pthread_mutex_unlock(&sp->sp_mtx));
+
+			err = ss->ss_err;
+			ss->ss_err = NULL;
+			if (err == ERRF_OK && sp->sp_sum != NULL) {
+				err = ebox_stream_summary_add(sp->sp_sum,
+				    ss->ss_out, &footer);
+			}
+			if (err == ERRF_OK) {
+				err = stream_write(sshbuf_ptr(ss->ss_out),
+				    sshbuf_len(ss->ss_out));
+			}
+			stream_buf_clear(ss->ss_out);
+
+			VERIFY0(pthread_mutex_lock(&sp->sp_mtx));
+			ss->ss_state = SS_FREE;
+			++sp->sp_tail;
+			if (err != ERRF_OK) {
+				stream_pipe_fail(sp, err);
+				break;
+			}
+			VERIFY0(pthread_cond_broadcast(&sp->sp_cv));
+			continue;
+		}
+		if (sp->sp_eof && sp->sp_tail == sp->sp_head)
+			break;
+		VERIFY0(pthread_cond_wait(&sp->sp_cv, &sp->sp_mtx));
+	}
+	VERIFY0(pthread_mutex_unlock(&sp->sp_mtx));
+	return (NULL);
+}
+
+static errf_t *
+stream_op_enc(struct ebox_stream_ctx *ctx, struct stream_slot *ss)
+{
+	struct sshbuf *in = (ss->ss_view != NULL) ? ss->ss_view : ss->ss_in;
+
+	return (sshbuf_put_ebox_stream_data(ss->ss_out, ctx, ss->ss_seqnr,
+	    sshbuf_ptr(in), sshbuf_len(in)));
+}
+
+static errf_t *
+stream_op_dec(struct ebox_stream_ctx *ctx, struct stream_slot *ss)
+{
+	struct sshbuf *in = (ss->ss_view != NULL) ? ss->ss_view : ss->ss_in;
+
+	return (sshbuf_get_ebox_stream_data(in, ctx, NULL, ss->ss_out));
+}
+
+/*
+ * If sum is not NULL, the writer adds each chunk to it (in order) as it
+ * writes it out.
+ */
+static void
+stream_pipe_start(struct stream_pipe *sp, struct ebox_stream *es,
+    boolean_t encrypt, struct ebox_stream_summary *sum)
+{
+	struct stream_slot *ss;
+	size_t i;
+
+	bzero(sp, sizeof (*sp));
+	VERIFY0(pthread_mutex_init(&sp->sp_mtx, NULL));
+	VERIFY0(pthread_cond_init(&sp->sp_cv, NULL));
+	sp->sp_es = es;
+	sp->sp_encrypt = encrypt;
+	sp->sp_sum = sum;
+	sp->sp_op = encrypt ? stream_op_enc : stream_op_dec;
+
+	sp->sp_nworkers = stream_nthreads();
+	sp->sp_nslots = 2 * sp->sp_nworkers + 2;
+	sp->sp_slots = calloc(sp->sp_nslots, sizeof (struct stream_slot));
+	sp->sp_workers = calloc(sp->sp_nworkers, sizeof (pthread_t));
+	if (sp->sp_slots == NULL || sp->sp_workers == NULL)
+		errx(EXIT_ERROR, "failed to allocate memory");
+	for (i = 0; i < sp->sp_nslots; ++i) {
+		ss = &sp->sp_slots[i];
+		ss->ss_in = sshbuf_new();
+		ss->ss_out = sshbuf_new();
+		if (ss->ss_in == NULL || ss->ss_out == NULL)
+			errx(EXIT_ERROR, "failed to allocate memory");
+	}
+
+	for (i = 0; i < sp->sp_nworkers; ++i) {
+		VERIFY0(pthread_create(&sp->sp_workers[i], NULL,
+		    stream_worker, sp));
+	}
+	VERIFY0(pthread_create(&sp->sp_writer, NULL, stream_writer, sp));
+}
+
+/*
+ * Returns the next free slot for the reader to fill in, waiting for one if
+ * the ring is full, or NULL if the pipeline has failed and the caller should
+ * stop feeding it. The slot isn't handed over to the workers until
+ * stream_pipe_put() is called, so it's fine to leave it unused.
+ */
+static struct stream_slot *
+stream_pipe_slot(struct stream_pipe *sp)
+{
+	struct stream_slot *ss;
+
+	VERIFY0(pthread_mutex_lock(&sp->sp_mtx));
+	ss = &sp->sp_slots[sp->sp_head % sp->sp_nslots];
+	while (!sp->sp_abort && ss->ss_state != SS_FREE)
+		VERIFY0(pthread_cond_wait(&sp->sp_cv, &sp->sp_mtx));
+	if (sp->sp_abort)
+		ss = NULL;
+	VERIFY0(pthread_mutex_unlock(&sp->sp_mtx));
+	return (ss);
+}
+
+static void
+stream_pipe_put(struct stream_pipe *sp, struct stream_slot *ss)
+{
+	VERIFY0(pthread_mutex_lock(&sp->sp_mtx));
+	VERIFY3P(ss, ==, &sp->sp_slots[sp->sp_head % sp->sp_nslots]);
+	VERIFY3U(ss->ss_state, ==, SS_FREE);
+	ss->ss_state = SS_READY;
+	++sp->sp_head;
+	VERIFY0(pthread_cond_broadcast(&sp->sp_cv));
+	VERIFY0(pthread_mutex_unlock(&sp->sp_mtx));
+}
+
+/*
+ * Tells the pipeline there is no more input (failing it with err if that's
+ * not ERRF_OK), waits for all the threads to finish, and tears it down.
+ * Returns the first error encountered by any stage.
+ */
+static errf_t *
+stream_pipe_finish(struct stream_pipe *sp, errf_t *err)
+{
+	struct stream_slot *ss;
+	size_t i;
+
+	VERIFY0(pthread_mutex_lock(&sp->sp_mtx));
+	sp->sp_eof = B_TRUE;
+	if (err != ERRF_OK)
+		stream_pipe_fail(sp, err);
+	VERIFY0(pthread_cond_broadcast(&sp->sp_cv));
+	VERIFY0(pthread_mutex_unlock(&sp->sp_mtx));
+
+	for (i = 0; i < sp->sp_nworkers; ++i)
+		VERIFY0(pthread_join(sp->sp_workers[i], NULL));
+	VERIFY0(pthread_join(sp->sp_writer, NULL));
+
+	for (i = 0; i < sp->sp_nslots; ++i) {
+		ss = &sp->sp_slots[i];
+		stream_slot_unview(sp, ss);
+		sshbuf_free(ss->ss_in);
+		sshbuf_free(ss->ss_out);
+		errf_free(ss->ss_err);
+	}
+	free(sp->sp_slots);
+	free(sp->sp_workers);
+	VERIFY0(pthread_cond_destroy(&sp->sp_cv));
+	VERIFY0(pthread_mutex_destroy(&sp->sp_mtx));
+
+	return (sp->sp_err);
+}
+
+/*
+ * Sets up the input and output of a stream command: -I replaces stdin and -o
+ * replaces stdout. If the input is a regular file, *insize is set to its size
+ * (and we'll map it instead of reading it), otherwise UINT64_MAX. *inoff is
+ * where in the file the input starts, in case we were handed stdin part-way
+ * through.
+ */
+static errf_t *
+stream_open(uint64_t *inoff, uint64_t *insize)
+{
+	struct stat st;
+	off_t pos;
+	int fd;
+
+	*inoff = 0;
+	*insize = UINT64_MAX;
+
+	if (ebox_stream_infile != NULL &&
+	    freopen(ebox_stream_infile, "r", stdin) == NULL) {
+		return (errfno("freopen", errno, "opening input file '%s'",
+		    ebox_stream_infile));
+	}
+	if (ebox_stream_outfile != NULL) {
+		fd = open(ebox_stream_outfile, O_WRONLY | O_CREAT | O_TRUNC,
+		    0600);
+		if (fd < 0) {
+			return (errfno("open", errno, "opening output file "
+			    "'%s'", ebox_stream_outfile));
+		}
+		ebox_stream_outfd = fd;
+	}
+
+	fd = fileno(stdin);
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+		return (ERRF_OK);
+	pos = lseek(fd, 0, SEEK_CUR);
+	if (pos < 0 || pos > st.st_size)
+		return (ERRF_OK);
+	*inoff = pos;
+	*insize = st.st_size;
+	return (ERRF_OK);
+}
+
+static errf_t *
+stream_close(errf_t *error)
+{
+	if (ebox_stream_outfd == STDOUT_FILENO)
 		return (error);
-	while (sshbuf_len(obuf) > 0) {
-		nwrote = fwrite(sshbuf_ptr(obuf), 1, sshbuf_len(obuf), stdout);
-		sshbuf_consume(obuf, nwrote);
+	if (close(ebox_stream_outfd) != 0 && error == ERRF_OK) {
+		error = errfno("close", errno, "closing output file '%s'",
+		    ebox_stream_outfile);
 	}
-	sshbuf_reset(obuf);
+	ebox_stream_outfd = STDOUT_FILENO;
+	return (error);
+}
+
+/* Reads each chunk from stdin straight into the input buffer of its slot. */
+static errf_t *
+stream_encrypt_stdio(struct stream_pipe *sp, size_t chunksz, uint32_t *seq)
+{
+	struct stream_slot *ss;
+	uint8_t *ibuf;
+	size_t nread;
+	int rc;
 
 	while (!feof(stdin) && !ferror(stdin)) {
+		if ((ss = stream_pipe_slot(sp)) == NULL)
+			break;
+		if ((rc = sshbuf_reserve(ss->ss_in, chunksz, &ibuf)))
+			return (ssherrf("sshbuf_reserve", rc));
 		nread = fread(ibuf, 1, chunksz, stdin);
+		VERIFY0(sshbuf_consume_end(ss->ss_in, chunksz - nread));
 		if (nread < 1)
 			continue;
-		error = ebox_stream_chunk_new(es, ibuf, nread, ++seq, &esc);
+		ss->ss_seqnr = ++(*seq);
+		stream_pipe_put(sp, ss);
+	}
+	if (ferror(stdin))
+		return (errfno("fread", errno, "reading input"));
+	return (ERRF_OK);
+}
+
+/*
+ * Hands the pipeline chunks of the input file between off and size as views
+ * into a mapping of it, without copying them. Like anything using mmap(), this
+ * will die with SIGBUS if the file is truncated while we're reading it.
+ */
+static errf_t *
+stream_encrypt_mapped(struct stream_pipe *sp, uint64_t off, uint64_t size,
+    size_t chunksz, uint32_t *seq)
+{
+	struct stream_win *sw;
+	struct stream_slot *ss = NULL;
+	size_t winsz, len, pos, n;
+	int fd = fileno(stdin);
+	errf_t *error;
+
+	/* Keep whole chunks in each window. */
+	winsz = (STREAM_WIN_SIZE / chunksz) * chunksz;
+	if (winsz == 0)
+		winsz = chunksz;
+
+	while (off < size) {
+		len = (size - off > winsz) ? winsz : size - off;
+		error = stream_win_map(fd, off, len, &sw);
 		if (error)
 			return (error);
-		error = ebox_stream_encrypt_chunk(esc);
+		for (pos = 0; pos < sw->sw_len; pos += n) {
+			if ((ss = stream_pipe_slot(sp)) == NULL)
+				break;
+			n = sw->sw_len - pos;
+			if (n > chunksz)
+				n = chunksz;
+			stream_slot_view(sp, ss, sw, sw->sw_data + pos, n);
+			ss->ss_seqnr = ++(*seq);
+			stream_pipe_put(sp, ss);
+		}
+		off += pos;
+		stream_win_rele(sp, sw);
+		if (ss == NULL)
+			break;
+	}
+	return (ERRF_OK);
+}
+
+/*
+ * Picks a chunk size for "-s auto". For a file of known size, we want chunks
+ * big enough that the framing and MAC are lost in the noise, but still enough
+ * of them to keep every worker busy, and not so big that the ring of slots
+ * (each of which can hold a whole chunk) uses too much locked memory. Data
+ * from a pipe may well trickle in, and no part of a chunk can be output until
+ * it's full, so there we use small ones.
+ */
+static size_t
+stream_auto_chunk_size(uint64_t insize)
+{
+	const uint64_t nslots = 2 * stream_nthreads() + 2;
+	uint64_t per;
+	size_t sz;
+
+	if (insize == UINT64_MAX)
+		return (STREAM_AUTO_PIPE_CHUNK);
+	per = insize / (4 * stream_nthreads());
+	sz = STREAM_AUTO_MAX_CHUNK;
+	while (sz > EBOX_STREAM_DEFAULT_CHUNK &&
+	    (sz > per || 2 * sz * nslots > STREAM_AUTO_MAX_MEM))
+		sz /= 2;
+	return (sz);
+}
+
+static errf_t *
+cmd_stream_encrypt(int argc, char *argv[])
+{
+	struct ebox_stream *es;
+	struct stream_pipe sp;
+	struct ebox_stream_summary *sum = NULL;
+	errf_t *error;
+	struct sshbuf *obuf;
+	size_t chunksz;
+	uint64_t inoff, insize;
+	uint32_t seq = 0;
+
+	error = stream_open(&inoff, &insize);
+	if (error)
+		return (error);
+
+	(void) mlockall(MCL_CURRENT | MCL_FUTURE);
+
+	error = ebox_stream_new_cipher(ebox_stpl, ebox_stream_ciphername, &es);
+	if (error)
+		return (error);
+	if (ebox_stream_footer) {
+		error = ebox_stream_set_version(es, 2);
 		if (error)
 			return (error);
-		error = sshbuf_put_ebox_stream_chunk(obuf, esc);
+	}
+	chunksz = ebox_stream_chunksz;
+	if (ebox_stream_chunk_auto)
+		chunksz = stream_auto_chunk_size(insize);
+	if (chunksz != 0) {
+		error = ebox_stream_set_chunk_size(es, chunksz);
 		if (error)
 			return (error);
-		while (sshbuf_len(obuf) > 0) {
-			nwrote = fwrite(sshbuf_ptr(obuf), 1, sshbuf_len(obuf),
-			    stdout);
-			sshbuf_consume(obuf, nwrote);
+	}
+	chunksz = ebox_stream_chunk_size(es);
+	obuf = sshbuf_new();
+	if (obuf == NULL)
+		errx(EXIT_ERROR, "failed to allocate memory");
+
+	error = sshbuf_put_ebox_stream(obuf, es);
+	if (error)
+		return (error);
+	error = stream_write(sshbuf_ptr(obuf), sshbuf_len(obuf));
+	if (error)
+		return (error);
+	sshbuf_free(obuf);
+
+	if (ebox_stream_footer) {
+		error = ebox_stream_summary_new(es, &sum);
+		if (error)
+			return (error);
+	}
+
+	stream_pipe_start(&sp, es, B_TRUE, sum);
+	if (insize != UINT64_MAX) {
+		error = stream_encrypt_mapped(&sp, inoff, insize, chunksz,
+		    &seq);
+	} else {
+		error = stream_encrypt_stdio(&sp, chunksz, &seq);
+	}
+	error = stream_pipe_finish(&sp, error);
+
+	if (error == ERRF_OK && sum != NULL) {
+		obuf = sshbuf_new();
+		if (obuf == NULL)
+			errx(EXIT_ERROR, "failed to allocate memory");
+		error = sshbuf_put_ebox_stream_footer(obuf, sum);
+		if (error == ERRF_OK) {
+			error = stream_write(sshbuf_ptr(obuf),
+			    sshbuf_len(obuf));
 		}
-		sshbuf_reset(obuf);
-		ebox_stream_chunk_free(esc);
+		sshbuf_free(obuf);
 	}
+	ebox_stream_summary_free(sum);
 
 	ebox_stream_free(es);
-	return (ERRF_OK);
+	return (stream_close(error));
+}
+
+/*
+ * Decrypts just the chunks covering the range given by -O and -L, reading
+ * them with pread() from stdin (which has to be a regular file for this).
+ * base is the offset in the file where the first chunk starts.
+ */
+static errf_t *
+stream_decrypt_range(struct ebox_stream *es, uint64_t base)
+{
+	struct ebox_stream_ctx *ctx;
+	struct sshbuf *obuf;
+	struct stat st;
+	uint64_t off = ebox_stream_range_off;
+	uint64_t rem = ebox_stream_range_len;
+	const size_t chunksz = ebox_stream_chunk_size(es);
+	size_t want;
+	int fd = fileno(stdin);
+	errf_t *error;
+
+	if (fstat(fd, &st) != 0)
+		return (errfno("fstat", errno, "stdin"));
+	if (!S_ISREG(st.st_mode)) {
+		return (errf("NotSeekableError", NULL, "-O/-L need stdin to "
+		    "be a regular file"));
+	}
+
+	error = ebox_stream_ctx_new(es, B_FALSE, &ctx);
+	if (error)
+		return (error);
+	obuf = sshbuf_new();
+	if (obuf == NULL)
+		errx(EXIT_ERROR, "failed to allocate memory");
+
+	while (rem > 0) {
+		want = (rem > chunksz) ? chunksz : rem;
+		error = ebox_stream_pread_range(ctx, fd, base, off, want,
+		    obuf);
+		if (error || sshbuf_len(obuf) == 0)
+			break;
+		error = stream_write(sshbuf_ptr(obuf), sshbuf_len(obuf));
+		if (error)
+			break;
+		off += sshbuf_len(obuf);
+		rem -= sshbuf_len(obuf);
+		stream_buf_clear(obuf);
+	}
+
+	sshbuf_free(obuf);
+	ebox_stream_ctx_free(ctx);
+	return (error);
+}
+
+/*
+ * Reads up to len bytes of input into buf: first whatever is left in ibuf
+ * (read past the end of the stream header), then from stdin.
+ */
+static size_t
+stream_read(struct sshbuf *ibuf, uint8_t *buf, size_t len)
+{
+	if (sshbuf_len(ibuf) == 0)
+		return (fread(buf, 1, len, stdin));
+	if (len > sshbuf_len(ibuf))
+		len = sshbuf_len(ibuf);
+	bcopy(sshbuf_ptr(ibuf), buf, len);
+	VERIFY0(sshbuf_consume(ibuf, len));
+	return (len);
+}
+
+/*
+ * Reads each frame from stdin straight into the input buffer of a slot and
+ * hands it to the pipeline. The workers check the MAC on each one and the
+ * writer stops at the first that fails, so nothing after a bad chunk is ever
+ * written out.
+ *
+ * We also keep track of the sequence numbers and (for v2 streams) check the
+ * footer here, since this is where the frames are in order.
+ */
+static errf_t *
+stream_decrypt_stdio(struct stream_pipe *sp, struct ebox_stream_summary *sum,
+    struct sshbuf *ibuf)
+{
+	struct ebox_stream_reader *rdr;
+	struct stream_slot *ss;
+	boolean_t done, footer;
+	errf_t *error;
+	uint8_t *buf;
+	size_t len, nread;
+
+	error = ebox_stream_reader_new(sp->sp_es, &rdr);
+	if (error)
+		return (error);
+
+	while ((ss = stream_pipe_slot(sp)) != NULL) {
+		done = B_FALSE;
+		while (!done) {
+			error = ebox_stream_reader_next(rdr, ss->ss_in, &buf,
+			    &len);
+			if (error)
+				goto out;
+			nread = stream_read(ibuf, buf, len);
+			error = ebox_stream_reader_advance(rdr, ss->ss_in,
+			    nread, &done);
+			if (error)
+				goto out;
+			if (nread == 0)
+				break;
+		}
+		if (!done) {
+			stream_buf_clear(ss->ss_in);
+			if (ferror(stdin)) {
+				error = errfno("fread", errno,
+				    "reading input");
+			} else if (ebox_stream_reader_partial(rdr)) {
+				error = errf("IncompleteInputError", NULL,
+				    "input too short");
+			} else {
+				error = ebox_stream_summary_finish(sum);
+			}
+			goto out;
+		}
+
+		error = ebox_stream_summary_add(sum, ss->ss_in, &footer);
+		if (error)
+			goto out;
+		if (footer)
+			stream_buf_clear(ss->ss_in);
+		else
+			stream_pipe_put(sp, ss);
+	}
+
+out:
+	ebox_stream_reader_free(rdr);
+	return (error);
+}
+
+/*
+ * The same as stream_decrypt_stdio(), but framing the chunks of the input
+ * file between off and size in place in a mapping of it. When a frame runs
+ * off the end of the current window we map a new one starting at that frame
+ * (big enough to hold all of it).
+ */
+static errf_t *
+stream_decrypt_mapped(struct stream_pipe *sp, struct ebox_stream_summary *sum,
+    uint64_t off, uint64_t size)
+{
+	struct stream_win *sw = NULL;
+	struct stream_slot *ss;
+	boolean_t footer;
+	size_t pos = 0, framelen = 0, len;
+	uint64_t end;
+	int fd = fileno(stdin);
+	errf_t *error = ERRF_OK;
+
+	while (1) {
+		if (sw != NULL) {
+			error = ebox_stream_frame_peek(sw->sw_data + pos,
+			    sw->sw_len - pos, &framelen);
+			if (error == ERRF_OK) {
+				if ((ss = stream_pipe_slot(sp)) == NULL)
+					break;
+				stream_slot_view(sp, ss, sw,
+				    sw->sw_data + pos, framelen);
+				pos += framelen;
+				error = ebox_stream_summary_add(sum,
+				    ss->ss_view, &footer);
+				if (error)
+					break;
+				if (footer)
+					stream_slot_unview(sp, ss);
+				else
+					stream_pipe_put(sp, ss);
+				continue;
+			}
+			if (!errf_caused_by(error, "IncompleteMessageError"))
+				break;
+			errf_free(error);
+			error = ERRF_OK;
+
+			off = sw->sw_off + pos;
+			end = sw->sw_off + sw->sw_len;
+			stream_win_rele(sp, sw);
+			sw = NULL;
+			if (off < size && end == size) {
+				error = errf("IncompleteInputError", NULL,
+				    "input too short");
+				break;
+			}
+		}
+		if (off == size) {
+			error = ebox_stream_summary_finish(sum);
+			break;
+		}
+		if (framelen > size - off) {
+			error = errf("IncompleteInputError", NULL,
+			    "input too short");
+			break;
+		}
+		len = (framelen > STREAM_WIN_SIZE) ? framelen : STREAM_WIN_SIZE;
+		if (len > size - off)
+			len = size - off;
+		error = stream_win_map(fd, off, len, &sw);
+		if (error)
+			break;
+		pos = 0;
+	}
+
+	if (sw != NULL)
+		stream_win_rele(sp, sw);
+	return (error);
 }
 
 static errf_t *
 cmd_stream_decrypt(int argc, char *argv[])
 {
 	struct ebox_stream *es = NULL;
-	struct ebox_stream_chunk *esc = NULL;
 	struct ebox *ebox;
+	struct stream_pipe sp;
+	struct ebox_stream_summary *sum;
 	errf_t *error;
 	uint8_t *buf;
-	const uint8_t *data;
-	struct sshbuf *ibuf, *nbuf;
-	size_t nread, nwrote, poff;
+	struct sshbuf *ibuf;
+	size_t nread, poff, total = 0;
+	uint64_t inoff, insize, base;
+
+	error = stream_open(&inoff, &insize);
+	if (error)
+		return (error);
 
 	(void) mlockall(MCL_CURRENT | MCL_FUTURE);
 
@@ -1572,6 +3010,7 @@ cmd_stream_decrypt(int argc, char *argv[])
 		if (nread < 1 && ferror(stdin))
 			err(EXIT_ERROR, "failed to read input");
 		VERIFY0(sshbuf_put(ibuf, buf, nread));
+		total += nread;
 
 		poff = ibuf->off;
 		error = sshbuf_get_ebox_stream(ibuf, &es);
@@ -1586,11 +3025,13 @@ cmd_stream_decrypt(int argc, char *argv[])
 		}
 		break;
 	}
+	free(buf);
 
 	if (es == NULL) {
 		return (errf("IncompleteInputError", NULL,
 		    "input was incomplete"));
 	}
+	base = inoff + (total - sshbuf_len(ibuf));
 
 	ebox = ebox_stream_ebox(es);
 
@@ -1598,52 +3039,33 @@ cmd_stream_decrypt(int argc, char *argv[])
 	if (error)
 		return (error);
 
-	while (1) {
-		nread = fread(buf, 1, 8192, stdin);
-		if (nread < 1 && ferror(stdin))
-			err(EXIT_ERROR, "failed to read input");
-		else if (nread < 1 && feof(stdin) && sshbuf_len(ibuf) == 0)
-			break;
-		VERIFY0(sshbuf_put(ibuf, buf, nread));
-
-		poff = ibuf->off;
-		error = sshbuf_get_ebox_stream_chunk(ibuf, es, &esc);
-		if (errf_caused_by(error, "IncompleteMessageError")) {
-			if (feof(stdin))
-				errfx(EXIT_ERROR, error, "input too short");
-			ibuf->off = poff;
-			errf_free(error);
-			continue;
-		} else if (error) {
-			return (error);
-		}
-
-		error = ebox_stream_decrypt_chunk(esc);
-		if (error)
-			return (error);
-
-		data = ebox_stream_chunk_data(esc, &nread);
-
-		nwrote = fwrite(data, 1, nread, stdout);
-		if (nwrote < nread)
-			err(EXIT_ERROR, "failed to write data");
-
-		ebox_stream_chunk_free(esc);
-		esc = NULL;
-
-		if (sshbuf_len(ibuf) > 0) {
-			nbuf = sshbuf_new();
-			VERIFY(nbuf != NULL);
-			VERIFY0(sshbuf_put(nbuf, sshbuf_ptr(ibuf),
-			    sshbuf_len(ibuf)));
-			sshbuf_free(ibuf);
-			ibuf = nbuf;
-		}
+	if (ebox_stream_range) {
+		error = stream_decrypt_range(es, base);
+		sshbuf_free(ibuf);
+		ebox_stream_free(es);
+		return (stream_close(error));
 	}
 
+	error = ebox_stream_summary_new(es, &sum);
+	if (error)
+		return (error);
+
+	/*
+	 * If we're mapping the input, what's left in ibuf is just whatever
+	 * stdio read past the end of the header: the mapping starts from the
+	 * first chunk at base.
+	 */
+	stream_pipe_start(&sp, es, B_FALSE, NULL);
+	if (insize != UINT64_MAX)
+		error = stream_decrypt_mapped(&sp, sum, base, insize);
+	else
+		error = stream_decrypt_stdio(&sp, sum, ibuf);
+	error = stream_pipe_finish(&sp, error);
+
+	ebox_stream_summary_free(sum);
+	sshbuf_free(ibuf);
 	ebox_stream_free(es);
-	ebox_stream_chunk_free(esc);
-	return (ERRF_OK);
+	return (stream_close(error));
 }
 
 static void
@@ -1686,15 +3108,87 @@ print_challenge(const struct ebox_challenge *chal)
 	    wordlist[words[2]], wordlist[words[3]]);
 }
 
+/*
+ * Parses each of the challenges in a bundle and unlocks them all at once,
+ * so that each device involved is only asked for its PIN the one time.
+ */
+static struct ebox_challenge **
+open_challenge_bundle(struct sshbuf *sbuf, uint *pn)
+{
+	struct ebox_bundle *bundle;
+	struct ebox_challenge **chals;
+	struct piv_ecdh_box **boxes;
+	struct sshbuf *ibuf;
+	errf_t *error;
+	uint i, n;
+
+	error = sshbuf_get_ebox_bundle(sbuf, &bundle);
+	if (error) {
+		errfx(EXIT_ERROR, error, "failed to parse input as "
+		    "a challenge bundle");
+	}
+	if (ebox_bundle_type(bundle) != EBOX_CHAL_BUNDLE)
+		errx(EXIT_ERROR, "input is a bundle, but not of challenges");
+	n = ebox_bundle_count(bundle);
+
+	boxes = calloc(n, sizeof (struct piv_ecdh_box *));
+	chals = calloc(n, sizeof (struct ebox_challenge *));
+	if (boxes == NULL || chals == NULL)
+		errx(EXIT_ERROR, "failed to allocate memory");
+
+	for (i = 0; i < n; ++i) {
+		ibuf = sshbuf_fromb((struct sshbuf *)ebox_bundle_item(bundle,
+		    i));
+		if (ibuf == NULL)
+			errx(EXIT_ERROR, "failed to allocate memory");
+		error = sshbuf_get_piv_box(ibuf, &boxes[i]);
+		if (error) {
+			errfx(EXIT_ERROR, error, "failed to parse challenge "
+			    "%u in bundle", i + 1);
+		}
+		sshbuf_free(ibuf);
+	}
+	ebox_bundle_free(bundle);
+
+	error = local_unlock_many(boxes, n, NULL);
+	if (error)
+		errfx(EXIT_ERROR, error, "failed to unlock challenges");
+
+	for (i = 0; i < n; ++i) {
+		error = sshbuf_get_ebox_challenge(boxes[i], &chals[i]);
+		if (error) {
+			errfx(EXIT_ERROR, error, "failed to parse contents of "
+			    "challenge box %u", i + 1);
+		}
+		piv_box_free(boxes[i]);
+	}
+	free(boxes);
+
+	*pn = n;
+	return (chals);
+}
+
 static errf_t *
 cmd_challenge_info(int argc, char *argv[])
 {
-	struct ebox_challenge *chal;
+	struct ebox_challenge *chal, **chals;
 	struct sshbuf *sbuf;
 	struct piv_ecdh_box *box;
 	errf_t *error;
+	uint i, n;
 
-	sbuf = read_stdin_b64(TPL_MAX_SIZE);
+	sbuf = read_stdin_b64(BUNDLE_MAX_SIZE);
+	if (sshbuf_is_ebox_bundle(sbuf)) {
+		chals = open_challenge_bundle(sbuf, &n);
+		sshbuf_free(sbuf);
+		for (i = 0; i < n; ++i) {
+			fprintf(stderr, "[%u of %u]\n", i + 1, n);
+			print_challenge(chals[i]);
+			ebox_challenge_free(chals[i]);
+		}
+		free(chals);
+		return (NULL);
+	}
 	error = sshbuf_get_piv_box(sbuf, &box);
 	if (error) {
 		errfx(EXIT_ERROR, error, "failed to parse input as "
@@ -1718,6 +3212,83 @@ cmd_challenge_info(int argc, char *argv[])
 	return (NULL);
 }
 
+/*
+ * Responds to every challenge in a bundle with a single confirmation. All
+ * the outer challenge boxes are opened first, then (once the user has said
+ * YES) all the keyboxes inside them, each batch taking one transaction per
+ * device.
+ */
+static errf_t *
+challenge_respond_bundle(struct sshbuf *sbuf)
+{
+	struct ebox_challenge **chals;
+	struct piv_ecdh_box **boxes;
+	struct ebox_bundle *rbundle;
+	errf_t *error;
+	char *line;
+	uint i, n;
+
+	chals = open_challenge_bundle(sbuf, &n);
+
+	for (i = 0; i < n; ++i) {
+		fprintf(stderr, "[%u of %u]\n", i + 1, n);
+		print_challenge(chals[i]);
+	}
+
+	fprintf(stderr, "Please check that the verification words of all %u "
+	    "challenges match the\noriginal sources via a separate "
+	    "communications channel to the one used to\ntransport the "
+	    "challenges themselves.\n\n", n);
+
+	line = readline("If all of these details are correct and you wish to "
+	    "respond to every\nchallenge, type 'YES': ");
+	if (line == NULL)
+		exit(EXIT_ERROR);
+	if (strcmp(line, "YES") != 0)
+		exit(EXIT_ERROR);
+	free(line);
+
+	boxes = calloc(n, sizeof (struct piv_ecdh_box *));
+	if (boxes == NULL)
+		errx(EXIT_ERROR, "failed to allocate memory");
+	for (i = 0; i < n; ++i)
+		boxes[i] = ebox_challenge_box(chals[i]);
+	error = local_unlock_many(boxes, n, NULL);
+	if (error)
+		errfx(EXIT_ERROR, error, "failed to unlock challenges");
+	free(boxes);
+
+	rbundle = ebox_bundle_new(EBOX_RESP_BUNDLE);
+	if (rbundle == NULL)
+		errx(EXIT_ERROR, "failed to allocate memory");
+	for (i = 0; i < n; ++i) {
+		sshbuf_reset(sbuf);
+		error = sshbuf_put_ebox_challenge_response(sbuf, chals[i]);
+		if (error == ERRF_OK)
+			error = ebox_bundle_add(rbundle, sbuf);
+		if (error) {
+			errfx(EXIT_ERROR, error, "failed to generate "
+			    "response %u", i + 1);
+		}
+		ebox_challenge_free(chals[i]);
+	}
+	free(chals);
+
+	sshbuf_reset(sbuf);
+	error = sshbuf_put_ebox_bundle(sbuf, rbundle);
+	if (error)
+		errfx(EXIT_ERROR, error, "failed to generate response bundle");
+	ebox_bundle_free(rbundle);
+
+	fprintf(stdout, "-- Begin response bundle --\n");
+	printwrap(stdout, sshbuf_dtob64(sbuf), BASE64_LINE_LEN);
+	fprintf(stdout, "-- End response bundle --\n");
+
+	sshbuf_free(sbuf);
+
+	return (NULL);
+}
+
 static errf_t *
 cmd_challenge_respond(int argc, char *argv[])
 {
@@ -1727,7 +3298,9 @@ cmd_challenge_respond(int argc, char *argv[])
 	errf_t *error;
 	char *line;
 
-	sbuf = read_stdin_b64(TPL_MAX_SIZE);
+	sbuf = read_stdin_b64(BUNDLE_MAX_SIZE);
+	if (sshbuf_is_ebox_bundle(sbuf))
+		return (challenge_respond_bundle(sbuf));
 	error = sshbuf_get_piv_box(sbuf, &box);
 	if (error) {
 		errfx(EXIT_ERROR, error, "failed to parse input as "
@@ -1780,6 +3353,127 @@ cmd_challenge_respond(int argc, char *argv[])
 	return (NULL);
 }
 
+/*
+ * Adds a challenge (or all the challenges in a bundle) to "bundle", after
+ * checking that it at least parses.
+ */
+static void
+bundle_add_challenge(struct ebox_bundle *bundle, struct sshbuf *cbuf)
+{
+	struct ebox_bundle *inner;
+	struct piv_ecdh_box *box;
+	struct sshbuf *ibuf;
+	errf_t *error;
+	uint i;
+
+	if (sshbuf_is_ebox_bundle(cbuf)) {
+		error = sshbuf_get_ebox_bundle(cbuf, &inner);
+		if (error)
+			errfx(EXIT_ERROR, error, "failed to parse bundle");
+		if (ebox_bundle_type(inner) != EBOX_CHAL_BUNDLE)
+			errx(EXIT_ERROR, "input bundle is not of challenges");
+		for (i = 0; i < ebox_bundle_count(inner); ++i) {
+			error = ebox_bundle_add(bundle,
+			    ebox_bundle_item(inner, i));
+			if (error)
+				errfx(EXIT_ERROR, error, "failed to add item");
+		}
+		ebox_bundle_free(inner);
+		return;
+	}
+
+	ibuf = sshbuf_fromb(cbuf);
+	if (ibuf == NULL)
+		errx(EXIT_ERROR, "failed to allocate memory");
+	error = sshbuf_get_piv_box(ibuf, &box);
+	if (error) {
+		errfx(EXIT_ERROR, error, "failed to parse input as "
+		    "a base64-encoded ebox challenge");
+	}
+	piv_box_free(box);
+	sshbuf_free(ibuf);
+
+	error = ebox_bundle_add(bundle, cbuf);
+	if (error)
+		errfx(EXIT_ERROR, error, "failed to add challenge");
+}
+
+static errf_t *
+cmd_challenge_bundle(int argc, char *argv[])
+{
+	struct ebox_bundle *bundle;
+	struct sshbuf *b64, *cbuf;
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	errf_t *error;
+	int rc;
+
+	if (ebox_raw_in) {
+		return (errf("ArgumentError", NULL, "challenge bundle can't "
+		    "take raw input (-r)"));
+	}
+
+	bundle = ebox_bundle_new(EBOX_CHAL_BUNDLE);
+	b64 = sshbuf_new();
+	cbuf = sshbuf_new();
+	if (bundle == NULL || b64 == NULL || cbuf == NULL)
+		errx(EXIT_ERROR, "failed to allocate memory");
+
+	/*
+	 * The input is any number of base64 challenges, one after another,
+	 * separated by "--" lines (like the ones printed around each challenge
+	 * during recovery).
+	 */
+	do {
+		len = getline(&line, &cap, stdin);
+		if (len > 0 && !(len >= 2 && line[0] == '-' &&
+		    line[1] == '-')) {
+			if ((rc = sshbuf_put(b64, line, len)))
+				errfx(EXIT_ERROR, ssherrf("sshbuf_put", rc),
+				    "error reading input");
+			if (sshbuf_len(b64) > BUNDLE_MAX_SIZE)
+				errx(EXIT_USAGE, "input too long");
+			continue;
+		}
+		if (sshbuf_len(b64) == 0)
+			continue;
+		if ((rc = sshbuf_put_u8(b64, 0)))
+			errfx(EXIT_ERROR, ssherrf("sshbuf_put_u8", rc),
+			    "error reading input");
+		sshbuf_reset(cbuf);
+		rc = sshbuf_b64tod(cbuf, (const char *)sshbuf_ptr(b64));
+		if (rc) {
+			errfx(EXIT_ERROR, ssherrf("sshbuf_b64tod", rc),
+			    "error parsing input as base64");
+		}
+		sshbuf_reset(b64);
+		bundle_add_challenge(bundle, cbuf);
+	} while (len > 0);
+	if (ferror(stdin))
+		err(EXIT_USAGE, "error reading input");
+	free(line);
+
+	if (ebox_bundle_count(bundle) == 0)
+		return (errf("ArgumentError", NULL, "no challenges given"));
+
+	sshbuf_reset(cbuf);
+	error = sshbuf_put_ebox_bundle(cbuf, bundle);
+	if (error)
+		return (error);
+
+	if (ebox_raw_out) {
+		fwrite(sshbuf_ptr(cbuf), sshbuf_len(cbuf), 1, stdout);
+	} else {
+		printwrap(stdout, sshbuf_dtob64(cbuf), BASE64_LINE_LEN);
+	}
+
+	ebox_bundle_free(bundle);
+	sshbuf_free(b64);
+	sshbuf_free(cbuf);
+	return (ERRF_OK);
+}
+
 static void
 usage_types(void)
 {
@@ -1941,16 +3635,24 @@ usage_key(const char *op)
 		    "\n");
 	} else if (strcmp(op, "relock") == 0) {
 		fprintf(stderr,
-		    "usage: pivy-box key relock [-brR] <newtpl>\n"
+		    "usage: pivy-box key relock [-brR] [-o dir] <newtpl> "
+		    "[file|dir|-]...\n"
 		    "\n"
 		    "Decrypts a 'key' ebox and then re-encrypts it with a new\n"
 		    "template. Can be used to update an ebox after editing\n"
 		    "the template to add/remove devices.\n"
 		    "\n"
+		    "With no files, reads one ebox (or a stream of them,\n"
+		    "separated by blank lines) from stdin and writes the\n"
+		    "results to stdout. Otherwise relocks each file given\n"
+		    "(every file in a directory, or every path listed on\n"
+		    "stdin for '-') in place, opening each token only once.\n"
+		    "\n"
 		    "Options:\n"
 		    "  -b         batch mode, don't talk to terminal\n"
 		    "  -r         raw input, don't base64-decode stdin\n"
 		    "  -R         raw output, don't base64-encode stdout\n"
+		    "  -o dir     write relocked files into dir instead\n"
 		    "\n");
 	} else {
 noop:
@@ -1971,13 +3673,36 @@ usage_stream(const char *op)
 		goto noop;
 	} else if (strcmp(op, "encrypt") == 0) {
 		fprintf(stderr,
-		    "usage: pivy-box stream encrypt <tpl>\n"
+		    "usage: pivy-box stream encrypt [-F] [-c cipher] "
+		    "[-j threads] [-s size]\n"
+		    "                              [-I infile] [-o outfile] "
+		    "<tpl>\n"
 		    "\n"
 		    "Accepts streaming data on stdin and encrypts it to the\n"
-		    "given template in chunks. Output is binary.\n");
+		    "given template in chunks. Output is binary.\n"
+		    "\n"
+		    "Options:\n"
+		    "  -F         write a v2 stream, with a footer to detect\n"
+		    "             truncation (needs a newer pivy to decrypt)\n"
+		    "  -I infile  read input from a file instead of stdin\n"
+		    "  -o outfile write output to a file instead of stdout\n"
+		    "  -c cipher  cipher to use for chunks, one of:\n"
+		    "               aes256-ctr (default, with HMAC-SHA256)\n"
+		    "               aes256-gcm\n"
+		    "               chacha20-poly1305\n"
+		    "               aead (fastest of the two above on this\n"
+		    "                     machine)\n"
+		    "  -j threads number of chunks to encrypt in parallel\n"
+		    "             (default: number of online CPUs)\n"
+		    "  -s size    plaintext bytes per chunk (with optional\n"
+		    "             k or m suffix, default 128k), or 'auto'\n"
+		    "             to pick based on the input and -j\n"
+		    "\n");
 	} else if (strcmp(op, "decrypt") == 0) {
 		fprintf(stderr,
-		    "usage: pivy-box stream decrypt [-b]\n"
+		    "usage: pivy-box stream decrypt [-b] [-j threads] "
+		    "[-O offset] [-L length]\n"
+		    "                              [-I infile] [-o outfile]\n"
 		    "\n"
 		    "Accepts output from 'stream encrypt' on stdin, decrypts\n"
 		    "it and outputs the plaintext. Data is only output after\n"
@@ -1985,6 +3710,14 @@ usage_stream(const char *op)
 		    "\n"
 		    "Options:\n"
 		    "  -b         batch mode, don't talk to terminal\n"
+		    "  -I infile  read input from a file instead of stdin\n"
+		    "  -o outfile write output to a file instead of stdout\n"
+		    "  -j threads number of chunks to decrypt in parallel\n"
+		    "             (default: number of online CPUs)\n"
+		    "  -O offset  only output plaintext starting from this\n"
+		    "             byte offset (stdin must be a file)\n"
+		    "  -L length  only output this many bytes of plaintext\n"
+		    "             (stdin must be a file)\n"
 		    "\n");
 	} else {
 noop:
@@ -2017,14 +3750,32 @@ usage_challenge(const char *op)
 		    "waits for user confirmation before generating a response.\n"
 		    "\n"
 		    "The response must then be transported back to the program\n"
-		    "which generated the challenge to complete the process.\n");
+		    "which generated the challenge to complete the process.\n"
+		    "\n"
+		    "If given a challenge bundle, responds to all of the\n"
+		    "challenges in it after one confirmation, and outputs a\n"
+		    "response bundle.\n");
+	} else if (strcmp(op, "bundle") == 0) {
+		fprintf(stderr,
+		    "usage: pivy-box challenge bundle\n"
+		    "\n"
+		    "Reads a number of recovery challenges (or challenge\n"
+		    "bundles) from stdin, separated by lines starting with\n"
+		    "'--', and combines them into one challenge bundle.\n"
+		    "\n"
+		    "This lets a custodian respond to challenges for many\n"
+		    "eboxes at once and send back a single response bundle\n"
+		    "(which the recovering side will accept in place of a\n"
+		    "response).\n");
 	} else {
 noop:
 		fprintf(stderr,
 		    "pivy-box challenge <op>:\n"
 		    "  info                  Show information about a recovery\n"
 		    "                        challenge without responding\n"
-		    "  respond               Respond to a recovery challenge\n");
+		    "  respond               Respond to a recovery challenge\n"
+		    "  bundle                Combine several challenges into\n"
+		    "                        one bundle\n");
 	}
 }
 
@@ -2050,12 +3801,13 @@ usage(const char *type, const char *op)
 int
 main(int argc, char *argv[])
 {
-	const char *optstring = "bl:irRP:i:o:f:";
+	const char *optstring = "bl:irRP:i:o:f:j:c:O:L:FI:s:";
 	const char *type = NULL, *op = NULL, *tplname;
-	int c;
+	int c, tplargs = 0;
 	char tpl[PATH_MAX] = { 0 };
 	errf_t *error = NULL;
 	unsigned long int parsed;
+	unsigned long long int parsedll;
 	char *p;
 
 	qa_term_setup();
@@ -2109,6 +3861,114 @@ main(int argc, char *argv[])
 			}
 			ebox_keylen = parsed;
 			break;
+		case 'j':
+			if (strcmp(type, "stream") != 0) {
+				warnx("option -j only supported with "
+				    "'stream' subcommands");
+				usage(type, op);
+				return (EXIT_USAGE);
+			}
+			errno = 0;
+			parsed = strtoul(optarg, &p, 0);
+			if (errno != 0 || *p != '\0' || parsed < 1 ||
+			    parsed > STREAM_MAX_THREADS) {
+				errx(EXIT_USAGE,
+				    "invalid argument for -j: '%s'", optarg);
+			}
+			ebox_stream_threads = parsed;
+			break;
+		case 'c':
+			if (strcmp(type, "stream") != 0 ||
+			    strcmp(op, "encrypt") != 0) {
+				warnx("option -c only supported with "
+				    "'stream encrypt' subcommand");
+				usage(type, op);
+				return (EXIT_USAGE);
+			}
+			ebox_stream_ciphername = optarg;
+			break;
+		case 'F':
+			if (strcmp(type, "stream") != 0 ||
+			    strcmp(op, "encrypt") != 0) {
+				warnx("option -F only supported with "
+				    "'stream encrypt' subcommand");
+				usage(type, op);
+				return (EXIT_USAGE);
+			}
+			ebox_stream_footer = B_TRUE;
+			break;
+		case 'O':
+		case 'L':
+			if (strcmp(type, "stream") != 0 ||
+			    strcmp(op, "decrypt") != 0) {
+				warnx("option -%c only supported with "
+				    "'stream decrypt' subcommand", c);
+				usage(type, op);
+				return (EXIT_USAGE);
+			}
+			errno = 0;
+			parsedll = strtoull(optarg, &p, 0);
+			if (errno != 0 || *p != '\0') {
+				errx(EXIT_USAGE,
+				    "invalid argument for -%c: '%s'", c, optarg);
+			}
+			if (c == 'O')
+				ebox_stream_range_off = parsedll;
+			else
+				ebox_stream_range_len = parsedll;
+			ebox_stream_range = B_TRUE;
+			break;
+		case 's':
+			if (strcmp(type, "stream") != 0 ||
+			    strcmp(op, "encrypt") != 0) {
+				warnx("option -s only supported with "
+				    "'stream encrypt' subcommand");
+				usage(type, op);
+				return (EXIT_USAGE);
+			}
+			if (strcmp(optarg, "auto") == 0) {
+				ebox_stream_chunk_auto = B_TRUE;
+				break;
+			}
+			errno = 0;
+			parsed = strtoul(optarg, &p, 0);
+			if (errno == 0 && (*p == 'k' || *p == 'K') &&
+			    p[1] == '\0') {
+				parsed *= 1024;
+				++p;
+			} else if (errno == 0 && (*p == 'm' || *p == 'M') &&
+			    p[1] == '\0') {
+				parsed *= 1024 * 1024;
+				++p;
+			}
+			if (errno != 0 || *p != '\0' ||
+			    parsed < EBOX_STREAM_MIN_CHUNK ||
+			    parsed > EBOX_STREAM_MAX_CHUNK) {
+				errx(EXIT_USAGE,
+				    "invalid argument for -s: '%s'", optarg);
+			}
+			ebox_stream_chunksz = parsed;
+			ebox_stream_chunk_auto = B_FALSE;
+			break;
+		case 'o':
+			if (strcmp(type, "key") == 0 &&
+			    strcmp(op, "relock") == 0) {
+				ebox_relock_outdir = optarg;
+				break;
+			}
+			/* FALLTHROUGH */
+		case 'I':
+			if (strcmp(type, "stream") != 0) {
+				warnx("option -%c only supported with "
+				    "'stream' subcommands", c);
+				usage(type, op);
+				return (EXIT_USAGE);
+			}
+			if (c == 'I')
+				ebox_stream_infile = optarg;
+			else
+				ebox_stream_outfile = optarg;
+			break;
 		default:
 			usage(type, op);
 			return (EXIT_USAGE);
@@ -2147,6 +4007,10 @@ main(int argc, char *argv[])
 		} else if (strcmp(op, "respond") == 0) {
 			error = cmd_challenge_respond(argc, argv);
 			goto out;
+
+		} else if (strcmp(op, "bundle") == 0) {
+			error = cmd_challenge_bundle(argc, argv);
+			goto out;
 		}
 		goto badop;
 	}
@@ -2159,6 +4023,7 @@ main(int argc, char *argv[])
 			return (EXIT_USAGE);
 		}
 		tplname = argv[0];
+		tplargs = 1;
 		home = getenv("HOME");
 		if (home == NULL) {
 			errx(EXIT_USAGE, "environment variable HOME not set, "
@@ -2203,7 +4068,7 @@ main(int argc, char *argv[])
 
 		} else if (strcmp(op, "relock") == 0) {
 			ebox_stpl = read_tpl_file(tpl);
-			error = cmd_key_relock(argc, argv);
+			error = cmd_key_relock(argc - tplargs, argv + tplargs);
 			goto out;
 		}
 
@@ -20,6 +20,7 @@
 #include <strings.h>
 #include <limits.h>
 #include <err.h>
+#include <pthread.h>
 
 #if defined(__APPLE__)
 #include <PCSC/wintypes.h>
@@ -88,6 +89,16 @@ unlock_or_recover(struct ebox *ebox, const char *descr, boolean_t *recovered)
 	struct answer *a;
 	char k = '0';
 
+	error = local_unlock_primary(ebox, &config);
+	if (error == ERRF_OK) {
+		error = ebox_unlock(ebox, config);
+		if (error)
+			return (error);
+		*recovered = B_FALSE;
+		goto done;
+	}
+	errf_free(error);
+
 	config = NULL;
 	while ((config = ebox_next_config(ebox, config)) != NULL) {
 		tconfig = ebox_config_tpl(config);
@@ -253,9 +264,9 @@ cmd_rekey(const char *devname)
 	if (error)
 		errfx(EXIT_ERROR, error, "ebox_create failed");
 	sshbuf_reset(buf);
-	error = sshbuf_put_ebox(buf, nebox);
+	error = sshbuf_put_ebox_compact(buf, nebox);
 	if (error)
-		errfx(EXIT_ERROR, error, "sshbuf_put_ebox failed");
+		errfx(EXIT_ERROR, error, "sshbuf_put_ebox_compact failed");
 
 	b64 = sshbuf_dtob64(buf);
 
@@ -406,9 +417,10 @@ newprimary:
 		if (error)
 			errfx(EXIT_ERROR, error, "ebox_create failed");
 		sshbuf_reset(buf);
-		error = sshbuf_put_ebox(buf, nebox);
+		error = sshbuf_put_ebox_compact(buf, nebox);
 		if (error)
-			errfx(EXIT_ERROR, error, "sshbuf_put_ebox failed");
+			errfx(EXIT_ERROR, error,
+			    "sshbuf_put_ebox_compact failed");
 
 		b64 = sshbuf_dtob64(buf);
 
@@ -433,6 +445,374 @@ done:
 	crypt_free(cd);
 }
 
+/*
+ * One device being unlocked by cmd_unlock_many(). Devices whose LUKS token
+ * holds exactly the same ebox as one earlier in the list point at that one
+ * through ld_same, and just share its key.
+ */
+struct luks_dev {
+	char			*ld_dev;
+	char			*ld_mapper;
+	struct crypt_device	*ld_cd;
+	char			*ld_b64;
+	struct ebox		*ld_ebox;
+	struct luks_dev		*ld_same;
+	struct ebox_config	*ld_config;
+	boolean_t		 ld_active;
+	boolean_t		 ld_recovered;
+	int			 ld_rc;
+};
+
+enum {
+	LUKS_MAX_DEVS = 256,
+	LUKS_MAX_THREADS = 16,
+};
+
+struct luks_activate {
+	pthread_mutex_t		 la_mtx;
+	struct luks_dev		*la_devs;
+	size_t			 la_ndevs;
+	size_t			 la_next;
+};
+
+static void
+luks_dev_add(struct luks_dev *devs, size_t *ndevs, const char *dev,
+    const char *mapper)
+{
+	struct luks_dev *ld;
+
+	if (*ndevs >= LUKS_MAX_DEVS)
+		errx(EXIT_USAGE, "too many devices (max %d)", LUKS_MAX_DEVS);
+	ld = &devs[(*ndevs)++];
+	/* crypttab-style UUID=... device specs */
+	if (strncmp(dev, "UUID=", 5) == 0) {
+		if (asprintf(&ld->ld_dev, "/dev/disk/by-uuid/%s",
+		    dev + 5) < 0) {
+			ld->ld_dev = NULL;
+		}
+	} else {
+		ld->ld_dev = strdup(dev);
+	}
+	ld->ld_mapper = strdup(mapper);
+	if (ld->ld_dev == NULL || ld->ld_mapper == NULL)
+		err(EXIT_ERROR, "failed to allocate memory");
+}
+
+/*
+ * Reads a crypttab-style file: one "<mapper name> <device> ..." per line,
+ * ignoring any further fields, blank lines and comments.
+ */
+static void
+read_crypttab(const char *path, struct luks_dev *devs, size_t *ndevs)
+{
+	FILE *f;
+	char *line = NULL, *save, *mapper, *dev;
+	size_t cap = 0;
+
+	if (strcmp(path, "-") == 0)
+		f = stdin;
+	else
+		f = fopen(path, "r");
+	if (f == NULL)
+		err(EXIT_ERROR, "failed to open '%s'", path);
+
+	while (getline(&line, &cap, f) >= 0) {
+		mapper = strtok_r(line, " \t\n", &save);
+		if (mapper == NULL || *mapper == '#')
+			continue;
+		dev = strtok_r(NULL, " \t\n", &save);
+		if (dev == NULL) {
+			errx(EXIT_USAGE, "no device given for '%s' in '%s'",
+			    mapper, path);
+		}
+		luks_dev_add(devs, ndevs, dev, mapper);
+	}
+	if (ferror(f))
+		err(EXIT_ERROR, "error reading '%s'", path);
+	free(line);
+	if (f != stdin)
+		fclose(f);
+}
+
+static void
+luks_dev_load(struct luks_dev *ld)
+{
+	struct sshbuf *buf;
+	const char *json;
+	json_object *jv, *obj;
+	errf_t *error;
+	int rc;
+
+	rc = crypt_init(&ld->ld_cd, ld->ld_dev);
+	if (rc < 0) {
+		errfx(EXIT_ERROR, lukserrf("crypt_init", rc), "failed to "
+		    "open device '%s'", ld->ld_dev);
+	}
+
+	if (crypt_status(ld->ld_cd, ld->ld_mapper) == CRYPT_ACTIVE) {
+		warnx("device '%s' already unlocked and active as '%s'",
+		    ld->ld_dev, ld->ld_mapper);
+		ld->ld_active = B_TRUE;
+		return;
+	}
+
+	rc = crypt_load(ld->ld_cd, CRYPT_LUKS2, NULL);
+	if (rc < 0) {
+		errfx(EXIT_ERROR, lukserrf("crypt_load", rc), "failed to "
+		    "load info from device '%s'", ld->ld_dev);
+	}
+
+	rc = crypt_token_json_get(ld->ld_cd, 1, &json);
+	if (rc < 0) {
+		errfx(EXIT_ERROR, lukserrf("crypt_token_json_get", rc),
+		    "failed to load ebox from device '%s'", ld->ld_dev);
+	}
+
+	obj = json_tokener_parse(json);
+	if (obj == NULL)
+		errx(EXIT_ERROR, "failed to parse json");
+
+	jv = json_object_object_get(obj, "type");
+	if (jv == NULL || strcmp("ebox", json_object_get_string(jv)) != 0) {
+		errx(EXIT_ERROR, "expected ebox token in slot 1 of '%s'",
+		    ld->ld_dev);
+	}
+	jv = json_object_object_get(obj, "ebox");
+	if (jv == NULL) {
+		errx(EXIT_ERROR, "no 'ebox' property in LUKS token json");
+	}
+	ld->ld_b64 = strdup(json_object_get_string(jv));
+	if (ld->ld_b64 == NULL)
+		err(EXIT_ERROR, "failed to allocate memory");
+	json_object_put(obj);
+
+	buf = sshbuf_new();
+	if (buf == NULL)
+		err(EXIT_ERROR, "failed to allocate buffer");
+	if ((rc = sshbuf_b64tod(buf, ld->ld_b64))) {
+		error = ssherrf("sshbuf_b64tod", rc);
+		errfx(EXIT_ERROR, error, "failed to parse LUKS token data "
+		    "from %s as base64", ld->ld_dev);
+	}
+	if ((error = sshbuf_get_ebox(buf, &ld->ld_ebox))) {
+		errfx(EXIT_ERROR, error, "failed to parse LUKS token data "
+		    "from %s as a valid ebox", ld->ld_dev);
+	}
+	sshbuf_free(buf);
+}
+
+/*
+ * Tries to open the first primary config of every distinct ebox in one go,
+ * so that each token is used in one transaction (and asked for its PIN once)
+ * however many devices it's the primary for. Returns B_FALSE if that didn't
+ * work out, and the caller falls back to doing them one by one.
+ */
+static boolean_t
+luks_unlock_primaries(struct luks_dev *devs, size_t ndevs)
+{
+	struct piv_ecdh_box **boxes;
+	struct ebox_config *config;
+	struct ebox_part *part;
+	size_t i, n = 0;
+	errf_t *error;
+
+	boxes = calloc(ndevs, sizeof (struct piv_ecdh_box *));
+	if (boxes == NULL)
+		err(EXIT_ERROR, "failed to allocate memory");
+
+	for (i = 0; i < ndevs; ++i) {
+		if (devs[i].ld_ebox == NULL)
+			continue;
+		config = NULL;
+		while ((config = ebox_next_config(devs[i].ld_ebox,
+		    config)) != NULL) {
+			if (ebox_tpl_config_type(ebox_config_tpl(config)) ==
+			    EBOX_PRIMARY) {
+				break;
+			}
+		}
+		if (config == NULL) {
+			free(boxes);
+			return (B_FALSE);
+		}
+		part = ebox_config_next_part(config, NULL);
+		devs[i].ld_config = config;
+		boxes[n++] = ebox_part_box(part);
+	}
+	if (n == 0) {
+		free(boxes);
+		return (B_TRUE);
+	}
+
+	error = local_unlock_many(boxes, n, NULL);
+	free(boxes);
+	if (error) {
+		warnfx(error, "failed to unlock all devices together, trying "
+		    "each in turn");
+		errf_free(error);
+		return (B_FALSE);
+	}
+
+	for (i = 0; i < ndevs; ++i) {
+		if (devs[i].ld_ebox == NULL)
+			continue;
+		error = ebox_unlock(devs[i].ld_ebox, devs[i].ld_config);
+		if (error) {
+			errfx(EXIT_ERROR, error, "failed to unlock ebox for "
+			    "'%s'", devs[i].ld_dev);
+		}
+	}
+	return (B_TRUE);
+}
+
+static void *
+luks_activate_worker(void *arg)
+{
+	struct luks_activate *la = arg;
+	struct luks_dev *ld, *kd;
+	const uint8_t *key;
+	size_t keylen;
+
+	while (1) {
+		VERIFY0(pthread_mutex_lock(&la->la_mtx));
+		if (la->la_next >= la->la_ndevs) {
+			VERIFY0(pthread_mutex_unlock(&la->la_mtx));
+			break;
+		}
+		ld = &la->la_devs[la->la_next++];
+		VERIFY0(pthread_mutex_unlock(&la->la_mtx));
+
+		if (ld->ld_active)
+			continue;
+		kd = (ld->ld_same != NULL) ? ld->ld_same : ld;
+		key = ebox_key(kd->ld_ebox, &keylen);
+		ld->ld_rc = crypt_activate_by_volume_key(ld->ld_cd,
+		    ld->ld_mapper, (char *)key, keylen, 0);
+	}
+	return (NULL);
+}
+
+static void
+cmd_unlock_many(int argc, char *argv[])
+{
+	struct luks_dev *devs;
+	struct luks_activate la;
+	pthread_t threads[LUKS_MAX_THREADS];
+	size_t ndevs = 0, nthreads, i, j;
+	char *descr;
+	errf_t *error;
+	int rc, ret = 0;
+
+	devs = calloc(LUKS_MAX_DEVS, sizeof (struct luks_dev));
+	if (devs == NULL)
+		err(EXIT_ERROR, "failed to allocate memory");
+
+	if (argc == 1) {
+		read_crypttab(argv[0], devs, &ndevs);
+	} else if (argc % 2 == 0) {
+		for (i = 0; i < (size_t)argc; i += 2)
+			luks_dev_add(devs, &ndevs, argv[i], argv[i + 1]);
+	} else {
+		warnx("devices and mapper names must be given in pairs");
+		usage();
+	}
+	if (ndevs == 0)
+		errx(EXIT_USAGE, "no devices given");
+
+	for (i = 0; i < ndevs; ++i) {
+		luks_dev_load(&devs[i]);
+		if (devs[i].ld_active)
+			continue;
+		for (j = 0; j < i; ++j) {
+			if (devs[j].ld_ebox == NULL)
+				continue;
+			if (strcmp(devs[j].ld_b64, devs[i].ld_b64) == 0) {
+				devs[i].ld_same = &devs[j];
+				ebox_free(devs[i].ld_ebox);
+				devs[i].ld_ebox = NULL;
+				break;
+			}
+		}
+	}
+
+	(void) mlockall(MCL_CURRENT | MCL_FUTURE);
+	fprintf(stderr, "Attempting to unlock %zu devices...\n", ndevs);
+
+	if (!luks_unlock_primaries(devs, ndevs)) {
+		for (i = 0; i < ndevs; ++i) {
+			if (devs[i].ld_ebox == NULL)
+				continue;
+			if (asprintf(&descr, "LUKS device %s",
+			    devs[i].ld_dev) < 0) {
+				err(EXIT_ERROR, "failed to allocate memory");
+			}
+			fprintf(stderr, "Attempting to unlock device "
+			    "'%s'...\n", devs[i].ld_dev);
+			error = unlock_or_recover(devs[i].ld_ebox, descr,
+			    &devs[i].ld_recovered);
+			if (error) {
+				errfx(EXIT_ERROR, error, "failed to unlock "
+				    "ebox for '%s'", devs[i].ld_dev);
+			}
+			free(descr);
+		}
+	}
+
+	/*
+	 * Activation (which mostly waits on the kernel setting up the dm
+	 * table) is independent for each device, and each has its own
+	 * crypt_device context, so we do them in parallel.
+	 */
+	bzero(&la, sizeof (la));
+	VERIFY0(pthread_mutex_init(&la.la_mtx, NULL));
+	la.la_devs = devs;
+	la.la_ndevs = ndevs;
+	nthreads = (ndevs < LUKS_MAX_THREADS) ? ndevs : LUKS_MAX_THREADS;
+	for (i = 0; i < nthreads; ++i) {
+		rc = pthread_create(&threads[i], NULL, luks_activate_worker,
+		    &la);
+		if (rc != 0)
+			break;
+	}
+	nthreads = i;
+	/* If we couldn't start any threads, do it all ourselves. */
+	if (nthreads == 0)
+		(void) luks_activate_worker(&la);
+	for (i = 0; i < nthreads; ++i)
+		VERIFY0(pthread_join(threads[i], NULL));
+	VERIFY0(pthread_mutex_destroy(&la.la_mtx));
+
+	for (i = 0; i < ndevs; ++i) {
+		if (devs[i].ld_rc < 0) {
+			warnfx(lukserrf("crypt_activate_by_volume_key",
+			    devs[i].ld_rc), "failed to activate device '%s'",
+			    devs[i].ld_dev);
+			ret = EXIT_ERROR;
+		} else if (!devs[i].ld_active) {
+			fprintf(stderr, "Activated '%s' as '%s'\n",
+			    devs[i].ld_dev, devs[i].ld_mapper);
+		}
+		if (devs[i].ld_recovered) {
+			fprintf(stderr, "Device '%s' was unlocked using a "
+			    "recovery config: use `pivy-luks unlock' on it to "
+			    "add a new primary token\n", devs[i].ld_dev);
+		}
+	}
+
+	for (i = 0; i < ndevs; ++i) {
+		ebox_free(devs[i].ld_ebox);
+		if (devs[i].ld_cd != NULL)
+			crypt_free(devs[i].ld_cd);
+		free(devs[i].ld_b64);
+		free(devs[i].ld_dev);
+		free(devs[i].ld_mapper);
+	}
+	free(devs);
+
+	if (ret != 0)
+		exit(ret);
+}
+
 static void
 cmd_format(const char *devname)
 {
@@ -473,9 +853,9 @@ cmd_format(const char *devname)
 	buf = sshbuf_new();
 	if (buf == NULL)
 		errx(EXIT_ERROR, "failed to allocate memory");
-	error = sshbuf_put_ebox(buf, ebox);
+	error = sshbuf_put_ebox_compact(buf, ebox);
 	if (error)
-		errfx(EXIT_ERROR, error, "sshbuf_put_ebox failed");
+		errfx(EXIT_ERROR, error, "sshbuf_put_ebox_compact failed");
 
 	b64 = sshbuf_dtob64(buf);
 
@@ -514,6 +894,8 @@ usage(void)
 	    "\n"
 	    "Available operations:\n"
 	    "  unlock <device> <mapper name>         Unlock/activate a LUKS device\n"
+	    "  unlock-many <crypttab>|<device> <mapper name>...\n"
+	    "                                        Unlock several LUKS devices at once\n"
 	    "  rekey <device>                        Update LUKS metadata to new template\n"
 	    "  format <device>                       Set up a new LUKS device\n");
 	fprintf(stderr, "\nTemplates are stored in " TPL_DEFAULT_PATH
@@ -589,6 +971,8 @@ main(int argc, char *argv[])
 			usage();
 		}
 		cmd_unlock(device, mapperdev);
+	} else if (strcmp(op, "unlock-many") == 0) {
+		cmd_unlock_many(argc - optind + 1, &argv[optind - 1]);
 	} else if (strcmp(op, "rekey") == 0) {
 		if (optind < argc) {
 			warnx("too many arguments");
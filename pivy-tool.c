@@ -20,6 +20,7 @@
 #include <strings.h>
 #include <limits.h>
 #include <err.h>
+#include <pthread.h>
 
 #if defined(__APPLE__)
 #include <PCSC/wintypes.h>
@@ -31,15 +32,19 @@
 
 #include <sys/types.h>
 #include <sys/errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #if defined(__sun)
 #include <sys/fork.h>
 #endif
 #include <sys/wait.h>
+#include <poll.h>
 
 #include "libssh/sshkey.h"
 #include "libssh/sshbuf.h"
 #include "libssh/digest.h"
 #include "libssh/ssherr.h"
+#include "libssh/authfd.h"
 
 #include <openssl/err.h>
 #include <openssl/x509.h>
@@ -91,6 +96,17 @@ static struct piv_token *selk = NULL;
 //static struct piv_token *sysk = NULL;
 static struct piv_slot *override = NULL;
 
+/*
+ * State for setup-batch. setup_reader is the reader the current token is in
+ * (so that we can re-open it after cmd_init() without probing every other
+ * reader, which may be busy), and the new PIN and PUK are asked for once and
+ * used for every token.
+ */
+static const char *setup_reader = NULL;
+static const char *setup_new_pin = NULL;
+static const char *setup_new_puk = NULL;
+static uint8_t *setup_admin_key = NULL;
+
 SCARDCONTEXT ctx;
 
 #ifndef LINT
@@ -387,167 +403,509 @@ alg_to_string(uint alg)
 	}
 }
 
-static errf_t *
-cmd_list(void)
+/*
+ * The fields which "pivy-tool -j list" can be asked for. Anything but
+ * LIST_F_SLOTS comes from the probe piv_enumerate() does anyway; if slots
+ * aren't wanted we don't read any certs at all.
+ */
+enum list_field {
+	LIST_F_READER	= (1 << 0),
+	LIST_F_GUID	= (1 << 1),
+	LIST_F_CHUID	= (1 << 2),
+	LIST_F_YUBICO	= (1 << 3),
+	LIST_F_ALGS	= (1 << 4),
+	LIST_F_AUTH	= (1 << 5),
+	LIST_F_SLOTS	= (1 << 6),
+	LIST_F_ALL	= 0x7F
+};
+
+static const struct {
+	const char *lf_name;
+	uint lf_field;
+} list_field_names[] = {
+	{ "reader",	LIST_F_READER },
+	{ "guid",	LIST_F_GUID },
+	{ "chuid",	LIST_F_CHUID },
+	{ "yubico",	LIST_F_YUBICO },
+	{ "algs",	LIST_F_ALGS },
+	{ "auth",	LIST_F_AUTH },
+	{ "slots",	LIST_F_SLOTS },
+	{ "all",	LIST_F_ALL },
+};
+
+static boolean_t json = B_FALSE;
+static boolean_t list_cached = B_FALSE;
+static uint list_fields = LIST_F_ALL;
+
+/*
+ * Each token's certs are read on a thread of its own (piv_enumerate() gives
+ * every token its own PCSC context when there's more than one reader), and
+ * each token is printed as soon as it's done: in completion order for -j,
+ * otherwise in the usual order.
+ */
+struct list_job {
+	struct piv_token *lj_tk;
+	pthread_t lj_thread;
+	boolean_t lj_started;
+	boolean_t lj_done;		/* protected by list_mtx */
+	boolean_t lj_printed;
+	boolean_t lj_fromcache;
+	errf_t *lj_err;
+};
+
+static pthread_mutex_t list_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t list_cv = PTHREAD_COND_INITIALIZER;
+
+#define	LIST_CACHE_MAX_LEN	(256 * 1024)
+
+/*
+ * With -C, tries to fill in the token's slots from the state cache pivy-agent
+ * keeps (see agent_cache_save() there), if it has one for this card under its
+ * full GUID and the change token still matches.
+ */
+static boolean_t
+list_cache_restore(struct piv_token *pk)
 {
-	struct piv_token *pk;
-	struct piv_slot *slot = NULL;
-	uint i;
-	char *buf = NULL;
-	const uint8_t *temp;
-	size_t len;
-	enum piv_pin defauth;
+	const char *home, *hex;
+	char *path = NULL;
+	struct sshbuf *b;
+	u_char *p;
+	FILE *f;
+	size_t n;
 	errf_t *err;
 
-	for (pk = ks; pk != NULL; pk = piv_token_next(pk)) {
-		const uint8_t *tguid = piv_token_guid(pk);
-		if (guid != NULL &&
-		    bcmp(tguid, guid, guid_len) != 0) {
-			continue;
-		}
+	if ((home = getenv("HOME")) == NULL ||
+	    (hex = piv_token_guid_hex(pk)) == NULL)
+		return (B_FALSE);
+	if (asprintf(&path, "%s/.cache/pivy-agent/%s.state", home, hex) < 0)
+		return (B_FALSE);
+	f = fopen(path, "r");
+	free(path);
+	if (f == NULL)
+		return (B_FALSE);
 
-		if ((err = piv_txn_begin(pk)))
-			return (err);
-		assert_select(pk);
-		if ((err = piv_read_all_certs(pk))) {
-			piv_txn_end(pk);
-			return (err);
-		}
+	b = sshbuf_new();
+	VERIFY(b != NULL);
+	VERIFY0(sshbuf_reserve(b, LIST_CACHE_MAX_LEN, &p));
+	n = fread(p, 1, LIST_CACHE_MAX_LEN, f);
+	if (n == 0 || !feof(f)) {
+		fclose(f);
+		sshbuf_free(b);
+		return (B_FALSE);
+	}
+	fclose(f);
+	VERIFY0(sshbuf_consume_end(b, LIST_CACHE_MAX_LEN - n));
+
+	err = piv_token_state_load(pk, b);
+	sshbuf_free(b);
+	if (err) {
+		bunyan_log(BNY_DEBUG, "not using cached token state",
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+		return (B_FALSE);
+	}
+	return (B_TRUE);
+}
+
+static void *
+list_read_token(void *arg)
+{
+	struct list_job *lj = arg;
+	struct piv_token *pk = lj->lj_tk;
+	errf_t *err;
+
+	if (list_cached && list_cache_restore(pk)) {
+		lj->lj_fromcache = B_TRUE;
+		err = ERRF_OK;
+	} else if ((err = piv_txn_begin(pk)) == ERRF_OK) {
+		if ((err = piv_select(pk)) == ERRF_OK)
+			err = piv_read_all_certs(pk);
 		piv_txn_end(pk);
+	}
 
-		if (parseable) {
-			uint8_t nover[] = { 0, 0, 0 };
-			const uint8_t *ver = nover;
-			if (piv_token_is_ykpiv(pk))
-				ver = ykpiv_token_version(pk);
-			printf("%s:%s:%s:%s:%d.%d.%d:",
-			    piv_token_rdrname(pk),
-			    piv_token_guid_hex(pk),
-			    piv_token_has_chuid(pk) ? "true" : "false",
-			    piv_token_is_ykpiv(pk) ? "true" : "false",
-			    ver[0], ver[1], ver[2]);
-			for (i = 0; i < piv_token_nalgs(pk); ++i) {
-				enum piv_alg alg = piv_token_alg(pk, i);
-				printf("%s%s", alg_to_string(alg),
-				    (i + 1 < piv_token_nalgs(pk)) ? "," : "");
-			}
-			for (i = 0x9A; i < 0x9F; ++i) {
-				slot = piv_get_slot(pk, i);
-				if (slot == NULL) {
-					printf(":%02X", i);
-				} else {
-					struct sshkey *key =
-					    piv_slot_pubkey(slot);
-					printf(":%02X;%s;%s;%u",
-					    i, piv_slot_subject(slot),
-					    sshkey_type(key),
-					    sshkey_size(key));
-				}
-			}
-			printf("\n");
-			continue;
-		}
+	VERIFY0(pthread_mutex_lock(&list_mtx));
+	lj->lj_err = err;
+	lj->lj_done = B_TRUE;
+	VERIFY0(pthread_cond_broadcast(&list_cv));
+	VERIFY0(pthread_mutex_unlock(&list_mtx));
+	return (NULL);
+}
 
-		if (piv_token_has_chuid(pk)) {
-			buf = piv_token_shortid(pk);
-		} else {
-			buf = strdup("00000000");
-		}
-		printf("%10s: %s\n", "card", buf);
-		free(buf);
-		printf("%10s: %s\n", "device", piv_token_rdrname(pk));
+static void
+json_string(FILE *f, const char *str)
+{
+	const u_char *p;
+
+	if (str == NULL) {
+		fprintf(f, "null");
+		return;
+	}
+	fputc('"', f);
+	for (p = (const u_char *)str; *p != '\0'; ++p) {
+		if (*p == '"' || *p == '\\')
+			fprintf(f, "\\%c", *p);
+		else if (*p < 0x20)
+			fprintf(f, "\\u%04x", *p);
+		else
+			fputc(*p, f);
+	}
+	fputc('"', f);
+}
+
+static void
+json_hex(FILE *f, const uint8_t *buf, size_t len)
+{
+	char *hex;
+
+	if (buf == NULL || len == 0) {
+		fprintf(f, "null");
+		return;
+	}
+	hex = buf_to_hex(buf, len, B_FALSE);
+	json_string(f, hex);
+	free(hex);
+}
+
+static void
+list_print_json(const struct list_job *lj)
+{
+	struct piv_token *pk = lj->lj_tk;
+	struct piv_slot *slot = NULL;
+	const uint8_t *temp;
+	const char *sep = "";
+	size_t len;
+	uint i;
+
+	printf("{");
+	if (list_fields & LIST_F_READER) {
+		printf("\"reader\":");
+		json_string(stdout, piv_token_rdrname(pk));
+		sep = ",";
+	}
+	if (list_fields & LIST_F_GUID) {
+		printf("%s\"guid\":", sep);
+		json_string(stdout, piv_token_guid_hex(pk));
+		sep = ",";
+	}
+	if (list_fields & LIST_F_CHUID) {
+		printf("%s\"chuid\":", sep);
 		if (!piv_token_has_chuid(pk)) {
-			printf("%10s: %s\n", "chuid", "not set "
-			    "(needs initialization)");
-		} else if (piv_token_has_signed_chuid(pk)) {
-			printf("%10s: %s\n", "chuid", "ok, signed");
+			printf("null");
 		} else {
-			printf("%10s: %s\n", "chuid", "ok");
+			printf("{\"signed\":%s,\"owner\":",
+			    piv_token_has_signed_chuid(pk) ? "true" : "false");
+			json_hex(stdout, piv_token_chuuid(pk), GUID_LEN);
+			printf(",\"fascn\":");
+			temp = piv_token_fascn(pk, &len);
+			json_hex(stdout, temp, len);
+			printf(",\"expiry\":");
+			temp = piv_token_expiry(pk, &len);
+			if (len == 8 && temp[0] >= '0' && temp[0] <= '9') {
+				printf("\"%c%c%c%c-%c%c-%c%c\"",
+				    temp[0], temp[1], temp[2], temp[3],
+				    temp[4], temp[5], temp[6], temp[7]);
+			} else {
+				printf("null");
+			}
+			printf("}");
 		}
-		printf("%10s: %s\n", "guid", piv_token_guid_hex(pk));
-		temp = piv_token_chuuid(pk);
-		if (temp != NULL) {
-			buf = buf_to_hex(temp, 16, B_FALSE);
-			printf("%10s: %s\n", "owner", buf);
-			free(buf);
+		sep = ",";
+	}
+	if (list_fields & LIST_F_YUBICO) {
+		printf("%s\"yubico\":", sep);
+		if (!piv_token_is_ykpiv(pk)) {
+			printf("null");
+		} else {
+			temp = ykpiv_token_version(pk);
+			printf("{\"version\":\"%d.%d.%d\",\"serial\":",
+			    temp[0], temp[1], temp[2]);
+			if (ykpiv_token_has_serial(pk))
+				printf("%u}", ykpiv_token_serial(pk));
+			else
+				printf("null}");
 		}
-		temp = piv_token_fascn(pk, &len);
-		if (temp != NULL && len > 0) {
-			buf = buf_to_hex(temp, len, B_FALSE);
-			printf("%10s: %s\n", "fasc-n", buf);
-			free(buf);
+		sep = ",";
+	}
+	if (list_fields & LIST_F_ALGS) {
+		printf("%s\"algs\":[", sep);
+		for (i = 0; i < piv_token_nalgs(pk); ++i) {
+			printf("%s", (i > 0) ? "," : "");
+			json_string(stdout,
+			    alg_to_string(piv_token_alg(pk, i)));
 		}
-		temp = piv_token_expiry(pk, &len);
-		if (len == 8 && temp[0] >= '0' && temp[0] <= '9') {
-			printf("%10s: %c%c%c%c-%c%c-%c%c\n", "expiry",
-			    temp[0], temp[1], temp[2], temp[3],
-			    temp[4], temp[5], temp[6], temp[7]);
+		printf("]");
+		sep = ",";
+	}
+	if (list_fields & LIST_F_AUTH) {
+		enum piv_pin auths[] = { PIV_PIN, PIV_GLOBAL_PIN, PIV_OCC };
+		boolean_t first = B_TRUE;
+
+		printf("%s\"auth\":{\"default\":", sep);
+		json_string(stdout,
+		    pin_type_to_name(piv_token_default_auth(pk)));
+		printf(",\"available\":[");
+		for (i = 0; i < sizeof (auths) / sizeof (auths[0]); ++i) {
+			if (!piv_token_has_auth(pk, auths[i]))
+				continue;
+			printf("%s", first ? "" : ",");
+			json_string(stdout, pin_type_to_name(auths[i]));
+			first = B_FALSE;
 		}
-		if (piv_token_is_ykpiv(pk)) {
-			temp = ykpiv_token_version(pk);
-			printf("%10s: implements YubicoPIV extensions "
-			    "(v%d.%d.%d)\n", "yubico", temp[0], temp[1],
-			    temp[2]);
-			if (ykpiv_token_has_serial(pk)) {
-				printf("%10s: %u\n", "serial",
-				    ykpiv_token_serial(pk));
-			}
+		printf("],\"vci\":%s}",
+		    piv_token_has_vci(pk) ? "true" : "false");
+		sep = ",";
+	}
+	if ((list_fields & LIST_F_SLOTS) && lj->lj_err != ERRF_OK) {
+		printf("%s\"error\":{\"name\":", sep);
+		json_string(stdout, errf_name(lj->lj_err));
+		printf(",\"message\":");
+		json_string(stdout, errf_message(lj->lj_err));
+		printf("}");
+	} else if (list_fields & LIST_F_SLOTS) {
+		printf("%s\"cached\":%s,\"slots\":[", sep,
+		    lj->lj_fromcache ? "true" : "false");
+		sep = "";
+		while ((slot = piv_slot_next(pk, slot)) != NULL) {
+			struct sshkey *pubkey = piv_slot_pubkey(slot);
+			printf("%s{\"id\":\"%02X\",\"type\":", sep,
+			    piv_slot_id(slot));
+			json_string(stdout, sshkey_type(pubkey));
+			printf(",\"bits\":%u,\"alg\":",
+			    sshkey_size(pubkey));
+			json_string(stdout,
+			    alg_to_string(piv_slot_alg(slot)));
+			printf(",\"subject\":");
+			json_string(stdout, piv_slot_subject(slot));
+			printf("}");
+			sep = ",";
 		}
-		printf("%10s:", "auth");
-		defauth = piv_token_default_auth(pk);
-		if (piv_token_has_auth(pk, PIV_PIN)) {
-			if (defauth == PIV_PIN)
-				printf(" PIN*");
-			else
-				printf(" PIN");
+		printf("]");
+	}
+	printf("}\n");
+	fflush(stdout);
+}
+
+static void
+list_print_parseable(struct piv_token *pk)
+{
+	struct piv_slot *slot;
+	uint i;
+	uint8_t nover[] = { 0, 0, 0 };
+	const uint8_t *ver = nover;
+	if (piv_token_is_ykpiv(pk))
+		ver = ykpiv_token_version(pk);
+	printf("%s:%s:%s:%s:%d.%d.%d:",
+	    piv_token_rdrname(pk),
+	    piv_token_guid_hex(pk),
+	    piv_token_has_chuid(pk) ? "true" : "false",
+	    piv_token_is_ykpiv(pk) ? "true" : "false",
+	    ver[0], ver[1], ver[2]);
+	for (i = 0; i < piv_token_nalgs(pk); ++i) {
+		enum piv_alg alg = piv_token_alg(pk, i);
+		printf("%s%s", alg_to_string(alg),
+		    (i + 1 < piv_token_nalgs(pk)) ? "," : "");
+	}
+	for (i = 0x9A; i < 0x9F; ++i) {
+		slot = piv_get_slot(pk, i);
+		if (slot == NULL) {
+			printf(":%02X", i);
+		} else {
+			struct sshkey *key =
+			    piv_slot_pubkey(slot);
+			printf(":%02X;%s;%s;%u",
+			    i, piv_slot_subject(slot),
+			    sshkey_type(key),
+			    sshkey_size(key));
 		}
-		if (piv_token_has_auth(pk, PIV_GLOBAL_PIN)) {
-			if (defauth == PIV_GLOBAL_PIN)
-				printf(" GlobalPIN*");
-			else
-				printf(" GlobalPIN");
+	}
+	printf("\n");
+}
+
+static void
+list_print_text(struct piv_token *pk)
+{
+	struct piv_slot *slot = NULL;
+	uint i;
+	char *buf = NULL;
+	const uint8_t *temp;
+	size_t len;
+	enum piv_pin defauth;
+
+	if (piv_token_has_chuid(pk)) {
+		buf = piv_token_shortid(pk);
+	} else {
+		buf = strdup("00000000");
+	}
+	printf("%10s: %s\n", "card", buf);
+	free(buf);
+	printf("%10s: %s\n", "device", piv_token_rdrname(pk));
+	if (!piv_token_has_chuid(pk)) {
+		printf("%10s: %s\n", "chuid", "not set "
+		    "(needs initialization)");
+	} else if (piv_token_has_signed_chuid(pk)) {
+		printf("%10s: %s\n", "chuid", "ok, signed");
+	} else {
+		printf("%10s: %s\n", "chuid", "ok");
+	}
+	printf("%10s: %s\n", "guid", piv_token_guid_hex(pk));
+	temp = piv_token_chuuid(pk);
+	if (temp != NULL) {
+		buf = buf_to_hex(temp, 16, B_FALSE);
+		printf("%10s: %s\n", "owner", buf);
+		free(buf);
+	}
+	temp = piv_token_fascn(pk, &len);
+	if (temp != NULL && len > 0) {
+		buf = buf_to_hex(temp, len, B_FALSE);
+		printf("%10s: %s\n", "fasc-n", buf);
+		free(buf);
+	}
+	temp = piv_token_expiry(pk, &len);
+	if (len == 8 && temp[0] >= '0' && temp[0] <= '9') {
+		printf("%10s: %c%c%c%c-%c%c-%c%c\n", "expiry",
+		    temp[0], temp[1], temp[2], temp[3],
+		    temp[4], temp[5], temp[6], temp[7]);
+	}
+	if (piv_token_is_ykpiv(pk)) {
+		temp = ykpiv_token_version(pk);
+		printf("%10s: implements YubicoPIV extensions "
+		    "(v%d.%d.%d)\n", "yubico", temp[0], temp[1],
+		    temp[2]);
+		if (ykpiv_token_has_serial(pk)) {
+			printf("%10s: %u\n", "serial",
+			    ykpiv_token_serial(pk));
 		}
-		if (piv_token_has_auth(pk, PIV_OCC)) {
-			if (defauth == PIV_OCC)
-				printf(" Biometrics*");
-			else
-				printf(" Biometrics");
+	}
+	printf("%10s:", "auth");
+	defauth = piv_token_default_auth(pk);
+	if (piv_token_has_auth(pk, PIV_PIN)) {
+		if (defauth == PIV_PIN)
+			printf(" PIN*");
+		else
+			printf(" PIN");
+	}
+	if (piv_token_has_auth(pk, PIV_GLOBAL_PIN)) {
+		if (defauth == PIV_GLOBAL_PIN)
+			printf(" GlobalPIN*");
+		else
+			printf(" GlobalPIN");
+	}
+	if (piv_token_has_auth(pk, PIV_OCC)) {
+		if (defauth == PIV_OCC)
+			printf(" Biometrics*");
+		else
+			printf(" Biometrics");
+	}
+	printf("\n");
+	if (piv_token_has_vci(pk)) {
+		printf("%10s: supports VCI (secure contactless)\n",
+		    "vci");
+	}
+	if (piv_token_nalgs(pk) > 0) {
+		printf("%10s: ", "algos");
+		for (i = 0; i < piv_token_nalgs(pk); ++i) {
+			printf("%s ", alg_to_string(
+			    piv_token_alg(pk, i)));
 		}
 		printf("\n");
-		if (piv_token_has_vci(pk)) {
-			printf("%10s: supports VCI (secure contactless)\n",
-			    "vci");
-		}
-		if (piv_token_nalgs(pk) > 0) {
-			printf("%10s: ", "algos");
-			for (i = 0; i < piv_token_nalgs(pk); ++i) {
-				printf("%s ", alg_to_string(
-				    piv_token_alg(pk, i)));
-			}
-			printf("\n");
+	}
+	if (!piv_token_has_chuid(pk)) {
+		printf("%10s:\n", "action");
+		printf("%10s Initialize this card using 'pivy-tool "
+		    "init'\n", "");
+		printf("%10s No keys can be stored on an uninitialized"
+		    " card\n", "");
+		printf("\n");
+		return;
+	}
+	printf("%10s:\n", "slots");
+	printf("%10s %-3s  %-6s  %-4s  %-30s\n", "", "ID", "TYPE",
+	    "BITS", "CERTIFICATE");
+	while ((slot = piv_slot_next(pk, slot)) != NULL) {
+		struct sshkey *pubkey = piv_slot_pubkey(slot);
+		printf("%10s %-3x  %-6s  %-4u  %-30s\n", "",
+		    piv_slot_id(slot), sshkey_type(pubkey),
+		    sshkey_size(pubkey), piv_slot_subject(slot));
+	}
+	printf("\n");
+}
+
+static errf_t *
+cmd_list(void)
+{
+	struct piv_token *pk;
+	struct list_job *jobs, *lj;
+	uint i, n = 0, next = 0;
+	boolean_t more;
+	errf_t *err = ERRF_OK;
+
+	for (pk = ks; pk != NULL; pk = piv_token_next(pk))
+		++n;
+	jobs = calloc(n + 1, sizeof (struct list_job));
+	VERIFY(jobs != NULL);
+
+	for (pk = ks, i = 0; pk != NULL; pk = piv_token_next(pk)) {
+		const uint8_t *tguid = piv_token_guid(pk);
+		if (guid != NULL &&
+		    bcmp(tguid, guid, guid_len) != 0) {
+			continue;
 		}
-		if (!piv_token_has_chuid(pk)) {
-			printf("%10s:\n", "action");
-			printf("%10s Initialize this card using 'pivy-tool "
-			    "init'\n", "");
-			printf("%10s No keys can be stored on an uninitialized"
-			    " card\n", "");
-			printf("\n");
+		lj = &jobs[i++];
+		lj->lj_tk = pk;
+		if (!(list_fields & LIST_F_SLOTS)) {
+			lj->lj_done = B_TRUE;
 			continue;
 		}
-		printf("%10s:\n", "slots");
-		printf("%10s %-3s  %-6s  %-4s  %-30s\n", "", "ID", "TYPE",
-		    "BITS", "CERTIFICATE");
-		while ((slot = piv_slot_next(pk, slot)) != NULL) {
-			struct sshkey *pubkey = piv_slot_pubkey(slot);
-			printf("%10s %-3x  %-6s  %-4u  %-30s\n", "",
-			    piv_slot_id(slot), sshkey_type(pubkey),
-			    sshkey_size(pubkey), piv_slot_subject(slot));
+		VERIFY0(pthread_create(&lj->lj_thread, NULL, list_read_token,
+		    lj));
+		lj->lj_started = B_TRUE;
+	}
+	n = i;
+
+	VERIFY0(pthread_mutex_lock(&list_mtx));
+	while (next < n) {
+		more = B_FALSE;
+		for (i = next; i < n; ++i) {
+			lj = &jobs[i];
+			if (lj->lj_printed || !lj->lj_done)
+				continue;
+			if (!json && i != next)
+				break;
+			VERIFY0(pthread_mutex_unlock(&list_mtx));
+			if (json) {
+				list_print_json(lj);
+			} else if (lj->lj_err != ERRF_OK) {
+				err = lj->lj_err;
+				lj->lj_err = ERRF_OK;
+			} else if (parseable) {
+				list_print_parseable(lj->lj_tk);
+			} else {
+				list_print_text(lj->lj_tk);
+			}
+			VERIFY0(pthread_mutex_lock(&list_mtx));
+			lj->lj_printed = B_TRUE;
+			more = B_TRUE;
+			if (err != ERRF_OK)
+				break;
 		}
-		printf("\n");
+		if (err != ERRF_OK)
+			break;
+		while (next < n && jobs[next].lj_printed)
+			++next;
+		if (!more && next < n)
+			VERIFY0(pthread_cond_wait(&list_cv, &list_mtx));
 	}
+	VERIFY0(pthread_mutex_unlock(&list_mtx));
 
-	return (ERRF_OK);
+	for (i = 0; i < n; ++i) {
+		lj = &jobs[i];
+		if (lj->lj_started)
+			VERIFY0(pthread_join(lj->lj_thread, NULL));
+		errf_free(lj->lj_err);
+	}
+	free(jobs);
+
+	return (err);
 }
 
 static errf_t *
@@ -850,33 +1208,21 @@ cmd_set_system(void)
 }
 #endif
 
+/*
+ * Prompts for a new PIN (or PUK) twice, until we get one that's the right
+ * length and matches. "who" says which token(s) it's for.
+ */
 static errf_t *
-cmd_change_pin(enum piv_pin pintype)
+read_new_pin(enum piv_pin pintype, const char *who, const char *charType,
+    char **newpinp)
 {
 	errf_t *err;
 	char prompt[64];
-	char *p, *newpin, *guidhex;
-	const char *charType = "digits";
-	if (piv_token_is_ykpiv(selk))
-		charType = "characters";
-
-	guidhex = piv_token_shortid(selk);
+	char *p, *newpin;
 
-	if (pin == NULL) {
-		snprintf(prompt, 64, "Enter current %s (%s): ",
-		    pin_type_to_name(pintype), guidhex);
-		do {
-			p = getpass(prompt);
-		} while (p == NULL && errno == EINTR);
-		if (p == NULL) {
-			err = errfno("getpass", errno, "");
-			return (err);
-		}
-		pin = strdup(p);
-	}
 again:
 	snprintf(prompt, 64, "Enter new %s (%s): ",
-	    pin_type_to_name(pintype), guidhex);
+	    pin_type_to_name(pintype), who);
 	do {
 		p = getpass(prompt);
 	} while (p == NULL && errno == EINTR);
@@ -890,18 +1236,59 @@ again:
 	}
 	newpin = strdup(p);
 	snprintf(prompt, 64, "Confirm new %s (%s): ",
-	    pin_type_to_name(pintype), guidhex);
+	    pin_type_to_name(pintype), who);
 	do {
 		p = getpass(prompt);
 	} while (p == NULL && errno == EINTR);
 	if (p == NULL) {
 		err = errfno("getpass", errno, "");
+		free(newpin);
 		return (err);
 	}
 	if (strcmp(p, newpin) != 0) {
 		warnx("PINs do not match");
+		free(newpin);
 		goto again;
 	}
+	*newpinp = newpin;
+	return (ERRF_OK);
+}
+
+static errf_t *
+cmd_change_pin(enum piv_pin pintype)
+{
+	errf_t *err;
+	char prompt[64];
+	char *p, *newpin, *guidhex;
+	const char *charType = "digits";
+	const char *batch;
+	if (piv_token_is_ykpiv(selk))
+		charType = "characters";
+
+	guidhex = piv_token_shortid(selk);
+
+	if (pin == NULL) {
+		snprintf(prompt, 64, "Enter current %s (%s): ",
+		    pin_type_to_name(pintype), guidhex);
+		do {
+			p = getpass(prompt);
+		} while (p == NULL && errno == EINTR);
+		if (p == NULL) {
+			err = errfno("getpass", errno, "");
+			return (err);
+		}
+		pin = strdup(p);
+	}
+	/* setup-batch asks for these once up front, for every token. */
+	batch = (pintype == PIV_PUK) ? setup_new_puk : setup_new_pin;
+	if (batch != NULL) {
+		newpin = strdup(batch);
+		VERIFY(newpin != NULL);
+	} else if ((err = read_new_pin(pintype, guidhex, charType,
+	    &newpin))) {
+		free(guidhex);
+		return (err);
+	}
 	free(guidhex);
 
 	if ((err = piv_txn_begin(selk)))
@@ -1538,6 +1925,43 @@ cmd_pubkey(uint slotid)
 	return (ERRF_OK);
 }
 
+/*
+ * If there's a pivy-agent running with the card, it already has the cert
+ * loaded and can just hand it over, without us having to open a transaction
+ * on the card (and fight the agent for it). Returns B_FALSE if we have to go
+ * to the card after all.
+ */
+static boolean_t
+cmd_cert_agent(uint slotid)
+{
+	struct ssh_x509certs *certs;
+	u_char slot = slotid;
+	size_t len;
+	int rc, fd;
+	boolean_t ok = B_FALSE;
+
+	assert_slotid(slotid);
+
+	if (ssh_get_authentication_socket(&fd) != 0)
+		return (B_FALSE);
+	len = guid_len;
+	if (guid_len > 0 && buf_is_zero(guid, guid_len))
+		len = 0;
+	rc = ssh_agent_find_x509certs(fd, guid, len, &slot, 1, &certs);
+	close(fd);
+	if (rc != 0)
+		return (B_FALSE);
+
+	/* An empty slot gets a better error message from the card path. */
+	if (certs->ncerts == 1) {
+		VERIFY(fwrite(certs->certs[0].cert, certs->certs[0].certlen,
+		    1, stdout) == 1);
+		ok = B_TRUE;
+	}
+	ssh_free_x509certs(certs);
+	return (ok);
+}
+
 static errf_t *
 cmd_cert(uint slotid)
 {
@@ -1564,13 +1988,67 @@ cmd_cert(uint slotid)
 	return (ERRF_OK);
 }
 
+#define	HASH_STDIN_BLOCK	(1024 * 1024)
+
+/*
+ * Hashes everything left on stdin. A regular file is mapped and hashed in
+ * place, anything else is read a big block at a time, so memory use stays the
+ * same however much input there is.
+ */
 static errf_t *
-cmd_sign(uint slotid)
+hash_stdin(enum sshdigest_types hashalg, uint8_t *dg, size_t dglen)
+{
+	struct ssh_digest_ctx *hctx;
+	struct stat st;
+	uint8_t *buf = NULL, *map;
+	off_t off;
+	ssize_t n;
+	int fd = STDIN_FILENO;
+	errf_t *err = ERRF_OK;
+
+	hctx = ssh_digest_start(hashalg);
+	VERIFY(hctx != NULL);
+
+	off = lseek(fd, 0, SEEK_CUR);
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && off >= 0 &&
+	    off < st.st_size) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			(void) madvise(map, st.st_size, MADV_SEQUENTIAL);
+			VERIFY0(ssh_digest_update(hctx, map + off,
+			    st.st_size - off));
+			VERIFY0(munmap(map, st.st_size));
+			goto done;
+		}
+	}
+
+	buf = malloc(HASH_STDIN_BLOCK);
+	VERIFY(buf != NULL);
+	while ((n = read(fd, buf, HASH_STDIN_BLOCK)) != 0) {
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			err = errfno("read", errno, "reading data to sign");
+			goto out;
+		}
+		VERIFY0(ssh_digest_update(hctx, buf, n));
+	}
+
+done:
+	VERIFY0(ssh_digest_final(hctx, dg, dglen));
+out:
+	ssh_digest_free(hctx);
+	free(buf);
+	return (err);
+}
+
+static errf_t *
+cmd_sign(uint slotid)
 {
 	struct piv_slot *cert;
 	uint8_t *buf, *sig;
 	enum sshdigest_types hashalg;
-	size_t inplen, siglen;
+	size_t inplen, siglen, dglen;
 	errf_t *err = ERRF_OK;
 
 	assert_slotid(slotid);
@@ -1593,22 +2071,51 @@ cmd_sign(uint slotid)
 		return (err);
 	}
 
-	buf = read_stdin(16384, &inplen);
-	assert(buf != NULL);
+	/*
+	 * Normally we hash the input as it streams in, so it can be any size.
+	 * Cards that can only hash on-card need all of it in memory.
+	 */
+	err = piv_sign_digest_alg(selk, cert, &hashalg);
+	if (errf_caused_by(err, "NotSupportedError")) {
+		errf_free(err);
+		err = ERRF_OK;
+		buf = read_stdin(16384, &inplen);
+		assert(buf != NULL);
+		dglen = 0;
+	} else if (err) {
+		return (funcerrf(err, "failed to sign data"));
+	} else {
+		dglen = ssh_digest_bytes(hashalg);
+		buf = calloc(1, dglen);
+		VERIFY(buf != NULL);
+		if ((err = hash_stdin(hashalg, buf, dglen))) {
+			free(buf);
+			return (funcerrf(err, "failed to sign data"));
+		}
+	}
 
-	if ((err = piv_txn_begin(selk)))
+	if ((err = piv_txn_begin(selk))) {
+		free(buf);
 		return (err);
+	}
 	assert_select(selk);
 	assert_pin(selk, B_FALSE);
 again:
-	hashalg = 0;
-	err = piv_sign(selk, cert, buf, inplen, &hashalg, &sig, &siglen);
+	if (dglen > 0) {
+		err = piv_sign_digest(selk, cert, hashalg, buf, dglen, &sig,
+		    &siglen);
+	} else {
+		hashalg = 0;
+		err = piv_sign(selk, cert, buf, inplen, &hashalg, &sig,
+		    &siglen);
+	}
 	if (errf_caused_by(err, "PermissionError")) {
 		assert_pin(selk, B_TRUE);
 		goto again;
 	}
 	piv_txn_end(selk);
 	if (err) {
+		free(buf);
 		err = funcerrf(err, "failed to sign data");
 		return (err);
 	}
@@ -1810,6 +2317,841 @@ cmd_sgdebug(void)
 	return (ERRF_OK);
 }
 
+/*
+ * One latency histogram as sent by pivy-agent's agent-stats@joyent.com
+ * extension: bucket n counts samples of less than 2^n usec.
+ */
+struct agent_hist {
+	uint64_t ah_count;
+	uint64_t ah_sum_us;
+	uint ah_nbuckets;
+	uint64_t ah_buckets[64];
+};
+
+static errf_t *
+sshbuf_get_agent_hist(struct sshbuf *buf, uint nbuckets,
+    struct agent_hist *ah)
+{
+	int rc;
+	uint i;
+
+	bzero(ah, sizeof (*ah));
+	if ((rc = sshbuf_get_u64(buf, &ah->ah_count)) ||
+	    (rc = sshbuf_get_u64(buf, &ah->ah_sum_us)))
+		return (ssherrf("sshbuf_get_u64", rc));
+	for (i = 0; i < nbuckets; ++i) {
+		if ((rc = sshbuf_get_u64(buf, &ah->ah_buckets[i])))
+			return (ssherrf("sshbuf_get_u64", rc));
+	}
+	ah->ah_nbuckets = nbuckets;
+	return (ERRF_OK);
+}
+
+/* Upper bound (in usec) of the bucket holding the given percentile. */
+static uint64_t
+agent_hist_pct(const struct agent_hist *ah, uint pct)
+{
+	uint64_t want, sum = 0;
+	uint i;
+
+	if (ah->ah_count == 0)
+		return (0);
+	want = (ah->ah_count * pct + 99) / 100;
+	for (i = 0; i < ah->ah_nbuckets; ++i) {
+		sum += ah->ah_buckets[i];
+		if (sum >= want)
+			break;
+	}
+	if (i >= ah->ah_nbuckets)
+		i = ah->ah_nbuckets - 1;
+	return (1ULL << i);
+}
+
+static void
+print_agent_hist(const char *name, const struct agent_hist *ah)
+{
+	uint64_t avg = 0;
+
+	if (ah->ah_count > 0)
+		avg = ah->ah_sum_us / ah->ah_count;
+	if (parseable) {
+		printf(":%llu:%llu:%llu:%llu",
+		    (unsigned long long)ah->ah_count,
+		    (unsigned long long)avg,
+		    (unsigned long long)agent_hist_pct(ah, 50),
+		    (unsigned long long)agent_hist_pct(ah, 99));
+		return;
+	}
+	printf("  %-12s avg %llu us, p50 < %llu us, p99 < %llu us\n", name,
+	    (unsigned long long)avg,
+	    (unsigned long long)agent_hist_pct(ah, 50),
+	    (unsigned long long)agent_hist_pct(ah, 99));
+}
+
+static errf_t *
+cmd_agent_stats(void)
+{
+	int rc, authfd;
+	errf_t *err = ERRF_OK;
+	struct sshbuf *req = NULL, *reply = NULL, *inner = NULL;
+	u_char code;
+	uint32_t ver, nbuckets, n, i;
+	uint64_t uptime, count, fails, apdus, apdu_bytes;
+	uint64_t opens, closes, finds, findfails, pinok, pinfail;
+	uint64_t reuses = 0, hold = 0;
+	struct agent_hist ah;
+	char *name = NULL;
+
+	if ((rc = ssh_get_authentication_socket(&authfd)) != 0)
+		return (ssherrf("ssh_get_authentication_socket", rc));
+
+	req = sshbuf_new();
+	reply = sshbuf_new();
+	inner = sshbuf_new();
+	VERIFY(req != NULL && reply != NULL && inner != NULL);
+
+	if ((rc = sshbuf_put_u8(req, SSH2_AGENTC_EXTENSION)) ||
+	    (rc = sshbuf_put_cstring(req, "agent-stats@joyent.com")) ||
+	    (rc = sshbuf_put_stringb(req, inner))) {
+		err = ssherrf("sshbuf_put_*", rc);
+		goto out;
+	}
+	if ((rc = ssh_request_reply(authfd, req, reply))) {
+		err = ssherrf("ssh_request_reply", rc);
+		goto out;
+	}
+	if ((rc = sshbuf_get_u8(reply, &code))) {
+		err = ssherrf("sshbuf_get_u8", rc);
+		goto out;
+	}
+	if (code != SSH_AGENT_SUCCESS) {
+		err = errf("SSHAgentError", NULL, "SSH agent returned "
+		    "message code %d to agent-stats request (is it "
+		    "pivy-agent?)", (int)code);
+		goto out;
+	}
+	if ((rc = sshbuf_get_u32(reply, &ver)) ||
+	    (rc = sshbuf_get_u64(reply, &uptime)) ||
+	    (rc = sshbuf_get_u32(reply, &nbuckets))) {
+		err = ssherrf("sshbuf_get_*", rc);
+		goto out;
+	}
+	if (ver < 1 || ver > 2 || nbuckets == 0 || nbuckets > 64) {
+		err = errf("SSHAgentError", NULL, "Unsupported agent-stats "
+		    "reply (version %u, %u buckets)", ver, nbuckets);
+		goto out;
+	}
+
+	if (!parseable) {
+		printf("uptime: %llu s\n", (unsigned long long)uptime / 1000);
+		printf("messages:\n");
+	}
+	if ((rc = sshbuf_get_u32(reply, &n))) {
+		err = ssherrf("sshbuf_get_u32", rc);
+		goto out;
+	}
+	for (i = 0; i < n; ++i) {
+		if ((rc = sshbuf_get_cstring(reply, &name, NULL)) ||
+		    (rc = sshbuf_get_u64(reply, &count)) ||
+		    (rc = sshbuf_get_u64(reply, &fails)) ||
+		    (rc = sshbuf_get_u64(reply, &apdus)) ||
+		    (rc = sshbuf_get_u64(reply, &apdu_bytes))) {
+			err = ssherrf("sshbuf_get_*", rc);
+			goto out;
+		}
+		if ((err = sshbuf_get_agent_hist(reply, nbuckets, &ah)))
+			goto out;
+		if (parseable) {
+			printf("msg:%s:%llu:%llu:%llu:%llu", name,
+			    (unsigned long long)count,
+			    (unsigned long long)fails,
+			    (unsigned long long)apdus,
+			    (unsigned long long)apdu_bytes);
+			print_agent_hist(name, &ah);
+			printf("\n");
+		} else {
+			printf("  %-24s %llu (%llu failed), %llu APDUs, "
+			    "%llu bytes\n", name,
+			    (unsigned long long)count,
+			    (unsigned long long)fails,
+			    (unsigned long long)apdus,
+			    (unsigned long long)apdu_bytes);
+			print_agent_hist("latency:", &ah);
+		}
+		free(name);
+		name = NULL;
+	}
+
+	if (!parseable)
+		printf("tokens:\n");
+	if ((rc = sshbuf_get_u32(reply, &n))) {
+		err = ssherrf("sshbuf_get_u32", rc);
+		goto out;
+	}
+	for (i = 0; i < n; ++i) {
+		if ((rc = sshbuf_get_cstring(reply, &name, NULL)) ||
+		    (rc = sshbuf_get_u64(reply, &opens)) ||
+		    (rc = sshbuf_get_u64(reply, &closes))) {
+			err = ssherrf("sshbuf_get_*", rc);
+			goto out;
+		}
+		if ((err = sshbuf_get_agent_hist(reply, nbuckets, &ah)))
+			goto out;
+		if ((rc = sshbuf_get_u64(reply, &finds)) ||
+		    (rc = sshbuf_get_u64(reply, &findfails)) ||
+		    (rc = sshbuf_get_u64(reply, &pinok)) ||
+		    (rc = sshbuf_get_u64(reply, &pinfail))) {
+			err = ssherrf("sshbuf_get_*", rc);
+			goto out;
+		}
+		if (ver >= 2 &&
+		    ((rc = sshbuf_get_u64(reply, &reuses)) ||
+		    (rc = sshbuf_get_u64(reply, &hold)))) {
+			err = ssherrf("sshbuf_get_u64", rc);
+			goto out;
+		}
+		if (parseable) {
+			printf("token:%s:%llu:%llu:%llu:%lld:"
+			    "%llu:%llu:%llu:%llu", name,
+			    (unsigned long long)opens,
+			    (unsigned long long)closes,
+			    (unsigned long long)reuses,
+			    (hold == UINT64_MAX) ? -1LL : (long long)hold,
+			    (unsigned long long)finds,
+			    (unsigned long long)findfails,
+			    (unsigned long long)pinok,
+			    (unsigned long long)pinfail);
+			print_agent_hist(name, &ah);
+			printf("\n");
+		} else {
+			printf("  %s\n", name);
+			printf("    txns:        %llu opened, %llu closed, "
+			    "%llu reused\n",
+			    (unsigned long long)opens,
+			    (unsigned long long)closes,
+			    (unsigned long long)reuses);
+			if (hold == UINT64_MAX)
+				printf("    txn hold:    exclusive\n");
+			else
+				printf("    txn hold:    %llu ms\n",
+				    (unsigned long long)hold);
+			printf("    finds:       %llu (%llu failed)\n",
+			    (unsigned long long)finds,
+			    (unsigned long long)findfails);
+			printf("    PIN:         %llu ok, %llu wrong\n",
+			    (unsigned long long)pinok,
+			    (unsigned long long)pinfail);
+			print_agent_hist("  txn hold hist:", &ah);
+		}
+		free(name);
+		name = NULL;
+	}
+
+out:
+	free(name);
+	sshbuf_free(req);
+	sshbuf_free(reply);
+	sshbuf_free(inner);
+	close(authfd);
+	return (err);
+}
+
+static errf_t *
+cmd_apdu_trace(void)
+{
+	int rc, authfd;
+	errf_t *err = ERRF_OK;
+	struct sshbuf *req = NULL, *reply = NULL, *inner = NULL;
+	u_char code, cls, ins, p1, p2, ext;
+	uint32_t ver, n, i, lc, le, sw, lr, pcscrv;
+	uint64_t now, start, end;
+	const u_char *guid;
+	size_t guidlen;
+	char *guidhex;
+
+	if ((rc = ssh_get_authentication_socket(&authfd)) != 0)
+		return (ssherrf("ssh_get_authentication_socket", rc));
+
+	req = sshbuf_new();
+	reply = sshbuf_new();
+	inner = sshbuf_new();
+	VERIFY(req != NULL && reply != NULL && inner != NULL);
+
+	if ((rc = sshbuf_put_u8(req, SSH2_AGENTC_EXTENSION)) ||
+	    (rc = sshbuf_put_cstring(req, "apdu-trace@joyent.com")) ||
+	    (rc = sshbuf_put_stringb(req, inner))) {
+		err = ssherrf("sshbuf_put_*", rc);
+		goto out;
+	}
+	if ((rc = ssh_request_reply(authfd, req, reply))) {
+		err = ssherrf("ssh_request_reply", rc);
+		goto out;
+	}
+	if ((rc = sshbuf_get_u8(reply, &code))) {
+		err = ssherrf("sshbuf_get_u8", rc);
+		goto out;
+	}
+	if (code != SSH_AGENT_SUCCESS) {
+		err = errf("SSHAgentError", NULL, "SSH agent returned "
+		    "message code %d to apdu-trace request (is it "
+		    "pivy-agent?)", (int)code);
+		goto out;
+	}
+	if ((rc = sshbuf_get_u32(reply, &ver)) ||
+	    (rc = sshbuf_get_u64(reply, &now)) ||
+	    (rc = sshbuf_get_u32(reply, &n))) {
+		err = ssherrf("sshbuf_get_*", rc);
+		goto out;
+	}
+	if (ver != 1) {
+		err = errf("SSHAgentError", NULL, "Unsupported apdu-trace "
+		    "reply (version %u)", ver);
+		goto out;
+	}
+
+	if (!parseable) {
+		printf("%-8s %10s %8s  %-2s %-2s %-2s %-2s %5s %5s %-4s %5s\n",
+		    "TOKEN", "AGO(ms)", "TIME(us)", "CL", "IN", "P1", "P2",
+		    "LC", "LE", "SW", "LR");
+	}
+	for (i = 0; i < n; ++i) {
+		if ((rc = sshbuf_get_string_direct(reply, &guid,
+		    &guidlen)) ||
+		    (rc = sshbuf_get_u8(reply, &cls)) ||
+		    (rc = sshbuf_get_u8(reply, &ins)) ||
+		    (rc = sshbuf_get_u8(reply, &p1)) ||
+		    (rc = sshbuf_get_u8(reply, &p2)) ||
+		    (rc = sshbuf_get_u8(reply, &ext)) ||
+		    (rc = sshbuf_get_u32(reply, &lc)) ||
+		    (rc = sshbuf_get_u32(reply, &le)) ||
+		    (rc = sshbuf_get_u32(reply, &sw)) ||
+		    (rc = sshbuf_get_u32(reply, &lr)) ||
+		    (rc = sshbuf_get_u32(reply, &pcscrv)) ||
+		    (rc = sshbuf_get_u64(reply, &start)) ||
+		    (rc = sshbuf_get_u64(reply, &end))) {
+			err = ssherrf("sshbuf_get_*", rc);
+			goto out;
+		}
+		guidhex = buf_to_hex(guid, guidlen, B_FALSE);
+		if (parseable) {
+			printf("%s:%llu:%llu:%02x:%02x:%02x:%02x:%u:%u:%u:"
+			    "%04x:%u:%x\n", guidhex,
+			    (unsigned long long)start,
+			    (unsigned long long)(end - start),
+			    cls, ins, p1, p2, ext, lc, le, sw, lr, pcscrv);
+		} else {
+			printf("%-8s %10llu %8llu  %02X %02X %02X %02X "
+			    "%5u %5u %04X %5u%s", guidhex,
+			    (unsigned long long)(now - start) / 1000,
+			    (unsigned long long)(end - start),
+			    cls, ins, p1, p2, lc, le, sw, lr,
+			    ext ? " ext" : "");
+			if (pcscrv != 0)
+				printf(" (pcsc error 0x%x)", pcscrv);
+			printf("\n");
+		}
+		free(guidhex);
+	}
+
+out:
+	sshbuf_free(req);
+	sshbuf_free(reply);
+	sshbuf_free(inner);
+	close(authfd);
+	return (err);
+}
+
+/*
+ * agent-bench: a load generator for pivy-agent. Each of agent_bench_conns
+ * threads opens its own connection to $SSH_AUTH_SOCK and sends a weighted
+ * random mix of requests (built once up front, so the client adds as little
+ * as possible) until the run time is up.
+ *
+ * With a target rate, requests are sent on a fixed schedule and latency is
+ * measured from when each one was due to go out rather than when it was
+ * actually sent, so a stalled agent shows up as queueing delay instead of
+ * just fewer samples. With no rate, each connection sends its next request
+ * as soon as it has the last reply.
+ */
+enum agent_bench_op {
+	ABOP_IDS = 0,
+	ABOP_SIGN,
+	ABOP_ECDH,
+	ABOP_REBOX,
+	ABOP__MAX
+};
+
+static const char *agent_bench_op_names[ABOP__MAX] = {
+	"ids", "sign", "ecdh", "rebox"
+};
+
+static uint agent_bench_conns = 4;
+static uint agent_bench_rate = 0;		/* reqs/sec in total, 0 = max */
+static uint agent_bench_secs = 10;
+static uint agent_bench_mix[ABOP__MAX] = { 1, 4, 0, 0 };
+
+struct agent_bench_samples {
+	uint64_t	*abs_ns;
+	size_t		 abs_n;
+	size_t		 abs_alloc;
+	uint64_t	 abs_errors;
+};
+
+struct agent_bench_thread {
+	pthread_t			 abt_thread;
+	uint				 abt_idx;
+	errf_t				*abt_err;
+	struct agent_bench_samples	 abt_samples[ABOP__MAX];
+};
+
+static struct sshbuf *agent_bench_reqs[ABOP__MAX];
+static u_char agent_bench_codes[ABOP__MAX] = {
+	SSH2_AGENT_IDENTITIES_ANSWER,
+	SSH2_AGENT_SIGN_RESPONSE,
+	SSH_AGENT_SUCCESS,
+	SSH_AGENT_SUCCESS
+};
+static uint agent_bench_total;
+static uint64_t agent_bench_start;
+static uint64_t agent_bench_end;
+
+static void
+parse_agent_bench_mix(const char *arg)
+{
+	char *buf, *p, *tok, *val, *end;
+	unsigned long parsed;
+	uint i, total = 0;
+
+	buf = strdup(arg);
+	VERIFY(buf != NULL);
+	bzero(agent_bench_mix, sizeof (agent_bench_mix));
+	for (p = buf; (tok = strsep(&p, ",")) != NULL; ) {
+		if ((val = strchr(tok, '=')) == NULL) {
+			errx(EXIT_BAD_ARGS, "invalid -m entry '%s' (expected "
+			    "op=weight)", tok);
+		}
+		*val++ = '\0';
+		for (i = 0; i < ABOP__MAX; ++i) {
+			if (strcmp(tok, agent_bench_op_names[i]) == 0)
+				break;
+		}
+		if (i == ABOP__MAX) {
+			errx(EXIT_BAD_ARGS, "unknown request type in -m: '%s' "
+			    "(expected ids, sign, ecdh or rebox)", tok);
+		}
+		errno = 0;
+		parsed = strtoul(val, &end, 0);
+		if (errno != 0 || *end != '\0' || parsed > 1000) {
+			errx(EXIT_BAD_ARGS, "invalid weight for '%s' in -m: "
+			    "'%s'", tok, val);
+		}
+		agent_bench_mix[i] = parsed;
+		total += parsed;
+	}
+	if (total == 0)
+		errx(EXIT_BAD_ARGS, "-m must give at least one non-zero weight");
+	free(buf);
+}
+
+static uint
+parse_agent_bench_uint(char c, const char *arg, uint max)
+{
+	unsigned long parsed;
+	char *end;
+
+	errno = 0;
+	parsed = strtoul(arg, &end, 0);
+	if (errno != 0 || *end != '\0' || parsed > max) {
+		errx(EXIT_BAD_ARGS, "invalid argument for -%c: '%s'", c,
+		    arg);
+	}
+	return (parsed);
+}
+
+static uint64_t
+agent_bench_now(void)
+{
+	struct timespec ts;
+
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+agent_bench_sleep_until(uint64_t when)
+{
+	struct timespec ts;
+	uint64_t now;
+
+	while ((now = agent_bench_now()) < when) {
+		ts.tv_sec = (when - now) / 1000000000ULL;
+		ts.tv_nsec = (when - now) % 1000000000ULL;
+		(void) nanosleep(&ts, NULL);
+	}
+}
+
+static void
+agent_bench_record(struct agent_bench_samples *abs, uint64_t ns)
+{
+	uint64_t *nv;
+	size_t nalloc;
+
+	if (abs->abs_n >= abs->abs_alloc) {
+		nalloc = abs->abs_alloc * 2;
+		if (nalloc == 0)
+			nalloc = 1024;
+		nv = recallocarray(abs->abs_ns, abs->abs_alloc, nalloc,
+		    sizeof (uint64_t));
+		VERIFY(nv != NULL);
+		abs->abs_ns = nv;
+		abs->abs_alloc = nalloc;
+	}
+	abs->abs_ns[abs->abs_n++] = ns;
+}
+
+static void
+agent_bench_merge(struct agent_bench_samples *to,
+    const struct agent_bench_samples *from)
+{
+	size_t i;
+
+	to->abs_errors += from->abs_errors;
+	for (i = 0; i < from->abs_n; ++i)
+		agent_bench_record(to, from->abs_ns[i]);
+}
+
+static enum agent_bench_op
+agent_bench_pick(void)
+{
+	uint r, i;
+
+	r = arc4random_uniform(agent_bench_total);
+	for (i = 0; i < ABOP__MAX; ++i) {
+		if (r < agent_bench_mix[i])
+			break;
+		r -= agent_bench_mix[i];
+	}
+	VERIFY3U(i, <, ABOP__MAX);
+	return (i);
+}
+
+static void *
+agent_bench_worker(void *arg)
+{
+	struct agent_bench_thread *abt = arg;
+	struct sshbuf *reply;
+	enum agent_bench_op op;
+	uint64_t interval = 0, due, now;
+	int rc, fd;
+	u_char code;
+
+	if ((rc = ssh_get_authentication_socket(&fd))) {
+		abt->abt_err = ssherrf("ssh_get_authentication_socket", rc);
+		return (NULL);
+	}
+	reply = sshbuf_new();
+	VERIFY(reply != NULL);
+
+	/* Stagger the connections evenly across each interval. */
+	due = agent_bench_start;
+	if (agent_bench_rate > 0) {
+		interval = (1000000000ULL * agent_bench_conns) /
+		    agent_bench_rate;
+		due += (interval * abt->abt_idx) / agent_bench_conns;
+	}
+
+	for (;;) {
+		if (interval > 0) {
+			if (due >= agent_bench_end)
+				break;
+			agent_bench_sleep_until(due);
+		} else {
+			due = agent_bench_now();
+			if (due >= agent_bench_end)
+				break;
+		}
+
+		op = agent_bench_pick();
+		rc = ssh_request_reply(fd, agent_bench_reqs[op], reply);
+		if (rc != 0) {
+			abt->abt_err = ssherrf("ssh_request_reply", rc);
+			break;
+		}
+		now = agent_bench_now();
+		if (sshbuf_get_u8(reply, &code) != 0 ||
+		    code != agent_bench_codes[op]) {
+			++abt->abt_samples[op].abs_errors;
+		} else {
+			agent_bench_record(&abt->abt_samples[op], now - due);
+		}
+		due += interval;
+	}
+
+	sshbuf_free(reply);
+	close(fd);
+	return (NULL);
+}
+
+static int
+agent_bench_cmp(const void *a, const void *b)
+{
+	uint64_t va = *(const uint64_t *)a, vb = *(const uint64_t *)b;
+
+	if (va < vb)
+		return (-1);
+	if (va > vb)
+		return (1);
+	return (0);
+}
+
+/* Takes the latency (in us) at a percentile given in tenths of a percent. */
+static uint64_t
+agent_bench_pct(const struct agent_bench_samples *abs, uint permille)
+{
+	if (abs->abs_n == 0)
+		return (0);
+	return (abs->abs_ns[((abs->abs_n - 1) * permille) / 1000] / 1000);
+}
+
+static void
+print_agent_bench(const char *name, struct agent_bench_samples *abs,
+    double secs)
+{
+	qsort(abs->abs_ns, abs->abs_n, sizeof (uint64_t), agent_bench_cmp);
+	if (parseable) {
+		printf("%s:%zu:%llu:%.1f:%llu:%llu:%llu:%llu\n", name,
+		    abs->abs_n, (unsigned long long)abs->abs_errors,
+		    abs->abs_n / secs,
+		    (unsigned long long)agent_bench_pct(abs, 500),
+		    (unsigned long long)agent_bench_pct(abs, 990),
+		    (unsigned long long)agent_bench_pct(abs, 999),
+		    (unsigned long long)agent_bench_pct(abs, 1000));
+		return;
+	}
+	printf("%-6s %8zu %7llu %9.1f %9llu %9llu %9llu %9llu\n", name,
+	    abs->abs_n, (unsigned long long)abs->abs_errors,
+	    abs->abs_n / secs,
+	    (unsigned long long)agent_bench_pct(abs, 500),
+	    (unsigned long long)agent_bench_pct(abs, 990),
+	    (unsigned long long)agent_bench_pct(abs, 999),
+	    (unsigned long long)agent_bench_pct(abs, 1000));
+}
+
+/*
+ * Builds the request for each type that's in the mix. Signing uses the first
+ * key the agent lists, and ecdh/rebox the first EC key (with a box sealed to
+ * it offline for rebox).
+ */
+static errf_t *
+agent_bench_setup(int fd, struct sshkey **tofree)
+{
+	struct ssh_identitylist *idl = NULL;
+	struct sshkey *signkey = NULL, *eckey = NULL, *partner = NULL;
+	struct piv_ecdh_box *box = NULL;
+	struct sshbuf *req, *inner = NULL, *boxbuf = NULL;
+	uint8_t data[64];
+	size_t i;
+	int rc;
+	errf_t *err = ERRF_OK;
+
+	rc = ssh_fetch_identitylist(fd, &idl);
+	if (rc != 0 && rc != SSH_ERR_AGENT_NO_IDENTITIES)
+		return (ssherrf("ssh_fetch_identitylist", rc));
+	for (i = 0; idl != NULL && i < idl->nkeys; ++i) {
+		if (signkey == NULL)
+			signkey = idl->keys[i];
+		if (eckey == NULL && idl->keys[i]->type == KEY_ECDSA)
+			eckey = idl->keys[i];
+	}
+	if (signkey == NULL && (agent_bench_mix[ABOP_SIGN] > 0)) {
+		err = errf("NoKeysError", NULL, "agent has no keys to sign "
+		    "with");
+		goto out;
+	}
+	if (eckey == NULL && (agent_bench_mix[ABOP_ECDH] > 0 ||
+	    agent_bench_mix[ABOP_REBOX] > 0)) {
+		err = errf("NoKeysError", NULL, "agent has no EC keys to use "
+		    "for ecdh/rebox");
+		goto out;
+	}
+	if (eckey != NULL) {
+		rc = sshkey_generate(KEY_ECDSA, sshkey_size(eckey), tofree);
+		if (rc != 0) {
+			err = ssherrf("sshkey_generate", rc);
+			goto out;
+		}
+		partner = *tofree;
+	}
+
+	inner = sshbuf_new();
+	boxbuf = sshbuf_new();
+	VERIFY(inner != NULL && boxbuf != NULL);
+	arc4random_buf(data, sizeof (data));
+
+	for (i = 0; i < ABOP__MAX; ++i) {
+		if (agent_bench_mix[i] == 0)
+			continue;
+		req = sshbuf_new();
+		VERIFY(req != NULL);
+		agent_bench_reqs[i] = req;
+		sshbuf_reset(inner);
+
+		switch (i) {
+		case ABOP_IDS:
+			rc = sshbuf_put_u8(req, SSH2_AGENTC_REQUEST_IDENTITIES);
+			break;
+		case ABOP_SIGN:
+			rc = sshbuf_put_u8(req, SSH2_AGENTC_SIGN_REQUEST);
+			if (rc != 0 || (rc = sshkey_puts(signkey, req)) ||
+			    (rc = sshbuf_put_string(req, data, sizeof (data))))
+				break;
+			rc = sshbuf_put_u32(req, (signkey->type == KEY_RSA) ?
+			    SSH_AGENT_RSA_SHA2_256 : 0);
+			break;
+		case ABOP_ECDH:
+			if ((rc = sshkey_puts(eckey, inner)) ||
+			    (rc = sshkey_puts(partner, inner)) ||
+			    (rc = sshbuf_put_u32(inner, 0)) ||
+			    (rc = sshbuf_put_u8(req, SSH2_AGENTC_EXTENSION)) ||
+			    (rc = sshbuf_put_cstring(req, "ecdh@joyent.com")))
+				break;
+			rc = sshbuf_put_stringb(req, inner);
+			break;
+		case ABOP_REBOX:
+			box = piv_box_new();
+			VERIFY(box != NULL);
+			if ((err = piv_box_set_data(box, data, 32)) ||
+			    (err = piv_box_seal_offline(eckey, box)))
+				goto out;
+			sshbuf_reset(boxbuf);
+			if ((err = sshbuf_put_piv_box(boxbuf, box)))
+				goto out;
+			if ((rc = sshbuf_put_stringb(inner, boxbuf)) ||
+			    (rc = sshbuf_put_u32(inner, 0)) ||
+			    (rc = sshbuf_put_u8(inner, 0)) ||
+			    (rc = sshkey_puts(partner, inner)) ||
+			    (rc = sshbuf_put_u32(inner, 0)) ||
+			    (rc = sshbuf_put_u8(req, SSH2_AGENTC_EXTENSION)) ||
+			    (rc = sshbuf_put_cstring(req,
+			    "ecdh-rebox@joyent.com")))
+				break;
+			rc = sshbuf_put_stringb(req, inner);
+			break;
+		}
+		if (rc != 0) {
+			err = ssherrf("sshbuf_put_*", rc);
+			goto out;
+		}
+	}
+
+out:
+	piv_box_free(box);
+	sshbuf_free(inner);
+	sshbuf_free(boxbuf);
+	ssh_free_identitylist(idl);
+	return (err);
+}
+
+static errf_t *
+cmd_agent_bench(void)
+{
+	struct agent_bench_thread *abts = NULL;
+	struct agent_bench_samples all[ABOP__MAX + 1];
+	struct agent_bench_samples *abs;
+	struct sshkey *partner = NULL;
+	uint i, j;
+	int rc, fd;
+	double secs;
+	errf_t *err = ERRF_OK;
+
+	if (agent_bench_conns == 0 || agent_bench_secs == 0) {
+		return (argerrf("-c/-T", "non-zero", "%u/%u",
+		    agent_bench_conns, agent_bench_secs));
+	}
+	agent_bench_total = 0;
+	for (i = 0; i < ABOP__MAX; ++i)
+		agent_bench_total += agent_bench_mix[i];
+
+	if ((rc = ssh_get_authentication_socket(&fd)) != 0)
+		return (ssherrf("ssh_get_authentication_socket", rc));
+	err = agent_bench_setup(fd, &partner);
+	close(fd);
+	if (err)
+		goto out;
+
+	abts = calloc(agent_bench_conns, sizeof (*abts));
+	VERIFY(abts != NULL);
+
+	agent_bench_start = agent_bench_now() + 10000000ULL;
+	agent_bench_end = agent_bench_start +
+	    agent_bench_secs * 1000000000ULL;
+	for (i = 0; i < agent_bench_conns; ++i) {
+		abts[i].abt_idx = i;
+		rc = pthread_create(&abts[i].abt_thread, NULL,
+		    agent_bench_worker, &abts[i]);
+		VERIFY0(rc);
+	}
+	for (i = 0; i < agent_bench_conns; ++i)
+		VERIFY0(pthread_join(abts[i].abt_thread, NULL));
+	secs = (agent_bench_now() - agent_bench_start) / 1e9;
+
+	for (i = 0; i < agent_bench_conns; ++i) {
+		if (abts[i].abt_err != ERRF_OK) {
+			err = errf("AgentBenchError", abts[i].abt_err,
+			    "connection %u failed", i);
+			abts[i].abt_err = ERRF_OK;
+			goto out;
+		}
+	}
+
+	/* Merge each type's samples, and all of them into all[ABOP__MAX]. */
+	bzero(all, sizeof (all));
+	for (i = 0; i < agent_bench_conns; ++i) {
+		for (j = 0; j < ABOP__MAX; ++j) {
+			abs = &abts[i].abt_samples[j];
+			agent_bench_merge(&all[j], abs);
+			agent_bench_merge(&all[ABOP__MAX], abs);
+		}
+	}
+
+	if (!parseable) {
+		printf("%u connections, %u s, ", agent_bench_conns,
+		    agent_bench_secs);
+		if (agent_bench_rate > 0)
+			printf("target %u req/s\n", agent_bench_rate);
+		else
+			printf("no rate limit\n");
+		printf("%-6s %8s %7s %9s %9s %9s %9s %9s\n", "TYPE", "COUNT",
+		    "ERRORS", "REQ/S", "P50(us)", "P99(us)", "P999(us)",
+		    "MAX(us)");
+	}
+	for (j = 0; j < ABOP__MAX; ++j) {
+		if (agent_bench_mix[j] > 0) {
+			print_agent_bench(agent_bench_op_names[j], &all[j],
+			    secs);
+		}
+	}
+	print_agent_bench("all", &all[ABOP__MAX], secs);
+	for (j = 0; j <= ABOP__MAX; ++j)
+		free(all[j].abs_ns);
+
+out:
+	if (abts != NULL) {
+		for (i = 0; i < agent_bench_conns; ++i) {
+			errf_free(abts[i].abt_err);
+			for (j = 0; j < ABOP__MAX; ++j)
+				free(abts[i].abt_samples[j].abs_ns);
+		}
+		free(abts);
+	}
+	for (i = 0; i < ABOP__MAX; ++i) {
+		sshbuf_free(agent_bench_reqs[i]);
+		agent_bench_reqs[i] = NULL;
+	}
+	sshkey_free(partner);
+	return (err);
+}
+
 static errf_t *
 cmd_box_info(void)
 {
@@ -2023,6 +3365,16 @@ check_select_key(void)
 	errf_t *err;
 	size_t len;
 
+	if (setup_reader != NULL) {
+		err = piv_open_reader(ctx, setup_reader, &t);
+		if (err) {
+			errfx(EXIT_NO_CARD, err, "failed to re-open token in "
+			    "reader '%s'", setup_reader);
+		}
+		selk = (ks = t);
+		return;
+	}
+
 	if (guid_len == 0) {
 		err = piv_enumerate(ctx, &t);
 		if (err) {
@@ -2186,8 +3538,10 @@ again9d:
 
 	if ((err = cmd_set_admin(admin_key)))
 		return (err);
+	setup_admin_key = admin_key;
 
-	if (!save_pinfo_admin) {
+	/* setup-batch puts it in the manifest instead. */
+	if (!save_pinfo_admin && setup_reader == NULL) {
 		hex = buf_to_hex(admin_key, 24, B_FALSE);
 		printf("Admin 3DES key: %s\n", hex);
 	}
@@ -2197,6 +3551,308 @@ again9d:
 	return (ERRF_OK);
 }
 
+/*
+ * Writes the setup-batch manifest line for one token: what we did to it (or
+ * why we didn't) and, if it worked, its GUID, serial, public keys and where
+ * the new admin key went.
+ */
+static void
+setup_manifest(FILE *mf, const char *rdr, struct piv_token *pk,
+    const char *status, errf_t *err)
+{
+	struct piv_slot *slot = NULL;
+	const char *sep = "";
+	char *b64;
+
+	fprintf(mf, "{\"reader\":");
+	json_string(mf, rdr);
+	fprintf(mf, ",\"status\":");
+	json_string(mf, status);
+	fprintf(mf, ",\"guid\":");
+	json_string(mf, (pk == NULL) ? NULL : piv_token_guid_hex(pk));
+	if (pk != NULL && piv_token_is_ykpiv(pk) &&
+	    ykpiv_token_has_serial(pk)) {
+		fprintf(mf, ",\"serial\":%u", ykpiv_token_serial(pk));
+	}
+	if (err != ERRF_OK) {
+		fprintf(mf, ",\"error\":{\"name\":");
+		json_string(mf, errf_name(err));
+		fprintf(mf, ",\"message\":");
+		json_string(mf, errf_message(err));
+		fprintf(mf, "}");
+	}
+	if (pk != NULL && strcmp(status, "ok") == 0) {
+		fprintf(mf, ",\"slots\":[");
+		while ((slot = piv_slot_next(pk, slot)) != NULL) {
+			struct sshkey *pubkey = piv_slot_pubkey(slot);
+			fprintf(mf, "%s{\"id\":\"%02X\",\"bits\":%u,"
+			    "\"pubkey\":", sep, piv_slot_id(slot),
+			    sshkey_size(pubkey));
+			b64 = NULL;
+			if (sshkey_to_base64(pubkey, &b64) == 0) {
+				fprintf(mf, "\"%s %s\"", sshkey_ssh_name(pubkey),
+				    b64);
+			} else {
+				fprintf(mf, "null");
+			}
+			free(b64);
+			fprintf(mf, "}");
+			sep = ",";
+		}
+		fprintf(mf, "],\"admin_key\":");
+		if (save_pinfo_admin) {
+			fprintf(mf, "{\"stored\":\"pinfo\"}");
+		} else {
+			fprintf(mf, "{\"stored\":\"none\",\"key\":");
+			json_hex(mf, setup_admin_key, 24);
+			fprintf(mf, "}");
+		}
+	}
+	fprintf(mf, "}\n");
+	fflush(mf);
+}
+
+/*
+ * Runs cmd_setup() on the token in one reader and writes its manifest line.
+ * Everything cmd_setup() uses lives in globals, so these are reset first.
+ */
+static boolean_t
+setup_batch_one(const char *rdr, FILE *mf)
+{
+	struct piv_token *t;
+	errf_t *err;
+
+	ks = selk = NULL;
+	override = NULL;
+	guid = NULL;
+	guid_len = 0;
+	admin_key = DEFAULT_ADMIN_KEY;
+	setup_admin_key = NULL;
+	setup_reader = rdr;
+
+	fprintf(stderr, "Setting up token in '%s'...\n", rdr);
+	if ((err = piv_open_reader(ctx, rdr, &t)) == ERRF_OK) {
+		selk = (ks = t);
+		err = cmd_setup(ctx);
+	}
+	if (err == ERRF_OK && (err = piv_txn_begin(selk)) == ERRF_OK) {
+		if ((err = piv_select(selk)) == ERRF_OK)
+			err = piv_read_all_certs(selk);
+		piv_txn_end(selk);
+	}
+
+	setup_manifest(mf, rdr, selk, (err == ERRF_OK) ? "ok" : "error", err);
+	errf_free(err);
+	if (ks != NULL)
+		piv_release(ks);
+	ks = selk = NULL;
+	setup_reader = NULL;
+	return (err == ERRF_OK);
+}
+
+#if !defined(__APPLE__)
+/*
+ * One of these per token being set up by cmd_setup_batch(), each of which
+ * runs in a child process: cmd_setup() isn't safe to run on several tokens
+ * at once in the same process (it's all globals), and it does too much
+ * waiting on the card for doing them one at a time to be any fun.
+ */
+struct setup_child {
+	const char *sc_rdr;
+	pid_t sc_pid;
+	int sc_fd;
+	struct sshbuf *sc_out;
+};
+
+static int
+setup_batch_child(const char *rdr, int fd)
+{
+	FILE *mf;
+	LONG rv;
+
+	/* Keep stray output off the manifest pipe. */
+	(void) dup2(STDERR_FILENO, STDOUT_FILENO);
+	if ((mf = fdopen(fd, "w")) == NULL)
+		return (EXIT_IO_ERROR);
+
+	/* Never use the parent's PCSC context (or handles) in here. */
+	rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &ctx);
+	if (rv != SCARD_S_SUCCESS) {
+		errf_t *err = pcscerrf("SCardEstablishContext", rv);
+		setup_manifest(mf, rdr, NULL, "error", err);
+		errf_free(err);
+		return (EXIT_IO_ERROR);
+	}
+	if (!setup_batch_one(rdr, mf))
+		return (EXIT_IO_ERROR);
+	fclose(mf);
+	return (EXIT_OK);
+}
+#endif
+
+/*
+ * Sets up every blank (i.e. CHUID-less) YubiKey on the system at once, with
+ * the same steps as "setup", and prints a line of JSON per token as each one
+ * finishes.
+ */
+static errf_t *
+cmd_setup_batch(void)
+{
+	struct piv_token *pk;
+	const char **rdrs;
+	char who[32];
+	char *newpin = NULL, *newpuk = NULL;
+	uint i, n = 0, failed = 0;
+	errf_t *error;
+#if !defined(__APPLE__)
+	struct setup_child *kids;
+	struct pollfd *pfds = NULL;
+	uint alive = 0, j;
+	u_char buf[1024];
+	ssize_t done;
+	int status, fds[2];
+#endif
+
+	if ((error = piv_enumerate(ctx, &ks)))
+		return (error);
+	for (pk = ks; pk != NULL; pk = piv_token_next(pk))
+		++n;
+	rdrs = calloc(n + 1, sizeof (const char *));
+	VERIFY(rdrs != NULL);
+
+	for (pk = ks, n = 0; pk != NULL; pk = piv_token_next(pk)) {
+		if (!piv_token_is_ykpiv(pk)) {
+			setup_manifest(stdout, piv_token_rdrname(pk), pk,
+			    "skipped", NULL);
+			continue;
+		}
+		if (piv_token_has_chuid(pk)) {
+			setup_manifest(stdout, piv_token_rdrname(pk), pk,
+			    "skipped", NULL);
+			continue;
+		}
+		rdrs[n++] = piv_token_rdrname(pk);
+	}
+	if (n == 0) {
+		free(rdrs);
+		return (errf("NotFoundError", NULL, "no blank YubiKeys found "
+		    "(tokens must not have a CHUID yet)"));
+	}
+
+	snprintf(who, sizeof (who), "for all %u tokens", n);
+	if ((error = read_new_pin(PIV_PIN, who, "characters", &newpin)) ||
+	    (error = read_new_pin(PIV_PUK, who, "characters", &newpuk))) {
+		free(newpin);
+		free(rdrs);
+		return (error);
+	}
+	setup_new_pin = newpin;
+	setup_new_puk = newpuk;
+
+#if defined(__APPLE__)
+	/* No fork() with smartcards here: do them one at a time. */
+	for (i = 0; i < n; ++i) {
+		if (!setup_batch_one(rdrs[i], stdout))
+			++failed;
+	}
+#else
+	kids = calloc(n, sizeof (struct setup_child));
+	pfds = calloc(n, sizeof (struct pollfd));
+	VERIFY(kids != NULL && pfds != NULL);
+
+	fflush(stdout);
+	fflush(stderr);
+	for (i = 0; i < n; ++i) {
+		kids[i].sc_rdr = rdrs[i];
+		kids[i].sc_fd = -1;
+		if ((kids[i].sc_out = sshbuf_new()) == NULL)
+			errx(EXIT_IO_ERROR, "failed to allocate memory");
+		if (pipe(fds) != 0)
+			err(EXIT_IO_ERROR, "pipe");
+		kids[i].sc_pid = fork();
+		if (kids[i].sc_pid == -1)
+			err(EXIT_IO_ERROR, "fork");
+		if (kids[i].sc_pid == 0) {
+			for (j = 0; j < i; ++j)
+				close(kids[j].sc_fd);
+			close(fds[0]);
+			_exit(setup_batch_child(rdrs[i], fds[1]));
+		}
+		close(fds[1]);
+		kids[i].sc_fd = fds[0];
+		++alive;
+	}
+
+	while (alive > 0) {
+		for (i = 0, j = 0; i < n; ++i) {
+			if (kids[i].sc_fd == -1)
+				continue;
+			pfds[j].fd = kids[i].sc_fd;
+			pfds[j].events = POLLIN;
+			pfds[j].revents = 0;
+			++j;
+		}
+		if (poll(pfds, j, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_IO_ERROR, "poll");
+		}
+		for (i = 0, j = 0; i < n; ++i) {
+			struct setup_child *sc = &kids[i];
+
+			if (sc->sc_fd == -1)
+				continue;
+			if (pfds[j++].revents == 0)
+				continue;
+			done = read(sc->sc_fd, buf, sizeof (buf));
+			if (done < 0 && errno == EINTR)
+				continue;
+			if (done > 0) {
+				VERIFY0(sshbuf_put(sc->sc_out, buf, done));
+				continue;
+			}
+
+			close(sc->sc_fd);
+			sc->sc_fd = -1;
+			--alive;
+			while (waitpid(sc->sc_pid, &status, 0) < 0 &&
+			    errno == EINTR)
+				;
+			if (!WIFEXITED(status) ||
+			    WEXITSTATUS(status) != EXIT_OK)
+				++failed;
+			if (sshbuf_len(sc->sc_out) > 0) {
+				fwrite(sshbuf_ptr(sc->sc_out), 1,
+				    sshbuf_len(sc->sc_out), stdout);
+				fflush(stdout);
+			} else {
+				errf_t *cerr = errf("ChildError", NULL,
+				    "setup process exited with status 0x%x",
+				    status);
+				setup_manifest(stdout, sc->sc_rdr, NULL,
+				    "error", cerr);
+				errf_free(cerr);
+			}
+			sshbuf_free(sc->sc_out);
+		}
+	}
+	free(pfds);
+	free(kids);
+#endif
+
+	setup_new_pin = NULL;
+	setup_new_puk = NULL;
+	freezero(newpin, strlen(newpin));
+	freezero(newpuk, strlen(newpuk));
+	free(rdrs);
+
+	if (failed > 0) {
+		return (errf("SetupError", NULL, "setup failed on %u of %u "
+		    "tokens", failed, n));
+	}
+	return (ERRF_OK);
+}
+
 #if defined(__sun)
 const char *
 _umem_debug_init()
@@ -2211,7 +3867,9 @@ usage(void)
 	fprintf(stderr,
 	    "usage: pivy-tool [options] <operation>\n"
 	    "Available operations:\n"
-	    "  list                   Lists PIV tokens present\n"
+	    "  list [field ...]       Lists PIV tokens present (fields\n"
+	    "                         for -j: reader, guid, chuid, yubico,\n"
+	    "                         algs, auth, slots; default all)\n"
 	    "  pubkey <slot>          Outputs a public key in SSH format\n"
 	    "  cert <slot>            Outputs DER certificate from slot\n"
 	    "\n"
@@ -2220,6 +3878,10 @@ usage(void)
 	    "  setup                  Quick setup procedure for new YubiKey\n"
 	    "                         (does init + generate + change-pin +\n"
 	    "                         change-puk + set-admin)\n"
+	    "  setup-batch            Does 'setup' on every blank YubiKey\n"
+	    "                         present at once, printing a JSON\n"
+	    "                         line for each with its GUID, serial\n"
+	    "                         and public keys\n"
 	    "  generate <slot>        Generate a new private key and a\n"
 	    "                         self-signed cert\n"
 	    "  import <slot>          Accept a SSH private key on stdin\n"
@@ -2233,7 +3895,8 @@ usage(void)
 	    "                         locked (max retries used)\n"
 	    "  set-admin <hex|@file>  Sets the admin 3DES key\n"
 	    "\n"
-	    "  sign <slot>            Signs data on stdin\n"
+	    "  sign <slot>            Signs data on stdin (of any size:\n"
+	    "                         it's hashed as it is read)\n"
 	    "  ecdh <slot>            Do ECDH with pubkey on stdin\n"
 	    "  auth <slot>            Does a round-trip signature test to\n"
 	    "                         verify that the pubkey on stdin\n"
@@ -2246,6 +3909,13 @@ usage(void)
 	    "                         Chooses token and slot automatically\n"
 	    "  box-info               Prints metadata about a box from stdin\n"
 	    "\n"
+	    "  agent-stats            Prints request and card statistics\n"
+	    "                         from the running pivy-agent\n"
+	    "  apdu-trace             Prints the recent APDU exchanges of\n"
+	    "                         the running pivy-agent, with timing\n"
+	    "  agent-bench            Load-tests the running pivy-agent and\n"
+	    "                         reports throughput and latency\n"
+	    "\n"
 	    "General options:\n"
 	    "  -g <hex>               GUID of the PIV token to use\n"
 	    "                         (Required if >1 token on system)\n"
@@ -2260,9 +3930,26 @@ usage(void)
 	    "  -d                     Output debug info to stderr\n"
 	    "                         (use twice to include APDU trace)\n"
 	    "\n"
-	    "Options for 'list':\n"
+	    "Options for 'list'/'agent-stats'/'apdu-trace'/'agent-bench':\n"
 	    "  -p                     Generate parseable output\n"
 	    "\n"
+	    "Options for 'list':\n"
+	    "  -j                     Output a line of JSON per token, as\n"
+	    "                         soon as each one is ready\n"
+	    "  -C                     Use the slot info cached by pivy-agent\n"
+	    "                         when it still matches the card,\n"
+	    "                         instead of reading every cert\n"
+	    "\n"
+	    "Options for 'agent-bench':\n"
+	    "  -c <n>                 Number of connections (default 4)\n"
+	    "  -r <n>                 Target rate in requests/sec over all\n"
+	    "                         connections (default: as fast as the\n"
+	    "                         agent will go)\n"
+	    "  -T <secs>              How long to run for (default 10)\n"
+	    "  -m <type=weight,...>   Mix of requests to send, from ids,\n"
+	    "                         sign, ecdh and rebox (default\n"
+	    "                         ids=1,sign=4)\n"
+	    "\n"
 	    "Options for 'generate':\n"
 	    "  -a <algo>              Choose algorithm of new key\n"
 	    "                         EC algos: eccp256, eccp384\n"
@@ -2297,7 +3984,7 @@ usage(void)
     "f(force)"
     "K:(admin-key)"
     "k:(key)";*/
-const char *optstring = "dpg:P:a:fK:k:n:t:i:u:R";
+const char *optstring = "dpg:P:a:fK:k:n:t:i:u:Rc:r:T:m:jC";
 
 int
 main(int argc, char *argv[])
@@ -2307,8 +3994,9 @@ main(int argc, char *argv[])
 	extern char *optarg;
 	extern int optind;
 	int c;
-	uint len;
+	uint len, i;
 	char *ptr;
+	const char *virt;
 	uint8_t *buf;
 	uint d_level = 0;
 	enum piv_alg overalg = 0;
@@ -2327,6 +4015,12 @@ main(int argc, char *argv[])
 		case 'R':
 			save_pinfo_admin = B_FALSE;
 			break;
+		case 'j':
+			json = B_TRUE;
+			break;
+		case 'C':
+			list_cached = B_TRUE;
+			break;
 		case 'K':
 			if (strcmp(optarg, "default") == 0) {
 				admin_key = DEFAULT_ADMIN_KEY;
@@ -2405,6 +4099,21 @@ main(int argc, char *argv[])
 		case 'p':
 			parseable = B_TRUE;
 			break;
+		case 'c':
+			agent_bench_conns = parse_agent_bench_uint(c, optarg,
+			    1024);
+			break;
+		case 'r':
+			agent_bench_rate = parse_agent_bench_uint(c, optarg,
+			    1000000);
+			break;
+		case 'T':
+			agent_bench_secs = parse_agent_bench_uint(c, optarg,
+			    86400);
+			break;
+		case 'm':
+			parse_agent_bench_mix(optarg);
+			break;
 		case 'k':
 			opubkey = sshkey_new(KEY_UNSPEC);
 			assert(opubkey != NULL);
@@ -2425,11 +4134,53 @@ main(int argc, char *argv[])
 
 	const char *op = argv[optind++];
 
+	/* These talk to the agent, not the card. */
+	if (strcmp(op, "agent-stats") == 0) {
+		if (optind < argc) {
+			warnx("too many arguments for %s", op);
+			usage();
+		}
+		err = cmd_agent_stats();
+		if (err)
+			errfx(1, err, "error occurred while executing '%s'", op);
+		return (0);
+	}
+	if (strcmp(op, "apdu-trace") == 0) {
+		if (optind < argc) {
+			warnx("too many arguments for %s", op);
+			usage();
+		}
+		err = cmd_apdu_trace();
+		if (err)
+			errfx(1, err, "error occurred while executing '%s'", op);
+		return (0);
+	}
+	if (strcmp(op, "agent-bench") == 0) {
+		if (optind < argc) {
+			warnx("too many arguments for %s", op);
+			usage();
+		}
+		err = cmd_agent_bench();
+		if (err)
+			errfx(1, err, "error occurred while executing '%s'", op);
+		return (0);
+	}
+
+	/* For benchmarks and testing: see piv_virt_init() */
+	if ((virt = getenv("PIVY_VIRTUAL_TOKENS")) != NULL) {
+		err = piv_virt_init(virt);
+		if (err) {
+			errfx(EXIT_BAD_ARGS, err, "invalid value for "
+			    "PIVY_VIRTUAL_TOKENS");
+		}
+	}
+
 	rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &ctx);
-	if (rv != SCARD_S_SUCCESS) {
+	if (rv != SCARD_S_SUCCESS && virt == NULL) {
 		errfx(EXIT_IO_ERROR, pcscerrf("SCardEstablishContext", rv),
 		    "failed to initialise libpcsc");
 	}
+	piv_use_reader_cache(NULL);
 
 #if 0
 	if (piv_system_token_find(ks, &sysk) != 0)
@@ -2437,11 +4188,32 @@ main(int argc, char *argv[])
 #endif
 
 	if (strcmp(op, "list") == 0) {
+		if (optind < argc && !json)
+			usage();
+		if (optind < argc)
+			list_fields = 0;
+		for (; optind < argc; ++optind) {
+			for (i = 0; i < sizeof (list_field_names) /
+			    sizeof (list_field_names[0]); ++i) {
+				if (strcmp(argv[optind],
+				    list_field_names[i].lf_name) == 0)
+					break;
+			}
+			if (i == sizeof (list_field_names) /
+			    sizeof (list_field_names[0])) {
+				warnx("unknown field for list: '%s'",
+				    argv[optind]);
+				usage();
+			}
+			list_fields |= list_field_names[i].lf_field;
+		}
+		/* Only the GUID and CHUID are needed: skip the rest. */
+		if ((list_fields & ~(LIST_F_READER | LIST_F_GUID |
+		    LIST_F_CHUID)) == 0)
+			piv_set_lazy_probe(B_TRUE);
 		err = piv_enumerate(ctx, &ks);
 		if (err)
 			errfx(1, err, "failed to enumerate PIV tokens");
-		if (optind < argc)
-			usage();
 		err = cmd_list();
 
 	} else if (strcmp(op, "init") == 0) {
@@ -2587,6 +4359,13 @@ main(int argc, char *argv[])
 		check_select_key();
 		err = cmd_setup(ctx);
 
+	} else if (strcmp(op, "setup-batch") == 0) {
+		if (optind < argc) {
+			warnx("too many arguments for %s", op);
+			usage();
+		}
+		err = cmd_setup_batch();
+
 	} else if (strcmp(op, "factory-reset") == 0) {
 		if (optind < argc) {
 			warnx("too many arguments for %s", op);
@@ -2610,8 +4389,10 @@ main(int argc, char *argv[])
 			usage();
 		}
 
-		check_select_key();
-		err = cmd_cert(slotid);
+		if (!cmd_cert_agent(slotid)) {
+			check_select_key();
+			err = cmd_cert(slotid);
+		}
 
 	} else if (strcmp(op, "ecdh") == 0) {
 		uint slotid;
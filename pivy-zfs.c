@@ -20,6 +20,7 @@
 #include <strings.h>
 #include <limits.h>
 #include <err.h>
+#include <pthread.h>
 
 #if defined(__APPLE__)
 #include <PCSC/wintypes.h>
@@ -90,6 +91,16 @@ unlock_or_recover(struct ebox *ebox, const char *descr, boolean_t *recovered)
 	struct answer *a;
 	char k = '0';
 
+	error = local_unlock_primary(ebox, &config);
+	if (error == ERRF_OK) {
+		error = ebox_unlock(ebox, config);
+		if (error)
+			return (error);
+		*recovered = B_FALSE;
+		goto done;
+	}
+	errf_free(error);
+
 	config = NULL;
 	while ((config = ebox_next_config(ebox, config)) != NULL) {
 		tconfig = ebox_config_tpl(config);
@@ -299,9 +310,10 @@ newprimary:
 		if (error)
 			errfx(EXIT_ERROR, error, "ebox_create failed");
 		sshbuf_reset(buf);
-		error = sshbuf_put_ebox(buf, nebox);
+		error = sshbuf_put_ebox_compact(buf, nebox);
 		if (error)
-			errfx(EXIT_ERROR, error, "sshbuf_put_ebox failed");
+			errfx(EXIT_ERROR, error,
+			    "sshbuf_put_ebox_compact failed");
 
 		b64 = sshbuf_dtob64(buf);
 
@@ -322,6 +334,262 @@ done:
 	zfs_close(ds);
 }
 
+#if defined(DMU_OT_ENCRYPTED)
+/*
+ * For "unlock -r": every encryption root under (and including) the given
+ * dataset that still needs its key, and the ebox to get it from. Datasets
+ * with an identical rfd77:ebox (e.g. because it was inherited) share one
+ * ebox, which we only unlock once.
+ */
+struct rdataset {
+	char		*rd_name;
+	char		*rd_b64;
+	struct ebox	*rd_ebox;
+	boolean_t	 rd_owner;	/* rd_ebox is ours to free */
+	int		 rd_rc;
+};
+
+struct rdataset_list {
+	struct rdataset	*rl_ds;
+	size_t		 rl_n;
+	size_t		 rl_alloc;
+};
+
+struct rload {
+	pthread_mutex_t	 rl_mtx;
+	struct rdataset	*rl_ds;
+	size_t		 rl_n;
+	size_t		 rl_next;
+};
+
+static int
+rdataset_collect(zfs_handle_t *ds, void *arg)
+{
+	struct rdataset_list *rl = arg;
+	struct rdataset *rd;
+	nvlist_t *props, *prop;
+	char root[ZFS_MAX_DATASET_NAME_LEN];
+	const char *name = zfs_get_name(ds);
+	char *b64;
+	int rc;
+
+	if (zfs_prop_get_int(ds, ZFS_PROP_KEYSTATUS) !=
+	    ZFS_KEYSTATUS_UNAVAILABLE)
+		goto next;
+	if (zfs_prop_get(ds, ZFS_PROP_ENCRYPTION_ROOT, root, sizeof (root),
+	    NULL, NULL, 0, B_TRUE) != 0 || strcmp(root, name) != 0)
+		goto next;
+
+	props = zfs_get_user_props(ds);
+	VERIFY(props != NULL);
+	if (nvlist_lookup_nvlist(props, "rfd77:ebox", &prop)) {
+		warnx("no rfd77:ebox property could be read on dataset %s, "
+		    "skipping it", name);
+		goto next;
+	}
+	VERIFY0(nvlist_lookup_string(prop, "value", &b64));
+
+	if (rl->rl_n >= rl->rl_alloc) {
+		rl->rl_alloc = (rl->rl_alloc == 0) ? 16 : rl->rl_alloc * 2;
+		rl->rl_ds = recallocarray(rl->rl_ds, rl->rl_n, rl->rl_alloc,
+		    sizeof (struct rdataset));
+		if (rl->rl_ds == NULL)
+			err(EXIT_ERROR, "failed to allocate memory");
+	}
+	rd = &rl->rl_ds[rl->rl_n++];
+	rd->rd_name = strdup(name);
+	rd->rd_b64 = strdup(b64);
+	if (rd->rd_name == NULL || rd->rd_b64 == NULL)
+		err(EXIT_ERROR, "failed to allocate memory");
+
+next:
+	rc = zfs_iter_filesystems(ds, rdataset_collect, rl);
+	zfs_close(ds);
+	return (rc);
+}
+
+static int
+rdataset_cmp(const void *a, const void *b)
+{
+	const struct rdataset *rda = a, *rdb = b;
+	int rc;
+
+	rc = strcmp(rda->rd_b64, rdb->rd_b64);
+	if (rc == 0)
+		rc = strcmp(rda->rd_name, rdb->rd_name);
+	return (rc);
+}
+
+static void *
+rload_worker(void *arg)
+{
+	struct rload *rl = arg;
+	struct rdataset *rd;
+	const uint8_t *key;
+	size_t keylen;
+
+	for (;;) {
+		VERIFY0(pthread_mutex_lock(&rl->rl_mtx));
+		rd = (rl->rl_next < rl->rl_n) ? &rl->rl_ds[rl->rl_next++] :
+		    NULL;
+		VERIFY0(pthread_mutex_unlock(&rl->rl_mtx));
+		if (rd == NULL)
+			break;
+		key = ebox_key(rd->rd_ebox, &keylen);
+		rd->rd_rc = lzc_load_key(rd->rd_name, B_FALSE, (uint8_t *)key,
+		    keylen);
+	}
+	return (NULL);
+}
+#endif
+
+enum {
+	RLOAD_MAX_THREADS = 16
+};
+
+static void
+cmd_unlock_recursive(const char *fsname)
+{
+#if !defined(DMU_OT_ENCRYPTED)
+	errx(EXIT_ERROR, "this ZFS implementation does not support encryption");
+#else
+	zfs_handle_t *ds;
+	struct rdataset_list list;
+	struct rdataset *rd, *first = NULL;
+	struct rload load;
+	struct sshbuf *buf;
+	pthread_t thr[RLOAD_MAX_THREADS];
+	char *description;
+	size_t i, j, desclen, nthr;
+	boolean_t recovered, failed = B_FALSE;
+	errf_t *error;
+	int rc;
+
+	ds = zfs_open(zfshdl, fsname, ZFS_TYPE_FILESYSTEM | ZFS_TYPE_VOLUME);
+	if (ds == NULL)
+		err(EXIT_ERROR, "failed to open dataset %s", fsname);
+
+	bzero(&list, sizeof (list));
+	if (rdataset_collect(ds, &list) != 0)
+		errx(EXIT_ERROR, "failed to walk datasets under %s", fsname);
+	if (list.rl_n == 0) {
+		errx(EXIT_ALREADY_UNLOCKED, "no keys left to load under %s",
+		    fsname);
+	}
+
+	qsort(list.rl_ds, list.rl_n, sizeof (struct rdataset), rdataset_cmp);
+
+	buf = sshbuf_new();
+	if (buf == NULL)
+		err(EXIT_ERROR, "failed to allocate buffer");
+
+	(void) mlockall(MCL_CURRENT | MCL_FUTURE);
+
+	/*
+	 * Unlock each distinct ebox once. Any PIN entered is kept in ebox_pin
+	 * and re-used for the rest, so if they're all on the same token it's
+	 * only asked for once.
+	 */
+	for (i = 0; i < list.rl_n; ++i) {
+		rd = &list.rl_ds[i];
+		if (first != NULL && strcmp(first->rd_b64, rd->rd_b64) == 0) {
+			rd->rd_ebox = first->rd_ebox;
+			continue;
+		}
+		first = rd;
+
+		sshbuf_reset(buf);
+		if ((rc = sshbuf_b64tod(buf, rd->rd_b64))) {
+			error = ssherrf("sshbuf_b64tod", rc);
+			errfx(EXIT_ERROR, error, "failed to parse rfd77:ebox "
+			    "property on %s as base64", rd->rd_name);
+		}
+		if ((error = sshbuf_get_ebox(buf, &rd->rd_ebox))) {
+			errfx(EXIT_ERROR, error, "failed to parse rfd77:ebox "
+			    "property on %s as a valid ebox", rd->rd_name);
+		}
+		rd->rd_owner = B_TRUE;
+
+		for (j = i + 1; j < list.rl_n; ++j) {
+			if (strcmp(list.rl_ds[j].rd_b64, rd->rd_b64) != 0)
+				break;
+		}
+		desclen = strlen(rd->rd_name) + 128;
+		description = calloc(1, desclen);
+		if (description == NULL)
+			err(EXIT_ERROR, "failed to allocate memory");
+		if (j - i > 1) {
+			snprintf(description, desclen, "ZFS filesystem %s "
+			    "(and %zu others)", rd->rd_name, j - i - 1);
+		} else {
+			snprintf(description, desclen, "ZFS filesystem %s",
+			    rd->rd_name);
+		}
+
+		fprintf(stderr, "Attempting to unlock %s...\n", description);
+		error = unlock_or_recover(rd->rd_ebox, description,
+		    &recovered);
+		if (error)
+			errfx(EXIT_ERROR, error, "failed to unlock ebox");
+		if (recovered) {
+			warnx("%s was recovered: use 'pivy-zfs unlock' or "
+			    "'pivy-zfs rekey' on it afterwards to add a new "
+			    "primary token", description);
+		}
+		free(description);
+	}
+
+	/* Now load all the keys, a few at a time. */
+	bzero(&load, sizeof (load));
+	VERIFY0(pthread_mutex_init(&load.rl_mtx, NULL));
+	load.rl_ds = list.rl_ds;
+	load.rl_n = list.rl_n;
+	nthr = list.rl_n;
+	if (nthr > RLOAD_MAX_THREADS)
+		nthr = RLOAD_MAX_THREADS;
+	for (i = 0; i < nthr; ++i)
+		VERIFY0(pthread_create(&thr[i], NULL, rload_worker, &load));
+	for (i = 0; i < nthr; ++i)
+		VERIFY0(pthread_join(thr[i], NULL));
+	VERIFY0(pthread_mutex_destroy(&load.rl_mtx));
+
+	for (i = 0; i < list.rl_n; ++i) {
+		rd = &list.rl_ds[i];
+		if (rd->rd_rc != 0) {
+			errno = rd->rd_rc;
+			warn("failed to load key material into ZFS for %s",
+			    rd->rd_name);
+			failed = B_TRUE;
+		} else {
+			fprintf(stderr, "Loaded key for %s\n", rd->rd_name);
+		}
+	}
+
+	/* As in cmd_unlock(), try to mount things if this was a whole pool. */
+	if (strchr(fsname, '/') == NULL) {
+		zpool_handle_t *pool;
+		pool = zpool_open_canfail(zfshdl, fsname);
+		if (pool != NULL) {
+			(void) zpool_enable_datasets(pool, NULL, 0);
+			zpool_close(pool);
+		}
+	}
+
+	for (i = 0; i < list.rl_n; ++i) {
+		rd = &list.rl_ds[i];
+		if (rd->rd_owner)
+			ebox_free(rd->rd_ebox);
+		free(rd->rd_name);
+		free(rd->rd_b64);
+	}
+	free(list.rl_ds);
+	sshbuf_free(buf);
+
+	if (failed)
+		exit(EXIT_ERROR);
+#endif
+}
+
 static void
 cmd_rekey(const char *fsname)
 {
@@ -434,9 +702,9 @@ newkey:
 	if (error)
 		errfx(EXIT_ERROR, error, "ebox_create failed");
 	sshbuf_reset(buf);
-	error = sshbuf_put_ebox(buf, nebox);
+	error = sshbuf_put_ebox_compact(buf, nebox);
 	if (error)
-		errfx(EXIT_ERROR, error, "sshbuf_put_ebox failed");
+		errfx(EXIT_ERROR, error, "sshbuf_put_ebox_compact failed");
 
 	b64 = sshbuf_dtob64(buf);
 
@@ -502,9 +770,9 @@ cmd_genopt(const char *cmd, const char *subcmd, const char *opt,
 	buf = sshbuf_new();
 	if (buf == NULL)
 		errx(EXIT_ERROR, "failed to allocate memory");
-	error = sshbuf_put_ebox(buf, ebox);
+	error = sshbuf_put_ebox_compact(buf, ebox);
 	if (error)
-		errfx(EXIT_ERROR, error, "sshbuf_put_ebox failed");
+		errfx(EXIT_ERROR, error, "sshbuf_put_ebox_compact failed");
 
 	b64 = sshbuf_dtob64(buf);
 	sshbuf_reset(buf);
@@ -559,7 +827,8 @@ usage(void)
 	    "  -t tplname              Specify ebox template name\n"
 	    "\n"
 	    "Available operations:\n"
-	    "  unlock <zfs>            Unlock an encrypted ZFS filesystem\n"
+	    "  unlock [-r] <zfs>       Unlock an encrypted ZFS filesystem\n"
+	    "                          (-r: and all of its descendants)\n"
 	    "  zfs-create -- <args>    Run 'zfs create' with arguments and\n"
 	    "                          input transformed to provide keys for\n"
 	    "                          encryption.\n"
@@ -578,8 +847,9 @@ main(int argc, char *argv[])
 	extern char *optarg;
 	extern int optind;
 	int c;
-	const char *optstring = "t:d";
+	const char *optstring = "t:dr";
 	const char *tpl = NULL;
+	boolean_t recursive = B_FALSE;
 
 	qa_term_setup();
 
@@ -594,6 +864,9 @@ main(int argc, char *argv[])
 		case 't':
 			tpl = optarg;
 			break;
+		case 'r':
+			recursive = B_TRUE;
+			break;
 		}
 	}
 
@@ -612,6 +885,10 @@ main(int argc, char *argv[])
 	if (strcmp(op, "unlock") == 0) {
 		const char *fsname;
 
+		if (optind < argc && strcmp(argv[optind], "-r") == 0) {
+			recursive = B_TRUE;
+			++optind;
+		}
 		if (optind >= argc) {
 			warnx("target zfs required");
 			usage();
@@ -623,7 +900,10 @@ main(int argc, char *argv[])
 			usage();
 		}
 
-		cmd_unlock(fsname);
+		if (recursive)
+			cmd_unlock_recursive(fsname);
+		else
+			cmd_unlock(fsname);
 
 	} else if (strcmp(op, "rekey") == 0) {
 		const char *fsname;
@@ -15,6 +15,14 @@
  *
  * All functions in this module are implemented constant time and constant
  * lookup operations, as all proper crypto code must be.
+ *
+ * On top of the bitslicing, the field arithmetic works on SSS_LANES
+ * independent values at once (one per lane of a GCC vector type), so that
+ * several shares are computed (or several Lagrange basis polynomials
+ * evaluated) in a single instruction stream. The compiler turns the vector
+ * operations into whatever SIMD the target has (SSE2, NEON, ...), and where
+ * ifuncs are available the two entry points are also built for AVX2 and
+ * picked at runtime.
  */
 
 
@@ -24,6 +32,22 @@
 #include <string.h>
 
 
+#define SSS_LANES 8
+
+typedef uint32_t gf256_v __attribute__((vector_size(4 * SSS_LANES)));
+
+#define GF256_INLINE static inline __attribute__((always_inline))
+
+#if defined(__x86_64__) && defined(__GLIBC__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define SSS_MULTIVERSION __attribute__((target_clones("avx2", "default")))
+#endif
+#endif
+#if !defined(SSS_MULTIVERSION)
+#define SSS_MULTIVERSION
+#endif
+
+
 typedef struct {
 	uint8_t x;
 	uint8_t y;
@@ -72,11 +96,46 @@ bitslice_setall(uint32_t r[8], const uint8_t x)
 }
 
 
+/*
+ * Set every lane of `r` to the bitsliced value `x`.
+ */
+GF256_INLINE void
+gf256_broadcast(gf256_v r[8], const uint32_t x[8])
+{
+	size_t idx;
+	for (idx = 0; idx < 8; idx++) r[idx] = (gf256_v){0} + x[idx];
+}
+
+
+/*
+ * Set lane `lane` of `r` to the bitsliced value `x`.
+ */
+GF256_INLINE void
+gf256_set_lane(gf256_v r[8], size_t lane, const uint32_t x[8])
+{
+	size_t idx;
+	for (idx = 0; idx < 8; idx++) r[idx][lane] = x[idx];
+}
+
+
+/*
+ * Set `r` to 1 in the lanes where `mask` is all ones. `mask` must be
+ * all ones or all zeroes in each lane.
+ */
+GF256_INLINE void
+gf256_select_one(gf256_v r[8], const gf256_v *mask)
+{
+	size_t idx;
+	r[0] |= *mask;
+	for (idx = 1; idx < 8; idx++) r[idx] &= ~*mask;
+}
+
+
 /*
  * Add (XOR) `r` with `x` and store the result in `r`.
  */
-static void
-gf256_add(uint32_t r[8], const uint32_t x[8])
+GF256_INLINE void
+gf256_add(gf256_v r[8], const gf256_v x[8])
 {
 	size_t idx;
 	for (idx = 0; idx < 8; idx++) r[idx] ^= x[idx];
@@ -89,8 +148,8 @@ gf256_add(uint32_t r[8], const uint32_t x[8])
  * and `b` will produce an incorrect result! If you need to square a polynomial
  * use `gf256_square` instead.
  */
-static void
-gf256_mul(uint32_t r[8], const uint32_t a[8], const uint32_t b[8])
+GF256_INLINE void
+gf256_mul(gf256_v r[8], const gf256_v a[8], const gf256_v b[8])
 {
 	/* This function implements Russian Peasant multiplication on two
 	 * bitsliced polynomials.
@@ -101,8 +160,8 @@ gf256_mul(uint32_t r[8], const uint32_t a[8], const uint32_t b[8])
 	 * However, some compilers seem to fail in optimizing these kinds of
 	 * loops. So we will just have to do this by hand.
 	 */
-	uint32_t a2[8];
-	memcpy(a2, a, sizeof(uint32_t[8]));
+	gf256_v a2[8];
+	memcpy(a2, a, sizeof(gf256_v[8]));
 
 	r[0] = a2[0] & b[0]; /* add (assignment, because r is 0) */
 	r[1] = a2[1] & b[0];
@@ -202,10 +261,10 @@ gf256_mul(uint32_t r[8], const uint32_t a[8], const uint32_t b[8])
 /*
  * Square `x` in GF(2^8) and write the result to `r`. `r` and `x` may overlap.
  */
-static void
-gf256_square(uint32_t r[8], const uint32_t x[8])
+GF256_INLINE void
+gf256_square(gf256_v r[8], const gf256_v x[8])
 {
-	uint32_t r8, r10, r12, r14;
+	gf256_v r8, r10, r12, r14;
 	/* Use the Freshman's Dream rule to square the polynomial
 	 * Assignments are done from 7 downto 0, because this allows the user
 	 * to execute this function in-place (e.g. `gf256_square(r, r);`).
@@ -247,10 +306,10 @@ gf256_square(uint32_t r[8], const uint32_t x[8])
 /*
  * Invert `x` in GF(2^8) and write the result to `r`
  */
-static void
-gf256_inv(uint32_t r[8], uint32_t x[8])
+GF256_INLINE void
+gf256_inv(gf256_v r[8], const gf256_v x[8])
 {
-	uint32_t y[8], z[8];
+	gf256_v y[8], z[8];
 
 	gf256_square(y, x); // y = x^2
 	gf256_square(y, y); // y = x^4
@@ -271,19 +330,21 @@ gf256_inv(uint32_t r[8], uint32_t x[8])
  * that the array `out` has enough space to hold at least `n` sss_Keyshare
  * structs.
  */
- void
- sss_create_keyshares(sss_Keyshare *out,
-                      const uint8_t key[32],
-                      uint8_t n,
-                      uint8_t k)
+SSS_MULTIVERSION void
+sss_create_keyshares(sss_Keyshare *out,
+                     const uint8_t key[32],
+                     uint8_t n,
+                     uint8_t k)
 {
 	/* Check if the parameters are valid */
 	assert(n != 0);
 	assert(k != 0);
 	assert(k <= n);
 
-	uint8_t share_idx, coeff_idx, unbitsliced_x;
-	uint32_t poly0[8], poly[k-1][8], x[8], y[8], xpow[8], tmp[8];
+	size_t share_idx, lane, idx;
+	int coeff_idx;
+	uint32_t poly0[8], poly[k-1][8], tmp[8];
+	gf256_v x[8], y[8], coeff[8];
 
 	/* Put the secret in the bottom part of the polynomial */
 	bitslice(poly0, key);
@@ -291,23 +352,30 @@ gf256_inv(uint32_t r[8], uint32_t x[8])
 	/* Generate the other terms of the polynomial */
 	randombytes((void*) poly, sizeof(poly));
 
-	for (share_idx = 0; share_idx < n; share_idx++) {
-		/* x value is in 1..n */
-		unbitsliced_x = share_idx + 1;
-		out[share_idx][0] = unbitsliced_x;
-		bitslice_setall(x, unbitsliced_x);
-
-		/* Calculate y */
-		memset(y, 0, sizeof(y));
-		memset(xpow, 0, sizeof(xpow));
-		xpow[0] = ~0;
-		gf256_add(y, poly0);
-		for (coeff_idx = 0; coeff_idx < (k-1); coeff_idx++) {
-			gf256_mul(xpow, xpow, x);
-			gf256_mul(tmp, xpow, poly[coeff_idx]);
-			gf256_add(y, tmp);
+	/* Do SSS_LANES shares at a time, one in each lane */
+	for (share_idx = 0; share_idx < n; share_idx += SSS_LANES) {
+		/* x value is in 1..n (and past n in lanes we won't use) */
+		for (lane = 0; lane < SSS_LANES; lane++) {
+			bitslice_setall(tmp, (uint8_t) (share_idx + lane + 1));
+			gf256_set_lane(x, lane, tmp);
+		}
+
+		/* Calculate y by Horner's rule, starting at the top term */
+		gf256_broadcast(y, k > 1 ? poly[k-2] : poly0);
+		for (coeff_idx = (int) k - 3; coeff_idx >= -1; coeff_idx--) {
+			gf256_mul(y, y, x);
+			gf256_broadcast(coeff,
+			    coeff_idx >= 0 ? poly[coeff_idx] : poly0);
+			gf256_add(y, coeff);
+		}
+
+		for (lane = 0; lane < SSS_LANES && share_idx + lane < n;
+		    lane++) {
+			out[share_idx + lane][0] =
+			    (uint8_t) (share_idx + lane + 1);
+			for (idx = 0; idx < 8; idx++) tmp[idx] = y[idx][lane];
+			unbitslice(&out[share_idx + lane][1], tmp);
 		}
-		unbitslice(&out[share_idx][1], y);
 	}
 }
 
@@ -316,38 +384,65 @@ gf256_inv(uint32_t r[8], uint32_t x[8])
  * Restore the `k` sss_Keyshare structs given in `shares` and write the result
  * to `key`.
  */
- void sss_combine_keyshares(uint8_t key[32],
-                            const sss_Keyshare *key_shares,
-                            uint8_t k)
+SSS_MULTIVERSION void
+sss_combine_keyshares(uint8_t key[32],
+                      const sss_Keyshare *key_shares,
+                      uint8_t k)
 {
-	size_t share_idx, idx1, idx2;
-	uint32_t xs[k][8], ys[k][8];
-	uint32_t num[8], denom[8], tmp[8];
+	size_t share_idx, idx1, idx2, lane, idx;
+	uint32_t xs[k][8], tmp1[8];
+	gf256_v xi[8], yi[8], num[8], denom[8], fac[8], tmp[8];
+	gf256_v secret_v[8] = {{0}};
+	gf256_v skip;
 	uint32_t secret[8] = {0};
 
-	/* Collect the x and y values */
+	/* Collect the x values */
 	for (share_idx = 0; share_idx < k; share_idx++) {
 		bitslice_setall(xs[share_idx], key_shares[share_idx][0]);
-		bitslice(ys[share_idx], &key_shares[share_idx][1]);
 	}
 
-	/* Use Lagrange basis polynomials to calculate the secret coefficient */
-	for (idx1 = 0; idx1 < k; idx1++) {
+	/*
+	 * Use Lagrange basis polynomials to calculate the secret coefficient,
+	 * doing the basis polynomials for SSS_LANES shares at a time.
+	 */
+	for (idx1 = 0; idx1 < k; idx1 += SSS_LANES) {
+		/* Lanes past the last share have y = 0, so add nothing */
+		memset(xi, 0, sizeof(xi));
+		memset(yi, 0, sizeof(yi));
+		for (lane = 0; lane < SSS_LANES && idx1 + lane < k; lane++) {
+			gf256_set_lane(xi, lane, xs[idx1 + lane]);
+			bitslice(tmp1, &key_shares[idx1 + lane][1]);
+			gf256_set_lane(yi, lane, tmp1);
+		}
+
 		memset(num, 0, sizeof(num));
 		memset(denom, 0, sizeof(denom));
-		num[0] = ~0; /* num is the numerator (=1) */
-		denom[0] = ~0; /* denom is the numerator (=1) */
+		num[0] = ~(gf256_v){0}; /* num is the numerator (=1) */
+		denom[0] = ~(gf256_v){0}; /* denom is the numerator (=1) */
 		for (idx2 = 0; idx2 < k; idx2++) {
-			if (idx1 == idx2) continue;
-			gf256_mul(num, num, xs[idx2]);
-			memcpy(tmp, xs[idx1], sizeof(uint32_t[8]));
-			gf256_add(tmp, xs[idx2]);
+			/* The lane (if any) for share idx2 multiplies by 1 */
+			skip = (gf256_v){0};
+			if (idx2 >= idx1 && idx2 < idx1 + SSS_LANES)
+				skip[idx2 - idx1] = ~0;
+
+			gf256_broadcast(fac, xs[idx2]);
+			memcpy(tmp, xi, sizeof(tmp));
+			gf256_add(tmp, fac);
+			gf256_select_one(fac, &skip);
+			gf256_select_one(tmp, &skip);
+			gf256_mul(num, num, fac);
 			gf256_mul(denom, denom, tmp);
 		}
 		gf256_inv(tmp, denom); /* inverted denominator */
 		gf256_mul(num, num, tmp); /* basis polynomial */
-		gf256_mul(num, num, ys[idx1]); /* scaled coefficient */
-		gf256_add(secret, num);
+		gf256_mul(num, num, yi); /* scaled coefficient */
+		gf256_add(secret_v, num);
+	}
+
+	/* Add up the lanes */
+	for (idx = 0; idx < 8; idx++) {
+		for (lane = 0; lane < SSS_LANES; lane++)
+			secret[idx] ^= secret_v[idx][lane];
 	}
 	unbitslice(key, secret);
 }
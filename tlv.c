@@ -24,17 +24,17 @@ enum tlv_tag_bits {
 	TLV_TAG_CONT = 0xFF & TLV_TAG_MASK,
 };
 
+/* Initial space we reserve in an sshbuf for tlv_init_write_sshbuf(). */
+#define	TLV_SSHBUF_CHUNK	256
+
 struct tlv_state *
-tlv_init(const uint8_t *buf, size_t offset, size_t len)
+tlv_init_at(struct tlv_state *ts, const uint8_t *buf, size_t offset,
+    size_t len)
 {
-	struct tlv_state *ts = calloc(1, sizeof (struct tlv_state));
-	if (ts == NULL)
-		return (NULL);
-	struct tlv_context *tc = calloc(1, sizeof (struct tlv_context));
-	if (tc == NULL) {
-		free(ts);
-		return (NULL);
-	}
+	struct tlv_context *tc;
+
+	bzero(ts, sizeof (struct tlv_state));
+	tc = &ts->ts_ctx[0];
 	ts->ts_root = tc;
 	ts->ts_now = tc;
 
@@ -46,44 +46,127 @@ tlv_init(const uint8_t *buf, size_t offset, size_t len)
 	return (ts);
 }
 
+struct tlv_state *
+tlv_init(const uint8_t *buf, size_t offset, size_t len)
+{
+	struct tlv_state *ts = calloc(1, sizeof (struct tlv_state));
+	if (ts == NULL)
+		return (NULL);
+	(void) tlv_init_at(ts, buf, offset, len);
+	ts->ts_freestate = B_TRUE;
+	return (ts);
+}
+
 void
 tlv_enable_debug(struct tlv_state *ts)
 {
 	ts->ts_debug = B_TRUE;
 }
 
+struct tlv_state *
+tlv_init_write_at(struct tlv_state *ts, uint8_t *buf, size_t len)
+{
+	return (tlv_init_at(ts, buf, 0, len));
+}
+
 struct tlv_state *
 tlv_init_write(void)
 {
-	struct tlv_state *ts = calloc(1, sizeof (struct tlv_state));
+	struct tlv_state *ts;
+	uint8_t *buf;
+
+	ts = calloc(1, sizeof (struct tlv_state));
 	if (ts == NULL)
 		return (NULL);
-	struct tlv_context *tc = calloc(1, sizeof (struct tlv_context));
-	if (tc == NULL) {
+	buf = calloc(1, MAX_APDU_SIZE);
+	if (buf == NULL) {
 		free(ts);
 		return (NULL);
 	}
-	ts->ts_root = tc;
-	ts->ts_now = tc;
+	(void) tlv_init_write_at(ts, buf, MAX_APDU_SIZE);
+	ts->ts_freebuf = B_TRUE;
+	ts->ts_freestate = B_TRUE;
+	return (ts);
+}
 
-	ts->ts_buf = calloc(1, MAX_APDU_SIZE);
-	if (ts->ts_buf == NULL) {
-		free(ts);
-		free(tc);
+/*
+ * In sshbuf mode the buffer is kept grown to cover the root context; we trim
+ * off whatever wasn't used in tlv_free().
+ */
+static boolean_t
+tlv_sshbuf_grow(struct tlv_state *ts, size_t len)
+{
+	u_char *p;
+
+	if (sshbuf_reserve(ts->ts_sbuf, len, &p) != 0)
+		return (B_FALSE);
+	ts->ts_buf = sshbuf_mutable_ptr(ts->ts_sbuf) + ts->ts_sbase;
+	ts->ts_root->tc_end += len;
+	return (B_TRUE);
+}
+
+struct tlv_state *
+tlv_init_write_sshbuf(struct tlv_state *ts, struct sshbuf *buf)
+{
+	(void) tlv_init_at(ts, NULL, 0, 0);
+	ts->ts_sbuf = buf;
+	ts->ts_sbase = sshbuf_len(buf);
+	if (!tlv_sshbuf_grow(ts, TLV_SSHBUF_CHUNK))
 		return (NULL);
-	}
-	ts->ts_freebuf = B_TRUE;
-	tc->tc_end = MAX_APDU_SIZE;
 	return (ts);
 }
 
+/* Makes sure there's room to write len more bytes. */
+static void
+tlv_wreserve(struct tlv_state *ts, size_t len)
+{
+	size_t want, cur;
+
+	if (ts->ts_sbuf != NULL && tlv_root_rem(ts) < len) {
+		cur = ts->ts_root->tc_end;
+		want = len - tlv_root_rem(ts);
+		if (want < cur)
+			want = cur;
+		VERIFY(tlv_sshbuf_grow(ts, want));
+	}
+	VERIFY3U(tlv_root_rem(ts), >=, len);
+}
+
 const uint8_t TLV_CONT = (1 << 7);
 
+/*
+ * Contexts are strictly LIFO, so the one at depth n can always use slot n of
+ * ts_ctx (if there is one).
+ */
+static struct tlv_context *
+tlv_ctx_alloc(struct tlv_state *ts)
+{
+	const int depth = ts->ts_now->tc_depth + 1;
+	struct tlv_context *tc;
+
+	if (depth < TLV_INLINE_DEPTH) {
+		tc = &ts->ts_ctx[depth];
+		bzero(tc, sizeof (struct tlv_context));
+	} else {
+		tc = calloc(1, sizeof (struct tlv_context));
+		if (tc == NULL)
+			return (NULL);
+	}
+	tc->tc_depth = depth;
+	return (tc);
+}
+
+static void
+tlv_ctx_free(struct tlv_context *tc)
+{
+	if (tc->tc_depth >= TLV_INLINE_DEPTH)
+		free(tc);
+}
+
 static void
 tlv_ctx_push(struct tlv_state *ts, struct tlv_context *tc)
 {
 	tc->tc_next = ts->ts_now;
-	tc->tc_depth = ts->ts_now->tc_depth + 1;
 	ts->ts_now = tc;
 }
 
@@ -99,13 +182,15 @@ tlv_ctx_pop(struct tlv_state *ts)
 void
 tlv_pushl(struct tlv_state *ts, uint tag, size_t maxlen)
 {
-	uint8_t *buf = ts->ts_buf;
+	uint8_t *buf;
 	struct tlv_context *tc;
 
-	tc = calloc(1, sizeof (struct tlv_context));
+	tc = tlv_ctx_alloc(ts);
 	VERIFY(tc != NULL);
 
 	tlv_write_u8to32(ts, tag);
+	tlv_wreserve(ts, tlv_len_size(maxlen));
+	buf = ts->ts_buf;
 
 	tc->tc_lenptr = ts->ts_pos;
 
@@ -128,6 +213,64 @@ tlv_pushl(struct tlv_state *ts, uint tag, size_t maxlen)
 	tlv_ctx_push(ts, tc);
 }
 
+size_t
+tlv_tag_size(uint tag)
+{
+	size_t n = 4;
+
+	/* Matches what tlv_write_u8to32() will actually write. */
+	while (n > 0 && ((tag >> ((n - 1) * 8)) & 0xFF) == 0)
+		--n;
+	return (n);
+}
+
+size_t
+tlv_len_size(size_t len)
+{
+	if (len < (1 << 7))
+		return (1);
+	else if (len < (1 << 8))
+		return (2);
+	else if (len < (1 << 16))
+		return (3);
+	VERIFY3U(len, <, (1 << 24));
+	return (4);
+}
+
+/*
+ * tlv_pushl() picks the shortest length encoding which fits len, and it's
+ * filled in right away. Write contexts don't otherwise use tc_end, so we set
+ * it to mark this tag as fixed-length for tlv_pop().
+ */
+void
+tlv_pushlen(struct tlv_state *ts, uint tag, size_t len)
+{
+	struct tlv_context *tc;
+	uint8_t *buf;
+
+	tlv_pushl(ts, tag, len);
+	tc = ts->ts_now;
+	buf = ts->ts_buf;
+	switch (buf[tc->tc_lenptr]) {
+	case 0x83:
+		buf[tc->tc_lenptr + 1] = (len & 0xFF0000) >> 16;
+		buf[tc->tc_lenptr + 2] = (len & 0x00FF00) >> 8;
+		buf[tc->tc_lenptr + 3] = (len & 0x0000FF);
+		break;
+	case 0x82:
+		buf[tc->tc_lenptr + 1] = (len & 0xFF00) >> 8;
+		buf[tc->tc_lenptr + 2] = (len & 0x00FF);
+		break;
+	case 0x81:
+		buf[tc->tc_lenptr + 1] = len;
+		break;
+	default:
+		buf[tc->tc_lenptr] = len;
+	}
+	tc->tc_end = tc->tc_begin + len;
+	tlv_wreserve(ts, len);
+}
+
 void
 tlv_pop(struct tlv_state *ts)
 {
@@ -135,6 +278,12 @@ tlv_pop(struct tlv_state *ts)
 	struct tlv_context *tc = tlv_ctx_pop(ts);
 	size_t len = (ts->ts_pos - tc->tc_begin);
 
+	if (tc->tc_end != 0) {
+		VERIFY3U(ts->ts_pos, ==, tc->tc_end);
+		tlv_ctx_free(tc);
+		return;
+	}
+
 	if (buf[tc->tc_lenptr] == 0x00) {
 		VERIFY3U(len, <, (1 << 7));
 		buf[tc->tc_lenptr] = len;
@@ -152,7 +301,7 @@ tlv_pop(struct tlv_state *ts)
 		buf[tc->tc_lenptr + 3] = (len & 0x0000FF);
 	}
 
-	free(tc);
+	tlv_ctx_free(tc);
 }
 
 errf_t *
@@ -166,14 +315,14 @@ tlv_read_tag(struct tlv_state *ts, uint *ptag)
 	size_t origin = ts->ts_pos;
 	errf_t *error;
 
-	tc = calloc(1, sizeof (struct tlv_context));
+	tc = tlv_ctx_alloc(ts);
 	if (tc == NULL)
 		return (ERRF_NOMEM);
 
 	if (tlv_at_end(ts)) {
 		error = errf("LengthError", NULL, "tlv_read_tag called "
 		    "past end of context");
-		free(tc);
+		tlv_ctx_free(tc);
 		return (error);
 	}
 	d = buf[ts->ts_pos++];
@@ -184,7 +333,7 @@ tlv_read_tag(struct tlv_state *ts, uint *ptag)
 			if (tlv_at_end(ts)) {
 				error = errf("LengthError", NULL, "TLV tag "
 				    "continued past end of context");
-				free(tc);
+				tlv_ctx_free(tc);
 				return (error);
 			}
 			d = buf[ts->ts_pos++];
@@ -198,7 +347,7 @@ tlv_read_tag(struct tlv_state *ts, uint *ptag)
 	if (tlv_at_end(ts)) {
 		error = errf("LengthError", NULL, "TLV tag length continued "
 		    "past end of context");
-		free(tc);
+		tlv_ctx_free(tc);
 		return (error);
 	}
 	d = buf[ts->ts_pos++];
@@ -207,14 +356,14 @@ tlv_read_tag(struct tlv_state *ts, uint *ptag)
 		if (octs < 1 || octs > 4) {
 			error = errf("LengthError", NULL, "TLV tag had invalid "
 			    "length indicator: %d octets", octs);
-			free(tc);
+			tlv_ctx_free(tc);
 			return (error);
 		}
 		len = 0;
 		if (tlv_rem(ts) < octs) {
 			error = errf("LengthError", NULL, "TLV tag length "
 			    "bytes continued past end of context");
-			free(tc);
+			tlv_ctx_free(tc);
 			return (error);
 		}
 		for (; octs > 0; --octs) {
@@ -228,13 +377,13 @@ tlv_read_tag(struct tlv_state *ts, uint *ptag)
 	if (tlv_root_rem(ts) < len) {
 		error = errf("LengthError", NULL, "TLV tag length is too "
 		    "long for buffer: %zu", len);
-		free(tc);
+		tlv_ctx_free(tc);
 		return (error);
 	}
 	if (tlv_rem(ts) < len) {
 		error = errf("LengthError", NULL, "TLV tag length is too "
 		    "long for enclosing tag: %zu", len);
-		free(tc);
+		tlv_ctx_free(tc);
 		return (error);
 	}
 
@@ -265,7 +414,7 @@ tlv_end(struct tlv_state *ts)
 		return (errf("LengthError", NULL, "tlv_end() called at +%zu "
 		    "but tag ends at +%zu", ts->ts_pos, tc->tc_end));
 	}
-	free(tc);
+	tlv_ctx_free(tc);
 	return (NULL);
 }
 
@@ -280,7 +429,7 @@ tlv_skip(struct tlv_state *ts)
 	VERIFY3U(ts->ts_pos, >=, tc->tc_begin);
 	VERIFY3U(ts->ts_pos, <=, tc->tc_end);
 	ts->ts_pos = tc->tc_end;
-	free(tc);
+	tlv_ctx_free(tc);
 }
 
 void
@@ -292,7 +441,7 @@ tlv_abort(struct tlv_state *ts)
 		tc = tc->tc_next;
 		VERIFY3U(ts->ts_pos, >=, tc->tc_begin);
 		VERIFY3U(ts->ts_pos, <=, tc->tc_end);
-		free(tofree);
+		tlv_ctx_free(tofree);
 	}
 	ts->ts_now = ts->ts_root;
 	ts->ts_pos = ts->ts_root->tc_end;
@@ -425,22 +574,38 @@ tlv_free(struct tlv_state *ts)
 		    root->tc_end - root->tc_begin);
 		free(ts->ts_buf);
 	}
-	free(root);
-	free(ts);
+	if (ts->ts_sbuf != NULL) {
+		VERIFY0(sshbuf_consume_end(ts->ts_sbuf,
+		    root->tc_end - ts->ts_pos));
+		ts->ts_sbuf = NULL;
+	}
+	if (ts->ts_freestate)
+		free(ts);
 }
 
 void
 tlv_write(struct tlv_state *ts, const uint8_t *src, size_t len)
 {
-	VERIFY3U(tlv_root_rem(ts), >=, len);
+	tlv_wreserve(ts, len);
 	bcopy(src, &ts->ts_buf[ts->ts_pos], len);
 	ts->ts_pos += len;
 }
 
+uint8_t *
+tlv_write_ptr(struct tlv_state *ts, size_t len)
+{
+	uint8_t *p;
+
+	tlv_wreserve(ts, len);
+	p = &ts->ts_buf[ts->ts_pos];
+	ts->ts_pos += len;
+	return (p);
+}
+
 void
 tlv_write_u8to32(struct tlv_state *ts, uint32_t val)
 {
-	uint8_t *buf = ts->ts_buf;
+	uint8_t *buf;
 	uint32_t mask = 0xFF << 24;
 	int shift = 24;
 	uint32_t part;
@@ -454,6 +619,8 @@ tlv_write_u8to32(struct tlv_state *ts, uint32_t val)
 		shift -= 8;
 	}
 	/* And then write out the rest. */
+	tlv_wreserve(ts, (shift / 8) + 1);
+	buf = ts->ts_buf;
 	while (shift >= 0) {
 		part = (val & mask) >> shift;
 		VERIFY(!tlv_at_root_end(ts));
@@ -466,6 +633,6 @@ tlv_write_u8to32(struct tlv_state *ts, uint32_t val)
 void
 tlv_write_byte(struct tlv_state *ts, uint8_t val)
 {
-	VERIFY(!tlv_at_root_end(ts));
+	tlv_wreserve(ts, 1);
 	ts->ts_buf[ts->ts_pos++] = val;
 }
@@ -18,6 +18,8 @@
 
 #define	MAX_APDU_SIZE	16384
 
+struct sshbuf;
+
 /*
  * This is a parser and generator for ISO7816 BER-TLV, a limited subset of
  * ASN.1 BER used by ISO7816 compliant smartcards.
@@ -44,13 +46,24 @@ struct tlv_context {
 	int tc_depth;		/* root = 0, tag = 1, child tag = 2, etc */
 };
 
+/*
+ * Contexts down to this depth (counting the root) live inside the tlv_state
+ * itself, so parsing or generating anything nested less deeply than this
+ * doesn't allocate. Deeper ones are calloc'd.
+ */
+#define	TLV_INLINE_DEPTH	8
+
 struct tlv_state {
 	struct tlv_context *ts_root;	/* top-level ctx spanning whole buf */
 	struct tlv_context *ts_now;	/* current tag ctx */
 	uint8_t *ts_buf;
 	size_t ts_pos;
 	boolean_t ts_freebuf;		/* if B_TRUE we malloc'd the buffer */
+	boolean_t ts_freestate;		/* if B_TRUE we malloc'd the tlv_state */
 	boolean_t ts_debug;
+	struct sshbuf *ts_sbuf;		/* growable write target (or NULL) */
+	size_t ts_sbase;		/* offset of ts_buf in ts_sbuf */
+	struct tlv_context ts_ctx[TLV_INLINE_DEPTH];
 };
 
 /*
@@ -59,6 +72,12 @@ struct tlv_state {
  * of the buffer).
  */
 struct tlv_state *tlv_init(const uint8_t *buf, size_t offset, size_t len);
+/*
+ * The same as tlv_init(), but sets up a tlv_state provided by the caller
+ * (e.g. on the stack), and returns it. Still call tlv_free() on it when done.
+ */
+struct tlv_state *tlv_init_at(struct tlv_state *ts, const uint8_t *buf,
+    size_t offset, size_t len);
 void tlv_free(struct tlv_state *ts);
 
 void tlv_enable_debug(struct tlv_state *ts);
@@ -163,10 +182,52 @@ tlv_ptr(const struct tlv_state *ts)
 
 /* Begins a write-mode BER-TLV generator with an internal buffer. */
 struct tlv_state *tlv_init_write(void);
+/*
+ * Begins a write-mode generator in a caller-provided tlv_state, writing into
+ * the len bytes at buf (running off the end of it is a programming error,
+ * like with tlv_init_write()). Returns ts.
+ */
+struct tlv_state *tlv_init_write_at(struct tlv_state *ts, uint8_t *buf,
+    size_t len);
+/*
+ * Begins a write-mode generator in a caller-provided tlv_state which appends
+ * to buf, growing it as needed. The data written only becomes the real
+ * contents of buf once tlv_free() is called. Returns NULL if buf can't be
+ * grown to hold the first bytes.
+ */
+struct tlv_state *tlv_init_write_sshbuf(struct tlv_state *ts,
+    struct sshbuf *buf);
 
 void tlv_pushl(struct tlv_state *ts, uint tag, size_t maxlen);
 void tlv_pop(struct tlv_state *ts);
 
+/*
+ * For building a TLV in two passes: first add up the tlv_size() of
+ * everything that's going to be written, then allocate exactly that much
+ * (e.g. for tlv_init_write_at()) and write it out.
+ *
+ * tlv_pushlen() begins a tag whose contents will be exactly len bytes long,
+ * so its final length is written out straight away and space for the
+ * contents is reserved up front. tlv_pop() checks that len bytes were
+ * actually written.
+ */
+size_t tlv_tag_size(uint tag);
+size_t tlv_len_size(size_t len);
+void tlv_pushlen(struct tlv_state *ts, uint tag, size_t len);
+
+static inline size_t
+tlv_size(uint tag, size_t len)
+{
+	return (tlv_tag_size(tag) + tlv_len_size(len) + len);
+}
+
+/*
+ * Reserves the next len bytes of the current tag and returns a pointer to
+ * them, for functions which want to produce their output in place rather
+ * than via tlv_write() from some other buffer.
+ */
+uint8_t *tlv_write_ptr(struct tlv_state *ts, size_t len);
+
 void tlv_write(struct tlv_state *ts, const uint8_t *src, size_t len);
 void tlv_write_u8to32(struct tlv_state *ts, uint32_t val);
 void tlv_write_byte(struct tlv_state *ts, uint8_t val);
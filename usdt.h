@@ -0,0 +1,62 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2026, Joyent Inc
+ */
+
+#if !defined(_USDT_H)
+#define	_USDT_H
+
+/*
+ * Static user-level tracing probes (USDT), under the provider "pivy".
+ *
+ * Built with "make USE_USDT=yes" (which needs <sys/sdt.h>, from e.g.
+ * systemtap-sdt-dev on Linux), each probe site is a single nop plus an ELF
+ * note describing it, which DTrace, SystemTap or bpftrace patch when they
+ * enable the probe. Otherwise the PIVY_PROBE macros expand to nothing at
+ * all. Either way the probes cost nothing while nobody is watching.
+ *
+ * Probes (double underscores become a dash under DTrace):
+ *
+ *   apdu__send(guid, ins, p1, p2, lc)        piv_apdu_transceive() before
+ *   apdu__recv(guid, ins, rv, sw, lr)        ...and after SCardTransmit
+ *   txn__begin(guid, reader, rv)             piv_txn_begin()
+ *   txn__end(guid, reader, rv)               piv_txn_end()
+ *   pin__verify__start(guid, type)           piv_verify_pin()
+ *   pin__verify__done(guid, type, ok)
+ *   agent__dispatch(socknum, type, seq)      process_message(), as each
+ *                                            request is handed to a card
+ *   agent__done(type, failed, usec)          ...and when it's answered
+ *   stream__encrypt__start(seqnr, len)       ebox_stream_encrypt_chunk()
+ *   stream__encrypt__done(seqnr, len)
+ *   stream__decrypt__start(seqnr, len)       ebox_stream_decrypt_chunk()
+ *   stream__decrypt__done(seqnr, len, ok)
+ *
+ * "guid" is a pointer to the 16-byte card GUID (copyin() it) and "reader" a
+ * C string. For example, to see APDU latency by instruction with bpftrace:
+ *
+ *   usdt:./pivy-agent:pivy:apdu__send { @s[tid] = nsecs; }
+ *   usdt:./pivy-agent:pivy:apdu__recv /@s[tid]/ {
+ *       @lat[arg1] = hist(nsecs - @s[tid]); delete(@s[tid]);
+ *   }
+ */
+
+#if defined(PIVY_USDT)
+
+#include <sys/sdt.h>
+
+#define	PIVY_PROBE2(n, a, b)		DTRACE_PROBE2(pivy, n, a, b)
+#define	PIVY_PROBE3(n, a, b, c)		DTRACE_PROBE3(pivy, n, a, b, c)
+#define	PIVY_PROBE5(n, a, b, c, d, e)	DTRACE_PROBE5(pivy, n, a, b, c, d, e)
+
+#else	/* !PIVY_USDT */
+
+#define	PIVY_PROBE2(n, a, b)
+#define	PIVY_PROBE3(n, a, b, c)
+#define	PIVY_PROBE5(n, a, b, c, d, e)
+
+#endif	/* PIVY_USDT */
+
+#endif	/* _USDT_H */
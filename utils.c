@@ -10,10 +10,15 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "utils.h"
 #include "debug.h"
 
+#if !defined(MAP_ANON)
+#define	MAP_ANON	MAP_ANONYMOUS
+#endif
+
 void
 set_no_dump(void *ptr, size_t size)
 {
@@ -40,10 +45,145 @@ calloc_conceal(size_t nmemb, size_t size)
 {
 	void *ptr = calloc(nmemb, size);
 	if (ptr != NULL)
-		set_no_dump(ptr, size);
+		set_no_dump(ptr, nmemb * size);
+	return (ptr);
+}
+
+/*
+ * The concealed arena behind zalloc_conceal(): a handful of regions which
+ * are mmap'd, locked and marked no-dump once, then carved into equal-sized
+ * slots (one size class per region, powers of two from 32 bytes up to 4k).
+ * Free slots are always zero, so allocation is just taking a bit out of the
+ * region's free bitmap. Anything which doesn't fit (or once we're out of
+ * regions) goes to calloc_conceal() instead.
+ */
+#define	CONCEAL_MIN_SHIFT	5
+#define	CONCEAL_CLASSES		8
+#define	CONCEAL_REGION_SIZE	(16 * 1024)
+#define	CONCEAL_MAX_REGIONS	32
+#define	CONCEAL_MAX_SLOTS	\
+    (CONCEAL_REGION_SIZE >> CONCEAL_MIN_SHIFT)
+
+struct conceal_region {
+	uint8_t		*cr_base;
+	uint		 cr_shift;	/* slot size is 1 << cr_shift */
+	uint		 cr_nfree;
+	uint64_t	 cr_free[CONCEAL_MAX_SLOTS / 64];	/* 1 = free */
+};
+
+static pthread_mutex_t conceal_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct conceal_region conceal_regions[CONCEAL_MAX_REGIONS];
+static uint conceal_nregions = 0;
+
+static struct conceal_region *
+conceal_region_new(uint shift)
+{
+	struct conceal_region *cr;
+	int flags = MAP_PRIVATE | MAP_ANON;
+	void *base;
+	uint nslots, i;
+
+	if (conceal_nregions >= CONCEAL_MAX_REGIONS)
+		return (NULL);
+#if defined(MAP_CONCEAL)
+	flags |= MAP_CONCEAL;
+#endif
+	base = mmap(NULL, CONCEAL_REGION_SIZE, PROT_READ | PROT_WRITE, flags,
+	    -1, 0);
+	if (base == MAP_FAILED)
+		return (NULL);
+	set_no_dump(base, CONCEAL_REGION_SIZE);
+
+	cr = &conceal_regions[conceal_nregions++];
+	cr->cr_base = base;
+	cr->cr_shift = shift;
+	nslots = CONCEAL_REGION_SIZE >> shift;
+	cr->cr_nfree = nslots;
+	bzero(cr->cr_free, sizeof (cr->cr_free));
+	for (i = 0; i < nslots; ++i)
+		cr->cr_free[i / 64] |= (1ULL << (i % 64));
+	return (cr);
+}
+
+static struct conceal_region *
+conceal_region_find(const void *ptr)
+{
+	const uint8_t *p = ptr;
+	uint i;
+
+	for (i = 0; i < conceal_nregions; ++i) {
+		struct conceal_region *cr = &conceal_regions[i];
+		if (p >= cr->cr_base && p < cr->cr_base + CONCEAL_REGION_SIZE)
+			return (cr);
+	}
+	return (NULL);
+}
+
+void *
+zalloc_conceal(size_t size)
+{
+	struct conceal_region *cr = NULL;
+	uint shift = CONCEAL_MIN_SHIFT;
+	uint i, w, bit;
+	void *ptr;
+
+	if (size == 0)
+		size = 1;
+	while (shift < CONCEAL_MIN_SHIFT + CONCEAL_CLASSES &&
+	    (1UL << shift) < size)
+		++shift;
+	if ((1UL << shift) < size)
+		return (calloc_conceal(1, size));
+
+	VERIFY0(pthread_mutex_lock(&conceal_mtx));
+	for (i = 0; i < conceal_nregions; ++i) {
+		if (conceal_regions[i].cr_shift == shift &&
+		    conceal_regions[i].cr_nfree > 0) {
+			cr = &conceal_regions[i];
+			break;
+		}
+	}
+	if (cr == NULL && (cr = conceal_region_new(shift)) == NULL) {
+		VERIFY0(pthread_mutex_unlock(&conceal_mtx));
+		return (calloc_conceal(1, size));
+	}
+	for (w = 0; cr->cr_free[w] == 0; ++w)
+		VERIFY3U(w + 1, <, CONCEAL_MAX_SLOTS / 64);
+	bit = __builtin_ctzll(cr->cr_free[w]);
+	cr->cr_free[w] &= ~(1ULL << bit);
+	--cr->cr_nfree;
+	ptr = cr->cr_base + (((size_t)w * 64 + bit) << shift);
+	VERIFY0(pthread_mutex_unlock(&conceal_mtx));
+
 	return (ptr);
 }
 
+void
+freezero_conceal(void *ptr, size_t size)
+{
+	struct conceal_region *cr;
+	size_t slot;
+
+	if (ptr == NULL)
+		return;
+
+	VERIFY0(pthread_mutex_lock(&conceal_mtx));
+	cr = conceal_region_find(ptr);
+	if (cr == NULL) {
+		VERIFY0(pthread_mutex_unlock(&conceal_mtx));
+		freezero(ptr, size);
+		return;
+	}
+	slot = ((uint8_t *)ptr - cr->cr_base) >> cr->cr_shift;
+	VERIFY3P(ptr, ==, cr->cr_base + (slot << cr->cr_shift));
+	VERIFY0(cr->cr_free[slot / 64] & (1ULL << (slot % 64)));
+	/* The whole slot, so that it's ready to hand out again. */
+	explicit_bzero(ptr, 1UL << cr->cr_shift);
+	cr->cr_free[slot / 64] |= (1ULL << (slot % 64));
+	++cr->cr_nfree;
+	VERIFY0(pthread_mutex_unlock(&conceal_mtx));
+}
+
 #if !defined(__OpenBSD__) && !defined(__sun)
 void
 freezero(void *ptr, size_t sz)
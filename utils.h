@@ -29,6 +29,16 @@ void *calloc_conceal(size_t nmemb, size_t size) __attribute__((malloc));
 
 void set_no_dump(void *ptr, size_t size);
 
+/*
+ * Zeroed memory for secrets, from a pool of slots which are already locked
+ * and excluded from core dumps (so there are no syscalls per allocation, as
+ * there are with malloc_conceal()). Must be released with freezero_conceal(),
+ * which also accepts memory from malloc() and friends (and then behaves like
+ * freezero()), so it's safe for buffers which might have come from either.
+ */
+void *zalloc_conceal(size_t size) __attribute__((malloc));
+void freezero_conceal(void *ptr, size_t size);
+
 #if !defined(__OpenBSD__) && !defined(__sun)
 void freezero(void *ptr, size_t size);
 #endif